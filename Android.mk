@@ -8,11 +8,14 @@ ifeq ($(TARGET_ARCH),arm)
 
 LOCAL_SRC_FILES := \
 	recovery.c \
+	recovery_log.c \
 	bootloader.c \
 	commands.c \
 	extendedcommand.c \
 	firmware.c \
+	hash_dir.c \
 	install.c \
+	nandroid.c \
 	roots.c \
 	ui.c \
 	verifier.c
@@ -24,7 +27,7 @@ LOCAL_MODULE := recovery
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 
 RECOVERY_VERSION := V6.6.2
-RECOVERY_API_VERSION := 2
+RECOVERY_API_VERSION := 3
 LOCAL_CFLAGS += -DRECOVERY_API_VERSION=$(RECOVERY_API_VERSION) -DRECOVERY_VERSION=$(RECOVERY_VERSION)
 
 # This binary is in the recovery ramdisk, which is otherwise a copy of root.
@@ -34,7 +37,7 @@ LOCAL_CFLAGS += -DRECOVERY_API_VERSION=$(RECOVERY_API_VERSION) -DRECOVERY_VERSIO
 
 LOCAL_MODULE_TAGS := eng
 
-LOCAL_STATIC_LIBRARIES := libminzip libunz libamend libmtdutils libmincrypt
+LOCAL_STATIC_LIBRARIES := libamend libminzip libz libmtdutils libmincrypt
 LOCAL_STATIC_LIBRARIES += libminui libpixelflinger_static libpng libcutils
 LOCAL_STATIC_LIBRARIES += libstdc++ libc
 
@@ -53,6 +56,23 @@ include $(BUILD_EXECUTABLE)
 # Depend on the generated keys.inc containing the OTA public keys.
 $(intermediates)/install.o: $(RECOVERY_INSTALL_OTA_KEYS_INC)
 
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	verifier_test.c \
+	verifier.c
+
+LOCAL_MODULE := verifier_test
+
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_STATIC_LIBRARIES := libminzip libmincrypt libz libcutils
+LOCAL_STATIC_LIBRARIES += libstdc++ libc
+
+include $(BUILD_EXECUTABLE)
+
 include $(commands_recovery_local_path)/minui/Android.mk
 include $(commands_recovery_local_path)/amend/Android.mk
 include $(commands_recovery_local_path)/minzip/Android.mk
@@ -61,6 +81,7 @@ include $(commands_recovery_local_path)/tools/Android.mk
 include $(commands_recovery_local_path)/edify/Android.mk
 include $(commands_recovery_local_path)/updater/Android.mk
 include $(commands_recovery_local_path)/applypatch/Android.mk
+include $(commands_recovery_local_path)/bench/Android.mk
 commands_recovery_local_path :=
 
 endif   # TARGET_ARCH == arm
@@ -29,8 +29,10 @@ LOCAL_SRC_FILES := \
 		$(amend_src_files) \
 		$(amend_test_files) \
 		register.c \
-		main.c
+		main.c \
+		../minzip/Hash.c
 
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
 LOCAL_CFLAGS := $(amend_cflags) -g -O0
 LOCAL_MODULE := amend
 LOCAL_MODULE_TAGS := optional
@@ -46,6 +48,7 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES := $(amend_src_files)
 LOCAL_SRC_FILES += $(amend_test_files)
 
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
 LOCAL_CFLAGS := $(amend_cflags)
 LOCAL_MODULE := libamend
 
@@ -16,6 +16,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include "minzip/Hash.h"
 #include "symtab.h"
 
 #define DEFAULT_TABLE_SIZE 16
@@ -26,12 +27,46 @@ typedef struct {
     unsigned int flags;
 } SymbolTableEntry;
 
+/* Entries are allocated one at a time and indexed by a hash of the
+ * symbol and flags, so lookups don't depend on the size of the table.
+ */
 struct SymbolTable {
-    SymbolTableEntry *table;
-    int numEntries;
-    int maxSize;
+    HashTable *hash;
 };
 
+static unsigned int
+hashSymbol(const char *symbol, unsigned int flags)
+{
+    const unsigned char *p = (const unsigned char *)symbol;
+    unsigned int hash = 2166136261u ^ flags;
+
+    while (*p != '\0') {
+        hash = (hash ^ *p++) * 16777619u;
+    }
+    return hash;
+}
+
+static int
+compareEntries(const void *tableItem, const void *looseItem)
+{
+    const SymbolTableEntry *a = (const SymbolTableEntry *)tableItem;
+    const SymbolTableEntry *b = (const SymbolTableEntry *)looseItem;
+
+    if (a->flags != b->flags) {
+        return a->flags < b->flags ? -1 : 1;
+    }
+    return strcmp(a->symbol, b->symbol);
+}
+
+static void
+freeEntry(void *item)
+{
+    SymbolTableEntry *entry = (SymbolTableEntry *)item;
+
+    free(entry->symbol);
+    free(entry);
+}
+
 SymbolTable *
 createSymbolTable()
 {
@@ -39,11 +74,8 @@ createSymbolTable()
 
     tab = (SymbolTable *)malloc(sizeof(SymbolTable));
     if (tab != NULL) {
-        tab->numEntries = 0;
-        tab->maxSize = DEFAULT_TABLE_SIZE;
-        tab->table = (SymbolTableEntry *)malloc(
-                            tab->maxSize * sizeof(SymbolTableEntry));
-        if (tab->table == NULL) {
+        tab->hash = mzHashTableCreate(DEFAULT_TABLE_SIZE, freeEntry);
+        if (tab->hash == NULL) {
             free(tab);
             tab = NULL;
         }
@@ -55,78 +87,63 @@ void
 deleteSymbolTable(SymbolTable *tab)
 {
     if (tab != NULL) {
-        while (tab->numEntries > 0) {
-            free(tab->table[--tab->numEntries].symbol);
-        }
-        free(tab->table);
+        mzHashTableFree(tab->hash);
+        free(tab);
     }
 }
 
 void *
 findInSymbolTable(SymbolTable *tab, const char *symbol, unsigned int flags)
 {
-    int i;
+    SymbolTableEntry key;
+    SymbolTableEntry *entry;
 
     if (tab == NULL || symbol == NULL) {
         return NULL;
     }
 
-    // TODO: Sort the table and binary search
-    for (i = 0; i < tab->numEntries; i++) {
-        if (strcmp(tab->table[i].symbol, symbol) == 0 &&
-                tab->table[i].flags == flags)
-        {
-            return (void *)tab->table[i].cookie;
-        }
+    key.symbol = (char *)symbol;
+    key.flags = flags;
+    entry = (SymbolTableEntry *)mzHashTableLookup(tab->hash,
+            hashSymbol(symbol, flags), &key, compareEntries, false);
+    if (entry == NULL) {
+        return NULL;
     }
-
-    return NULL;
+    return (void *)entry->cookie;
 }
 
 int
 addToSymbolTable(SymbolTable *tab, const char *symbol, unsigned int flags,
         const void *cookie)
 {
+    SymbolTableEntry *entry;
+    SymbolTableEntry *found;
+
     if (tab == NULL || symbol == NULL || cookie == NULL) {
         return -1;
     }
 
-    /* Make sure that this symbol isn't already in the table.
-     */
-    if (findInSymbolTable(tab, symbol, flags) != NULL) {
-        return -2;
+    entry = (SymbolTableEntry *)malloc(sizeof(SymbolTableEntry));
+    if (entry == NULL) {
+        return -1;
     }
-
-    /* Make sure there's enough space for the new entry.
-     */
-    if (tab->numEntries == tab->maxSize) {
-        SymbolTableEntry *newTable;
-        int newSize;
-
-        newSize = tab->numEntries * 2;
-        if (newSize < DEFAULT_TABLE_SIZE) {
-            newSize = DEFAULT_TABLE_SIZE;
-        }
-        newTable = (SymbolTableEntry *)realloc(tab->table,
-                            newSize * sizeof(SymbolTableEntry));
-        if (newTable == NULL) {
-            return -1;
-        }
-        tab->maxSize = newSize;
-        tab->table = newTable;
+    entry->symbol = strdup(symbol);
+    if (entry->symbol == NULL) {
+        free(entry);
+        return -1;
     }
+    entry->cookie = cookie;
+    entry->flags = flags;
 
-    /* Insert the new entry.
+    /* One lookup both checks that this symbol isn't already in the
+     * table and inserts it.
      */
-    symbol = strdup(symbol);
-    if (symbol == NULL) {
-        return -1;
+    found = (SymbolTableEntry *)mzHashTableLookup(tab->hash,
+            hashSymbol(symbol, flags), entry, compareEntries, true);
+    if (found != entry) {
+        freeEntry(entry);
+        return found == NULL ? -1 : -2;
     }
-    // TODO: Sort the table
-    tab->table[tab->numEntries].symbol = (char *)symbol;
-    tab->table[tab->numEntries].cookie = cookie;
-    tab->table[tab->numEntries].flags = flags;
-    tab->numEntries++;
 
     return 0;
 }
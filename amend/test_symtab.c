@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #undef NDEBUG
 #include <assert.h>
@@ -24,7 +25,9 @@ test_symtab()
 {
     SymbolTable *tab;
     void *cookie;
+    char name[16];
     int ret;
+    int i;
 
     /* Test creation */
     tab = createSymbolTable();
@@ -138,6 +141,24 @@ test_symtab()
     cookie = findInSymbolTable(tab, "one", 0);
     assert((int)cookie == 1);
 
+    /* Fill the table well past its initial size, so that it has to
+     * grow, and make sure everything can still be found.
+     */
+    for (i = 0; i < 1000; i++) {
+        sprintf(name, "sym%d", i);
+        ret = addToSymbolTable(tab, name, i % 3, (void *)(i + 100));
+        assert(ret == 0);
+    }
+    for (i = 0; i < 1000; i++) {
+        sprintf(name, "sym%d", i);
+        cookie = findInSymbolTable(tab, name, i % 3);
+        assert((int)cookie == i + 100);
+        cookie = findInSymbolTable(tab, name, (i + 1) % 3);
+        assert(cookie == NULL);
+    }
+    cookie = findInSymbolTable(tab, "one", 0);
+    assert((int)cookie == 1);
+
     /* Try deleting again, now that there's stuff in the table.
      */
     deleteSymbolTable(tab);
@@ -16,9 +16,12 @@
 
 #include <errno.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/types.h>
@@ -27,11 +30,14 @@
 
 #include "mincrypt/sha.h"
 #include "applypatch.h"
+#include "minzip/Budget.h"
+#include "minzip/Throughput.h"
 #include "mtdutils/mtdutils.h"
 #include "edify/expr.h"
 
 int SaveFileContents(const char* filename, FileContents file);
 int LoadMTDContents(const char* filename, FileContents* file);
+int CheckMTDContents(const char* filename, FileContents* file);
 int ParseSha1(const char* str, uint8_t* digest);
 ssize_t FileSink(unsigned char* data, ssize_t len, void* token);
 
@@ -41,6 +47,7 @@ static int mtd_partitions_scanned = 0;
 // *file.  Return 0 on success.
 int LoadFileContents(const char* filename, FileContents* file) {
     file->data = NULL;
+    file->mapped = 0;
 
     // A special 'filename' beginning with "MTD:" means to load the
     // contents of an MTD partition.
@@ -54,12 +61,12 @@ int LoadFileContents(const char* filename, FileContents* file) {
     }
 
     file->size = file->st.st_size;
-    file->data = malloc(file->size);
+    file->data = mzBudgetAlloc(file->size, 0);
 
     FILE* f = fopen(filename, "rb");
     if (f == NULL) {
         printf("failed to open \"%s\": %s\n", filename, strerror(errno));
-        free(file->data);
+        mzBudgetFree(file->data);
         file->data = NULL;
         return -1;
     }
@@ -68,13 +75,52 @@ int LoadFileContents(const char* filename, FileContents* file) {
     if (bytes_read != file->size) {
         printf("short read of \"%s\" (%ld bytes of %ld)\n",
                filename, (long)bytes_read, (long)file->size);
-        free(file->data);
+        mzBudgetFree(file->data);
         file->data = NULL;
         return -1;
     }
     fclose(f);
 
-    SHA(file->data, file->size, file->sha1);
+    mzSha1(file->data, file->size, file->sha1);
+    return 0;
+}
+
+int MapFileContents(const char* filename, FileContents* file) {
+    file->data = NULL;
+    file->mapped = 0;
+
+    if (strncmp(filename, "MTD:", 4) == 0) {
+        return LoadMTDContents(filename, file);
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &file->st) != 0) {
+        printf("failed to stat \"%s\": %s\n", filename, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    file->size = file->st.st_size;
+    if (file->size == 0) {
+        // Nothing to map; keep data non-NULL, which means "loaded".
+        close(fd);
+        file->data = mzBudgetAlloc(1, 0);
+    } else {
+        void* map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            printf("failed to map \"%s\": %s\n", filename, strerror(errno));
+            return -1;
+        }
+        file->data = map;
+        file->mapped = 1;
+    }
+
+    // Hashing is the first pass over the data, and what pages it in.
+    mzSha1(file->data, file->size, file->sha1);
     return 0;
 }
 
@@ -94,8 +140,14 @@ static int compare_size_indices(const void* a, const void* b) {
 }
 
 void FreeFileContents(FileContents* file) {
-    if (file) free(file->data);
-    free(file);
+    if (file == NULL || file->data == NULL) return;
+    if (file->mapped) {
+        munmap(file->data, file->size);
+    } else {
+        mzBudgetFree(file->data);
+    }
+    file->data = NULL;
+    file->mapped = 0;
 }
 
 // Load the contents of an MTD partition into the provided
@@ -113,12 +165,36 @@ void FreeFileContents(FileContents* file) {
 // marker), so the caller must specify the possible lengths and the
 // hash of the data, and we'll do the load expecting to find one of
 // those hashes.
+static int ReadMTDContents(const char* filename, FileContents* file,
+                           int want_data);
+
 int LoadMTDContents(const char* filename, FileContents* file) {
+    return ReadMTDContents(filename, file, 1);
+}
+
+// Like LoadMTDContents(), but only work out which size matches and its
+// sha1: file->data is left NULL.  Digests of partition prefixes are
+// remembered for the rest of the boot (see mtd_get_cached_digest()), so
+// checking the same partition again doesn't read it at all.
+int CheckMTDContents(const char* filename, FileContents* file) {
+    return ReadMTDContents(filename, file, 0);
+}
+
+// When only checking, the partition is hashed through a buffer this big
+// rather than read whole into memory.
+#define MTD_CHECK_WINDOW (256 * 1024)
+
+static int ReadMTDContents(const char* filename, FileContents* file,
+                           int want_data) {
+    file->data = NULL;
+    file->mapped = 0;
+
     char* copy = strdup(filename);
     const char* magic = strtok(copy, ":");
     if (strcmp(magic, "MTD") != 0) {
         printf("LoadMTDContents called with bad filename (%s)\n",
                filename);
+        free(copy);
         return -1;
     }
     const char* partition = strtok(NULL, ":");
@@ -135,17 +211,20 @@ int LoadMTDContents(const char* filename, FileContents* file) {
                filename);
     }
 
+    int result = -1;
     int pairs = (colons-1)/2;     // # of (size,sha1) pairs in filename
     int* index = malloc(pairs * sizeof(int));
     size_t* size = malloc(pairs * sizeof(size_t));
     char** sha1sum = malloc(pairs * sizeof(char*));
+    char* buffer = NULL;
+    MtdReadContext* ctx = NULL;
 
     for (i = 0; i < pairs; ++i) {
         const char* size_str = strtok(NULL, ":");
         size[i] = strtol(size_str, NULL, 10);
         if (size[i] == 0) {
             printf("LoadMTDContents called with bad size (%s)\n", filename);
-            return -1;
+            goto done;
         }
         sha1sum[i] = strtok(NULL, ":");
         index[i] = i;
@@ -165,56 +244,91 @@ int LoadMTDContents(const char* filename, FileContents* file) {
     if (mtd == NULL) {
         printf("mtd partition \"%s\" not found (loading %s)\n",
                partition, filename);
-        return -1;
+        goto done;
     }
 
-    MtdReadContext* ctx = mtd_read_partition(mtd);
+    uint8_t parsed_sha[SHA_DIGEST_SIZE];
+    uint8_t digest[SHA_DIGEST_SIZE];
+
+    // The sizes are tried smallest first, so a size whose digest isn't
+    // known yet means reading from the start after all.  Until then the
+    // answer may already be known.
+    if (!want_data) {
+        for (i = 0; i < pairs; ++i) {
+            if (mtd_get_cached_digest(mtd, size[index[i]], digest,
+                                      SHA_DIGEST_SIZE) != 0) {
+                break;
+            }
+            if (ParseSha1(sha1sum[index[i]], parsed_sha) == 0 &&
+                memcmp(digest, parsed_sha, SHA_DIGEST_SIZE) == 0) {
+                printf("mtd digest cached for size %lu sha %s\n",
+                       (unsigned long) size[index[i]], sha1sum[index[i]]);
+                file->size = size[index[i]];
+                memcpy(file->sha1, digest, SHA_DIGEST_SIZE);
+                goto found;
+            }
+        }
+        if (i == pairs) {
+            printf("contents of MTD partition \"%s\" didn't match %s "
+                   "(cached)\n", partition, filename);
+            goto done;
+        }
+    }
+
+    ctx = mtd_read_partition(mtd);
     if (ctx == NULL) {
         printf("failed to initialize read of mtd partition \"%s\"\n",
                partition);
-        return -1;
+        goto done;
     }
 
-    SHA_CTX sha_ctx;
-    SHA_init(&sha_ctx);
-    uint8_t parsed_sha[SHA_DIGEST_SIZE];
-
-    // allocate enough memory to hold the largest size.
-    file->data = malloc(size[index[pairs-1]]);
-    char* p = (char*)file->data;
+    MzSha1Ctx sha_ctx;
+    mzSha1Init(&sha_ctx);
+
+    // allocate enough memory to hold the largest size, or a window to
+    // hash through.
+    size_t buffer_size = want_data ? size[index[pairs-1]] : MTD_CHECK_WINDOW;
+    buffer = mzBudgetAlloc(buffer_size, 0);
+    if (buffer == NULL) {
+        printf("failed to allocate %lu bytes for mtd partition \"%s\"\n",
+               (unsigned long) buffer_size, partition);
+        goto done;
+    }
     file->size = 0;                // # bytes read so far
 
     for (i = 0; i < pairs; ++i) {
         // Read enough additional bytes to get us up to the next size
         // (again, we're trying the possibilities in order of increasing
         // size).
-        size_t next = size[index[i]] - file->size;
-        size_t read = 0;
-        if (next > 0) {
-            read = mtd_read_data(ctx, p, next);
+        while ((size_t) file->size < size[index[i]]) {
+            size_t next = size[index[i]] - file->size;
+            char* p = buffer;
+            if (want_data) {
+                p += file->size;
+            } else if (next > MTD_CHECK_WINDOW) {
+                next = MTD_CHECK_WINDOW;
+            }
+            size_t read = mtd_read_data(ctx, p, next);
             if (next != read) {
                 printf("short read (%d bytes of %d) for partition \"%s\"\n",
                        read, next, partition);
-                free(file->data);
-                file->data = NULL;
-                return -1;
+                goto done;
             }
-            SHA_update(&sha_ctx, p, read);
+            mzSha1Update(&sha_ctx, p, read);
             file->size += read;
         }
 
         // Duplicate the SHA context and finalize the duplicate so we can
         // check it against this pair's expected hash.
-        SHA_CTX temp_ctx;
-        memcpy(&temp_ctx, &sha_ctx, sizeof(SHA_CTX));
-        const uint8_t* sha_so_far = SHA_final(&temp_ctx);
+        MzSha1Ctx temp_ctx;
+        memcpy(&temp_ctx, &sha_ctx, sizeof(MzSha1Ctx));
+        const uint8_t* sha_so_far = mzSha1Final(&temp_ctx);
+        mtd_put_cached_digest(mtd, file->size, sha_so_far, SHA_DIGEST_SIZE);
 
         if (ParseSha1(sha1sum[index[i]], parsed_sha) != 0) {
             printf("failed to parse sha1 %s in %s\n",
                    sha1sum[index[i]], filename);
-            free(file->data);
-            file->data = NULL;
-            return -1;
+            goto done;
         }
 
         if (memcmp(sha_so_far, parsed_sha, SHA_DIGEST_SIZE) == 0) {
@@ -222,47 +336,48 @@ int LoadMTDContents(const char* filename, FileContents* file) {
             // the data we've read so far.
             printf("mtd read matched size %d sha %s\n",
                    size[index[i]], sha1sum[index[i]]);
+            memcpy(file->sha1, sha_so_far, SHA_DIGEST_SIZE);
             break;
         }
-
-        p += read;
     }
 
-    mtd_read_close(ctx);
-
     if (i == pairs) {
         // Ran off the end of the list of (size,sha1) pairs without
         // finding a match.
         printf("contents of MTD partition \"%s\" didn't match %s\n",
                partition, filename);
-        free(file->data);
-        file->data = NULL;
-        return -1;
+        goto done;
     }
 
-    const uint8_t* sha_final = SHA_final(&sha_ctx);
-    for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
-        file->sha1[i] = sha_final[i];
+found:
+    if (want_data) {
+        file->data = (unsigned char*) buffer;
+        buffer = NULL;
     }
 
     // Fake some stat() info.
     file->st.st_mode = 0644;
     file->st.st_uid = 0;
     file->st.st_gid = 0;
+    result = 0;
 
+done:
+    if (ctx != NULL) mtd_read_close(ctx);
+    mzBudgetFree(buffer);
     free(copy);
     free(index);
     free(size);
     free(sha1sum);
-
-    return 0;
+    return result;
 }
 
 
 // Save the contents of the given FileContents object under the given
 // filename.  Return 0 on success.
+static int SetSavedAttributes(const char* filename, const FileContents* file);
+
 int SaveFileContents(const char* filename, FileContents file) {
-    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC);
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
     if (fd < 0) {
         printf("failed to open \"%s\" for write: %s\n",
                filename, strerror(errno));
@@ -280,11 +395,100 @@ int SaveFileContents(const char* filename, FileContents file) {
     fsync(fd);
     close(fd);
 
-    if (chmod(filename, file.st.st_mode) != 0) {
+    return SetSavedAttributes(filename, &file);
+}
+
+// Copy source_filename to filename inside the kernel with sendfile(),
+// without the data passing through this process.  Returns 1 if the
+// kernel can't do that for regular files (before 2.6.33 it can't), so
+// the caller should write the data itself, or -1 on any other error.
+static int SendFileContents(const char* source_filename, const char* filename,
+                            const FileContents* file) {
+    int in = open(source_filename, O_RDONLY);
+    if (in < 0) {
+        return 1;
+    }
+    int out = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (out < 0) {
+        printf("failed to open \"%s\" for write: %s\n",
+               filename, strerror(errno));
+        close(in);
+        return -1;
+    }
+
+    off_t offset = 0;
+    while (offset < file->size) {
+        ssize_t sent = sendfile(out, in, &offset, file->size - offset);
+        if (sent < 0 && offset == 0 &&
+            (errno == EINVAL || errno == ENOSYS)) {
+            close(in);
+            close(out);
+            return 1;
+        }
+        if (sent <= 0) {
+            printf("error copying \"%s\" to \"%s\" (%ld of %ld bytes): %s\n",
+                   source_filename, filename, (long)offset, (long)file->size,
+                   sent < 0 ? strerror(errno) : "source shrank");
+            close(in);
+            close(out);
+            return -1;
+        }
+    }
+    close(in);
+    fsync(out);
+    close(out);
+
+    return SetSavedAttributes(filename, file) == 0 ? 0 : -1;
+}
+
+// Set once this patch has started using /cache as its staging area.
+static int spills_paused = 0;
+
+// From here until applypatch() returns, /cache holds (or is about to
+// hold) the copy of the source, and its free space was planned around
+// that; buffers over the memory budget mustn't be spilled there too.
+static void StageInCache(void) {
+    if (!spills_paused) {
+        mzBudgetPauseSpills();
+        spills_paused = 1;
+    }
+}
+
+// Save the contents of source_filename, already loaded into *file, as
+// CACHE_TEMP_SOURCE, as cheaply as possible:  a hard link when /cache
+// is the same filesystem (no data is written at all), else an
+// in-kernel copy from the file, else a write from memory.  MTD sources
+// are always written from memory.
+static int BackupSourceFile(const char* source_filename,
+                            const FileContents* file) {
+    int is_mtd = (strncmp(source_filename, "MTD:", 4) == 0);
+
+    StageInCache();
+    unlink(CACHE_TEMP_SOURCE);
+    if (!is_mtd && link(source_filename, CACHE_TEMP_SOURCE) == 0) {
+        printf("linked %s to %s\n", source_filename, CACHE_TEMP_SOURCE);
+        sync();
+        return 0;
+    }
+
+    if (MakeFreeSpaceOnCache(file->size) < 0) {
+        printf("not enough free space on /cache\n");
+        return -1;
+    }
+
+    if (!is_mtd) {
+        int r = SendFileContents(source_filename, CACHE_TEMP_SOURCE, file);
+        if (r <= 0) return r;
+    }
+    return SaveFileContents(CACHE_TEMP_SOURCE, *file);
+}
+
+static int SetSavedAttributes(const char* filename, const FileContents* file) {
+    if (chmod(filename, file->st.st_mode) != 0) {
         printf("chmod of \"%s\" failed: %s\n", filename, strerror(errno));
         return -1;
     }
-    if (chown(filename, file.st.st_uid, file.st.st_gid) != 0) {
+    if (chown(filename, file->st.st_uid, file->st.st_gid) != 0) {
         printf("chown of \"%s\" failed: %s\n", filename, strerror(errno));
         return -1;
     }
@@ -292,14 +496,13 @@ int SaveFileContents(const char* filename, FileContents file) {
     return 0;
 }
 
-// Write a memory buffer to target_mtd partition, a string of the form
-// "MTD:<partition>[:...]".  Return 0 on success.
-int WriteToMTDPartition(unsigned char* data, size_t len,
-                        const char* target_mtd) {
+// Open target_mtd partition, a string of the form
+// "MTD:<partition>[:...]", for writing.  Return NULL on failure.
+static MtdWriteContext* OpenMTDTarget(const char* target_mtd) {
     char* partition = strchr(target_mtd, ':');
     if (partition == NULL) {
         printf("bad MTD target name \"%s\"\n", target_mtd);
-        return -1;
+        return NULL;
     }
     ++partition;
     // Trim off anything after a colon, eg "MTD:boot:blah:blah:blah...".
@@ -314,43 +517,36 @@ int WriteToMTDPartition(unsigned char* data, size_t len,
         mtd_partitions_scanned = 1;
     }
 
+    MtdWriteContext* ctx = NULL;
     const MtdPartition* mtd = mtd_find_partition_by_name(partition);
     if (mtd == NULL) {
         printf("mtd partition \"%s\" not found for writing\n", partition);
-        return -1;
-    }
-
-    MtdWriteContext* ctx = mtd_write_partition(mtd);
-    if (ctx == NULL) {
+    } else if ((ctx = mtd_write_partition(mtd)) == NULL) {
         printf("failed to init mtd partition \"%s\" for writing\n",
                partition);
-        return -1;
-    }
-
-    size_t written = mtd_write_data(ctx, (char*)data, len);
-    if (written != len) {
-        printf("only wrote %d of %d bytes to MTD %s\n",
-               written, len, partition);
-        mtd_write_close(ctx);
-        return -1;
+    } else {
+        // Leave blocks that the patch doesn't change alone.
+        mtd_write_skip_unchanged(ctx);
     }
+    free(partition);
+    return ctx;
+}
 
+// Erase the rest of the partition and close it.  Return 0 on success.
+static int CloseMTDTarget(MtdWriteContext* ctx, const char* target_mtd) {
     if (mtd_erase_blocks(ctx, -1) < 0) {
-        printf("error finishing mtd write of %s\n", partition);
+        printf("error finishing mtd write of %s\n", target_mtd);
         mtd_write_close(ctx);
         return -1;
     }
 
     if (mtd_write_close(ctx)) {
-        printf("error closing mtd write of %s\n", partition);
+        printf("error closing mtd write of %s\n", target_mtd);
         return -1;
     }
-
-    free(partition);
     return 0;
 }
 
-
 // Take a string 'str' of 40 hex digits and parse it into the 20
 // byte array 'digest'.  'str' may contain only the digest or be of
 // the form "<digest>:<anything>".  Return 0 on success, -1 on any
@@ -404,18 +600,21 @@ int applypatch_check(const char* filename,
                      int num_patches, char** const patch_sha1_str) {
     FileContents file;
     file.data = NULL;
+    file.mapped = 0;
 
     // It's okay to specify no sha1s; the check will pass if the
     // LoadFileContents is successful.  (Useful for reading MTD
     // partitions, where the filename encodes the sha1s; no need to
-    // check them twice.)
-    if (LoadFileContents(filename, &file) != 0 ||
+    // check them twice.)  Partitions are only hashed, not loaded.
+    int loaded = strncmp(filename, "MTD:", 4) == 0 ?
+        CheckMTDContents(filename, &file) : MapFileContents(filename, &file);
+    if (loaded != 0 ||
         (num_patches > 0 &&
          FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0)) {
         printf("file \"%s\" doesn't have any of expected "
                "sha1 sums; checking cache\n", filename);
 
-        free(file.data);
+        FreeFileContents(&file);
 
         // If the source file is missing or corrupted, it might be because
         // we were killed in the middle of patching it.  A copy of it
@@ -423,22 +622,136 @@ int applypatch_check(const char* filename,
         // exists and matches the sha1 we're looking for, the check still
         // passes.
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &file) != 0) {
+        if (MapFileContents(CACHE_TEMP_SOURCE, &file) != 0) {
             printf("failed to load cache file\n");
             return 1;
         }
 
         if (FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0) {
             printf("cache bits don't match any sha1 for \"%s\"\n", filename);
-            free(file.data);
+            FreeFileContents(&file);
             return 1;
         }
     }
 
-    free(file.data);
+    FreeFileContents(&file);
     return 0;
 }
 
+// Returns 0 if filename (a file, or an "MTD:partition:size:sha1" name)
+// holds exactly the data with the given sha1.  Unlike applypatch_check(),
+// a copy in CACHE_TEMP_SOURCE doesn't count: this is for deciding whether
+// an install step's output needs writing again, not whether a patch has
+// a source to start from.
+int applypatch_check_output(const char* filename, const uint8_t* sha1) {
+    FileContents file;
+    file.data = NULL;
+    file.mapped = 0;
+    int loaded = strncmp(filename, "MTD:", 4) == 0 ?
+        CheckMTDContents(filename, &file) : MapFileContents(filename, &file);
+    int result = loaded == 0 &&
+        memcmp(file.sha1, sha1, SHA_DIGEST_SIZE) == 0 ? 0 : 1;
+    FreeFileContents(&file);
+    return result;
+}
+
+// Files are hashed on up to this many threads by applypatch_check_batch().
+#define CHECK_MAX_WORKERS 4
+
+typedef struct {
+    int count;
+    char** filenames;
+    char** sha1_lists;
+    int* results;
+    int next;                   // next file to take
+    pthread_mutex_t lock;
+} CheckBatch;
+
+static int CheckOne(const char* filename, const char* sha1_list) {
+    // Split "<sha1>,<sha1>,..." (possibly empty) into an array.
+    char* list = strdup(sha1_list);
+    char* sha1s[64];
+    int num_sha1s = 0;
+    char* p = list;
+    while (*p != '\0' && num_sha1s < 64) {
+        sha1s[num_sha1s++] = p;
+        char* comma = strchr(p, ',');
+        if (comma == NULL) break;
+        *comma = '\0';
+        p = comma + 1;
+    }
+    int result = applypatch_check(filename, num_sha1s, sha1s);
+    free(list);
+    return result;
+}
+
+static void* CheckWorker(void* cookie) {
+    CheckBatch* batch = (CheckBatch*) cookie;
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        int i = batch->next;
+        while (i < batch->count &&
+               strncmp(batch->filenames[i], "MTD:", 4) == 0) {
+            ++i;
+        }
+        batch->next = i + 1;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= batch->count) break;
+        batch->results[i] = CheckOne(batch->filenames[i],
+                                     batch->sha1_lists[i]);
+    }
+    return NULL;
+}
+
+// Runs applypatch_check() on each of count files, where sha1_lists[i]
+// holds the acceptable sha1s for filenames[i] separated by commas (or
+// is empty).  Files are hashed on a pool of threads; MTD: files, which
+// share the flash and LoadMTDContents()'s state, are done one at a time
+// on this one.  Every file is checked, even after a failure; results[i]
+// gets its applypatch_check() result.  Returns the number that failed.
+int applypatch_check_batch(int count, char** const filenames,
+                           char** const sha1_lists, int* results) {
+    CheckBatch batch;
+    batch.count = count;
+    batch.filenames = filenames;
+    batch.sha1_lists = sha1_lists;
+    batch.results = results;
+    batch.next = 0;
+    pthread_mutex_init(&batch.lock, NULL);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int want = cpus < 1 ? 1 : cpus > CHECK_MAX_WORKERS ?
+            CHECK_MAX_WORKERS : cpus;
+    if (want > count) want = count;
+
+    pthread_t workers[CHECK_MAX_WORKERS];
+    int num_workers = 0;
+    if (want > 1) {
+        while (num_workers < want &&
+               pthread_create(&workers[num_workers], NULL,
+                              CheckWorker, &batch) == 0) {
+            ++num_workers;
+        }
+    }
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (num_workers == 0 || strncmp(filenames[i], "MTD:", 4) == 0) {
+            results[i] = CheckOne(filenames[i], sha1_lists[i]);
+        }
+    }
+    for (i = 0; i < num_workers; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_mutex_destroy(&batch.lock);
+
+    int failed = 0;
+    for (i = 0; i < count; ++i) {
+        if (results[i] != 0) ++failed;
+    }
+    return failed;
+}
+
 int ShowLicenses() {
     ShowBSDiffLicense();
     return 0;
@@ -455,23 +768,31 @@ ssize_t FileSink(unsigned char* data, ssize_t len, void* token) {
             return done;
         }
         done += wrote;
+        mzPhaseAdd(wrote);
     }
     return done;
 }
 
 typedef struct {
-    unsigned char* buffer;
+    MtdWriteContext* ctx;
     ssize_t size;
     ssize_t pos;
-} MemorySinkInfo;
+} MtdSinkInfo;
 
-ssize_t MemorySink(unsigned char* data, ssize_t len, void* token) {
-    MemorySinkInfo* msi = (MemorySinkInfo*)token;
+// Writes patched output straight to the flash, so nothing the size of
+// the target is ever held in memory.
+ssize_t MtdSink(unsigned char* data, ssize_t len, void* token) {
+    MtdSinkInfo* msi = (MtdSinkInfo*)token;
     if (msi->size - msi->pos < len) {
         return -1;
     }
-    memcpy(msi->buffer + msi->pos, data, len);
+    ssize_t wrote = mtd_write_data(msi->ctx, (char*)data, len);
+    if (wrote != len) {
+        printf("only wrote %ld of %ld bytes to MTD\n", (long)wrote, (long)len);
+        return wrote < 0 ? -1 : wrote;
+    }
     msi->pos += len;
+    mzPhaseAdd(len);
     return len;
 }
 
@@ -522,13 +843,15 @@ int CacheSizeCheck(size_t bytes) {
 // data.  See the comments for the LoadMTDContents() function above
 // for the format of such a filename.
 
-int applypatch(const char* source_filename,
-               const char* target_filename,
-               const char* target_sha1_str,
-               size_t target_size,
-               int num_patches,
-               char** const patch_sha1_str,
-               Value** patch_data) {
+static int ApplyPatchToFile(const char* source_filename,
+                            const char* target_filename,
+                            const char* target_sha1_str,
+                            size_t target_size,
+                            int num_patches,
+                            char** const patch_sha1_str,
+                            Value** patch_data,
+                            FileContents* source_file,
+                            FileContents* copy_file) {
     printf("\napplying patch to %s\n", source_filename);
 
     if (target_filename[0] == '-' &&
@@ -542,15 +865,13 @@ int applypatch(const char* source_filename,
         return 1;
     }
 
-    FileContents copy_file;
-    FileContents source_file;
     const Value* source_patch_value = NULL;
     const Value* copy_patch_value = NULL;
     int made_copy = 0;
 
     // We try to load the target file into the source_file object.
-    if (LoadFileContents(target_filename, &source_file) == 0) {
-        if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_SIZE) == 0) {
+    if (MapFileContents(target_filename, source_file) == 0) {
+        if (memcmp(source_file->sha1, target_sha1, SHA_DIGEST_SIZE) == 0) {
             // The early-exit case:  the patch was already applied, this file
             // has the desired hash, nothing for us to do.
             printf("\"%s\" is already target; no patch needed\n",
@@ -559,17 +880,17 @@ int applypatch(const char* source_filename,
         }
     }
 
-    if (source_file.data == NULL ||
+    if (source_file->data == NULL ||
         (target_filename != source_filename &&
          strcmp(target_filename, source_filename) != 0)) {
         // Need to load the source file:  either we failed to load the
         // target file, or we did but it's different from the source file.
-        free(source_file.data);
-        LoadFileContents(source_filename, &source_file);
+        FreeFileContents(source_file);
+        MapFileContents(source_filename, source_file);
     }
 
-    if (source_file.data != NULL) {
-        int to_use = FindMatchingPatch(source_file.sha1,
+    if (source_file->data != NULL) {
+        int to_use = FindMatchingPatch(source_file->sha1,
                                        patch_sha1_str, num_patches);
         if (to_use >= 0) {
             source_patch_value = patch_data[to_use];
@@ -577,18 +898,18 @@ int applypatch(const char* source_filename,
     }
 
     if (source_patch_value == NULL) {
-        free(source_file.data);
+        FreeFileContents(source_file);
         printf("source file is bad; trying copy\n");
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &copy_file) < 0) {
+        if (MapFileContents(CACHE_TEMP_SOURCE, copy_file) < 0) {
             // fail.
             printf("failed to read copy file\n");
             return 1;
         }
 
-        int to_use = FindMatchingPatch(copy_file.sha1,
+        int to_use = FindMatchingPatch(copy_file->sha1,
                                        patch_sha1_str, num_patches);
-        if (to_use > 0) {
+        if (to_use >= 0) {
             copy_patch_value = patch_data[to_use];
         }
 
@@ -600,9 +921,9 @@ int applypatch(const char* source_filename,
     }
 
     int retry = 1;
-    SHA_CTX ctx;
+    MzSha1Ctx ctx;
     int output;
-    MemorySinkInfo msi;
+    MtdSinkInfo msi;
     FileContents* source_to_use;
     char* outname;
 
@@ -624,18 +945,12 @@ int applypatch(const char* source_filename,
         // file?
 
         if (strncmp(target_filename, "MTD:", 4) == 0) {
-            // If the target is an MTD partition, we're actually going to
-            // write the output to /tmp and then copy it to the partition.
-            // statfs() always returns 0 blocks free for /tmp, so instead
-            // we'll just assume that /tmp has enough space to hold the file.
-
-            // We still write the original source to cache, in case the MTD
-            // write is interrupted.
-            if (MakeFreeSpaceOnCache(source_file.size) < 0) {
-                printf("not enough free space on /cache\n");
-                return 1;
-            }
-            if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
+            // If the target is an MTD partition, the output is written
+            // straight to it as it's produced.  The partition is garbage
+            // until the patch finishes, so first save the original source
+            // to cache; if we're interrupted, the next run patches from
+            // the copy.
+            if (BackupSourceFile(source_filename, source_file) < 0) {
                 printf("failed to back up source file\n");
                 return 1;
             }
@@ -645,7 +960,7 @@ int applypatch(const char* source_filename,
             int enough_space = 0;
             if (retry > 0) {
                 size_t free_space = FreeSpaceForFile(target_fs);
-                int enough_space =
+                enough_space =
                     (free_space > (target_size * 3 / 2));  // 50% margin of error
                 printf("target %ld bytes; free space %ld bytes; retry %d; enough %d\n",
                        (long)target_size, (long)free_space, retry, enough_space);
@@ -668,16 +983,25 @@ int applypatch(const char* source_filename,
                     return 1;
                 }
 
-                if (MakeFreeSpaceOnCache(source_file.size) < 0) {
-                    printf("not enough free space on /cache\n");
-                    return 1;
-                }
-
-                if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
+                if (BackupSourceFile(source_filename, source_file) < 0) {
                     printf("failed to back up source file\n");
                     return 1;
                 }
                 made_copy = 1;
+
+                // A mapped source would keep the deleted file's blocks in
+                // use; patch from the copy in cache instead.
+                if (source_file->mapped) {
+                    FileContents original = *source_file;
+                    FreeFileContents(source_file);
+                    if (MapFileContents(CACHE_TEMP_SOURCE, source_file) != 0 ||
+                        memcmp(source_file->sha1, original.sha1,
+                               SHA_DIGEST_SIZE) != 0) {
+                        printf("failed to reload source from cache copy\n");
+                        return 1;
+                    }
+                    source_file->st = original.st;
+                }
                 unlink(source_filename);
 
                 size_t free_space = FreeSpaceForFile(target_fs);
@@ -687,10 +1011,10 @@ int applypatch(const char* source_filename,
 
         const Value* patch;
         if (source_patch_value != NULL) {
-            source_to_use = &source_file;
+            source_to_use = source_file;
             patch = source_patch_value;
         } else {
-            source_to_use = &copy_file;
+            source_to_use = copy_file;
             patch = copy_patch_value;
         }
 
@@ -704,16 +1028,13 @@ int applypatch(const char* source_filename,
         output = -1;
         outname = NULL;
         if (strncmp(target_filename, "MTD:", 4) == 0) {
-            // We store the decoded output in memory.
-            msi.buffer = malloc(target_size);
-            if (msi.buffer == NULL) {
-                printf("failed to alloc %ld bytes for output\n",
-                       (long)target_size);
+            msi.ctx = OpenMTDTarget(target_filename);
+            if (msi.ctx == NULL) {
                 return 1;
             }
             msi.pos = 0;
             msi.size = target_size;
-            sink = MemorySink;
+            sink = MtdSink;
             token = &msi;
         } else {
             // We write the decoded output to "<tgt-file>.patch".
@@ -734,12 +1055,13 @@ int applypatch(const char* source_filename,
         char* header = patch->data;
         ssize_t header_bytes_read = patch->size;
 
-        SHA_init(&ctx);
+        mzSha1Init(&ctx);
 
         int result;
 
         if (header_bytes_read >= 8 &&
-            memcmp(header, "BSDIFF40", 8) == 0) {
+            (memcmp(header, "BSDIFF40", 8) == 0 ||
+             memcmp(header, "BSDIFFZL", 8) == 0)) {
             result = ApplyBSDiffPatch(source_to_use->data, source_to_use->size,
                                       patch, 0, sink, token, &ctx);
         } else if (header_bytes_read >= 8 &&
@@ -754,6 +1076,8 @@ int applypatch(const char* source_filename,
         if (output >= 0) {
             fsync(output);
             close(output);
+        } else if (CloseMTDTarget(msi.ctx, target_filename) != 0) {
+            result = 1;
         }
 
         if (result != 0) {
@@ -772,20 +1096,15 @@ int applypatch(const char* source_filename,
         }
     } while (retry-- > 0);
 
-    const uint8_t* current_target_sha1 = SHA_final(&ctx);
+    const uint8_t* current_target_sha1 = mzSha1Final(&ctx);
     if (memcmp(current_target_sha1, target_sha1, SHA_DIGEST_SIZE) != 0) {
         printf("patch did not produce expected sha1\n");
+        // An MTD target has already been overwritten; the copy of the
+        // source in cache is kept so that another run can redo it.
         return 1;
     }
 
-    if (output < 0) {
-        // Copy the temp file to the MTD partition.
-        if (WriteToMTDPartition(msi.buffer, msi.pos, target_filename) != 0) {
-            printf("write of patched data to %s failed\n", target_filename);
-            return 1;
-        }
-        free(msi.buffer);
-    } else {
+    if (output >= 0) {
         // Give the .patch file the same owner, group, and mode of the
         // original source file.
         if (chmod(outname, source_to_use->st.st_mode) != 0) {
@@ -813,3 +1132,34 @@ int applypatch(const char* source_filename,
     // Success!
     return 0;
 }
+
+int applypatch(const char* source_filename,
+               const char* target_filename,
+               const char* target_sha1_str,
+               size_t target_size,
+               int num_patches,
+               char** const patch_sha1_str,
+               Value** patch_data) {
+    FileContents source_file, copy_file;
+    source_file.data = copy_file.data = NULL;
+    // An MTD target always stages its source in /cache, and the source
+    // is loaded before that happens; keep it from being spilled there.
+    const char* target = strcmp(target_filename, "-") == 0 ?
+        source_filename : target_filename;
+    if (strncmp(target, "MTD:", 4) == 0) StageInCache();
+    mzPhaseBegin("patch", target_size);
+    int result = ApplyPatchToFile(source_filename, target_filename,
+                                  target_sha1_str, target_size,
+                                  num_patches, patch_sha1_str, patch_data,
+                                  &source_file, &copy_file);
+    mzPhaseEnd();
+    // Mapped sources must be let go, or a replaced file's blocks stay in
+    // use for the rest of the update.
+    FreeFileContents(&source_file);
+    FreeFileContents(&copy_file);
+    if (spills_paused) {
+        mzBudgetResumeSpills();
+        spills_paused = 0;
+    }
+    return result;
+}
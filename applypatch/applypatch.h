@@ -19,6 +19,7 @@
 
 #include <sys/stat.h>
 #include "mincrypt/sha.h"
+#include "minzip/Sha1.h"
 #include "edify/expr.h"
 
 typedef struct _Patch {
@@ -31,6 +32,7 @@ typedef struct _FileContents {
   unsigned char* data;
   ssize_t size;
   struct stat st;
+  int mapped;           // data is a read-only mmap of the file
 } FileContents;
 
 // When there isn't enough room on the target filesystem to hold the
@@ -58,17 +60,28 @@ int applypatch(const char* source_filename,
 int applypatch_check(const char* filename,
                      int num_patches,
                      char** const patch_sha1_str);
+int applypatch_check_batch(int count, char** const filenames,
+                           char** const sha1_lists, int* results);
+int applypatch_check_output(const char* filename, const uint8_t* sha1);
 
 // Read a file into memory; store it and its associated metadata in
-// *file.  Return 0 on success.
+// *file.  Return 0 on success.  The data is taken from the memory budget
+// (minzip/Budget.h), so a big file may end up spilled to /cache.
 int LoadFileContents(const char* filename, FileContents* file);
+// Like LoadFileContents(), but map the file instead of reading it, so
+// its pages are only read as they're used (the first time being for
+// the SHA-1).  The data is read-only.  MTD: names are still read.
+int MapFileContents(const char* filename, FileContents* file);
+// Release the data of a file loaded either way.
 void FreeFileContents(FileContents* file);
 
 // bsdiff.c
 void ShowBSDiffLicense();
 int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
                      const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx);
+                     SinkFn sink, void* token, MzSha1Ctx* ctx);
+// *new_data comes from the memory budget (minzip/Budget.h); release it
+// with mzBudgetFree().
 int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
                         const Value* patch, ssize_t patch_offset,
                         unsigned char** new_data, ssize_t* new_size);
@@ -76,7 +89,7 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
 // imgpatch.c
 int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                     const Value* patch,
-                    SinkFn sink, void* token, SHA_CTX* ctx);
+                    SinkFn sink, void* token, MzSha1Ctx* ctx);
 
 // freecache.c
 int MakeFreeSpaceOnCache(size_t bytes_needed);
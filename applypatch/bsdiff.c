@@ -45,16 +45,23 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <bzlib.h>
 #include <err.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "mincrypt/sha.h"
+#include "zlib.h"
+
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
 static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
@@ -156,6 +163,164 @@ static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
 	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
 }
 
+// Linear-time suffix sorting (SA-IS, after Nong, Zhang & Chan, "Two
+// Efficient Algorithms for Linear Time Suffix Array Construction").
+// It produces the same array as qsufsort() -- the empty suffix first,
+// then every suffix of old in order -- but with 32-bit entries and no
+// V array, so it needs a quarter of the memory.  Used whenever old is
+// short enough for 32-bit offsets.
+//
+// At the top level the string is old[] plus a virtual sentinel, taken
+// as smaller than every byte; bytes are shifted up by one to make room
+// for it.  Recursive levels work on int32 names whose last entry is
+// already a unique 0.
+
+typedef struct {
+	const u_char *bytes;	// top level only
+	const int32_t *ints;	// recursive levels
+	int32_t n;
+} SaisString;
+
+#define tget(i) ((t[(i)/8]&(0x80>>((i)%8))) ? 1 : 0)
+#define tset(i,b) (t[(i)/8] = (b) ? (t[(i)/8]|(0x80>>((i)%8))) : \
+				    (t[(i)/8]&~(0x80>>((i)%8))))
+#define isLMS(i) ((i)>0 && tget(i) && !tget((i)-1))
+
+static inline int32_t chr(const SaisString *s,int32_t i)
+{
+	if(s->ints) return s->ints[i];
+	return (i==s->n-1) ? 0 : s->bytes[i]+1;
+}
+
+static void getbuckets(const SaisString *s,int32_t *bkt,int32_t K,int end)
+{
+	int32_t i,sum=0;
+
+	for(i=0;i<=K;i++) bkt[i]=0;
+	for(i=0;i<s->n;i++) bkt[chr(s,i)]++;
+	for(i=0;i<=K;i++) {
+		sum+=bkt[i];
+		bkt[i]=end ? sum : sum-bkt[i];
+	};
+}
+
+static void induce(const SaisString *s,const u_char *t,int32_t *SA,
+		int32_t *bkt,int32_t K)
+{
+	int32_t i,j,n=s->n;
+
+	getbuckets(s,bkt,K,0);
+	for(i=0;i<n;i++) {
+		j=SA[i]-1;
+		if(j>=0 && !tget(j)) SA[bkt[chr(s,j)]++]=j;
+	};
+	getbuckets(s,bkt,K,1);
+	for(i=n-1;i>=0;i--) {
+		j=SA[i]-1;
+		if(j>=0 && tget(j)) SA[--bkt[chr(s,j)]]=j;
+	};
+}
+
+static void sais(const SaisString *s,int32_t *SA,int32_t K)
+{
+	int32_t i,j,d,n=s->n,n1,name,prev,pos;
+	int32_t *bkt,*s1;
+	u_char *t;
+	SaisString sub;
+	int diff;
+
+	if(((t=calloc(1,n/8+1))==NULL) ||
+		((bkt=malloc((K+1)*sizeof(int32_t)))==NULL)) err(1,NULL);
+
+	// Classify each suffix as S-type (1) or L-type (0).
+	tset(n-2,0);
+	tset(n-1,1);
+	for(i=n-3;i>=0;i--)
+		tset(i,(chr(s,i)<chr(s,i+1) ||
+			(chr(s,i)==chr(s,i+1) && tget(i+1))) ? 1 : 0);
+
+	// Sort the LMS substrings by induction from their bucket ends.
+	getbuckets(s,bkt,K,1);
+	for(i=0;i<n;i++) SA[i]=-1;
+	for(i=1;i<n;i++) if(isLMS(i)) SA[--bkt[chr(s,i)]]=i;
+	induce(s,t,SA,bkt,K);
+
+	// Compact the sorted LMS positions into the front of SA and name
+	// the substrings, equal substrings getting equal names.
+	n1=0;
+	for(i=0;i<n;i++) if(isLMS(SA[i])) SA[n1++]=SA[i];
+	for(i=n1;i<n;i++) SA[i]=-1;
+	name=0;prev=-1;
+	for(i=0;i<n1;i++) {
+		pos=SA[i];diff=0;
+		for(d=0;d<n;d++) {
+			if(prev==-1 || chr(s,pos+d)!=chr(s,prev+d) ||
+				tget(pos+d)!=tget(prev+d)) {
+				diff=1;
+				break;
+			} else if(d>0 && (isLMS(pos+d) || isLMS(prev+d))) break;
+		};
+		if(diff) { name++; prev=pos; };
+		SA[n1+pos/2]=name-1;
+	};
+	for(i=n-1,j=n-1;i>=n1;i--) if(SA[i]>=0) SA[j--]=SA[i];
+
+	// Sort the reduced string, recursing while names repeat.
+	s1=SA+n-n1;
+	if(name<n1) {
+		sub.bytes=NULL;sub.ints=s1;sub.n=n1;
+		sais(&sub,SA,name-1);
+	} else {
+		for(i=0;i<n1;i++) SA[s1[i]]=i;
+	};
+
+	// Put the LMS suffixes in their final order at their bucket ends
+	// and induce everything else from them.
+	for(i=1,j=0;i<n;i++) if(isLMS(i)) s1[j++]=i;
+	for(i=0;i<n1;i++) SA[i]=s1[SA[i]];
+	for(i=n1;i<n;i++) SA[i]=-1;
+	getbuckets(s,bkt,K,1);
+	for(i=n1-1;i>=0;i--) {
+		j=SA[i];SA[i]=-1;
+		SA[--bkt[chr(s,j)]]=j;
+	};
+	induce(s,t,SA,bkt,K);
+
+	free(bkt);
+	free(t);
+}
+
+#undef tget
+#undef tset
+#undef isLMS
+
+static int32_t *sufsort32(u_char *old,off_t oldsize)
+{
+	int32_t *I;
+	SaisString s;
+
+	if((I=malloc((oldsize+1)*sizeof(int32_t)))==NULL) err(1,NULL);
+	if(oldsize==0) {
+		I[0]=0;
+		return I;
+	};
+	s.bytes=old;s.ints=NULL;s.n=oldsize+1;
+	sais(&s,I,256);
+	return I;
+}
+
+// The suffix array of one old file, kept by the caller between calls.
+// Exactly one of I32 and I is set.
+typedef struct BsdiffIndex {
+	int32_t *I32;
+	off_t *I;
+} BsdiffIndex;
+
+static inline off_t sa_at(const BsdiffIndex *index,off_t i)
+{
+	return index->I32 ? index->I32[i] : index->I[i];
+}
+
 static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 {
 	off_t i;
@@ -166,26 +331,29 @@ static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 	return i;
 }
 
-static off_t search(off_t *I,u_char *old,off_t oldsize,
+static off_t search(const BsdiffIndex *I,u_char *old,off_t oldsize,
 		u_char *new,off_t newsize,off_t st,off_t en,off_t *pos)
 {
-	off_t x,y;
+	off_t x,y,ist,ien,ix;
 
 	if(en-st<2) {
-		x=matchlen(old+I[st],oldsize-I[st],new,newsize);
-		y=matchlen(old+I[en],oldsize-I[en],new,newsize);
+		ist=sa_at(I,st);
+		ien=sa_at(I,en);
+		x=matchlen(old+ist,oldsize-ist,new,newsize);
+		y=matchlen(old+ien,oldsize-ien,new,newsize);
 
 		if(x>y) {
-			*pos=I[st];
+			*pos=ist;
 			return x;
 		} else {
-			*pos=I[en];
+			*pos=ien;
 			return y;
 		}
 	};
 
 	x=st+(en-st)/2;
-	if(memcmp(old+I[x],new,MIN(oldsize-I[x],newsize))<0) {
+	ix=sa_at(I,x);
+	if(memcmp(old+ix,new,MIN(oldsize-ix,newsize))<0) {
 		return search(I,old,oldsize,new,newsize,x,en,pos);
 	} else {
 		return search(I,old,oldsize,new,newsize,st,x,pos);
@@ -210,81 +378,82 @@ static void offtout(off_t x,u_char *buf)
 	if(x<0) buf[7]|=0x80;
 }
 
-// This is main() from bsdiff.c, with the following changes:
-//
-//    - old, oldsize, new, newsize are arguments; we don't load this
-//      data from files.  old and new are owned by the caller; we
-//      don't free them at the end.
-//
-//    - the "I" block of memory is owned by the caller, who passes a
-//      pointer to *I, which can be NULL.  This way if we call
-//      bsdiff() multiple times with the same 'old' data, we only do
-//      the qsufsort() step the first time.
-//
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
-           const char* patch_filename)
+static off_t offtin(const u_char *buf)
 {
-	int fd;
-	off_t *I;
+	off_t y;
+
+	y=buf[7]&0x7F;
+	y=y*256;y+=buf[6];
+	y=y*256;y+=buf[5];
+	y=y*256;y+=buf[4];
+	y=y*256;y+=buf[3];
+	y=y*256;y+=buf[2];
+	y=y*256;y+=buf[1];
+	y=y*256;y+=buf[0];
+
+	if(buf[7]&0x80) y=-y;
+
+	return y;
+}
+
+// One stretch of new, scanned for matches against the whole of old.
+// The scan loop of bsdiff-4.3 runs over it as though it were the
+// entire new file, except that oldpos starts from 0 at the beginning
+// of the segment; bsdiff() corrects for that when it joins the
+// segments' control triples together.
+typedef struct {
+	u_char *old;
+	off_t oldsize;
+	const BsdiffIndex *I;
+	u_char *new;		// start of the segment
+	off_t newsize;		// length of the segment
+	off_t *ctrl;		// triples of (diff, extra, seek)
+	off_t nctrl,ctrlcap;
+	u_char *db,*eb;
+	off_t dblen,eblen;
+} ScanSegment;
+
+#define BSDIFF_MAX_WORKERS 4
+#define BSDIFF_MIN_SEGMENT (4*1024*1024)
+
+static void add_ctrl(ScanSegment *seg,off_t x,off_t y,off_t z)
+{
+	if(seg->nctrl+3>seg->ctrlcap) {
+		seg->ctrlcap=seg->ctrlcap ? seg->ctrlcap*2 : 3*1024;
+		if((seg->ctrl=realloc(seg->ctrl,
+			seg->ctrlcap*sizeof(off_t)))==NULL) err(1,NULL);
+	};
+	seg->ctrl[seg->nctrl++]=x;
+	seg->ctrl[seg->nctrl++]=y;
+	seg->ctrl[seg->nctrl++]=z;
+}
+
+static void *scan_segment(void *cookie)
+{
+	ScanSegment *seg=cookie;
+	u_char *old=seg->old,*new=seg->new;
+	off_t oldsize=seg->oldsize,newsize=seg->newsize;
 	off_t scan,pos,len;
 	off_t lastscan,lastpos,lastoffset;
 	off_t oldscore,scsc;
 	off_t s,Sf,lenf,Sb,lenb;
 	off_t overlap,Ss,lens;
 	off_t i;
-	off_t dblen,eblen;
 	u_char *db,*eb;
-	u_char buf[8];
-	u_char header[32];
-	FILE * pf;
-	BZFILE * pfbz2;
-	int bz2err;
-
-        if (*IP == NULL) {
-            off_t* V;
-            *IP = malloc((oldsize+1) * sizeof(off_t));
-            V = malloc((oldsize+1) * sizeof(off_t));
-            qsufsort(*IP, V, old, oldsize);
-            free(V);
-        }
-        I = *IP;
+	off_t dblen,eblen;
 
 	if(((db=malloc(newsize+1))==NULL) ||
 		((eb=malloc(newsize+1))==NULL)) err(1,NULL);
 	dblen=0;
 	eblen=0;
 
-	/* Create the patch file */
-	if ((pf = fopen(patch_filename, "w")) == NULL)
-              err(1, "%s", patch_filename);
-
-	/* Header is
-		0	8	 "BSDIFF40"
-		8	8	length of bzip2ed ctrl block
-		16	8	length of bzip2ed diff block
-		24	8	length of new file */
-	/* File is
-		0	32	Header
-		32	??	Bzip2ed ctrl block
-		??	??	Bzip2ed diff block
-		??	??	Bzip2ed extra block */
-	memcpy(header,"BSDIFF40",8);
-	offtout(0, header + 8);
-	offtout(0, header + 16);
-	offtout(newsize, header + 24);
-	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", patch_filename);
-
-	/* Compute the differences, writing ctrl as we go */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	scan=0;len=0;
+	scan=0;len=0;pos=0;
 	lastscan=0;lastpos=0;lastoffset=0;
 	while(scan<newsize) {
 		oldscore=0;
 
 		for(scsc=scan+=len;scan<newsize;scan++) {
-			len=search(I,old,oldsize,new+scan,newsize-scan,
+			len=search(seg->I,old,oldsize,new+scan,newsize-scan,
 					0,oldsize,&pos);
 
 			for(;scsc<scan+len;scsc++)
@@ -340,29 +509,363 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 			dblen+=lenf;
 			eblen+=(scan-lenb)-(lastscan+lenf);
 
-			offtout(lenf,buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+			add_ctrl(seg,lenf,(scan-lenb)-(lastscan+lenf),
+				(pos-lenb)-(lastpos+lenf));
 
-			offtout((scan-lenb)-(lastscan+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+			lastscan=scan-lenb;
+			lastpos=pos-lenb;
+			lastoffset=pos-scan;
+		};
+	};
+
+	seg->db=db;seg->dblen=dblen;
+	seg->eb=eb;seg->eblen=eblen;
+	return NULL;
+}
+
+// Patches normally compress their three blocks with bzip2, as
+// bsdiff-4.3 does ("BSDIFF40").  With bsdiff_use_zlib(1) they use zlib
+// instead and are marked "BSDIFFZL"; those are a little bigger but
+// decode much faster, and only newer applypatch binaries accept them.
+static int use_zlib=0;
+
+void bsdiff_use_zlib(int enable)
+{
+	use_zlib=enable;
+}
+
+typedef struct {
+	FILE *f;
+	BZFILE *bz;
+	z_stream z;
+} BlockWriter;
+
+static void block_open(BlockWriter *w,FILE *f)
+{
+	int bz2err;
+
+	w->f=f;
+	if(use_zlib) {
+		memset(&w->z,0,sizeof(w->z));
+		if(deflateInit(&w->z,Z_BEST_COMPRESSION)!=Z_OK)
+			errx(1,"deflateInit failed");
+	} else {
+		if((w->bz=BZ2_bzWriteOpen(&bz2err,f,9,0,0))==NULL)
+			errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
+	};
+}
 
-			offtout((pos-lenb)-(lastpos+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
+static void block_deflate(BlockWriter *w,int flush)
+{
+	u_char out[16384];
+	int zerr;
+
+	do {
+		w->z.next_out=out;
+		w->z.avail_out=sizeof(out);
+		zerr=deflate(&w->z,flush);
+		if(zerr==Z_STREAM_ERROR)
+			errx(1,"deflate failed");
+		if(fwrite(out,1,sizeof(out)-w->z.avail_out,w->f)!=
+			sizeof(out)-w->z.avail_out)
+			err(1,"fwrite");
+	} while(w->z.avail_out==0);
+}
+
+static void block_write(BlockWriter *w,void *data,off_t len)
+{
+	int bz2err;
+	int n;
+
+	while(len>0) {
+		n=MIN(len,1<<30);
+		if(use_zlib) {
+			w->z.next_in=data;
+			w->z.avail_in=n;
+			block_deflate(w,Z_NO_FLUSH);
+		} else {
+			BZ2_bzWrite(&bz2err, w->bz, data, n);
 			if (bz2err != BZ_OK)
 				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+		};
+		data=(u_char *)data+n;
+		len-=n;
+	};
+}
 
-			lastscan=scan-lenb;
-			lastpos=pos-lenb;
-			lastoffset=pos-scan;
+static void block_close(BlockWriter *w)
+{
+	int bz2err;
+
+	if(use_zlib) {
+		block_deflate(w,Z_FINISH);
+		deflateEnd(&w->z);
+	} else {
+		BZ2_bzWriteClose(&bz2err, w->bz, 0, NULL, NULL);
+		if (bz2err != BZ_OK)
+			errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+	};
+}
+
+// Suffix arrays can be kept on disk between runs, one file per old
+// file named for the SHA-1 of its contents, and mapped back in rather
+// than sorted again.  A file is
+//
+//	0	8	"BSDIFFSA"
+//	8	8	oldsize
+//	16	8	bytes per entry (4 or 8)
+//	24	??	the oldsize+1 entries, native byte order
+//
+// Old files under BSDIFF_CACHE_MIN bytes are cheaper to sort than to
+// look up, and never go through the cache.
+
+#define BSDIFF_CACHE_MIN (1024*1024)
+#define BSDIFF_CACHE_HEADER 24
+
+static const char *cache_dir=NULL;
+
+void bsdiff_set_index_cache(const char *dir)
+{
+	cache_dir=dir;
+}
+
+static char *cache_path(u_char *old,off_t oldsize)
+{
+	SHA_CTX ctx;
+	const uint8_t *digest;
+	char *path;
+	off_t pos;
+	int i,len;
+
+	SHA_init(&ctx);
+	for(pos=0;pos<oldsize;pos+=len) {
+		len=MIN(oldsize-pos,BSDIFF_CACHE_MIN);
+		SHA_update(&ctx,old+pos,len);
+	};
+	digest=SHA_final(&ctx);
+	len=strlen(cache_dir)+1+SHA_DIGEST_SIZE*2+4;
+	if((path=malloc(len))==NULL) err(1,NULL);
+	len=sprintf(path,"%s/",cache_dir);
+	for(i=0;i<SHA_DIGEST_SIZE;i++)
+		len+=sprintf(path+len,"%02x",digest[i]);
+	strcpy(path+len,".sa");
+	return path;
+}
+
+static int load_cached_index(const char *path,off_t oldsize,
+		BsdiffIndex *index)
+{
+	struct stat st;
+	u_char *map;
+	off_t width;
+	int fd;
+
+	if((fd=open(path,O_RDONLY))<0) return -1;
+	if((fstat(fd,&st)!=0) || (st.st_size<BSDIFF_CACHE_HEADER)) {
+		close(fd);
+		return -1;
+	};
+	map=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if(map==MAP_FAILED) return -1;
+
+	width=offtin(map+16);
+	if((memcmp(map,"BSDIFFSA",8)!=0) || (offtin(map+8)!=oldsize) ||
+		((width!=sizeof(int32_t)) && (width!=sizeof(off_t))) ||
+		(st.st_size!=BSDIFF_CACHE_HEADER+(oldsize+1)*width)) {
+		munmap(map,st.st_size);
+		return -1;
+	};
+
+	if(width==sizeof(int32_t))
+		index->I32=(int32_t *)(map+BSDIFF_CACHE_HEADER);
+	else
+		index->I=(off_t *)(map+BSDIFF_CACHE_HEADER);
+	return 0;
+}
+
+// Write the index to a temporary file and rename it into place, so a
+// concurrent run never maps a half-written one.  Failure just means
+// the next run sorts again.
+static void save_cached_index(const char *path,off_t oldsize,
+		const BsdiffIndex *index)
+{
+	u_char header[BSDIFF_CACHE_HEADER];
+	char *tmp;
+	off_t width;
+	const void *data;
+	FILE *f;
+	int fd,ok;
+
+	width=index->I32 ? sizeof(int32_t) : sizeof(off_t);
+	data=index->I32 ? (const void *)index->I32 : (const void *)index->I;
+
+	if((tmp=malloc(strlen(path)+8))==NULL) err(1,NULL);
+	sprintf(tmp,"%s.XXXXXX",path);
+	if((fd=mkstemp(tmp))<0) {
+		warn("can't cache suffix array in %s",cache_dir);
+		free(tmp);
+		return;
+	};
+	if((f=fdopen(fd,"wb"))==NULL) {
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return;
+	};
+
+	memcpy(header,"BSDIFFSA",8);
+	offtout(oldsize,header+8);
+	offtout(width,header+16);
+	ok=(fwrite(header,sizeof(header),1,f)==1) &&
+		(fwrite(data,width,oldsize+1,f)==(size_t)(oldsize+1));
+	if(fclose(f)!=0) ok=0;
+	if(!ok || (rename(tmp,path)!=0)) {
+		warn("can't write %s",tmp);
+		unlink(tmp);
+	};
+	free(tmp);
+}
+
+// Build the suffix array bsdiff() needs for old, or map it from the
+// cache directory if one is set and already holds it.  Callers that
+// diff several targets against one old file from different threads
+// can build it once up front and pass it in.
+BsdiffIndex* bsdiff_index(u_char* old, off_t oldsize)
+{
+        BsdiffIndex* index;
+        char* path = NULL;
+
+        if ((index = calloc(1, sizeof(BsdiffIndex))) == NULL) err(1, NULL);
+        if (cache_dir != NULL && oldsize >= BSDIFF_CACHE_MIN) {
+            path = cache_path(old, oldsize);
+            if (load_cached_index(path, oldsize, index) == 0) {
+                free(path);
+                return index;
+            }
+        }
+        if (oldsize < INT32_MAX) {
+            index->I32 = sufsort32(old, oldsize);
+        } else {
+            off_t* V;
+            if (((index->I = malloc((oldsize+1) * sizeof(off_t))) == NULL) ||
+                ((V = malloc((oldsize+1) * sizeof(off_t))) == NULL))
+                err(1, NULL);
+            qsufsort(index->I, V, old, oldsize);
+            free(V);
+        }
+        if (path != NULL) {
+            save_cached_index(path, oldsize, index);
+            free(path);
+        }
+        return index;
+}
+
+// This is main() from bsdiff.c, with the following changes:
+//
+//    - old, oldsize, new, newsize are arguments; we don't load this
+//      data from files.  old and new are owned by the caller; we
+//      don't free them at the end.
+//
+//    - the suffix array of old is owned by the caller, who passes a
+//      pointer to *IP, which can be NULL.  This way if we call
+//      bsdiff() multiple times with the same 'old' data, we only do
+//      the sort the first time.
+//
+//    - the sort is done with SA-IS into 32-bit offsets, falling back
+//      to qsufsort() only when old is too big for them.
+//
+//    - a large new file is cut into up to BSDIFF_MAX_WORKERS segments
+//      that are scanned on separate threads.  Matches don't cross the
+//      cuts, so the patch can be slightly bigger than a serial scan
+//      would make; files under two BSDIFF_MIN_SEGMENTs are scanned
+//      in one piece and give exactly the bsdiff-4.3 result.
+//
+int bsdiff(u_char* old, off_t oldsize, BsdiffIndex** IP, u_char* new,
+           off_t newsize, const char* patch_filename)
+{
+	ScanSegment segs[BSDIFF_MAX_WORKERS];
+	pthread_t threads[BSDIFF_MAX_WORKERS];
+	int nsegs,k;
+	long cpus;
+	off_t len,oldpos,segstart,seglen;
+	off_t i;
+	u_char buf[8];
+	u_char header[32];
+	FILE * pf;
+	BlockWriter w;
+
+        if (*IP == NULL) *IP = bsdiff_index(old, oldsize);
+
+        nsegs = newsize / BSDIFF_MIN_SEGMENT;
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nsegs > cpus) nsegs = cpus;
+        if (nsegs > BSDIFF_MAX_WORKERS) nsegs = BSDIFF_MAX_WORKERS;
+        if (nsegs < 1) nsegs = 1;
+
+        memset(segs, 0, sizeof(segs));
+        segstart = 0;
+        for (k = 0; k < nsegs; ++k) {
+            seglen = (newsize - segstart) / (nsegs - k);
+            segs[k].old = old;
+            segs[k].oldsize = oldsize;
+            segs[k].I = *IP;
+            segs[k].new = new + segstart;
+            segs[k].newsize = seglen;
+            segstart += seglen;
+        }
+        for (k = 1; k < nsegs; ++k) {
+            if (pthread_create(&threads[k], NULL, scan_segment, &segs[k]) != 0)
+                errx(1, "pthread_create failed");
+        }
+        scan_segment(&segs[0]);
+        for (k = 1; k < nsegs; ++k) {
+            pthread_join(threads[k], NULL);
+        }
+
+        // Each segment's seeks assume oldpos was 0 when it began; fold
+        // the difference into the last seek of the segment before it.
+        oldpos = 0;
+        for (k = 0; k < nsegs; ++k) {
+            for (i = 0; i < segs[k].nctrl; i += 3) {
+                oldpos += segs[k].ctrl[i] + segs[k].ctrl[i+2];
+            }
+            if (k < nsegs-1 && segs[k].nctrl > 0) {
+                segs[k].ctrl[segs[k].nctrl-1] -= oldpos;
+                oldpos = 0;
+            }
+        }
+
+	/* Create the patch file */
+	if ((pf = fopen(patch_filename, "w")) == NULL)
+              err(1, "%s", patch_filename);
+
+	/* Header is
+		0	8	 "BSDIFF40"
+		8	8	length of bzip2ed ctrl block
+		16	8	length of bzip2ed diff block
+		24	8	length of new file */
+	/* File is
+		0	32	Header
+		32	??	Bzip2ed ctrl block
+		??	??	Bzip2ed diff block
+		??	??	Bzip2ed extra block */
+	memcpy(header,use_zlib ? "BSDIFFZL" : "BSDIFF40",8);
+	offtout(0, header + 8);
+	offtout(0, header + 16);
+	offtout(newsize, header + 24);
+	if (fwrite(header, 32, 1, pf) != 1)
+		err(1, "fwrite(%s)", patch_filename);
+
+	/* Write the ctrl triples */
+	block_open(&w, pf);
+	for (k = 0; k < nsegs; ++k) {
+		for (i = 0; i < segs[k].nctrl; ++i) {
+			offtout(segs[k].ctrl[i],buf);
+			block_write(&w, buf, 8);
 		};
 	};
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+	block_close(&w);
 
 	/* Compute size of compressed ctrl data */
 	if ((len = ftello(pf)) == -1)
@@ -370,14 +873,10 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	offtout(len-32, header + 8);
 
 	/* Write compressed diff data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, db, dblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+	block_open(&w, pf);
+	for (k = 0; k < nsegs; ++k)
+		block_write(&w, segs[k].db, segs[k].dblen);
+	block_close(&w);
 
 	/* Compute size of compressed diff data */
 	if ((newsize = ftello(pf)) == -1)
@@ -385,14 +884,10 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	offtout(newsize - len, header + 16);
 
 	/* Write compressed extra data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, eb, eblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+	block_open(&w, pf);
+	for (k = 0; k < nsegs; ++k)
+		block_write(&w, segs[k].eb, segs[k].eblen);
+	block_close(&w);
 
 	/* Seek to the beginning, write the header, and close the file */
 	if (fseeko(pf, 0, SEEK_SET))
@@ -403,8 +898,11 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 		err(1, "fclose");
 
 	/* Free the memory we used */
-	free(db);
-	free(eb);
+	for (k = 0; k < nsegs; ++k) {
+		free(segs[k].ctrl);
+		free(segs[k].db);
+		free(segs[k].eb);
+	}
 
 	return 0;
 }
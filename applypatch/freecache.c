@@ -10,13 +10,26 @@
 #include <ctype.h>
 
 #include "applypatch.h"
+#include "minzip/Budget.h"
 
-static int EliminateOpenFiles(char** files, int file_count) {
+static int CompareStrings(const void* a, const void* b) {
+  return strcmp(*(const char**)a, *(const char**)b);
+}
+
+// Collect the names of every file under /cache that any process has
+// open, in one pass over /proc/*/fd.  On success *open_files is a
+// sorted array of *count names, for bsearch() with CompareStrings.
+static int FindOpenCacheFiles(char*** open_files, int* count) {
   DIR* d;
   struct dirent* de;
+  int size = 32;
+  *count = 0;
+  *open_files = malloc(size * sizeof(char*));
+
   d = opendir("/proc");
   if (d == NULL) {
     printf("error opening /proc: %s\n", strerror(errno));
+    free(*open_files);
     return -1;
   }
   while ((de = readdir(d)) != 0) {
@@ -44,23 +57,17 @@ static int EliminateOpenFiles(char** files, int file_count) {
       strcpy(fd_path, path);
       strcat(fd_path, fdde->d_name);
 
-      int count;
-      count = readlink(fd_path, link, sizeof(link)-1);
-      if (count >= 0) {
-        link[count] = '\0';
-
-        // This is inefficient, but it should only matter if there are
-        // lots of files in /cache, and lots of them are open (neither
-        // of which should be true, especially in recovery).
+      int len;
+      len = readlink(fd_path, link, sizeof(link)-1);
+      if (len >= 0) {
+        link[len] = '\0';
         if (strncmp(link, "/cache/", 7) == 0) {
-          int j;
-          for (j = 0; j < file_count; ++j) {
-            if (files[j] && strcmp(files[j], link) == 0) {
-              printf("%s is open by %s\n", link, de->d_name);
-              free(files[j]);
-              files[j] = NULL;
-            }
+          printf("%s is open by %s\n", link, de->d_name);
+          if (*count >= size) {
+            size *= 2;
+            *open_files = realloc(*open_files, size * sizeof(char*));
           }
+          (*open_files)[(*count)++] = strdup(link);
         }
       }
     }
@@ -68,15 +75,41 @@ static int EliminateOpenFiles(char** files, int file_count) {
   }
   closedir(d);
 
+  qsort(*open_files, *count, sizeof(char*), CompareStrings);
   return 0;
 }
 
-int FindExpendableFiles(char*** names, int* entries) {
+typedef struct {
+  char* name;
+  off_t size;
+  time_t mtime;
+} ExpendableFile;
+
+// Biggest files first, so that as few files as possible are deleted;
+// among files of the same size, the least recently modified first.
+static int CompareExpendable(const void* a, const void* b) {
+  const ExpendableFile* fa = (const ExpendableFile*)a;
+  const ExpendableFile* fb = (const ExpendableFile*)b;
+  if (fa->size != fb->size) return fa->size < fb->size ? 1 : -1;
+  if (fa->mtime != fb->mtime) return fa->mtime < fb->mtime ? -1 : 1;
+  return strcmp(fa->name, fb->name);
+}
+
+// Find the regular files we're allowed to delete, that nothing has
+// open, in the order they should be deleted.
+static int FindExpendableFiles(ExpendableFile** files, int* entries) {
   DIR* d;
   struct dirent* de;
   int size = 32;
   *entries = 0;
-  *names = malloc(size * sizeof(char*));
+
+  char** open_files;
+  int open_count;
+  if (FindOpenCacheFiles(&open_files, &open_count) < 0) {
+    return -1;
+  }
+
+  *files = malloc(size * sizeof(ExpendableFile));
 
   char path[FILENAME_MAX];
 
@@ -103,70 +136,93 @@ int FindExpendableFiles(char*** names, int* entries) {
       // be there.
       if (strcmp(path, CACHE_TEMP_SOURCE) == 0) continue;
 
+      char* key = path;
+      if (bsearch(&key, open_files, open_count, sizeof(char*),
+                  CompareStrings) != NULL) {
+        continue;
+      }
+
       struct stat st;
       if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
         if (*entries >= size) {
           size *= 2;
-          *names = realloc(*names, size * sizeof(char*));
+          *files = realloc(*files, size * sizeof(ExpendableFile));
         }
-        (*names)[(*entries)++] = strdup(path);
+        ExpendableFile* f = *files + (*entries)++;
+        f->name = strdup(path);
+        f->size = st.st_size;
+        f->mtime = st.st_mtime;
       }
     }
 
     closedir(d);
   }
 
-  printf("%d regular files in deletable directories\n", *entries);
-
-  if (EliminateOpenFiles(*names, *entries) < 0) {
-    return -1;
+  int j;
+  for (j = 0; j < open_count; ++j) {
+    free(open_files[j]);
   }
+  free(open_files);
+
+  printf("%d unopened regular files in deletable directories\n", *entries);
 
+  qsort(*files, *entries, sizeof(ExpendableFile), CompareExpendable);
   return 0;
 }
 
+// Once room on /cache has been made for a patch, buffers over the
+// memory budget mustn't be spilled into it (minzip/Budget.h), or the
+// patch that fitted a moment ago runs out of space.
+static void KeepFreeForPatch(size_t bytes) {
+  struct stat cache_st, spill_st;
+  const char* spill_dir = getenv(MZ_BUDGET_SPILL_ENV);
+  if (spill_dir == NULL) spill_dir = MZ_BUDGET_SPILL_DIR;
+  if (*spill_dir != '\0' && stat("/cache", &cache_st) == 0 &&
+      stat(spill_dir, &spill_st) == 0 && cache_st.st_dev == spill_st.st_dev) {
+    mzBudgetKeepFree(bytes);
+  }
+}
+
 int MakeFreeSpaceOnCache(size_t bytes_needed) {
   size_t free_now = FreeSpaceForFile("/cache");
   printf("%ld bytes free on /cache (%ld needed)\n",
          (long)free_now, (long)bytes_needed);
 
   if (free_now >= bytes_needed) {
+    KeepFreeForPatch(bytes_needed);
     return 0;
   }
 
-  char** names;
+  ExpendableFile* files;
   int entries;
 
-  if (FindExpendableFiles(&names, &entries) < 0) {
+  if (FindExpendableFiles(&files, &entries) < 0) {
     return -1;
   }
 
   if (entries == 0) {
     // nothing we can delete to free up space!
     printf("no files can be deleted to free space on /cache\n");
+    free(files);
     return -1;
   }
 
-  // We could try to be smarter about which files to delete:  the
-  // biggest ones?  the smallest ones that will free up enough space?
-  // the oldest?  the newest?
-  //
-  // Instead, we'll be dumb.
-
+  // Delete the biggest files first, stopping as soon as there's
+  // enough room.
   int i;
   for (i = 0; i < entries && free_now < bytes_needed; ++i) {
-    if (names[i]) {
-      unlink(names[i]);
-      free_now = FreeSpaceForFile("/cache");
-      printf("deleted %s; now %ld bytes free\n", names[i], (long)free_now);
-      free(names[i]);
-    }
+    unlink(files[i].name);
+    free_now = FreeSpaceForFile("/cache");
+    printf("deleted %s (%ld bytes); now %ld bytes free\n",
+           files[i].name, (long)files[i].size, (long)free_now);
   }
 
-  for (; i < entries; ++i) {
-    free(names[i]);
+  for (i = 0; i < entries; ++i) {
+    free(files[i].name);
   }
-  free(names);
+  free(files);
 
-  return (free_now >= bytes_needed) ? 0 : -1;
+  if (free_now < bytes_needed) return -1;
+  KeepFreeForPatch(bytes_needed);
+  return 0;
 }
@@ -114,6 +114,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -125,6 +126,9 @@
 #include "imgdiff.h"
 #include "utils.h"
 
+// Suffix array of a chunk's data, built by bsdiff.c.
+typedef struct BsdiffIndex BsdiffIndex;
+
 typedef struct {
   int type;             // CHUNK_NORMAL, CHUNK_DEFLATE
   size_t start;         // offset of chunk in original image file
@@ -135,7 +139,7 @@ typedef struct {
   size_t source_start;
   size_t source_len;
 
-  off_t* I;             // used by bsdiff
+  BsdiffIndex* I;       // used by bsdiff
 
   // --- for CHUNK_DEFLATE chunks only: ---
 
@@ -171,8 +175,66 @@ static int fileentry_compare(const void* a, const void* b) {
 }
 
 // from bsdiff.c
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
-           const char* patch_filename);
+void bsdiff_set_index_cache(const char* dir);
+void bsdiff_use_zlib(int enable);
+BsdiffIndex* bsdiff_index(u_char* old, off_t oldsize);
+int bsdiff(u_char* old, off_t oldsize, BsdiffIndex** IP, u_char* new,
+           off_t newsize, const char* patch_filename);
+
+#define IMGDIFF_MAX_WORKERS 4
+
+typedef struct {
+  void (*fn)(int i, void* cookie);
+  void* cookie;
+  int count;
+  int next;
+  pthread_mutex_t lock;
+} WorkQueue;
+
+static void* WorkQueueThread(void* arg) {
+  WorkQueue* q = (WorkQueue*)arg;
+  for (;;) {
+    pthread_mutex_lock(&q->lock);
+    int i = q->next++;
+    pthread_mutex_unlock(&q->lock);
+    if (i >= q->count) break;
+    q->fn(i, q->cookie);
+  }
+  return NULL;
+}
+
+/*
+ * Call fn(i, cookie) for every i in [0, count), on up to
+ * IMGDIFF_MAX_WORKERS threads (one per online CPU), and wait for all
+ * of them.  Items are handed out in order but may finish in any
+ * order; fn must only touch state belonging to item i.
+ */
+static void RunInParallel(int count, void (*fn)(int, void*), void* cookie) {
+  WorkQueue q;
+  pthread_t threads[IMGDIFF_MAX_WORKERS];
+  int workers = sysconf(_SC_NPROCESSORS_ONLN);
+  int started = 0;
+  int i;
+
+  if (workers > IMGDIFF_MAX_WORKERS) workers = IMGDIFF_MAX_WORKERS;
+  if (workers > count) workers = count;
+
+  q.fn = fn;
+  q.cookie = cookie;
+  q.count = count;
+  q.next = 0;
+  pthread_mutex_init(&q.lock, NULL);
+  for (i = 1; i < workers; ++i) {
+    if (pthread_create(threads+started, NULL, WorkQueueThread, &q) == 0) {
+      ++started;
+    }
+  }
+  WorkQueueThread(&q);
+  for (i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&q.lock);
+}
 
 unsigned char* ReadZip(const char* filename,
                        int* num_chunks, ImageChunk** chunks,
@@ -595,6 +657,9 @@ int ReconstructDeflateChunk(ImageChunk* chunk) {
  * by running bsdiff in a subprocess.  Return the patch data, placing
  * its length in *size.  Return NULL on failure.  We expect the bsdiff
  * program to be in the path.
+ *
+ * Safe to call for different targets at once, provided src->I is
+ * already built when one source is shared by several of them.
  */
 unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   if (tgt->type == CHUNK_NORMAL) {
@@ -606,7 +671,12 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   }
 
   char ptemp[] = "/tmp/imgdiff-patch-XXXXXX";
-  mkstemp(ptemp);
+  int fd = mkstemp(ptemp);
+  if (fd < 0) {
+    printf("failed to create patch file %s: %s\n", ptemp, strerror(errno));
+    return NULL;
+  }
+  close(fd);
 
   int r = bsdiff(src->data, src->len, &(src->I), tgt->data, tgt->len, ptemp);
   if (r != 0) {
@@ -771,20 +841,61 @@ void DumpChunks(ImageChunk* chunks, int num_chunks) {
     }
 }
 
-int main(int argc, char** argv) {
-  if (argc != 4 && argc != 5) {
-    usage:
-    printf("usage: %s [-z] <src-img> <tgt-img> <patch-file>\n",
-            argv[0]);
-    return 2;
+typedef struct {
+  ImageChunk* chunks;
+  int* results;
+} ReconstructJob;
+
+static void ReconstructWorker(int i, void* cookie) {
+  ReconstructJob* job = (ReconstructJob*)cookie;
+  if (job->chunks[i].type == CHUNK_DEFLATE) {
+    job->results[i] = ReconstructDeflateChunk(job->chunks+i);
   }
+}
+
+typedef struct {
+  ImageChunk** src_of;
+  ImageChunk* tgt_chunks;
+  unsigned char** patch_data;
+  size_t* patch_size;
+} PatchJob;
+
+static void PatchWorker(int i, void* cookie) {
+  PatchJob* job = (PatchJob*)cookie;
+  job->patch_data[i] = MakePatch(job->src_of[i], job->tgt_chunks+i,
+                                 job->patch_size+i);
+}
 
+int main(int argc, char** argv) {
+  const char* prog = argv[0];
   int zip_mode = 0;
 
-  if (strcmp(argv[1], "-z") == 0) {
-    zip_mode = 1;
-    --argc;
-    ++argv;
+  // -c <dir> keeps suffix arrays of large sources in dir, so that
+  // diffing one source against many targets sorts it only once.
+  // -f writes chunk patches with zlib rather than bzip2 blocks, which
+  // devices apply faster; they need an applypatch that knows BSDIFFZL.
+  while (argc > 1 && argv[1][0] == '-') {
+    if (strcmp(argv[1], "-z") == 0) {
+      zip_mode = 1;
+      --argc;
+      ++argv;
+    } else if (strcmp(argv[1], "-f") == 0) {
+      bsdiff_use_zlib(1);
+      --argc;
+      ++argv;
+    } else if (strcmp(argv[1], "-c") == 0 && argc > 2) {
+      bsdiff_set_index_cache(argv[2]);
+      argc -= 2;
+      argv += 2;
+    } else {
+      break;
+    }
+  }
+
+  if (argc != 4) {
+    printf("usage: %s [-z] [-f] [-c <cache-dir>] "
+           "<src-img> <tgt-img> <patch-file>\n", prog);
+    return 2;
   }
 
 
@@ -844,13 +955,19 @@ int main(int argc, char** argv) {
     }
   }
 
+  // Confirm that given the uncompressed chunk data in the target, we
+  // can recompress it and get exactly the same bits as are in the
+  // input target image.  Each chunk is independent, so run the
+  // searches in parallel and act on the results in order below.
+  int* reconstructed = malloc(num_tgt_chunks * sizeof(int));
+  ReconstructJob reconstruct_job = { tgt_chunks, reconstructed };
+  RunInParallel(num_tgt_chunks, ReconstructWorker, &reconstruct_job);
+
   for (i = 0; i < num_tgt_chunks; ++i) {
     if (tgt_chunks[i].type == CHUNK_DEFLATE) {
-      // Confirm that given the uncompressed chunk data in the target, we
-      // can recompress it and get exactly the same bits as are in the
-      // input target image.  If this fails, treat the chunk as a normal
-      // non-deflated chunk.
-      if (ReconstructDeflateChunk(tgt_chunks+i) < 0) {
+      // If the target couldn't be reconstructed, treat the chunk as a
+      // normal non-deflated chunk.
+      if (reconstructed[i] < 0) {
         printf("failed to reconstruct target deflate chunk %d [%s]; "
                "treating as normal\n", i, tgt_chunks[i].filename);
         ChangeDeflateChunkToNormal(tgt_chunks+i);
@@ -912,18 +1029,35 @@ int main(int argc, char** argv) {
   printf("Construct patches for %d chunks...\n", num_tgt_chunks);
   unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
   size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  PatchJob patch_job;
+  patch_job.src_of = malloc(num_tgt_chunks * sizeof(ImageChunk*));
+  patch_job.tgt_chunks = tgt_chunks;
+  patch_job.patch_data = patch_data;
+  patch_job.patch_size = patch_size;
   for (i = 0; i < num_tgt_chunks; ++i) {
+    ImageChunk* src;
     if (zip_mode) {
-      ImageChunk* src;
-      if (tgt_chunks[i].type == CHUNK_DEFLATE &&
+      if (tgt_chunks[i].type != CHUNK_DEFLATE ||
           (src = FindChunkByName(tgt_chunks[i].filename, src_chunks,
-                                 num_src_chunks))) {
-        patch_data[i] = MakePatch(src, tgt_chunks+i, patch_size+i);
-      } else {
-        patch_data[i] = MakePatch(src_chunks, tgt_chunks+i, patch_size+i);
+                                 num_src_chunks)) == NULL) {
+        src = src_chunks;
       }
     } else {
-      patch_data[i] = MakePatch(src_chunks+i, tgt_chunks+i, patch_size+i);
+      src = src_chunks+i;
+    }
+    patch_job.src_of[i] = src;
+    if (zip_mode && src == src_chunks && src->I == NULL) {
+      // Normal target chunks are all diffed against the whole source
+      // file; build its index once here rather than racing to build
+      // it in the workers.
+      src->I = bsdiff_index(src->data, src->len);
+    }
+  }
+  RunInParallel(num_tgt_chunks, PatchWorker, &patch_job);
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    if (patch_data[i] == NULL) {
+      printf("failed to construct patch for chunk %d\n", i);
+      return 1;
     }
     printf("patch %3d is %d bytes (of %d)\n",
            i, patch_size[i], tgt_chunks[i].source_len);
@@ -17,7 +17,9 @@
 // See imgdiff.c in this directory for a description of the patch file
 // format.
 
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
@@ -25,195 +27,402 @@
 
 #include "zlib.h"
 #include "mincrypt/sha.h"
+#include "minzip/Budget.h"
 #include "applypatch.h"
 #include "imgdiff.h"
 #include "utils.h"
 
+// Deflate chunks are patched and recompressed on up to this many
+// threads, while the output is still written in chunk order.
+#define IMGPATCH_MAX_WORKERS 4
+
+// How far past the chunk being written the workers may run; each
+// finished chunk is held in memory until its turn comes.
+#define IMGPATCH_LOOKAHEAD (IMGPATCH_MAX_WORKERS * 2)
+
+enum { CHUNK_PENDING, CHUNK_BUSY, CHUNK_DONE, CHUNK_FAILED };
+
+typedef struct {
+    int type;
+    char* header;           // the chunk's header fields, within the patch
+    ssize_t raw_len;        // CHUNK_RAW data, which follows the header
+
+    // CHUNK_DEFLATE only: the recompressed target.
+    int state;
+    unsigned char* out;
+    ssize_t out_len;
+} ImageChunk;
+
+typedef struct {
+    const unsigned char* old_data;
+    ssize_t old_size;
+    const Value* patch;
+    ImageChunk* chunks;
+    int num_chunks;
+    int next;               // first chunk not yet written
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ImagePatch;
+
 /*
- * Apply the patch given in 'patch_filename' to the source data given
- * by (old_data, old_size).  Write the patched output to the 'output'
- * file, and update the SHA context with the output data as well.
- * Return 0 on success.
+ * Work out where each chunk's header (and raw data) is, checking that
+ * all of it lies within the patch.  Returns the chunk table, or NULL.
  */
-int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
-                    const Value* patch,
-                    SinkFn sink, void* token, SHA_CTX* ctx) {
-    ssize_t pos = 12;
-    char* header = patch->data;
-    if (patch->size < 12) {
-        printf("patch too short to contain header\n");
-        return -1;
+static ImageChunk* ParseChunks(const Value* patch, int num_chunks) {
+    ImageChunk* chunks = calloc(num_chunks > 0 ? num_chunks : 1,
+                                sizeof(ImageChunk));
+    if (chunks == NULL) {
+        printf("failed to allocate table for %d chunks\n", num_chunks);
+        return NULL;
     }
 
-    // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW.
-    // (IMGDIFF1, which is no longer supported, used CHUNK_NORMAL and
-    // CHUNK_GZIP.)
-    if (memcmp(header, "IMGDIFF2", 8) != 0) {
-        printf("corrupt patch file header (magic number)\n");
-        return -1;
-    }
-
-    int num_chunks = Read4(header+8);
-
+    ssize_t pos = 12;
     int i;
     for (i = 0; i < num_chunks; ++i) {
         // each chunk's header record starts with 4 bytes.
         if (pos + 4 > patch->size) {
             printf("failed to read chunk %d record\n", i);
-            return -1;
+            goto fail;
         }
         int type = Read4(patch->data + pos);
         pos += 4;
+        chunks[i].type = type;
+        chunks[i].header = patch->data + pos;
 
         if (type == CHUNK_NORMAL) {
-            char* normal_header = patch->data + pos;
             pos += 24;
             if (pos > patch->size) {
                 printf("failed to read chunk %d normal header data\n", i);
-                return -1;
+                goto fail;
             }
-
-            size_t src_start = Read8(normal_header);
-            size_t src_len = Read8(normal_header+8);
-            size_t patch_offset = Read8(normal_header+16);
-
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
         } else if (type == CHUNK_RAW) {
-            char* raw_header = patch->data + pos;
             pos += 4;
             if (pos > patch->size) {
                 printf("failed to read chunk %d raw header data\n", i);
-                return -1;
+                goto fail;
             }
-
-            ssize_t data_len = Read4(raw_header);
-
-            if (pos + data_len > patch->size) {
+            chunks[i].raw_len = Read4((unsigned char*)chunks[i].header);
+            if (chunks[i].raw_len < 0 ||
+                pos + chunks[i].raw_len > patch->size) {
                 printf("failed to read chunk %d raw data\n", i);
-                return -1;
+                goto fail;
             }
-            SHA_update(ctx, patch->data + pos, data_len);
-            if (sink((unsigned char*)patch->data + pos,
-                     data_len, token) != data_len) {
-                printf("failed to write chunk %d raw data\n", i);
-                return -1;
-            }
-            pos += data_len;
+            pos += chunks[i].raw_len;
         } else if (type == CHUNK_DEFLATE) {
             // deflate chunks have an additional 60 bytes in their chunk header.
-            char* deflate_header = patch->data + pos;
             pos += 60;
             if (pos > patch->size) {
                 printf("failed to read chunk %d deflate header data\n", i);
-                return -1;
+                goto fail;
             }
+        } else {
+            printf("patch chunk %d is unknown type %d\n", i, type);
+            goto fail;
+        }
+    }
+    return chunks;
 
-            size_t src_start = Read8(deflate_header);
-            size_t src_len = Read8(deflate_header+8);
-            size_t patch_offset = Read8(deflate_header+16);
-            size_t expanded_len = Read8(deflate_header+24);
-            size_t target_len = Read8(deflate_header+32);
-            int level = Read4(deflate_header+40);
-            int method = Read4(deflate_header+44);
-            int windowBits = Read4(deflate_header+48);
-            int memLevel = Read4(deflate_header+52);
-            int strategy = Read4(deflate_header+56);
-
-            // Decompress the source data; the chunk header tells us exactly
-            // how big we expect it to be when decompressed.
-
-            unsigned char* expanded_source = malloc(expanded_len);
-            if (expanded_source == NULL) {
-                printf("failed to allocate %d bytes for expanded_source\n",
-                       expanded_len);
-                return -1;
-            }
+fail:
+    free(chunks);
+    return NULL;
+}
 
-            z_stream strm;
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = src_len;
-            strm.next_in = (unsigned char*)(old_data + src_start);
-            strm.avail_out = expanded_len;
-            strm.next_out = expanded_source;
-
-            int ret;
-            ret = inflateInit2(&strm, -15);
-            if (ret != Z_OK) {
-                printf("failed to init source inflation: %d\n", ret);
-                return -1;
-            }
+/*
+ * Inflate a deflate chunk's source, bspatch it and deflate the result
+ * again with the parameters recorded in the chunk header.  The output
+ * goes in chunk->out.  Safe to run on several chunks at once.
+ */
+static int PatchDeflateChunk(const unsigned char* old_data, ssize_t old_size,
+                             const Value* patch, ImageChunk* chunk) {
+    char* deflate_header = chunk->header;
+    size_t src_start = Read8(deflate_header);
+    size_t src_len = Read8(deflate_header+8);
+    size_t patch_offset = Read8(deflate_header+16);
+    size_t expanded_len = Read8(deflate_header+24);
+    size_t target_len = Read8(deflate_header+32);
+    int level = Read4(deflate_header+40);
+    int method = Read4(deflate_header+44);
+    int windowBits = Read4(deflate_header+48);
+    int memLevel = Read4(deflate_header+52);
+    int strategy = Read4(deflate_header+56);
 
-            // Because we've provided enough room to accommodate the output
-            // data, we expect one call to inflate() to suffice.
-            ret = inflate(&strm, Z_SYNC_FLUSH);
-            if (ret != Z_STREAM_END) {
-                printf("source inflation returned %d\n", ret);
-                return -1;
-            }
-            // We should have filled the output buffer exactly.
-            if (strm.avail_out != 0) {
-                printf("source inflation short by %d bytes\n", strm.avail_out);
-                return -1;
-            }
-            inflateEnd(&strm);
-
-            // Next, apply the bsdiff patch (in memory) to the uncompressed
-            // data.
-            unsigned char* uncompressed_target_data;
-            ssize_t uncompressed_target_size;
-            if (ApplyBSDiffPatchMem(expanded_source, expanded_len,
-                                    patch, patch_offset,
-                                    &uncompressed_target_data,
-                                    &uncompressed_target_size) != 0) {
-                return -1;
-            }
+    if (src_start > (size_t) old_size || src_len > old_size - src_start) {
+        printf("deflate chunk source is outside the file\n");
+        return -1;
+    }
 
-            // Now compress the target data and append it to the output.
-
-            // we're done with the expanded_source data buffer, so we'll
-            // reuse that memory to receive the output of deflate.
-            unsigned char* temp_data = expanded_source;
-            ssize_t temp_size = expanded_len;
-            if (temp_size < 32768) {
-                // ... unless the buffer is too small, in which case we'll
-                // allocate a fresh one.
-                free(temp_data);
-                temp_data = malloc(32768);
-                temp_size = 32768;
-            }
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+
+    unsigned char* expanded_source = mzBudgetAlloc(expanded_len, 0);
+    if (expanded_source == NULL) {
+        printf("failed to allocate %d bytes for expanded_source\n",
+               expanded_len);
+        return -1;
+    }
+
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = src_len;
+    strm.next_in = (unsigned char*)(old_data + src_start);
+    strm.avail_out = expanded_len;
+    strm.next_out = expanded_source;
+
+    int ret;
+    ret = inflateInit2(&strm, -15);
+    if (ret != Z_OK) {
+        printf("failed to init source inflation: %d\n", ret);
+        mzBudgetFree(expanded_source);
+        return -1;
+    }
+
+    // Because we've provided enough room to accommodate the output
+    // data, we expect one call to inflate() to suffice.
+    ret = inflate(&strm, Z_SYNC_FLUSH);
+    int avail_out = strm.avail_out;
+    inflateEnd(&strm);
+    if (ret != Z_STREAM_END) {
+        printf("source inflation returned %d\n", ret);
+        mzBudgetFree(expanded_source);
+        return -1;
+    }
+    // We should have filled the output buffer exactly.
+    if (avail_out != 0) {
+        printf("source inflation short by %d bytes\n", avail_out);
+        mzBudgetFree(expanded_source);
+        return -1;
+    }
+
+    // Next, apply the bsdiff patch (in memory) to the uncompressed
+    // data.
+    unsigned char* uncompressed_target_data;
+    ssize_t uncompressed_target_size;
+    ret = ApplyBSDiffPatchMem(expanded_source, expanded_len,
+                              patch, patch_offset,
+                              &uncompressed_target_data,
+                              &uncompressed_target_size);
+    mzBudgetFree(expanded_source);
+    if (ret != 0) {
+        return -1;
+    }
+
+    // Now compress the target data, all in one go, into a buffer big
+    // enough for the worst case.
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
+    if (ret != Z_OK) {
+        printf("failed to init target deflation: %d\n", ret);
+        mzBudgetFree(uncompressed_target_data);
+        return -1;
+    }
+    ssize_t bound = deflateBound(&strm, uncompressed_target_size);
+    chunk->out = mzBudgetAlloc(bound, 0);
+    if (chunk->out == NULL) {
+        printf("failed to allocate %ld bytes for deflate output\n",
+               (long)bound);
+        deflateEnd(&strm);
+        mzBudgetFree(uncompressed_target_data);
+        return -1;
+    }
+    strm.avail_in = uncompressed_target_size;
+    strm.next_in = uncompressed_target_data;
+    strm.avail_out = bound;
+    strm.next_out = chunk->out;
+    ret = deflate(&strm, Z_FINISH);
+    chunk->out_len = bound - strm.avail_out;
+    deflateEnd(&strm);
+    mzBudgetFree(uncompressed_target_data);
+    if (ret != Z_STREAM_END) {
+        printf("target deflation returned %d\n", ret);
+        return -1;
+    }
+    return 0;
+}
+
+// Finds a deflate chunk a worker may start on.  Called with the lock held.
+static ImageChunk* NextDeflateChunk(ImagePatch* ip) {
+    int limit = ip->next + IMGPATCH_LOOKAHEAD;
+    int i;
+    if (limit > ip->num_chunks) limit = ip->num_chunks;
+    for (i = ip->next; i < limit; ++i) {
+        ImageChunk* chunk = ip->chunks + i;
+        if (chunk->type == CHUNK_DEFLATE && chunk->state == CHUNK_PENDING) {
+            return chunk;
+        }
+    }
+    return NULL;
+}
 
-            // now the deflate stream
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = uncompressed_target_size;
-            strm.next_in = uncompressed_target_data;
-            ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-            do {
-                strm.avail_out = temp_size;
-                strm.next_out = temp_data;
-                ret = deflate(&strm, Z_FINISH);
-                ssize_t have = temp_size - strm.avail_out;
-
-                if (sink(temp_data, have, token) != have) {
-                    printf("failed to write %ld compressed bytes to output\n",
-                           (long)have);
-                    return -1;
-                }
-                SHA_update(ctx, temp_data, have);
-            } while (ret != Z_STREAM_END);
-            deflateEnd(&strm);
-
-            free(temp_data);
-            free(uncompressed_target_data);
+static void RunDeflateChunk(ImagePatch* ip, ImageChunk* chunk) {
+    chunk->state = CHUNK_BUSY;
+    pthread_mutex_unlock(&ip->lock);
+    int ret = PatchDeflateChunk(ip->old_data, ip->old_size, ip->patch, chunk);
+    pthread_mutex_lock(&ip->lock);
+    chunk->state = ret == 0 ? CHUNK_DONE : CHUNK_FAILED;
+    pthread_cond_broadcast(&ip->cond);
+}
+
+static void* DeflateWorker(void* cookie) {
+    ImagePatch* ip = (ImagePatch*) cookie;
+    pthread_mutex_lock(&ip->lock);
+    while (!ip->stop) {
+        ImageChunk* chunk = NextDeflateChunk(ip);
+        if (chunk == NULL) {
+            pthread_cond_wait(&ip->cond, &ip->lock);
         } else {
-            printf("patch chunk %d is unknown type %d\n", i, type);
+            RunDeflateChunk(ip, chunk);
+        }
+    }
+    pthread_mutex_unlock(&ip->lock);
+    return NULL;
+}
+
+// Writes chunk i, in turn.  Deflate chunks are waited for (or done
+// here, if no worker has picked them up).
+static int WriteChunk(ImagePatch* ip, int i, SinkFn sink, void* token,
+                      MzSha1Ctx* ctx) {
+    ImageChunk* chunk = ip->chunks + i;
+
+    if (chunk->type == CHUNK_NORMAL) {
+        size_t src_start = Read8(chunk->header);
+        size_t src_len = Read8(chunk->header+8);
+        size_t patch_offset = Read8(chunk->header+16);
+        if (src_start > (size_t) ip->old_size ||
+            src_len > ip->old_size - src_start) {
+            printf("chunk %d source is outside the file\n", i);
             return -1;
         }
+        return ApplyBSDiffPatch(ip->old_data + src_start, src_len,
+                                ip->patch, patch_offset, sink, token, ctx);
     }
 
-    return 0;
+    if (chunk->type == CHUNK_RAW) {
+        unsigned char* data = (unsigned char*)chunk->header + 4;
+        mzSha1Update(ctx, data, chunk->raw_len);
+        if (sink(data, chunk->raw_len, token) != chunk->raw_len) {
+            printf("failed to write chunk %d raw data\n", i);
+            return -1;
+        }
+        return 0;
+    }
+
+    pthread_mutex_lock(&ip->lock);
+    if (chunk->state == CHUNK_PENDING) {
+        RunDeflateChunk(ip, chunk);
+    }
+    while (chunk->state == CHUNK_BUSY) {
+        pthread_cond_wait(&ip->cond, &ip->lock);
+    }
+    int state = chunk->state;
+    pthread_mutex_unlock(&ip->lock);
+
+    int result = -1;
+    if (state == CHUNK_FAILED) {
+        printf("failed to patch deflate chunk %d\n", i);
+    } else if (sink(chunk->out, chunk->out_len, token) != chunk->out_len) {
+        printf("failed to write %ld compressed bytes to output\n",
+               (long)chunk->out_len);
+    } else {
+        mzSha1Update(ctx, chunk->out, chunk->out_len);
+        result = 0;
+    }
+    mzBudgetFree(chunk->out);
+    chunk->out = NULL;
+    return result;
+}
+
+/*
+ * Apply the patch given in 'patch_filename' to the source data given
+ * by (old_data, old_size).  Write the patched output to the 'output'
+ * file, and update the SHA context with the output data as well.
+ * Return 0 on success.
+ *
+ * Deflate chunks, which each need a bspatch and a full recompression,
+ * are worked on by a pool of threads ahead of the output; a chunk is
+ * only handed to the sink once everything before it has been.
+ */
+int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
+                    const Value* patch,
+                    SinkFn sink, void* token, MzSha1Ctx* ctx) {
+    char* header = patch->data;
+    if (patch->size < 12) {
+        printf("patch too short to contain header\n");
+        return -1;
+    }
+
+    // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW.
+    // (IMGDIFF1, which is no longer supported, used CHUNK_NORMAL and
+    // CHUNK_GZIP.)
+    if (memcmp(header, "IMGDIFF2", 8) != 0) {
+        printf("corrupt patch file header (magic number)\n");
+        return -1;
+    }
+
+    int num_chunks = Read4(header+8);
+    if (num_chunks < 0) {
+        printf("corrupt patch file header (chunk count)\n");
+        return -1;
+    }
+
+    ImagePatch ip;
+    memset(&ip, 0, sizeof(ip));
+    ip.old_data = old_data;
+    ip.old_size = old_size;
+    ip.patch = patch;
+    ip.num_chunks = num_chunks;
+    ip.chunks = ParseChunks(patch, num_chunks);
+    if (ip.chunks == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&ip.lock, NULL);
+    pthread_cond_init(&ip.cond, NULL);
+
+    // Only worth threads if there's recompression to overlap.
+    int num_deflate = 0;
+    int i;
+    for (i = 0; i < num_chunks; ++i) {
+        if (ip.chunks[i].type == CHUNK_DEFLATE) ++num_deflate;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int want = cpus < 1 ? 1 : cpus > IMGPATCH_MAX_WORKERS ?
+            IMGPATCH_MAX_WORKERS : cpus;
+    if (want > num_deflate) want = num_deflate;
+    if (want < 2) want = 0;
+
+    pthread_t workers[IMGPATCH_MAX_WORKERS];
+    int num_workers = 0;
+    while (num_workers < want &&
+           pthread_create(&workers[num_workers], NULL,
+                          DeflateWorker, &ip) == 0) {
+        ++num_workers;
+    }
+
+    int result = 0;
+    for (i = 0; i < num_chunks && result == 0; ++i) {
+        pthread_mutex_lock(&ip.lock);
+        ip.next = i;
+        pthread_cond_broadcast(&ip.cond);
+        pthread_mutex_unlock(&ip.lock);
+        result = WriteChunk(&ip, i, sink, token, ctx);
+    }
+
+    pthread_mutex_lock(&ip.lock);
+    ip.stop = 1;
+    pthread_cond_broadcast(&ip.cond);
+    pthread_mutex_unlock(&ip.lock);
+    for (i = 0; i < num_workers; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    for (i = 0; i < num_chunks; ++i) {
+        mzBudgetFree(ip.chunks[i].out);
+    }
+    free(ip.chunks);
+    pthread_cond_destroy(&ip.cond);
+    pthread_mutex_destroy(&ip.lock);
+    return result == 0 ? 0 : -1;
 }
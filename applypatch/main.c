@@ -30,6 +30,33 @@ int CheckMode(int argc, char** argv) {
     return applypatch_check(argv[2], argc-3, argv+3);
 }
 
+// applypatch -b <file> <sha1>[,<sha1>...] [<file> <sha1>[,...] ...]
+int BatchCheckMode(int argc, char** argv) {
+    if (argc < 4 || (argc - 2) % 2 != 0) {
+        return 2;
+    }
+    int count = (argc - 2) / 2;
+    char** filenames = malloc(count * sizeof(char*));
+    char** sha1_lists = malloc(count * sizeof(char*));
+    int* results = malloc(count * sizeof(int));
+    int i;
+    for (i = 0; i < count; ++i) {
+        filenames[i] = argv[2 + i*2];
+        sha1_lists[i] = argv[3 + i*2];
+    }
+    int failed = applypatch_check_batch(count, filenames, sha1_lists, results);
+    for (i = 0; i < count; ++i) {
+        if (results[i] != 0) {
+            printf("check failed: %s\n", filenames[i]);
+        }
+    }
+    printf("%d of %d files failed the check\n", failed, count);
+    free(filenames);
+    free(sha1_lists);
+    free(results);
+    return failed > 0 ? 1 : 0;
+}
+
 int SpaceMode(int argc, char** argv) {
     if (argc != 3) {
         return 2;
@@ -43,9 +70,38 @@ int SpaceMode(int argc, char** argv) {
     return CacheSizeCheck(bytes);
 }
 
+// A patch file mapped into memory, shared by the Value pointing into
+// it; unmapped when that Value is freed.
+typedef struct {
+    ValueStore store;
+    FileContents file;
+} PatchFileStore;
+
+static void ReleasePatchFile(ValueStore* store) {
+    PatchFileStore* pf = (PatchFileStore*)store;
+    FreeFileContents(&pf->file);
+    free(pf);
+}
+
+// Map the patch in filename and wrap it in a blob Value, so multi-MB
+// patches are never copied into the heap.  Returns NULL on failure.
+static Value* MapPatchValue(const char* filename) {
+    PatchFileStore* pf = malloc(sizeof(PatchFileStore));
+    if (MapFileContents(filename, &pf->file) != 0) {
+        free(pf);
+        return NULL;
+    }
+    pf->store.refcount = 1;
+    pf->store.release = ReleasePatchFile;
+    Value* v = StoreBlobValue(&pf->store, (char*)pf->file.data,
+                              pf->file.size);
+    ReleaseValueStore(&pf->store);
+    return v;
+}
+
 // Parse arguments (which should be of the form "<sha1>" or
 // "<sha1>:<filename>" into the new parallel arrays *sha1s and
-// *patches (loading file contents into the patches).  Returns 0 on
+// *patches (mapping the files into the patches).  Returns 0 on
 // success.
 static int ParsePatchArgs(int argc, char** argv,
                           char*** sha1s, Value*** patches, int* num_patches) {
@@ -73,14 +129,10 @@ static int ParsePatchArgs(int argc, char** argv,
         if (colon == NULL) {
             (*patches)[i] = NULL;
         } else {
-            FileContents fc;
-            if (LoadFileContents(colon, &fc) != 0) {
+            (*patches)[i] = MapPatchValue(colon);
+            if ((*patches)[i] == NULL) {
                 goto abort;
             }
-            (*patches)[i] = malloc(sizeof(Value));
-            (*patches)[i]->type = VAL_BLOB;
-            (*patches)[i]->size = fc.size;
-            (*patches)[i]->data = (char*)fc.data;
         }
     }
 
@@ -88,11 +140,7 @@ static int ParsePatchArgs(int argc, char** argv,
 
   abort:
     for (i = 0; i < *num_patches; ++i) {
-        Value* p = (*patches)[i];
-        if (p != NULL) {
-            free(p->data);
-            free(p);
-        }
+        FreeValue((*patches)[i]);
     }
     free(*sha1s);
     free(*patches);
@@ -124,11 +172,7 @@ int PatchMode(int argc, char** argv) {
 
     int i;
     for (i = 0; i < num_patches; ++i) {
-        Value* p = patches[i];
-        if (p != NULL) {
-            free(p->data);
-            free(p);
-        }
+        FreeValue(patches[i]);
     }
     free(sha1s);
     free(patches);
@@ -166,13 +210,14 @@ int main(int argc, char** argv) {
             "usage: %s <src-file> <tgt-file> <tgt-sha1> <tgt-size> "
             "[<src-sha1>:<patch> ...]\n"
             "   or  %s -c <file> [<sha1> ...]\n"
+            "   or  %s -b <file> <sha1>[,<sha1>...] [<file> <sha1>[,...] ...]\n"
             "   or  %s -s <bytes>\n"
             "   or  %s -l\n"
             "\n"
             "Filenames may be of the form\n"
             "  MTD:<partition>:<len_1>:<sha1_1>:<len_2>:<sha1_2>:...\n"
             "to specify reading from or writing to an MTD partition.\n\n",
-            argv[0], argv[0], argv[0], argv[0]);
+            argv[0], argv[0], argv[0], argv[0], argv[0]);
         return 2;
     }
 
@@ -182,6 +227,8 @@ int main(int argc, char** argv) {
         result = ShowLicenses();
     } else if (strncmp(argv[1], "-c", 3) == 0) {
         result = CheckMode(argc, argv);
+    } else if (strncmp(argv[1], "-b", 3) == 0) {
+        result = BatchCheckMode(argc, argv);
     } else if (strncmp(argv[1], "-s", 3) == 0) {
         result = SpaceMode(argc, argv);
     } else {
@@ -0,0 +1,64 @@
+# Copyright (C) 2010 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+LOCAL_PATH := $(call my-dir)
+
+bench_src_files := \
+	bench.c \
+	../applypatch/bsdiff.c \
+	../verifier.c
+
+bench_c_includes := \
+	bootable/recovery \
+	external/bzip2 \
+	external/zlib \
+	external/safe-iop/include
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := $(bench_src_files)
+LOCAL_MODULE := recovery_bench
+LOCAL_MODULE_TAGS := eng
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_C_INCLUDES += $(bench_c_includes)
+LOCAL_CFLAGS += -Wall
+LOCAL_STATIC_LIBRARIES := libapplypatch libminzip libmincrypt libbz libz
+LOCAL_STATIC_LIBRARIES += libcutils libc
+
+include $(BUILD_EXECUTABLE)
+
+# There are no host builds of libapplypatch or libminzip, so the host
+# version compiles the sources it needs directly.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := $(bench_src_files) \
+	../applypatch/bspatch.c \
+	../applypatch/imgpatch.c \
+	../applypatch/utils.c \
+	../minzip/Hash.c \
+	../minzip/SysUtil.c \
+	../minzip/DirUtil.c \
+	../minzip/Inlines.c \
+	../minzip/Crc32.c \
+	../minzip/Digests.c \
+	../minzip/Sha1.c \
+	../minzip/Zip.c
+LOCAL_MODULE := recovery_bench
+LOCAL_MODULE_TAGS := eng
+LOCAL_C_INCLUDES += $(bench_c_includes)
+LOCAL_CFLAGS += -Wall
+LOCAL_STATIC_LIBRARIES := libmincrypt libbz libz
+LOCAL_LDLIBS += -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
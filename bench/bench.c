@@ -0,0 +1,502 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Throughput benchmarks for the code paths an install spends its time
+ * in, run on the host or the device:
+ *
+ *     recovery_bench [-m megabytes] [-r repeats] [-d workdir] [-p package]
+ *
+ * The corpus is generated from a fixed seed, so numbers from different
+ * builds are comparable; the patches and zip it needs are written to
+ * workdir (default /tmp) before anything is timed.  With -p, the
+ * signature of a real OTA package is also checked against keys.inc.
+ *
+ * Results go to stdout one per line, tab-separated:
+ *
+ *     <name> <bytes> <best seconds> <MB/s>
+ *
+ * with lines starting '#' being comments.  Each benchmark runs
+ * "repeats" times (default 3) and the fastest run is reported.  The
+ * exit status is nonzero if any benchmark produced the wrong output.
+ */
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "zlib.h"
+
+#include "applypatch/applypatch.h"
+#include "applypatch/imgdiff.h"
+#include "mincrypt/rsa.h"
+#include "minzip/Crc32.h"
+#include "minzip/Sha1.h"
+#include "minzip/Zip.h"
+#include "verifier.h"
+
+// from applypatch/bsdiff.c
+typedef struct BsdiffIndex BsdiffIndex;
+int bsdiff(u_char* old, off_t oldsize, BsdiffIndex** IP, u_char* new,
+           off_t newsize, const char* patch_filename);
+
+static const RSAPublicKey keys[] = {
+#include "keys.inc"
+};
+
+// verifier.c reports through the recovery UI; there isn't one here.
+void ui_print(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+void ui_set_progress(float fraction)
+{
+}
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int g_repeats = 3;
+static int g_failures = 0;
+
+typedef int (*BenchFn)(void *cookie);
+
+// Run fn g_repeats times and report the fastest, counting "bytes" of
+// work per run.  fn returns nonzero if its output was wrong.
+static void run(const char *name, size_t bytes, BenchFn fn, void *cookie)
+{
+    double best = 0;
+    int i;
+
+    for (i = 0; i < g_repeats; ++i) {
+        double start = now();
+        if (fn(cookie) != 0) {
+            printf("# %s: FAILED\n", name);
+            ++g_failures;
+            return;
+        }
+        double t = now() - start;
+        if (i == 0 || t < best) best = t;
+    }
+    printf("%s\t%lu\t%.6f\t%.1f\n", name, (unsigned long) bytes, best,
+            best > 0 ? bytes / best / (1024 * 1024) : 0.0);
+    fflush(stdout);
+}
+
+/*
+ * Corpus: words drawn from a small vocabulary with an LCG, so it
+ * compresses about as well as typical system files, with the odd run
+ * of noise.  The target is the same data with a change every 64K.
+ */
+static unsigned char *make_corpus(size_t len, unsigned int seed)
+{
+    static const char *words[] = {
+        "android", "system", "framework", "lib", "class", "dex", "\n",
+        "return", "public", "void ", "<manifest>", "0x00000000", "\t",
+    };
+    unsigned char *data = malloc(len);
+    size_t pos = 0;
+
+    if (data == NULL) return NULL;
+    while (pos < len) {
+        seed = seed * 1103515245 + 12345;
+        if ((seed >> 16) % 64 == 0) {
+            data[pos++] = (unsigned char) (seed >> 8);
+            continue;
+        }
+        const char *w = words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+        size_t n = strlen(w);
+        if (n > len - pos) n = len - pos;
+        memcpy(data + pos, w, n);
+        pos += n;
+    }
+    return data;
+}
+
+static unsigned char *make_target(const unsigned char *src, size_t len)
+{
+    unsigned char *data = malloc(len);
+    size_t pos;
+
+    if (data == NULL) return NULL;
+    memcpy(data, src, len);
+    for (pos = 4096; pos + 16 < len; pos += 65536) {
+        memcpy(data + pos, "patched-content!", 16);
+    }
+    return data;
+}
+
+static unsigned char *deflate_raw(const unsigned char *data, size_t len,
+        size_t *out_len)
+{
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+    size_t cap = deflateBound(&strm, len);
+    unsigned char *out = malloc(cap);
+    strm.next_in = (unsigned char *) data;
+    strm.avail_in = len;
+    strm.next_out = out;
+    strm.avail_out = cap;
+    if (out == NULL || deflate(&strm, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&strm);
+        free(out);
+        return NULL;
+    }
+    *out_len = strm.total_out;
+    deflateEnd(&strm);
+    return out;
+}
+
+static unsigned char *read_file(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    unsigned char *data;
+    long n;
+
+    if (f == NULL) return NULL;
+    fseek(f, 0, SEEK_END);
+    n = ftell(f);
+    rewind(f);
+    data = malloc(n > 0 ? n : 1);
+    if (data == NULL || fread(data, 1, n, f) != (size_t) n) {
+        free(data);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    *len = n;
+    return data;
+}
+
+static void put4(unsigned char *p, unsigned int v)
+{
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static void put8(unsigned char *p, unsigned long long v)
+{
+    put4(p, (unsigned int) v);
+    put4(p + 4, (unsigned int) (v >> 32));
+}
+
+static void put2(unsigned char *p, unsigned int v)
+{
+    p[0] = v; p[1] = v >> 8;
+}
+
+/*
+ * Write a zip holding the corpus twice, once stored and once deflated.
+ */
+static int write_zip(const char *path, const unsigned char *data, size_t len,
+        const unsigned char *deflated, size_t deflated_len)
+{
+    static const char *names[2] = { "stored.bin", "deflated.bin" };
+    unsigned char hdr[46];
+    unsigned long offsets[2];
+    unsigned long crc = crc32(0L, data, len);
+    unsigned long pos = 0, cd_start, cd_len = 0;
+    FILE *f = fopen(path, "wb");
+    int i;
+
+    if (f == NULL) return -1;
+    for (i = 0; i < 2; ++i) {
+        size_t nlen = strlen(names[i]);
+        size_t clen = i == 0 ? len : deflated_len;
+        memset(hdr, 0, 30);
+        put4(hdr, 0x04034b50);
+        put2(hdr + 4, 20);
+        put2(hdr + 8, i == 0 ? 0 : 8);
+        put4(hdr + 14, crc);
+        put4(hdr + 18, clen);
+        put4(hdr + 22, len);
+        put2(hdr + 26, nlen);
+        offsets[i] = pos;
+        fwrite(hdr, 1, 30, f);
+        fwrite(names[i], 1, nlen, f);
+        fwrite(i == 0 ? data : deflated, 1, clen, f);
+        pos += 30 + nlen + clen;
+    }
+    cd_start = pos;
+    for (i = 0; i < 2; ++i) {
+        size_t nlen = strlen(names[i]);
+        memset(hdr, 0, 46);
+        put4(hdr, 0x02014b50);
+        put2(hdr + 4, 20);
+        put2(hdr + 6, 20);
+        put2(hdr + 10, i == 0 ? 0 : 8);
+        put4(hdr + 16, crc);
+        put4(hdr + 20, i == 0 ? len : deflated_len);
+        put4(hdr + 24, len);
+        put2(hdr + 28, nlen);
+        put4(hdr + 42, offsets[i]);
+        fwrite(hdr, 1, 46, f);
+        fwrite(names[i], 1, nlen, f);
+        cd_len += 46 + nlen;
+    }
+    memset(hdr, 0, 22);
+    put4(hdr, 0x06054b50);
+    put2(hdr + 8, 2);
+    put2(hdr + 10, 2);
+    put4(hdr + 12, cd_len);
+    put4(hdr + 16, cd_start);
+    fwrite(hdr, 1, 22, f);
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+/* ---- the benchmarks ---- */
+
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    const unsigned char *expected;     // SHA-1 of the right output
+} Buffer;
+
+static int bench_sha1(void *cookie)
+{
+    Buffer *b = cookie;
+    uint8_t digest[SHA_DIGEST_SIZE];
+    mzSha1(b->data, b->len, digest);
+    return memcmp(digest, b->expected, SHA_DIGEST_SIZE) != 0;
+}
+
+static unsigned long g_crc;
+
+static int bench_crc32(void *cookie)
+{
+    Buffer *b = cookie;
+    return mzCrc32(0, b->data, b->len) != g_crc;
+}
+
+static int bench_zlib_crc32(void *cookie)
+{
+    Buffer *b = cookie;
+    return crc32(0L, b->data, b->len) != g_crc;
+}
+
+static ssize_t null_sink(unsigned char *data, ssize_t len, void *token)
+{
+    *(size_t *) token += len;
+    return len;
+}
+
+typedef struct {
+    const unsigned char *old_data;
+    size_t old_len;
+    Value patch;
+    const unsigned char *expected;
+    int image;
+} PatchBench;
+
+static int bench_patch(void *cookie)
+{
+    PatchBench *p = cookie;
+    MzSha1Ctx ctx;
+    size_t written = 0;
+    int r;
+
+    mzSha1Init(&ctx);
+    if (p->image) {
+        r = ApplyImagePatch(p->old_data, p->old_len, &p->patch,
+                null_sink, &written, &ctx);
+    } else {
+        r = ApplyBSDiffPatch(p->old_data, p->old_len, &p->patch, 0,
+                null_sink, &written, &ctx);
+    }
+    return r != 0 || memcmp(mzSha1Final(&ctx), p->expected,
+            SHA_DIGEST_SIZE) != 0;
+}
+
+typedef struct {
+    ZipArchive *archive;
+    const ZipEntry *entry;
+    unsigned long expected_crc;
+    unsigned long crc;
+} ZipBench;
+
+static bool zip_crc_fn(const unsigned char *data, int len, void *cookie)
+{
+    ZipBench *z = cookie;
+    z->crc = mzCrc32(z->crc, data, len);
+    return true;
+}
+
+static int bench_zip(void *cookie)
+{
+    ZipBench *z = cookie;
+    z->crc = 0;
+    if (!mzProcessZipEntryContents(z->archive, z->entry, zip_crc_fn, z)) {
+        return 1;
+    }
+    return z->crc != z->expected_crc;
+}
+
+static int bench_verify(void *cookie)
+{
+    return !verify_jar_signature((ZipArchive *) cookie, keys,
+            sizeof(keys) / sizeof(keys[0]));
+}
+
+int main(int argc, char **argv)
+{
+    int megs = 16;
+    const char *workdir = "/tmp";
+    const char *package = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "m:r:d:p:")) != -1) {
+        switch (c) {
+            case 'm': megs = atoi(optarg); break;
+            case 'r': g_repeats = atoi(optarg); break;
+            case 'd': workdir = optarg; break;
+            case 'p': package = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-m megabytes] [-r repeats] "
+                        "[-d workdir] [-p package]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (megs <= 0 || g_repeats <= 0) {
+        fprintf(stderr, "megabytes and repeats must be positive\n");
+        return 2;
+    }
+
+    size_t len = (size_t) megs << 20;
+    unsigned char *src = make_corpus(len, 1);
+    unsigned char *tgt = src ? make_target(src, len) : NULL;
+    if (tgt == NULL) {
+        fprintf(stderr, "can't allocate %d MB corpus\n", megs);
+        return 1;
+    }
+    uint8_t src_sha1[SHA_DIGEST_SIZE], tgt_sha1[SHA_DIGEST_SIZE];
+    mzSha1(src, len, src_sha1);
+    mzSha1(tgt, len, tgt_sha1);
+    g_crc = crc32(0L, src, len);
+
+    printf("# recovery_bench: %d MB corpus, best of %d\n", megs, g_repeats);
+    printf("# name\tbytes\tseconds\tMB/s\n");
+
+    Buffer buf = { src, len, src_sha1 };
+    run("sha1", len, bench_sha1, &buf);
+    run("crc32", len, bench_crc32, &buf);
+    run("crc32_zlib", len, bench_zlib_crc32, &buf);
+
+    // bsdiff patch of the raw corpus.
+    char path[PATH_MAX];
+    size_t patch_len;
+    BsdiffIndex *index = NULL;
+    snprintf(path, sizeof(path), "%s/bench.bsdiff", workdir);
+    if (bsdiff(src, len, &index, tgt, len, path) != 0 ||
+        (buf.data = read_file(path, &patch_len)) == NULL) {
+        fprintf(stderr, "can't make %s\n", path);
+        return 1;
+    }
+    unlink(path);
+
+    PatchBench bp;
+    bp.old_data = src;
+    bp.old_len = len;
+    bp.patch.type = VAL_BLOB;
+    bp.patch.size = patch_len;
+    bp.patch.data = (char *) buf.data;
+    bp.patch.store = NULL;
+    bp.expected = tgt_sha1;
+    bp.image = 0;
+    run("bspatch", len, bench_patch, &bp);
+
+    // The same patch as the single deflate chunk of an imgdiff patch,
+    // so ApplyImagePatch() inflates, patches and deflates again.
+    size_t src_deflated_len, tgt_deflated_len;
+    unsigned char *src_deflated = deflate_raw(src, len, &src_deflated_len);
+    unsigned char *tgt_deflated = deflate_raw(tgt, len, &tgt_deflated_len);
+    if (src_deflated == NULL || tgt_deflated == NULL) {
+        fprintf(stderr, "can't deflate corpus\n");
+        return 1;
+    }
+    size_t img_header = 12 + 4 + 60;
+    unsigned char *img = malloc(img_header + patch_len);
+    memcpy(img, "IMGDIFF2", 8);
+    put4(img + 8, 1);
+    put4(img + 12, CHUNK_DEFLATE);
+    put8(img + 16, 0);                      // source start
+    put8(img + 24, src_deflated_len);       // source len
+    put8(img + 32, img_header);             // bsdiff patch offset
+    put8(img + 40, len);                    // source expanded len
+    put8(img + 48, len);                    // target expected len
+    put4(img + 56, 6);
+    put4(img + 60, Z_DEFLATED);
+    put4(img + 64, -15);
+    put4(img + 68, 8);
+    put4(img + 72, Z_DEFAULT_STRATEGY);
+    memcpy(img + img_header, buf.data, patch_len);
+
+    uint8_t tgt_deflated_sha1[SHA_DIGEST_SIZE];
+    mzSha1(tgt_deflated, tgt_deflated_len, tgt_deflated_sha1);
+    bp.old_data = src_deflated;
+    bp.old_len = src_deflated_len;
+    bp.patch.size = img_header + patch_len;
+    bp.patch.data = (char *) img;
+    bp.expected = tgt_deflated_sha1;
+    bp.image = 1;
+    run("imgpatch_deflate", len, bench_patch, &bp);
+
+    // Reading zip entries, stored and deflated.
+    ZipArchive archive;
+    snprintf(path, sizeof(path), "%s/bench.zip", workdir);
+    if (write_zip(path, src, len, src_deflated, src_deflated_len) != 0 ||
+        mzOpenZipArchive(path, &archive) != 0) {
+        fprintf(stderr, "can't make %s\n", path);
+        return 1;
+    }
+    ZipBench zb;
+    zb.archive = &archive;
+    zb.expected_crc = g_crc;
+    zb.entry = mzFindZipEntry(&archive, "stored.bin");
+    run("zip_stored", len, bench_zip, &zb);
+    zb.entry = mzFindZipEntry(&archive, "deflated.bin");
+    run("zip_deflated", len, bench_zip, &zb);
+    mzCloseZipArchive(&archive);
+    unlink(path);
+
+    if (package != NULL) {
+        struct stat st;
+        if (stat(package, &st) != 0 || mzOpenZipArchive(package, &archive) != 0) {
+            fprintf(stderr, "can't open %s\n", package);
+            return 1;
+        }
+        run("verify_jar_signature", st.st_size, bench_verify, &archive);
+        mzCloseZipArchive(&archive);
+    } else {
+        printf("# verify_jar_signature: skipped (no -p package)\n");
+    }
+
+    return g_failures ? 1 : 0;
+}
@@ -16,6 +16,7 @@
 
 #include "bootloader.h"
 #include "common.h"
+#include "minzip/Throughput.h"
 #include "mtdutils/mtdutils.h"
 #include "roots.h"
 
@@ -155,8 +156,21 @@ struct update_header {
     unsigned fail_bitmap_length;
 };
 
+typedef struct {
+    MtdWriteContext *write;
+    int written;
+} CacheSink;
+
+static int write_cache_data(const char *data, int len, void *cookie) {
+    CacheSink *sink = (CacheSink *) cookie;
+    if (mtd_write_data(sink->write, data, len) != len) return -1;
+    sink->written += len;
+    mzPhaseAdd(len);
+    return 0;
+}
+
 int write_update_for_bootloader(
-        const char *update, int update_length,
+        UpdateSource source, void *source_cookie, int update_length,
         int bitmap_width, int bitmap_height, int bitmap_bpp,
         const char *busy_bitmap, const char *fail_bitmap) {
     if (ensure_root_path_unmounted(CACHE_NAME)) {
@@ -200,8 +214,10 @@ int write_update_for_bootloader(
 
     header.image_offset = mtd_erase_blocks(write, 0);
     header.image_length = update_length;
+    CacheSink sink = { write, 0 };
     if ((int) header.image_offset == -1 ||
-        mtd_write_data(write, update, update_length) != update_length) {
+        source(write_cache_data, &sink, source_cookie) != 0 ||
+        sink.written != update_length) {
         LOGE("Can't write update to %s\n(%s)\n", CACHE_NAME, strerror(errno));
         mtd_write_close(write);
         return -1;
@@ -47,12 +47,21 @@ struct bootloader_message {
 int get_bootloader_message(struct bootloader_message *out);
 int set_bootloader_message(const struct bootloader_message *in);
 
+/* The update image is passed to write_update_for_bootloader() as a
+ * source, which hands it to the sink in as many pieces as it likes, so it
+ * can be streamed from wherever it is rather than read into memory first.
+ * Both return zero on success.
+ */
+typedef int (*UpdateSink)(const char *data, int len, void *sink_cookie);
+typedef int (*UpdateSource)(UpdateSink sink, void *sink_cookie, void *cookie);
+
 /* Write an update to the cache partition for update-radio or update-hboot.
+ * The source must produce exactly update_len bytes.
  * Note, this destroys any filesystem on the cache partition!
  * The expected bitmap format is 240x320, 16bpp (2Bpp), RGB 5:6:5.
  */
 int write_update_for_bootloader(
-        const char *update, int update_len,
+        UpdateSource source, void *source_cookie, int update_len,
         int bitmap_width, int bitmap_height, int bitmap_bpp,
         const char *busy_bitmap, const char *error_bitmap);
 
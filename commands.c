@@ -17,6 +17,7 @@
 #undef NDEBUG
 
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -35,12 +36,18 @@
 #include "cutils/misc.h"
 #include "cutils/properties.h"
 #include "firmware.h"
+#include "hash_dir.h"
+#include "minzip/Budget.h"
 #include "minzip/DirUtil.h"
+#include "minzip/Throughput.h"
 #include "minzip/Zip.h"
 #include "roots.h"
 
 static int gDidShowProgress = 0;
 
+/* Where hash_dir() keeps the digests of the files it has hashed. */
+#define HASH_DIR_CACHE "CACHE:recovery/hash_dir"
+
 #define UNUSED(p)   ((void)(p))
 
 #define CHECK_BOOL() \
@@ -155,7 +162,12 @@ cmd_delete(const char *name, void *cookie, int argc, const char *argv[])
                 continue;
             }
             if (recurse) {
-                ret = dirUnlinkHierarchy(path);
+                DirUnlinkStats stats;
+                ret = dirUnlinkHierarchyEx(path, 0, &stats);
+                if (ret == 0) {
+                    LOGI("Removed %lu entries under %s in %ld ms\n",
+                            stats.removed, path, stats.elapsedMs);
+                }
             } else {
                 ret = unlink(path);
             }
@@ -173,20 +185,30 @@ cmd_delete(const char *name, void *cookie, int argc, const char *argv[])
 }
 
 typedef struct {
-    int num_done;
-    int num_total;
+    const ZipArchive *package;
+    char entry_name[PATH_MAX];  // the zip directory, then each entry's name
+    size_t zip_dir_len;
+    size_t target_dir_len;
+    long long bytes_done;
+    long long bytes_total;
 } ExtractContext;
 
-static void extract_count_cb(const char *fn, void *cookie)
-{
-   ++((ExtractContext*) cookie)->num_total;
-}
-
+/* Each extracted file's name is the target directory followed by the
+ * rest of the entry's name, so the entry (and its size) can be found
+ * again from it without a second walk of the archive.
+ */
 static void extract_cb(const char *fn, void *cookie)
 {
     // minzip writes the filename to the log, so we don't need to
     ExtractContext *ctx = (ExtractContext*) cookie;
-    ui_set_progress((float) ++ctx->num_done / ctx->num_total);
+    const char *rest = fn + ctx->target_dir_len;
+    if (ctx->zip_dir_len + strlen(rest) >= sizeof(ctx->entry_name)) return;
+    strcpy(ctx->entry_name + ctx->zip_dir_len, rest);
+    const ZipEntry *entry = mzFindZipEntry(ctx->package, ctx->entry_name);
+    if (entry != NULL) ctx->bytes_done += mzGetZipEntryUncompLen(entry);
+    if (ctx->bytes_total > 0) {
+        ui_set_progress((float) ctx->bytes_done / ctx->bytes_total);
+    }
 }
 
 /* copy_dir <src-dir> <dst-dir> [<timestamp>]
@@ -265,19 +287,42 @@ cmd_copy_dir(const char *name, void *cookie, int argc, const char *argv[])
         }
 
         /* Extract the files.  Set MZ_EXTRACT_FILES_ONLY, because only files
-         * are validated by the signature.  Do a dry run first to count how
-         * many there are (and find some errors early).
+         * are validated by the signature.  The entries under src_path are
+         * contiguous in the package index, so their total size (for the
+         * progress bar) comes from there rather than from a dry run.
          */
         ExtractContext ctx;
-        ctx.num_done = 0;
-        ctx.num_total = 0;
-
-        if (!mzExtractRecursive(package, src_path, dst_path,
-                    MZ_EXTRACT_FILES_ONLY | MZ_EXTRACT_DRY_RUN,
-                    &timestamp, extract_count_cb, (void *) &ctx) ||
-            !mzExtractRecursive(package, src_path, dst_path,
-                    MZ_EXTRACT_FILES_ONLY,
-                    &timestamp, extract_cb, (void *) &ctx)) {
+        ctx.package = package;
+        ctx.bytes_done = 0;
+        ctx.bytes_total = 0;
+        ctx.zip_dir_len = strlen(src_path);
+        if (ctx.zip_dir_len + 2 > sizeof(ctx.entry_name)) {
+            LOGE("Command %s: source path \"%s\" too long\n",
+                    name, src_root_path);
+            return 1;
+        }
+        strcpy(ctx.entry_name, src_path);
+        if (ctx.zip_dir_len > 0 && src_path[ctx.zip_dir_len-1] != '/') {
+            ctx.entry_name[ctx.zip_dir_len++] = '/';
+            ctx.entry_name[ctx.zip_dir_len] = '\0';
+        }
+        ctx.target_dir_len = strlen(dst_path);
+        if (ctx.target_dir_len == 0 || dst_path[ctx.target_dir_len-1] != '/') {
+            ctx.target_dir_len++;
+        }
+
+        unsigned int first, count, i;
+        count = mzFindZipEntriesWithPrefix(package, ctx.entry_name, &first);
+        for (i = 0; i < count; i++) {
+            ctx.bytes_total += mzGetZipEntryUncompLen(
+                    mzGetZipEntryAt(package, first + i));
+        }
+
+        mzPhaseBegin("extract", ctx.bytes_total);
+        bool ok = mzExtractRecursive(package, src_path, dst_path,
+                MZ_EXTRACT_FILES_ONLY, &timestamp, extract_cb, (void *) &ctx);
+        mzPhaseEnd();
+        if (!ok) {
             LOGW("Command %s: couldn't extract \"%s\" to \"%s\"\n",
                     name, src_root_path, dst_root_path);
             return 1;
@@ -557,11 +602,12 @@ cmd_write_firmware_image(const char *name, void *cookie,
         return 1;
     }
 
-    // Load the update image into RAM.
+    // Load the update image into RAM.  It has to stay there until
+    // shutdown, when cache is rewritten, so it can't be spilled.
     struct FirmwareContext context;
     context.total_bytes = mzGetZipEntryUncompLen(entry);
     context.done_bytes = 0;
-    context.data = malloc(context.total_bytes);
+    context.data = mzBudgetAlloc(context.total_bytes, MZ_BUDGET_PINNED);
     if (context.data == NULL) {
         LOGE("Can't allocate %d bytes for %s\n", context.total_bytes, argv[0]);
         return 1;
@@ -570,13 +616,13 @@ cmd_write_firmware_image(const char *name, void *cookie,
     if (!mzProcessZipEntryContents(package, entry, firmware_fn, &context) ||
         context.done_bytes != context.total_bytes) {
         LOGE("Can't read %s\n", argv[0]);
-        free(context.data);
+        mzBudgetFree(context.data);
         return 1;
     }
 
     if (remember_firmware_update(type, context.data, context.total_bytes)) {
         LOGE("Can't store %s image\n", type);
-        free(context.data);
+        mzBudgetFree(context.data);
         return 1;
     }
 
@@ -588,7 +634,10 @@ static bool write_raw_image_process_fn(
         int data_len, void *ctx)
 {
     int r = mtd_write_data((MtdWriteContext*)ctx, (const char *)data, data_len);
-    if (r == data_len) return true;
+    if (r == data_len) {
+        mzPhaseAdd(data_len);
+        return true;
+    }
     LOGE("%s\n", strerror(errno));
     return false;
 }
@@ -664,8 +713,10 @@ cmd_write_raw_image(const char *name, void *cookie,
 
     /* Extract and write the image.
      */
+    mzPhaseBegin("flash", mzGetZipEntryUncompLen(entry));
     bool ok = mzProcessZipEntryContents(package, entry,
             write_raw_image_process_fn, context);
+    mzPhaseEnd();
     if (!ok) {
         LOGE("Error writing %s\n", dst_root_path);
         mtd_write_close(context);
@@ -808,27 +859,72 @@ fn_get_mark(const char *name, void *cookie, int argc, const char *argv[],
 }
 
 /* hash_dir(<path-to-directory>)
+ *
+ * Returns the hex SHA-1 of everything under the directory: names, types,
+ * modes, owners, file contents and symlink targets (see hash_dir.h).
+ * File digests are cached under /cache, so asserting the same unchanged
+ * tree again only needs a stat() of each file.
+ *
+ * E.g., assert matches(hash_dir("SYSTEM:"), "hash1", "hash2")
  */
 static int
 fn_hash_dir(const char *name, void *cookie, int argc, const char *argv[],
         char **result, size_t *resultLen)
 {
-    int ret = -1;
-
-    UNUSED(name);
     UNUSED(cookie);
     CHECK_FN();
 
-    const char *dir;
     if (argc != 1) {
         fprintf(stderr, "%s: wrong number of arguments (%d)\n",
                 name, argc);
         return 1;
-    } else {
-        dir = argv[0];
     }
 
-    return ret;
+    char pathbuf[PATH_MAX];
+    const char *root_path = argv[0];
+    const char *path = translate_root_path(root_path, pathbuf, sizeof(pathbuf));
+    if (path == NULL) {
+        LOGE("Command %s: bad path \"%s\"\n", name, root_path);
+        return 1;
+    }
+    if (ensure_root_path_mounted(root_path)) {
+        LOGE("Can't mount %s\n", root_path);
+        return 1;
+    }
+
+    /* One cache file per tree, named after its root path.  Hashing
+     * still works (just slower) if /cache isn't available.
+     */
+    char cachebuf[PATH_MAX];
+    const char *cache_file = NULL;
+    const char *cache_dir = translate_root_path(HASH_DIR_CACHE,
+            cachebuf, sizeof(cachebuf));
+    if (cache_dir != NULL && ensure_root_path_mounted(HASH_DIR_CACHE) == 0 &&
+        (mkdir(cache_dir, 0700) == 0 || errno == EEXIST)) {
+        size_t len = strlen(cachebuf);
+        if (len + 1 + strlen(root_path) < sizeof(cachebuf)) {
+            char *p = cachebuf + len;
+            const char *q;
+            *p++ = '/';
+            for (q = root_path; *q != '\0'; ++q) {
+                *p++ = isalnum((unsigned char) *q) ? *q : '_';
+            }
+            *p = '\0';
+            cache_file = cachebuf;
+        }
+    }
+
+    char hex[HASH_DIR_HEX_SIZE];
+    if (hash_dir(path, cache_file, hex) != 0) {
+        LOGE("Command %s: can't hash \"%s\"\n", name, root_path);
+        return 1;
+    }
+
+    *result = strdup(hex);
+    if (resultLen != NULL) {
+        *resultLen = strlen(*result);
+    }
+    return 0;
 }
 
 /* matches(<str>, <str1> [, <strN>...])
@@ -19,6 +19,8 @@
 
 #include <stdio.h>
 
+#include "minzip/Throughput.h"
+
 // Initialize the graphics system.
 void ui_init();
 
@@ -41,6 +43,9 @@ int ui_start_menu(char** headers, char** items);
 // Set the menu highlight to the given index, and return it (capped to
 // the range [0..numitems).
 int ui_menu_select(int sel);
+// Change the text of one item of the menu being shown; safe to call from
+// any thread.
+void ui_set_menu_item(int item, const char* text);
 // End menu mode, resetting the text overlay so that ui_print()
 // statements will be displayed.
 void ui_end_menu();
@@ -80,6 +85,11 @@ void ui_show_indeterminate_progress();
 // Hide and reset the progress bar.
 void ui_reset_progress();
 
+// Show how a phase of work is going (rate, how far, time left) in a line
+// at the bottom of the screen, until it ends.  Alt+T hides and shows it.
+// Suitable as a PhaseObserver; may be called from any thread.
+void ui_show_phase(const PhaseStatus* status);
+
 #define LOGE(...) ui_print("E:" __VA_ARGS__)
 #define LOGW(...) fprintf(stderr, "W:" __VA_ARGS__)
 #define LOGI(...) fprintf(stderr, "I:" __VA_ARGS__)
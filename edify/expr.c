@@ -14,15 +14,140 @@
  * limitations under the License.
  */
 
+#include <pthread.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "expr.h"
 
+// Name given to the nodes made by Build(); every other node's name is
+// allocated by the lexer.
+static char kOperatorName[] = "(operator)";
+
+static bool profiling = false;
+static Value* ProfileCall(State* state, Expr* expr);
+
+static inline Value* Call(State* state, Expr* expr) {
+    if (profiling) return ProfileCall(state, expr);
+    return expr->fn(expr->name, state, expr->argc, expr->argv);
+}
+
+// -----------------------------------------------------------------
+//   memory
+// -----------------------------------------------------------------
+
+// A parsed script is tens of thousands of Exprs, argument arrays and
+// names, none of which is ever freed on its own.  They're bumped out of
+// big chunks instead, and FreeExprArena() gives all of them back at
+// once.  Parsing is single-threaded (so is the lexer), so this is too.
+#define ARENA_CHUNK_SIZE 65536
+#define ARENA_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t used;
+    size_t size;
+} ArenaChunk;
+
+#define ARENA_HEADER ARENA_ALIGN(sizeof(ArenaChunk))
+
+static ArenaChunk* arena = NULL;
+
+void* ExprArenaAlloc(size_t size) {
+    size = ARENA_ALIGN(size);
+    if (arena == NULL || arena->size - arena->used < size) {
+        // Something big gets a chunk of its own, behind the current
+        // one, so the rest of that chunk isn't wasted.
+        bool big = size > ARENA_CHUNK_SIZE / 4;
+        size_t chunk_size = big ? size : ARENA_CHUNK_SIZE;
+        ArenaChunk* chunk = malloc(ARENA_HEADER + chunk_size);
+        if (chunk == NULL) return NULL;
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        if (big && arena != NULL) {
+            chunk->next = arena->next;
+            arena->next = chunk;
+            chunk->used = size;
+            return (char*)chunk + ARENA_HEADER;
+        }
+        chunk->next = arena;
+        arena = chunk;
+    }
+    void* p = (char*)arena + ARENA_HEADER + arena->used;
+    arena->used += size;
+    return p;
+}
+
+char* ExprArenaStrndup(const char* str, size_t len) {
+    char* copy = ExprArenaAlloc(len + 1);
+    if (copy != NULL) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+char* ExprArenaStrdup(const char* str) {
+    return ExprArenaStrndup(str, strlen(str));
+}
+
+void FreeExprArena() {
+    while (arena != NULL) {
+        ArenaChunk* next = arena->next;
+        free(arena);
+        arena = next;
+    }
+}
+
+// Nearly every call makes a Value and frees one or two, from whichever
+// thread parallel() runs it on.  Freed Values go on a list to be handed
+// out again rather than back to malloc, and new ones are made a slab at
+// a time.  (The strings they hold are still malloc'd: callers own those
+// and free() them.)
+#define VALUE_SLAB 256
+
+typedef union PooledValue {
+    Value value;
+    union PooledValue* next;
+} PooledValue;
+
+static pthread_mutex_t value_lock = PTHREAD_MUTEX_INITIALIZER;
+static PooledValue* value_free_list = NULL;
+
+static Value* NewValue() {
+    pthread_mutex_lock(&value_lock);
+    if (value_free_list == NULL) {
+        PooledValue* slab = malloc(VALUE_SLAB * sizeof(PooledValue));
+        if (slab == NULL) {
+            pthread_mutex_unlock(&value_lock);
+            return NULL;
+        }
+        int i;
+        for (i = 0; i < VALUE_SLAB - 1; ++i) {
+            slab[i].next = slab + i + 1;
+        }
+        slab[VALUE_SLAB - 1].next = NULL;
+        value_free_list = slab;
+    }
+    PooledValue* pv = value_free_list;
+    value_free_list = pv->next;
+    pthread_mutex_unlock(&value_lock);
+    return &pv->value;
+}
+
+static void ReleaseValue(Value* v) {
+    PooledValue* pv = (PooledValue*)v;
+    pthread_mutex_lock(&value_lock);
+    pv->next = value_free_list;
+    value_free_list = pv;
+    pthread_mutex_unlock(&value_lock);
+}
+
 // Functions should:
 //
 //    - return a malloc()'d string
@@ -33,7 +158,7 @@ int BooleanString(const char* s) {
 }
 
 char* Evaluate(State* state, Expr* expr) {
-    Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
+    Value* v = Call(state, expr);
     if (v == NULL) return NULL;
     if (v->type != VAL_STRING) {
         ErrorAbort(state, "expecting string, got value type %d", v->type);
@@ -41,53 +166,94 @@ char* Evaluate(State* state, Expr* expr) {
         return NULL;
     }
     char* result = v->data;
-    free(v);
+    if (v->store != NULL) {
+        result = malloc(v->size + 1);
+        memcpy(result, v->data, v->size);
+        result[v->size] = '\0';
+        ReleaseValueStore(v->store);
+    }
+    ReleaseValue(v);
     return result;
 }
 
 Value* EvaluateValue(State* state, Expr* expr) {
-    return expr->fn(expr->name, state, expr->argc, expr->argv);
+    return Call(state, expr);
 }
 
 Value* StringValue(char* str) {
     if (str == NULL) return NULL;
-    Value* v = malloc(sizeof(Value));
+    Value* v = NewValue();
     v->type = VAL_STRING;
     v->size = strlen(str);
     v->data = str;
+    v->store = NULL;
     return v;
 }
 
+Value* StoreBlobValue(ValueStore* store, char* data, ssize_t size) {
+    Value* v = NewValue();
+    v->type = VAL_BLOB;
+    v->size = size;
+    v->data = data;
+    v->store = store;
+    RetainValueStore(store);
+    return v;
+}
+
+void RetainValueStore(ValueStore* store) {
+    __sync_fetch_and_add(&store->refcount, 1);
+}
+
+void ReleaseValueStore(ValueStore* store) {
+    if (store != NULL && __sync_sub_and_fetch(&store->refcount, 1) == 0) {
+        store->release(store);
+    }
+}
+
 void FreeValue(Value* v) {
     if (v == NULL) return;
-    free(v->data);
-    free(v);
+    if (v->store != NULL) {
+        ReleaseValueStore(v->store);
+    } else {
+        free(v->data);
+    }
+    ReleaseValue(v);
 }
 
 Value* ConcatFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc == 0) {
         return StringValue(strdup(""));
     }
-    char** strings = malloc(argc * sizeof(char*));
+    // Most calls (the '+' operator) have two arguments; only go to
+    // the heap for the rare long concat().
+    char* local[8];
+    size_t local_lengths[8];
+    char** strings = local;
+    size_t* lengths = local_lengths;
+    if (argc > 8) {
+        strings = malloc(argc * sizeof(char*));
+        lengths = malloc(argc * sizeof(size_t));
+    }
     int i;
     for (i = 0; i < argc; ++i) {
         strings[i] = NULL;
     }
     char* result = NULL;
-    int length = 0;
+    size_t length = 0;
     for (i = 0; i < argc; ++i) {
         strings[i] = Evaluate(state, argv[i]);
         if (strings[i] == NULL) {
             goto done;
         }
-        length += strlen(strings[i]);
+        lengths[i] = strlen(strings[i]);
+        length += lengths[i];
     }
 
     result = malloc(length+1);
-    int p = 0;
+    size_t p = 0;
     for (i = 0; i < argc; ++i) {
-        strcpy(result+p, strings[i]);
-        p += strlen(strings[i]);
+        memcpy(result+p, strings[i], lengths[i]);
+        p += lengths[i];
     }
     result[p] = '\0';
 
@@ -95,7 +261,10 @@ Value* ConcatFn(const char* name, State* state, int argc, Expr* argv[]) {
     for (i = 0; i < argc; ++i) {
         free(strings[i]);
     }
-    free(strings);
+    if (strings != local) {
+        free(strings);
+        free(lengths);
+    }
     return StringValue(result);
 }
 
@@ -265,10 +434,15 @@ Value* InequalityFn(const char* name, State* state, int argc, Expr* argv[]) {
 }
 
 Value* SequenceFn(const char* name, State* state, int argc, Expr* argv[]) {
-    Value* left = EvaluateValue(state, argv[0]);
-    if (left == NULL) return NULL;
-    FreeValue(left);
-    return EvaluateValue(state, argv[1]);
+    // The parser always builds two-argument sequences; OptimizeExpr()
+    // flattens chains of them into one node with many arguments.
+    int i;
+    for (i = 0; i < argc-1; ++i) {
+        Value* left = EvaluateValue(state, argv[i]);
+        if (left == NULL) return NULL;
+        FreeValue(left);
+    }
+    return EvaluateValue(state, argv[argc-1]);
 }
 
 Value* LessThanIntFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -327,11 +501,11 @@ Value* Literal(const char* name, State* state, int argc, Expr* argv[]) {
 Expr* Build(Function fn, YYLTYPE loc, int count, ...) {
     va_list v;
     va_start(v, count);
-    Expr* e = malloc(sizeof(Expr));
+    Expr* e = ExprArenaAlloc(sizeof(Expr));
     e->fn = fn;
-    e->name = "(operator)";
+    e->name = kOperatorName;
     e->argc = count;
-    e->argv = malloc(count * sizeof(Expr*));
+    e->argv = ExprArenaAlloc(count * sizeof(Expr*));
     int i;
     for (i = 0; i < count; ++i) {
         e->argv[i] = va_arg(v, Expr*);
@@ -342,6 +516,201 @@ Expr* Build(Function fn, YYLTYPE loc, int count, ...) {
     return e;
 }
 
+// -----------------------------------------------------------------
+//   compile-time optimization
+// -----------------------------------------------------------------
+
+
+static bool IsLiteral(const Expr* e) {
+    return e->fn == Literal;
+}
+
+// Turn e into a literal evaluating to str (allocated from the arena),
+// discarding its arguments.  The source span is kept so assert() still
+// reports the original text.  Nodes that drop out of the tree are left
+// to FreeExprArena().
+static void MakeLiteral(Expr* e, char* str) {
+    e->fn = Literal;
+    e->name = str;
+    e->argc = 0;
+    e->argv = NULL;
+}
+
+static void MakeBoolLiteral(Expr* e, bool b) {
+    MakeLiteral(e, ExprArenaStrdup(b ? "t" : ""));
+}
+
+// Replace e with its argument argv[keep], discarding the others.
+static void ReplaceWithArg(Expr* e, int keep) {
+    Expr* child = e->argv[keep];
+    int start = e->start;
+    int end = e->end;
+    *e = *child;
+    e->start = start;
+    e->end = end;
+}
+
+// The flattened argument lists are built up on the heap and moved into
+// the arena once they're complete.
+static Expr** FinishArgs(Expr** argv, int argc) {
+    Expr** copy = ExprArenaAlloc(argc * sizeof(Expr*));
+    if (argc > 0) memcpy(copy, argv, argc * sizeof(Expr*));
+    free(argv);
+    return copy;
+}
+
+static void AppendArg(Expr*** argv, int* argc, int* size, Expr* arg) {
+    if (*argc >= *size) {
+        *size = *size * 2 + 4;
+        *argv = realloc(*argv, *size * sizeof(Expr*));
+    }
+    (*argv)[(*argc)++] = arg;
+}
+
+// Append arg to a sequence being flattened, splicing in its arguments
+// if it is itself a (flattened) sequence.
+static void AppendSequenceArg(Expr*** argv, int* argc, int* size, Expr* arg) {
+    OptimizeExpr(arg);
+    if (arg->fn == SequenceFn) {
+        int i;
+        for (i = 0; i < arg->argc; ++i) {
+            AppendArg(argv, argc, size, arg->argv[i]);
+        }
+    } else {
+        AppendArg(argv, argc, size, arg);
+    }
+}
+
+// "a; b; c; ..." parses as a chain of two-argument SequenceFn nodes
+// leaning to the left, as deep as the script is long.  Walk down it
+// without recursing and replace it with one node holding all the
+// statements, dropping literals whose value would be thrown away.
+static void OptimizeSequence(Expr* e) {
+    int depth = 0;
+    Expr* n;
+    for (n = e; n->fn == SequenceFn && n->argc > 0; n = n->argv[0]) {
+        ++depth;
+    }
+    Expr** spine = malloc(depth * sizeof(Expr*));
+    int i, j;
+    for (i = 0, n = e; i < depth; ++i, n = n->argv[0]) {
+        spine[i] = n;
+    }
+
+    Expr** argv = NULL;
+    int argc = 0;
+    int size = 0;
+    AppendSequenceArg(&argv, &argc, &size, n);
+    for (i = depth-1; i >= 0; --i) {
+        for (j = 1; j < spine[i]->argc; ++j) {
+            AppendSequenceArg(&argv, &argc, &size, spine[i]->argv[j]);
+        }
+    }
+    free(spine);
+
+    int out = 0;
+    for (i = 0; i < argc; ++i) {
+        if (i == argc-1 || !IsLiteral(argv[i])) {
+            argv[out++] = argv[i];
+        }
+    }
+
+    e->argc = out;
+    e->argv = FinishArgs(argv, out);
+    if (out == 1) {
+        ReplaceWithArg(e, 0);
+    }
+}
+
+// Splice nested concatenations into e and merge runs of adjacent
+// literals, so "a" + b + "c" + "d" becomes concat("a", b, "cd").
+static void OptimizeConcat(Expr* e) {
+    Expr** argv = NULL;
+    int argc = 0;
+    int size = 0;
+    int i, j;
+    for (i = 0; i < e->argc; ++i) {
+        Expr* arg = e->argv[i];
+        if (arg->fn == ConcatFn) {
+            for (j = 0; j < arg->argc; ++j) {
+                AppendArg(&argv, &argc, &size, arg->argv[j]);
+            }
+        } else {
+            AppendArg(&argv, &argc, &size, arg);
+        }
+    }
+
+    int out = 0;
+    for (i = 0; i < argc; i = j) {
+        for (j = i+1; j < argc && IsLiteral(argv[i]) && IsLiteral(argv[j]);
+             ++j) {
+            size_t a = strlen(argv[i]->name);
+            size_t b = strlen(argv[j]->name);
+            char* joined = ExprArenaAlloc(a + b + 1);
+            memcpy(joined, argv[i]->name, a);
+            memcpy(joined + a, argv[j]->name, b + 1);
+            argv[i]->end = argv[j]->end;
+            MakeLiteral(argv[i], joined);
+        }
+        argv[out++] = argv[i];
+    }
+
+    e->argc = out;
+    e->argv = FinishArgs(argv, out);
+    if (out == 1 && IsLiteral(e->argv[0])) {
+        ReplaceWithArg(e, 0);
+    } else if (out == 0) {
+        MakeLiteral(e, ExprArenaStrdup(""));
+    }
+}
+
+void OptimizeExpr(Expr* e) {
+    if (e->fn == SequenceFn) {
+        OptimizeSequence(e);
+        return;
+    }
+
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        OptimizeExpr(e->argv[i]);
+    }
+
+    Expr** argv = e->argv;
+    if (e->fn == ConcatFn) {
+        OptimizeConcat(e);
+    } else if (e->fn == EqualityFn || e->fn == InequalityFn) {
+        if (IsLiteral(argv[0]) && IsLiteral(argv[1])) {
+            bool equal = strcmp(argv[0]->name, argv[1]->name) == 0;
+            MakeBoolLiteral(e, e->fn == EqualityFn ? equal : !equal);
+        }
+    } else if (e->fn == SubstringFn && e->argc == 2) {
+        if (IsLiteral(argv[0]) && IsLiteral(argv[1])) {
+            MakeBoolLiteral(e, strstr(argv[1]->name, argv[0]->name) != NULL);
+        }
+    } else if (e->fn == LogicalNotFn) {
+        if (IsLiteral(argv[0])) {
+            MakeBoolLiteral(e, !BooleanString(argv[0]->name));
+        }
+    } else if (e->fn == LogicalAndFn || e->fn == LogicalOrFn) {
+        // The right side is only evaluated if the left doesn't
+        // already decide the result, which is then the left itself.
+        if (IsLiteral(argv[0])) {
+            bool left = BooleanString(argv[0]->name);
+            ReplaceWithArg(e, left == (e->fn == LogicalAndFn) ? 1 : 0);
+        }
+    } else if (e->fn == IfElseFn && (e->argc == 2 || e->argc == 3)) {
+        if (IsLiteral(argv[0])) {
+            if (BooleanString(argv[0]->name)) {
+                ReplaceWithArg(e, 1);
+            } else if (e->argc == 3) {
+                ReplaceWithArg(e, 2);
+            } else {
+                ReplaceWithArg(e, 0);
+            }
+        }
+    }
+}
+
 // -----------------------------------------------------------------
 //   the function table
 // -----------------------------------------------------------------
@@ -350,6 +719,21 @@ static int fn_entries = 0;
 static int fn_size = 0;
 NamedFunction* fn_table = NULL;
 
+// FinishRegistration() builds a perfect hash over fn_table ("hash and
+// displace"): each name picks a bucket with one hash, and each bucket
+// has a seed, chosen at registration time, that sends all of its names
+// to distinct free slots of fn_slot with a second hash.  A lookup is
+// two hashes and one strcmp() to reject names that aren't registered;
+// the full hash is kept per slot so most of those are rejected without
+// touching the string at all.
+static NamedFunction** fn_slot = NULL;
+static unsigned int* fn_slot_hash = NULL;
+static unsigned int fn_slot_mask = 0;
+static unsigned int* fn_bucket_seed = NULL;
+static unsigned int fn_bucket_mask = 0;
+
+#define FN_MAX_SEED 65536
+
 void RegisterFunction(const char* name, Function fn) {
     if (fn_entries >= fn_size) {
         fn_size = fn_size*2 + 1;
@@ -366,16 +750,111 @@ static int fn_entry_compare(const void* a, const void* b) {
     return strcmp(na, nb);
 }
 
+// FNV-1a, with the seed folded into the offset basis.
+static unsigned int fn_hash(const char* name, unsigned int seed) {
+    unsigned int h = 2166136261u ^ (seed * 0x9e3779b9u);
+    const unsigned char* p;
+    for (p = (const unsigned char*)name; *p; ++p) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+static unsigned int fn_bucket(const char* name) {
+    return fn_hash(name, 0) & fn_bucket_mask;
+}
+
+// Entries of fn_table ordered by bucket, biggest buckets first: those
+// are the hardest to place, so they go while the table is emptiest.
+static int* fn_bucket_count;
+static int fn_bucket_order_compare(const void* a, const void* b) {
+    unsigned int ba = fn_bucket(((const NamedFunction*)a)->name);
+    unsigned int bb = fn_bucket(((const NamedFunction*)b)->name);
+    if (fn_bucket_count[ba] != fn_bucket_count[bb]) {
+        return fn_bucket_count[bb] - fn_bucket_count[ba];
+    }
+    return (ba > bb) - (ba < bb);
+}
+
+// Find a seed for every bucket with fn_slot_mask+1 slots.  Returns
+// false if some bucket can't be placed, in which case the caller tries
+// again with a bigger table.
+static bool fn_place_all() {
+    memset(fn_slot, 0, (fn_slot_mask+1) * sizeof(NamedFunction*));
+    int i = 0;
+    while (i < fn_entries) {
+        unsigned int bucket = fn_bucket(fn_table[i].name);
+        int n = fn_bucket_count[bucket];
+        unsigned int seed;
+        for (seed = 1; seed < FN_MAX_SEED; ++seed) {
+            int j;
+            for (j = 0; j < n; ++j) {
+                unsigned int h = fn_hash(fn_table[i+j].name, seed);
+                unsigned int slot = h & fn_slot_mask;
+                if (fn_slot[slot] != NULL) break;
+                fn_slot[slot] = fn_table + i + j;
+                fn_slot_hash[slot] = h;
+            }
+            if (j == n) break;
+            // Collided (possibly with this bucket's own names); undo.
+            while (j-- > 0) {
+                fn_slot[fn_hash(fn_table[i+j].name, seed) & fn_slot_mask] = NULL;
+            }
+        }
+        if (seed == FN_MAX_SEED) return false;
+        fn_bucket_seed[bucket] = seed;
+        i += n;
+    }
+    return true;
+}
+
 void FinishRegistration() {
+    // Drop names registered more than once; only one of them is kept.
     qsort(fn_table, fn_entries, sizeof(NamedFunction), fn_entry_compare);
+    int i, out = 0;
+    for (i = 0; i < fn_entries; ++i) {
+        if (out == 0 || strcmp(fn_table[out-1].name, fn_table[i].name) != 0) {
+            fn_table[out++] = fn_table[i];
+        }
+    }
+    fn_entries = out;
+
+    unsigned int buckets = 1;
+    while (buckets * 2 < (unsigned int)fn_entries) {
+        buckets <<= 1;
+    }
+    fn_bucket_mask = buckets - 1;
+    fn_bucket_seed = realloc(fn_bucket_seed, buckets * sizeof(unsigned int));
+    fn_bucket_count = calloc(buckets, sizeof(int));
+    for (i = 0; i < fn_entries; ++i) {
+        ++fn_bucket_count[fn_bucket(fn_table[i].name)];
+    }
+    qsort(fn_table, fn_entries, sizeof(NamedFunction),
+          fn_bucket_order_compare);
+
+    unsigned int size = 1;
+    while (size < 2 * (unsigned int)fn_entries) {
+        size <<= 1;
+    }
+    for (;;) {
+        fn_slot = realloc(fn_slot, size * sizeof(NamedFunction*));
+        fn_slot_hash = realloc(fn_slot_hash, size * sizeof(unsigned int));
+        fn_slot_mask = size - 1;
+        if (fn_place_all()) break;
+        size <<= 1;
+    }
+    free(fn_bucket_count);
+    fn_bucket_count = NULL;
 }
 
 Function FindFunction(const char* name) {
-    NamedFunction key;
-    key.name = name;
-    NamedFunction* nf = bsearch(&key, fn_table, fn_entries,
-                                sizeof(NamedFunction), fn_entry_compare);
-    if (nf == NULL) {
+    if (fn_slot == NULL) {
+        return NULL;
+    }
+    unsigned int h = fn_hash(name, fn_bucket_seed[fn_bucket(name)]);
+    unsigned int slot = h & fn_slot_mask;
+    NamedFunction* nf = fn_slot[slot];
+    if (nf == NULL || fn_slot_hash[slot] != h || strcmp(nf->name, name) != 0) {
         return NULL;
     }
     return nf->fn;
@@ -395,6 +874,246 @@ void RegisterBuiltins() {
 }
 
 
+// -----------------------------------------------------------------
+//   profiling
+// -----------------------------------------------------------------
+
+// What has been recorded for one call site.
+typedef struct {
+    const Expr* expr;
+    long calls;
+    double total;           // seconds, including the calls it made
+    double self;            // seconds, excluding them
+    long long bytes;
+} ProfileRecord;
+
+// The call in progress on a thread, innermost first.
+typedef struct ProfileFrame {
+    ProfileRecord* record;
+    double child;           // seconds spent in calls made from this one
+    long long bytes;
+    struct ProfileFrame* parent;
+} ProfileFrame;
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t profile_key;
+
+// Open-addressed table of call sites, keyed by Expr*.  Records are
+// allocated one by one so running calls can keep pointers to them
+// while the table grows.
+static ProfileRecord** profile_table = NULL;
+static int profile_size = 0;
+static int profile_count = 0;
+
+static double ProfileNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int ProfileSlot(ProfileRecord** table, int size, const Expr* expr) {
+    unsigned long h = (unsigned long)expr;
+    int i = (int)((h >> 4) * 2654435761u) & (size - 1);
+    while (table[i] != NULL && table[i]->expr != expr) {
+        i = (i + 1) & (size - 1);
+    }
+    return i;
+}
+
+// Called with profile_lock held.
+static ProfileRecord* ProfileRecordFor(const Expr* expr) {
+    if (profile_count * 2 >= profile_size) {
+        int size = profile_size ? profile_size * 2 : 1024;
+        ProfileRecord** table = calloc(size, sizeof(ProfileRecord*));
+        int i;
+        for (i = 0; i < profile_size; ++i) {
+            if (profile_table[i] != NULL) {
+                table[ProfileSlot(table, size, profile_table[i]->expr)] =
+                    profile_table[i];
+            }
+        }
+        free(profile_table);
+        profile_table = table;
+        profile_size = size;
+    }
+    int slot = ProfileSlot(profile_table, profile_size, expr);
+    if (profile_table[slot] == NULL) {
+        ProfileRecord* r = calloc(1, sizeof(ProfileRecord));
+        r->expr = expr;
+        profile_table[slot] = r;
+        ++profile_count;
+    }
+    return profile_table[slot];
+}
+
+static Value* ProfileCall(State* state, Expr* expr) {
+    // Literals and operators cost next to nothing themselves; their
+    // time shows up in whatever called them.
+    if (expr->fn == Literal || expr->name == kOperatorName) {
+        return expr->fn(expr->name, state, expr->argc, expr->argv);
+    }
+
+    ProfileFrame frame;
+    pthread_mutex_lock(&profile_lock);
+    frame.record = ProfileRecordFor(expr);
+    pthread_mutex_unlock(&profile_lock);
+    frame.child = 0;
+    frame.bytes = 0;
+    frame.parent = (ProfileFrame*)pthread_getspecific(profile_key);
+    pthread_setspecific(profile_key, &frame);
+
+    double start = ProfileNow();
+    Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
+    double elapsed = ProfileNow() - start;
+
+    pthread_setspecific(profile_key, frame.parent);
+    if (frame.parent != NULL) {
+        frame.parent->child += elapsed;
+    }
+    pthread_mutex_lock(&profile_lock);
+    ++frame.record->calls;
+    frame.record->total += elapsed;
+    frame.record->self += elapsed - frame.child;
+    frame.record->bytes += frame.bytes;
+    pthread_mutex_unlock(&profile_lock);
+    return v;
+}
+
+void EnableProfiling() {
+    if (!profiling) {
+        pthread_key_create(&profile_key, NULL);
+        profiling = true;
+    }
+}
+
+void ProfileAddBytes(long long bytes) {
+    if (!profiling) return;
+    ProfileFrame* frame = (ProfileFrame*)pthread_getspecific(profile_key);
+    if (frame != NULL) {
+        frame->bytes += bytes;
+    }
+}
+
+// One line of the report: a function, or a function on one line.
+typedef struct {
+    const char* name;
+    int line;
+    long calls;
+    double total;
+    double self;
+    long long bytes;
+} ProfileEntry;
+
+static int profile_entry_by_start(const void* a, const void* b) {
+    int sa = (*(ProfileRecord* const*)a)->expr->start;
+    int sb = (*(ProfileRecord* const*)b)->expr->start;
+    return (sa > sb) - (sa < sb);
+}
+
+static int profile_entry_by_key(const void* a, const void* b) {
+    const ProfileEntry* ea = (const ProfileEntry*)a;
+    const ProfileEntry* eb = (const ProfileEntry*)b;
+    if (ea->line != eb->line) return ea->line - eb->line;
+    return strcmp(ea->name, eb->name);
+}
+
+static int profile_entry_by_self(const void* a, const void* b) {
+    double sa = ((const ProfileEntry*)a)->self;
+    double sb = ((const ProfileEntry*)b)->self;
+    return (sa < sb) - (sa > sb);
+}
+
+// Sort entries by (line, name), merge the duplicates and sort what's
+// left by self time, biggest first.  Returns the new count.
+static int ProfileMerge(ProfileEntry* entries, int count) {
+    qsort(entries, count, sizeof(ProfileEntry), profile_entry_by_key);
+    int i, out = 0;
+    for (i = 0; i < count; ++i) {
+        if (out > 0 && entries[out-1].line == entries[i].line &&
+            strcmp(entries[out-1].name, entries[i].name) == 0) {
+            entries[out-1].calls += entries[i].calls;
+            entries[out-1].total += entries[i].total;
+            entries[out-1].self += entries[i].self;
+            entries[out-1].bytes += entries[i].bytes;
+        } else {
+            entries[out++] = entries[i];
+        }
+    }
+    qsort(entries, out, sizeof(ProfileEntry), profile_entry_by_self);
+    return out;
+}
+
+static void ProfilePrint(FILE* f, const ProfileEntry* e, bool by_line) {
+    if (by_line) {
+        fprintf(f, "%6d  ", e->line);
+    }
+    fprintf(f, "%-26s %8ld %10.3f %10.3f", e->name, e->calls,
+            e->total, e->self);
+    if (e->bytes > 0) {
+        fprintf(f, " %9.1f %8.2f", e->bytes / 1048576.0,
+                e->self > 0 ? e->bytes / 1048576.0 / e->self : 0.0);
+    }
+    fputc('\n', f);
+}
+
+void WriteProfileReport(FILE* f, const char* script, int max_lines) {
+    if (!profiling) return;
+    pthread_mutex_lock(&profile_lock);
+
+    ProfileRecord** records = malloc(profile_count * sizeof(ProfileRecord*));
+    int i, n = 0;
+    for (i = 0; i < profile_size; ++i) {
+        if (profile_table[i] != NULL) records[n++] = profile_table[i];
+    }
+
+    // Work out line numbers in one sweep over the script.
+    qsort(records, n, sizeof(ProfileRecord*), profile_entry_by_start);
+    ProfileEntry* by_line = malloc(n * sizeof(ProfileEntry));
+    ProfileEntry* by_name = malloc(n * sizeof(ProfileEntry));
+    int line = 1;
+    int pos = 0;
+    long calls = 0;
+    double self = 0;
+    for (i = 0; i < n; ++i) {
+        ProfileRecord* r = records[i];
+        for (; pos < r->expr->start && script[pos] != '\0'; ++pos) {
+            if (script[pos] == '\n') ++line;
+        }
+        by_line[i].name = r->expr->name;
+        by_line[i].line = line;
+        by_line[i].calls = r->calls;
+        by_line[i].total = r->total;
+        by_line[i].self = r->self;
+        by_line[i].bytes = r->bytes;
+        by_name[i] = by_line[i];
+        by_name[i].line = 0;
+        calls += r->calls;
+        self += r->self;
+    }
+    free(records);
+    pthread_mutex_unlock(&profile_lock);
+
+    int names = ProfileMerge(by_name, n);
+    int lines = ProfileMerge(by_line, n);
+
+    fprintf(f, "edify profile: %ld calls, %.3f s in functions\n", calls, self);
+    fprintf(f, "%-26s %8s %10s %10s %9s %8s\n",
+            "function", "calls", "total s", "self s", "MB", "MB/s");
+    for (i = 0; i < names; ++i) {
+        ProfilePrint(f, by_name + i, false);
+    }
+    fprintf(f, "\n%6s  %-26s %8s %10s %10s %9s %8s\n",
+            "line", "function", "calls", "total s", "self s", "MB", "MB/s");
+    for (i = 0; i < lines && (max_lines <= 0 || i < max_lines); ++i) {
+        ProfilePrint(f, by_line + i, true);
+    }
+    if (i < lines) {
+        fprintf(f, "(%d more lines)\n", lines - i);
+    }
+    free(by_name);
+    free(by_line);
+}
+
 // -----------------------------------------------------------------
 //   convenience methods for functions
 // -----------------------------------------------------------------
@@ -17,6 +17,7 @@
 #ifndef _EXPRESSION_H
 #define _EXPRESSION_H
 
+#include <stdio.h>
 #include <unistd.h>
 
 #include "yydefs.h"
@@ -44,10 +45,21 @@ typedef struct {
 #define VAL_STRING  1  // data will be NULL-terminated; size doesn't count null
 #define VAL_BLOB    2
 
+// Reference-counted memory shared by blob Values that point into it
+// rather than owning a malloc'd copy of their data (eg, a mapping of a
+// large file or package entry).  Embed this at the start of a bigger
+// struct; release() is called to free the whole thing when the last
+// reference is dropped.
+typedef struct ValueStore {
+    int refcount;
+    void (*release)(struct ValueStore* store);
+} ValueStore;
+
 typedef struct {
     int type;
     ssize_t size;
     char* data;
+    ValueStore* store;  // if non-NULL, data lies inside it and isn't ours
 } Value;
 
 typedef Value* (*Function)(const char* name, State* state,
@@ -92,6 +104,23 @@ Value* SequenceFn(const char* name, State* state, int argc, Expr* argv[]);
 // of arguments.
 Expr* Build(Function fn, YYLTYPE loc, int count, ...);
 
+// Memory for Exprs, their argv arrays and names.  It all comes from one
+// arena, which is only ever freed as a whole: call FreeExprArena() once
+// every script parsed so far is done with (and after any profile report,
+// which refers to the Exprs).
+void* ExprArenaAlloc(size_t size);
+char* ExprArenaStrdup(const char* str);
+char* ExprArenaStrndup(const char* str, size_t len);
+void FreeExprArena();
+
+// Simplify a parsed script in place before it is evaluated: operators
+// and builtins whose arguments are all literals are folded into
+// literals, and chains of ';' and '+' are flattened into single nodes
+// so evaluating a long script doesn't recurse once per statement.
+// Only side-effect-free builtins are folded; functions registered by
+// the application are always called at run time.
+void OptimizeExpr(Expr* root);
+
 // Global builtins, registered by RegisterBuiltins().
 Value* IfElseFn(const char* name, State* state, int argc, Expr* argv[]);
 Value* AssertFn(const char* name, State* state, int argc, Expr* argv[]);
@@ -150,6 +179,24 @@ char** ReadVarArgs(State* state, int argc, Expr* argv[]);
 // Values it contains.
 Value** ReadValueVarArgs(State* state, int argc, Expr* argv[]);
 
+// --- profiling ---
+
+// Start timing every function call evaluated from now on (operators
+// and literals are folded into their callers).  Off by default: it
+// costs a lookup and two clock reads per call.
+void EnableProfiling();
+
+// Credit bytes of data read or written to the function call running on
+// this thread, for the MB/s figures in the report.  Does nothing when
+// not profiling.
+void ProfileAddBytes(long long bytes);
+
+// Write the calls, wall time (including and excluding the calls each
+// one made) and bytes recorded so far to f, per function and then per
+// script line, biggest self time first.  script is the source that was
+// parsed, for the line numbers; max_lines > 0 limits the per-line part.
+void WriteProfileReport(FILE* f, const char* script, int max_lines);
+
 // Use printf-style arguments to compose an error message to put into
 // *state.  Returns NULL.
 Value* ErrorAbort(State* state, char* format, ...);
@@ -157,7 +204,16 @@ Value* ErrorAbort(State* state, char* format, ...);
 // Wrap a string into a Value, taking ownership of the string.
 Value* StringValue(char* str);
 
-// Free a Value object.
+// Wrap size bytes at data, which must lie inside store, into a
+// VAL_BLOB Value without copying them.  The Value takes its own
+// reference to store.
+Value* StoreBlobValue(ValueStore* store, char* data, ssize_t size);
+
+void RetainValueStore(ValueStore* store);
+void ReleaseValueStore(ValueStore* store);
+
+// Free a Value object (dropping its reference to a ValueStore, if it
+// has one, instead of freeing the data).
 void FreeValue(Value* v);
 
 #endif  // _EXPRESSION_H
@@ -23,13 +23,12 @@
 
 extern int yyparse(Expr** root, int* error_count);
 
-int expect(const char* expr_str, const char* expected, int* errors) {
+int expect_parsed(const char* expr_str, const char* expected, int optimize,
+                  int* errors) {
     Expr* e;
     int error;
     char* result;
 
-    printf(".");
-
     yy_scan_string(expr_str);
     int error_count = 0;
     error = yyparse(&e, &error_count);
@@ -39,6 +38,9 @@ int expect(const char* expr_str, const char* expected, int* errors) {
         ++*errors;
         return 0;
     }
+    if (optimize) {
+        OptimizeExpr(e);
+    }
 
     State state;
     state.cookie = NULL;
@@ -47,8 +49,10 @@ int expect(const char* expr_str, const char* expected, int* errors) {
 
     result = Evaluate(&state, e);
     free(state.errmsg);
+    FreeExprArena();
     if (result == NULL && expected != NULL) {
-        fprintf(stderr, "error evaluating \"%s\"\n", expr_str);
+        fprintf(stderr, "error evaluating \"%s\"%s\n", expr_str,
+                optimize ? " (optimized)" : "");
         ++*errors;
         return 0;
     }
@@ -58,8 +62,8 @@ int expect(const char* expr_str, const char* expected, int* errors) {
     }
 
     if (strcmp(result, expected) != 0) {
-        fprintf(stderr, "evaluating \"%s\": expected \"%s\", got \"%s\"\n",
-                expr_str, expected, result);
+        fprintf(stderr, "evaluating \"%s\"%s: expected \"%s\", got \"%s\"\n",
+                expr_str, optimize ? " (optimized)" : "", expected, result);
         ++*errors;
         free(result);
         return 0;
@@ -69,6 +73,13 @@ int expect(const char* expr_str, const char* expected, int* errors) {
     return 1;
 }
 
+// Check each expression both as parsed and after OptimizeExpr().
+int expect(const char* expr_str, const char* expected, int* errors) {
+    printf(".");
+    return expect_parsed(expr_str, expected, 0, errors) &
+        expect_parsed(expr_str, expected, 1, errors);
+}
+
 int test() {
     int errors = 0;
 
@@ -153,6 +164,16 @@ int test() {
     expect("greater_than_int(x, 3)", "", &errors);
     expect("greater_than_int(3, x)", "", &errors);
 
+    // folding and flattening
+    expect("a; \"\"; b + c; (d; e + f) + g", "efg", &errors);
+    expect("(a + b) + concat(c, d + e) + concat()", "abcde", &errors);
+    expect("a + (\"\" || b) + (!c && d) + ifelse(x == y, e)", "ab", &errors);
+    expect("if a != b then c + d endif + less_than_int(1, 2)", "cdt", &errors);
+    expect("is_substring(b, abc) + concat(a, less_than_int(2, 1), b)",
+           "tab", &errors);
+    expect("a; ifelse(a == a, abort(), b)", NULL, &errors);
+    expect("\"\" || abort(); c", NULL, &errors);
+
     printf("\n");
 
     return errors;
@@ -193,6 +214,7 @@ int main(int argc, char** argv) {
     printf("parse returned %d; %d errors encountered\n", error, error_count);
     if (error == 0 || error_count > 0) {
 
+        OptimizeExpr(root);
         ExprDump(0, root, buffer);
 
         State state;
@@ -66,7 +66,7 @@ input:  expr           { *root = $1; }
 ;
 
 expr:  STRING {
-    $$ = malloc(sizeof(Expr));
+    $$ = ExprArenaAlloc(sizeof(Expr));
     $$->fn = Literal;
     $$->name = $1;
     $$->argc = 0;
@@ -87,7 +87,7 @@ expr:  STRING {
 |  IF expr THEN expr ENDIF           { $$ = Build(IfElseFn, @$, 2, $2, $4); }
 |  IF expr THEN expr ELSE expr ENDIF { $$ = Build(IfElseFn, @$, 3, $2, $4, $6); }
 | STRING '(' arglist ')' {
-    $$ = malloc(sizeof(Expr));
+    $$ = ExprArenaAlloc(sizeof(Expr));
     $$->fn = FindFunction($1);
     if ($$->fn == NULL) {
         char buffer[256];
@@ -109,12 +109,18 @@ arglist:    /* empty */ {
 }
 | expr {
     $$.argc = 1;
-    $$.argv = malloc(sizeof(Expr*));
+    $$.argv = ExprArenaAlloc(sizeof(Expr*));
     $$.argv[0] = $1;
 }
 | arglist ',' expr {
+    // Grow by doubling, in the arena; the old array is left behind.
     $$.argc = $1.argc + 1;
-    $$.argv = realloc($$.argv, $$.argc * sizeof(Expr*));
+    $$.argv = $1.argv;
+    if (($1.argc & ($1.argc - 1)) == 0) {
+        int size = $1.argc > 0 ? $1.argc * 2 : 1;
+        $$.argv = ExprArenaAlloc(size * sizeof(Expr*));
+        if ($1.argc > 0) memcpy($$.argv, $1.argv, $1.argc * sizeof(Expr*));
+    }
     $$.argv[$$.argc-1] = $3;
 }
 ;
@@ -1,6 +1,8 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <linux/input.h>
 
 #include <sys/wait.h>
@@ -12,6 +14,7 @@
 #include "minui/minui.h"
 #include "recovery_ui.h"
 #include "extendedcommand.h"
+#include "roots.h"
 
 void free_string_array(char** array)
 {
@@ -27,109 +30,199 @@ void free_string_array(char** array)
     free(array);
 }
 
-char** gather_files(const char* directory, const char* fileExtensionOrDirectory, int* numFiles)
+// Listings of the directories shown by the file choosers are kept while
+// the directory's mtime and the mount generation (see roots.h) stay the
+// same, so going in and out of a big sdcard directory reads it once.
+#define LISTING_CACHE_SIZE 8
+
+typedef struct {
+    char* directory;
+    unsigned int generation;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    int reusable;
+    unsigned int last_used;
+    // Entry names, sorted.
+    char** dirs;
+    int numDirs;
+    char** files;
+    int numFiles;
+} DirListing;
+
+static DirListing listing_cache[LISTING_CACHE_SIZE];
+static unsigned int listing_clock = 0;
+
+static int compare_names(const void* a, const void* b)
+{
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+static void add_name(char*** names, int* count, int* capacity, const char* name)
+{
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        *names = (char**) realloc(*names, *capacity * sizeof(char*));
+    }
+    (*names)[(*count)++] = strdup(name);
+}
+
+static void free_listing(DirListing* l)
 {
-    char path[PATH_MAX] = "";
-    DIR *dir;
-    struct dirent *de;
-    int total = 0;
     int i;
-    char** files = NULL;
-    int pass;
-    *numFiles = 0;
-    int dirLen = strlen(directory);
+    for (i = 0; i < l->numDirs; i++)
+        free(l->dirs[i]);
+    for (i = 0; i < l->numFiles; i++)
+        free(l->files[i]);
+    free(l->dirs);
+    free(l->files);
+    free(l->directory);
+    memset(l, 0, sizeof(*l));
+}
 
-    dir = opendir(directory);
-    if (dir == NULL) {
+// Read the directory once, sorting entries into directories and files by
+// d_type, and only stat()ing those the filesystem doesn't type for us.
+static int scan_directory(const char* directory, DirListing* l)
+{
+    DIR* dir = opendir(directory);
+    if (dir == NULL)
+        return -1;
+
+    int dirsCap = 0, filesCap = 0;
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        // skip hidden files
+        if (de->d_name[0] == '.')
+            continue;
+
+        int isDir = de->d_type == DT_DIR;
+        if (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK) {
+            struct stat info;
+            char fullFileName[PATH_MAX];
+            snprintf(fullFileName, sizeof(fullFileName), "%s%s", directory, de->d_name);
+            isDir = stat(fullFileName, &info) == 0 && S_ISDIR(info.st_mode);
+        }
+        if (isDir)
+            add_name(&l->dirs, &l->numDirs, &dirsCap, de->d_name);
+        else
+            add_name(&l->files, &l->numFiles, &filesCap, de->d_name);
+    }
+    if (closedir(dir) < 0) {
+        LOGE("Failed to close directory.");
+    }
+
+    qsort(l->dirs, l->numDirs, sizeof(char*), compare_names);
+    qsort(l->files, l->numFiles, sizeof(char*), compare_names);
+    return 0;
+}
+
+static DirListing* get_listing(const char* directory)
+{
+    struct stat st;
+    if (stat(directory, &st) != 0)
+        return NULL;
+    unsigned int generation = get_mount_generation();
+
+    int i;
+    DirListing* slot = &listing_cache[0];
+    for (i = 0; i < LISTING_CACHE_SIZE; i++) {
+        DirListing* l = &listing_cache[i];
+        if (l->directory != NULL && strcmp(l->directory, directory) == 0) {
+            if (l->reusable && l->generation == generation &&
+                l->dev == st.st_dev && l->ino == st.st_ino &&
+                l->mtime == st.st_mtime) {
+                l->last_used = ++listing_clock;
+                return l;
+            }
+            slot = l;
+            break;
+        }
+        if (l->last_used < slot->last_used)
+            slot = l;
+    }
+
+    free_listing(slot);
+    if (scan_directory(directory, slot) != 0) {
+        free_listing(slot);
+        return NULL;
+    }
+    slot->directory = strdup(directory);
+    slot->generation = generation;
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->mtime = st.st_mtime;
+    // A directory changed in the same (vfat: two-second) tick as we read
+    // it could change again without its mtime moving, so don't trust it.
+    time_t now = time(NULL);
+    slot->reusable = now < st.st_mtime || now - st.st_mtime > 2;
+    slot->last_used = ++listing_clock;
+    return slot;
+}
+
+char** gather_files(const char* directory, const char* fileExtensionOrDirectory, int* numFiles)
+{
+    *numFiles = 0;
+    DirListing* l = get_listing(directory);
+    if (l == NULL) {
         ui_print("Couldn't open directory.\n");
         return NULL;
     }
-  
+
+    // NULL means that we are gathering directories
+    char** names = fileExtensionOrDirectory == NULL ? l->dirs : l->files;
+    int count = fileExtensionOrDirectory == NULL ? l->numDirs : l->numFiles;
     int extension_length = 0;
     if (fileExtensionOrDirectory != NULL)
         extension_length = strlen(fileExtensionOrDirectory);
-  
-    int isCounting = 1;
-    i = 0;
-    for (pass = 0; pass < 2; pass++) {
-        while ((de=readdir(dir)) != NULL) {
-            // skip hidden files
-            if (de->d_name[0] == '.')
-                continue;
-            
-            // NULL means that we are gathering directories, so skip this
-            if (fileExtensionOrDirectory != NULL)
-            {
-                // make sure that we can have the desired extension (prevent seg fault)
-                if (strlen(de->d_name) < extension_length)
-                    continue;
-                // compare the extension
-                if (strcmp(de->d_name + strlen(de->d_name) - extension_length, fileExtensionOrDirectory) != 0)
-                    continue;
-            }
-            else
-            {
-                struct stat info;
-                char fullFileName[PATH_MAX];
-                strcpy(fullFileName, directory);
-                strcat(fullFileName, de->d_name);
-                stat(fullFileName, &info);
-                // make sure it is a directory
-                if (!(S_ISDIR(info.st_mode)))
-                    continue;
-            }
-            
-            if (pass == 0)
-            {
-                total++;
-                continue;
-            }
-            
-            files[i] = (char*) malloc(dirLen + strlen(de->d_name) + 2);
-            strcpy(files[i], directory);
-            strcat(files[i], de->d_name);
-            if (fileExtensionOrDirectory == NULL)
-                strcat(files[i], "/");
-            i++;
-        }
-        if (pass == 1)
-            break;
-        if (total == 0)
-            break;
-        rewinddir(dir);
-        *numFiles = total;
-        files = (char**) malloc((total+1)*sizeof(char*));
-        files[total]=NULL;
-    }
+    int dirLen = strlen(directory);
 
-    if(closedir(dir) < 0) {
-        LOGE("Failed to close directory.");
+    char** files = (char**) malloc((count + 1) * sizeof(char*));
+    int total = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        int len = strlen(names[i]);
+        if (fileExtensionOrDirectory != NULL &&
+            (len < extension_length ||
+             strcmp(names[i] + len - extension_length, fileExtensionOrDirectory) != 0))
+            continue;
+
+        files[total] = (char*) malloc(dirLen + len + 2);
+        strcpy(files[total], directory);
+        strcat(files[total], names[i]);
+        if (fileExtensionOrDirectory == NULL)
+            strcat(files[total], "/");
+        total++;
     }
+    files[total] = NULL;
 
-    if (total==0) {
+    if (total == 0) {
+        free(files);
         return NULL;
     }
+    *numFiles = total;
+    return files;
+}
 
-	// sort the result
-	if (files != NULL) {
-		for (i = 0; i < total; i++) {
-			int curMax = -1;
-			int j;
-			for (j = 0; j < total - i; j++) {
-				if (curMax == -1 || strcmp(files[curMax], files[j]) < 0)
-					curMax = j;
-			}
-			char* temp = files[curMax];
-			files[curMax] = files[total - i - 1];
-			files[total - i - 1] = temp;
-		}
-	}
+typedef struct {
+    char** files;
+    int numDirs;
+    void (*highlight)(const char* path);
+} FileHighlight;
 
-    return files;
+static void file_highlighted(int item, void* cookie)
+{
+    FileHighlight* fh = (FileHighlight*) cookie;
+    fh->highlight(item < fh->numDirs ? NULL : fh->files[item - fh->numDirs]);
 }
 
 // pass in NULL for fileExtensionOrDirectory and you will get a directory chooser
 char* choose_file_menu(const char* directory, const char* fileExtensionOrDirectory, const char* headers[])
+{
+    return choose_file_menu_highlight(directory, fileExtensionOrDirectory, headers, NULL);
+}
+
+char* choose_file_menu_highlight(const char* directory, const char* fileExtensionOrDirectory, const char* headers[],
+                                 void (*highlight)(const char* path))
 {
     char path[PATH_MAX] = "";
     DIR *dir;
@@ -165,15 +258,17 @@ char* choose_file_menu(const char* directory, const char* fileExtensionOrDirecto
             list[numDirs + i] = strdup(files[i] + dir_len);
         }
 
+        FileHighlight fh = { files, numDirs, highlight };
         for (;;)
         {
-            int chosen_item = get_menu_selection(headers, list, 0);
+            int chosen_item = get_menu_selection_highlight(headers, list, 0,
+                    highlight != NULL ? file_highlighted : NULL, &fh);
             if (chosen_item == GO_BACK)
                 break;
             static char ret[PATH_MAX];
             if (chosen_item < numDirs)
             {
-                char* subret = choose_file_menu(dirs[chosen_item], fileExtensionOrDirectory, headers);
+                char* subret = choose_file_menu_highlight(dirs[chosen_item], fileExtensionOrDirectory, headers, highlight);
                 if (subret != NULL)
                 {
                     strcpy(ret, subret);
@@ -1,3 +1,16 @@
 
+// The paths (with a trailing slash for directories) of the entries of
+// "directory" ending in fileExtensionOrDirectory, or of its directories if
+// that's NULL.  Returns NULL, with *numFiles 0, if there are none.
+char** gather_files(const char* directory, const char* fileExtensionOrDirectory, int* numFiles);
+
+void free_string_array(char** array);
+
 char*
 choose_file_menu(const char* directory, const char* fileExtensionOrDirectory, const char* headers[]);
+
+// Like choose_file_menu(), also calling "highlight" with the path of each
+// file as it's highlighted, or NULL for a directory.
+char*
+choose_file_menu_highlight(const char* directory, const char* fileExtensionOrDirectory, const char* headers[],
+                           void (*highlight)(const char* path));
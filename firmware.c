@@ -17,18 +17,40 @@
 #include "bootloader.h"
 #include "common.h"
 #include "firmware.h"
+#include "minzip/Budget.h"
+#include "minzip/Sha1.h"
+#include "minzip/Zip.h"
+#include "recovery_log.h"
 #include "roots.h"
 
 #include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/reboot.h>
+#include <sys/stat.h>
 
 static const char *update_type = NULL;
-static const char *update_data = NULL;
 static int update_length = 0;
 
+/* The image is either in memory (update_data) or still in a file, to be
+ * streamed from there when it's installed: the whole of update_path, or
+ * entry update_entry of the package at update_path.  update_sha1 is the
+ * digest of the bytes we were given, taken while the (just verified)
+ * package was being installed; anything else read back later isn't
+ * flashed.  update_root is mounted again first if need be.
+ */
+static const char *update_data = NULL;
+static char *update_path = NULL;
+static char *update_entry = NULL;
+static const char *update_root = NULL;
+static uint8_t update_sha1[MZ_SHA1_DIGEST_SIZE];
+
+#define FIRMWARE_READ_SIZE (64 * 1024)
+
 int remember_firmware_update(const char *type, const char *data, int length) {
-    if (update_type != NULL || update_data != NULL) {
+    if (update_type != NULL || update_data != NULL || update_path != NULL) {
         LOGE("Multiple firmware images\n");
         return -1;
     }
@@ -41,7 +63,243 @@ int remember_firmware_update(const char *type, const char *data, int length) {
 
 // Return true if there is a firmware update pending.
 int firmware_update_pending() {
-  return update_data != NULL && update_length > 0;
+  return (update_data != NULL || update_path != NULL) && update_length > 0;
+}
+
+// An image in a file, opened for reading.
+typedef struct {
+    const char *path;
+    const char *entry_name;     // NULL for a plain file
+    ZipArchive zip;
+    const ZipEntry *entry;
+    FILE *file;
+    struct stat st;
+} FirmwareFile;
+
+static int open_firmware_file(FirmwareFile *ff, const char *path,
+                              const char *entry_name) {
+    memset(ff, 0, sizeof(*ff));
+    ff->path = path;
+    ff->entry_name = entry_name;
+    if (entry_name == NULL) {
+        ff->file = fopen(path, "rb");
+        if (ff->file == NULL || fstat(fileno(ff->file), &ff->st) != 0) {
+            LOGE("Can't open %s\n(%s)\n", path, strerror(errno));
+            if (ff->file != NULL) fclose(ff->file);
+            return -1;
+        }
+        return 0;
+    }
+
+    int err = mzOpenZipArchive(path, &ff->zip);
+    if (err != 0) {
+        LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
+        return -1;
+    }
+    ff->entry = mzFindZipEntry(&ff->zip, entry_name);
+    if (ff->entry == NULL) {
+        LOGE("Failed to find \"%s\" in package\n", entry_name);
+        mzCloseZipArchive(&ff->zip);
+        return -1;
+    }
+    return 0;
+}
+
+static long firmware_file_length(const FirmwareFile *ff) {
+    return ff->entry != NULL ? mzGetZipEntryUncompLen(ff->entry)
+                             : (long) ff->st.st_size;
+}
+
+static void close_firmware_file(FirmwareFile *ff) {
+    if (ff->entry_name == NULL) {
+        fclose(ff->file);
+    } else {
+        mzCloseZipArchive(&ff->zip);
+    }
+}
+
+typedef struct {
+    UpdateSink sink;
+    void *cookie;
+} SinkBridge;
+
+static bool zip_to_sink(const unsigned char *data, int len, void *cookie) {
+    SinkBridge *bridge = (SinkBridge *) cookie;
+    return bridge->sink((const char *) data, len, bridge->cookie) == 0;
+}
+
+// UpdateSource for a FirmwareFile.
+static int read_firmware_file(UpdateSink sink, void *sink_cookie,
+                              void *cookie) {
+    FirmwareFile *ff = (FirmwareFile *) cookie;
+    if (ff->entry != NULL) {
+        SinkBridge bridge = { sink, sink_cookie };
+        if (!mzProcessZipEntryContentsVerified(&ff->zip, ff->entry,
+                                               zip_to_sink, &bridge)) {
+            LOGE("Can't read \"%s\" from %s\n", ff->entry_name, ff->path);
+            return -1;
+        }
+        return 0;
+    }
+
+    char *buf = malloc(FIRMWARE_READ_SIZE);
+    if (buf == NULL) return -1;
+    int result = 0;
+    size_t n;
+    while ((n = fread(buf, 1, FIRMWARE_READ_SIZE, ff->file)) > 0) {
+        if (sink(buf, n, sink_cookie) != 0) {
+            result = -1;
+            break;
+        }
+    }
+    if (ferror(ff->file)) {
+        LOGE("Can't read %s\n(%s)\n", ff->path, strerror(errno));
+        result = -1;
+    }
+    free(buf);
+    return result;
+}
+
+// UpdateSource for an image in memory.
+static int read_firmware_data(UpdateSink sink, void *sink_cookie,
+                              void *cookie) {
+    return sink(update_data, update_length, sink_cookie);
+}
+
+typedef struct {
+    char *data;
+    int length;
+    int done;
+} MemorySink;
+
+static int copy_to_memory(const char *data, int len, void *cookie) {
+    MemorySink *mem = (MemorySink *) cookie;
+    if (mem->done + len > mem->length) return -1;
+    memcpy(mem->data + mem->done, data, len);
+    mem->done += len;
+    return 0;
+}
+
+static int hash_to_sha1(const char *data, int len, void *cookie) {
+    mzSha1Update((MzSha1Ctx *) cookie, data, len);
+    return 0;
+}
+
+typedef struct {
+    FirmwareFile *ff;
+    UpdateSink sink;
+    void *sink_cookie;
+    MzSha1Ctx sha1;
+} HashingSink;
+
+static int hash_and_forward(const char *data, int len, void *cookie) {
+    HashingSink *hs = (HashingSink *) cookie;
+    mzSha1Update(&hs->sha1, data, len);
+    return hs->sink(data, len, hs->sink_cookie);
+}
+
+// UpdateSource for a FirmwareFile, that fails at the end unless what was
+// read is what remember_firmware_update_file() hashed.
+static int read_firmware_file_checked(UpdateSink sink, void *sink_cookie,
+                                      void *cookie) {
+    HashingSink hs;
+    hs.sink = sink;
+    hs.sink_cookie = sink_cookie;
+    mzSha1Init(&hs.sha1);
+    if (read_firmware_file(hash_and_forward, &hs, cookie) != 0) return -1;
+    if (memcmp(mzSha1Final(&hs.sha1), update_sha1, MZ_SHA1_DIGEST_SIZE) != 0) {
+        LOGE("%s image %s has changed since it was verified\n",
+             update_type, update_path);
+        return -1;
+    }
+    return 0;
+}
+
+// The root path ("SDCARD:", ...) whose mount point path is under, or NULL.
+static const char *root_of_path(const char *path) {
+    static const char *roots[] = {
+        "SDCARD:", "INTERNAL:", "DATA:", "DBDATA:", "SYSTEM:", NULL
+    };
+    int i;
+    for (i = 0; roots[i] != NULL; ++i) {
+        char dir[PATH_MAX];
+        if (translate_root_path(roots[i], dir, sizeof(dir)) == NULL) continue;
+        size_t len = strlen(dir);
+        while (len > 1 && dir[len - 1] == '/') --len;
+        if (strncmp(path, dir, len) == 0 && path[len] == '/') {
+            return roots[i];
+        }
+    }
+    return NULL;
+}
+
+// Is path on the cache partition, which installing the image wipes?
+static int on_cache_partition(const char *path) {
+    char cache[PATH_MAX];
+    struct stat st, cache_st;
+    if (is_root_path_mounted("CACHE:") <= 0 ||
+        translate_root_path("CACHE:", cache, sizeof(cache)) == NULL ||
+        stat(cache, &cache_st) != 0 || stat(path, &st) != 0) {
+        return 0;
+    }
+    return st.st_dev == cache_st.st_dev;
+}
+
+int remember_firmware_update_file(const char *type, const char *path,
+                                  const char *entry_name) {
+    if (update_type != NULL || update_data != NULL || update_path != NULL) {
+        LOGE("Multiple firmware images\n");
+        return -1;
+    }
+
+    FirmwareFile ff;
+    if (open_firmware_file(&ff, path, entry_name) != 0) return -1;
+    long length = firmware_file_length(&ff);
+    LOGI("type is %s; size is %ld; file is %s%s%s\n", type, length, path,
+         entry_name != NULL ? ":" : "", entry_name != NULL ? entry_name : "");
+
+    if (!on_cache_partition(path)) {
+        // Read it through once now, while the package is the one that was
+        // verified, to know it again when it's installed.
+        MzSha1Ctx sha1;
+        mzSha1Init(&sha1);
+        int result = read_firmware_file(hash_to_sha1, &sha1, &ff);
+        close_firmware_file(&ff);
+        if (result != 0) {
+            LOGE("Failed to read firmware data\n");
+            return -1;
+        }
+        memcpy(update_sha1, mzSha1Final(&sha1), MZ_SHA1_DIGEST_SIZE);
+        update_root = root_of_path(path);
+        update_path = strdup(path);
+        update_entry = entry_name != NULL ? strdup(entry_name) : NULL;
+        if (update_path == NULL || (entry_name != NULL && update_entry == NULL)) {
+            free(update_path);
+            free(update_entry);
+            update_path = update_entry = NULL;
+            return -1;
+        }
+        update_type = type;
+        update_length = length;
+        return 0;
+    }
+
+    // It won't survive until we install it, so keep a copy in memory.
+    // (Real memory: a spilled buffer would be on cache too.)
+    MemorySink mem = { mzBudgetAlloc(length, MZ_BUDGET_PINNED), length, 0 };
+    if (mem.data == NULL) {
+        LOGE("Can't allocate %ld bytes for firmware data\n", length);
+        close_firmware_file(&ff);
+        return -1;
+    }
+    int result = read_firmware_file(copy_to_memory, &mem, &ff);
+    close_firmware_file(&ff);
+    if (result != 0 || mem.done != length) {
+        LOGE("Failed to read firmware data\n");
+        mzBudgetFree(mem.data);
+        return -1;
+    }
+    return remember_firmware_update(type, mem.data, length);
 }
 
 /* Bootloader / Recovery Flow
@@ -76,8 +334,41 @@ int firmware_update_pending() {
  * It is recovery's responsibility to clean up the mess afterwards.
  */
 
+// The user was told to reboot to complete the installation, so don't
+// just carry on booting without saying anything.
+static void firmware_update_failed(const char *why) {
+    ui_set_background(BACKGROUND_ICON_ERROR);
+    LOGE("Not installing %s image %s\n(%s)\n", update_type, update_path, why);
+    if (ui_text_visible()) {
+        ui_print("Press any key to continue.\n");
+        ui_wait_key();
+    }
+}
+
 int maybe_install_firmware_update(const char *send_intent) {
-    if (update_data == NULL || update_length == 0) return 0;
+    if (!firmware_update_pending()) return 0;
+
+    /* Open the image before touching anything.  Its contents are checked
+     * against update_sha1 as it's copied, and the bootloader is only told
+     * to install it if they match.
+     */
+    FirmwareFile ff;
+    UpdateSource source = read_firmware_data;
+    void *source_cookie = NULL;
+    if (update_path != NULL) {
+        if ((update_root != NULL && ensure_root_path_mounted(update_root) != 0) ||
+            open_firmware_file(&ff, update_path, update_entry) != 0) {
+            firmware_update_failed("can't read it");
+            return -1;
+        }
+        if (firmware_file_length(&ff) != update_length) {
+            close_firmware_file(&ff);
+            firmware_update_failed("it has changed");
+            return -1;
+        }
+        source = read_firmware_file_checked;
+        source_cookie = &ff;
+    }
 
     /* We destroy the cache partition to pass the update image to the
      * bootloader, so all we can really do afterwards is wipe cache and reboot.
@@ -93,7 +384,10 @@ int maybe_install_firmware_update(const char *send_intent) {
         strlcat(boot.recovery, send_intent, sizeof(boot.recovery));
         strlcat(boot.recovery, "\n", sizeof(boot.recovery));
     }
-    if (set_bootloader_message(&boot)) return -1;
+    if (set_bootloader_message(&boot)) {
+        if (update_path != NULL) close_firmware_file(&ff);
+        return -1;
+    }
 
     int width = 0, height = 0, bpp = 0;
     char *busy_image = ui_copy_image(
@@ -102,11 +396,16 @@ int maybe_install_firmware_update(const char *send_intent) {
         BACKGROUND_ICON_FIRMWARE_ERROR, &width, &height, &bpp);
 
     ui_print("Writing %s image...\n", update_type);
-    if (write_update_for_bootloader(
-            update_data, update_length,
-            width, height, bpp, busy_image, fail_image)) {
+    mzPhaseBegin("flash", update_length);
+    int result = write_update_for_bootloader(
+            source, source_cookie, update_length,
+            width, height, bpp, busy_image, fail_image);
+    mzPhaseEnd();
+    if (update_path != NULL) close_firmware_file(&ff);
+    if (result) {
         LOGE("Can't write %s image\n(%s)\n", update_type, strerror(errno));
         format_root_device("CACHE:");  // Attempt to clean cache up, at least.
+        if (update_path != NULL) firmware_update_failed("it couldn't be copied intact");
         return -1;
     }
 
@@ -123,6 +422,7 @@ int maybe_install_firmware_update(const char *send_intent) {
         return -1;
     }
 
+    recovery_log_flush();
     reboot(RB_AUTOBOOT);
 
     // Can't reboot?  WTF?
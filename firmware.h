@@ -23,6 +23,18 @@
  */
 int remember_firmware_update(const char *type, const char *data, int length);
 
+/* Like remember_firmware_update(), but for an image that's in a file: the
+ * whole of path, or if entry_name isn't NULL, that entry of the zip package
+ * at path.  The image is streamed from there when it's installed instead
+ * of being kept in memory until then, unless the file is on the cache
+ * partition, which installing it overwrites; then it's read in now.
+ * Either way it's read through now for its SHA-1, and it isn't installed
+ * unless what's streamed later has the same one.
+ * Takes ownership of type.  Returns nonzero on error.
+ */
+int remember_firmware_update_file(const char *type, const char *path,
+                                  const char *entry_name);
+
 /* Returns true if a firmware update has been saved. */
 int firmware_update_pending();
 
@@ -0,0 +1,413 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "hash_dir.h"
+#include "minzip/Sha1.h"
+
+#define HASH_MAX_WORKERS 4
+#define HASH_BUFFER_SIZE (64 * 1024)
+
+// First line of a cache file; anything else is an older format.
+#define HASH_CACHE_HEADER "hash_dir cache 2\n"
+
+// Files changed this close to the start of a scan may be changed again
+// within the same second of mtime/ctime, so their digests aren't trusted
+// from the cache or written to it.
+#define HASH_CACHE_RACY_SECONDS 2
+
+typedef struct {
+    char *path;             // relative to the top of the tree
+    char *link;             // symlink target
+    struct stat st;
+    uint8_t digest[MZ_SHA1_DIGEST_SIZE];
+    int hashed;             // digest is known
+} TreeEntry;
+
+typedef struct {
+    const char *root;
+    time_t started;         // when the scan began
+    TreeEntry *entries;
+    int count;
+    int capacity;
+
+    // Handed out to the workers, under lock.
+    pthread_mutex_t lock;
+    int next;
+    int failed;
+} Tree;
+
+/* A line of the cache: "<sha1> <size> <mtime> <ctime> <inode> <path>". */
+typedef struct {
+    char *path;
+    long long size;
+    long long mtime;
+    long long ctime;
+    long long ino;
+    uint8_t digest[MZ_SHA1_DIGEST_SIZE];
+} CacheEntry;
+
+static int compare_entries(const void *a, const void *b)
+{
+    return strcmp(((const TreeEntry *) a)->path, ((const TreeEntry *) b)->path);
+}
+
+static int compare_cache(const void *a, const void *b)
+{
+    return strcmp(((const CacheEntry *) a)->path, ((const CacheEntry *) b)->path);
+}
+
+static TreeEntry *add_entry(Tree *tree, const char *path)
+{
+    if (tree->count == tree->capacity) {
+        int capacity = tree->capacity ? tree->capacity * 2 : 256;
+        TreeEntry *entries = realloc(tree->entries,
+                capacity * sizeof(TreeEntry));
+        if (entries == NULL) return NULL;
+        tree->entries = entries;
+        tree->capacity = capacity;
+    }
+    TreeEntry *e = &tree->entries[tree->count++];
+    memset(e, 0, sizeof(*e));
+    e->path = strdup(path);
+    return e;
+}
+
+/* Adds everything under root/rel (rel is "" for the top) to tree. */
+static int walk(Tree *tree, const char *rel)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s%s", tree->root, *rel ? "/" : "", rel);
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        LOGE("Can't open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    int result = 0;
+    struct dirent *de;
+    while (result == 0 && (de = readdir(d)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+
+        char child[PATH_MAX];
+        if (snprintf(child, sizeof(child), "%s%s%s", rel, *rel ? "/" : "",
+                de->d_name) >= (int) sizeof(child)) {
+            LOGE("Path too long under %s\n", path);
+            result = -1;
+            break;
+        }
+        snprintf(path, sizeof(path), "%s/%s", tree->root, child);
+
+        TreeEntry *e = add_entry(tree, child);
+        if (e == NULL || e->path == NULL || lstat(path, &e->st) != 0) {
+            LOGE("Can't stat %s (%s)\n", path, strerror(errno));
+            result = -1;
+            break;
+        }
+        if (S_ISLNK(e->st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t len = readlink(path, target, sizeof(target) - 1);
+            if (len < 0) {
+                LOGE("Can't read link %s (%s)\n", path, strerror(errno));
+                result = -1;
+                break;
+            }
+            target[len] = '\0';
+            e->link = strdup(target);
+            if (e->link == NULL) {
+                result = -1;
+                break;
+            }
+        } else if (S_ISDIR(e->st.st_mode)) {
+            // e may move when the table grows.
+            result = walk(tree, child);
+        }
+    }
+    closedir(d);
+    return result;
+}
+
+static int hash_file(const char *path, uint8_t *buf, uint8_t *digest)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Can't open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    MzSha1Ctx sha;
+    mzSha1Init(&sha);
+    ssize_t n;
+    while ((n = read(fd, buf, HASH_BUFFER_SIZE)) != 0) {
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            LOGE("Can't read %s (%s)\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        mzSha1Update(&sha, buf, n);
+    }
+    close(fd);
+    memcpy(digest, mzSha1Final(&sha), MZ_SHA1_DIGEST_SIZE);
+    return 0;
+}
+
+/* Workers take the next regular file nobody has a digest for yet. */
+static void *hash_worker(void *cookie)
+{
+    Tree *tree = (Tree *) cookie;
+    uint8_t *buf = malloc(HASH_BUFFER_SIZE);
+    if (buf == NULL) {
+        pthread_mutex_lock(&tree->lock);
+        tree->failed = 1;
+        pthread_mutex_unlock(&tree->lock);
+        return NULL;
+    }
+    for (;;) {
+        pthread_mutex_lock(&tree->lock);
+        while (tree->next < tree->count &&
+               (tree->entries[tree->next].hashed ||
+                !S_ISREG(tree->entries[tree->next].st.st_mode))) {
+            tree->next++;
+        }
+        TreeEntry *e = tree->failed || tree->next == tree->count ?
+                NULL : &tree->entries[tree->next++];
+        pthread_mutex_unlock(&tree->lock);
+        if (e == NULL) break;
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", tree->root, e->path);
+        if (hash_file(path, buf, e->digest) != 0) {
+            pthread_mutex_lock(&tree->lock);
+            tree->failed = 1;
+            pthread_mutex_unlock(&tree->lock);
+            break;
+        }
+        e->hashed = 1;
+    }
+    free(buf);
+    return NULL;
+}
+
+static void to_hex(const uint8_t *digest, char *hex)
+{
+    int i;
+    for (i = 0; i < MZ_SHA1_DIGEST_SIZE; ++i) {
+        sprintf(hex + i * 2, "%02x", digest[i]);
+    }
+}
+
+static int from_hex(const char *hex, uint8_t *digest)
+{
+    int i;
+    for (i = 0; i < MZ_SHA1_DIGEST_SIZE; ++i) {
+        unsigned int b;
+        if (sscanf(hex + i * 2, "%2x", &b) != 1) return -1;
+        digest[i] = b;
+    }
+    return 0;
+}
+
+/* Reads cache_file into *entries, sorted by path.  Returns the count. */
+static int load_cache(const char *cache_file, CacheEntry **entries)
+{
+    *entries = NULL;
+    FILE *f = fopen(cache_file, "r");
+    if (f == NULL) return 0;
+
+    int count = 0, capacity = 0;
+    char line[PATH_MAX + 128];
+    if (fgets(line, sizeof(line), f) == NULL ||
+        strcmp(line, HASH_CACHE_HEADER) != 0) {
+        fclose(f);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char hex[MZ_SHA1_DIGEST_SIZE * 2 + 1];
+        CacheEntry c;
+        int pos;
+        size_t len = strlen(line);
+        if (len == 0 || line[len-1] != '\n') continue;
+        line[len-1] = '\0';
+        if (sscanf(line, "%40s %lld %lld %lld %lld %n", hex, &c.size,
+                &c.mtime, &c.ctime, &c.ino, &pos) != 5 || strlen(hex) != MZ_SHA1_DIGEST_SIZE * 2 ||
+            from_hex(hex, c.digest) != 0 || line[pos] == '\0') {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            CacheEntry *more = realloc(*entries, capacity * sizeof(CacheEntry));
+            if (more == NULL) break;
+            *entries = more;
+        }
+        c.path = strdup(line + pos);
+        (*entries)[count++] = c;
+    }
+    fclose(f);
+    qsort(*entries, count, sizeof(CacheEntry), compare_cache);
+    return count;
+}
+
+/* True if e was modified or had its inode changed so recently that a
+ * later change could leave size and timestamps just as they are now.
+ * Extraction stamps files with a fixed mtime and yaffs2 reuses inode
+ * numbers, so ctime (which nothing can set back) carries most of the
+ * weight here.
+ */
+static int is_racy(const Tree *tree, const TreeEntry *e)
+{
+    time_t limit = tree->started - HASH_CACHE_RACY_SECONDS;
+    return e->st.st_mtime >= limit || e->st.st_ctime >= limit;
+}
+
+/* Fill in the digests of files that haven't changed since they were
+ * cached.  Both lists are sorted, so one pass over each does it.
+ */
+static void apply_cache(Tree *tree, const CacheEntry *cache, int cache_count)
+{
+    int i, j = 0;
+    for (i = 0; i < tree->count && j < cache_count; ++i) {
+        TreeEntry *e = &tree->entries[i];
+        int cmp = 1;
+        while (j < cache_count && (cmp = strcmp(cache[j].path, e->path)) < 0) {
+            ++j;
+        }
+        if (cmp != 0 || !S_ISREG(e->st.st_mode) || is_racy(tree, e)) continue;
+        const CacheEntry *c = &cache[j];
+        if (c->size == (long long) e->st.st_size &&
+            c->mtime == (long long) e->st.st_mtime &&
+            c->ctime == (long long) e->st.st_ctime &&
+            c->ino == (long long) e->st.st_ino) {
+            memcpy(e->digest, c->digest, MZ_SHA1_DIGEST_SIZE);
+            e->hashed = 1;
+        }
+    }
+}
+
+static void save_cache(const char *cache_file, const Tree *tree)
+{
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cache_file);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) {
+        LOGW("Can't write %s (%s)\n", tmp, strerror(errno));
+        return;
+    }
+    fputs(HASH_CACHE_HEADER, f);
+    int i;
+    for (i = 0; i < tree->count; ++i) {
+        const TreeEntry *e = &tree->entries[i];
+        if (!S_ISREG(e->st.st_mode) || strchr(e->path, '\n') != NULL ||
+            is_racy(tree, e)) {
+            continue;
+        }
+        char hex[MZ_SHA1_DIGEST_SIZE * 2 + 1];
+        to_hex(e->digest, hex);
+        fprintf(f, "%s %lld %lld %lld %lld %s\n", hex,
+                (long long) e->st.st_size, (long long) e->st.st_mtime,
+                (long long) e->st.st_ctime, (long long) e->st.st_ino, e->path);
+    }
+    if (fclose(f) != 0 || rename(tmp, cache_file) != 0) {
+        LOGW("Can't write %s (%s)\n", cache_file, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+int hash_dir(const char *dir, const char *cache_file,
+        char hex[HASH_DIR_HEX_SIZE])
+{
+    Tree tree;
+    memset(&tree, 0, sizeof(tree));
+    tree.root = dir;
+    tree.started = time(NULL);
+    pthread_mutex_init(&tree.lock, NULL);
+
+    int result = walk(&tree, "");
+    if (result == 0) {
+        qsort(tree.entries, tree.count, sizeof(TreeEntry), compare_entries);
+
+        CacheEntry *cache = NULL;
+        int cached = 0, i;
+        if (cache_file != NULL) {
+            cached = load_cache(cache_file, &cache);
+            apply_cache(&tree, cache, cached);
+            for (i = 0; i < cached; ++i) free(cache[i].path);
+            free(cache);
+        }
+
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int workers = cpus < 1 ? 1 : cpus > HASH_MAX_WORKERS ?
+                HASH_MAX_WORKERS : cpus;
+        pthread_t threads[HASH_MAX_WORKERS];
+        int started = 0;
+        for (i = 0; i < workers; ++i) {
+            if (pthread_create(&threads[started], NULL,
+                    hash_worker, &tree) == 0) {
+                ++started;
+            }
+        }
+        if (started == 0) hash_worker(&tree);
+        for (i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+        if (tree.failed) result = -1;
+    }
+
+    if (result == 0) {
+        MzSha1Ctx sha;
+        mzSha1Init(&sha);
+        int i;
+        for (i = 0; i < tree.count; ++i) {
+            const TreeEntry *e = &tree.entries[i];
+            char header[64];
+            char type = S_ISREG(e->st.st_mode) ? 'f' :
+                    S_ISDIR(e->st.st_mode) ? 'd' :
+                    S_ISLNK(e->st.st_mode) ? 'l' : 'o';
+            int len = snprintf(header, sizeof(header), "%c %o %u %u",
+                    type, (unsigned int) (e->st.st_mode & 07777),
+                    (unsigned int) e->st.st_uid, (unsigned int) e->st.st_gid);
+            mzSha1Update(&sha, e->path, strlen(e->path) + 1);
+            mzSha1Update(&sha, header, len + 1);
+            if (type == 'f') {
+                mzSha1Update(&sha, e->digest, MZ_SHA1_DIGEST_SIZE);
+            } else if (type == 'l') {
+                mzSha1Update(&sha, e->link, strlen(e->link) + 1);
+            }
+        }
+        to_hex(mzSha1Final(&sha), hex);
+        if (cache_file != NULL) save_cache(cache_file, &tree);
+    }
+
+    int i;
+    for (i = 0; i < tree.count; ++i) {
+        free(tree.entries[i].path);
+        free(tree.entries[i].link);
+    }
+    free(tree.entries);
+    pthread_mutex_destroy(&tree.lock);
+    return result;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RECOVERY_HASH_DIR_H_
+#define RECOVERY_HASH_DIR_H_
+
+#define HASH_DIR_HEX_SIZE 41
+
+/* Put the hex SHA-1 of the tree under dir (a real path) into hex.  Every
+ * entry's relative path, type, mode and owner go into the digest, in
+ * sorted order, along with each file's contents and each symlink's
+ * target, so the result only depends on what's in the tree.  Files are
+ * hashed on several threads.
+ *
+ * If cache_file is non-NULL, file digests are remembered there, keyed
+ * by path and checked against size, mtime, ctime and inode, so unchanged
+ * files aren't read again next time.  Files changed within a couple of
+ * seconds of the scan are always read, and never cached.  A missing,
+ * damaged or older-format cache is ignored.
+ *
+ * Returns 0 on success, -1 if the tree couldn't be read.
+ */
+int hash_dir(const char *dir, const char *cache_file,
+        char hex[HASH_DIR_HEX_SIZE]);
+
+#endif  // RECOVERY_HASH_DIR_H_
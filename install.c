@@ -18,7 +18,13 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/sysinfo.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -27,11 +33,16 @@
 #include "install.h"
 #include "mincrypt/rsa.h"
 #include "minui/minui.h"
+#include "minzip/Digests.h"
+#include "minzip/Sha1.h"
 #include "minzip/SysUtil.h"
+#include "minzip/Trace.h"
 #include "minzip/Zip.h"
 #include "mtdutils/mounts.h"
 #include "mtdutils/mtdutils.h"
 #include "roots.h"
+#include "updater/checkpoint.h"
+#include "updater/protocol.h"
 #include "verifier.h"
 #include "firmware.h"
 
@@ -119,89 +130,234 @@ handle_update_script(ZipArchive *zip, const ZipEntry *update_script_entry)
 }
 
 // The update binary ask us to install a firmware file on reboot.  Set
-// that up.  Takes ownership of type and filename.
+// that up.  Takes ownership of type and filename.  The image is left
+// where it is (the package at path, or the file) until it's installed.
 static int
-handle_firmware_update(char* type, char* filename, ZipArchive* zip) {
-    unsigned int data_size;
-    const ZipEntry* entry = NULL;
-
+handle_firmware_update(char* type, char* filename, const char* path) {
+    const char* source = filename;
+    const char* entry_name = NULL;
     if (strncmp(filename, "PACKAGE:", 8) == 0) {
-        entry = mzFindZipEntry(zip, filename+8);
-        if (entry == NULL) {
-            LOGE("Failed to find \"%s\" in package", filename+8);
-            return INSTALL_ERROR;
-        }
-        data_size = entry->uncompLen;
-    } else {
-        struct stat st_data;
-        if (stat(filename, &st_data) < 0) {
-            LOGE("Error stat'ing %s: %s\n", filename, strerror(errno));
-            return INSTALL_ERROR;
-        }
-        data_size = st_data.st_size;
+        source = path;
+        entry_name = filename + 8;
     }
 
-    LOGI("type is %s; size is %d; file is %s\n",
-         type, data_size, filename);
-
-    char* data = malloc(data_size);
-    if (data == NULL) {
-        LOGI("Can't allocate %d bytes for firmware data\n", data_size);
+    if (remember_firmware_update_file(type, source, entry_name)) {
+        LOGE("Can't store %s image\n", type);
         return INSTALL_ERROR;
     }
+    free(filename);
 
-    if (entry) {
-        if (mzReadZipEntry(zip, entry, data, data_size) == false) {
-            LOGE("Failed to read \"%s\" from package", filename+8);
-            return INSTALL_ERROR;
-        }
-    } else {
-        FILE* f = fopen(filename, "rb");
-        if (f == NULL) {
-            LOGE("Failed to open %s: %s\n", filename, strerror(errno));
-            return INSTALL_ERROR;
-        }
-        if (fread(data, 1, data_size, f) != data_size) {
-            LOGE("Failed to read firmware data: %s\n", strerror(errno));
-            return INSTALL_ERROR;
-        }
-        fclose(f);
+    return INSTALL_SUCCESS;
+}
+
+typedef struct {
+    char* firmware_type;
+    char* firmware_filename;
+    int commands;               // number received
+    bool have_set_progress;     // set_progress is waiting to be shown
+    float set_progress;
+} UpdaterCommands;
+
+static void
+apply_set_progress(UpdaterCommands* uc) {
+    if (uc->have_set_progress) {
+        ui_set_progress(uc->set_progress);
+        uc->have_set_progress = false;
     }
+}
 
-    if (remember_firmware_update(type, data, data_size)) {
-        LOGE("Can't store %s image\n", type);
-        free(data);
-        return INSTALL_ERROR;
+// Any command other than set_progress shows a pending set_progress
+// first, so everything still happens in the order it was sent.
+static void
+begin_command(UpdaterCommands* uc, bool is_set_progress) {
+    ++uc->commands;
+    if (!is_set_progress) apply_set_progress(uc);
+}
+
+static void
+do_firmware(UpdaterCommands* uc, const char* type, const char* filename) {
+    if (uc->firmware_type != NULL) {
+        LOGE("ignoring attempt to do multiple firmware updates");
+    } else {
+        uc->firmware_type = strdup(type);
+        uc->firmware_filename = strdup(filename);
     }
-    free(filename);
+}
 
-    return INSTALL_SUCCESS;
+static void
+do_ui_print(const char* text, size_t len) {
+    // ui_print() formats into a small buffer; hand it long text a
+    // piece at a time rather than let it be cut off.
+    while (len > 0) {
+        int n = len > 200 ? 200 : (int)len;
+        ui_print("%.*s", n, text);
+        text += n;
+        len -= n;
+    }
 }
 
-// If the package contains an update binary, extract it and run it.
-static int
-try_update_binary(const char *path, ZipArchive *zip) {
-    const ZipEntry* binary_entry =
-            mzFindZipEntry(zip, ASSUMED_UPDATE_BINARY_NAME);
-    if (binary_entry == NULL) {
-        return INSTALL_CORRUPT;
+// Handle the complete text commands in buf[0..len), returning how many
+// bytes were used.  Lines may be of any length.  At eof an unterminated
+// last line is handled too, and buf must have room for one more byte.
+static size_t
+parse_text_commands(UpdaterCommands* uc, char* buf, size_t len, bool eof) {
+    size_t used = 0;
+    while (used < len) {
+        char* line = buf + used;
+        char* nl = memchr(line, '\n', len - used);
+        if (nl == NULL) {
+            if (!eof) break;
+            nl = buf + len;     // last line, unterminated
+        }
+        *nl = '\0';
+        used = nl - buf + 1;
+        LOGI("read: %s\n", line);
+
+        char* save;
+        char* command = strtok_r(line, " ", &save);
+        if (command == NULL) {
+            continue;
+        } else if (strcmp(command, "progress") == 0) {
+            char* fraction_s = strtok_r(NULL, " ", &save);
+            char* seconds_s = strtok_r(NULL, " ", &save);
+            if (fraction_s == NULL || seconds_s == NULL) continue;
+            begin_command(uc, false);
+            ui_show_progress(strtof(fraction_s, NULL) *
+                                 (1-VERIFICATION_PROGRESS_FRACTION),
+                             strtol(seconds_s, NULL, 10));
+        } else if (strcmp(command, "set_progress") == 0) {
+            char* fraction_s = strtok_r(NULL, " ", &save);
+            if (fraction_s == NULL) continue;
+            begin_command(uc, true);
+            uc->set_progress = strtof(fraction_s, NULL);
+            uc->have_set_progress = true;
+        } else if (strcmp(command, "firmware") == 0) {
+            char* type = strtok_r(NULL, " ", &save);
+            char* filename = strtok_r(NULL, " ", &save);
+            begin_command(uc, false);
+            if (type != NULL && filename != NULL) {
+                do_firmware(uc, type, filename);
+            }
+        } else if (strcmp(command, "ui_print") == 0) {
+            char* str = strtok_r(NULL, "", &save);
+            begin_command(uc, false);
+            if (str) {
+                do_ui_print(str, strlen(str));
+            } else {
+                ui_print("\n");
+            }
+        } else {
+            LOGE("unknown command [%s]\n", command);
+        }
     }
+    return used;
+}
 
-    char* binary = "/tmp/update_binary";
-    unlink(binary);
-    int fd = creat(binary, 0755);
-    if (fd < 0) {
-        LOGE("Can't make %s\n", binary);
-        return 1;
+// Handle the complete frames (see updater/protocol.h) in buf[0..len),
+// returning how many bytes were used.
+static size_t
+parse_framed_commands(UpdaterCommands* uc, char* buf, size_t len) {
+    size_t used = 0;
+    UpdaterFrameHeader header;
+    while (len - used >= sizeof(header)) {
+        memcpy(&header, buf + used, sizeof(header));
+        if (len - used - sizeof(header) < header.length) break;
+        char* payload = buf + used + sizeof(header);
+        used += sizeof(header) + header.length;
+
+        begin_command(uc, header.type == UPDATER_CMD_SET_PROGRESS);
+        switch (header.type) {
+            case UPDATER_CMD_PROGRESS: {
+                UpdaterProgress p;
+                if (header.length != sizeof(p)) break;
+                memcpy(&p, payload, sizeof(p));
+                ui_show_progress(p.fraction * (1-VERIFICATION_PROGRESS_FRACTION),
+                                 p.seconds);
+                break;
+            }
+            case UPDATER_CMD_SET_PROGRESS:
+                if (header.length != sizeof(float)) break;
+                memcpy(&uc->set_progress, payload, sizeof(float));
+                uc->have_set_progress = true;
+                break;
+            case UPDATER_CMD_FIRMWARE: {
+                // "<type>\0<filename>\0"
+                char* type = payload;
+                char* type_end = memchr(payload, '\0', header.length);
+                if (type_end == NULL) break;
+                char* filename = type_end + 1;
+                size_t rest = payload + header.length - filename;
+                if (rest == 0 || memchr(filename, '\0', rest) == NULL) break;
+                do_firmware(uc, type, filename);
+                break;
+            }
+            case UPDATER_CMD_UI_PRINT:
+                do_ui_print(payload, header.length);
+                break;
+            case UPDATER_CMD_PHASE: {
+                // UpdaterPhase, then "<name>\0"
+                UpdaterPhase p;
+                if (header.length <= sizeof(p)) break;
+                char* name = payload + sizeof(p);
+                if (payload[header.length - 1] != '\0') break;
+                memcpy(&p, payload, sizeof(p));
+                PhaseStatus status;
+                status.name = name;
+                status.done = p.done;
+                status.total = p.total;
+                status.elapsedMs = p.elapsed_ms;
+                status.ended = p.ended;
+                ui_show_phase(&status);
+                break;
+            }
+            default:
+                LOGE("unknown command type %d\n", header.type);
+                break;
+        }
     }
-    bool ok = mzExtractZipEntryToFile(zip, binary_entry, fd);
-    close(fd);
+    return used;
+}
 
-    if (!ok) {
-        LOGE("Can't copy %s\n", ASSUMED_UPDATE_BINARY_NAME);
-        return 1;
+// Read commands from the update binary on fd until it closes the pipe.
+// Of a burst of set_progress commands that arrive together, only the
+// last is shown, so a script reporting progress very often doesn't
+// turn into a redraw per command.
+static void
+read_updater_commands(int fd, bool framed, UpdaterCommands* uc) {
+    size_t size = 4096;
+    size_t len = 0;
+    char* buf = malloc(size);
+
+    for (;;) {
+        if (len == size) {
+            size *= 2;
+            buf = realloc(buf, size);
+        }
+        ssize_t r = read(fd, buf + len, size - len);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        len += r;
+
+        size_t used = framed ? parse_framed_commands(uc, buf, len)
+                             : parse_text_commands(uc, buf, len, false);
+        memmove(buf, buf + used, len - used);
+        len -= used;
+        apply_set_progress(uc);
+    }
+    if (!framed && len > 0) {
+        // The last line had no newline; make room to terminate it.
+        if (len == size) buf = realloc(buf, size + 1);
+        parse_text_commands(uc, buf, len, true);
     }
+    apply_set_progress(uc);
+    free(buf);
+}
 
+// Run the update binary, telling it to speak the given API version, and
+// handle its commands.  Returns its wait() status.
+static int
+run_update_binary(const char* binary, const char* path, int api_version,
+                  UpdaterCommands* uc) {
     int pipefd[2];
     pipe(pipefd);
 
@@ -211,7 +367,9 @@ try_update_binary(const char *path, ZipArchive *zip) {
     //   - the version number for this interface
     //
     //   - an fd to which the program can write in order to update the
-    //     progress bar.  The program can write single-line commands:
+    //     progress bar.  Up to version 2 the program writes
+    //     single-line commands; from version 3 on the same commands
+    //     are sent as binary frames (see updater/protocol.h):
     //
     //        progress <frac> <secs>
     //            fill up the next <frac> part of of the progress bar
@@ -236,11 +394,14 @@ try_update_binary(const char *path, ZipArchive *zip) {
     //   - the name of the package zip file.
     //
 
-    char** args = malloc(sizeof(char*) * 5);
-    args[0] = binary;
-    args[1] = EXPAND(RECOVERY_API_VERSION);   // defined in Android.mk
-    args[2] = malloc(10);
-    sprintf(args[2], "%d", pipefd[1]);
+    char version[12];
+    char fd_arg[12];
+    snprintf(version, sizeof(version), "%d", api_version);
+    snprintf(fd_arg, sizeof(fd_arg), "%d", pipefd[1]);
+    char* args[5];
+    args[0] = (char*)binary;
+    args[1] = version;
+    args[2] = fd_arg;
     args[3] = (char*)path;
     args[4] = NULL;
 
@@ -253,71 +414,249 @@ try_update_binary(const char *path, ZipArchive *zip) {
     }
     close(pipefd[1]);
 
-    char* firmware_type = NULL;
-    char* firmware_filename = NULL;
+    read_updater_commands(pipefd[0],
+                          api_version >= UPDATER_FRAMED_API_VERSION, uc);
+    close(pipefd[0]);
 
-    char buffer[81];
-    FILE* from_child = fdopen(pipefd[0], "r");
-    while (fgets(buffer, sizeof(buffer), from_child) != NULL) {
-        LOGI("read: %s", buffer);
+    int status;
+    waitpid(pid, &status, 0);
+    return status;
+}
 
-        char* command = strtok(buffer, " \n");
-        if (command == NULL) {
-            continue;
-        } else if (strcmp(command, "progress") == 0) {
-            char* fraction_s = strtok(NULL, " \n");
-            char* seconds_s = strtok(NULL, " \n");
+// If the package contains an update binary, extract it and run it.
+static int
+try_update_binary(const char *path, ZipArchive *zip) {
+    const ZipEntry* binary_entry =
+            mzFindZipEntry(zip, ASSUMED_UPDATE_BINARY_NAME);
+    if (binary_entry == NULL) {
+        return INSTALL_CORRUPT;
+    }
 
-            float fraction = strtof(fraction_s, NULL);
-            int seconds = strtol(seconds_s, NULL, 10);
+    char* binary = "/tmp/update_binary";
+    unlink(binary);
+    int fd = creat(binary, 0755);
+    if (fd < 0) {
+        LOGE("Can't make %s\n", binary);
+        return 1;
+    }
+    bool ok = mzExtractZipEntryToFile(zip, binary_entry, fd);
+    close(fd);
 
-            ui_show_progress(fraction * (1-VERIFICATION_PROGRESS_FRACTION),
-                             seconds);
-        } else if (strcmp(command, "set_progress") == 0) {
-            char* fraction_s = strtok(NULL, " \n");
-            float fraction = strtof(fraction_s, NULL);
-            ui_set_progress(fraction);
-        } else if (strcmp(command, "firmware") == 0) {
-            char* type = strtok(NULL, " \n");
-            char* filename = strtok(NULL, " \n");
+    if (!ok) {
+        LOGE("Can't copy %s\n", ASSUMED_UPDATE_BINARY_NAME);
+        return 1;
+    }
 
-            if (type != NULL && filename != NULL) {
-                if (firmware_type != NULL) {
-                    LOGE("ignoring attempt to do multiple firmware updates");
-                } else {
-                    firmware_type = strdup(type);
-                    firmware_filename = strdup(filename);
-                }
-            }
-        } else if (strcmp(command, "ui_print") == 0) {
-            char* str = strtok(NULL, "\n");
-            if (str) {
-                ui_print(str);
-            } else {
-                ui_print("\n");
-            }
-        } else {
-            LOGE("unknown command [%s]\n", command);
-        }
+    UpdaterCommands uc;
+    memset(&uc, 0, sizeof(uc));
+    mzTraceBegin("updater");
+    int status = run_update_binary(binary, path, RECOVERY_API_VERSION, &uc);
+
+    // Update binaries older than this recovery exit with status 2,
+    // before sending anything, when given a version they don't know.
+    // Run those again speaking the text protocol they understand.
+    if (RECOVERY_API_VERSION >= UPDATER_FRAMED_API_VERSION &&
+            uc.commands == 0 && WIFEXITED(status) && WEXITSTATUS(status) == 2) {
+        LOGI("update binary predates API v%d; retrying with v%d\n",
+             RECOVERY_API_VERSION, UPDATER_FRAMED_API_VERSION - 1);
+        status = run_update_binary(binary, path,
+                                   UPDATER_FRAMED_API_VERSION - 1, &uc);
     }
-    fclose(from_child);
+    mzTraceEnd("updater");
 
-    int status;
-    waitpid(pid, &status, 0);
     if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
         LOGE("Error in %s\n(Status %d)\n", path, WEXITSTATUS(status));
         return INSTALL_ERROR;
     }
 
-    if (firmware_type != NULL) {
-        return handle_firmware_update(firmware_type, firmware_filename, zip);
+    if (uc.firmware_type != NULL) {
+        return handle_firmware_update(uc.firmware_type, uc.firmware_filename,
+                                      path);
     } else {
         return INSTALL_SUCCESS;
     }
 }
 
+// A record of the last package that verified, so that an install
+// interrupted partway (say, by a dying battery) can be retried without
+// verifying it all over again.  It's only trusted if the path, size,
+// mtime and central directory digest of the package all still match,
+// and it's removed once an install finishes.
+#define VERIFY_CACHE_FILE "CACHE:recovery/last_verified"
+
+static bool
+get_verify_cache_key(const char *path, ZipArchive *zip, char *key, size_t len)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) return false;
+
+    unsigned char digest[MZ_SHA1_DIGEST_SIZE];
+    char hex[MZ_SHA1_DIGEST_SIZE * 2 + 1];
+    int i;
+    mzGetCentralDirectoryDigest(zip, digest);
+    for (i = 0; i < MZ_SHA1_DIGEST_SIZE; ++i) {
+        sprintf(hex + i * 2, "%02x", digest[i]);
+    }
+
+    int n = snprintf(key, len, "%s\n%lld %ld %s\n", path,
+            (long long) st.st_size, (long) st.st_mtime, hex);
+    return n > 0 && n < (int) len;
+}
+
+static bool
+get_verify_cache_path(char *cache_path, size_t len)
+{
+    return ensure_root_path_mounted(VERIFY_CACHE_FILE) == 0 &&
+            translate_root_path(VERIFY_CACHE_FILE, cache_path, len) != NULL;
+}
+
+static bool
+is_verification_cached(const char *cache_path, const char *key)
+{
+    char stored[PATH_MAX + 128];
+    FILE *f = fopen(cache_path, "r");
+    if (f == NULL) return false;
+    size_t n = fread(stored, 1, sizeof(stored) - 1, f);
+    fclose(f);
+    stored[n] = '\0';
+    return strcmp(stored, key) == 0;
+}
+
+static void
+remember_verification(const char *cache_path, const char *key)
+{
+    FILE *f = fopen(cache_path, "w");
+    if (f == NULL) {
+        LOGW("Can't write %s (%s)\n", cache_path, strerror(errno));
+        return;
+    }
+    fputs(key, f);
+    if (fclose(f) != 0) unlink(cache_path);
+}
+
+static void
+forget_verification(void)
+{
+    char cache_path[PATH_MAX];
+    if (get_verify_cache_path(cache_path, sizeof(cache_path))) {
+        unlink(cache_path);
+    }
+}
+
+// Speculative verification: while the package chooser has a zip
+// highlighted, a worker thread verifies it and leaves the result in the
+// cache above, so that confirming the install can go straight to
+// flashing.  Highlighting something else cancels it.  In a queued
+// install the next package is verified the same way while the current
+// one is being flashed.  Background mode keeps the verifier off the
+// screen, and at most one verification runs at a time: an install waits
+// for the worker if it's on the same package, and cancels it otherwise.
+// Set SPECULATE_ENV to "0" to turn this off.
+#define SPECULATE_ENV       "RECOVERY_SPECULATIVE_VERIFY"
+// How long a zip must stay highlighted before it's read at all, so
+// scrolling past doesn't start (and then cancel) a verification.
+#define SPECULATE_DELAY_MS  600
+
+static pthread_t spec_thread;
+static bool spec_running = false;           // spec_thread needs joining
+static volatile int spec_cancel = 0;
+static int spec_delay_ms;
+static char spec_path[PATH_MAX];
+// Where to record the result too; empty while an install is running,
+// which may be reformatting the cache partition.
+static char spec_cache_path[PATH_MAX];
+// The cache key of the last package the worker verified.
+static char spec_verified_key[PATH_MAX + 128];
+
+static void *
+speculate_worker(void *cookie)
+{
+    int waited;
+    for (waited = 0; waited < spec_delay_ms; waited += 50) {
+        if (spec_cancel) return NULL;
+        usleep(50 * 1000);
+    }
+
+    ZipArchive zip;
+    if (mzOpenZipArchive(spec_path, &zip) != 0) return NULL;
+
+    char key[PATH_MAX + 128];
+    bool persist = spec_cache_path[0] != '\0';
+    if (get_verify_cache_key(spec_path, &zip, key, sizeof(key)) &&
+            strcmp(key, spec_verified_key) != 0 &&
+            !(persist && is_verification_cached(spec_cache_path, key))) {
+        LOGI("Verifying %s in the background\n", spec_path);
+        int numKeys = sizeof(keys) / sizeof(keys[0]);
+        verify_set_background(&spec_cancel);
+        int verified = verify_whole_file_signature(spec_path, keys, numKeys);
+        if (verified == VERIFY_NO_SIGNATURE) {
+            // Not deferred: only a complete verification can be cached.
+            verified = verify_jar_signature(&zip, keys, numKeys) ?
+                    VERIFY_SUCCESS : VERIFY_FAILURE;
+        }
+        verify_set_background(NULL);
+        if (verified == VERIFY_SUCCESS && !spec_cancel) {
+            strcpy(spec_verified_key, key);
+            if (persist) remember_verification(spec_cache_path, key);
+            LOGI("Verified %s in the background\n", spec_path);
+        }
+    }
+    mzCloseZipArchive(&zip);
+    return NULL;
+}
+
+static void
+stop_speculation(bool cancel)
+{
+    if (!spec_running) return;
+    if (cancel) spec_cancel = 1;
+    pthread_join(spec_thread, NULL);
+    spec_running = false;
+}
+
+static void
+start_speculation(const char *path, bool persist, int delay_ms)
+{
+    if (path != NULL && spec_running && strcmp(path, spec_path) == 0) {
+        return;
+    }
+    stop_speculation(true);
+    if (path == NULL) return;
+
+    const char *enabled = getenv(SPECULATE_ENV);
+    if (enabled != NULL && strcmp(enabled, "0") == 0) return;
+
+    // The cache partition is mounted here, on the UI thread, so the
+    // worker never has to.
+    spec_cache_path[0] = '\0';
+    if ((persist && !get_verify_cache_path(spec_cache_path,
+                    sizeof(spec_cache_path))) ||
+            strlcpy(spec_path, path, sizeof(spec_path)) >= sizeof(spec_path)) {
+        return;
+    }
+    spec_cancel = 0;
+    spec_delay_ms = delay_ms;
+    spec_running = pthread_create(&spec_thread, NULL,
+            speculate_worker, NULL) == 0;
+}
+
+void
+speculate_package_verification(const char *path)
+{
+    start_speculation(path, true, SPECULATE_DELAY_MS);
+}
+
+// Where verify_jar_signature_deferred() leaves the entry digests, and
+// the environment variable that tells the updater to check them.
+#define DEFERRED_DIGESTS_FILE  "/tmp/package-digests"
+#define DEFERRED_DIGESTS_ENV   "UPDATE_PACKAGE_DIGESTS"
+
+static int install_verified_package(const char *path, ZipArchive *zip);
+
+// "next" is the package to verify in the background once this one has
+// verified, or NULL.
 static int
-handle_update_package(const char *path, ZipArchive *zip)
+handle_update_package(const char *path, ZipArchive *zip, const char *next)
 {
     // Give verification half the progress bar...
     ui_print("Verifying update package...\n");
@@ -325,11 +664,68 @@ handle_update_package(const char *path, ZipArchive *zip)
             VERIFICATION_PROGRESS_FRACTION,
             VERIFICATION_PROGRESS_TIME);
 
-    if (!verify_jar_signature(zip, keys, sizeof(keys) / sizeof(keys[0]))) {
-        LOGE("Verification failed\n");
-        return INSTALL_CORRUPT;
+    char cache_key[PATH_MAX + 128];
+    char cache_path[PATH_MAX];
+    bool have_key = get_verify_cache_key(path, zip, cache_key,
+            sizeof(cache_key));
+    bool have_cache = have_key &&
+            get_verify_cache_path(cache_path, sizeof(cache_path));
+    bool deferred = false;
+    if (have_key && (strcmp(cache_key, spec_verified_key) == 0 ||
+            (have_cache && is_verification_cached(cache_path, cache_key)))) {
+        ui_print("Package already verified; skipping.\n");
+    } else {
+        // Prefer a signature over the whole file, which only needs one
+        // sequential read; legacy packages only carry the per-entry one.
+        int numKeys = sizeof(keys) / sizeof(keys[0]);
+        int verified = verify_whole_file_signature(path, keys, numKeys);
+        if (verified == VERIFY_NO_SIGNATURE) {
+            verified = verify_jar_signature_deferred(zip, keys, numKeys,
+                    DEFERRED_DIGESTS_FILE, &deferred) ?
+                    VERIFY_SUCCESS : VERIFY_FAILURE;
+        }
+        if (verified != VERIFY_SUCCESS) {
+            LOGE("Verification failed\n");
+            return INSTALL_CORRUPT;
+        }
+        // A deferred verification isn't finished until every entry has
+        // been read, so there's nothing to remember yet.
+        if (have_key && !deferred) {
+            strcpy(spec_verified_key, cache_key);
+            if (have_cache) remember_verification(cache_path, cache_key);
+        }
+    }
+    start_speculation(next, false, 0);
+
+    // If the entry digests were deferred, everything read from the
+    // package from here on, here and in the updater, is hashed as it's
+    // extracted and fails if it doesn't match.
+    MzDigestTable *digests = NULL;
+    if (deferred) {
+        digests = mzLoadDigestTable(zip, DEFERRED_DIGESTS_FILE);
+        if (digests == NULL) {
+            unlink(DEFERRED_DIGESTS_FILE);
+            return INSTALL_CORRUPT;
+        }
+        mzSetEntryVerifier(zip, mzGetDigestTableVerifier(digests));
+        setenv(DEFERRED_DIGESTS_ENV, DEFERRED_DIGESTS_FILE, 1);
     }
 
+    int ret = install_verified_package(path, zip);
+    if (ret == INSTALL_SUCCESS) forget_verification();
+
+    if (digests != NULL) {
+        unsetenv(DEFERRED_DIGESTS_ENV);
+        mzSetEntryVerifier(zip, NULL);
+        mzFreeDigestTable(digests);
+        unlink(DEFERRED_DIGESTS_FILE);
+    }
+    return ret;
+}
+
+static int
+install_verified_package(const char *path, ZipArchive *zip)
+{
     // Update should take the rest of the progress bar.
     ui_print("Installing update...\n");
 
@@ -360,23 +756,297 @@ handle_update_package(const char *path, ZipArchive *zip)
     return ret;
 }
 
+// Packages that arrive over a pipe or socket (e.g. TMP:usb.fifo fed
+// from the host) are received into a file rather than being copied to
+// the card and read back.  A zip can't be verified or opened until its
+// central directory, which is at the very end, has arrived, so the
+// whole package has to be held.  That's on /cache when it can be
+// mounted; otherwise it's /tmp, which is RAM, so a stream is cut off
+// before it takes the memory the install itself needs.
+#define STREAM_CACHE_FILE   "CACHE:stream-package.zip"
+#define STREAM_TMP_FILE     "/tmp/stream-package.zip"
+#define STREAM_TMP_RESERVE  (16 * 1024 * 1024)
+
+// How much may be received into dir; -1 if that can't be told.
+static long long
+stream_spill_room(const char *dir, bool in_ram)
+{
+    struct statfs sf;
+    if (statfs(dir, &sf) != 0) return -1;
+    long long room = (long long) sf.f_bavail * sf.f_bsize;
+    if (in_ram) {
+        // A tmpfs may claim more than is actually free.
+        struct sysinfo si;
+        if (sysinfo(&si) == 0) {
+            long long mem = ((long long) si.freeram + si.bufferram) *
+                    si.mem_unit;
+            if (mem < room) room = mem;
+        }
+        room -= STREAM_TMP_RESERVE;
+    }
+    return room;
+}
+
+// Picks the file to receive a stream into, and the most that may go in.
+static void
+choose_stream_spill_file(char *path, size_t len, long long *room)
+{
+    char dir[PATH_MAX];
+    if (ensure_root_path_mounted(STREAM_CACHE_FILE) == 0 &&
+            translate_root_path("CACHE:", dir, sizeof(dir)) != NULL &&
+            translate_root_path(STREAM_CACHE_FILE, path, len) != NULL) {
+        *room = stream_spill_room(dir, false);
+        if (*room > 0) return;
+    }
+    strlcpy(path, STREAM_TMP_FILE, len);
+    *room = stream_spill_room("/tmp", true);
+}
+
+static int
+open_package_stream(const char *path, const struct stat *st)
+{
+    if (!S_ISSOCK(st->st_mode)) {
+        return open(path, O_RDONLY);
+    }
+
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int save = errno;
+        close(fd);
+        errno = save;
+        return -1;
+    }
+    return fd;
+}
+
+// Receive a package from the pipe or socket at "path" into a file
+// (see choose_stream_spill_file()), whose name is put in spill_path.
+// Returns 0 on success.
+static int
+receive_package_stream(const char *path, const struct stat *st,
+        char *spill_path, size_t spill_len)
+{
+    long long room;
+    choose_stream_spill_file(spill_path, spill_len, &room);
+    if (room <= 0) {
+        LOGE("No room on /cache or /tmp to receive package\n");
+        return -1;
+    }
+
+    int in = open_package_stream(path, st);
+    if (in < 0) {
+        LOGE("Can't open stream %s\n(%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    unlink(spill_path);
+    int out = open(spill_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (out < 0) {
+        LOGE("Can't create %s\n(%s)\n", spill_path, strerror(errno));
+        close(in);
+        return -1;
+    }
+
+    char buf[64 * 1024];
+    long total = 0, reported = 0;
+    int ret = 0;
+    for (;;) {
+        ssize_t n = read(in, buf, sizeof(buf));
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOGE("Can't read %s\n(%s)\n", path, strerror(errno));
+            ret = -1;
+            break;
+        }
+        if (total + n > room) {
+            LOGE("Package doesn't fit in the %lld MB free for it\n",
+                    room >> 20);
+            ret = -1;
+            break;
+        }
+        ssize_t done = 0;
+        while (done < n) {
+            ssize_t w = write(out, buf + done, n - done);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                LOGE("Can't write %s\n(%s)\n", spill_path, strerror(errno));
+                ret = -1;
+                break;
+            }
+            done += w;
+        }
+        if (ret != 0) break;
+        total += n;
+        if (total - reported >= 4 * 1024 * 1024) {
+            ui_print("Received %ld MB...\n", total >> 20);
+            reported = total;
+        }
+    }
+    close(in);
+    if (close(out) < 0 && ret == 0) {
+        LOGE("Can't write %s\n(%s)\n", spill_path, strerror(errno));
+        ret = -1;
+    }
+    if (ret != 0) {
+        unlink(spill_path);
+        return -1;
+    }
+    LOGI("Received %ld bytes from %s\n", total, path);
+    return 0;
+}
+
+// Every install is traced (see minzip/Trace.h) to INSTALL_TRACE_FILE,
+// in RAM, and the trace copied to SAVED_TRACE_FILE afterwards, if the
+// card is there, to load into chrome://tracing.
+#define INSTALL_TRACE_FILE  "/tmp/install-trace.json"
+#define SAVED_TRACE_FILE    "SDCARD:install-trace.json"
+
+static void
+save_install_trace(void) {
+    char path[PATH_MAX];
+    if (is_root_path_mounted(SAVED_TRACE_FILE) <= 0 ||
+        translate_root_path(SAVED_TRACE_FILE, path, sizeof(path)) == NULL) {
+        return;
+    }
+    FILE* in = fopen(INSTALL_TRACE_FILE, "rb");
+    FILE* out = fopen(path, "wb");
+    if (in != NULL && out != NULL) {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+            if (fwrite(buf, 1, n, out) != n) break;
+        }
+        LOGI("Install trace saved to %s\n", path);
+    }
+    if (in != NULL) fclose(in);
+    if (out != NULL) fclose(out);
+}
+
+static int install_traced_package(const char *path, const char *next);
+static void sync_installed_data(void);
+
+void
+forget_install_checkpoint(void)
+{
+    if (ensure_root_path_mounted("CACHE:") != 0) return;
+    if (unlink(CHECKPOINT_FILE) == 0) {
+        LOGI("Removed %s\n", CHECKPOINT_FILE);
+    } else if (errno != ENOENT) {
+        LOGW("Can't remove %s\n(%s)\n", CHECKPOINT_FILE, strerror(errno));
+    }
+}
+
 int
 install_package(const char *root_path)
 {
+    return install_packages(&root_path, 1);
+}
+
+int
+install_packages(const char **root_paths, int count)
+{
+    mzTraceStart(INSTALL_TRACE_FILE, "recovery");
+    setenv(MZ_TRACE_ENV, INSTALL_TRACE_FILE, 1);
+    mzTraceBegin("install_package");
+
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     ui_print("\nFinding update package...\n");
     ui_show_indeterminate_progress();
-    LOGI("Update location: %s\n", root_path);
 
-    if (ensure_root_path_mounted(root_path) != 0) {
-        LOGE("Can't mount %s\n", root_path);
-        return INSTALL_CORRUPT;
+    // Every package is found (and its volume mounted) before anything is
+    // flashed, so a bad path at the end of the queue doesn't leave the
+    // device half updated.
+    int status = INSTALL_SUCCESS;
+    int i;
+    char (*paths)[PATH_MAX] = malloc(count * sizeof(*paths));
+    if (paths == NULL) {
+        LOGE("Can't allocate install queue\n");
+        status = INSTALL_ERROR;
+    }
+    for (i = 0; status == INSTALL_SUCCESS && i < count; ++i) {
+        LOGI("Update location: %s\n", root_paths[i]);
+        if (ensure_root_path_mounted(root_paths[i]) != 0) {
+            LOGE("Can't mount %s\n", root_paths[i]);
+            status = INSTALL_CORRUPT;
+        } else if (translate_root_path(root_paths[i], paths[i],
+                sizeof(paths[i])) == NULL) {
+            LOGE("Bad path %s\n", root_paths[i]);
+            status = INSTALL_CORRUPT;
+        }
     }
 
-    char path[PATH_MAX] = "";
-    if (translate_root_path(root_path, path, sizeof(path)) == NULL) {
-        LOGE("Bad path %s\n", root_path);
-        return INSTALL_CORRUPT;
+    for (i = 0; status == INSTALL_SUCCESS && i < count; ++i) {
+        if (count > 1) {
+            ui_print("\nPackage %d of %d: %s\n", i + 1, count, root_paths[i]);
+        }
+        // Only a regular file can be read ahead; a stream has to wait.
+        struct stat st;
+        const char *next = NULL;
+        if (i + 1 < count && stat(paths[i + 1], &st) == 0 &&
+                S_ISREG(st.st_mode)) {
+            next = paths[i + 1];
+        }
+        status = install_traced_package(paths[i], next);
+    }
+    // After a failure there's no use for the one running ahead.
+    stop_speculation(true);
+    free(paths);
+    // Only an install cut short by a power loss is ever resumed.
+    if (status != INSTALL_SUCCESS) forget_install_checkpoint();
+
+    sync_installed_data();
+
+    mzTraceEnd("install_package");
+    unsetenv(MZ_TRACE_ENV);
+    mzTraceFinish();
+    save_install_trace();
+    return status;
+}
+
+static int
+install_traced_package(const char *package_path, const char *next)
+{
+    char path[PATH_MAX];
+    strlcpy(path, package_path, sizeof(path));
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_show_indeterminate_progress();
+
+    // A background verification of this package has likely done most of
+    // the work already; one of anything else would only compete with it.
+    bool same = spec_running && strcmp(path, spec_path) == 0;
+    if (same) ui_print("Finishing verification...\n");
+    stop_speculation(!same);
+
+    // Anything other than a regular file is treated as a stream.
+    struct stat st;
+    bool streamed = false;
+    if (stat(path, &st) == 0 &&
+            (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) ||
+             S_ISCHR(st.st_mode))) {
+        ui_print("Receiving update package...\n");
+        forget_install_checkpoint();
+        mzTraceBegin("receive");
+        char spill[PATH_MAX];
+        int received = receive_package_stream(path, &st, spill, sizeof(spill));
+        mzTraceEnd("receive");
+        if (received != 0) {
+            return INSTALL_CORRUPT;
+        }
+        strlcpy(path, spill, sizeof(path));
+        streamed = true;
     }
 
     ui_print("Opening update package...\n");
@@ -385,19 +1055,31 @@ install_package(const char *root_path)
     /* Try to open the package.
      */
     ZipArchive zip;
+    mzTraceBegin("open");
     int err = mzOpenZipArchive(path, &zip);
+    mzTraceEnd("open");
     if (err != 0) {
         LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
+        if (streamed) unlink(path);
         return INSTALL_CORRUPT;
     }
 
     /* Verify and install the contents of the package.
      */
-    int status = handle_update_package(path, &zip);
+    int status = handle_update_package(path, &zip, next);
     mzCloseZipArchive(&zip);
+    // A firmware image in the package is read from it at reboot.
+    if (streamed && !firmware_update_pending()) unlink(path);
+    return status;
+}
 
+// Once per install, however many packages were queued.
+static void
+sync_installed_data(void)
+{
     // Sync /data because of ext3 fs
     ui_print("Sync data...\n");
+    mzTraceBegin("sync");
     pid_t pidsync = fork();
     if (pidsync == 0) {
 	char *args[] = {"/sbin/busybox", "sync", NULL};
@@ -410,8 +1092,5 @@ install_package(const char *root_path)
     ui_print(".");
     sleep(1);
                     }
-
-
-
-    return status;
+    mzTraceEnd("sync");
 }
@@ -22,4 +22,22 @@
 enum { INSTALL_SUCCESS, INSTALL_ERROR, INSTALL_CORRUPT };
 int install_package(const char *root_path);
 
+// Install several packages in a row, as one session: all of them are
+// found before the first is flashed, each is verified in the background
+// while the one before it installs, and everything is synced once at
+// the end.  Stops at the first that fails, and returns its status.
+int install_packages(const char **root_paths, int count);
+
+// Start verifying the package at "path" (a real path, not a root path) in
+// the background, for a later install_package() of it to pick up.  Any
+// other speculative verification is cancelled; NULL just cancels.
+void speculate_package_verification(const char *path);
+
+// Drop the checkpoints the updater keeps so that a rerun of an install
+// cut short by a power loss can skip the steps already done
+// (updater/checkpoint.h).  Anything else that changes the partitions --
+// a failed install, a restore, a wipe or format, a sideload -- calls
+// this first, so that no step is skipped on the strength of them.
+void forget_install_checkpoint(void);
+
 #endif  // RECOVERY_INSTALL_H_
@@ -10,3 +10,30 @@ LOCAL_C_INCLUDES +=\
 LOCAL_MODULE := libminui
 
 include $(BUILD_STATIC_LIBRARY)
+
+# Host tool that converts the recovery images into a resource pack.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := mkrespack.c
+
+LOCAL_C_INCLUDES +=\
+    external/libpng\
+    external/zlib
+
+LOCAL_STATIC_LIBRARIES := libpng libz
+LOCAL_LDLIBS := -lm
+LOCAL_MODULE := mkrespack
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# The pack of res/images, to be copied to /res/images.pack in the
+# recovery ramdisk alongside the PNGs.  res_create_surface() uses a
+# picture from the pack when it's there and decodes the PNG otherwise.
+RECOVERY_RESOURCE_PACK := $(call intermediates-dir-for,ETC,recovery_respack)/images.pack
+recovery_respack_images := $(wildcard $(LOCAL_PATH)/../res/images/*.png)
+$(RECOVERY_RESOURCE_PACK): $(HOST_OUT_EXECUTABLES)/mkrespack $(recovery_respack_images)
+	@echo "Resource pack: $@"
+	@mkdir -p $(dir $@)
+	$(hide) $(HOST_OUT_EXECUTABLES)/mkrespack $@ $(filter %.png,$^)
+recovery_respack_images :=
@@ -16,38 +16,122 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <dirent.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
 
 #include <linux/input.h>
 
 #include "minui.h"
 
 #define MAX_DEVICES 16
+#define INPUT_DIR "/dev/input"
 
-static struct pollfd ev_fds[MAX_DEVICES];
+// Events are read this many at a time and handed out one by one.
+#define EV_BATCH 64
+
+// epoll data for the inotify fd; devices use their slot number.
+#define EV_INOTIFY MAX_DEVICES
+
+static int ev_fds[MAX_DEVICES];
 static unsigned ev_count = 0;
+static int ev_epoll_fd = -1;
+static int ev_inotify_fd = -1;
+
+static struct input_event ev_buf[EV_BATCH];
+static unsigned ev_buf_pos = 0;
+static unsigned ev_buf_len = 0;
+
+static void ev_add_device(int dirfd, const char *name)
+{
+    if (strncmp(name, "event", 5)) return;
+
+    unsigned n;
+    for (n = 0; n < MAX_DEVICES; n++) {
+        if (ev_fds[n] < 0) break;
+    }
+    if (n == MAX_DEVICES) return;
+
+    int fd = openat(dirfd, name, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) return;
+
+    struct epoll_event e;
+    e.events = EPOLLIN;
+    e.data.u32 = n;
+    if (epoll_ctl(ev_epoll_fd, EPOLL_CTL_ADD, fd, &e) < 0) {
+        close(fd);
+        return;
+    }
+    ev_fds[n] = fd;
+    ev_count++;
+}
+
+static void ev_remove_device(unsigned n)
+{
+    epoll_ctl(ev_epoll_fd, EPOLL_CTL_DEL, ev_fds[n], NULL);
+    close(ev_fds[n]);
+    ev_fds[n] = -1;
+    ev_count--;
+}
+
+// Pick up devices that appeared under /dev/input.  Ones that go away are
+// dropped when reading them fails.
+static void ev_handle_inotify(void)
+{
+    char buf[512];
+    int r = read(ev_inotify_fd, buf, sizeof(buf));
+    if (r <= 0) return;
+
+    int dirfd = open(INPUT_DIR, O_RDONLY);
+    if (dirfd < 0) return;
+    int pos = 0;
+    while (pos + (int) sizeof(struct inotify_event) <= r) {
+        struct inotify_event *ie = (struct inotify_event *) (buf + pos);
+        if (ie->len > 0 && (ie->mask & IN_CREATE)) {
+            ev_add_device(dirfd, ie->name);
+        }
+        pos += sizeof(*ie) + ie->len;
+    }
+    close(dirfd);
+}
 
 int ev_init(void)
 {
     DIR *dir;
     struct dirent *de;
-    int fd;
+    unsigned n;
+
+    for (n = 0; n < MAX_DEVICES; n++) ev_fds[n] = -1;
 
-    dir = opendir("/dev/input");
+    ev_epoll_fd = epoll_create(MAX_DEVICES + 1);
+    if (ev_epoll_fd < 0) {
+        perror("epoll_create");
+        return -1;
+    }
+
+    // Watch for hot-plugged devices before looking, so none are missed.
+    ev_inotify_fd = inotify_init();
+    if (ev_inotify_fd >= 0) {
+        struct epoll_event e;
+        e.events = EPOLLIN;
+        e.data.u32 = EV_INOTIFY;
+        if (inotify_add_watch(ev_inotify_fd, INPUT_DIR, IN_CREATE) < 0 ||
+            epoll_ctl(ev_epoll_fd, EPOLL_CTL_ADD, ev_inotify_fd, &e) < 0) {
+            close(ev_inotify_fd);
+            ev_inotify_fd = -1;
+        }
+    }
+
+    dir = opendir(INPUT_DIR);
     if(dir != 0) {
         while((de = readdir(dir))) {
-//            fprintf(stderr,"/dev/input/%s\n", de->d_name);
-            if(strncmp(de->d_name,"event",5)) continue;
-            fd = openat(dirfd(dir), de->d_name, O_RDONLY);
-            if(fd < 0) continue;
-
-            ev_fds[ev_count].fd = fd;
-            ev_fds[ev_count].events = POLLIN;
-            ev_count++;
-            if(ev_count == MAX_DEVICES) break;
+            ev_add_device(dirfd(dir), de->d_name);
         }
+        closedir(dir);
     }
 
     return 0;
@@ -55,28 +139,52 @@ int ev_init(void)
 
 void ev_exit(void)
 {
-    while (ev_count > 0) {
-        close(ev_fds[--ev_count].fd);
+    unsigned n;
+    for (n = 0; n < MAX_DEVICES; n++) {
+        if (ev_fds[n] >= 0) ev_remove_device(n);
     }
+    if (ev_inotify_fd >= 0) close(ev_inotify_fd);
+    if (ev_epoll_fd >= 0) close(ev_epoll_fd);
+    ev_inotify_fd = ev_epoll_fd = -1;
+    ev_buf_pos = ev_buf_len = 0;
 }
 
 int ev_get(struct input_event *ev, unsigned dont_wait)
 {
-    int r;
-    unsigned n;
+    struct epoll_event events[MAX_DEVICES + 1];
+    int r, i;
 
     do {
-        r = poll(ev_fds, ev_count, dont_wait ? 0 : -1);
-
-        if(r > 0) {
-            for(n = 0; n < ev_count; n++) {
-                if(ev_fds[n].revents & POLLIN) {
-                    r = read(ev_fds[n].fd, ev, sizeof(*ev));
-                    if(r == sizeof(*ev)) return 0;
-                }
+        if (ev_buf_pos < ev_buf_len) {
+            *ev = ev_buf[ev_buf_pos++];
+            return 0;
+        }
+
+        r = epoll_wait(ev_epoll_fd, events, MAX_DEVICES + 1,
+                       dont_wait ? 0 : -1);
+        if (r < 0 && errno != EINTR) return -1;
+
+        for (i = 0; i < r; i++) {
+            unsigned n = events[i].data.u32;
+            if (n == EV_INOTIFY) {
+                ev_handle_inotify();
+                continue;
+            }
+            if (ev_fds[n] < 0) continue;
+
+            // Take everything this device has queued in one read; the
+            // rest of the ready devices are still ready next time.
+            int len = read(ev_fds[n], ev_buf, sizeof(ev_buf));
+            if (len < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+            if (len <= 0) {
+                ev_remove_device(n);    // unplugged
+                continue;
             }
+            ev_buf_pos = 0;
+            ev_buf_len = len / sizeof(ev_buf[0]);
+            if (ev_buf_len > 0) break;
         }
-    } while(dont_wait == 0);
+    } while (ev_buf_pos < ev_buf_len || dont_wait == 0);
 
     return -1;
 }
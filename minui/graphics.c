@@ -15,6 +15,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <fcntl.h>
@@ -32,11 +33,18 @@
 #include "font_10x18.h"
 #include "minui.h"
 
+/* The font is a 1-bit mask, so besides the texture each glyph is kept as
+ * one bitmask per row (bit n is column n) for gr_text() to write straight
+ * into the memory surface. */
+#define GLYPH_COUNT 96
+#define MAX_GLYPH_WIDTH 16
+
 typedef struct {
     GGLSurface texture;
     unsigned cwidth;
     unsigned cheight;
     unsigned ascent;
+    unsigned short *glyphs;     // [GLYPH_COUNT][cheight], or NULL
 } GRFont;
 
 static GRFont *gr_font = 0;
@@ -45,12 +53,107 @@ static GGLSurface gr_font_texture;
 static GGLSurface gr_framebuffer[2];
 static GGLSurface gr_mem_surface;
 static unsigned gr_active_fb = 0;
+static unsigned gr_num_fbs = 2;
+static int gr_can_pan = 1;
+
+static unsigned short gr_color565 = 0;
+static unsigned char gr_alpha = 255;
 
 static int gr_fb_fd = -1;
 static int gr_vt_fd = -1;
 
 static struct fb_var_screeninfo vi;
 
+/* Parts of the screen drawn on since the last flip.  Each framebuffer was
+ * last brought up to date two flips ago (or one, if there's only one), so
+ * a flip copies what changed since then: this frame's damage and, with
+ * two buffers, the previous frame's too.  Rectangles are [x1,x2) x [y1,y2).
+ */
+#define MAX_DAMAGE 8
+
+typedef struct {
+    int x1, y1, x2, y2;
+} GRRect;
+
+typedef struct {
+    GRRect rects[MAX_DAMAGE];
+    int count;
+} GRDamage;
+
+static GRDamage gr_damage;
+static GRDamage gr_prev_damage;
+
+static void damage_full(GRDamage* d)
+{
+    d->rects[0].x1 = 0;
+    d->rects[0].y1 = 0;
+    d->rects[0].x2 = vi.xres;
+    d->rects[0].y2 = vi.yres;
+    d->count = 1;
+}
+
+static void add_damage(int x1, int y1, int x2, int y2)
+{
+    GRDamage* d = &gr_damage;
+    if (x1 < 0) x1 = 0;
+    if (y1 < 0) y1 = 0;
+    if (x2 > (int) vi.xres) x2 = vi.xres;
+    if (y2 > (int) vi.yres) y2 = vi.yres;
+    if (x1 >= x2 || y1 >= y2) return;
+
+    // Grow a rectangle this one touches, or add it; when there's no room
+    // left, fold everything into one.
+    int i;
+    for (i = 0; i < d->count; ++i) {
+        GRRect* r = &d->rects[i];
+        if (x1 <= r->x2 && r->x1 <= x2 && y1 <= r->y2 && r->y1 <= y2) break;
+    }
+    if (i == d->count) {
+        if (d->count < MAX_DAMAGE) {
+            GRRect* r = &d->rects[d->count++];
+            r->x1 = x1;
+            r->y1 = y1;
+            r->x2 = x2;
+            r->y2 = y2;
+            return;
+        }
+        for (i = 1; i < d->count; ++i) {
+            GRRect* r = &d->rects[i];
+            if (r->x1 < d->rects[0].x1) d->rects[0].x1 = r->x1;
+            if (r->y1 < d->rects[0].y1) d->rects[0].y1 = r->y1;
+            if (r->x2 > d->rects[0].x2) d->rects[0].x2 = r->x2;
+            if (r->y2 > d->rects[0].y2) d->rects[0].y2 = r->y2;
+        }
+        d->count = 1;
+        i = 0;
+    }
+    GRRect* r = &d->rects[i];
+    if (x1 < r->x1) r->x1 = x1;
+    if (y1 < r->y1) r->y1 = y1;
+    if (x2 > r->x2) r->x2 = x2;
+    if (y2 > r->y2) r->y2 = y2;
+}
+
+static void copy_damage(GGLSurface* fb, const GRDamage* d)
+{
+    int i, y;
+    for (i = 0; i < d->count; ++i) {
+        const GRRect* r = &d->rects[i];
+        if (r->x1 == 0 && r->x2 == (int) vi.xres) {
+            // Whole rows are contiguous.
+            memcpy(fb->data + r->y1 * vi.xres * 2,
+                   gr_mem_surface.data + r->y1 * vi.xres * 2,
+                   (r->y2 - r->y1) * vi.xres * 2);
+            continue;
+        }
+        for (y = r->y1; y < r->y2; ++y) {
+            unsigned offset = (y * vi.xres + r->x1) * 2;
+            memcpy(fb->data + offset, gr_mem_surface.data + offset,
+                   (r->x2 - r->x1) * 2);
+        }
+    }
+}
+
 static int get_framebuffer(GGLSurface *fb)
 {
     int fd;
@@ -75,6 +178,10 @@ static int get_framebuffer(GGLSurface *fb)
         return -1;
     }
 
+    // Some drivers only have room for the visible screen; then we draw
+    // straight into it rather than flipping.
+    gr_num_fbs = (fi.smem_len >= vi.xres * vi.yres * 2 * 2) ? 2 : 1;
+
     bits = mmap(0, fi.smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (bits == MAP_FAILED) {
         perror("failed to mmap framebuffer");
@@ -112,9 +219,14 @@ static void get_memory_surface(GGLSurface* ms) {
 
 static void set_active_framebuffer(unsigned n)
 {
-    if (n > 1) return;
-    vi.yres_virtual = vi.yres * 2;
+    if (n >= gr_num_fbs) return;
+    vi.yres_virtual = vi.yres * gr_num_fbs;
     vi.yoffset = n * vi.yres;
+
+    /* Panning only moves the scanout; fall back to setting the whole mode
+     * for drivers that don't implement it. */
+    if (gr_can_pan && ioctl(gr_fb_fd, FBIOPAN_DISPLAY, &vi) == 0) return;
+    gr_can_pan = 0;
     if (ioctl(gr_fb_fd, FBIOPUT_VSCREENINFO, &vi) < 0) {
         perror("active fb swap failed");
     }
@@ -122,15 +234,27 @@ static void set_active_framebuffer(unsigned n)
 
 void gr_flip(void)
 {
-    GGLContext *gl = gr_context;
+    if (gr_num_fbs == 1) {
+        /* copy what changed straight to the screen */
+        copy_damage(&gr_framebuffer[0], &gr_damage);
+        gr_damage.count = 0;
+        return;
+    }
+
+    /* nothing new since the last flip: the front buffer is already right,
+     * and the back one still just needs the previous frame's damage */
+    if (gr_damage.count == 0) return;
 
     /* swap front and back buffers */
     gr_active_fb = (gr_active_fb + 1) & 1;
 
     /* copy data from the in-memory surface to the buffer we're about
-     * to make active. */
-    memcpy(gr_framebuffer[gr_active_fb].data, gr_mem_surface.data,
-           vi.xres * vi.yres * 2);
+     * to make active, where it has changed since that buffer was last
+     * shown. */
+    copy_damage(&gr_framebuffer[gr_active_fb], &gr_prev_damage);
+    copy_damage(&gr_framebuffer[gr_active_fb], &gr_damage);
+    gr_prev_damage = gr_damage;
+    gr_damage.count = 0;
 
     /* inform the display driver */
     set_active_framebuffer(gr_active_fb);
@@ -145,6 +269,21 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     color[2] = ((b << 8) | b) + 1;
     color[3] = ((a << 8) | a) + 1;
     gl->color4xv(gl, color);
+
+    /* for gr_text_direct(), which blends by hand when a < 255 */
+    gr_color565 = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+    gr_alpha = a;
+}
+
+/* Mix color over the 565 pixel *p with alpha a (0-255). */
+static void gr_blend565(unsigned short *p, unsigned short color, unsigned a)
+{
+    unsigned d = *p;
+    unsigned r = ((color >> 11) * a + (d >> 11) * (255 - a)) / 255;
+    unsigned g = (((color >> 5) & 0x3f) * a +
+                  ((d >> 5) & 0x3f) * (255 - a)) / 255;
+    unsigned b = ((color & 0x1f) * a + (d & 0x1f) * (255 - a)) / 255;
+    *p = (r << 11) | (g << 5) | b;
 }
 
 int gr_measure(const char *s)
@@ -152,6 +291,53 @@ int gr_measure(const char *s)
     return gr_font->cwidth * strlen(s);
 }
 
+/* Draw s a row of pixels at a time, setting the pixels each glyph covers
+ * to the current color, blended by its alpha.  This is what pixelflinger
+ * does with the font texture, without setting up a textured rectangle
+ * per character. */
+static int gr_text_direct(int x, int y, const char *s)
+{
+    GRFont *font = gr_font;
+    int width = vi.xres;
+    int len = strlen(s);
+    unsigned short *dst = (unsigned short *) gr_mem_surface.data;
+    unsigned short color = gr_color565;
+    unsigned alpha = gr_alpha;
+    unsigned row;
+
+    for (row = 0; row < font->cheight; ++row) {
+        int py = y + row;
+        if (py < 0 || py >= (int) vi.yres) continue;
+        unsigned short *line = dst + py * width;
+
+        int i;
+        int gx = x;
+        for (i = 0; i < len; ++i, gx += font->cwidth) {
+            unsigned off = (unsigned char) s[i] - 32;
+            if (off >= GLYPH_COUNT) continue;
+            unsigned bits = font->glyphs[off * font->cheight + row];
+            if (bits == 0) continue;
+
+            if (gx >= 0 && gx + (int) font->cwidth <= width) {
+                unsigned short *p = line + gx;
+                for (; bits; bits >>= 1, ++p) {
+                    if (!(bits & 1)) continue;
+                    if (alpha == 255) *p = color;
+                    else gr_blend565(p, color, alpha);
+                }
+            } else {
+                int px;
+                for (px = gx; bits; bits >>= 1, ++px) {
+                    if (!(bits & 1) || px < 0 || px >= width) continue;
+                    if (alpha == 255) line[px] = color;
+                    else gr_blend565(line + px, color, alpha);
+                }
+            }
+        }
+    }
+    return x + len * font->cwidth;
+}
+
 int gr_text(int x, int y, const char *s)
 {
     GGLContext *gl = gr_context;
@@ -159,6 +345,11 @@ int gr_text(int x, int y, const char *s)
     unsigned off;
 
     y -= font->ascent;
+    add_damage(x, y, x + font->cwidth * strlen(s), y + font->cheight);
+
+    if (font->glyphs != NULL) {
+        return gr_text_direct(x, y, s);
+    }
 
     gl->bindTexture(gl, &font->texture);
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
@@ -181,6 +372,8 @@ int gr_text(int x, int y, const char *s)
 void gr_fill(int x, int y, int w, int h)
 {
     GGLContext *gl = gr_context;
+    /* recti() takes the far corner, so w and h are really x2 and y2 */
+    add_damage(x, y, w, h);
     gl->disable(gl, GGL_TEXTURE_2D);
     gl->recti(gl, x, y, w, h);
 }
@@ -190,6 +383,7 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy) {
         return;
     }
     GGLContext *gl = gr_context;
+    add_damage(dx, dy, dx + w, dy + h);
 
     gl->bindTexture(gl, (GGLSurface*) source);
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
@@ -241,6 +435,25 @@ static void gr_init_font(void)
     gr_font->cwidth = font.cwidth;
     gr_font->cheight = font.cheight;
     gr_font->ascent = font.cheight - 2;
+
+    if (font.cwidth <= MAX_GLYPH_WIDTH) {
+        gr_font->glyphs = calloc(GLYPH_COUNT * font.cheight,
+                                 sizeof(*gr_font->glyphs));
+    }
+    if (gr_font->glyphs != NULL) {
+        unsigned char *tex = ftex->data;
+        unsigned g, row, col;
+        for (g = 0; g < GLYPH_COUNT; ++g) {
+            for (row = 0; row < font.cheight; ++row) {
+                unsigned char *p = tex + row * font.width + g * font.cwidth;
+                unsigned short bits = 0;
+                for (col = 0; col < font.cwidth; ++col) {
+                    if (p[col]) bits |= 1 << col;
+                }
+                gr_font->glyphs[g * font.cheight + row] = bits;
+            }
+        }
+    }
 }
 
 int gr_init(void)
@@ -267,6 +480,8 @@ int gr_init(void)
     }
 
     get_memory_surface(&gr_mem_surface);
+    damage_full(&gr_damage);
+    damage_full(&gr_prev_damage);
 
     fprintf(stderr, "framebuffer: fd %d (%d x %d)\n",
             gr_fb_fd, gr_framebuffer[0].width, gr_framebuffer[0].height);
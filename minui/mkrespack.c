@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Build-time tool: convert the recovery PNGs into a resource pack (see
+// respack.h).
+//
+//   mkrespack <output.pack> <image.png>...
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pixelflinger/format.h>
+
+#include <png.h>
+
+#include "respack.h"
+
+typedef struct {
+    char name[RESPACK_NAME_LEN];
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    unsigned char* pixels;      // already in the pack's format
+    size_t size;
+} Image;
+
+static void put32(unsigned char* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// Decode the PNG at path into img.  Like res_create_surface(), this only
+// takes 8-bit RGB and RGBA.  Returns 0 on success.
+static int load_png(const char* path, Image* img) {
+    int result = 0;
+    unsigned char header[8];
+    unsigned char* row = NULL;
+    png_structp png_ptr = NULL;
+    png_infop info_ptr = NULL;
+
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "mkrespack: can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+        png_sig_cmp(header, 0, sizeof(header))) {
+        fprintf(stderr, "mkrespack: %s is not a PNG\n", path);
+        result = -1;
+        goto exit;
+    }
+
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png_ptr == NULL) {
+        result = -1;
+        goto exit;
+    }
+    info_ptr = png_create_info_struct(png_ptr);
+    if (info_ptr == NULL) {
+        result = -1;
+        goto exit;
+    }
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        fprintf(stderr, "mkrespack: error decoding %s\n", path);
+        result = -1;
+        goto exit;
+    }
+
+    png_init_io(png_ptr, fp);
+    png_set_sig_bytes(png_ptr, sizeof(header));
+    png_read_info(png_ptr, info_ptr);
+
+    int color_type = png_get_color_type(png_ptr, info_ptr);
+    int channels = png_get_channels(png_ptr, info_ptr);
+    if (png_get_bit_depth(png_ptr, info_ptr) != 8 ||
+        (channels != 3 && channels != 4) ||
+        (color_type != PNG_COLOR_TYPE_RGB &&
+         color_type != PNG_COLOR_TYPE_RGBA)) {
+        fprintf(stderr, "mkrespack: %s is not 8-bit RGB or RGBA\n", path);
+        result = -1;
+        goto exit;
+    }
+
+    img->width = png_get_image_width(png_ptr, info_ptr);
+    img->height = png_get_image_height(png_ptr, info_ptr);
+    int bpp = (channels == 3) ? 2 : 4;
+    img->format = (channels == 3) ?
+            GGL_PIXEL_FORMAT_RGB_565 : GGL_PIXEL_FORMAT_RGBA_8888;
+    img->size = (size_t) img->width * img->height * bpp;
+    img->pixels = malloc(img->size);
+    row = malloc(img->width * channels);
+    if (img->pixels == NULL || row == NULL) {
+        result = -1;
+        goto exit;
+    }
+
+    uint32_t x, y;
+    for (y = 0; y < img->height; ++y) {
+        png_read_row(png_ptr, row, NULL);
+        unsigned char* out = img->pixels + (size_t) y * img->width * bpp;
+        if (channels == 4) {
+            memcpy(out, row, img->width * 4);
+            continue;
+        }
+        for (x = 0; x < img->width; ++x) {
+            unsigned char* p = row + x * 3;
+            unsigned int v = ((p[0] >> 3) << 11) | ((p[1] >> 2) << 5) |
+                    (p[2] >> 3);
+            out[x * 2] = v;
+            out[x * 2 + 1] = v >> 8;
+        }
+    }
+
+exit:
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    fclose(fp);
+    free(row);
+    return result;
+}
+
+// The resource name for a path: its basename without ".png".
+static int image_name(const char* path, char* name) {
+    const char* base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    size_t len = strlen(base);
+    if (len > 4 && strcmp(base + len - 4, ".png") == 0) len -= 4;
+    if (len == 0 || len >= RESPACK_NAME_LEN) {
+        fprintf(stderr, "mkrespack: bad image name %s\n", path);
+        return -1;
+    }
+    memset(name, 0, RESPACK_NAME_LEN);
+    memcpy(name, base, len);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <output.pack> <image.png>...\n", argv[0]);
+        return 2;
+    }
+
+    int count = argc - 2;
+    Image* images = calloc(count, sizeof(Image));
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (image_name(argv[i+2], images[i].name) != 0 ||
+            load_png(argv[i+2], &images[i]) != 0) {
+            return 1;
+        }
+    }
+
+    size_t table_size = sizeof(RespackHeader) + count * sizeof(RespackEntry);
+    unsigned char* table = calloc(1, table_size);
+    memcpy(table, RESPACK_MAGIC, 4);
+    put32(table + 4, count);
+
+    uint32_t offset = (table_size + 3) & ~3;
+    for (i = 0; i < count; ++i) {
+        unsigned char* e = table + sizeof(RespackHeader) +
+                i * sizeof(RespackEntry);
+        memcpy(e, images[i].name, RESPACK_NAME_LEN);
+        put32(e + RESPACK_NAME_LEN, images[i].format);
+        put32(e + RESPACK_NAME_LEN + 4, images[i].width);
+        put32(e + RESPACK_NAME_LEN + 8, images[i].height);
+        put32(e + RESPACK_NAME_LEN + 12, offset);
+        offset = (offset + images[i].size + 3) & ~3;
+    }
+
+    FILE* out = fopen(argv[1], "wb");
+    if (out == NULL) {
+        fprintf(stderr, "mkrespack: can't create %s: %s\n",
+                argv[1], strerror(errno));
+        return 1;
+    }
+    static const unsigned char zeros[4];
+    size_t pos = table_size;
+    fwrite(table, 1, table_size, out);
+    for (i = 0; i < count; ++i) {
+        fwrite(zeros, 1, ((pos + 3) & ~3) - pos, out);
+        pos = (pos + 3) & ~3;
+        fwrite(images[i].pixels, 1, images[i].size, out);
+        pos += images[i].size;
+    }
+    int failed = ferror(out);
+    if (fclose(out) != 0 || failed) {
+        fprintf(stderr, "mkrespack: error writing %s\n", argv[1]);
+        remove(argv[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -20,8 +20,11 @@
 #include <fcntl.h>
 #include <stdio.h>
 
+#include <string.h>
+
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <linux/fb.h>
@@ -32,6 +35,9 @@
 #include <png.h>
 
 #include "minui.h"
+#include "respack.h"
+
+#define RESPACK_PATH "/res/images.pack"
 
 // libpng gives "undefined reference to 'pow'" errors, and I have no
 // idea how to convince the build system to link with -lm.  We don't
@@ -41,7 +47,74 @@ double pow(double x, double y) {
     return x;
 }
 
+// The mapped resource pack, or NULL if there isn't a usable one.
+static const unsigned char* gPack = NULL;
+static size_t gPackSize = 0;
+static int gPackOpened = 0;
+
+static void open_pack() {
+    gPackOpened = 1;
+    int fd = open(RESPACK_PATH, O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= sizeof(RespackHeader)) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            const RespackHeader* header = map;
+            if (memcmp(header->magic, RESPACK_MAGIC, 4) == 0 &&
+                header->count <= (st.st_size - sizeof(RespackHeader)) /
+                        sizeof(RespackEntry)) {
+                gPack = map;
+                gPackSize = st.st_size;
+            } else {
+                munmap(map, st.st_size);
+            }
+        }
+    }
+    close(fd);
+}
+
+// Point *pSurface at the named image in the pack, whose pixels are used
+// where they are.  Returns 0 on success, or -1 if it isn't there.
+static int pack_create_surface(const char* name, gr_surface* pSurface) {
+    if (!gPackOpened) open_pack();
+    if (gPack == NULL) return -1;
+
+    const RespackHeader* header = (const RespackHeader*) gPack;
+    const RespackEntry* entries = (const RespackEntry*) (header + 1);
+    uint32_t i;
+    for (i = 0; i < header->count; ++i) {
+        const RespackEntry* e = &entries[i];
+        if (strncmp(e->name, name, RESPACK_NAME_LEN) != 0) continue;
+
+        size_t bpp = (e->format == GGL_PIXEL_FORMAT_RGB_565) ? 2 : 4;
+        if (e->offset > gPackSize ||
+            (gPackSize - e->offset) / bpp / (e->width ? e->width : 1) <
+                    e->height) {
+            return -1;
+        }
+        GGLSurface* surface = malloc(sizeof(GGLSurface));
+        if (surface == NULL) return -1;
+        surface->version = sizeof(GGLSurface);
+        surface->width = e->width;
+        surface->height = e->height;
+        surface->stride = e->width;
+        surface->data = (GGLubyte*) (gPack + e->offset);
+        surface->format = e->format;
+        *pSurface = (gr_surface) surface;
+        return 0;
+    }
+    return -1;
+}
+
 int res_create_surface(const char* name, gr_surface* pSurface) {
+    // Images in the pack need no decoding; anything else comes from its
+    // PNG as before.
+    if (pack_create_surface(name, pSurface) == 0) {
+        return 0;
+    }
+
     char resPath[256];
     GGLSurface* surface = NULL;
     int result = 0;
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MINUI_RESPACK_H_
+#define _MINUI_RESPACK_H_
+
+#include <stdint.h>
+
+/* A resource pack holds the recovery images already converted to the
+ * pixel formats pixelflinger draws from, so they can be mmapped and used
+ * in place instead of decoded from PNG.  It's written by mkrespack at
+ * build time and read by res_create_surface().
+ *
+ * The file is a RespackHeader, then count RespackEntry records, then the
+ * pixel data.  All fields are little-endian.  Each image starts at a
+ * multiple of 4 bytes and has width * height pixels with no row padding:
+ * RGB_565 for opaque images and RGBA_8888 for ones with alpha, which 565
+ * has no room for.
+ */
+
+#define RESPACK_MAGIC       "RPK1"
+#define RESPACK_NAME_LEN    32
+
+typedef struct {
+    char magic[4];
+    uint32_t count;
+} RespackHeader;
+
+typedef struct {
+    char name[RESPACK_NAME_LEN];    // NUL-terminated, without ".png"
+    uint32_t format;                // GGL_PIXEL_FORMAT_*
+    uint32_t width;
+    uint32_t height;
+    uint32_t offset;                // of the pixels, from the file start
+} RespackEntry;
+
+#endif
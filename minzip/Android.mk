@@ -6,6 +6,12 @@ LOCAL_SRC_FILES := \
 	SysUtil.c \
 	DirUtil.c \
 	Inlines.c \
+	Crc32.c \
+	Digests.c \
+	Sha1.c \
+	Throughput.c \
+	Trace.c \
+	Budget.c \
 	Zip.c
 
 LOCAL_C_INCLUDES += \
@@ -17,3 +23,17 @@ LOCAL_MODULE := libminzip
 LOCAL_CFLAGS += -Wall
 
 include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := Sha1Bench.c
+
+LOCAL_MODULE := sha1_bench
+LOCAL_MODULE_TAGS := eng
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+
+LOCAL_CFLAGS += -Wall
+
+LOCAL_STATIC_LIBRARIES := libminzip libmincrypt libc
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,177 @@
+/*
+ * Copyright 2010 The Android Open Source Project
+ *
+ * A memory budget for buffers sized by the data in them.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/statfs.h>
+#include <unistd.h>
+
+#include "Budget.h"
+
+/* Used if the size of physical memory can't be found. */
+#define DEFAULT_BUDGET (32 * 1024 * 1024)
+
+/* Leave this much of the spill directory's filesystem free. */
+#define SPILL_RESERVE (1024 * 1024)
+
+/*
+ * Every buffer starts with one of these; the caller gets the bytes
+ * after it.  Sixteen bytes keep the caller's part aligned for anything.
+ */
+typedef union {
+    struct {
+        size_t size;
+        int spilled;
+    } h;
+    char pad[16];
+} BufferHeader;
+
+static pthread_mutex_t gLock = PTHREAD_MUTEX_INITIALIZER;
+static long long gLimit = -1;           /* not yet worked out */
+static long long gUsed = 0;
+static int gSpillPaused = 0;
+static long long gKeepFree = 0;         /* on top of SPILL_RESERVE */
+static const char* gSpillDir = NULL;    /* "" if spilling is off */
+
+/* Called with gLock held. */
+static void initLimit(void)
+{
+    gSpillDir = getenv(MZ_BUDGET_SPILL_ENV);
+    if (gSpillDir == NULL) gSpillDir = MZ_BUDGET_SPILL_DIR;
+
+    const char* env = getenv(MZ_BUDGET_ENV);
+    if (env != NULL && *env != '\0') {
+        char* end;
+        gLimit = strtoll(env, &end, 10);
+        if (*end == 'k' || *end == 'K') gLimit <<= 10;
+        if (*end == 'm' || *end == 'M') gLimit <<= 20;
+        if (gLimit >= 0) return;
+    }
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    gLimit = (pages > 0 && pageSize > 0) ?
+            (long long) pages * pageSize / 4 : DEFAULT_BUDGET;
+}
+
+/* Take "size" bytes of the budget if they fit, or regardless if "force". */
+static int charge(size_t size, int force)
+{
+    int fits;
+    pthread_mutex_lock(&gLock);
+    if (gLimit < 0) initLimit();
+    fits = gUsed + (long long) size <= gLimit;
+    if (fits || force) gUsed += size;
+    pthread_mutex_unlock(&gLock);
+    return fits;
+}
+
+static void refund(size_t size)
+{
+    pthread_mutex_lock(&gLock);
+    gUsed -= size;
+    pthread_mutex_unlock(&gLock);
+}
+
+/* Map a new unlinked file of "length" bytes in the spill directory. */
+static void* spill(size_t length)
+{
+    pthread_mutex_lock(&gLock);
+    const char* dir = gSpillPaused ? "" : gSpillDir;
+    long long keep = gKeepFree;
+    pthread_mutex_unlock(&gLock);
+    if (*dir == '\0') return NULL;
+
+    struct statfs sf;
+    if (statfs(dir, &sf) != 0 ||
+        (long long) sf.f_bavail * sf.f_bsize <
+                (long long) length + SPILL_RESERVE + keep) {
+        return NULL;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/.budget-XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd < 0) return NULL;
+    unlink(path);
+
+    void* map = MAP_FAILED;
+    if (ftruncate(fd, length) == 0) {
+        map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "budget: can't map %lu bytes in %s: %s\n",
+                (unsigned long) length, dir, strerror(errno));
+        return NULL;
+    }
+    fprintf(stderr, "budget: %lu bytes over budget; spilled to %s\n",
+            (unsigned long) length, dir);
+    return map;
+}
+
+void* mzBudgetAlloc(size_t size, int flags)
+{
+    size_t length = sizeof(BufferHeader) + size;
+    int pinned = flags & MZ_BUDGET_PINNED;
+    BufferHeader* hdr;
+
+    if (length < size) return NULL;
+    if (!charge(size, pinned) && !pinned) {
+        hdr = (BufferHeader*) spill(length);
+        if (hdr != NULL) {
+            hdr->h.size = size;
+            hdr->h.spilled = 1;
+            return hdr + 1;
+        }
+        /* No room there either: the heap, over budget or not. */
+        charge(size, 1);
+    }
+    hdr = (BufferHeader*) malloc(length);
+    if (hdr == NULL) {
+        refund(size);
+        return NULL;
+    }
+    hdr->h.size = size;
+    hdr->h.spilled = 0;
+    return hdr + 1;
+}
+
+void mzBudgetFree(void* buf)
+{
+    if (buf == NULL) return;
+    BufferHeader* hdr = (BufferHeader*) buf - 1;
+    if (hdr->h.spilled) {
+        munmap(hdr, sizeof(BufferHeader) + hdr->h.size);
+    } else {
+        refund(hdr->h.size);
+        free(hdr);
+    }
+}
+
+void mzBudgetPauseSpills(void)
+{
+    pthread_mutex_lock(&gLock);
+    gSpillPaused++;
+    pthread_mutex_unlock(&gLock);
+}
+
+void mzBudgetResumeSpills(void)
+{
+    pthread_mutex_lock(&gLock);
+    if (gSpillPaused > 0) gSpillPaused--;
+    pthread_mutex_unlock(&gLock);
+}
+
+void mzBudgetKeepFree(long long bytes)
+{
+    pthread_mutex_lock(&gLock);
+    gKeepFree = bytes > 0 ? bytes : 0;
+    pthread_mutex_unlock(&gLock);
+}
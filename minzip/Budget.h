@@ -0,0 +1,62 @@
+/*
+ * Copyright 2010 The Android Open Source Project
+ *
+ * A memory budget for buffers sized by the data in them.
+ */
+#ifndef _MINZIP_BUDGET
+#define _MINZIP_BUDGET
+
+#include <stddef.h>
+
+/*
+ * Whole images, patch targets and files read into memory can each be
+ * bigger than a low-RAM device has to spare, and several can be live at
+ * once (the deflate workers in imgpatch, for one).  Buffers like that
+ * are taken from a budget, by default a quarter of physical memory, or
+ * the number of bytes in MZ_BUDGET_ENV (with an optional "k" or "m").
+ *
+ * A buffer that doesn't fit in what's left of the budget is put in an
+ * unlinked file in the spill directory and mapped, so the kernel can
+ * page it out to flash instead of the process running out of memory.
+ * It's slower, not broken.  If there's no room there either, or spilling
+ * is off, it's malloc'd anyway, as it always used to be.
+ *
+ * The spill directory is MZ_BUDGET_SPILL_DIR unless MZ_BUDGET_SPILL_ENV
+ * names another one; set that to "" to never spill.  A spilled buffer
+ * holds its space (and keeps the filesystem busy, so it can't be
+ * unmounted) until it's freed.
+ *
+ * The budget is per process: recovery and the updater each have one.
+ */
+#define MZ_BUDGET_ENV "RECOVERY_MEMORY_BUDGET"
+#define MZ_BUDGET_SPILL_ENV "RECOVERY_MEMORY_SPILL_DIR"
+#define MZ_BUDGET_SPILL_DIR "/cache"
+
+/* The buffer must stay in RAM (it outlives the spill directory, say);
+ * it's counted against the budget but never spilled. */
+#define MZ_BUDGET_PINNED 1
+
+/*
+ * Allocate "size" bytes from the budget.  Returns NULL only if no memory
+ * at all could be had.  Free the buffer with mzBudgetFree(), not free().
+ * Safe to call from any thread.
+ */
+void* mzBudgetAlloc(size_t size, int flags);
+void mzBudgetFree(void* buf);
+
+/*
+ * Stop new buffers from being spilled until the matching resume, for
+ * when the spill directory's space is spoken for (applypatch staging a
+ * copy of its source in /cache, say).  Calls nest.
+ */
+void mzBudgetPauseSpills(void);
+void mzBudgetResumeSpills(void);
+
+/*
+ * Leave at least "bytes" of the spill directory's filesystem free when
+ * spilling, on top of the usual margin: room someone else has planned
+ * on.  Each call replaces the last; 0 drops the reservation.
+ */
+void mzBudgetKeepFree(long long bytes);
+
+#endif /*_MINZIP_BUDGET*/
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2006 The Android Open Source Project
+ *
+ * Table-driven CRC-32, eight bytes at a time.
+ */
+#include <pthread.h>
+#include <stdint.h>
+
+#include "Crc32.h"
+
+#define CRC32_POLY 0xedb88320   /* reflected 0x04c11db7 */
+
+/* gCrcTable[0] is the classic byte-at-a-time table.  gCrcTable[k][n] is
+ * the CRC of byte n followed by k zero bytes, which lets eight input
+ * bytes be folded in with eight independent lookups.
+ */
+static uint32_t gCrcTable[8][256];
+static pthread_once_t gCrcTableOnce = PTHREAD_ONCE_INIT;
+
+static void buildCrcTables(void)
+{
+    uint32_t n, k;
+
+    for (n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32_POLY : c >> 1;
+        }
+        gCrcTable[0][n] = c;
+    }
+    for (n = 0; n < 256; n++) {
+        uint32_t c = gCrcTable[0][n];
+        for (k = 1; k < 8; k++) {
+            c = (c >> 8) ^ gCrcTable[0][c & 0xff];
+            gCrcTable[k][n] = c;
+        }
+    }
+}
+
+unsigned long mzCrc32(unsigned long crc, const unsigned char *buf, size_t len)
+{
+    uint32_t c;
+
+    pthread_once(&gCrcTableOnce, buildCrcTables);
+
+    c = ~(uint32_t)crc;
+
+    /* Words are assembled a byte at a time, so this is independent of
+     * alignment and host byte order.
+     */
+    while (len >= 8) {
+        uint32_t one = c ^ (buf[0] | (buf[1] << 8) |
+                ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24));
+        uint32_t two = buf[4] | (buf[5] << 8) |
+                ((uint32_t)buf[6] << 16) | ((uint32_t)buf[7] << 24);
+        c = gCrcTable[7][one & 0xff] ^
+            gCrcTable[6][(one >> 8) & 0xff] ^
+            gCrcTable[5][(one >> 16) & 0xff] ^
+            gCrcTable[4][one >> 24] ^
+            gCrcTable[3][two & 0xff] ^
+            gCrcTable[2][(two >> 8) & 0xff] ^
+            gCrcTable[1][(two >> 16) & 0xff] ^
+            gCrcTable[0][two >> 24];
+        buf += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        c = (c >> 8) ^ gCrcTable[0][(c ^ *buf++) & 0xff];
+    }
+
+    return ~c & 0xffffffffUL;
+}
@@ -0,0 +1,20 @@
+/*
+ * Copyright 2006 The Android Open Source Project
+ *
+ * CRC-32 (the zip/zlib polynomial) over byte buffers.
+ */
+#ifndef _MINZIP_CRC32
+#define _MINZIP_CRC32
+
+#include <stdlib.h>
+
+/*
+ * Update a running CRC with "len" bytes from "buf".  Same conventions as
+ * zlib's crc32(): start with 0, and the result can be fed back in to
+ * continue over the next buffer.
+ *
+ * Uses slicing-by-8, which handles eight bytes per step instead of one.
+ */
+unsigned long mzCrc32(unsigned long crc, const unsigned char *buf, size_t len);
+
+#endif /*_MINZIP_CRC32*/
@@ -0,0 +1,150 @@
+/*
+ * Copyright 2006 The Android Open Source Project
+ *
+ * Per-entry SHA-1 checks against a table of expected digests.
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "minzip"
+#include "Digests.h"
+#include "Log.h"
+#include "Sha1.h"
+
+struct MzDigestTable {
+    MzEntryVerifier verifier;   /* must be first */
+    const ZipArchive* pArchive;
+    unsigned char* present;     /* indexed by entry */
+    unsigned char (*digests)[MZ_SHA1_DIGEST_SIZE];
+};
+
+typedef struct {
+    MzSha1Ctx ctx;
+    const unsigned char* expected;
+} DigestState;
+
+static bool digestBegin(const MzEntryVerifier* pVerifier,
+        const ZipEntry* pEntry, void** pState)
+{
+    const MzDigestTable* pTable = (const MzDigestTable*) pVerifier;
+    unsigned int index = mzGetZipEntryIndex(pTable->pArchive, pEntry);
+
+    if (index >= mzZipEntryCount(pTable->pArchive) ||
+            !pTable->present[index]) {
+        LOGE("No digest for %.*s\n", pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+
+    DigestState* state = (DigestState*) malloc(sizeof(DigestState));
+    if (state == NULL) {
+        return false;
+    }
+    mzSha1Init(&state->ctx);
+    state->expected = pTable->digests[index];
+    *pState = state;
+    return true;
+}
+
+static void digestUpdate(void* vstate, const unsigned char* data, int dataLen)
+{
+    DigestState* state = (DigestState*) vstate;
+    mzSha1Update(&state->ctx, data, dataLen);
+}
+
+static bool digestFinish(void* vstate)
+{
+    DigestState* state = (DigestState*) vstate;
+    bool ok = memcmp(mzSha1Final(&state->ctx), state->expected,
+            MZ_SHA1_DIGEST_SIZE) == 0;
+    free(state);
+    return ok;
+}
+
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+MzDigestTable* mzLoadDigestTable(const ZipArchive* pArchive,
+        const char* fileName)
+{
+    unsigned int numEntries = mzZipEntryCount(pArchive);
+    MzDigestTable* pTable = NULL;
+    char line[PATH_MAX + 2 * MZ_SHA1_DIGEST_SIZE + 4];
+    FILE* fp;
+
+    fp = fopen(fileName, "r");
+    if (fp == NULL) {
+        LOGE("Can't open digest table %s\n", fileName);
+        return NULL;
+    }
+
+    pTable = (MzDigestTable*) calloc(1, sizeof(MzDigestTable));
+    if (pTable == NULL)
+        goto bail;
+    pTable->pArchive = pArchive;
+    pTable->present = (unsigned char*) calloc(numEntries + 1, 1);
+    pTable->digests = calloc(numEntries + 1, MZ_SHA1_DIGEST_SIZE);
+    if (pTable->present == NULL || pTable->digests == NULL)
+        goto bail;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        size_t len = strlen(line);
+        int i;
+
+        if (len > 0 && line[len-1] == '\n')
+            line[--len] = '\0';
+        if (len < 2 * MZ_SHA1_DIGEST_SIZE + 2 || line[2 * MZ_SHA1_DIGEST_SIZE] != ' ') {
+            LOGE("Malformed digest line in %s\n", fileName);
+            goto bail;
+        }
+
+        const char* name = line + 2 * MZ_SHA1_DIGEST_SIZE + 1;
+        const ZipEntry* pEntry = mzFindZipEntry(pArchive, name);
+        if (pEntry == NULL) {
+            LOGE("Digest for unknown entry %s\n", name);
+            goto bail;
+        }
+        unsigned int index = mzGetZipEntryIndex(pArchive, pEntry);
+        for (i = 0; i < MZ_SHA1_DIGEST_SIZE; i++) {
+            int hi = hexValue(line[2*i]);
+            int lo = hexValue(line[2*i + 1]);
+            if (hi < 0 || lo < 0) {
+                LOGE("Malformed digest for %s\n", name);
+                goto bail;
+            }
+            pTable->digests[index][i] = (hi << 4) | lo;
+        }
+        pTable->present[index] = 1;
+    }
+    fclose(fp);
+
+    pTable->verifier.begin = digestBegin;
+    pTable->verifier.update = digestUpdate;
+    pTable->verifier.finish = digestFinish;
+    return pTable;
+
+bail:
+    fclose(fp);
+    mzFreeDigestTable(pTable);
+    return NULL;
+}
+
+const MzEntryVerifier* mzGetDigestTableVerifier(MzDigestTable* pTable)
+{
+    return &pTable->verifier;
+}
+
+void mzFreeDigestTable(MzDigestTable* pTable)
+{
+    if (pTable == NULL)
+        return;
+    free(pTable->present);
+    free(pTable->digests);
+    free(pTable);
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright 2006 The Android Open Source Project
+ *
+ * Expected SHA-1 digests for the entries of an archive, checked as the
+ * entries are read.
+ */
+#ifndef _MINZIP_DIGESTS
+#define _MINZIP_DIGESTS
+
+#include "Zip.h"
+
+/*
+ * The table is loaded from a text file with one line per entry:
+ *
+ *     <40 hex digits of SHA-1> <entry name>
+ *
+ * as written by the recovery verifier once the package's manifest has
+ * been checked.
+ */
+typedef struct MzDigestTable MzDigestTable;
+
+/*
+ * Load digests for "pArchive" from "fileName".  Returns NULL on error,
+ * including a line naming an entry the archive doesn't have.
+ */
+MzDigestTable* mzLoadDigestTable(const ZipArchive* pArchive,
+        const char* fileName);
+
+/*
+ * Get a verifier for mzSetEntryVerifier() that fails any entry with no
+ * digest in the table, or whose data doesn't hash to it.  It's freed
+ * along with the table.
+ */
+const MzEntryVerifier* mzGetDigestTableVerifier(MzDigestTable* pTable);
+
+void mzFreeDigestTable(MzDigestTable* pTable);
+
+#endif /*_MINZIP_DIGESTS*/
@@ -17,14 +17,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
 #include <limits.h>
 
 #include "DirUtil.h"
+#include "Hash.h"
 
 typedef enum { DMISSING, DDIR, DILLEGAL } DirStatus;
 
@@ -52,9 +56,92 @@ getPathDirStatus(const char *path)
     return DMISSING;
 }
 
+/* A set of directory paths (no trailing slash) that are known to exist.
+ */
+struct DirCache {
+    HashTable *paths;
+};
+
+static unsigned int
+hashPath(const char *path)
+{
+    /* FNV-1a */
+    unsigned int hash = 2166136261u;
+    while (*path != '\0') {
+        hash ^= (unsigned char)*path++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int
+cmpPath(const void *tableItem, const void *looseItem)
+{
+    return strcmp((const char *)tableItem, (const char *)looseItem);
+}
+
+DirCache *
+dirCacheCreate(void)
+{
+    DirCache *cache = (DirCache *)malloc(sizeof(*cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->paths = mzHashTableCreate(64, free);
+    if (cache->paths == NULL) {
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void
+dirCacheFree(DirCache *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+    mzHashTableFree(cache->paths);
+    free(cache);
+}
+
+static bool
+dirCacheContains(DirCache *cache, const char *path)
+{
+    if (cache == NULL) {
+        return false;
+    }
+    return mzHashTableLookup(cache->paths, hashPath(path), (void *)path,
+            cmpPath, false) != NULL;
+}
+
+static void
+dirCacheAdd(DirCache *cache, const char *path)
+{
+    if (cache == NULL) {
+        return;
+    }
+    char *copy = strdup(path);
+    if (copy == NULL) {
+        return;     // it's only a cache
+    }
+    if (mzHashTableLookup(cache->paths, hashPath(copy), copy,
+            cmpPath, true) != copy) {
+        free(copy);
+    }
+}
+
 int
 dirCreateHierarchy(const char *path, int mode,
         const struct utimbuf *timestamp, bool stripFileName)
+{
+    return dirCreateHierarchyCached(NULL, path, mode, timestamp,
+            stripFileName);
+}
+
+int
+dirCreateHierarchyCached(DirCache *cache, const char *path, int mode,
+        const struct utimbuf *timestamp, bool stripFileName)
 {
     DirStatus ds;
 
@@ -99,12 +186,24 @@ dirCreateHierarchy(const char *path, int mode,
         cpath[pathLen + 1] = '\0';
     }
 
-    /* See if it already exists.
+    /* See if we've already made it, or if it already exists.
+     * Cache keys don't have the trailing slash.
      */
+    char *end = cpath + strlen(cpath) - 1;
+    *end = '\0';
+    if (dirCacheContains(cache, cpath)) {
+        free(cpath);
+        return 0;
+    }
+    *end = '/';
     ds = getPathDirStatus(cpath);
     if (ds == DDIR) {
+        *end = '\0';
+        dirCacheAdd(cache, cpath);
+        free(cpath);
         return 0;
     } else if (ds == DILLEGAL) {
+        free(cpath);
         return -1;
     }
 
@@ -134,6 +233,10 @@ dirCreateHierarchy(const char *path, int mode,
         /* Check this part of the path and make a new directory
          * if necessary.
          */
+        if (dirCacheContains(cache, cpath)) {
+            *p = '/';
+            continue;
+        }
         ds = getPathDirStatus(cpath);
         if (ds == DILLEGAL) {
             /* Could happen if some other process/thread is
@@ -155,7 +258,8 @@ dirCreateHierarchy(const char *path, int mode,
             }
         }
         // else, this directory already exists.
-        
+        dirCacheAdd(cache, cpath);
+
         /* Repair the path and continue.
          */
         *p = '/';
@@ -165,67 +269,652 @@ dirCreateHierarchy(const char *path, int mode,
     return 0;
 }
 
-int
-dirUnlinkHierarchy(const char *path)
+/* A small pool of threads that walks a directory tree by descriptor.
+ *
+ * Directories waiting to be walked sit in a bounded queue as open
+ * descriptors (plus, optionally, their path).  Each worker pulls one,
+ * hands it to the walk function, and that function pushes any
+ * subdirectories it finds.  When the queue is full, the subdirectory is
+ * walked inline on the thread that found it instead.
+ */
+#define DIRWALK_MAX_WORKERS 4
+#define DIRWALK_MAX_QUEUED 64
+
+typedef struct DirWalk DirWalk;
+
+/* Walk the directory open on "fd", then close it and free "path".
+ */
+typedef void (*DirWalkFunc)(DirWalk *walk, int fd, char *path);
+
+struct DirWalk {
+    DirWalkFunc func;
+    void *cookie;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct {
+        int fd;
+        char *path;
+    } queue[DIRWALK_MAX_QUEUED];
+    int numQueued;
+    int numBusy;        /* workers currently walking a directory */
+    int error;          /* first errno seen, or 0 */
+};
+
+static void
+dirWalkFail(DirWalk *walk, int err)
 {
-    struct stat st;
-    DIR *dir;
-    struct dirent *de;
-    int fail = 0;
+    pthread_mutex_lock(&walk->lock);
+    if (walk->error == 0) {
+        walk->error = err ? err : -1;
+    }
+    pthread_cond_broadcast(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
+}
 
-    /* is it a file or directory? */
-    if (lstat(path, &st) < 0) {
+static bool
+dirWalkFailed(DirWalk *walk)
+{
+    pthread_mutex_lock(&walk->lock);
+    bool failed = walk->error != 0;
+    pthread_mutex_unlock(&walk->lock);
+    return failed;
+}
+
+/* Hand a subdirectory to another worker, or walk it here if the queue
+ * is full.  Takes ownership of "fd" and "path".
+ */
+static void
+dirWalkQueue(DirWalk *walk, int fd, char *path)
+{
+    pthread_mutex_lock(&walk->lock);
+    if (walk->numQueued < DIRWALK_MAX_QUEUED) {
+        walk->queue[walk->numQueued].fd = fd;
+        walk->queue[walk->numQueued].path = path;
+        walk->numQueued++;
+        pthread_cond_signal(&walk->cond);
+        pthread_mutex_unlock(&walk->lock);
+        return;
+    }
+    pthread_mutex_unlock(&walk->lock);
+    walk->func(walk, fd, path);
+}
+
+static void *
+dirWalkWorker(void *arg)
+{
+    DirWalk *walk = (DirWalk *)arg;
+
+    pthread_mutex_lock(&walk->lock);
+    for (;;) {
+        while (walk->numQueued == 0 && walk->numBusy > 0) {
+            pthread_cond_wait(&walk->cond, &walk->lock);
+        }
+        if (walk->numQueued == 0) {
+            /* Nothing queued and nobody left who could queue more. */
+            break;
+        }
+        walk->numQueued--;
+        int fd = walk->queue[walk->numQueued].fd;
+        char *path = walk->queue[walk->numQueued].path;
+        bool failed = walk->error != 0;
+        walk->numBusy++;
+        pthread_mutex_unlock(&walk->lock);
+
+        if (!failed) {
+            walk->func(walk, fd, path);
+        } else {
+            close(fd);
+            free(path);
+        }
+
+        pthread_mutex_lock(&walk->lock);
+        walk->numBusy--;
+        if (walk->numBusy == 0) {
+            pthread_cond_broadcast(&walk->cond);
+        }
+    }
+    pthread_cond_broadcast(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+/* Walk the tree rooted at the directory open on "fd" (taking ownership
+ * of it and of "path").  Returns 0, or -1 with errno set to the first
+ * error any worker hit.
+ */
+static int
+dirWalkRun(DirWalk *walk, int fd, char *path)
+{
+    pthread_t threads[DIRWALK_MAX_WORKERS];
+    long numWorkers;
+    int started = 0;
+    int i;
+
+    pthread_mutex_init(&walk->lock, NULL);
+    pthread_cond_init(&walk->cond, NULL);
+    walk->numQueued = walk->numBusy = walk->error = 0;
+    walk->queue[walk->numQueued].fd = fd;
+    walk->queue[walk->numQueued].path = path;
+    walk->numQueued++;
+
+    numWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numWorkers < 1) numWorkers = 1;
+    if (numWorkers > DIRWALK_MAX_WORKERS) numWorkers = DIRWALK_MAX_WORKERS;
+    for (i = 1; i < numWorkers; i++) {
+        if (pthread_create(&threads[started], NULL, dirWalkWorker, walk)) {
+            break;
+        }
+        started++;
+    }
+    dirWalkWorker(walk);
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&walk->cond);
+    pthread_mutex_destroy(&walk->lock);
+
+    if (walk->error != 0) {
+        errno = walk->error;
         return -1;
     }
+    return 0;
+}
 
-    /* a file, so unlink it */
-    if (!S_ISDIR(st.st_mode)) {
-        return unlink(path);
+static char *
+joinPath(const char *dir, const char *name)
+{
+    size_t dirLen = strlen(dir);
+    size_t nameLen = strlen(name);
+    char *path = (char *)malloc(dirLen + 1 + nameLen + 1);
+    if (path != NULL) {
+        memcpy(path, dir, dirLen);
+        path[dirLen] = '/';
+        memcpy(path + dirLen + 1, name, nameLen + 1);
+    }
+    return path;
+}
+
+/* State for removing a tree.  Files are unlinked as the walk finds
+ * them; directories can only go once they're empty, so their paths are
+ * collected and removed deepest-first after the walk.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    char **dirs;
+    int numDirs;
+    int dirsCap;
+    unsigned long removed;
+} UnlinkState;
+
+static void
+unlinkRememberDir(DirWalk *walk, UnlinkState *state, char *path)
+{
+    pthread_mutex_lock(&state->lock);
+    if (state->numDirs == state->dirsCap) {
+        int newCap = state->dirsCap ? state->dirsCap * 2 : 64;
+        char **newDirs = (char **)realloc(state->dirs,
+                newCap * sizeof(char *));
+        if (newDirs == NULL) {
+            pthread_mutex_unlock(&state->lock);
+            free(path);
+            dirWalkFail(walk, ENOMEM);
+            return;
+        }
+        state->dirs = newDirs;
+        state->dirsCap = newCap;
     }
+    state->dirs[state->numDirs++] = path;
+    pthread_mutex_unlock(&state->lock);
+}
 
-    /* a directory, so open handle */
-    dir = opendir(path);
+static void
+unlinkWalkDir(DirWalk *walk, int fd, char *path)
+{
+    UnlinkState *state = (UnlinkState *)walk->cookie;
+    unsigned long removed = 0;
+
+    DIR *dir = fdopendir(fd);
     if (dir == NULL) {
-        return -1;
+        dirWalkFail(walk, errno);
+        close(fd);
+        free(path);
+        return;
     }
 
-    /* recurse over components */
+    const struct dirent *de;
     errno = 0;
     while ((de = readdir(dir)) != NULL) {
-//TODO: don't blow the stack
-        char dn[PATH_MAX];
         if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
             continue;
         }
-        snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-        if (dirUnlinkHierarchy(dn) < 0) {
-            fail = 1;
+        if (dirWalkFailed(walk)) {
+            break;
+        }
+
+        /* Try it as a file first; that's what most entries are, and it
+         * saves a stat.
+         */
+        if (unlinkat(fd, de->d_name, 0) == 0) {
+            removed++;
+            errno = 0;
+            continue;
+        }
+        if (errno != EISDIR && errno != EPERM) {
+            dirWalkFail(walk, errno);
+            break;
+        }
+
+        int subfd = openat(fd, de->d_name,
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        char *subpath = joinPath(path, de->d_name);
+        if (subfd < 0 || subpath == NULL) {
+            dirWalkFail(walk, subfd < 0 ? errno : ENOMEM);
+            if (subfd >= 0) close(subfd);
+            free(subpath);
+            break;
+        }
+        char *dirpath = strdup(subpath);
+        if (dirpath == NULL) {
+            dirWalkFail(walk, ENOMEM);
+            close(subfd);
+            free(subpath);
             break;
         }
+        unlinkRememberDir(walk, state, dirpath);
+        dirWalkQueue(walk, subfd, subpath);
         errno = 0;
     }
-    /* in case readdir or unlink_recursive failed */
-    if (fail || errno < 0) {
-        int save = errno;
-        closedir(dir);
-        errno = save;
+    if (de == NULL && errno != 0) {
+        /* readdir failed */
+        dirWalkFail(walk, errno);
+    }
+    closedir(dir);
+    free(path);
+
+    pthread_mutex_lock(&state->lock);
+    state->removed += removed;
+    pthread_mutex_unlock(&state->lock);
+}
+
+/* Deepest paths first, so every directory is empty when we get to it.
+ */
+static int
+cmpDepthDescending(const void *a, const void *b)
+{
+    const char *pa = *(const char * const *)a;
+    const char *pb = *(const char * const *)b;
+    int da = 0, db = 0;
+    for (; *pa != '\0'; pa++) if (*pa == '/') da++;
+    for (; *pb != '\0'; pb++) if (*pb == '/') db++;
+    return db - da;
+}
+
+static int
+unlinkTree(const char *path, unsigned long *pRemoved)
+{
+    struct stat st;
+    DirWalk walk;
+    UnlinkState state;
+    int ret = 0;
+    int i;
+
+    *pRemoved = 0;
+
+    /* is it a file or directory? */
+    if (lstat(path, &st) < 0) {
         return -1;
     }
 
-    /* close directory handle */
-    if (closedir(dir) < 0) {
+    /* a file, so unlink it */
+    if (!S_ISDIR(st.st_mode)) {
+        if (unlink(path) < 0) {
+            return -1;
+        }
+        *pRemoved = 1;
+        return 0;
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    char *rootPath = strdup(path);
+    if (fd < 0 || rootPath == NULL) {
+        int save = fd < 0 ? errno : ENOMEM;
+        if (fd >= 0) close(fd);
+        free(rootPath);
+        errno = save;
         return -1;
     }
 
+    memset(&state, 0, sizeof(state));
+    pthread_mutex_init(&state.lock, NULL);
+    memset(&walk, 0, sizeof(walk));
+    walk.func = unlinkWalkDir;
+    walk.cookie = &state;
+
+    ret = dirWalkRun(&walk, fd, rootPath);
+
+    /* Remove the (now empty) directories, even after a failure, so we
+     * leave as little behind as possible.
+     */
+    int save = errno;
+    qsort(state.dirs, state.numDirs, sizeof(char *), cmpDepthDescending);
+    for (i = 0; i < state.numDirs; i++) {
+        if (ret == 0) {
+            if (rmdir(state.dirs[i]) == 0) {
+                state.removed++;
+            } else {
+                save = errno;
+                ret = -1;
+            }
+        }
+        free(state.dirs[i]);
+    }
+    free(state.dirs);
+    pthread_mutex_destroy(&state.lock);
+
     /* delete target directory */
-    return rmdir(path);
+    if (ret == 0) {
+        ret = rmdir(path);
+        if (ret == 0) {
+            state.removed++;
+        }
+    } else {
+        errno = save;
+    }
+    *pRemoved = state.removed;
+    return ret;
+}
+
+typedef struct {
+    char *path;
+} UnlinkAwayArgs;
+
+/* Dropped into a tree before it's renamed away, so that a "<path>.deleting"
+ * found later is known to be one of ours and not someone's data.
+ */
+#define UNLINK_AWAY_MARKER ".dirutil-deleting"
+
+/* Is there a marker file in dir? */
+static bool
+hasAwayMarker(const char *dir)
+{
+    char marker[PATH_MAX];
+    struct stat st;
+    if (snprintf(marker, sizeof(marker), "%s/" UNLINK_AWAY_MARKER, dir) >=
+            (int)sizeof(marker)) {
+        return false;
+    }
+    return lstat(marker, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/* Put a marker file in dir; returns false if it couldn't. */
+static bool
+addAwayMarker(const char *dir)
+{
+    char marker[PATH_MAX];
+    if (snprintf(marker, sizeof(marker), "%s/" UNLINK_AWAY_MARKER, dir) >=
+            (int)sizeof(marker)) {
+        return false;
+    }
+    int fd = open(marker, O_WRONLY | O_CREAT | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+/* Background removals still running, for dirUnlinkWaitAway(). */
+static pthread_mutex_t gAwayLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gAwayDone = PTHREAD_COND_INITIALIZER;
+static int gAwayPending = 0;
+
+static void *
+unlinkAwayThread(void *arg)
+{
+    UnlinkAwayArgs *args = (UnlinkAwayArgs *)arg;
+    unsigned long removed;
+    if (unlinkTree(args->path, &removed) < 0) {
+        fprintf(stderr, "can't remove %s: %s\n", args->path, strerror(errno));
+    }
+    free(args->path);
+    free(args);
+
+    pthread_mutex_lock(&gAwayLock);
+    if (--gAwayPending == 0) {
+        pthread_cond_broadcast(&gAwayDone);
+    }
+    pthread_mutex_unlock(&gAwayLock);
+    return NULL;
+}
+
+void
+dirUnlinkWaitAway(void)
+{
+    pthread_mutex_lock(&gAwayLock);
+    while (gAwayPending > 0) {
+        pthread_cond_wait(&gAwayDone, &gAwayLock);
+    }
+    pthread_mutex_unlock(&gAwayLock);
+}
+
+static long
+elapsedMs(const struct timeval *start)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000 +
+            (now.tv_usec - start->tv_usec) / 1000;
+}
+
+int
+dirUnlinkHierarchyEx(const char *path, int flags, DirUnlinkStats *pStats)
+{
+    struct timeval start;
+    unsigned long removed = 0;
+    int ret;
+
+    gettimeofday(&start, NULL);
+
+    if (flags & DIR_UNLINK_RENAME_AWAY) {
+        /* Move the tree to a hidden sibling so "path" is free right
+         * away, then remove the sibling in the background.
+         */
+        size_t len = strlen(path);
+        char *away = (char *)malloc(len + 32);
+        UnlinkAwayArgs *args = (UnlinkAwayArgs *)malloc(sizeof(*args));
+        pthread_t thread;
+        pthread_attr_t attr;
+
+        if (away == NULL || args == NULL) {
+            free(away);
+            free(args);
+            errno = ENOMEM;
+            return -1;
+        }
+        while (len > 1 && path[len - 1] == '/') {
+            len--;
+        }
+        snprintf(away, len + 32, "%.*s.deleting", (int)len, path);
+        /* Only a directory carrying the marker is renamed, and a sibling
+         * left by a run that was cut short is cleared only if it carries
+         * one too; anything else of that name is left alone.
+         */
+        struct stat st;
+        int renamed = lstat(path, &st) == 0 && S_ISDIR(st.st_mode) &&
+                addAwayMarker(path) && rename(path, away) == 0;
+        if (!renamed && (errno == EEXIST || errno == ENOTEMPTY) &&
+                hasAwayMarker(away)) {
+            unlinkTree(away, &removed);
+            renamed = rename(path, away) == 0;
+        }
+        if (renamed) {
+            args->path = away;
+            pthread_mutex_lock(&gAwayLock);
+            gAwayPending++;
+            pthread_mutex_unlock(&gAwayLock);
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            ret = pthread_create(&thread, &attr, unlinkAwayThread, args);
+            pthread_attr_destroy(&attr);
+            if (ret != 0) {
+                pthread_mutex_lock(&gAwayLock);
+                gAwayPending--;
+                pthread_mutex_unlock(&gAwayLock);
+            }
+            if (ret == 0) {
+                if (pStats != NULL) {
+                    pStats->removed = 0;
+                    pStats->elapsedMs = elapsedMs(&start);
+                }
+                return 0;
+            }
+            /* No thread; remove it ourselves. */
+            path = away;
+            free(args);
+        } else {
+            /* Can't rename (e.g. a mount point); remove it in place. */
+            free(away);
+            free(args);
+            away = NULL;
+        }
+        ret = unlinkTree(path, &removed);
+        int save = errno;
+        free(away);
+        errno = save;
+    } else {
+        ret = unlinkTree(path, &removed);
+    }
+
+    if (pStats != NULL) {
+        pStats->removed = removed;
+        pStats->elapsedMs = elapsedMs(&start);
+    }
+    return ret;
+}
+
+int
+dirUnlinkHierarchy(const char *path)
+{
+    return dirUnlinkHierarchyEx(path, 0, NULL);
+}
+
+/* Permissions requested by dirSetHierarchyPermissions().
+ */
+typedef struct {
+    int uid, gid, dirMode, fileMode;
+} PermsRequest;
+
+/* Report a failed chown or chmod of dirPath/name (or just name, if
+ * dirPath is NULL), leaving errno as it was.
+ */
+static void
+reportPermsFailure(const char *what, const char *dirPath, const char *name)
+{
+    int save = errno;
+    fprintf(stderr, "can't %s %s%s%s: %s\n", what,
+            dirPath != NULL ? dirPath : "", dirPath != NULL ? "/" : "",
+            name, strerror(save));
+    errno = save;
+}
+
+/* Bring one node in line, relative to dirfd, which is open on dirPath.
+ * Nothing is written if the owner and mode are already right, which is
+ * the common case when a script runs set_perm_recursive over the same
+ * tree more than once.
+ */
+static int
+setNodePermsAt(const PermsRequest *req, int dirfd, const char *dirPath,
+        const char *name, const struct stat *st)
+{
+    int mode = S_ISDIR(st->st_mode) ? req->dirMode : req->fileMode;
+    bool chowned = false;
+
+    if (st->st_uid != (uid_t)req->uid || st->st_gid != (gid_t)req->gid) {
+        if (fchownat(dirfd, name, req->uid, req->gid,
+                AT_SYMLINK_NOFOLLOW)) {
+            reportPermsFailure("chown", dirPath, name);
+            return -1;
+        }
+        chowned = true;
+    }
+    /* chown() may have cleared set-id bits, so always chmod after it. */
+    if (chowned || (int)(st->st_mode & 07777) != (mode & 07777)) {
+        if (fchmodat(dirfd, name, mode, 0)) {
+            reportPermsFailure("chmod", dirPath, name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Fix every entry of the directory open on "fd", queueing its
+ * subdirectories.
+ */
+static void
+permsWalkDir(DirWalk *walk, int fd, char *path)
+{
+    const PermsRequest *req = (const PermsRequest *)walk->cookie;
+
+    DIR *dir = fdopendir(fd);
+    if (dir == NULL) {
+        dirWalkFail(walk, errno);
+        close(fd);
+        free(path);
+        return;
+    }
+
+    const struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
+            continue;
+        }
+        if (dirWalkFailed(walk)) {
+            break;
+        }
+
+        struct stat st;
+        if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+            dirWalkFail(walk, errno);
+            break;
+        }
+
+        /* ignore symlinks */
+        if (S_ISLNK(st.st_mode)) {
+            continue;
+        }
+
+        if (setNodePermsAt(req, fd, path, de->d_name, &st)) {
+            dirWalkFail(walk, errno);
+            break;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            int subfd = openat(fd, de->d_name,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            char *subpath = joinPath(path, de->d_name);
+            if (subfd < 0 || subpath == NULL) {
+                dirWalkFail(walk, subfd < 0 ? errno : ENOMEM);
+                if (subfd >= 0) close(subfd);
+                free(subpath);
+                break;
+            }
+            dirWalkQueue(walk, subfd, subpath);
+        }
+    }
+    closedir(dir);
+    free(path);
 }
 
 int
 dirSetHierarchyPermissions(const char *path,
         int uid, int gid, int dirMode, int fileMode)
 {
+    PermsRequest req;
+    DirWalk walk;
     struct stat st;
+
     if (lstat(path, &st)) {
         return -1;
     }
@@ -235,46 +924,145 @@ dirSetHierarchyPermissions(const char *path,
         return 0;
     }
 
+    req.uid = uid;
+    req.gid = gid;
+    req.dirMode = dirMode;
+    req.fileMode = fileMode;
+
     /* directories and files get different permissions */
-    if (chown(path, uid, gid) ||
-        chmod(path, S_ISDIR(st.st_mode) ? dirMode : fileMode)) {
+    if (setNodePermsAt(&req, AT_FDCWD, NULL, path, &st)) {
         return -1;
     }
+    if (!S_ISDIR(st.st_mode)) {
+        return 0;
+    }
 
-    /* recurse over directory components */
-    if (S_ISDIR(st.st_mode)) {
-        DIR *dir = opendir(path);
-        if (dir == NULL) {
-            return -1;
-        }
+    /* Every lookup below is relative to its parent's descriptor; the
+     * paths are only carried along for error messages.
+     */
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    char *rootPath = strdup(path);
+    if (fd < 0 || rootPath == NULL) {
+        int save = fd < 0 ? errno : ENOMEM;
+        if (fd >= 0) close(fd);
+        free(rootPath);
+        errno = save;
+        return -1;
+    }
+    memset(&walk, 0, sizeof(walk));
+    walk.func = permsWalkDir;
+    walk.cookie = &req;
+    return dirWalkRun(&walk, fd, rootPath);
+}
 
-        errno = 0;
-        const struct dirent *de;
-        while (errno == 0 && (de = readdir(dir)) != NULL) {
-            if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
-                continue;
-            }
+/* Parent directories kept open by dirSetPermissionsBatch().
+ */
+#define PERMS_DIR_CACHE 4
 
-            char dn[PATH_MAX];
-            snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-            if (!dirSetHierarchyPermissions(dn, uid, gid, dirMode, fileMode)) {
-                errno = 0;
-            } else if (errno == 0) {
-                errno = -1;
-            }
+typedef struct {
+    char *path;         /* malloc'd; NULL if the slot is unused */
+    int fd;
+} PermsDirSlot;
+
+/* Return a descriptor for the directory dir[0..len), opening it into
+ * the least recently used slot if it isn't cached.  Returns -1 on
+ * failure.
+ */
+static int
+permsDirFd(PermsDirSlot *cache, const char *dir, size_t len)
+{
+    int i;
+    if (len == 0) {
+        return AT_FDCWD;
+    }
+    for (i = 0; i < PERMS_DIR_CACHE; i++) {
+        if (cache[i].path != NULL && strlen(cache[i].path) == len &&
+                memcmp(cache[i].path, dir, len) == 0) {
+            /* Move it to the front. */
+            PermsDirSlot hit = cache[i];
+            memmove(cache + 1, cache, i * sizeof(PermsDirSlot));
+            cache[0] = hit;
+            return hit.fd;
         }
+    }
 
-        if (errno != 0) {
-            int save = errno;
-            closedir(dir);
-            errno = save;
-            return -1;
+    char *path = malloc(len + 1);
+    if (path == NULL) {
+        return -1;
+    }
+    memcpy(path, dir, len);
+    path[len] = '\0';
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        free(path);
+        return -1;
+    }
+
+    PermsDirSlot *last = &cache[PERMS_DIR_CACHE - 1];
+    if (last->path != NULL) {
+        free(last->path);
+        close(last->fd);
+    }
+    memmove(cache + 1, cache, (PERMS_DIR_CACHE - 1) * sizeof(PermsDirSlot));
+    cache[0].path = path;
+    cache[0].fd = fd;
+    return fd;
+}
+
+int
+dirSetPermissionsBatch(const DirPermsEntry *entries, int count)
+{
+    PermsDirSlot cache[PERMS_DIR_CACHE];
+    int failed = 0;
+    int saved_errno = 0;
+    int i;
+
+    memset(cache, 0, sizeof(cache));
+    for (i = 0; i < count; i++) {
+        const DirPermsEntry *e = &entries[i];
+
+        /* Split into parent and last component; "/x" has parent "/". */
+        const char *slash = strrchr(e->path, '/');
+        const char *name = e->path;
+        size_t dirLen = 0;
+        if (slash != NULL && slash[1] != '\0') {
+            name = slash + 1;
+            dirLen = (slash == e->path) ? 1 : (size_t)(slash - e->path);
         }
 
-        if (closedir(dir)) {
-            return -1;
+        int dirfd = permsDirFd(cache, e->path, dirLen);
+        struct stat st;
+        if (dirfd == -1 || fstatat(dirfd, name, &st, 0)) {
+            goto fail;
         }
+        bool chowned = false;
+        if (st.st_uid != (uid_t)e->uid || st.st_gid != (gid_t)e->gid) {
+            if (fchownat(dirfd, name, e->uid, e->gid, 0)) {
+                goto fail;
+            }
+            chowned = true;
+        }
+        /* chown() may have cleared set-id bits, so always chmod after it. */
+        if (chowned || (int)(st.st_mode & 07777) != (e->mode & 07777)) {
+            if (fchmodat(dirfd, name, e->mode, 0)) {
+                goto fail;
+            }
+        }
+        continue;
+
+fail:
+        saved_errno = errno;
+        failed++;
     }
 
-    return 0;
+    for (i = 0; i < PERMS_DIR_CACHE; i++) {
+        if (cache[i].path != NULL) {
+            free(cache[i].path);
+            close(cache[i].fd);
+        }
+    }
+    if (failed) {
+        errno = saved_errno;
+    }
+    return failed;
 }
@@ -36,16 +36,80 @@
 int dirCreateHierarchy(const char *path, int mode,
         const struct utimbuf *timestamp, bool stripFileName);
 
+/* A record of directories already known to exist, so that creating many
+ * files in the same few directories doesn't stat() and mkdir() every
+ * path component over and over.  Meant to live for a single extraction;
+ * it isn't thread-safe, and it doesn't notice directories removed by
+ * someone else while it's in use.
+ */
+typedef struct DirCache DirCache;
+
+DirCache *dirCacheCreate(void);
+void dirCacheFree(DirCache *cache);
+
+/* Like dirCreateHierarchy(), but consults and updates "cache".
+ * A NULL cache behaves exactly like dirCreateHierarchy().
+ */
+int dirCreateHierarchyCached(DirCache *cache, const char *path, int mode,
+        const struct utimbuf *timestamp, bool stripFileName);
+
 /* rm -rf <path>
  */
 int dirUnlinkHierarchy(const char *path);
 
+/* Like dirUnlinkHierarchy(), with options and a report.
+ *
+ * Directories are read in parallel and entries are removed relative to
+ * their parent's descriptor.  flags is zero or more of:
+ *
+ *     DIR_UNLINK_RENAME_AWAY - rename <path> to "<path>.deleting" and
+ *         remove that in a background thread, returning as soon as
+ *         <path> is gone.  Call dirUnlinkWaitAway() before exiting, or
+ *         before unmounting the filesystem, and before writing much
+ *         to it: the old tree's blocks stay allocated until the thread
+ *         is done.  A "<path>.deleting" left by a process that didn't
+ *         get that far is removed first, but only if it carries the
+ *         marker file this puts in every tree it renames.
+ *
+ * If pStats is non-NULL it's filled in with the number of entries
+ * removed (zero for a background removal) and the time taken.
+ */
+enum { DIR_UNLINK_RENAME_AWAY = 1 };
+typedef struct {
+    unsigned long removed;
+    long elapsedMs;
+} DirUnlinkStats;
+int dirUnlinkHierarchyEx(const char *path, int flags, DirUnlinkStats *pStats);
+
+/* Wait for every removal started with DIR_UNLINK_RENAME_AWAY to finish.
+ */
+void dirUnlinkWaitAway(void);
+
 /* chown -R <uid>:<gid> <path>
  * chmod -R <mode> <path>
  *
  * Sets directories to <dirMode> and files to <fileMode>.  Skips symlinks.
+ * Nodes that already have the requested owner and mode aren't touched.
+ * Subdirectories are walked in parallel, relative to their parent's
+ * descriptor.
  */
 int dirSetHierarchyPermissions(const char *path,
          int uid, int gid, int dirMode, int fileMode);
 
+/* chown <uid>:<gid> <path>; chmod <mode> <path> for a whole table of
+ * paths at once.  Each path is looked up relative to a descriptor for
+ * its parent directory; the last few parents are kept open, so a table
+ * sorted by path opens each directory about once.  Like chown(1) and
+ * chmod(1) without -h, symlinks are followed.  Nodes that already have
+ * the requested owner and mode aren't touched.
+ *
+ * Returns the number of entries that couldn't be set (the rest are
+ * still applied); errno is left from the last failure.
+ */
+typedef struct {
+    const char *path;
+    int uid, gid, mode;
+} DirPermsEntry;
+int dirSetPermissionsBatch(const DirPermsEntry *entries, int count);
+
 #endif  // MINZIP_DIRUTIL_H_
@@ -6,6 +6,7 @@
  * about tombstone removal.
  */
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #define LOG_TAG "minzip"
@@ -61,8 +62,9 @@ HashTable* mzHashTableCreate(size_t initialSize, HashFreeFunc freeFunc)
     pHashTable->tableSize = roundUpPower2(initialSize);
     pHashTable->numEntries = pHashTable->numDeadEntries = 0;
     pHashTable->freeFunc = freeFunc;
+    pHashTable->ownEntries = true;
     pHashTable->pEntries =
-        (HashEntry*) calloc((size_t)pHashTable->tableSize, sizeof(HashTable));
+        (HashEntry*) calloc((size_t)pHashTable->tableSize, sizeof(HashEntry));
     if (pHashTable->pEntries == NULL) {
         free(pHashTable);
         return NULL;
@@ -71,6 +73,36 @@ HashTable* mzHashTableCreate(size_t initialSize, HashFreeFunc freeFunc)
     return pHashTable;
 }
 
+/*
+ * Size of the block mzHashTableInit() needs: the table followed by its
+ * slots.
+ */
+size_t mzHashTableStorageSize(size_t initialSize)
+{
+    return sizeof(HashTable) + roundUpPower2(initialSize) * sizeof(HashEntry);
+}
+
+/*
+ * Create a hash table in caller-provided memory.
+ */
+HashTable* mzHashTableInit(void* storage, size_t initialSize,
+    HashFreeFunc freeFunc)
+{
+    HashTable* pHashTable = (HashTable*) storage;
+
+    assert(initialSize > 0);
+
+    pHashTable->tableSize = roundUpPower2(initialSize);
+    pHashTable->numEntries = pHashTable->numDeadEntries = 0;
+    pHashTable->freeFunc = freeFunc;
+    pHashTable->ownEntries = false;
+    pHashTable->pEntries = (HashEntry*) (pHashTable + 1);
+    memset(pHashTable->pEntries, 0,
+        (size_t)pHashTable->tableSize * sizeof(HashEntry));
+
+    return pHashTable;
+}
+
 /*
  * Clear out all entries.
  */
@@ -103,11 +135,25 @@ void mzHashTableFree(HashTable* pHashTable)
 {
     if (pHashTable == NULL)
         return;
-    mzHashTableClear(pHashTable);
-    free(pHashTable->pEntries);
+    mzHashTableRelease(pHashTable);
     free(pHashTable);
 }
 
+/*
+ * Clear out a table and free its slots if they're on the heap, leaving
+ * the HashTable itself alone.
+ */
+void mzHashTableRelease(HashTable* pHashTable)
+{
+    if (pHashTable == NULL)
+        return;
+    mzHashTableClear(pHashTable);
+    if (pHashTable->ownEntries)
+        free(pHashTable->pEntries);
+    pHashTable->pEntries = NULL;
+    pHashTable->tableSize = 0;
+}
+
 #ifndef NDEBUG
 /*
  * Count up the number of tombstone entries in the hash table.
@@ -142,7 +188,7 @@ static bool resizeHash(HashTable* pHashTable, int newSize)
     assert(countTombStones(pHashTable) == pHashTable->numDeadEntries);
     //LOGI("before: dead=%d\n", pHashTable->numDeadEntries);
 
-    pNewEntries = (HashEntry*) calloc(newSize, sizeof(HashTable));
+    pNewEntries = (HashEntry*) calloc(newSize, sizeof(HashEntry));
     if (pNewEntries == NULL)
         return false;
 
@@ -162,8 +208,10 @@ static bool resizeHash(HashTable* pHashTable, int newSize)
         }
     }
 
-    free(pHashTable->pEntries);
+    if (pHashTable->ownEntries)
+        free(pHashTable->pEntries);
     pHashTable->pEntries = pNewEntries;
+    pHashTable->ownEntries = true;
     pHashTable->tableSize = newSize;
     pHashTable->numDeadEntries = 0;
 
@@ -312,8 +360,8 @@ int mzHashForeach(HashTable* pHashTable, HashForeachFunc func, void* arg)
  *
  * Returns -1 if the entry wasn't found.
  */
-int countProbes(HashTable* pHashTable, unsigned int itemHash, const void* item,
-    HashCompareFunc cmpFunc)
+static int countProbes(HashTable* pHashTable, unsigned int itemHash,
+    const void* item, HashCompareFunc cmpFunc)
 {
     HashEntry* pEntry;
     HashEntry* pEnd;
@@ -358,33 +406,44 @@ int countProbes(HashTable* pHashTable, unsigned int itemHash, const void* item,
  *
  * The caller should lock the table before calling here.
  */
-void mzHashTableProbeCount(HashTable* pHashTable, HashCalcFunc calcFunc,
-    HashCompareFunc cmpFunc)
+void mzHashTableProbeStats(HashTable* pHashTable, HashCalcFunc calcFunc,
+    HashCompareFunc cmpFunc, HashProbeStats* pStats)
 {
-    int numEntries, minProbe, maxProbe, totalProbe;
     HashIter iter;
 
-    numEntries = maxProbe = totalProbe = 0;
-    minProbe = 65536*32767;
+    memset(pStats, 0, sizeof(*pStats));
+    pStats->tableSize = pHashTable->tableSize;
 
     for (mzHashIterBegin(pHashTable, &iter); !mzHashIterDone(&iter);
         mzHashIterNext(&iter))
     {
         const void* data = (const void*)mzHashIterData(&iter);
         int count;
-            
-        count = countProbes(pHashTable, (*calcFunc)(data), data, cmpFunc);
 
-        numEntries++;
+        count = countProbes(pHashTable, (*calcFunc)(data), data, cmpFunc);
 
-        if (count < minProbe)
-            minProbe = count;
-        if (count > maxProbe)
-            maxProbe = count;
-        totalProbe += count;
+        if (pStats->numEntries == 0 || count < pStats->minProbe)
+            pStats->minProbe = count;
+        if (count > pStats->maxProbe)
+            pStats->maxProbe = count;
+        pStats->totalProbe += count;
+        pStats->numEntries++;
     }
+}
+
+/*
+ * Log the probe statistics for the specified hash table.
+ */
+void mzHashTableProbeCount(HashTable* pHashTable, HashCalcFunc calcFunc,
+    HashCompareFunc cmpFunc)
+{
+    HashProbeStats stats;
+
+    mzHashTableProbeStats(pHashTable, calcFunc, cmpFunc, &stats);
 
     LOGI("Probe: min=%d max=%d, total=%d in %d (%d), avg=%.3f\n",
-        minProbe, maxProbe, totalProbe, numEntries, pHashTable->tableSize,
-        (float) totalProbe / (float) numEntries);
+        stats.minProbe, stats.maxProbe, stats.totalProbe, stats.numEntries,
+        stats.tableSize,
+        stats.numEntries ?
+            (float) stats.totalProbe / (float) stats.numEntries : 0.0f);
 }
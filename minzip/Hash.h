@@ -62,8 +62,9 @@ typedef struct HashTable {
     int         tableSize;          /* must be power of 2 */
     int         numEntries;         /* current #of "live" entries */
     int         numDeadEntries;     /* current #of tombstone entries */
-    HashEntry*  pEntries;           /* array on heap */
+    HashEntry*  pEntries;           /* array on heap, or see mzHashTableInit */
     HashFreeFunc freeFunc;
+    bool        ownEntries;         /* pEntries is ours to free */
 } HashTable;
 
 /*
@@ -76,6 +77,20 @@ typedef struct HashTable {
  */
 HashTable* mzHashTableCreate(size_t initialSize, HashFreeFunc freeFunc);
 
+/*
+ * Create a hash table in memory the caller provides, which must be at
+ * least mzHashTableStorageSize(initialSize) bytes and pointer-aligned.
+ * Nothing is allocated as long as the table doesn't outgrow its initial
+ * size (pass the result of mzHashSize() to make sure of that), so a
+ * caller can put the table in the same block as the things it indexes.
+ *
+ * Tear it down with mzHashTableRelease(), then free "storage".
+ */
+size_t mzHashTableStorageSize(size_t initialSize);
+HashTable* mzHashTableInit(void* storage, size_t initialSize,
+    HashFreeFunc freeFunc);
+void mzHashTableRelease(HashTable* pHashTable);
+
 /*
  * Compute the capacity needed for a table to hold "size" elements.  Use
  * this when you know ahead of time how many elements the table will hold.
@@ -175,11 +190,24 @@ INLINE void* mzHashIterData(HashIter* pIter) {
 
 /*
  * Evaluate hash table performance by examining the number of times we
- * have to probe for an entry.
+ * have to probe for an entry.  A probe count of zero means the entry
+ * was found in its home slot.
+ *
+ * mzHashTableProbeStats() fills in "pStats"; mzHashTableProbeCount()
+ * just logs the same numbers.
  *
  * The caller should lock the table beforehand.
  */
 typedef unsigned int (*HashCalcFunc)(const void* item);
+typedef struct HashProbeStats {
+    int         numEntries;         /* live entries examined */
+    int         tableSize;
+    int         minProbe;
+    int         maxProbe;
+    int         totalProbe;         /* divide by numEntries for the mean */
+} HashProbeStats;
+void mzHashTableProbeStats(HashTable* pHashTable, HashCalcFunc calcFunc,
+    HashCompareFunc cmpFunc, HashProbeStats* pStats);
 void mzHashTableProbeCount(HashTable* pHashTable, HashCalcFunc calcFunc,
     HashCompareFunc cmpFunc);
 
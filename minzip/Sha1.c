@@ -0,0 +1,166 @@
+/*
+ * Copyright 2006 The Android Open Source Project
+ *
+ * SHA-1 (FIPS 180-2), block at a time.
+ */
+#include <string.h>
+
+#include "Sha1.h"
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define F0(b, c, d) ((d) ^ ((b) & ((c) ^ (d))))
+#define F1(b, c, d) ((b) ^ (c) ^ (d))
+#define F2(b, c, d) (((b) & (c)) | ((d) & ((b) | (c))))
+#define F3(b, c, d) ((b) ^ (c) ^ (d))
+
+#define K0 0x5a827999
+#define K1 0x6ed9eba1
+#define K2 0x8f1bbcdc
+#define K3 0xca62c1d6
+
+/* The message schedule is kept in a 16-word ring. */
+#define W(i) (w[(i) & 15] = ROL(w[((i) + 13) & 15] ^ w[((i) + 8) & 15] ^ \
+                                w[((i) + 2) & 15] ^ w[(i) & 15], 1))
+
+/* One round; the caller rotates the variable names rather than the
+ * values, so nothing is shuffled between rounds.
+ */
+#define R(a, b, c, d, e, f, k, x) do { \
+        e += ROL(a, 5) + f(b, c, d) + k + (x); \
+        b = ROL(b, 30); \
+    } while (0)
+
+#define R5(i, f, k, x) do { \
+        R(a, b, c, d, e, f, k, x(i));     \
+        R(e, a, b, c, d, f, k, x(i + 1)); \
+        R(d, e, a, b, c, f, k, x(i + 2)); \
+        R(c, d, e, a, b, f, k, x(i + 3)); \
+        R(b, c, d, e, a, f, k, x(i + 4)); \
+    } while (0)
+
+#define WLOAD(i) (w[i])
+
+static void sha1Block(uint32_t state[5], const uint8_t* p)
+{
+    uint32_t w[16];
+    uint32_t a, b, c, d, e;
+    int i;
+
+    for (i = 0; i < 16; i++, p += 4) {
+        w[i] = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+               ((uint32_t) p[2] << 8) | p[3];
+    }
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+
+    /* Rounds come in groups of five so the names line up again. */
+    R5(0, F0, K0, WLOAD);
+    R5(5, F0, K0, WLOAD);
+    R5(10, F0, K0, WLOAD);
+    R(a, b, c, d, e, F0, K0, w[15]);
+    R(e, a, b, c, d, F0, K0, W(16));
+    R(d, e, a, b, c, F0, K0, W(17));
+    R(c, d, e, a, b, F0, K0, W(18));
+    R(b, c, d, e, a, F0, K0, W(19));
+
+    R5(20, F1, K1, W);
+    R5(25, F1, K1, W);
+    R5(30, F1, K1, W);
+    R5(35, F1, K1, W);
+
+    R5(40, F2, K2, W);
+    R5(45, F2, K2, W);
+    R5(50, F2, K2, W);
+    R5(55, F2, K2, W);
+
+    R5(60, F3, K3, W);
+    R5(65, F3, K3, W);
+    R5(70, F3, K3, W);
+    R5(75, F3, K3, W);
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+void mzSha1Init(MzSha1Ctx* ctx)
+{
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xc3d2e1f0;
+    ctx->count = 0;
+}
+
+void mzSha1Update(MzSha1Ctx* ctx, const void* data, size_t len)
+{
+    const uint8_t* p = (const uint8_t*) data;
+    size_t used = (size_t) (ctx->count & 63);
+
+    ctx->count += len;
+
+    /* Top up a partial block first. */
+    if (used > 0) {
+        size_t fill = 64 - used;
+        if (len < fill) {
+            memcpy(ctx->buf + used, p, len);
+            return;
+        }
+        memcpy(ctx->buf + used, p, fill);
+        sha1Block(ctx->state, ctx->buf);
+        p += fill;
+        len -= fill;
+    }
+
+    /* Whole blocks straight from the input. */
+    while (len >= 64) {
+        sha1Block(ctx->state, p);
+        p += 64;
+        len -= 64;
+    }
+
+    if (len > 0) {
+        memcpy(ctx->buf, p, len);
+    }
+}
+
+const uint8_t* mzSha1Final(MzSha1Ctx* ctx)
+{
+    uint64_t bits = ctx->count * 8;
+    uint8_t pad[72];
+    size_t used = (size_t) (ctx->count & 63);
+    size_t padLen = (used < 56 ? 56 : 120) - used;
+    int i;
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++) {
+        pad[padLen + i] = (uint8_t) (bits >> (56 - 8 * i));
+    }
+    mzSha1Update(ctx, pad, padLen + 8);
+
+    for (i = 0; i < 5; i++) {
+        ctx->digest[4*i] = (uint8_t) (ctx->state[i] >> 24);
+        ctx->digest[4*i + 1] = (uint8_t) (ctx->state[i] >> 16);
+        ctx->digest[4*i + 2] = (uint8_t) (ctx->state[i] >> 8);
+        ctx->digest[4*i + 3] = (uint8_t) ctx->state[i];
+    }
+    return ctx->digest;
+}
+
+const uint8_t* mzSha1(const void* data, size_t len, uint8_t* digest)
+{
+    MzSha1Ctx ctx;
+    mzSha1Init(&ctx);
+    mzSha1Update(&ctx, data, len);
+    memcpy(digest, mzSha1Final(&ctx), MZ_SHA1_DIGEST_SIZE);
+    return digest;
+}
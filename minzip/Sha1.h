@@ -0,0 +1,44 @@
+/*
+ * Copyright 2006 The Android Open Source Project
+ *
+ * SHA-1, for hashing package and partition contents.
+ */
+#ifndef _MINZIP_SHA1
+#define _MINZIP_SHA1
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define MZ_SHA1_DIGEST_SIZE 20
+
+/*
+ * Same usage as mincrypt's SHA_init()/SHA_update()/SHA_final(), and
+ * produces the same digests.  Whole 64-byte blocks are compressed
+ * straight from the caller's buffer, with the rounds unrolled, instead
+ * of being copied through the context a byte at a time; on the ARMv7
+ * cores we ship that's several times faster.
+ *
+ * A context may be copied with memcpy() to take an intermediate digest.
+ */
+typedef struct {
+    uint32_t state[5];
+    uint64_t count;             /* bytes hashed so far */
+    uint8_t buf[64];            /* partial block */
+    uint8_t digest[MZ_SHA1_DIGEST_SIZE];
+} MzSha1Ctx;
+
+void mzSha1Init(MzSha1Ctx* ctx);
+void mzSha1Update(MzSha1Ctx* ctx, const void* data, size_t len);
+
+/*
+ * Finish the hash and return a pointer to the digest, which lives in the
+ * context.
+ */
+const uint8_t* mzSha1Final(MzSha1Ctx* ctx);
+
+/*
+ * One-shot digest of "len" bytes into "digest".  Returns digest.
+ */
+const uint8_t* mzSha1(const void* data, size_t len, uint8_t* digest);
+
+#endif /*_MINZIP_SHA1*/
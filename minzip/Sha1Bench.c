@@ -0,0 +1,76 @@
+/*
+ * Copyright 2006 The Android Open Source Project
+ *
+ * Compare mincrypt's SHA-1 against minzip's on the device:
+ *
+ *     sha1_bench [megabytes]
+ *
+ * Both hash the same buffer in 32K updates, the size minzip hands to
+ * its process functions; the digests must agree.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "mincrypt/sha.h"
+#include "Sha1.h"
+
+#define CHUNK (32 * 1024)
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char** argv)
+{
+    int megs = argc > 1 ? atoi(argv[1]) : 64;
+    size_t len = (size_t) megs << 20;
+    size_t off;
+    unsigned char* data;
+    uint8_t expected[SHA_DIGEST_SIZE];
+    double start, slow, fast;
+
+    if (megs <= 0) {
+        fprintf(stderr, "usage: %s [megabytes]\n", argv[0]);
+        return 1;
+    }
+    data = malloc(len);
+    if (data == NULL) {
+        fprintf(stderr, "can't allocate %d MB\n", megs);
+        return 1;
+    }
+    for (off = 0; off < len; off++) {
+        data[off] = (unsigned char) (off * 2654435761u >> 24);
+    }
+
+    SHA_CTX ctx;
+    start = now();
+    SHA_init(&ctx);
+    for (off = 0; off < len; off += CHUNK) {
+        SHA_update(&ctx, data + off, CHUNK);
+    }
+    memcpy(expected, SHA_final(&ctx), SHA_DIGEST_SIZE);
+    slow = now() - start;
+
+    MzSha1Ctx mzctx;
+    start = now();
+    mzSha1Init(&mzctx);
+    for (off = 0; off < len; off += CHUNK) {
+        mzSha1Update(&mzctx, data + off, CHUNK);
+    }
+    const uint8_t* digest = mzSha1Final(&mzctx);
+    fast = now() - start;
+
+    printf("mincrypt: %.1f MB/s\n", megs / slow);
+    printf("minzip:   %.1f MB/s (%.2fx)\n", megs / fast, slow / fast);
+    if (memcmp(expected, digest, SHA_DIGEST_SIZE) != 0) {
+        printf("DIGESTS DIFFER\n");
+        return 1;
+    }
+    free(data);
+    return 0;
+}
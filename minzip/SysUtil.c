@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
@@ -140,8 +141,9 @@ int sysMapFileInShmem(int fd, MemMapping* pMap)
 }
 
 /*
- * Map part of a file (from fd's current offset) into a shared, read-only
- * memory segment.
+ * Map part of a file into a shared, read-only memory segment.  "start"
+ * is an absolute offset; fd's current offset is neither used nor
+ * changed, so this may be called from several threads on the same fd.
  *
  * On success, returns 0 and fills out "pMap".  On failure, returns a nonzero
  * value and does not disturb "pMap".
@@ -149,7 +151,7 @@ int sysMapFileInShmem(int fd, MemMapping* pMap)
 int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     MemMapping* pMap)
 {
-    off_t dummy;
+    struct stat st;
     size_t fileLength, actualLength;
     off_t actualStart;
     int adjust;
@@ -157,8 +159,11 @@ int sysMapFileSegmentInShmem(int fd, off_t start, long length,
 
     assert(pMap != NULL);
 
-    if (getFileStartAndLength(fd, &dummy, &fileLength) < 0)
+    if (fstat(fd, &st) < 0) {
+        LOGE("could not determine length of file\n");
         return -1;
+    }
+    fileLength = st.st_size;
 
     if (start + length > (long)fileLength) {
         LOGW("bad segment: st=%d len=%ld flen=%d\n",
@@ -46,7 +46,8 @@ int sysLoadFileInShmem(int fd, MemMapping* pMap);
 int sysMapFileInShmem(int fd, MemMapping* pMap);
 
 /*
- * Like sysMapFileInShmem, but on only part of a file.
+ * Like sysMapFileInShmem, but on only part of a file, starting at the
+ * absolute offset "start".  Doesn't touch fd's file offset.
  */
 int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     MemMapping* pMap);
@@ -0,0 +1,246 @@
+/*
+ * Copyright 2010 The Android Open Source Project
+ *
+ * Throughput counters for long-running phases of work.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "Throughput.h"
+#include "Trace.h"
+
+#define MAX_PHASES 8
+#define MAX_DEPTH 8
+#define PHASE_NAME_LEN 16
+
+/* How often a running phase is reported to the observer. */
+#define REPORT_INTERVAL_MS 500
+
+typedef struct {
+    char name[PHASE_NAME_LEN];
+    int active;                 /* begun and not yet ended; 0 if free */
+    unsigned int serial;        /* when it was (last) begun */
+    long long done;
+    long long total;
+    long long startMs;
+    long long lastReportMs;
+} Phase;
+
+/* The phases a thread has begun, innermost last. */
+typedef struct {
+    int depth;
+    int slots[MAX_DEPTH];
+} PhaseStack;
+
+static pthread_mutex_t gLock = PTHREAD_MUTEX_INITIALIZER;
+static Phase gPhases[MAX_PHASES];
+static int gLatest = -1;        /* most recently begun active phase */
+static unsigned int gSerial = 0;
+static volatile int gActive = 0;
+
+static PhaseObserver gObserver = NULL;
+static void* gObserverCookie = NULL;
+
+static pthread_once_t gKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t gKey;
+
+static void makeKey(void)
+{
+    pthread_key_create(&gKey, free);
+}
+
+static PhaseStack* getStack(int create)
+{
+    pthread_once(&gKeyOnce, makeKey);
+    PhaseStack* stack = (PhaseStack*) pthread_getspecific(gKey);
+    if (stack == NULL && create) {
+        stack = (PhaseStack*) calloc(1, sizeof(PhaseStack));
+        if (stack != NULL) pthread_setspecific(gKey, stack);
+    }
+    return stack;
+}
+
+static long long nowMs(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+/*
+ * Copy what the observer needs out of "phase"; the name goes in "name",
+ * since the slot may be reused once the lock is dropped.
+ */
+static void snapshot(const Phase* phase, long long now, int ended,
+        PhaseStatus* status, char* name)
+{
+    strcpy(name, phase->name);
+    status->name = name;
+    status->done = phase->done;
+    status->total = phase->total;
+    status->elapsedMs = now - phase->startMs;
+    status->ended = ended;
+}
+
+static void report(const PhaseStatus* status)
+{
+    mzTraceCounter(status->name, status->done);
+    PhaseObserver observer = gObserver;
+    if (observer != NULL) observer(status, gObserverCookie);
+}
+
+void mzSetPhaseObserver(PhaseObserver observer, void* cookie)
+{
+    pthread_mutex_lock(&gLock);
+    gObserverCookie = cookie;
+    gObserver = observer;
+    pthread_mutex_unlock(&gLock);
+}
+
+void mzPhaseBegin(const char* name, long long totalBytes)
+{
+    PhaseStack* stack = getStack(1);
+    PhaseStatus status;
+    char nameCopy[PHASE_NAME_LEN];
+    int slot, join = -1, free_slot = -1;
+    long long now = nowMs();
+
+    pthread_mutex_lock(&gLock);
+    for (slot = 0; slot < MAX_PHASES; slot++) {
+        if (gPhases[slot].active == 0) {
+            if (free_slot < 0) free_slot = slot;
+        } else if (strncmp(gPhases[slot].name, name, PHASE_NAME_LEN - 1) == 0) {
+            join = slot;
+        }
+    }
+    slot = (join >= 0) ? join : free_slot;
+    if (slot >= 0) {
+        Phase* phase = &gPhases[slot];
+        if (join < 0) {
+            memset(phase, 0, sizeof(*phase));
+            strncpy(phase->name, name, PHASE_NAME_LEN - 1);
+            phase->startMs = now;
+        }
+        phase->active++;
+        phase->total += totalBytes;
+        phase->serial = ++gSerial;
+        phase->lastReportMs = now;
+        gLatest = slot;
+        gActive++;
+        snapshot(phase, now, 0, &status, nameCopy);
+    }
+    pthread_mutex_unlock(&gLock);
+
+    /* Too many at once just goes uncounted, but End() must still match. */
+    if (stack != NULL) {
+        if (stack->depth < MAX_DEPTH) stack->slots[stack->depth] = slot;
+        stack->depth++;
+    }
+    /* Traced only if mzPhaseEnd() will see it. */
+    if (slot >= 0 && stack != NULL && stack->depth <= MAX_DEPTH) {
+        mzTraceBegin(name);
+    }
+    if (slot >= 0) report(&status);
+}
+
+void mzPhaseAdd(long long bytes)
+{
+    if (gActive == 0) return;
+    PhaseStack* stack = getStack(0);
+    PhaseStatus status;
+    char nameCopy[PHASE_NAME_LEN];
+    int due = 0;
+
+    pthread_mutex_lock(&gLock);
+    int slot = gLatest;
+    if (stack != NULL && stack->depth > 0 && stack->depth <= MAX_DEPTH) {
+        slot = stack->slots[stack->depth - 1];
+    }
+    if (slot >= 0 && gPhases[slot].active > 0) {
+        Phase* phase = &gPhases[slot];
+        phase->done += bytes;
+        long long now = nowMs();
+        if (now - phase->lastReportMs >= REPORT_INTERVAL_MS) {
+            phase->lastReportMs = now;
+            snapshot(phase, now, 0, &status, nameCopy);
+            due = 1;
+        }
+    }
+    pthread_mutex_unlock(&gLock);
+
+    if (due) report(&status);
+}
+
+void mzPhaseEnd(void)
+{
+    PhaseStack* stack = getStack(0);
+    PhaseStatus status;
+    char nameCopy[PHASE_NAME_LEN];
+    int ended = 0;
+
+    if (stack == NULL || stack->depth == 0) return;
+    stack->depth--;
+    if (stack->depth >= MAX_DEPTH) return;
+    int slot = stack->slots[stack->depth];
+    if (slot < 0) return;
+
+    pthread_mutex_lock(&gLock);
+    Phase* phase = &gPhases[slot];
+    char traceName[PHASE_NAME_LEN];
+    strcpy(traceName, phase->name);
+    gActive--;
+    if (--phase->active == 0) {
+        snapshot(phase, nowMs(), 1, &status, nameCopy);
+        ended = 1;
+
+        /* Untracked bytes go to whatever was begun most recently. */
+        if (gLatest == slot) {
+            unsigned int best = 0;
+            int i;
+            gLatest = -1;
+            for (i = 0; i < MAX_PHASES; i++) {
+                if (gPhases[i].active > 0 && gPhases[i].serial >= best) {
+                    best = gPhases[i].serial;
+                    gLatest = i;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&gLock);
+    mzTraceEnd(traceName);
+
+    if (ended) {
+        double seconds = status.elapsedMs / 1000.0;
+        fprintf(stderr, "phase %s: %.1f MB in %.1f s (%.2f MB/s)\n",
+                status.name, status.done / 1048576.0, seconds,
+                seconds > 0 ? status.done / 1048576.0 / seconds : 0.0);
+        report(&status);
+    }
+}
+
+void mzFormatPhaseStatus(const PhaseStatus* status, char* buf, size_t len)
+{
+    double seconds = status->elapsedMs / 1000.0;
+    double rate = seconds > 0 ? status->done / 1048576.0 / seconds : 0.0;
+
+    if (status->total <= 0 || status->done > status->total) {
+        snprintf(buf, len, "%-7.7s %5.1fMB/s %lldMB", status->name, rate,
+                status->done / 1048576);
+        return;
+    }
+
+    int percent = (int) (status->done * 100 / status->total);
+    if (status->done == 0 || status->ended) {
+        snprintf(buf, len, "%-7.7s %5.1fMB/s %3d%%", status->name, rate,
+                percent);
+        return;
+    }
+    long long leftMs = (status->total - status->done) *
+            status->elapsedMs / status->done;
+    int left = (int) (leftMs / 1000);
+    snprintf(buf, len, "%-7.7s %5.1fMB/s %3d%% %2d:%02d", status->name, rate,
+            percent, left / 60, left % 60);
+}
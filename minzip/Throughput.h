@@ -0,0 +1,53 @@
+/*
+ * Copyright 2010 The Android Open Source Project
+ *
+ * Throughput counters for long-running phases of work.
+ */
+#ifndef _MINZIP_THROUGHPUT
+#define _MINZIP_THROUGHPUT
+
+#include <stddef.h>
+
+/*
+ * A phase is a named stretch of work ("verify", "extract", "flash", ...)
+ * with an expected number of bytes.  The code that starts one knows how
+ * big it is; the code that moves the bytes (zip extraction, image and
+ * patch writers) calls mzPhaseAdd() without needing to know which phase,
+ * if any, it is part of.
+ *
+ * Bytes counted on a thread go to the phase that thread began most
+ * recently, or, on a thread that hasn't begun one (such as an
+ * extraction worker), to the most recently begun phase of all.  Phases
+ * of the same name that overlap, as in the branches of a parallel()
+ * block, are counted as one.
+ *
+ * When a phase ends its totals are written to stderr, which is the
+ * recovery log.
+ */
+typedef struct {
+    const char* name;
+    long long done;         /* bytes so far */
+    long long total;        /* bytes expected, or 0 if not known */
+    long long elapsedMs;
+    int ended;
+} PhaseStatus;
+
+void mzPhaseBegin(const char* name, long long totalBytes);
+void mzPhaseAdd(long long bytes);
+void mzPhaseEnd(void);
+
+/*
+ * Have "observer" called as phases begin and end, and every so often
+ * while they run.  It's called with no locks held, possibly from several
+ * threads at once.
+ */
+typedef void (*PhaseObserver)(const PhaseStatus* status, void* cookie);
+void mzSetPhaseObserver(PhaseObserver observer, void* cookie);
+
+/*
+ * Describe "status" in one short line, something like
+ * "extract   3.4MB/s  37%  0:17" (phase, rate, how far, time left).
+ */
+void mzFormatPhaseStatus(const PhaseStatus* status, char* buf, size_t len);
+
+#endif /*_MINZIP_THROUGHPUT*/
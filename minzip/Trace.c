@@ -0,0 +1,148 @@
+/*
+ * Copyright 2010 The Android Open Source Project
+ *
+ * Timeline of an install, as Chrome trace events.
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Trace.h"
+
+#define MAX_EVENT_LEN 256
+
+static pthread_mutex_t gLock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int gFd = -1;
+static pid_t gStarter = 0;      /* wrote the "[", and owes the "]" */
+
+static int threadId(void)
+{
+    return (int) syscall(__NR_gettid);
+}
+
+static long long nowUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Copy name into buf for a JSON string, dropping anything that would
+ * need escaping; names are ours, so that's only ever a safeguard.
+ */
+static const char* jsonName(const char* name, char* buf, size_t len)
+{
+    size_t i = 0;
+    for (; *name != '\0' && i + 1 < len; name++) {
+        if (*name != '"' && *name != '\\' && (unsigned char) *name >= ' ') {
+            buf[i++] = *name;
+        }
+    }
+    buf[i] = '\0';
+    return buf;
+}
+
+/*
+ * Each event is written with a single write() to an O_APPEND file, so
+ * events from the two processes don't interleave.
+ */
+static void writeEvent(const char* phase, const char* name, const char* args)
+{
+    if (gFd < 0) return;
+
+    char event[MAX_EVENT_LEN];
+    char safe[64];
+    int n = snprintf(event, sizeof(event),
+            "{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%lld,\"pid\":%d,"
+            "\"tid\":%d%s%s},\n",
+            jsonName(name, safe, sizeof(safe)), phase, nowUs(),
+            (int) getpid(), threadId(), args ? ",\"args\":" : "",
+            args ? args : "");
+    if (n <= 0 || n >= (int) sizeof(event)) return;
+
+    pthread_mutex_lock(&gLock);
+    if (gFd >= 0) write(gFd, event, n);
+    pthread_mutex_unlock(&gLock);
+}
+
+static void nameProcess(const char* processName)
+{
+    char args[96], safe[64];
+    snprintf(args, sizeof(args), "{\"name\":\"%s\"}",
+            jsonName(processName, safe, sizeof(safe)));
+    writeEvent("M", "process_name", args);
+}
+
+static void openTrace(const char* path, int flags, int started,
+        const char* processName)
+{
+    mzTraceFinish();
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | flags, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "can't open trace file %s\n", path);
+        return;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if (started) write(fd, "[\n", 2);
+
+    pthread_mutex_lock(&gLock);
+    gFd = fd;
+    gStarter = started ? getpid() : 0;
+    pthread_mutex_unlock(&gLock);
+    nameProcess(processName);
+}
+
+void mzTraceStart(const char* path, const char* processName)
+{
+    openTrace(path, O_TRUNC, 1, processName);
+}
+
+void mzTraceAttach(const char* path, const char* processName)
+{
+    if (path != NULL && path[0] != '\0') {
+        openTrace(path, 0, 0, processName);
+    }
+}
+
+void mzTraceFinish(void)
+{
+    pthread_mutex_lock(&gLock);
+    if (gFd >= 0) {
+        if (gStarter == getpid()) {
+            /* A last, harmless event, so the array needs no trailing comma. */
+            char end[MAX_EVENT_LEN];
+            int n = snprintf(end, sizeof(end),
+                    "{\"name\":\"trace_end\",\"ph\":\"i\",\"ts\":%lld,"
+                    "\"pid\":%d,\"tid\":%d,\"s\":\"g\"}\n]\n",
+                    nowUs(), (int) getpid(), threadId());
+            write(gFd, end, n);
+        }
+        close(gFd);
+        gFd = -1;
+        gStarter = 0;
+    }
+    pthread_mutex_unlock(&gLock);
+}
+
+void mzTraceBegin(const char* name)
+{
+    writeEvent("B", name, NULL);
+}
+
+void mzTraceEnd(const char* name)
+{
+    writeEvent("E", name, NULL);
+}
+
+void mzTraceCounter(const char* name, long long value)
+{
+    if (gFd < 0) return;
+    char args[48];
+    snprintf(args, sizeof(args), "{\"bytes\":%lld}", value);
+    writeEvent("C", name, args);
+}
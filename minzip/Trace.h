@@ -0,0 +1,36 @@
+/*
+ * Copyright 2010 The Android Open Source Project
+ *
+ * Timeline of an install, as Chrome trace events.
+ */
+#ifndef _MINZIP_TRACE
+#define _MINZIP_TRACE
+
+/*
+ * Events go to a file in the JSON format chrome://tracing loads: begin
+ * and end of spans on each thread, and counter samples.  Recovery starts
+ * the file for each install; the updater it runs attaches to the same
+ * one (through MZ_TRACE_ENV), so both processes end up on one timeline.
+ * Timestamps come from the monotonic clock, which they share.
+ *
+ * Throughput phases (see Throughput.h) are traced as spans, and the
+ * bytes done in them as counters, so most callers need nothing more.
+ *
+ * All of these do nothing if no trace file is open.
+ */
+#define MZ_TRACE_ENV "RECOVERY_TRACE_FILE"
+
+/* Create (or truncate) the trace file at path. */
+void mzTraceStart(const char* path, const char* processName);
+
+/* Add this process's events to the file at path, if path isn't NULL. */
+void mzTraceAttach(const char* path, const char* processName);
+
+/* Close the file; the one that started it also terminates the JSON. */
+void mzTraceFinish(void);
+
+void mzTraceBegin(const char* name);
+void mzTraceEnd(const char* name);
+void mzTraceCounter(const char* name, long long value);
+
+#endif /*_MINZIP_TRACE*/
@@ -9,22 +9,31 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
 #include <sys/stat.h>   // for S_ISLNK()
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #define LOG_TAG "minzip"
 #include "Zip.h"
 #include "Bits.h"
+#include "Crc32.h"
+#include "Sha1.h"
 #include "Log.h"
 #include "DirUtil.h"
+#include "Throughput.h"
 
 #undef NDEBUG   // do this after including Log.h
 #include <assert.h>
 
 #define SORT_ENTRIES 1
 
+/* Largest chunk of a STORED entry passed to a process function at once.
+ */
+#define STORED_SLICE_SIZE (32 * 1024)
+
 /*
  * Offset and length constants (java.util.zip naming convention).
  */
@@ -114,35 +123,81 @@ static int hashcmpZipEntry(const void* ventry1, const void* ventry2)
 /*
  * (This is a mzHashTableLookup callback.)
  *
- * find a ZipEntry struct by name.
+ * find a ZipEntry struct by name.  The loose item is an UnterminatedString
+ * so the length is computed once per lookup instead of once per probe.
  */
 static int hashcmpZipName(const void* ventry, const void* vname)
 {
     const ZipEntry* entry = (const ZipEntry*) ventry;
-    const char* name = (const char*) vname;
-    unsigned int nameLen = strlen(name);
+    const UnterminatedString* name = (const UnterminatedString*) vname;
 
-    if (entry->fileNameLen != nameLen)
-        return entry->fileNameLen - nameLen;
-    return memcmp(entry->fileName, name, nameLen);
+    if (entry->fileNameLen != name->len)
+        return entry->fileNameLen - name->len;
+    return memcmp(entry->fileName, name->str, name->len);
 }
 
 /*
  * Compute the hash code for a ZipEntry filename.
  *
- * Not expected to be compatible with any other hash function, so we init
- * to 2 to ensure it doesn't happen to match.
+ * This is MurmurHash3 (x86, 32-bit).  It consumes four bytes per step and
+ * finishes with an avalanche, so the low bits used to pick a slot are
+ * well mixed even for long, nearly identical paths like
+ * "system/app/Foo.apk" and "system/app/Bar.apk".  The old "hash * 31 + c"
+ * clustered badly on packages with thousands of such names.
+ *
+ * Not expected to be compatible with any other hash function, so we seed
+ * with 2 to ensure it doesn't happen to match.
  */
 static unsigned int computeHash(const char* name, int nameLen)
 {
+    const unsigned char* p = (const unsigned char*) name;
+    const unsigned int c1 = 0xcc9e2d51;
+    const unsigned int c2 = 0x1b873593;
     unsigned int hash = 2;
+    unsigned int k;
+    int i;
+
+    for (i = 0; i + 4 <= nameLen; i += 4) {
+        k = p[i] | (p[i+1] << 8) | (p[i+2] << 16) | ((unsigned int)p[i+3] << 24);
+        k *= c1;
+        k = (k << 15) | (k >> 17);
+        k *= c2;
+        hash ^= k;
+        hash = (hash << 13) | (hash >> 19);
+        hash = hash * 5 + 0xe6546b64;
+    }
 
-    while (nameLen--)
-        hash = hash * 31 + *name++;
+    k = 0;
+    switch (nameLen & 3) {
+    case 3: k ^= p[i+2] << 16;
+    case 2: k ^= p[i+1] << 8;
+    case 1: k ^= p[i];
+        k *= c1;
+        k = (k << 15) | (k >> 17);
+        k *= c2;
+        hash ^= k;
+    }
+
+    hash ^= nameLen;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
 
     return hash;
 }
 
+/*
+ * (This is a mzHashTableProbeStats callback.)
+ */
+static unsigned int hashcalcZipEntry(const void* ventry)
+{
+    const ZipEntry* entry = (const ZipEntry*) ventry;
+
+    return computeHash(entry->fileName, entry->fileNameLen);
+}
+
 static void addEntryToHashTable(HashTable* pHash, ZipEntry* pEntry)
 {
     unsigned int itemHash = computeHash(pEntry->fileName, pEntry->fileNameLen);
@@ -178,25 +233,38 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
 }
 
 /*
- * Parse the contents of a Zip archive.  After confirming that the file
- * is in fact a Zip, we scan out the contents of the central directory and
- * store it in a hash table.
+ * Find the central directory of the Zip archive open on "fd" and map
+ * just that part of the file.  After confirming that the file is in fact
+ * a Zip, we map the tail of the file to find the EOCD, then map the
+ * central directory it points to.  Entry data is never mapped here;
+ * it's read (or mapped) on demand.
  *
- * Returns "true" on success.
+ * Returns "true" on success, filling in "pMap" and "*pNumEntries".
  */
-static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
+static bool mapCentralDirectory(int fd, size_t fileLength, MemMapping* pMap,
+        unsigned int* pNumEntries)
 {
     bool result = false;
+    MemMapping tail;
     const unsigned char* ptr;
-    unsigned int i, numEntries, cdOffset;
+    unsigned char sig[4];
+    unsigned int numEntries, cdOffset, cdSize;
+    size_t tailLength;
     unsigned int val;
 
+    tail.baseAddr = NULL;
+    tail.baseLength = 0;
+
     /*
      * The first 4 bytes of the file will either be the local header
      * signature for the first file (LOCSIG) or, if the archive doesn't
      * have any files in it, the end-of-central-directory signature (ENDSIG).
      */
-    val = get4LE(pMap->addr);
+    if (pread(fd, sig, sizeof(sig), 0) != (ssize_t)sizeof(sig)) {
+        LOGW("Can't read Zip signature: %s\n", strerror(errno));
+        goto bail;
+    }
+    val = get4LE(sig);
     if (val == ENDSIG) {
         LOGI("Found Zip archive, but it looks empty\n");
         goto bail;
@@ -207,49 +275,94 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
 
     /*
      * Find the EOCD.  We'll find it immediately unless they have a file
-     * comment.
+     * comment, which can be at most 64K long.
      */
-    ptr = pMap->addr + pMap->length - ENDHDR;
+    tailLength = ENDHDR + 0xffff;
+    if (tailLength > fileLength) {
+        tailLength = fileLength;
+    }
+    if (sysMapFileSegmentInShmem(fd, fileLength - tailLength, tailLength,
+            &tail) != 0) {
+        LOGW("Map of Zip tail failed\n");
+        goto bail;
+    }
+    ptr = (const unsigned char*) tail.addr + tail.length - ENDHDR;
 
-    while (ptr >= (const unsigned char*) pMap->addr) {
+    while (ptr >= (const unsigned char*) tail.addr) {
         if (*ptr == (ENDSIG & 0xff) && get4LE(ptr) == ENDSIG)
             break;
         ptr--;
     }
-    if (ptr < (const unsigned char*) pMap->addr) {
+    if (ptr < (const unsigned char*) tail.addr) {
         LOGI("Could not find end-of-central-directory in Zip\n");
         goto bail;
     }
 
     /*
-     * There are two interesting items in the EOCD block: the number of
-     * entries in the file, and the file offset of the start of the
-     * central directory.
+     * There are three interesting items in the EOCD block: the number of
+     * entries in the file, and the file offset and size of the central
+     * directory.
      */
     numEntries = get2LE(ptr + ENDSUB);
     cdOffset = get4LE(ptr + ENDOFF);
+    cdSize = get4LE(ptr + ENDSIZ);
+
+    LOGVV("numEntries=%d cdOffset=%d cdSize=%d\n",
+        numEntries, cdOffset, cdSize);
+    if (numEntries == 0 || cdSize == 0 || cdOffset >= fileLength ||
+            cdSize > fileLength - cdOffset) {
+        LOGW("Invalid entries=%d offset=%d size=%d (len=%zd)\n",
+            numEntries, cdOffset, cdSize, fileLength);
+        goto bail;
+    }
 
-    LOGVV("numEntries=%d cdOffset=%d\n", numEntries, cdOffset);
-    if (numEntries == 0 || cdOffset >= pMap->length) {
-        LOGW("Invalid entries=%d offset=%d (len=%zd)\n",
-            numEntries, cdOffset, pMap->length);
+    if (sysMapFileSegmentInShmem(fd, cdOffset, cdSize, pMap) != 0) {
+        LOGW("Map of Zip central directory failed\n");
         goto bail;
     }
+    *pNumEntries = numEntries;
+    result = true;
+
+bail:
+    sysReleaseShmem(&tail);
+    return result;
+}
+
+/*
+ * Parse the contents of a Zip archive.  We scan out the contents of the
+ * central directory (mapped at "pMap") and store it in a hash table.
+ * Local headers are read from "fd" as we go.
+ *
+ * Returns "true" on success.
+ */
+static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap,
+        unsigned int numEntries, size_t fileLength)
+{
+    bool result = false;
+    const unsigned char* ptr;
+    unsigned int i;
 
     /*
-     * Create data structures to hold entries.
+     * Create data structures to hold entries.  The entries and the hash
+     * table over them share one allocation (pEntries), sized up front so
+     * the table never needs to grow, and closing the archive frees it.
      */
+    size_t entriesSize = ((size_t) numEntries * sizeof(ZipEntry) + 7) & ~7;
+    size_t hashSize = mzHashSize(numEntries);
     pArchive->numEntries = numEntries;
-    pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
-    pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
-    if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
+    pArchive->pEntries = (ZipEntry*) malloc(entriesSize +
+            mzHashTableStorageSize(hashSize));
+    if (pArchive->pEntries == NULL)
         goto bail;
+    memset(pArchive->pEntries, 0, entriesSize);
+    pArchive->pHash = mzHashTableInit((char*) pArchive->pEntries + entriesSize,
+            hashSize, NULL);
 
-    ptr = pMap->addr + cdOffset;
+    ptr = pMap->addr;
     for (i = 0; i < numEntries; i++) {
         ZipEntry* pEntry;
         unsigned int fileNameLen, extraLen, commentLen, localHdrOffset;
-        const unsigned char* localHdr;
+        unsigned char localHdr[LOCHDR];
         const char *fileName;
 
         if (ptr + CENHDR > (const unsigned char*)pMap->addr + pMap->length) {
@@ -352,16 +465,15 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         }
         pEntry->externalFileAttributes = get4LE(ptr + CENATX);
 
-        // Perform pMap->addr + localHdrOffset, ensuring that it won't
-        // overflow. This is needed because localHdrOffset is untrusted.
-        if (!safe_add((uintptr_t *)&localHdr, (uintptr_t)pMap->addr,
-            (uintptr_t)localHdrOffset)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
+        // localHdrOffset is untrusted, so check it against the file
+        // before reading the local header it points to.
+        if (localHdrOffset > fileLength ||
+            fileLength - localHdrOffset < LOCHDR) {
+            LOGW("Bad offset to local header: %d (at %d)\n", localHdrOffset, i);
             goto bail;
         }
-        if ((uintptr_t)localHdr + LOCHDR >
-            (uintptr_t)pMap->addr + pMap->length) {
-            LOGW("Bad offset to local header: %d (at %d)\n", localHdrOffset, i);
+        if (pread(pArchive->fd, localHdr, LOCHDR, localHdrOffset) != LOCHDR) {
+            LOGW("Can't read local header (at %d): %s\n", i, strerror(errno));
             goto bail;
         }
         if (get4LE(localHdr) != LOCSIG) {
@@ -374,7 +486,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             LOGW("Integer overflow adding in parseZipArchive\n");
             goto bail;
         }
-        if ((size_t)pEntry->offset + pEntry->compLen > pMap->length) {
+        if ((size_t)pEntry->offset + pEntry->compLen > fileLength) {
             LOGW("Data ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -407,7 +519,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
 
 bail:
     if (!result) {
-        mzHashTableFree(pArchive->pHash);
+        mzHashTableRelease(pArchive->pHash);
         pArchive->pHash = NULL;
     }
     return result;
@@ -416,10 +528,9 @@ bail:
 /*
  * Open a Zip archive and scan out the contents.
  *
- * The easiest way to do this is to mmap() the whole thing and do the
- * traditional backward scan for central directory.  Since the EOCD is
- * a relatively small bit at the end, we should end up only touching a
- * small set of pages.
+ * Only the end of the file and the central directory get mapped; on a
+ * large package that's a tiny fraction of the file, and it's all we need
+ * to build the entry table.  Entry data is read on demand.
  *
  * This will be called on non-Zip files, especially during startup, so
  * we don't want to be too noisy about failures.  (Do we want a "quiet"
@@ -430,6 +541,8 @@ bail:
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
 {
     MemMapping map;
+    struct stat st;
+    unsigned int numEntries;
     int err;
 
     LOGV("Opening archive '%s' %p\n", fileName, pArchive);
@@ -444,19 +557,26 @@ int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
         goto bail;
     }
 
-    if (sysMapFileInShmem(pArchive->fd, &map) != 0) {
+    if (fstat(pArchive->fd, &st) != 0) {
+        err = errno ? errno : -1;
+        LOGW("Unable to stat '%s': %s\n", fileName, strerror(err));
+        goto bail;
+    }
+
+    if (st.st_size < ENDHDR) {
         err = -1;
-        LOGW("Map of '%s' failed\n", fileName);
+        LOGV("File '%s' too small to be zip (%lld)\n", fileName,
+            (long long) st.st_size);
         goto bail;
     }
 
-    if (map.length < ENDHDR) {
+    if (!mapCentralDirectory(pArchive->fd, st.st_size, &map, &numEntries)) {
         err = -1;
-        LOGV("File '%s' too small to be zip (%zd)\n", fileName, map.length);
+        LOGW("Map of '%s' failed\n", fileName);
         goto bail;
     }
 
-    if (!parseZipArchive(pArchive, &map)) {
+    if (!parseZipArchive(pArchive, &map, numEntries, st.st_size)) {
         err = -1;
         LOGV("Parsing '%s' failed\n", fileName);
         goto bail;
@@ -488,15 +608,27 @@ void mzCloseZipArchive(ZipArchive* pArchive)
     if (pArchive->map.addr != NULL)
         sysReleaseShmem(&pArchive->map);
 
+    /* The table lives in the same block as the entries. */
+    mzHashTableRelease(pArchive->pHash);
     free(pArchive->pEntries);
 
-    mzHashTableFree(pArchive->pHash);
-
     pArchive->fd = -1;
     pArchive->pHash = NULL;
     pArchive->pEntries = NULL;
 }
 
+void mzGetCentralDirectoryDigest(const ZipArchive* pArchive,
+        unsigned char* digest)
+{
+    mzSha1(pArchive->map.addr, pArchive->map.length, digest);
+}
+
+void mzSetEntryVerifier(ZipArchive* pArchive,
+        const MzEntryVerifier* pVerifier)
+{
+    pArchive->pVerifier = pVerifier;
+}
+
 /*
  * Find a matching entry.
  *
@@ -505,10 +637,88 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName)
 {
-    unsigned int itemHash = computeHash(entryName, strlen(entryName));
+    UnterminatedString name;
+    unsigned int itemHash;
+
+    name.str = entryName;
+    name.len = strlen(entryName);
+    itemHash = computeHash(name.str, name.len);
 
     return (const ZipEntry*)mzHashTableLookup(pArchive->pHash,
-                itemHash, (char*) entryName, hashcmpZipName, false);
+                itemHash, &name, hashcmpZipName, false);
+}
+
+/*
+ * Report how well the entry name hash is doing.
+ */
+void mzGetZipHashStats(const ZipArchive* pArchive, HashProbeStats* pStats)
+{
+    mzHashTableProbeStats(pArchive->pHash, hashcalcZipEntry, hashcmpZipEntry,
+            pStats);
+}
+
+/*
+ * Compare the first "prefixLen" bytes of an entry name against "prefix",
+ * the same way parseZipArchive() orders entries.  Names shorter than the
+ * prefix sort before it when they match as far as they go.
+ */
+static int comparePrefix(const ZipEntry *pEntry, const char *prefix,
+        unsigned int prefixLen)
+{
+    unsigned int len = pEntry->fileNameLen < prefixLen ?
+            pEntry->fileNameLen : prefixLen;
+    int diff = strncmp(pEntry->fileName, prefix, len);
+    if (diff == 0 && pEntry->fileNameLen < prefixLen) {
+        diff = -1;
+    }
+    return diff;
+}
+
+/*
+ * Find the run of entries whose names begin with "prefix".
+ *
+ * Because parseZipArchive() leaves pEntries sorted by name, every
+ * entry under a given directory is contiguous, so this is a pair of
+ * binary searches rather than a walk over the whole archive.
+ */
+unsigned int mzFindZipEntriesWithPrefix(const ZipArchive *pArchive,
+        const char *prefix, unsigned int *pFirst)
+{
+    unsigned int prefixLen = strlen(prefix);
+    unsigned int low, high, first;
+
+#if !SORT_ENTRIES
+#error "mzFindZipEntriesWithPrefix() requires sorted entries"
+#endif
+
+    /* Lower bound: first entry that doesn't sort before the prefix.
+     */
+    low = 0;
+    high = pArchive->numEntries;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (comparePrefix(&pArchive->pEntries[mid], prefix, prefixLen) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    first = low;
+
+    /* Upper bound: first entry after that which doesn't match.
+     */
+    high = pArchive->numEntries;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (comparePrefix(&pArchive->pEntries[mid], prefix, prefixLen) == 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    *pFirst = first;
+    return low - first;
 }
 
 /*
@@ -522,37 +732,270 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
     return false;
 }
 
+/*
+ * Map the contents of a STORED entry, or fail if the entry is compressed.
+ */
+bool mzMapZipEntryStoredData(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, MemMapping *pMap)
+{
+    if (pEntry->compression != STORED) {
+        return false;
+    }
+    if (pEntry->compLen == 0) {
+        /* mmap() won't take a zero length; hand back an empty mapping
+         * that sysReleaseShmem() knows to ignore.
+         */
+        memset(pMap, 0, sizeof(*pMap));
+        return true;
+    }
+    /* parseZipArchive() already checked that the data lies inside
+     * the file.
+     */
+    if (sysMapFileSegmentInShmem(pArchive->fd, pEntry->offset,
+            pEntry->compLen, pMap) != 0) {
+        LOGE("Can't map %ld bytes of '%.*s'\n", pEntry->compLen,
+                pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+    return true;
+}
+
 /* Call processFunction on the uncompressed data of a STORED entry.
+ *
+ * The data is handed over straight from a mapping of the entry, so
+ * there's no bounce buffer; it's still passed in slices of sliceSize
+ * bytes so that callers which report progress per call keep working.
  */
 static bool processStoredEntry(const ZipArchive *pArchive,
-    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
-    void *cookie)
+    const ZipEntry *pEntry, size_t sliceSize,
+    ProcessZipEntryContentsFunction processFunction, void *cookie)
 {
-    size_t bytesLeft = pEntry->compLen;
+    MemMapping map;
+    bool ret = true;
+
+    if (!mzMapZipEntryStoredData(pArchive, pEntry, &map)) {
+        return false;
+    }
+
+    const unsigned char *data = map.addr;
+    size_t bytesLeft = map.length;
     while (bytesLeft > 0) {
-        unsigned char buf[32 * 1024];
-        ssize_t n;
         size_t count;
-        bool ret;
 
         count = bytesLeft;
-        if (count > sizeof(buf)) {
-            count = sizeof(buf);
-        }
-        n = read(pArchive->fd, buf, count);
-        if (n < 0 || (size_t)n != count) {
-            LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
-            return false;
+        if (count > sliceSize) {
+            count = sliceSize;
         }
-        ret = processFunction(buf, n, cookie);
+        ret = processFunction(data, count, cookie);
         if (!ret) {
-            return false;
+            break;
         }
+        data += count;
         bytesLeft -= count;
     }
+
+    sysReleaseShmem(&map);
+    return ret;
+}
+
+/*
+ * Size of each read-ahead buffer; zero disables read-ahead.
+ */
+static size_t gReadAheadSize = MZ_DEFAULT_READAHEAD_SIZE;
+
+void mzSetReadAheadSize(size_t bufSize)
+{
+    gReadAheadSize = bufSize;
+}
+
+/*
+ * Source of compressed bytes for processDeflatedEntry().
+ *
+ * Without read-ahead, each call pread()s the next chunk into readBuf
+ * on the inflating thread.  With read-ahead, a reader thread keeps one
+ * of two buffers filled while the other is being inflated, so card
+ * latency overlaps with decompression instead of adding to it.
+ */
+typedef struct {
+    int fd;
+    off_t offset;
+    long remaining;
+
+    /* Direct mode. */
+    unsigned char *readBuf;
+    size_t readBufSize;
+
+    /* Read-ahead mode; everything below "lock" is protected by it. */
+    bool readAhead;
+    pthread_t reader;
+    size_t bufSize;
+    unsigned char *buf[2];
+    int consumer;               /* buffer the inflater holds, or -1 */
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    long len[2];
+    bool full[2];
+    bool failed;
+    bool stop;
+} InflateInput;
+
+static void *readAheadThread(void *arg)
+{
+    InflateInput *in = (InflateInput *)arg;
+    off_t offset = in->offset;
+    long remaining = in->remaining;
+    int idx = 0;
+
+    while (remaining > 0) {
+        pthread_mutex_lock(&in->lock);
+        while (in->full[idx] && !in->stop) {
+            pthread_cond_wait(&in->cond, &in->lock);
+        }
+        bool stop = in->stop;
+        pthread_mutex_unlock(&in->lock);
+        if (stop) {
+            break;
+        }
+
+        long getSize = (remaining > (long)in->bufSize) ?
+                (long)in->bufSize : remaining;
+        ssize_t cc = pread(in->fd, in->buf[idx], getSize, offset);
+
+        pthread_mutex_lock(&in->lock);
+        if (cc != getSize) {
+            LOGW("inflate read-ahead failed (%d vs %ld)\n", (int) cc, getSize);
+            in->failed = true;
+            pthread_cond_broadcast(&in->cond);
+            pthread_mutex_unlock(&in->lock);
+            break;
+        }
+        in->len[idx] = getSize;
+        in->full[idx] = true;
+        pthread_cond_broadcast(&in->cond);
+        pthread_mutex_unlock(&in->lock);
+
+        offset += getSize;
+        remaining -= getSize;
+        idx ^= 1;
+    }
+    return NULL;
+}
+
+static bool initInflateInput(InflateInput *in, const ZipArchive *pArchive,
+    const ZipEntry *pEntry, unsigned char *readBuf, size_t readBufSize)
+{
+    memset(in, 0, sizeof(*in));
+    in->fd = pArchive->fd;
+    in->offset = pEntry->offset;
+    in->remaining = pEntry->compLen;
+    in->readBuf = readBuf;
+    in->readBufSize = readBufSize;
+    in->consumer = -1;
+
+    /* Only worth a thread when there's more than one buffer's worth.
+     */
+    if (gReadAheadSize == 0 || (size_t)pEntry->compLen <= gReadAheadSize) {
+        return true;
+    }
+
+    in->bufSize = gReadAheadSize;
+    in->buf[0] = (unsigned char *)malloc(in->bufSize);
+    in->buf[1] = (unsigned char *)malloc(in->bufSize);
+    if (in->buf[0] == NULL || in->buf[1] == NULL) {
+        free(in->buf[0]);
+        free(in->buf[1]);
+        in->buf[0] = in->buf[1] = NULL;
+        return true;        // fall back to direct reads
+    }
+    pthread_mutex_init(&in->lock, NULL);
+    pthread_cond_init(&in->cond, NULL);
+    if (pthread_create(&in->reader, NULL, readAheadThread, in) != 0) {
+        LOGW("Can't start inflate read-ahead thread\n");
+        pthread_cond_destroy(&in->cond);
+        pthread_mutex_destroy(&in->lock);
+        free(in->buf[0]);
+        free(in->buf[1]);
+        in->buf[0] = in->buf[1] = NULL;
+        return true;
+    }
+    in->readAhead = true;
     return true;
 }
 
+/*
+ * Hand back the next chunk of compressed data.  Returns its length,
+ * 0 at the end of the entry, or -1 on a read error.
+ */
+static long readInflateInput(InflateInput *in, unsigned char **pData)
+{
+    if (!in->readAhead) {
+        long getSize = (in->remaining > (long)in->readBufSize) ?
+                (long)in->readBufSize : in->remaining;
+        LOGVV("+++ reading %ld bytes (%ld left)\n", getSize, in->remaining);
+
+        /* Positional reads leave the shared file offset alone,
+         * so several threads can read the same archive at once.
+         */
+        int cc = pread(in->fd, in->readBuf, getSize, in->offset);
+        if (cc != (int) getSize) {
+            LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
+            return -1;
+        }
+        in->remaining -= getSize;
+        in->offset += getSize;
+        *pData = in->readBuf;
+        return getSize;
+    }
+
+    if (in->remaining == 0) {
+        return 0;
+    }
+
+    int idx = (in->consumer < 0) ? 0 : in->consumer ^ 1;
+    long len;
+
+    pthread_mutex_lock(&in->lock);
+    if (in->consumer >= 0) {
+        /* zlib is done with the previous buffer; let the reader refill it.
+         */
+        in->full[in->consumer] = false;
+        pthread_cond_broadcast(&in->cond);
+    }
+    while (!in->full[idx] && !in->failed) {
+        pthread_cond_wait(&in->cond, &in->lock);
+    }
+    if (!in->full[idx]) {
+        pthread_mutex_unlock(&in->lock);
+        return -1;
+    }
+    len = in->len[idx];
+    pthread_mutex_unlock(&in->lock);
+
+    in->consumer = idx;
+    in->remaining -= len;
+    *pData = in->buf[idx];
+    return len;
+}
+
+static void finishInflateInput(InflateInput *in)
+{
+    if (!in->readAhead) {
+        return;
+    }
+    pthread_mutex_lock(&in->lock);
+    in->stop = true;
+    pthread_cond_broadcast(&in->cond);
+    pthread_mutex_unlock(&in->lock);
+    pthread_join(in->reader, NULL);
+
+    pthread_cond_destroy(&in->cond);
+    pthread_mutex_destroy(&in->lock);
+    free(in->buf[0]);
+    free(in->buf[1]);
+    in->readAhead = false;
+}
+
 static bool processDeflatedEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
@@ -560,11 +1003,11 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     long result = -1;
     unsigned char readBuf[32 * 1024];
     unsigned char procBuf[32 * 1024];
+    InflateInput input;
     z_stream zstream;
     int zerr;
-    long compRemaining;
 
-    compRemaining = pEntry->compLen;
+    initInflateInput(&input, pArchive, pEntry, readBuf, sizeof(readBuf));
 
     /*
      * Initialize the zlib stream.
@@ -600,20 +1043,13 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     do {
         /* read as much as we can */
         if (zstream.avail_in == 0) {
-            long getSize = (compRemaining > (long)sizeof(readBuf)) ?
-                        (long)sizeof(readBuf) : compRemaining;
-            LOGVV("+++ reading %ld bytes (%ld left)\n",
-                getSize, compRemaining);
-
-            int cc = read(pArchive->fd, readBuf, getSize);
-            if (cc != (int) getSize) {
-                LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
+            unsigned char *data;
+            long getSize = readInflateInput(&input, &data);
+            if (getSize < 0) {
                 goto z_bail;
             }
 
-            compRemaining -= getSize;
-
-            zstream.next_in = readBuf;
+            zstream.next_in = data;
             zstream.avail_in = getSize;
         }
 
@@ -650,6 +1086,7 @@ z_bail:
     inflateEnd(&zstream);        /* free up any allocated structures */
 
 bail:
+    finishInflateInput(&input);
     if (result != pEntry->uncompLen) {
         if (result != -1)        // error already shown?
             LOGW("Size mismatch on inflated file (%ld vs %ld)\n",
@@ -659,32 +1096,38 @@ bail:
     return true;
 }
 
-/*
- * Stream the uncompressed data through the supplied function,
- * passing cookie to it each time it gets called.  processFunction
- * may be called more than once.
- *
- * If processFunction returns false, the operation is abandoned and
- * mzProcessZipEntryContents() immediately returns false.
- *
- * This is useful for calculating the hash of an entry's uncompressed contents.
+/* Feeds each chunk to the archive's entry verifier on its way to the
+ * caller's process function.
  */
-bool mzProcessZipEntryContents(const ZipArchive *pArchive,
-    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
-    void *cookie)
-{
-    bool ret = false;
-    off_t oldOff;
+typedef struct {
+    const MzEntryVerifier *pVerifier;
+    void *state;
+    ProcessZipEntryContentsFunction processFunction;
+    void *cookie;
+} VerifyProcessArgs;
 
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
+static bool verifyProcessFunction(const unsigned char *data, int dataLen,
+        void *cookie)
+{
+    VerifyProcessArgs *args = (VerifyProcessArgs *)cookie;
+    args->pVerifier->update(args->state, data, dataLen);
+    return args->processFunction(data, dataLen, args->cookie);
+}
 
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
+static bool processEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, size_t sliceSize,
+    ProcessZipEntryContentsFunction processFunction, void *cookie)
+{
+    bool ret = false;
 
+    /* Neither path below touches the archive's file offset (stored
+     * entries come from the mapping, deflated ones use pread()), so
+     * this is safe to call from several threads at once.
+     */
     switch (pEntry->compression) {
     case STORED:
-        ret = processStoredEntry(pArchive, pEntry, processFunction, cookie);
+        ret = processStoredEntry(pArchive, pEntry, sliceSize,
+                processFunction, cookie);
         break;
     case DEFLATED:
         ret = processDeflatedEntry(pArchive, pEntry, processFunction, cookie);
@@ -695,42 +1138,141 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
         break;
     }
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
     return ret;
 }
 
+/*
+ * Stream the uncompressed data through the supplied function,
+ * passing cookie to it each time it gets called.  processFunction
+ * may be called more than once.
+ *
+ * If processFunction returns false, the operation is abandoned and
+ * mzProcessZipEntryContents() immediately returns false.
+ *
+ * This is useful for calculating the hash of an entry's uncompressed contents.
+ */
+static bool processContents(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, size_t sliceSize,
+    ProcessZipEntryContentsFunction processFunction, void *cookie)
+{
+    const MzEntryVerifier *pVerifier = pArchive->pVerifier;
+    VerifyProcessArgs args;
+    bool ret;
+
+    if (pVerifier == NULL) {
+        return processEntry(pArchive, pEntry, sliceSize,
+                processFunction, cookie);
+    }
+
+    args.state = NULL;
+    if (!pVerifier->begin(pVerifier, pEntry, &args.state)) {
+        LOGE("Entry %.*s refused by verifier\n",
+                pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+    if (args.state == NULL) {
+        return processEntry(pArchive, pEntry, sliceSize,
+                processFunction, cookie);
+    }
+
+    args.pVerifier = pVerifier;
+    args.processFunction = processFunction;
+    args.cookie = cookie;
+    ret = processEntry(pArchive, pEntry, sliceSize, verifyProcessFunction,
+            (void *)&args);
+    if (!pVerifier->finish(args.state) && ret) {
+        LOGE("Entry %.*s failed verification\n",
+                pEntry->fileNameLen, pEntry->fileName);
+        ret = false;
+    }
+    return ret;
+}
+
+bool mzProcessZipEntryContents(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+    void *cookie)
+{
+    return processContents(pArchive, pEntry, STORED_SLICE_SIZE,
+            processFunction, cookie);
+}
+
+/* Carries the caller's process function through a CRC check, so the
+ * checksum is taken from each output chunk while it's still in cache.
+ */
+typedef struct {
+    ProcessZipEntryContentsFunction processFunction;
+    void *cookie;
+    unsigned long crc;
+} CrcProcessArgs;
+
 static bool crcProcessFunction(const unsigned char *data, int dataLen,
-        void *crc)
+        void *cookie)
 {
-    *(unsigned long *)crc = crc32(*(unsigned long *)crc, data, dataLen);
+    CrcProcessArgs *args = (CrcProcessArgs *)cookie;
+    args->crc = mzCrc32(args->crc, data, dataLen);
+    if (args->processFunction != NULL) {
+        return args->processFunction(data, dataLen, args->cookie);
+    }
     return true;
 }
 
 /*
- * Check the CRC on this entry; return true if it is correct.
- * May do other internal checks as well.
+ * Like mzProcessZipEntryContents(), but also checks the entry's CRC
+ * along the way.
  */
-bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry)
+static bool processContentsVerified(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, size_t sliceSize,
+    ProcessZipEntryContentsFunction processFunction, void *cookie)
 {
-    unsigned long crc;
+    CrcProcessArgs args;
     bool ret;
 
-    crc = crc32(0L, Z_NULL, 0);
-    ret = mzProcessZipEntryContents(pArchive, pEntry, crcProcessFunction,
-            (void *)&crc);
+    args.processFunction = processFunction;
+    args.cookie = cookie;
+    args.crc = 0;
+    ret = processContents(pArchive, pEntry, sliceSize, crcProcessFunction,
+            (void *)&args);
     if (!ret) {
         LOGE("Can't calculate CRC for entry\n");
         return false;
     }
-    if (crc != (unsigned long)pEntry->crc32) {
+    if (args.crc != (unsigned long)pEntry->crc32) {
         LOGW("CRC for entry %.*s (0x%08lx) != expected (0x%08lx)\n",
-                pEntry->fileNameLen, pEntry->fileName, crc, pEntry->crc32);
+                pEntry->fileNameLen, pEntry->fileName, args.crc,
+                pEntry->crc32);
         return false;
     }
     return true;
 }
 
+bool mzProcessZipEntryContentsVerified(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+    void *cookie)
+{
+    return processContentsVerified(pArchive, pEntry, STORED_SLICE_SIZE,
+            processFunction, cookie);
+}
+
+bool mzProcessZipEntryContentsInSlices(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, size_t sliceSize,
+    ProcessZipEntryContentsFunction processFunction, void *cookie)
+{
+    if (sliceSize == 0) {
+        sliceSize = STORED_SLICE_SIZE;
+    }
+    return processContentsVerified(pArchive, pEntry, sliceSize,
+            processFunction, cookie);
+}
+
+/*
+ * Check the CRC on this entry; return true if it is correct.
+ * May do other internal checks as well.
+ */
+bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry)
+{
+    return mzProcessZipEntryContentsVerified(pArchive, pEntry, NULL, NULL);
+}
+
 typedef struct {
     char *buf;
     int bufLen;
@@ -785,6 +1327,7 @@ static bool writeProcessFunction(const unsigned char *data, int dataLen,
             }
         } else if (n > 0) {
             soFar += n;
+            mzPhaseAdd(n);
             if (soFar == dataLen) return true;
             if (soFar > dataLen) {
                 LOGE("write overrun?  (%ld bytes instead of %d)\n",
@@ -810,6 +1353,9 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     return true;
 }
 
+#define UNZIP_DIRMODE 0755
+#define UNZIP_FILEMODE 0644
+
 /* Helper state to make path translation easier and less malloc-happy.
  */
 typedef struct {
@@ -870,6 +1416,460 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+/*
+ * One regular file queued up by mzExtractRecursive() when
+ * MZ_EXTRACT_PARALLEL or MZ_EXTRACT_DEFER_METADATA is set.
+ */
+typedef struct {
+    const ZipEntry *pEntry;
+    char *targetFile;
+    /* With MZ_EXTRACT_DEDUP, an earlier job whose entry seems to hold the
+     * same data, and whether this one was in fact made from its file.
+     */
+    const ZipEntry *pSourceEntry;
+    const char *sourceFile;
+    bool deduped;
+} MzExtractJob;
+
+/*
+ * State shared by the extraction workers.  Everything below "lock" is
+ * protected by it; the rest is read-only once the workers start.
+ */
+typedef struct {
+    const ZipArchive *pArchive;
+    MzExtractJob *jobs;
+    unsigned int numJobs;
+    int flags;
+    const struct utimbuf *timestamp;
+    void (*callback)(const char *fn, void *);
+    void *cookie;
+
+    pthread_mutex_t lock;
+    unsigned int nextJob;
+    bool failed;
+} MzExtractPool;
+
+/* Set once the kernel turns out not to have fallocate() at all. */
+static volatile bool gNoFallocate = false;
+
+/*
+ * Reserve space for a file we're about to write, so the filesystem can
+ * lay it out in one go instead of growing it a chunk at a time.  This is
+ * only a hint; yaffs2 and vfat don't support it, and that's fine.
+ *
+ * The C library doesn't wrap fallocate(), so this makes the system call
+ * itself.  On 32-bit targets the two 64-bit arguments go in as
+ * (low, high) word pairs, which is what ARM EABI and i386 expect.
+ */
+static void preallocateFile(int fd, long length)
+{
+#ifdef __NR_fallocate
+    if (length <= 0 || gNoFallocate) {
+        return;
+    }
+#if defined(__LP64__)
+    long ret = syscall(__NR_fallocate, fd, 0, (off_t)0, (off_t)length);
+#else
+    long ret = syscall(__NR_fallocate, fd, 0, 0, 0,
+            (unsigned long)length, 0);
+#endif
+    if (ret != 0) {
+        if (errno == ENOSYS) {
+            gNoFallocate = true;
+        }
+        LOGVV("fallocate(%ld) failed: %s\n", length, strerror(errno));
+    }
+#endif
+}
+
+/*
+ * Flush everything written under dir in one go.  syncfs() limits that
+ * to dir's filesystem; where the kernel doesn't have it, fall back to
+ * sync().
+ */
+static void syncTargetFilesystem(const char *dir)
+{
+#ifdef __NR_syncfs
+    int fd = open(dir, O_RDONLY);
+    if (fd >= 0) {
+        long ret = syscall(__NR_syncfs, fd);
+        close(fd);
+        if (ret == 0) {
+            return;
+        }
+    }
+#endif
+    sync();
+}
+
+/*
+ * Write a single regular file.  Returns true on success.
+ *
+ * With MZ_EXTRACT_DEFER_METADATA the file's space is reserved up front
+ * and the timestamp is left for the caller to apply later.
+ */
+static bool extractFileEntry(const ZipArchive *pArchive,
+        const ZipEntry *pEntry, const char *targetFile, int flags,
+        const struct utimbuf *timestamp)
+{
+    int fd = creat(targetFile, UNZIP_FILEMODE);
+    if (fd < 0) {
+        LOGE("Can't create target file \"%s\": %s\n",
+                targetFile, strerror(errno));
+        return false;
+    }
+
+    if (flags & MZ_EXTRACT_DEFER_METADATA) {
+        preallocateFile(fd, pEntry->uncompLen);
+    }
+
+    bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
+    close(fd);
+    if (!ok) {
+        /* Don't leave partial (or unverified) data behind. */
+        LOGE("Error extracting \"%s\"\n", targetFile);
+        unlink(targetFile);
+        return false;
+    }
+
+    if (!(flags & MZ_EXTRACT_DEFER_METADATA) &&
+            timestamp != NULL && utime(targetFile, timestamp)) {
+        LOGE("Error touching \"%s\"\n", targetFile);
+        return false;
+    }
+
+    LOGD("Extracted file \"%s\"\n", targetFile);
+    return true;
+}
+
+/* How much of two entries' compressed data is compared at a time, and
+ * of a duplicate's file copied at a time.
+ */
+#define DEDUP_BUFFER_SIZE (64 * 1024)
+
+/*
+ * Whether two entries hold the same data.  A matching CRC and sizes
+ * make it all but certain; comparing the compressed bytes, which costs
+ * far less than inflating them, makes sure.
+ */
+static bool sameEntryData(const ZipArchive *pArchive,
+        const ZipEntry *pA, const ZipEntry *pB)
+{
+    if (pA->crc32 != pB->crc32 || pA->uncompLen != pB->uncompLen ||
+            pA->compLen != pB->compLen || pA->compression != pB->compression) {
+        return false;
+    }
+    unsigned char *buf = (unsigned char *)malloc(DEDUP_BUFFER_SIZE * 2);
+    if (buf == NULL) {
+        return false;
+    }
+    bool same = true;
+    long done = 0;
+    while (same && done < pA->compLen) {
+        size_t n = pA->compLen - done;
+        if (n > DEDUP_BUFFER_SIZE) {
+            n = DEDUP_BUFFER_SIZE;
+        }
+        same = pread(pArchive->fd, buf, n, pA->offset + done) == (ssize_t)n &&
+                pread(pArchive->fd, buf + DEDUP_BUFFER_SIZE, n,
+                        pB->offset + done) == (ssize_t)n &&
+                memcmp(buf, buf + DEDUP_BUFFER_SIZE, n) == 0;
+        done += n;
+    }
+    free(buf);
+    return same;
+}
+
+/*
+ * Make a duplicate's file from its source's, by hard link if
+ * MZ_EXTRACT_DEDUP_LINK allows and the filesystem supports it, or by
+ * copying.  The archive's verifier, if any, still sees the data.
+ * Returns true on success.
+ */
+static bool extractDuplicateEntry(const ZipArchive *pArchive,
+        const MzExtractJob *job, int flags, const struct utimbuf *timestamp)
+{
+    const ZipEntry *pEntry = job->pEntry;
+    const MzEntryVerifier *pVerifier = pArchive->pVerifier;
+    void *state = NULL;
+
+    if (pVerifier != NULL && !pVerifier->begin(pVerifier, pEntry, &state)) {
+        LOGE("Entry %.*s refused by verifier\n",
+                pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
+
+    bool linked = false;
+    if (flags & MZ_EXTRACT_DEDUP_LINK) {
+        unlink(job->targetFile);
+        linked = link(job->sourceFile, job->targetFile) == 0;
+        if (!linked) {
+            LOGVV("Can't link \"%s\": %s\n", job->targetFile,
+                    strerror(errno));
+        }
+    }
+
+    bool ok = true;
+    int out = -1;
+    if (!linked) {
+        out = creat(job->targetFile, UNZIP_FILEMODE);
+        if (out < 0) {
+            LOGE("Can't create target file \"%s\": %s\n",
+                    job->targetFile, strerror(errno));
+            ok = false;
+        } else if (flags & MZ_EXTRACT_DEFER_METADATA) {
+            preallocateFile(out, pEntry->uncompLen);
+        }
+    }
+
+    /* A link needs no data at all, unless it's to be verified.
+     */
+    if (ok && (out >= 0 || state != NULL)) {
+        unsigned char *buf = (unsigned char *)malloc(DEDUP_BUFFER_SIZE);
+        int in = open(job->sourceFile, O_RDONLY);
+        long total = 0;
+        ok = buf != NULL && in >= 0;
+        while (ok) {
+            ssize_t n = read(in, buf, DEDUP_BUFFER_SIZE);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                ok = n == 0;
+                break;
+            }
+            if (state != NULL) {
+                pVerifier->update(state, buf, n);
+            }
+            if (out >= 0) {
+                ok = writeProcessFunction(buf, n, (void *)out);
+            }
+            total += n;
+        }
+        if (ok && total != pEntry->uncompLen) {
+            LOGE("\"%s\" changed while being copied\n", job->sourceFile);
+            ok = false;
+        }
+        if (in >= 0) {
+            close(in);
+        }
+        free(buf);
+    }
+    if (state != NULL && !pVerifier->finish(state) && ok) {
+        LOGE("Entry %.*s failed verification\n",
+                pEntry->fileNameLen, pEntry->fileName);
+        ok = false;
+    }
+    if (out >= 0 && close(out) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        LOGE("Error copying \"%s\" to \"%s\"\n",
+                job->sourceFile, job->targetFile);
+        unlink(job->targetFile);
+        return false;
+    }
+    if (linked) {
+        mzPhaseAdd(pEntry->uncompLen);
+    }
+
+    if (!(flags & MZ_EXTRACT_DEFER_METADATA) &&
+            timestamp != NULL && utime(job->targetFile, timestamp)) {
+        LOGE("Error touching \"%s\"\n", job->targetFile);
+        return false;
+    }
+
+    LOGD("%s file \"%s\" from \"%s\"\n", linked ? "Linked" : "Copied",
+            job->targetFile, job->sourceFile);
+    return true;
+}
+
+static void *extractWorker(void *arg)
+{
+    MzExtractPool *pool = (MzExtractPool *)arg;
+
+    for (;;) {
+        MzExtractJob *job;
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->failed || pool->nextJob >= pool->numJobs) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        job = &pool->jobs[pool->nextJob++];
+        pthread_mutex_unlock(&pool->lock);
+
+        bool ok;
+        if (job->sourceFile != NULL &&
+                sameEntryData(pool->pArchive, job->pSourceEntry, job->pEntry)) {
+            ok = extractDuplicateEntry(pool->pArchive, job, pool->flags,
+                    pool->timestamp);
+            job->deduped = ok;
+        } else {
+            ok = extractFileEntry(pool->pArchive, job->pEntry,
+                    job->targetFile, pool->flags, pool->timestamp);
+        }
+
+        /* The callback is invoked with the lock held so that callers
+         * don't need to be thread-safe.
+         */
+        pthread_mutex_lock(&pool->lock);
+        if (!ok) {
+            pool->failed = true;
+        } else if (pool->callback != NULL) {
+            pool->callback(job->targetFile, pool->cookie);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+static int compareEntryData(const ZipEntry *pA, const ZipEntry *pB)
+{
+    if (pA->crc32 != pB->crc32) {
+        return pA->crc32 < pB->crc32 ? -1 : 1;
+    }
+    if (pA->uncompLen != pB->uncompLen) {
+        return pA->uncompLen < pB->uncompLen ? -1 : 1;
+    }
+    if (pA->compLen != pB->compLen) {
+        return pA->compLen < pB->compLen ? -1 : 1;
+    }
+    if (pA->compression != pB->compression) {
+        return pA->compression < pB->compression ? -1 : 1;
+    }
+    return 0;
+}
+
+static int compareJobData(const void *a, const void *b)
+{
+    const MzExtractJob *jobA = *(const MzExtractJob * const *)a;
+    const MzExtractJob *jobB = *(const MzExtractJob * const *)b;
+    int cmp = compareEntryData(jobA->pEntry, jobB->pEntry);
+
+    /* Keep archive order within a group; the first one is inflated.
+     */
+    if (cmp == 0) {
+        cmp = jobA < jobB ? -1 : (jobA > jobB);
+    }
+    return cmp;
+}
+
+/*
+ * Group the queued files by (crc32, uncompLen, compLen) and point every
+ * file after the first of a group at it, then reorder the jobs so the
+ * firsts all come before the duplicates.  Returns how many jobs there
+ * are before the duplicates, which is all of them if grouping fails.
+ */
+static unsigned int findDuplicateJobs(MzExtractJob *jobs,
+        unsigned int numJobs)
+{
+    MzExtractJob **sorted = (MzExtractJob **)malloc(
+            numJobs * sizeof(MzExtractJob *));
+    MzExtractJob *reordered = (MzExtractJob *)malloc(
+            numJobs * sizeof(MzExtractJob));
+    unsigned int i, numFirst = 0, numDups = 0;
+
+    if (sorted == NULL || reordered == NULL) {
+        free(sorted);
+        free(reordered);
+        return numJobs;
+    }
+    for (i = 0; i < numJobs; i++) {
+        sorted[i] = &jobs[i];
+    }
+    qsort(sorted, numJobs, sizeof(MzExtractJob *), compareJobData);
+
+    /* Empty files are as quick to create as to copy.
+     */
+    const MzExtractJob *first = sorted[0];
+    for (i = 1; i < numJobs; i++) {
+        MzExtractJob *job = sorted[i];
+        if (job->pEntry->uncompLen > 0 &&
+                compareEntryData(first->pEntry, job->pEntry) == 0) {
+            job->pSourceEntry = first->pEntry;
+            job->sourceFile = first->targetFile;
+            numDups++;
+        } else {
+            first = job;
+        }
+    }
+    free(sorted);
+
+    numFirst = numJobs - numDups;
+    unsigned int nextFirst = 0, nextDup = numFirst;
+    for (i = 0; i < numJobs; i++) {
+        if (jobs[i].sourceFile == NULL) {
+            reordered[nextFirst++] = jobs[i];
+        } else {
+            reordered[nextDup++] = jobs[i];
+        }
+    }
+    memcpy(jobs, reordered, numJobs * sizeof(MzExtractJob));
+    free(reordered);
+    return numFirst;
+}
+
+/*
+ * Extract the queued regular files.  With MZ_EXTRACT_PARALLEL this uses
+ * up to MZ_EXTRACT_MAX_WORKERS threads; otherwise it runs them in order
+ * on the calling thread.  Returns true if every file was extracted.
+ */
+static bool runExtractJobs(const ZipArchive *pArchive,
+        MzExtractJob *jobs, unsigned int numJobs, int flags,
+        const struct utimbuf *timestamp,
+        void (*callback)(const char *fn, void *), void *cookie)
+{
+    pthread_t threads[MZ_EXTRACT_MAX_WORKERS];
+    MzExtractPool pool;
+    long numWorkers = 0;
+    int started = 0;
+    int i;
+
+    if (flags & MZ_EXTRACT_PARALLEL) {
+        numWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (numWorkers < 2) {
+            /* Even on a single core, inflate and flash writes overlap. */
+            numWorkers = 2;
+        }
+        if (numWorkers > MZ_EXTRACT_MAX_WORKERS) {
+            numWorkers = MZ_EXTRACT_MAX_WORKERS;
+        }
+        if ((unsigned int)numWorkers > numJobs) {
+            numWorkers = numJobs;
+        }
+    }
+
+    memset(&pool, 0, sizeof(pool));
+    pool.pArchive = pArchive;
+    pool.jobs = jobs;
+    pool.numJobs = numJobs;
+    pool.flags = flags;
+    pool.timestamp = timestamp;
+    pool.callback = callback;
+    pool.cookie = cookie;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    for (i = 0; i < numWorkers; i++) {
+        if (pthread_create(&threads[i], NULL, extractWorker, &pool) != 0) {
+            LOGW("Can't start extraction worker %d\n", i);
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        /* Serial mode, or no threads available: do it all here. */
+        extractWorker(&pool);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool.lock);
+    return !pool.failed && pool.nextJob == numJobs;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -903,6 +1903,9 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
         LOGE("mzExtractRecursive(): targetDir must be an absolute path.\n");
         return false;
     }
+    if (flags & MZ_EXTRACT_DEDUP_LINK) {
+        flags |= MZ_EXTRACT_DEDUP;
+    }
 
     unsigned int zipDirLen;
     char *zpath;
@@ -939,50 +1942,31 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
-    /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-//TODO: since the entries are sorted, binary search for the first match
-//      and stop after the first non-match.
+    /* In parallel, deferred or dedup mode, regular files are collected
+     * here and written once every directory and symlink exists.
      */
-    unsigned int i;
-    bool seenMatch = false;
-    int ok = true;
-    for (i = 0; i < pArchive->numEntries; i++) {
-        ZipEntry *pEntry = pArchive->pEntries + i;
-        if (pEntry->fileNameLen < zipDirLen) {
+    MzExtractJob *jobs = NULL;
+    unsigned int numJobs = 0;
+    unsigned int jobsCap = 0;
+
+    /* Most entries land in a directory we've already made; remember
+     * which ones so we don't stat every component again.  If the cache
+     * can't be allocated, dirCreateHierarchyCached() just works uncached.
+     */
+    DirCache *dirCache = dirCacheCreate();
+
+    /* Extract everything whose path begins with zpath.  The entries
+     * are sorted, so the matches form a single contiguous run.
 //TODO: look out for a single empty directory entry that matches zpath, but
 //      missing the trailing slash.  Most zip files seem to include
 //      the trailing slash, but I think it's legal to leave it off.
 //      e.g., zpath "a/b/", entry "a/b", with no children of the entry.
-            /* No chance of matching.
-             */
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* If zpath is empty, this strncmp() will match everything,
-         * which is what we want.
-         */
-        if (strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* This entry begins with zipDir, so we'll extract it.
-         */
-        seenMatch = true;
+     */
+    unsigned int i, first, numMatches;
+    int ok = true;
+    numMatches = mzFindZipEntriesWithPrefix(pArchive, zpath, &first);
+    for (i = first; i < first + numMatches; i++) {
+        ZipEntry *pEntry = pArchive->pEntries + i;
 
         /* Find the target location of the entry.
          */
@@ -1003,11 +1987,9 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 
         /* Create the file or directory.
          */
-#define UNZIP_DIRMODE 0755
-#define UNZIP_FILEMODE 0644
         if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
             if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
-                int ret = dirCreateHierarchy(
+                int ret = dirCreateHierarchyCached(dirCache,
                         targetFile, UNZIP_DIRMODE, timestamp, false);
                 if (ret != 0) {
                     LOGE("Can't create containing directory for \"%s\": %s\n",
@@ -1021,7 +2003,7 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
             /* This is not a directory.  First, make sure that
              * the containing directory exists.
              */
-            int ret = dirCreateHierarchy(
+            int ret = dirCreateHierarchyCached(dirCache,
                     targetFile, UNZIP_DIRMODE, timestamp, true);
             if (ret != 0) {
                 LOGE("Can't create containing directory for \"%s\": %s\n",
@@ -1072,39 +2054,90 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
                         targetFile, linkTarget);
                 free(linkTarget);
-            } else {
-                /* The entry is a regular file.
-                 * Open the target for writing.
+            } else if (flags & (MZ_EXTRACT_PARALLEL |
+                    MZ_EXTRACT_DEFER_METADATA | MZ_EXTRACT_DEDUP)) {
+                /* The entry is a regular file; queue it up.
                  */
-                int fd = creat(targetFile, UNZIP_FILEMODE);
-                if (fd < 0) {
-                    LOGE("Can't create target file \"%s\": %s\n",
-                            targetFile, strerror(errno));
-                    ok = false;
-                    break;
+                if (numJobs == jobsCap) {
+                    unsigned int newCap = jobsCap ? jobsCap * 2 : 64;
+                    MzExtractJob *newJobs = (MzExtractJob *)realloc(jobs,
+                            newCap * sizeof(MzExtractJob));
+                    if (newJobs == NULL) {
+                        ok = false;
+                        break;
+                    }
+                    jobs = newJobs;
+                    jobsCap = newCap;
                 }
-
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-                close(fd);
-                if (!ok) {
-                    LOGE("Error extracting \"%s\"\n", targetFile);
+                memset(&jobs[numJobs], 0, sizeof(MzExtractJob));
+                jobs[numJobs].pEntry = pEntry;
+                jobs[numJobs].targetFile = strdup(targetFile);
+                if (jobs[numJobs].targetFile == NULL) {
                     ok = false;
                     break;
                 }
-
-                if (timestamp != NULL && utime(targetFile, timestamp)) {
-                    LOGE("Error touching \"%s\"\n", targetFile);
+                numJobs++;
+                continue;
+            } else {
+                /* The entry is a regular file.
+                 */
+                if (!extractFileEntry(pArchive, pEntry, targetFile, flags,
+                        timestamp)) {
                     ok = false;
                     break;
                 }
-
-                LOGD("Extracted file \"%s\"\n", targetFile);
             }
         }
 
         if (callback != NULL) callback(targetFile, cookie);
     }
 
+    if (ok && numJobs > 0) {
+        /* Duplicates are made from the first file of their group, so
+         * they wait until all of those are out.
+         */
+        unsigned int numFirst = numJobs;
+        if (flags & MZ_EXTRACT_DEDUP) {
+            numFirst = findDuplicateJobs(jobs, numJobs);
+        }
+        ok = runExtractJobs(pArchive, jobs, numFirst, flags, timestamp,
+                callback, cookie);
+        if (ok && numFirst < numJobs) {
+            ok = runExtractJobs(pArchive, jobs + numFirst,
+                    numJobs - numFirst, flags, timestamp, callback, cookie);
+
+            unsigned int numDeduped = 0;
+            long long savedBytes = 0;
+            for (i = numFirst; i < numJobs; i++) {
+                if (jobs[i].deduped) {
+                    numDeduped++;
+                    savedBytes += jobs[i].pEntry->uncompLen;
+                }
+            }
+            LOGI("%s %u duplicate files (%lld bytes not inflated)\n",
+                    (flags & MZ_EXTRACT_DEDUP_LINK) ? "Linked or copied" :
+                    "Copied", numDeduped, savedBytes);
+        }
+    }
+    if (ok && (flags & MZ_EXTRACT_DEFER_METADATA)) {
+        /* Now that the data is all out, stamp the files in one pass
+         * and make the whole lot durable with a single sync.
+         */
+        for (i = 0; timestamp != NULL && i < numJobs; i++) {
+            if (utime(jobs[i].targetFile, timestamp)) {
+                LOGE("Error touching \"%s\"\n", jobs[i].targetFile);
+                ok = false;
+                break;
+            }
+        }
+        syncTargetFilesystem(targetDir);
+    }
+    for (i = 0; i < numJobs; i++) {
+        free(jobs[i].targetFile);
+    }
+    free(jobs);
+    dirCacheFree(dirCache);
+
     free(helper.buf);
     free(zpath);
 
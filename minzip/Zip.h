@@ -35,6 +35,27 @@ typedef struct ZipEntry {
     long         externalFileAttributes;
 } ZipEntry;
 
+/*
+ * Optional check applied to the data of every entry read through
+ * mzProcessZipEntryContents() (and so every read and extract call).
+ * All three hooks may be called from several threads at once, for
+ * different entries.
+ */
+typedef struct MzEntryVerifier {
+    /* Called before an entry is read.  Return false to refuse the entry
+     * outright; otherwise set *pState to per-entry state, or to NULL if
+     * this entry needs no check.
+     */
+    bool (*begin)(const struct MzEntryVerifier *pVerifier,
+            const ZipEntry *pEntry, void **pState);
+    /* Called with each chunk of uncompressed data, in order. */
+    void (*update)(void *state, const unsigned char *data, int dataLen);
+    /* Called once after the last chunk, or after a failed read.  Must
+     * release the state; returns true if the data checked out.
+     */
+    bool (*finish)(void *state);
+} MzEntryVerifier;
+
 /*
  * One Zip archive.  Treat as opaque.
  */
@@ -43,7 +64,8 @@ typedef struct ZipArchive {
     unsigned int numEntries;
     ZipEntry*   pEntries;
     HashTable*  pHash;          // maps file name to ZipEntry
-    MemMapping  map;
+    MemMapping  map;            // central directory only
+    const MzEntryVerifier* pVerifier;   // may be NULL
 } ZipArchive;
 
 /*
@@ -72,12 +94,42 @@ int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive);
 void mzCloseZipArchive(ZipArchive* pArchive);
 
 
+/*
+ * Install (or, with NULL, remove) a check that every entry's data must
+ * pass from now on.  Reads that fail it return false.  The verifier must
+ * outlive its use by the archive.
+ */
+void mzSetEntryVerifier(ZipArchive* pArchive,
+        const MzEntryVerifier* pVerifier);
+
+/*
+ * Get the SHA-1 of the archive's raw central directory, which covers
+ * every entry's name, size, CRC and offset.  "digest" must hold 20 bytes.
+ */
+void mzGetCentralDirectoryDigest(const ZipArchive* pArchive,
+        unsigned char* digest);
+
 /*
  * Find an entry in the Zip archive, by name.
  */
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName);
 
+/*
+ * Fill in probe-length statistics for the archive's entry name hash
+ * table, for measuring lookup cost on very large packages.
+ */
+void mzGetZipHashStats(const ZipArchive* pArchive, HashProbeStats* pStats);
+
+/*
+ * Find all entries whose names begin with "prefix" (e.g. "system/").
+ * Entries are kept sorted by name, so the matches are contiguous:
+ * on return *pFirst holds the index of the first one, suitable for
+ * mzGetZipEntryAt(), and the number of matches is returned.
+ */
+unsigned int mzFindZipEntriesWithPrefix(const ZipArchive *pArchive,
+        const char *prefix, unsigned int *pFirst);
+
 /*
  * Get the number of entries in the Zip archive.
  */
@@ -145,11 +197,62 @@ typedef bool (*ProcessZipEntryContentsFunction)(const unsigned char *data,
  * mzProcessZipEntryContents() immediately returns false.
  *
  * This is useful for calculating the hash of an entry's uncompressed contents.
+ *
+ * Entry data is read with positional I/O and never moves the archive's
+ * file offset, so concurrent calls on the same archive are safe.
  */
 bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie);
 
+/*
+ * Like mzProcessZipEntryContents(), but the entry's CRC is computed from
+ * the same output chunks as they're handed to processFunction (which may
+ * be NULL), and the call fails if it doesn't match.  Use this instead of
+ * mzIsZipEntryIntact() followed by a second pass over the data.
+ *
+ * Note processFunction has already seen all of the data by the time a
+ * mismatch is detected.
+ */
+bool mzProcessZipEntryContentsVerified(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+    void *cookie);
+
+/*
+ * Like mzProcessZipEntryContentsVerified(), but a STORED entry is handed
+ * to processFunction in slices of "sliceSize" bytes of its mapping (the
+ * last one may be shorter) instead of the default 32K, still without
+ * copying.  Deflated entries arrive in inflate-sized chunks as usual.
+ * A sliceSize of 0 picks the default.
+ */
+bool mzProcessZipEntryContentsInSlices(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, size_t sliceSize,
+    ProcessZipEntryContentsFunction processFunction, void *cookie);
+
+/*
+ * Map the contents of a STORED (uncompressed) entry straight from the
+ * package file, without copying.  On success "pMap" describes exactly
+ * mzGetZipEntryUncompLen() read-only bytes; release it with
+ * sysReleaseShmem().  Returns false if the entry is compressed or
+ * can't be mapped.
+ *
+ * Stored entries passed to mzProcessZipEntryContents() are handed to
+ * the callback from such a mapping as well, without an intermediate copy.
+ *
+ * The archive's entry verifier, if any, is not applied to the mapping.
+ */
+bool mzMapZipEntryStoredData(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, MemMapping *pMap);
+
+/*
+ * Set the size of the two read-ahead buffers used when inflating
+ * entries.  For deflated entries larger than one buffer, a reader thread
+ * fetches the next compressed block while the current one is inflated.
+ * Pass 0 to read synchronously on the calling thread instead.
+ */
+#define MZ_DEFAULT_READAHEAD_SIZE (256 * 1024)
+void mzSetReadAheadSize(size_t bufSize);
+
 /*
  * Read an entry into a buffer allocated by the caller.
  */
@@ -190,14 +293,38 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
  *
  *     MZ_EXTRACT_FILES_ONLY - only unpack files, not directories or symlinks
  *     MZ_EXTRACT_DRY_RUN - don't do anything, but do invoke the callback
+ *     MZ_EXTRACT_PARALLEL - create directories and symlinks first, then
+ *         write regular files from a pool of up to MZ_EXTRACT_MAX_WORKERS
+ *         threads
+ *     MZ_EXTRACT_DEFER_METADATA - reserve each file's space up front
+ *         (where the filesystem supports fallocate), set all timestamps
+ *         in one pass after the data is written, then sync targetDir's
+ *         filesystem once
+ *     MZ_EXTRACT_DEDUP - inflate files with the same data (same CRC,
+ *         sizes and compressed bytes) only once, and copy the first one's
+ *         file to the other paths after all the rest are written
+ *     MZ_EXTRACT_DEDUP_LINK - like MZ_EXTRACT_DEDUP, but hard link the
+ *         copies where the filesystem allows; only for trees whose files
+ *         won't get different owners or modes later
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
  * If callback is non-NULL, it will be invoked with each unpacked file.
+ * With MZ_EXTRACT_PARALLEL, regular files are reported in completion
+ * order rather than archive order; calls are serialized, so the callback
+ * doesn't need to be thread-safe.
  *
  * Returns true on success, false on failure.
  */
-enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2 };
+enum {
+    MZ_EXTRACT_FILES_ONLY = 1,
+    MZ_EXTRACT_DRY_RUN = 2,
+    MZ_EXTRACT_PARALLEL = 4,
+    MZ_EXTRACT_DEFER_METADATA = 8,
+    MZ_EXTRACT_DEDUP = 16,
+    MZ_EXTRACT_DEDUP_LINK = 32,
+};
+#define MZ_EXTRACT_MAX_WORKERS 4
 bool mzExtractRecursive(const ZipArchive *pArchive,
         const char *zipDir, const char *targetDir,
         int flags, const struct utimbuf *timestamp,
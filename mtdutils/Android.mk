@@ -6,10 +6,16 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
 	mtdutils.c \
-	mounts.c
+	mounts.c \
+	yaffs2.c
 
 LOCAL_MODULE := libmtdutils
 
+# How blocks are checked after writing: FULL, ECC, SAMPLED or DEFERRED.
+ifneq ($(BOARD_MTD_WRITE_VERIFY),)
+LOCAL_CFLAGS += -DMTD_WRITE_VERIFY_DEFAULT=MTD_VERIFY_$(BOARD_MTD_WRITE_VERIFY)
+endif
+
 include $(BUILD_STATIC_LIBRARY)
 
 include $(CLEAR_VARS)
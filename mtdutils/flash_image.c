@@ -16,9 +16,11 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #include "cutils/log.h"
@@ -27,6 +29,7 @@
 #define LOG_TAG "flash_image"
 
 #define HEADER_SIZE 2048  // size of header to compare for equality
+#define RING_SLOTS 4      // erase blocks read ahead of the writer
 
 void die(const char *msg, ...) {
     int err = errno;
@@ -52,6 +55,137 @@ void printUsage(char *programName) {
     fprintf(stderr, "		-d		delete the image file after a successful flash\n");
 }
 
+/* The image is read on one thread and written on another, through a
+ * ring of erase-block-sized buffers, so card reads overlap with NAND
+ * programming.
+ */
+typedef struct {
+    int fd;
+    size_t block_size;
+    char *slot[RING_SLOTS];
+    ssize_t len[RING_SLOTS];
+    int head, count;        // filled slots, oldest first
+    int eof, error;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    long long bytes;
+    long read_usec, write_usec;         // time spent in each stage
+    long reader_wait_usec, writer_wait_usec;
+} Pipeline;
+
+static long usec_since(const struct timeval *start) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000000L +
+            (now.tv_usec - start->tv_usec);
+}
+
+static void *reader_thread(void *cookie) {
+    Pipeline *p = (Pipeline *) cookie;
+    struct timeval t;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->eof) {
+        gettimeofday(&t, NULL);
+        while (p->count == RING_SLOTS) pthread_cond_wait(&p->cond, &p->lock);
+        p->reader_wait_usec += usec_since(&t);
+        int index = (p->head + p->count) % RING_SLOTS;
+        pthread_mutex_unlock(&p->lock);
+
+        // Fill the whole slot, so the writer mostly sees complete blocks.
+        char *data = p->slot[index];
+        ssize_t len = 0, r = 0;
+        gettimeofday(&t, NULL);
+        while (len < (ssize_t) p->block_size &&
+                (r = read(p->fd, data + len, p->block_size - len)) > 0) {
+            len += r;
+        }
+        long usec = usec_since(&t);
+
+        pthread_mutex_lock(&p->lock);
+        p->read_usec += usec;
+        if (r < 0) p->error = errno;
+        if (r <= 0) p->eof = 1;
+        if (len > 0) {
+            p->len[index] = len;
+            p->count++;
+        }
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void print_rate(const char *stage, long long bytes, long usec) {
+    long ms = usec / 1000;
+    printf("  %s: %lld KB in %ld ms (%lld KB/s)\n", stage, bytes / 1024, ms,
+            ms > 0 ? bytes / 1024 * 1000 / ms : bytes / 1024);
+}
+
+/* Copy the rest of fd to out through the pipeline.  Dies on error. */
+static void write_pipelined(int fd, MtdWriteContext *out,
+        size_t block_size, const char *partitionName) {
+    Pipeline p;
+    memset(&p, 0, sizeof(p));
+    p.fd = fd;
+    p.block_size = block_size;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+
+    int i;
+    for (i = 0; i < RING_SLOTS; ++i) {
+        p.slot[i] = malloc(block_size);
+        if (p.slot[i] == NULL) die("out of memory");
+    }
+
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, reader_thread, &p)) {
+        die("can't start reader thread");
+    }
+
+    struct timeval t;
+    pthread_mutex_lock(&p.lock);
+    for (;;) {
+        gettimeofday(&t, NULL);
+        while (p.count == 0 && !p.eof) pthread_cond_wait(&p.cond, &p.lock);
+        p.writer_wait_usec += usec_since(&t);
+        if (p.count == 0) break;
+        int index = p.head;
+        pthread_mutex_unlock(&p.lock);
+
+        gettimeofday(&t, NULL);
+        ssize_t wrote = mtd_write_data(out, p.slot[index], p.len[index]);
+        if (wrote != p.len[index]) die("error writing %s", partitionName);
+        long usec = usec_since(&t);
+
+        pthread_mutex_lock(&p.lock);
+        p.write_usec += usec;
+        p.bytes += wrote;
+        p.head = (p.head + 1) % RING_SLOTS;
+        p.count--;
+        pthread_cond_broadcast(&p.cond);
+    }
+    pthread_mutex_unlock(&p.lock);
+    pthread_join(reader, NULL);
+
+    if (p.error) {
+        errno = p.error;
+        die("error reading image");
+    }
+
+    printf("flashed %s:\n", partitionName);
+    print_rate("read", p.bytes, p.read_usec);
+    print_rate("write", p.bytes, p.write_usec);
+    printf("  reader waited %ld ms for the writer, writer waited %ld ms "
+            "for the reader\n", p.reader_wait_usec / 1000,
+            p.writer_wait_usec / 1000);
+
+    for (i = 0; i < RING_SLOTS; ++i) free(p.slot[i]);
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+}
+
 /* Read an image file and write it to a flash partition. */
 int main(int argc, char **argv) {
     const MtdPartition *ptn;
@@ -120,18 +254,18 @@ int main(int argc, char **argv) {
 
     MtdWriteContext *out = mtd_write_partition(partition);
     if (out == NULL) die("error writing %s", partitionName);
+    mtd_write_skip_unchanged(out);
 
     char buf[HEADER_SIZE];
     memset(buf, 0, headerlen);
     int wrote = mtd_write_data(out, buf, headerlen);
     if (wrote != headerlen) die("error writing %s", partitionName);
 
-    int len;
-    while ((len = read(fd, buf, sizeof(buf))) > 0) {
-        wrote = mtd_write_data(out, buf, len);
-        if (wrote != len) die("error writing %s", partitionName);
-    }
-    if (len < 0) die("error reading %s", imageFile);
+    size_t block_size;
+    if (mtd_partition_info(partition, NULL, &block_size, NULL))
+        die("error getting %s block size", partitionName);
+
+    write_pipelined(fd, out, block_size, partitionName);
 
     if (mtd_write_close(out)) die("error closing %s", partitionName);
 
@@ -139,18 +273,16 @@ int main(int argc, char **argv) {
 
     out = mtd_write_partition(partition);
     if (out == NULL) die("error re-opening %s", partitionName);
+    mtd_write_skip_unchanged(out);
 
     wrote = mtd_write_data(out, header, headerlen);
     if (wrote != headerlen) die("error re-writing %s", partitionName);
 
     // Need to write a complete block, so write the rest of the first block
-    size_t block_size;
-    if (mtd_partition_info(partition, NULL, &block_size, NULL))
-        die("error getting %s block size", partitionName);
-
     if (lseek(fd, headerlen, SEEK_SET) != headerlen)
         die("error rewinding %s", imageFile);
 
+    int len;
     int left = block_size - headerlen;
     while (left < 0) left += block_size;
     while (left > 0) {
@@ -19,6 +19,8 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <unistd.h>
 #include <sys/mount.h>
 
 #include "mounts.h"
@@ -34,12 +36,16 @@ typedef struct {
     MountedVolume *volumes;
     int volumes_allocd;
     int volume_count;
+    int fd;         // /proc/mounts, kept open to poll() for changes
+    int valid;      // volumes matches /proc/mounts as of the last poll()
 } MountsState;
 
 static MountsState g_mounts_state = {
     NULL,   // volumes
     0,      // volumes_allocd
-    0       // volume_count
+    0,      // volume_count
+    -1,     // fd
+    0       // valid
 };
 
 static inline void
@@ -56,13 +62,125 @@ free_volume_internals(const MountedVolume *volume, int zero)
 
 #define PROC_MOUNTS_FILENAME   "/proc/mounts"
 
+/* The kernel flags an open /proc/mounts with POLLPRI|POLLERR when the
+ * mount table changes, and clears it for that file when it's polled.
+ * Returns 1 if the table may have changed since the last call.
+ */
+static int
+mounts_changed(void)
+{
+    if (g_mounts_state.fd < 0) {
+        g_mounts_state.fd = open(PROC_MOUNTS_FILENAME, O_RDONLY);
+        if (g_mounts_state.fd < 0) {
+            return 1;
+        }
+        fcntl(g_mounts_state.fd, F_SETFD, FD_CLOEXEC);
+        /* Clear the initial event; we're about to read it all anyway. */
+        struct pollfd pfd = { g_mounts_state.fd, POLLPRI, 0 };
+        poll(&pfd, 1, 0);
+        return 1;
+    }
+    struct pollfd pfd = { g_mounts_state.fd, POLLPRI, 0 };
+    int n = poll(&pfd, 1, 0);
+    return n != 0 || !g_mounts_state.valid;
+}
+
+/* Read all of /proc/mounts into a malloc()ed, NUL-terminated buffer.
+ */
+static char *
+read_mounts(void)
+{
+    size_t size = 4096, len = 0;
+    char *buf = malloc(size);
+    int fd = g_mounts_state.fd;
+    int own_fd = 0;
+
+    if (fd >= 0) {
+        if (lseek(fd, 0, SEEK_SET) != 0) {
+            fd = -1;
+        }
+    }
+    if (fd < 0) {
+        fd = open(PROC_MOUNTS_FILENAME, O_RDONLY);
+        own_fd = 1;
+    }
+    if (fd < 0 || buf == NULL) {
+        goto fail;
+    }
+    for (;;) {
+        if (len + 1 >= size) {
+            char *bigger = realloc(buf, size * 2);
+            if (bigger == NULL) {
+                errno = ENOMEM;
+                goto fail;
+            }
+            buf = bigger;
+            size *= 2;
+        }
+        ssize_t nbytes = read(fd, buf + len, size - len - 1);
+        if (nbytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nbytes < 0) {
+            goto fail;
+        }
+        if (nbytes == 0) {
+            break;
+        }
+        len += nbytes;
+    }
+    buf[len] = '\0';
+    if (own_fd) {
+        close(fd);
+    }
+    return buf;
+
+fail:
+    if (own_fd && fd >= 0) {
+        close(fd);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Add a volume to the table, growing it if need be.
+ */
+static int
+add_volume(const char *device, const char *mount_point,
+        const char *filesystem, const char *flags)
+{
+    if (g_mounts_state.volume_count == g_mounts_state.volumes_allocd) {
+        int numv = g_mounts_state.volumes_allocd * 2;
+        MountedVolume *volumes = realloc(g_mounts_state.volumes,
+                numv * sizeof(*volumes));
+        if (volumes == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(volumes + g_mounts_state.volumes_allocd, 0,
+                (numv - g_mounts_state.volumes_allocd) * sizeof(*volumes));
+        g_mounts_state.volumes = volumes;
+        g_mounts_state.volumes_allocd = numv;
+    }
+    MountedVolume *v = &g_mounts_state.volumes[g_mounts_state.volume_count++];
+    v->device = strdup(device);
+    v->mount_point = strdup(mount_point);
+    v->filesystem = strdup(filesystem);
+    v->flags = strdup(flags);
+    return 0;
+}
+
+/* Make the volume table match /proc/mounts.  The table is kept until the
+ * kernel says the mount table has changed, so calling this often is
+ * cheap.  Pointers from the find_mounted_volume_*() functions are only
+ * good until the next call that does rescan.
+ */
 int
 scan_mounted_volumes()
 {
-    char buf[2048];
-    const char *bufp;
-    int fd;
-    ssize_t nbytes;
+    char *buf;
+    char *line, *save_line;
+    int changed = mounts_changed();
 
     if (g_mounts_state.volumes == NULL) {
         const int numv = 32;
@@ -74,28 +192,23 @@ scan_mounted_volumes()
         g_mounts_state.volumes = volumes;
         g_mounts_state.volumes_allocd = numv;
         memset(volumes, 0, numv * sizeof(*volumes));
-    } else {
-        /* Free the old volume strings.
-         */
-        int i;
-        for (i = 0; i < g_mounts_state.volume_count; i++) {
-            free_volume_internals(&g_mounts_state.volumes[i], 1);
-        }
+    } else if (!changed) {
+        return 0;
     }
-    g_mounts_state.volume_count = 0;
 
-    /* Open and read the file contents.
+    /* Free the old volume strings.
      */
-    fd = open(PROC_MOUNTS_FILENAME, O_RDONLY);
-    if (fd < 0) {
-        goto bail;
+    int i;
+    for (i = 0; i < g_mounts_state.volume_count; i++) {
+        free_volume_internals(&g_mounts_state.volumes[i], 1);
     }
-    nbytes = read(fd, buf, sizeof(buf) - 1);
-    close(fd);
-    if (nbytes < 0) {
-        goto bail;
+    g_mounts_state.volume_count = 0;
+    g_mounts_state.valid = 0;
+
+    buf = read_mounts();
+    if (buf == NULL) {
+        return -1;
     }
-    buf[nbytes] = '\0';
 
     /* Parse the contents of the file, which looks like:
      *
@@ -111,53 +224,27 @@ scan_mounted_volumes()
      * The zeroes at the end are dummy placeholder fields to make the
      * output match Linux's /etc/mtab, but don't represent anything here.
      */
-    bufp = buf;
-    while (nbytes > 0) {
-        char device[64];
-        char mount_point[64];
-        char filesystem[64];
-        char flags[128];
-        int matches;
-
-        /* %as is a gnu extension that malloc()s a string for each field.
-         */
-        matches = sscanf(bufp, "%63s %63s %63s %127s",
-                device, mount_point, filesystem, flags);
-
-        if (matches == 4) {
-            device[sizeof(device)-1] = '\0';
-            mount_point[sizeof(mount_point)-1] = '\0';
-            filesystem[sizeof(filesystem)-1] = '\0';
-            flags[sizeof(flags)-1] = '\0';
-
-            MountedVolume *v =
-                    &g_mounts_state.volumes[g_mounts_state.volume_count++];
-            v->device = strdup(device);
-            v->mount_point = strdup(mount_point);
-            v->filesystem = strdup(filesystem);
-            v->flags = strdup(flags);
-        } else {
-printf("matches was %d on <<%.40s>>\n", matches, bufp);
-        }
+    for (line = strtok_r(buf, "\n", &save_line); line != NULL;
+         line = strtok_r(NULL, "\n", &save_line)) {
+        char *save_field;
+        char *device = strtok_r(line, " \t", &save_field);
+        char *mount_point = strtok_r(NULL, " \t", &save_field);
+        char *filesystem = strtok_r(NULL, " \t", &save_field);
+        char *flags = strtok_r(NULL, " \t", &save_field);
 
-        /* Eat the line.
-         */
-        while (nbytes > 0 && *bufp != '\n') {
-            bufp++;
-            nbytes--;
+        if (flags == NULL) {
+            printf("can't parse mount <<%.40s>>\n", line);
+            continue;
         }
-        if (nbytes > 0) {
-            bufp++;
-            nbytes--;
+        if (add_volume(device, mount_point, filesystem, flags) != 0) {
+            free(buf);
+            return -1;
         }
     }
+    free(buf);
 
+    g_mounts_state.valid = 1;
     return 0;
-
-bail:
-//TODO: free the strings we've allocated.
-    g_mounts_state.volume_count = 0;
-    return -1;
 }
 
 const MountedVolume *
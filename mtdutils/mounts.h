@@ -19,6 +19,11 @@
 
 typedef struct MountedVolume MountedVolume;
 
+/* The volume table is global and not locked: a rescan frees the volumes
+ * an earlier find_mounted_volume_*() returned.  Callers on more than one
+ * thread must hold a lock of their own from the scan until they're done
+ * with the volume (see roots.c and updater/install.c).
+ */
 int scan_mounted_volumes(void);
 
 const MountedVolume *find_mounted_volume_by_device(const char *device);
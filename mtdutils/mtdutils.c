@@ -20,8 +20,12 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <mtd/mtd-user.h>
 #undef NDEBUG
 #include <assert.h>
@@ -33,20 +37,103 @@ struct MtdPartition {
     unsigned int size;
     unsigned int erase_size;
     char *name;
+    unsigned char *bad_map;     // per block: BLOCK_UNKNOWN, _GOOD, _BAD
+                                // or _ERASED
 };
 
+/* BLOCK_ERASED is a good block that has been erased (or found blank)
+ * and not written since, as far as this process knows.
+ */
+enum { BLOCK_UNKNOWN = 0, BLOCK_GOOD, BLOCK_BAD, BLOCK_ERASED };
+
+/* Reads are done this many erase blocks at a time where possible. */
+#define READ_BATCH_BLOCKS 8
+
 struct MtdReadContext {
     const MtdPartition *partition;
-    char *buffer;
+    char *buffer;           // READ_BATCH_BLOCKS blocks
+    size_t buffered;
     size_t consumed;
     int fd;
 };
 
+/* How many blocks the eraser thread may have erased ahead of the writer. */
+#define ERASE_AHEAD_BLOCKS 8
+
+/* Erases blocks on a helper thread, ahead of the writer, so the slow
+ * NAND erase overlaps with transferring the previous block.  Blocks are
+ * only ever erased if data for them has already been handed to
+ * mtd_write_data(), so nothing past the end of the image is touched.
+ */
+typedef struct {
+    pthread_t thread;
+    int running;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    off_t write_pos;        // block the writer is on (or will start on)
+    off_t next_erase;       // where the eraser picks up
+    off_t erasing_start;    // run being erased right now (empty if equal)
+    off_t erasing_end;
+    off_t queue[ERASE_AHEAD_BLOCKS];  // erased blocks, ascending
+    int queued;
+
+    size_t accepted;        // bytes handed to mtd_write_data()
+    size_t blocks_written;
+} EraseAhead;
+
+#ifndef MTD_WRITE_VERIFY_DEFAULT
+#define MTD_WRITE_VERIFY_DEFAULT MTD_VERIFY_FULL
+#endif
+
+/* With MTD_VERIFY_SAMPLED, every this-many'th page of a block (and the
+ * last one) is read back and compared.
+ */
+#define MTD_VERIFY_SAMPLE_STRIDE 8
+
+// A block written under MTD_VERIFY_DEFERRED, to be checked at close.
+typedef struct {
+    off_t pos;
+    unsigned int sum;
+} WrittenBlock;
+
 struct MtdWriteContext {
     const MtdPartition *partition;
     char *buffer;
     size_t stored;
     int fd;
+    EraseAhead ahead;
+
+    MtdVerifyMode verify;
+    char *verify_buffer;
+    size_t page_size;
+    WrittenBlock *written;
+    int written_count;
+    int written_alloc;
+
+    size_t blocks;          // blocks successfully written
+    struct timeval start;
+    long verify_usec;       // time spent checking them
+
+    int skip_unchanged;
+    size_t skipped;         // blocks left alone because they matched
+    size_t erase_skipped;   // blocks mtd_erase_blocks() found erased
+
+    // Set by mtd_write_with_oob(): the caller's records (a page, then
+    // oob_len bytes of spare data) are gathered in record_buffer, and
+    // split into the block's pages, in buffer, and each page's oob_len
+    // spare bytes, in oob_buffer, for MEMWRITE to place.
+    size_t oob_len;
+    size_t oob_size;        // the device's spare bytes per page
+    struct nand_oobfree oob_free[MTD_MAX_OOBFREE_ENTRIES];
+    int oob_free_count;
+    char *record_buffer;
+    size_t record_stored;
+    char *oob_buffer;
+    int oob_written;        // MEMWRITE has worked on this device
+    size_t oob_deferred;    // bytes kept from the eraser until it has
+                            // (see write_records())
 };
 
 typedef struct {
@@ -61,16 +148,26 @@ static MtdState g_mtd_state = {
     -1      // partition_count
 };
 
+static int g_verify_mode = -1;  // not chosen yet
+
+// Guards the bad block maps, which the eraser thread also consults.
+static pthread_mutex_t g_bad_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
 #define MTD_PROC_FILENAME   "/proc/mtd"
 
 int
 mtd_scan_partitions()
 {
-    char buf[2048];
+    char buf[4096];
     const char *bufp;
     int fd;
     int i;
-    ssize_t nbytes;
+    ssize_t nbytes, r = 0;
+
+    // The partition table doesn't change under us; only read it once.
+    if (g_mtd_state.partition_count >= 0) {
+        return g_mtd_state.partition_count;
+    }
 
     if (g_mtd_state.partitions == NULL) {
         const int nump = 32;
@@ -95,6 +192,10 @@ mtd_scan_partitions()
             free(p->name);
             p->name = NULL;
         }
+        pthread_mutex_lock(&g_bad_map_lock);
+        free(p->bad_map);
+        p->bad_map = NULL;
+        pthread_mutex_unlock(&g_bad_map_lock);
         p->device_index = -1;
     }
 
@@ -104,9 +205,13 @@ mtd_scan_partitions()
     if (fd < 0) {
         goto bail;
     }
-    nbytes = read(fd, buf, sizeof(buf) - 1);
+    nbytes = 0;
+    while (nbytes < (ssize_t) sizeof(buf) - 1 &&
+            (r = read(fd, buf + nbytes, sizeof(buf) - 1 - nbytes)) > 0) {
+        nbytes += r;
+    }
     close(fd);
-    if (nbytes < 0) {
+    if (r < 0) {
         goto bail;
     }
     buf[nbytes] = '\0';
@@ -135,7 +240,8 @@ mtd_scan_partitions()
         /* This will fail on the first line, which just contains
          * column headers.
          */
-        if (matches == 4) {
+        if (matches == 4 && mtdnum >= 0 &&
+                mtdnum < g_mtd_state.partitions_allocd) {
             MtdPartition *p = &g_mtd_state.partitions[mtdnum];
             p->device_index = mtdnum;
             p->size = mtdsize;
@@ -168,6 +274,88 @@ bail:
     return -1;
 }
 
+void
+mtd_invalidate_partitions()
+{
+    g_mtd_state.partition_count = -1;
+}
+
+/* Returns nonzero if the block at pos is marked bad.  Answers come from
+ * the partition's bad block map once a block has been asked about.
+ */
+static int is_bad_block(const MtdPartition *partition, int fd, off_t pos)
+{
+    MtdPartition *p = (MtdPartition *) partition;
+    size_t block = pos / p->erase_size;
+    size_t blocks = p->size / p->erase_size;
+    int state = BLOCK_UNKNOWN;
+
+    pthread_mutex_lock(&g_bad_map_lock);
+    if (p->bad_map == NULL) p->bad_map = calloc(blocks, 1);
+    if (p->bad_map != NULL && block < blocks) state = p->bad_map[block];
+    pthread_mutex_unlock(&g_bad_map_lock);
+    if (state != BLOCK_UNKNOWN) return state == BLOCK_BAD;
+
+    loff_t bpos = pos;
+    int r = ioctl(fd, MEMGETBADBLOCK, &bpos);
+    if (r < 0) return 0;  // don't remember errors
+    state = r > 0 ? BLOCK_BAD : BLOCK_GOOD;
+
+    pthread_mutex_lock(&g_bad_map_lock);
+    if (p->bad_map != NULL && block < blocks) p->bad_map[block] = state;
+    pthread_mutex_unlock(&g_bad_map_lock);
+    return state == BLOCK_BAD;
+}
+
+/* Records whether the good block at pos is known to be erased.
+ */
+static void set_block_erased(const MtdPartition *partition, off_t pos,
+        int erased)
+{
+    MtdPartition *p = (MtdPartition *) partition;
+    size_t block = pos / p->erase_size;
+    size_t blocks = p->size / p->erase_size;
+
+    pthread_mutex_lock(&g_bad_map_lock);
+    if (p->bad_map == NULL && erased) p->bad_map = calloc(blocks, 1);
+    if (p->bad_map != NULL && block < blocks) {
+        if (erased) {
+            p->bad_map[block] = BLOCK_ERASED;
+        } else if (p->bad_map[block] == BLOCK_ERASED) {
+            p->bad_map[block] = BLOCK_GOOD;
+        }
+    }
+    pthread_mutex_unlock(&g_bad_map_lock);
+}
+
+static int is_erased_block(const MtdPartition *partition, off_t pos)
+{
+    size_t block = pos / partition->erase_size;
+    int erased;
+
+    pthread_mutex_lock(&g_bad_map_lock);
+    erased = partition->bad_map != NULL &&
+            block < partition->size / partition->erase_size &&
+            partition->bad_map[block] == BLOCK_ERASED;
+    pthread_mutex_unlock(&g_bad_map_lock);
+    return erased;
+}
+
+/* Called when something other than mtdutils may write the partition. */
+static void forget_erased_blocks(const MtdPartition *partition)
+{
+    size_t blocks = partition->size / partition->erase_size;
+    size_t i;
+
+    pthread_mutex_lock(&g_bad_map_lock);
+    for (i = 0; partition->bad_map != NULL && i < blocks; ++i) {
+        if (partition->bad_map[i] == BLOCK_ERASED) {
+            partition->bad_map[i] = BLOCK_GOOD;
+        }
+    }
+    pthread_mutex_unlock(&g_bad_map_lock);
+}
+
 const MtdPartition *
 mtd_find_partition_by_name(const char *name)
 {
@@ -185,6 +373,8 @@ mtd_find_partition_by_name(const char *name)
     return NULL;
 }
 
+static void forget_cached_digests(const MtdPartition *partition);
+
 int
 mtd_mount_partition(const MtdPartition *partition, const char *mount_point,
         const char *filesystem, int read_only)
@@ -195,6 +385,8 @@ mtd_mount_partition(const MtdPartition *partition, const char *mount_point,
 
     sprintf(devname, "/dev/block/mtdblock%d", partition->device_index);
     if (!read_only) {
+        forget_cached_digests(partition);
+        forget_erased_blocks(partition);
         rv = mount(devname, mount_point, filesystem, flags, NULL);
     }
     if (read_only || rv < 0) {
@@ -255,7 +447,7 @@ MtdReadContext *mtd_read_partition(const MtdPartition *partition)
     MtdReadContext *ctx = (MtdReadContext*) malloc(sizeof(MtdReadContext));
     if (ctx == NULL) return NULL;
 
-    ctx->buffer = malloc(partition->erase_size);
+    ctx->buffer = malloc(partition->erase_size * READ_BATCH_BLOCKS);
     if (ctx->buffer == NULL) {
         free(ctx);
         return NULL;
@@ -265,16 +457,40 @@ MtdReadContext *mtd_read_partition(const MtdPartition *partition)
     sprintf(mtddevname, "/dev/mtd/mtd%d", partition->device_index);
     ctx->fd = open(mtddevname, O_RDONLY);
     if (ctx->fd < 0) {
-        free(ctx);
         free(ctx->buffer);
+        free(ctx);
         return NULL;
     }
 
     ctx->partition = partition;
-    ctx->consumed = partition->erase_size;
+    ctx->buffered = ctx->consumed = 0;
     return ctx;
 }
 
+static int is_zero_block(const char *data, size_t size)
+{
+    // Bytes up to word alignment, then eight words per test.
+    while (size > 0 && ((unsigned long) data & (sizeof(long) - 1)) != 0) {
+        if (*data++ != 0) return 0;
+        --size;
+    }
+    const unsigned long *words = (const unsigned long *) data;
+    while (size >= 8 * sizeof(long)) {
+        if ((words[0] | words[1] | words[2] | words[3] |
+             words[4] | words[5] | words[6] | words[7]) != 0) {
+            return 0;
+        }
+        words += 8;
+        size -= 8 * sizeof(long);
+    }
+    data = (const char *) words;
+    while (size > 0) {
+        if (*data++ != 0) return 0;
+        --size;
+    }
+    return 1;
+}
+
 static int read_block(const MtdPartition *partition, int fd, char *data)
 {
     struct mtd_ecc_stats before, after;
@@ -296,13 +512,10 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
             fprintf(stderr, "mtd: ECC errors (%d soft, %d hard) at 0x%08lx\n",
                     after.corrected - before.corrected,
                     after.failed - before.failed, pos);
+            before = after;  // so the next block is judged on its own
+        } else if (!is_zero_block(data, size)) {
+            return 0;  // Success!
         } else {
-            int i;
-            for (i = 0; i < size; ++i) {
-                if (data[i] != 0) {
-                    return 0;  // Success!
-                }
-            }
             fprintf(stderr, "mtd: read all-zero block at 0x%08lx; skipping\n",
                     pos);
         }
@@ -314,34 +527,93 @@ static int read_block(const MtdPartition *partition, int fd, char *data)
     return -1;
 }
 
+/* Reads up to max_blocks good blocks into data with a single read(),
+ * checking the ECC counters once for the whole batch.  If anything in
+ * the batch went wrong, falls back to read_block() for its first block
+ * so the bad one gets skipped.  All-zero blocks are dropped as usual.
+ * Returns the number of blocks stored in data (at least one), or -1.
+ */
+static int read_blocks(const MtdPartition *partition, int fd, char *data,
+        int max_blocks)
+{
+    ssize_t size = partition->erase_size;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos == (off_t) -1) return -1;
+
+    while (pos + size <= (int) partition->size) {
+        int count = (partition->size - pos) / size;
+        if (count > max_blocks) count = max_blocks;
+        if (count == 1) break;
+
+        struct mtd_ecc_stats before, after;
+        if (ioctl(fd, ECCGETSTATS, &before)) {
+            fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+            return -1;
+        }
+        if (lseek(fd, pos, SEEK_SET) != pos ||
+            read(fd, data, count * size) != count * size) {
+            break;
+        }
+        if (ioctl(fd, ECCGETSTATS, &after)) {
+            fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+            return -1;
+        }
+        if (after.failed != before.failed) break;
+
+        int i, good = 0;
+        for (i = 0; i < count; ++i) {
+            char *block = data + i * size;
+            if (is_zero_block(block, size)) {
+                fprintf(stderr, "mtd: read all-zero block at 0x%08lx; "
+                        "skipping\n", pos + i * size);
+                continue;
+            }
+            if (good != i) memmove(data + good * size, block, size);
+            ++good;
+        }
+        pos += count * size;
+        if (good > 0) return good;
+    }
+
+    // Go one block at a time, starting from where the batch began.
+    if (lseek(fd, pos, SEEK_SET) != pos) return -1;
+    return read_block(partition, fd, data) ? -1 : 1;
+}
+
 ssize_t mtd_read_data(MtdReadContext *ctx, char *data, size_t len)
 {
+    const size_t esize = ctx->partition->erase_size;
     ssize_t read = 0;
     while (read < (int) len) {
-        if (ctx->consumed < ctx->partition->erase_size) {
-            size_t avail = ctx->partition->erase_size - ctx->consumed;
+        if (ctx->consumed < ctx->buffered) {
+            size_t avail = ctx->buffered - ctx->consumed;
             size_t copy = len - read < avail ? len - read : avail;
             memcpy(data + read, ctx->buffer + ctx->consumed, copy);
             ctx->consumed += copy;
             read += copy;
         }
 
-        // Read complete blocks directly into the user's buffer
-        while (ctx->consumed == ctx->partition->erase_size &&
-               len - read >= ctx->partition->erase_size) {
-            if (read_block(ctx->partition, ctx->fd, data + read)) return -1;
-            read += ctx->partition->erase_size;
-        }
-
-        if (read >= len) {
+        if (read >= (int) len) {
             return read;
         }
 
-        // Read the next block into the buffer
-        if (ctx->consumed == ctx->partition->erase_size && read < (int) len) {
-            if (read_block(ctx->partition, ctx->fd, ctx->buffer)) return -1;
-            ctx->consumed = 0;
+        // Read complete blocks directly into the user's buffer, unless
+        // it only has room for one; then batching through ours is cheaper.
+        if (len - read >= 2 * esize) {
+            size_t want = (len - read) / esize;
+            int got = read_blocks(ctx->partition, ctx->fd, data + read,
+                    want < READ_BATCH_BLOCKS ? want : READ_BATCH_BLOCKS);
+            if (got < 0) return -1;
+            read += got * esize;
+            continue;
         }
+
+        // Read the next batch into the buffer
+        int got = read_blocks(ctx->partition, ctx->fd, ctx->buffer,
+                READ_BATCH_BLOCKS);
+        if (got < 0) return -1;
+        ctx->buffered = got * esize;
+        ctx->consumed = 0;
     }
 
     return read;
@@ -354,13 +626,394 @@ void mtd_read_close(MtdReadContext *ctx)
     free(ctx);
 }
 
+/* One file per (partition, length), holding the digest.  /tmp is the
+ * ramdisk, so they go away at reboot, and every process sees the same
+ * ones: recovery, the updater and applypatch.
+ */
+#define DIGEST_CACHE_DIR "/tmp/mtd-digests"
+
+static void digest_cache_path(const MtdPartition *partition, size_t len,
+        char *path, size_t size)
+{
+    snprintf(path, size, DIGEST_CACHE_DIR "/%s.%lu", partition->name,
+            (unsigned long) len);
+}
+
+int mtd_get_cached_digest(const MtdPartition *partition, size_t len,
+        unsigned char *digest, size_t digest_len)
+{
+    char path[PATH_MAX];
+    digest_cache_path(partition, len, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    ssize_t got = read(fd, digest, digest_len);
+    close(fd);
+    return got == (ssize_t) digest_len ? 0 : -1;
+}
+
+void mtd_put_cached_digest(const MtdPartition *partition, size_t len,
+        const unsigned char *digest, size_t digest_len)
+{
+    char path[PATH_MAX], temp[PATH_MAX];
+    digest_cache_path(partition, len, path, sizeof(path));
+    snprintf(temp, sizeof(temp), "%s.%d", path, getpid());
+
+    mkdir(DIGEST_CACHE_DIR, 0700);
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return;
+    ssize_t wrote = write(fd, digest, digest_len);
+    close(fd);
+    if (wrote != (ssize_t) digest_len || rename(temp, path) != 0) {
+        unlink(temp);
+    }
+}
+
+/* Called whenever the partition may change. */
+static void forget_cached_digests(const MtdPartition *partition)
+{
+    DIR *dir = opendir(DIGEST_CACHE_DIR);
+    if (dir == NULL) return;
+
+    size_t name_len = strlen(partition->name);
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strncmp(de->d_name, partition->name, name_len) == 0 &&
+            de->d_name[name_len] == '.') {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), DIGEST_CACHE_DIR "/%s", de->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+static int erase_range(int fd, off_t start, off_t length)
+{
+    struct erase_info_user erase_info;
+    erase_info.start = start;
+    erase_info.length = length;
+    return ioctl(fd, MEMERASE, &erase_info);
+}
+
+// Blocks the writer still has data for, counting the one it's on.
+static int erase_ahead_pending_locked(const MtdWriteContext *ctx)
+{
+    size_t esize = ctx->partition->erase_size;
+    size_t blocks = (ctx->ahead.accepted + esize - 1) / esize;
+    return blocks > ctx->ahead.blocks_written ?
+            (int) (blocks - ctx->ahead.blocks_written) : 0;
+}
+
+static void *erase_ahead_thread(void *cookie)
+{
+    MtdWriteContext *ctx = (MtdWriteContext *) cookie;
+    EraseAhead *a = &ctx->ahead;
+    const off_t esize = ctx->partition->erase_size;
+    const off_t limit = ctx->partition->size;
+
+    pthread_mutex_lock(&a->lock);
+    while (!a->stop) {
+        // Never erase the writer's current block, or more blocks than
+        // there's data for.
+        int want = erase_ahead_pending_locked(ctx) - 1 - a->queued;
+        if (want > ERASE_AHEAD_BLOCKS - a->queued) {
+            want = ERASE_AHEAD_BLOCKS - a->queued;
+        }
+        off_t start = a->next_erase;
+        if (start <= a->write_pos) start = a->write_pos + esize;
+        if (want <= 0 || start + esize > limit) {
+            pthread_cond_wait(&a->cond, &a->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&a->lock);
+
+        // Find a run of good blocks to erase with one ioctl.
+        off_t end;
+        while (start + esize <= limit &&
+                is_bad_block(ctx->partition, ctx->fd, start)) {
+            start += esize;
+        }
+        for (end = start; end + esize <= limit && (end - start) / esize < want;
+                end += esize) {
+            if (is_bad_block(ctx->partition, ctx->fd, end)) break;
+        }
+
+        pthread_mutex_lock(&a->lock);
+        if (a->stop) break;
+        if (end == start) {
+            a->next_erase = start + esize;  // skip past the bad block
+            continue;
+        }
+        if (a->write_pos >= start) {
+            // The writer got here first; start over from where it is.
+            a->next_erase = a->write_pos + esize;
+            continue;
+        }
+        a->erasing_start = start;
+        a->erasing_end = end;
+        pthread_mutex_unlock(&a->lock);
+
+        off_t pos;
+        int ok = erase_range(ctx->fd, start, end - start) == 0;
+
+        pthread_mutex_lock(&a->lock);
+        for (pos = start; pos < end; pos += esize) {
+            // If the batch failed, fall back to one block at a time and
+            // leave any that won't erase for the writer to deal with.
+            if (!ok) {
+                pthread_mutex_unlock(&a->lock);
+                int r = erase_range(ctx->fd, pos, esize);
+                pthread_mutex_lock(&a->lock);
+                if (r != 0) continue;
+            }
+            a->queue[a->queued++] = pos;
+        }
+        a->next_erase = end;
+        a->erasing_start = a->erasing_end = 0;
+        pthread_cond_broadcast(&a->cond);
+    }
+    pthread_mutex_unlock(&a->lock);
+    return NULL;
+}
+
+static void erase_ahead_start(MtdWriteContext *ctx)
+{
+    EraseAhead *a = &ctx->ahead;
+    memset(a, 0, sizeof(*a));
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->cond, NULL);
+    a->running = pthread_create(&a->thread, NULL,
+            erase_ahead_thread, ctx) == 0;
+}
+
+static void erase_ahead_stop(MtdWriteContext *ctx)
+{
+    EraseAhead *a = &ctx->ahead;
+    if (a->running) {
+        pthread_mutex_lock(&a->lock);
+        a->stop = 1;
+        pthread_cond_broadcast(&a->cond);
+        pthread_mutex_unlock(&a->lock);
+        pthread_join(a->thread, NULL);
+        a->running = 0;
+    }
+}
+
+// Called by the writer before it writes the block at pos.  Returns
+// nonzero if the block has already been erased for it.
+static int erase_ahead_claim(MtdWriteContext *ctx, off_t pos)
+{
+    EraseAhead *a = &ctx->ahead;
+    int erased = 0;
+    if (!a->running) return 0;
+
+    pthread_mutex_lock(&a->lock);
+    a->write_pos = pos;
+    while (pos >= a->erasing_start && pos < a->erasing_end) {
+        pthread_cond_wait(&a->cond, &a->lock);
+    }
+    while (a->queued > 0 && a->queue[0] <= pos) {
+        if (a->queue[0] == pos) erased = 1;
+        memmove(a->queue, a->queue + 1, --a->queued * sizeof(off_t));
+    }
+    pthread_cond_broadcast(&a->cond);
+    pthread_mutex_unlock(&a->lock);
+    return erased;
+}
+
+static void erase_ahead_update(MtdWriteContext *ctx,
+        size_t accepted, size_t written)
+{
+    EraseAhead *a = &ctx->ahead;
+    if (!a->running) return;
+
+    pthread_mutex_lock(&a->lock);
+    a->accepted += accepted;
+    a->blocks_written += written;
+    pthread_cond_broadcast(&a->cond);
+    pthread_mutex_unlock(&a->lock);
+}
+
+static const char *verify_mode_names[] = {
+    "full", "ecc", "sampled", "deferred",
+};
+
+int mtd_parse_verify_mode(const char *name, MtdVerifyMode *mode)
+{
+    unsigned int i;
+    for (i = 0; i < sizeof(verify_mode_names) / sizeof(verify_mode_names[0]);
+            ++i) {
+        if (strcmp(name, verify_mode_names[i]) == 0) {
+            *mode = (MtdVerifyMode) i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void mtd_set_write_verify(MtdVerifyMode mode)
+{
+    g_verify_mode = mode;
+}
+
+static MtdVerifyMode get_write_verify(void)
+{
+    if (g_verify_mode < 0) {
+        MtdVerifyMode mode = MTD_WRITE_VERIFY_DEFAULT;
+        const char *env = getenv("MTD_WRITE_VERIFY");
+        if (env != NULL && mtd_parse_verify_mode(env, &mode)) {
+            fprintf(stderr, "mtd: unknown MTD_WRITE_VERIFY \"%s\"\n", env);
+        }
+        g_verify_mode = mode;
+    }
+    return (MtdVerifyMode) g_verify_mode;
+}
+
+static long usec_since(const struct timeval *start)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000000L +
+            (now.tv_usec - start->tv_usec);
+}
+
+// FNV-1a over 32-bit words; the erase size is always a multiple of 4.
+static unsigned int block_checksum(const char *data, size_t size)
+{
+    const unsigned int *words = (const unsigned int *) data;
+    unsigned int sum = 2166136261u;
+    size_t i;
+    for (i = 0; i < size / sizeof(*words); ++i) {
+        sum = (sum ^ words[i]) * 16777619u;
+    }
+    return sum;
+}
+
+// Reads back (part of) the block just written at pos and checks it
+// according to the context's verify mode.  Returns 0 if it's good.
+static int verify_block(MtdWriteContext *ctx, off_t pos, const char *data)
+{
+    int fd = ctx->fd;
+    ssize_t size = ctx->partition->erase_size;
+    char *verify = ctx->verify_buffer;
+    struct mtd_ecc_stats before, after;
+
+    switch (ctx->verify) {
+    case MTD_VERIFY_DEFERRED:
+        if (ctx->written_count == ctx->written_alloc) {
+            int alloc = ctx->written_alloc ? ctx->written_alloc * 2 : 64;
+            WrittenBlock *w = (WrittenBlock *)
+                    realloc(ctx->written, alloc * sizeof(WrittenBlock));
+            if (w == NULL) return -1;
+            ctx->written = w;
+            ctx->written_alloc = alloc;
+        }
+        ctx->written[ctx->written_count].pos = pos;
+        ctx->written[ctx->written_count].sum = block_checksum(data, size);
+        ctx->written_count++;
+        return 0;
+
+    case MTD_VERIFY_ECC:
+        if (ioctl(fd, ECCGETSTATS, &before)) {
+            fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+            return -1;
+        }
+        if (lseek(fd, pos, SEEK_SET) != pos ||
+            read(fd, verify, size) != size) {
+            fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
+                    pos, strerror(errno));
+            return -1;
+        }
+        if (ioctl(fd, ECCGETSTATS, &after)) {
+            fprintf(stderr, "mtd: ECCGETSTATS error (%s)\n", strerror(errno));
+            return -1;
+        }
+        if (after.failed != before.failed) {
+            fprintf(stderr, "mtd: ECC errors (%d soft, %d hard) at 0x%08lx\n",
+                    after.corrected - before.corrected,
+                    after.failed - before.failed, pos);
+            return -1;
+        }
+        return 0;
+
+    case MTD_VERIFY_SAMPLED: {
+        ssize_t page = ctx->page_size;
+        ssize_t offset;
+        for (offset = 0; offset < size; offset += page) {
+            ssize_t index = offset / page;
+            if (index % MTD_VERIFY_SAMPLE_STRIDE != 0 &&
+                offset + page < size) {
+                continue;
+            }
+            if (lseek(fd, pos + offset, SEEK_SET) != pos + offset ||
+                read(fd, verify, page) != page) {
+                fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
+                        pos + offset, strerror(errno));
+                return -1;
+            }
+            if (memcmp(data + offset, verify, page) != 0) {
+                fprintf(stderr, "mtd: verification error at 0x%08lx\n",
+                        pos + offset);
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    case MTD_VERIFY_FULL:
+    default:
+        if (lseek(fd, pos, SEEK_SET) != pos ||
+            read(fd, verify, size) != size) {
+            fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
+                    pos, strerror(errno));
+            return -1;
+        }
+        if (memcmp(data, verify, size) != 0) {
+            fprintf(stderr, "mtd: verification error at 0x%08lx (%s)\n",
+                    pos, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+}
+
+// Checks every block recorded under MTD_VERIFY_DEFERRED in one pass.
+static int verify_deferred(MtdWriteContext *ctx)
+{
+    ssize_t size = ctx->partition->erase_size;
+    int bad = 0;
+    int i;
+    for (i = 0; i < ctx->written_count; ++i) {
+        off_t pos = ctx->written[i].pos;
+        if (lseek(ctx->fd, pos, SEEK_SET) != pos ||
+            read(ctx->fd, ctx->verify_buffer, size) != size) {
+            fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
+                    pos, strerror(errno));
+            ++bad;
+        } else if (block_checksum(ctx->verify_buffer, size) !=
+                ctx->written[i].sum) {
+            fprintf(stderr, "mtd: verification error at 0x%08lx\n", pos);
+            ++bad;
+        }
+    }
+    if (bad) {
+        fprintf(stderr, "mtd: %d of %d blocks failed verification\n",
+                bad, ctx->written_count);
+        return -1;
+    }
+    return 0;
+}
+
 MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
 {
     MtdWriteContext *ctx = (MtdWriteContext*) malloc(sizeof(MtdWriteContext));
     if (ctx == NULL) return NULL;
 
     ctx->buffer = malloc(partition->erase_size);
-    if (ctx->buffer == NULL) {
+    ctx->verify_buffer = malloc(partition->erase_size);
+    if (ctx->buffer == NULL || ctx->verify_buffer == NULL) {
+        free(ctx->buffer);
+        free(ctx->verify_buffer);
         free(ctx);
         return NULL;
     }
@@ -370,61 +1023,307 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
     ctx->fd = open(mtddevname, O_RDWR);
     if (ctx->fd < 0) {
         free(ctx->buffer);
+        free(ctx->verify_buffer);
         free(ctx);
         return NULL;
     }
 
     ctx->partition = partition;
     ctx->stored = 0;
+
+    ctx->verify = get_write_verify();
+    ctx->page_size = partition->erase_size;
+    struct mtd_info_user mtd_info;
+    if (ioctl(ctx->fd, MEMGETINFO, &mtd_info) == 0 &&
+        mtd_info.writesize > 0 &&
+        partition->erase_size % mtd_info.writesize == 0) {
+        ctx->page_size = mtd_info.writesize;
+    }
+    ctx->written = NULL;
+    ctx->written_count = ctx->written_alloc = 0;
+    ctx->blocks = 0;
+    ctx->verify_usec = 0;
+    gettimeofday(&ctx->start, NULL);
+
+    ctx->skip_unchanged = 0;
+    ctx->skipped = 0;
+    ctx->erase_skipped = 0;
+
+    ctx->oob_len = 0;
+    ctx->oob_size = 0;
+    ctx->oob_free_count = -1;   // layout not read yet
+    ctx->record_buffer = NULL;
+    ctx->record_stored = 0;
+    ctx->oob_buffer = NULL;
+    ctx->oob_written = 0;
+    ctx->oob_deferred = 0;
+
+    forget_cached_digests(partition);
+    erase_ahead_start(ctx);
     return ctx;
 }
 
-static int write_block(const MtdPartition *partition, int fd, const char *data)
+void mtd_write_skip_unchanged(MtdWriteContext *ctx)
+{
+    // Spare data isn't compared, so a block can't be judged unchanged.
+    if (ctx->oob_len > 0) return;
+    // Erasing ahead would destroy the contents we want to compare with.
+    erase_ahead_stop(ctx);
+    ctx->skip_unchanged = 1;
+}
+
+int mtd_write_oob_avail(MtdWriteContext *ctx)
 {
+    if (ctx->oob_free_count < 0) {
+        struct mtd_info_user mtd_info;
+        struct nand_ecclayout layout;
+        ctx->oob_free_count = 0;
+        if (ioctl(ctx->fd, MEMGETINFO, &mtd_info) != 0 ||
+            ioctl(ctx->fd, ECCGETLAYOUT, &layout) != 0) {
+            fprintf(stderr, "mtd: can't get spare layout of %s (%s)\n",
+                    ctx->partition->name, strerror(errno));
+            return -1;
+        }
+        ctx->oob_size = mtd_info.oobsize;
+        int i;
+        for (i = 0; i < MTD_MAX_OOBFREE_ENTRIES &&
+                layout.oobfree[i].length > 0; ++i) {
+            if (layout.oobfree[i].offset + layout.oobfree[i].length >
+                    ctx->oob_size) {
+                break;
+            }
+            ctx->oob_free[i] = layout.oobfree[i];
+        }
+        ctx->oob_free_count = i;
+    }
+
+    int avail = 0;
+    int i;
+    for (i = 0; i < ctx->oob_free_count; ++i) {
+        avail += ctx->oob_free[i].length;
+    }
+    return avail;
+}
+
+int mtd_write_with_oob(MtdWriteContext *ctx, size_t oob_len)
+{
+    int avail = mtd_write_oob_avail(ctx);
+    if (avail < 0 || (size_t) avail < oob_len) {
+        fprintf(stderr, "mtd: %s has %d free spare bytes per page, "
+                "not %lu\n", ctx->partition->name, avail,
+                (unsigned long) oob_len);
+        return -1;
+    }
+    if (ctx->oob_len > 0) return ctx->oob_len == oob_len ? 0 : -1;
+    if (oob_len == 0) return 0;
+
+    size_t pages = ctx->partition->erase_size / ctx->page_size;
+    ctx->record_buffer = malloc(pages * (ctx->page_size + oob_len));
+    ctx->oob_buffer = malloc(pages * oob_len);
+    if (ctx->record_buffer == NULL || ctx->oob_buffer == NULL) {
+        free(ctx->record_buffer);
+        free(ctx->oob_buffer);
+        ctx->record_buffer = ctx->oob_buffer = NULL;
+        return -1;
+    }
+    ctx->oob_len = oob_len;
+    ctx->skip_unchanged = 0;
+    return 0;
+}
+
+static int is_erased(const char *data, size_t size)
+{
+    size_t i;
+    for (i = 0; i < size; ++i) {
+        if ((unsigned char) data[i] != 0xff) return 0;
+    }
+    return 1;
+}
+
+#ifndef MEMWRITE
+// From the 3.2 kernel's mtd-abi.h, for older headers.  Kernels without
+// it reject the ioctl, which write_block() takes as fatal.
+struct mtd_write_req {
+    __u64 start;
+    __u64 len;
+    __u64 ooblen;
+    __u64 usr_data;
+    __u64 usr_oob;
+    __u8 mode;
+    __u8 padding[7];
+};
+#define MEMWRITE _IOWR('M', 24, struct mtd_write_req)
+#define MTD_OPS_AUTO_OOB 1
+#endif
+
+/* Programs the block at pos with data, and with the spare bytes in
+ * oob_buffer if the context has them.  Each page and its spare bytes go
+ * in one MEMWRITE, with the driver placing them in the free bytes
+ * (MTD_OPS_AUTO_OOB): programming a page's spare area separately isn't
+ * allowed on MLC parts, and msm_nand doesn't support MTD_OOB_PLACE.
+ * Returns 0 on success.
+ */
+static int program_block(MtdWriteContext *ctx, off_t pos, const char *data)
+{
+    int fd = ctx->fd;
+    ssize_t size = ctx->partition->erase_size;
+    if (ctx->oob_len == 0) {
+        return lseek(fd, pos, SEEK_SET) != pos ||
+                write(fd, data, size) != size;
+    }
+
+    // A page left erased, spare area and all, is one yaffs2 sees as free.
+    ssize_t page = ctx->page_size;
+    ssize_t offset;
+    for (offset = 0; offset < size; offset += page) {
+        char *oob = ctx->oob_buffer + (offset / page) * ctx->oob_len;
+        if (is_erased(data + offset, page) && is_erased(oob, ctx->oob_len)) {
+            continue;
+        }
+        struct mtd_write_req req;
+        memset(&req, 0, sizeof(req));
+        req.start = pos + offset;
+        req.len = page;
+        req.ooblen = ctx->oob_len;
+        req.usr_data = (unsigned long) (data + offset);
+        req.usr_oob = (unsigned long) oob;
+        req.mode = MTD_OPS_AUTO_OOB;
+        if (ioctl(fd, MEMWRITE, &req) != 0) return -1;
+    }
+    return 0;
+}
+
+/* Reads the block at pos a page at a time and returns nonzero if it's
+ * blank.  Pages are programmed in order, so a block in use nearly always
+ * shows it in the first page, and only blank blocks are read through.
+ * With sample set just the first and last pages are read.  Read or ECC
+ * trouble counts as not blank.
+ */
+static int block_is_blank(MtdWriteContext *ctx, off_t pos, int sample)
+{
+    int fd = ctx->fd;
+    ssize_t page = ctx->page_size;
+    ssize_t size = ctx->partition->erase_size;
+    struct mtd_ecc_stats before, after;
+    int blank = 1;
+    ssize_t offset;
+
+    if (ioctl(fd, ECCGETSTATS, &before)) blank = 0;
+    for (offset = 0; blank && offset < size; offset += page) {
+        const unsigned long *words = (const unsigned long *) ctx->verify_buffer;
+        size_t i;
+        if (sample && offset > 0 && offset < size - page) offset = size - page;
+        if (lseek(fd, pos + offset, SEEK_SET) != pos + offset ||
+            read(fd, ctx->verify_buffer, page) != page) {
+            blank = 0;
+            break;
+        }
+        for (i = 0; i < page / sizeof(*words); ++i) {
+            if (words[i] != ~0UL) {
+                blank = 0;
+                break;
+            }
+        }
+    }
+    if (blank && (ioctl(fd, ECCGETSTATS, &after) ||
+            after.failed != before.failed)) {
+        blank = 0;
+    }
+    lseek(fd, pos, SEEK_SET);
+    return blank;
+}
+
+/* Reads the block at pos and returns nonzero if it already holds data,
+ * or is already erased if data is NULL.  Any read or ECC trouble counts
+ * as a difference.
+ */
+static int block_matches(MtdWriteContext *ctx, off_t pos, const char *data)
+{
+    if (data == NULL) return block_is_blank(ctx, pos, 0);
+
+    int fd = ctx->fd;
+    ssize_t size = ctx->partition->erase_size;
+    char *current = ctx->verify_buffer;
+    struct mtd_ecc_stats before, after;
+
+    if (ioctl(fd, ECCGETSTATS, &before) ||
+        lseek(fd, pos, SEEK_SET) != pos ||
+        read(fd, current, size) != size ||
+        ioctl(fd, ECCGETSTATS, &after) ||
+        after.failed != before.failed) {
+        lseek(fd, pos, SEEK_SET);
+        return 0;
+    }
+    lseek(fd, pos, SEEK_SET);
+    return memcmp(current, data, size) == 0;
+}
+
+static int write_block(MtdWriteContext *ctx, const char *data)
+{
+    const MtdPartition *partition = ctx->partition;
+    int fd = ctx->fd;
     off_t pos = lseek(fd, 0, SEEK_CUR);
     if (pos == (off_t) -1) return 1;
 
     ssize_t size = partition->erase_size;
     while (pos + size <= (int) partition->size) {
-        loff_t bpos = pos;
-        if (ioctl(fd, MEMGETBADBLOCK, &bpos) > 0) {
+        int erased = erase_ahead_claim(ctx, pos);
+        if (!erased && is_bad_block(partition, fd, pos)) {
             fprintf(stderr, "mtd: not writing bad block at 0x%08lx\n", pos);
             pos += partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
         }
 
+        if (ctx->skip_unchanged && block_matches(ctx, pos, data)) {
+            if (lseek(fd, pos + size, SEEK_SET) != pos + size) return -1;
+            ctx->blocks++;
+            ctx->skipped++;
+            return 0;  // Already there.
+        }
+
+        set_block_erased(partition, pos, 0);
         struct erase_info_user erase_info;
         erase_info.start = pos;
         erase_info.length = size;
         int retry;
         for (retry = 0; retry < 2; ++retry) {
-            if (ioctl(fd, MEMERASE, &erase_info) < 0) {
+            if (retry == 0 && erased) {
+                // The eraser thread already took care of it.
+            } else if (ioctl(fd, MEMERASE, &erase_info) < 0) {
                 fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
                         pos, strerror(errno));
                 continue;
             }
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                write(fd, data, size) != size) {
+            if (program_block(ctx, pos, data)) {
                 fprintf(stderr, "mtd: write error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
-            }
-
-            char verify[size];
-            if (lseek(fd, pos, SEEK_SET) != pos ||
-                read(fd, verify, size) != size) {
-                fprintf(stderr, "mtd: re-read error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
+                if (ctx->oob_len > 0 && !ctx->oob_written) {
+                    // Most likely the driver can't write spare data this
+                    // way; going on would just erase the whole partition.
+                    fprintf(stderr, "mtd: can't write spare data to %s; "
+                            "giving up\n", partition->name);
+                    return -1;
+                }
                 continue;
             }
-            if (memcmp(data, verify, size) != 0) {
-                fprintf(stderr, "mtd: verification error at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-                continue;
+            if (ctx->oob_len > 0 && !ctx->oob_written) {
+                ctx->oob_written = 1;
+                erase_ahead_update(ctx, ctx->oob_deferred, 0);
+                ctx->oob_deferred = 0;
             }
 
+            struct timeval verify_start;
+            gettimeofday(&verify_start, NULL);
+            int bad = verify_block(ctx, pos, data);
+            ctx->verify_usec += usec_since(&verify_start);
+            if (bad) continue;
+            if (lseek(fd, pos + size, SEEK_SET) != pos + size) continue;
+
             if (retry > 0) {
                 fprintf(stderr, "mtd: wrote block after %d retries\n", retry);
             }
+            ctx->blocks++;
+            erase_ahead_update(ctx, 0, 1);
             return 0;  // Success!
         }
 
@@ -439,9 +1338,62 @@ static int write_block(const MtdPartition *partition, int fd, const char *data)
     return -1;
 }
 
+/* Splits the block of records gathered in record_buffer into its data,
+ * in buffer, and spare bytes, in oob_buffer, and writes it.
+ */
+static int write_record_block(MtdWriteContext *ctx)
+{
+    size_t page = ctx->page_size;
+    size_t pages = ctx->partition->erase_size / page;
+    size_t p;
+    for (p = 0; p < pages; ++p) {
+        const char *record = ctx->record_buffer + p * (page + ctx->oob_len);
+        memcpy(ctx->buffer + p * page, record, page);
+
+        memcpy(ctx->oob_buffer + p * ctx->oob_len, record + page,
+               ctx->oob_len);
+    }
+    ctx->record_stored = 0;
+    return write_block(ctx, ctx->buffer);
+}
+
+static ssize_t write_records(MtdWriteContext *ctx, const char *data,
+        size_t len)
+{
+    size_t record = ctx->page_size + ctx->oob_len;
+    size_t block = ctx->partition->erase_size / ctx->page_size * record;
+    size_t wrote = 0;
+
+    // Only the page data takes up room on the device.  Nothing is erased
+    // ahead until the first block shows the driver takes spare data.
+    size_t accepted = len / record * ctx->page_size;
+    if (ctx->oob_written) {
+        erase_ahead_update(ctx, accepted, 0);
+    } else {
+        ctx->oob_deferred += accepted;
+    }
+
+    while (wrote < len) {
+        size_t copy = block - ctx->record_stored;
+        if (copy > len - wrote) copy = len - wrote;
+        memcpy(ctx->record_buffer + ctx->record_stored, data + wrote, copy);
+        ctx->record_stored += copy;
+        wrote += copy;
+        if (ctx->record_stored == block && write_record_block(ctx)) return -1;
+    }
+    return wrote;
+}
+
 ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 {
     size_t wrote = 0;
+
+    if (ctx->oob_len > 0) return write_records(ctx, data, len);
+
+    // Everything handed to us will be written, so the eraser may get
+    // that many blocks ready.
+    erase_ahead_update(ctx, len, 0);
+
     while (wrote < len) {
         // Coalesce partial writes into complete blocks
         if (ctx->stored > 0 || len - wrote < ctx->partition->erase_size) {
@@ -454,13 +1406,13 @@ ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 
         // If a complete block was accumulated, write it
         if (ctx->stored == ctx->partition->erase_size) {
-            if (write_block(ctx->partition, ctx->fd, ctx->buffer)) return -1;
+            if (write_block(ctx, ctx->buffer)) return -1;
             ctx->stored = 0;
         }
 
         // Write complete blocks directly from the user's buffer
         while (ctx->stored == 0 && len - wrote >= ctx->partition->erase_size) {
-            if (write_block(ctx->partition, ctx->fd, data + wrote)) return -1;
+            if (write_block(ctx, data + wrote)) return -1;
             wrote += ctx->partition->erase_size;
         }
     }
@@ -470,14 +1422,27 @@ ssize_t mtd_write_data(MtdWriteContext *ctx, const char *data, size_t len)
 
 off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
 {
+    // Pad records out with erased pages, which stay unprogrammed
+    if (ctx->record_stored > 0) {
+        size_t record = ctx->page_size + ctx->oob_len;
+        size_t block = ctx->partition->erase_size / ctx->page_size * record;
+        memset(ctx->record_buffer + ctx->record_stored, 0xff,
+               block - ctx->record_stored);
+        if (write_record_block(ctx)) return -1;
+    }
+
     // Zero-pad and write any pending data to get us to a block boundary
     if (ctx->stored > 0) {
         size_t zero = ctx->partition->erase_size - ctx->stored;
         memset(ctx->buffer + ctx->stored, 0, zero);
-        if (write_block(ctx->partition, ctx->fd, ctx->buffer)) return -1;
+        if (write_block(ctx, ctx->buffer)) return -1;
         ctx->stored = 0;
     }
 
+    // Everything the eraser thread was allowed to erase has been
+    // written by now; stop it before erasing more here.
+    if (blocks != 0) erase_ahead_stop(ctx);
+
     off_t pos = lseek(ctx->fd, 0, SEEK_CUR);
     if ((off_t) pos == (off_t) -1) return pos;
 
@@ -490,18 +1455,32 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
 
     // Erase the specified number of blocks
     while (blocks-- > 0) {
-        loff_t bpos = pos;
-        if (ioctl(ctx->fd, MEMGETBADBLOCK, &bpos) > 0) {
+        if (is_bad_block(ctx->partition, ctx->fd, pos)) {
             fprintf(stderr, "mtd: not erasing bad block at 0x%08lx\n", pos);
             pos += ctx->partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
         }
 
+        // Erased earlier (by a format, say) and not written since, or
+        // if we're comparing anyway, found blank.  Another process may
+        // have written an erased block since, so a spot check of its
+        // first and last pages has to agree.
+        if ((is_erased_block(ctx->partition, pos) &&
+             block_is_blank(ctx, pos, 1)) ||
+            (ctx->skip_unchanged && block_matches(ctx, pos, NULL))) {
+            set_block_erased(ctx->partition, pos, 1);
+            ctx->erase_skipped++;
+            pos += ctx->partition->erase_size;
+            continue;
+        }
+
         struct erase_info_user erase_info;
         erase_info.start = pos;
         erase_info.length = ctx->partition->erase_size;
         if (ioctl(ctx->fd, MEMERASE, &erase_info) < 0) {
             fprintf(stderr, "mtd: erase failure at 0x%08lx\n", pos);
+        } else {
+            set_block_erased(ctx->partition, pos, 1);
         }
         pos += ctx->partition->erase_size;
     }
@@ -514,7 +1493,41 @@ int mtd_write_close(MtdWriteContext *ctx)
     int r = 0;
     // Make sure any pending data gets written
     if (mtd_erase_blocks(ctx, 0) == (off_t) -1) r = -1;
+    erase_ahead_stop(ctx);
+    pthread_cond_destroy(&ctx->ahead.cond);
+    pthread_mutex_destroy(&ctx->ahead.lock);
+
+    if (ctx->verify == MTD_VERIFY_DEFERRED) {
+        struct timeval verify_start;
+        gettimeofday(&verify_start, NULL);
+        if (verify_deferred(ctx)) r = -1;
+        ctx->verify_usec += usec_since(&verify_start);
+    }
+
+    if (ctx->blocks > 0) {
+        long ms = usec_since(&ctx->start) / 1000;
+        unsigned long kb = ctx->blocks * (ctx->partition->erase_size / 1024);
+        fprintf(stderr, "mtd: wrote %luKB to %s in %ldms (%luKB/s), "
+                "%s verify took %ldms\n", kb, ctx->partition->name, ms,
+                ms > 0 ? kb * 1000 / ms : kb,
+                verify_mode_names[ctx->verify], ctx->verify_usec / 1000);
+        if (ctx->skip_unchanged) {
+            fprintf(stderr, "mtd: %lu of %lu blocks were unchanged\n",
+                    (unsigned long) ctx->skipped, (unsigned long) ctx->blocks);
+        }
+    }
+    if (ctx->erase_skipped > 0) {
+        fprintf(stderr, "mtd: %lu blocks of %s were already erased\n",
+                (unsigned long) ctx->erase_skipped, ctx->partition->name);
+    }
+
     if (close(ctx->fd)) r = -1;
+    // Again, in case something was cached while we were writing.
+    forget_cached_digests(ctx->partition);
+    free(ctx->written);
+    free(ctx->record_buffer);
+    free(ctx->oob_buffer);
+    free(ctx->verify_buffer);
     free(ctx->buffer);
     free(ctx);
     return r;
@@ -21,7 +21,13 @@
 
 typedef struct MtdPartition MtdPartition;
 
+/* reads /proc/mtd the first time it's called and returns the cached
+ * table (and each partition's cached bad block map) after that, until
+ * mtd_invalidate_partitions() is called.  MtdPartition pointers stay
+ * valid across rescans.
+ */
 int mtd_scan_partitions(void);
+void mtd_invalidate_partitions(void);
 
 const MtdPartition *mtd_find_partition_by_name(const char *name);
 
@@ -46,9 +52,69 @@ MtdReadContext *mtd_read_partition(const MtdPartition *);
 ssize_t mtd_read_data(MtdReadContext *, char *data, size_t data_len);
 void mtd_read_close(MtdReadContext *);
 
+/* digests of the first len bytes of a partition, remembered for the rest
+ * of this boot by whoever worked them out (mtdutils doesn't hash
+ * anything itself).  a partition's digests are forgotten when it's
+ * opened for writing or mounted read-write.  get returns 0 if there's
+ * one.
+ */
+int mtd_get_cached_digest(const MtdPartition *, size_t len,
+        unsigned char *digest, size_t digest_len);
+void mtd_put_cached_digest(const MtdPartition *, size_t len,
+        const unsigned char *digest, size_t digest_len);
+
 MtdWriteContext *mtd_write_partition(const MtdPartition *);
 ssize_t mtd_write_data(MtdWriteContext *, const char *data, size_t data_len);
 off_t mtd_erase_blocks(MtdWriteContext *, int blocks);  /* 0 ok, -1 for all */
 int mtd_write_close(MtdWriteContext *);
 
+/* mtd_erase_blocks() leaves out blocks this process has already erased
+ * and not written since, once their first and last pages read back
+ * blank; mounting the partition read-write forgets which those are.
+ */
+
+/* compare each block with what's already on the flash first, and leave
+ * it alone (no erase or program) if it's the same.  blocks that
+ * mtd_erase_blocks() finds already erased are skipped too.  call right
+ * after mtd_write_partition(), before writing anything; this turns off
+ * erasing ahead of the writer.
+ */
+void mtd_write_skip_unchanged(MtdWriteContext *);
+
+/* for writing images that carry their own spare area data, such as a
+ * yaffs2 image's tags.  afterwards mtd_write_data() takes records of one
+ * page followed by oob_len bytes, which the driver puts in the free
+ * bytes of that page's spare area (MTD_OPS_AUTO_OOB), programming both
+ * in one MEMWRITE; the rest of the spare area is left erased, as are
+ * pages that are all 0xff, data and spare alike.  if the driver won't
+ * take the first block, mtd_write_data() fails before anything past it
+ * is erased.  only the page data is verified, and unchanged blocks are
+ * never skipped.  call right after mtd_write_partition(); returns -1 if
+ * pages have fewer than oob_len free spare bytes.  mtd_write_oob_avail()
+ * says how many they have (-1 if that can't be found out).
+ */
+int mtd_write_oob_avail(MtdWriteContext *);
+int mtd_write_with_oob(MtdWriteContext *, size_t oob_len);
+
+/* how each block written is checked.  MTD_VERIFY_FULL reads every block
+ * back and compares it (the default); MTD_VERIFY_ECC reads it back but
+ * only checks that the controller saw no uncorrectable ECC errors;
+ * MTD_VERIFY_SAMPLED compares a subset of the pages; MTD_VERIFY_DEFERRED
+ * checksums each block as it's written and checks them all in a single
+ * pass in mtd_write_close(), which fails if any don't match.
+ *
+ * The setting applies to contexts opened afterwards.  Until it's set,
+ * it's taken from $MTD_WRITE_VERIFY ("full", "ecc", "sampled" or
+ * "deferred") if present, or else the build's default.
+ */
+typedef enum {
+    MTD_VERIFY_FULL,
+    MTD_VERIFY_ECC,
+    MTD_VERIFY_SAMPLED,
+    MTD_VERIFY_DEFERRED,
+} MtdVerifyMode;
+
+void mtd_set_write_verify(MtdVerifyMode mode);
+int mtd_parse_verify_mode(const char *name, MtdVerifyMode *mode);
+
 #endif  // MTDUTILS_H_
@@ -0,0 +1,304 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "mtdutils.h"
+#include "yaffs2.h"
+
+// From yaffs_guts.h.
+#define YAFFS_MAX_NAME_LENGTH           255
+#define YAFFS_MAX_ALIAS_LENGTH          159
+#define YAFFS_NOBJECT_BUCKETS           256
+#define YAFFS_LOWEST_SEQUENCE_NUMBER    0x00001000
+
+enum {
+    YAFFS_OBJECT_TYPE_FILE = 1,
+    YAFFS_OBJECT_TYPE_SYMLINK = 2,
+    YAFFS_OBJECT_TYPE_DIRECTORY = 3,
+};
+
+/* yaffs_ObjectHeader, which takes up a chunk of its own ahead of an
+ * object's data.  The natural alignment here is the kernel's; the rest of
+ * the chunk, padding included, stays 0xff as mkyaffs2image leaves it.
+ */
+typedef struct {
+    uint32_t type;
+    uint32_t parent_id;
+    uint16_t sum_unused;
+    char name[YAFFS_MAX_NAME_LENGTH + 1];
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t atime;
+    uint32_t mtime;
+    uint32_t ctime;
+    uint32_t file_size;
+    uint32_t equivalent_id;
+    char alias[YAFFS_MAX_ALIAS_LENGTH + 1];
+    uint32_t rdev;
+} ObjectHeader;
+
+/* yaffs_PackedTags2: the tags proper, then (if there's room in the
+ * spare area) yaffs_ECCOther computed over them.
+ */
+#define TAGS_SIZE       16
+#define TAGS_ECC_SIZE   12
+
+struct Yaffs2Writer {
+    MtdWriteContext *ctx;
+    size_t page_size;
+    size_t tags_size;       // TAGS_SIZE, plus TAGS_ECC_SIZE if it fits
+    char *record;           // page_size + tags_size
+    unsigned char column_parity[256];
+    int next_id;
+    int failed;
+
+    // The file being written, if there is one.
+    int file_id;
+    size_t file_size;
+    size_t file_written;
+    int file_chunk;         // of the page being filled
+    size_t file_fill;       // bytes in it
+};
+
+// The column_parity_table of yaffs_ecc.c.
+static void init_column_parity(unsigned char *table)
+{
+    int b;
+    for (b = 0; b < 256; ++b) {
+        static const unsigned char masks[6] = {
+            0x55, 0xaa, 0x33, 0xcc, 0x0f, 0xf0,     // CP0..CP5
+        };
+        unsigned char v = __builtin_parity(b);
+        int i;
+        for (i = 0; i < 6; ++i) {
+            if (__builtin_parity(b & masks[i])) v |= 1 << (i + 2);
+        }
+        table[b] = v;
+    }
+}
+
+static void put32(char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// yaffs_PackTags2(), for tags with no extra header information.
+static void pack_tags(Yaffs2Writer *w, char *tags,
+        int object_id, int chunk_id, unsigned int byte_count)
+{
+    put32(tags, YAFFS_LOWEST_SEQUENCE_NUMBER);
+    put32(tags + 4, object_id);
+    put32(tags + 8, chunk_id);
+    put32(tags + 12, byte_count);
+    if (w->tags_size < TAGS_SIZE + TAGS_ECC_SIZE) return;
+
+    // yaffs_ECCCalculateOther()
+    unsigned char col_parity = 0;
+    uint32_t line_parity = 0, line_parity_prime = 0;
+    uint32_t i;
+    for (i = 0; i < TAGS_SIZE; ++i) {
+        unsigned char b = w->column_parity[(unsigned char) tags[i]];
+        col_parity ^= b;
+        if (b & 0x01) {
+            line_parity ^= i;
+            line_parity_prime ^= ~i;
+        }
+    }
+    char *ecc = tags + TAGS_SIZE;
+    ecc[0] = (col_parity >> 2) & 0x3f;
+    ecc[1] = ecc[2] = ecc[3] = 0;
+    put32(ecc + 4, line_parity);
+    put32(ecc + 8, line_parity_prime);
+}
+
+// Writes the page in w->record as the given chunk.
+static int write_chunk(Yaffs2Writer *w, int object_id, int chunk_id,
+        unsigned int byte_count)
+{
+    if (w->failed) return -1;
+    pack_tags(w, w->record + w->page_size, object_id, chunk_id, byte_count);
+    size_t len = w->page_size + w->tags_size;
+    if (mtd_write_data(w->ctx, w->record, len) != (ssize_t) len) {
+        fprintf(stderr, "yaffs2: write failed\n");
+        w->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static int write_header(Yaffs2Writer *w, int type, int parent_id,
+        const char *name, const Yaffs2Attrs *attrs, size_t size,
+        const char *alias)
+{
+    if (w->failed || w->file_id != 0) {
+        w->failed = 1;
+        return -1;
+    }
+    if (strlen(name) > YAFFS_MAX_NAME_LENGTH ||
+        (alias != NULL && strlen(alias) > YAFFS_MAX_ALIAS_LENGTH)) {
+        fprintf(stderr, "yaffs2: name too long: %s\n", name);
+        return -1;
+    }
+
+    ObjectHeader oh;
+    memset(&oh, 0xff, sizeof(oh));
+    oh.type = type;
+    oh.parent_id = parent_id;
+    strncpy(oh.name, name, YAFFS_MAX_NAME_LENGTH);
+    oh.mode = attrs->mode;
+    oh.uid = attrs->uid;
+    oh.gid = attrs->gid;
+    oh.atime = oh.mtime = oh.ctime = attrs->mtime;
+    if (type == YAFFS_OBJECT_TYPE_FILE) oh.file_size = size;
+    if (alias != NULL) strncpy(oh.alias, alias, YAFFS_MAX_ALIAS_LENGTH);
+
+    memset(w->record, 0xff, w->page_size);
+    memcpy(w->record, &oh, sizeof(oh));
+    int id = w->next_id++;
+    if (write_chunk(w, id, 0, 0xffff) != 0) return -1;
+    return id;
+}
+
+Yaffs2Writer *yaffs2_writer_open(const MtdPartition *partition,
+        MtdWriteContext *ctx)
+{
+    size_t write_size;
+    if (mtd_partition_info(partition, NULL, NULL, &write_size) != 0 ||
+        write_size < sizeof(ObjectHeader)) {
+        fprintf(stderr, "yaffs2: can't use pages of %lu bytes\n",
+                (unsigned long) write_size);
+        return NULL;
+    }
+
+    int avail = mtd_write_oob_avail(ctx);
+    size_t tags_size = TAGS_SIZE + TAGS_ECC_SIZE;
+    if (avail >= 0 && (size_t) avail < tags_size) tags_size = TAGS_SIZE;
+    if (mtd_write_with_oob(ctx, tags_size) != 0) return NULL;
+
+    Yaffs2Writer *w = calloc(1, sizeof(Yaffs2Writer));
+    if (w == NULL) return NULL;
+    w->record = malloc(write_size + tags_size);
+    if (w->record == NULL) {
+        free(w);
+        return NULL;
+    }
+    w->ctx = ctx;
+    w->page_size = write_size;
+    w->tags_size = tags_size;
+    w->next_id = YAFFS_NOBJECT_BUCKETS + 1;
+    init_column_parity(w->column_parity);
+    return w;
+}
+
+int yaffs2_add_directory(Yaffs2Writer *w, int parent_id, const char *name,
+        const Yaffs2Attrs *attrs)
+{
+    Yaffs2Attrs a = *attrs;
+    a.mode = (a.mode & ~S_IFMT) | S_IFDIR;
+    return write_header(w, YAFFS_OBJECT_TYPE_DIRECTORY, parent_id, name,
+            &a, 0, NULL);
+}
+
+int yaffs2_add_symlink(Yaffs2Writer *w, int parent_id, const char *name,
+        const char *target, const Yaffs2Attrs *attrs)
+{
+    Yaffs2Attrs a = *attrs;
+    a.mode = (a.mode & ~S_IFMT) | S_IFLNK;
+    return write_header(w, YAFFS_OBJECT_TYPE_SYMLINK, parent_id, name,
+            &a, 0, target);
+}
+
+int yaffs2_begin_file(Yaffs2Writer *w, int parent_id, const char *name,
+        size_t size, const Yaffs2Attrs *attrs)
+{
+    Yaffs2Attrs a = *attrs;
+    a.mode = (a.mode & ~S_IFMT) | S_IFREG;
+    int id = write_header(w, YAFFS_OBJECT_TYPE_FILE, parent_id, name,
+            &a, size, NULL);
+    if (id < 0) return -1;
+    w->file_id = id;
+    w->file_size = size;
+    w->file_written = 0;
+    w->file_chunk = 1;
+    w->file_fill = 0;
+    return 0;
+}
+
+static int flush_file_chunk(Yaffs2Writer *w)
+{
+    memset(w->record + w->file_fill, 0xff, w->page_size - w->file_fill);
+    int r = write_chunk(w, w->file_id, w->file_chunk, w->file_fill);
+    w->file_chunk++;
+    w->file_fill = 0;
+    return r;
+}
+
+int yaffs2_write_file(Yaffs2Writer *w, const void *data, size_t len)
+{
+    const char *p = (const char *) data;
+    if (w->file_id == 0 || w->file_written + len > w->file_size) {
+        w->failed = 1;
+        return -1;
+    }
+    w->file_written += len;
+    while (len > 0) {
+        size_t n = w->page_size - w->file_fill;
+        if (n > len) n = len;
+        memcpy(w->record + w->file_fill, p, n);
+        w->file_fill += n;
+        p += n;
+        len -= n;
+        if (w->file_fill == w->page_size && flush_file_chunk(w) != 0) {
+            return -1;
+        }
+    }
+    return w->failed ? -1 : 0;
+}
+
+int yaffs2_end_file(Yaffs2Writer *w)
+{
+    if (w->file_id == 0 || w->file_written != w->file_size) {
+        fprintf(stderr, "yaffs2: file got %lu of %lu bytes\n",
+                (unsigned long) w->file_written,
+                (unsigned long) w->file_size);
+        w->failed = 1;
+    } else if (w->file_fill > 0) {
+        flush_file_chunk(w);
+    }
+    w->file_id = 0;
+    return w->failed ? -1 : 0;
+}
+
+int yaffs2_writer_close(Yaffs2Writer *w)
+{
+    int r = (w->failed || w->file_id != 0) ? -1 : 0;
+    if (r == 0) {
+        fprintf(stderr, "yaffs2: wrote %d objects\n",
+                w->next_id - (YAFFS_NOBJECT_BUCKETS + 1));
+    }
+    free(w->record);
+    free(w);
+    return r;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MTDUTILS_YAFFS2_H_
+#define MTDUTILS_YAFFS2_H_
+
+#include <sys/types.h>
+
+#include "mtdutils.h"
+
+/* builds a yaffs2 filesystem in user space, the way mkyaffs2image lays
+ * one out, and streams its pages and tags straight to an MTD partition.
+ * objects are written in the order they're added, each file's header
+ * before its data, so a parent directory must be added before anything
+ * in it.  the partition's previous contents are lost; erase the rest of
+ * it (mtd_erase_blocks(ctx, -1)) once the writer is closed.
+ */
+typedef struct Yaffs2Writer Yaffs2Writer;
+
+#define YAFFS2_ROOT_ID 1    // the parent of top-level objects
+
+typedef struct {
+    unsigned int mode;      // including the S_IFMT type bits
+    unsigned int uid;
+    unsigned int gid;
+    unsigned int mtime;
+} Yaffs2Attrs;
+
+/* ctx must be fresh from mtd_write_partition(partition); this switches
+ * it to writing spare data (mtd_write_with_oob()).
+ */
+Yaffs2Writer *yaffs2_writer_open(const MtdPartition *partition,
+        MtdWriteContext *ctx);
+
+/* each returns the new object's id, for use as a parent, or -1.
+ */
+int yaffs2_add_directory(Yaffs2Writer *, int parent_id, const char *name,
+        const Yaffs2Attrs *attrs);
+int yaffs2_add_symlink(Yaffs2Writer *, int parent_id, const char *name,
+        const char *target, const Yaffs2Attrs *attrs);
+
+/* a file's data follows in any number of yaffs2_write_file() calls,
+ * which must add up to exactly size bytes by yaffs2_end_file().
+ * return 0 on success.
+ */
+int yaffs2_begin_file(Yaffs2Writer *, int parent_id, const char *name,
+        size_t size, const Yaffs2Attrs *attrs);
+int yaffs2_write_file(Yaffs2Writer *, const void *data, size_t len);
+int yaffs2_end_file(Yaffs2Writer *);
+
+/* frees the writer (not the MTD context).  returns 0 if everything
+ * added was written.
+ */
+int yaffs2_writer_close(Yaffs2Writer *);
+
+#endif  // MTDUTILS_YAFFS2_H_
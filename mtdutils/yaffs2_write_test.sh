@@ -0,0 +1,68 @@
+#!/bin/bash
+#
+# A script for testing write_yaffs2_image() on a device booted into
+# recovery.  It builds (on the host) a package holding a small directory
+# tree, has the updater write it to the cache partition as a yaffs2
+# image, then mounts cache and checks every file against the original.
+# THE CONTENTS OF THE CACHE PARTITION ARE LOST.  Build updater first.
+
+# where on the device to put the updater and the package.
+WORK_DIR=/tmp
+
+ADB="adb -d "
+
+# ------------------------
+
+tmpdir=$(mktemp -d)
+
+echo "waiting to connect to device"
+$ADB wait-for-device
+
+# run a command on the device; exit with the exit status of the device
+# command.
+run_command() {
+  $ADB shell "$@" \; echo \$? | awk '{if (b) {print a}; a=$0; b=1} END {exit a}'
+}
+
+fail() {
+  echo
+  echo FAIL: $*
+  echo
+  rm -rf $tmpdir
+  exit 1
+}
+
+# A tree with empty, small, page-sized and multi-block files, a
+# subdirectory and a symlink.
+mkdir -p $tmpdir/pkg/META-INF/com/google/android $tmpdir/pkg/test/sub
+: > $tmpdir/pkg/test/empty
+echo hello > $tmpdir/pkg/test/small
+head -c 2048 /dev/urandom > $tmpdir/pkg/test/page
+head -c 1000000 /dev/urandom > $tmpdir/pkg/test/sub/big
+ln -s sub/big $tmpdir/pkg/test/link
+cat > $tmpdir/pkg/META-INF/com/google/android/updater-script <<'SCRIPT'
+unmount("/cache");
+write_yaffs2_image("test", "cache", "/cache") || abort("write failed");
+mount("MTD", "cache", "/cache");
+SCRIPT
+(cd $tmpdir/pkg && zip -qry ../test.zip .)
+
+$ADB push $ANDROID_PRODUCT_OUT/system/bin/updater $WORK_DIR/updater
+$ADB push $tmpdir/test.zip $WORK_DIR/yaffs2_test.zip
+run_command chmod 755 $WORK_DIR/updater || fail "can't push updater"
+run_command $WORK_DIR/updater 2 1 $WORK_DIR/yaffs2_test.zip || \
+    fail "updater failed"
+
+for f in empty small page sub/big; do
+  $ADB pull /cache/$f $tmpdir/out-$(basename $f) || fail "$f is missing"
+  cmp $tmpdir/pkg/test/$f $tmpdir/out-$(basename $f) || fail "$f differs"
+done
+[ "$(run_command readlink /cache/link | tr -d '\r')" == "sub/big" ] || \
+    fail "link is wrong"
+
+run_command rm $WORK_DIR/updater $WORK_DIR/yaffs2_test.zip
+rm -rf $tmpdir
+
+echo
+echo PASS
+echo
@@ -0,0 +1,2825 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "common.h"
+#include "install.h"
+#include "minzip/DirUtil.h"
+#include "minzip/Sha1.h"
+#include "minzip/Throughput.h"
+#include "mtdutils/mtdutils.h"
+#include "nandroid.h"
+#include "roots.h"
+
+/* What gets backed up, in order.  Raw partitions are read straight off
+ * the flash, and ext4 volumes block by block; the rest are mounted and
+ * archived file by file.
+ */
+typedef enum { BACKUP_RAW, BACKUP_TREE, BACKUP_BLOCKS } BackupKind;
+
+typedef struct {
+    const char *root;
+    const char *name;       // file name in the backup directory
+    BackupKind kind;
+    const char *device;     // items on different devices run concurrently
+} BackupItem;
+
+static const BackupItem g_backup_items[] = {
+    { "BOOT:",     "boot",     BACKUP_RAW,    "nand" },
+    { "SYSTEM:",   "system",   BACKUP_TREE,   "nand" },
+    { "DBDATA:",   "data",     BACKUP_TREE,   "nand" },
+    { "DATA:",     "userdata", BACKUP_TREE,   "nand" },
+    { "INTERNAL:", "intdata",  BACKUP_BLOCKS, "mmc" },
+};
+#define NUM_BACKUP_ITEMS (sizeof(g_backup_items) / sizeof(g_backup_items[0]))
+
+// The middle of an item's file name, e.g. "tar" in "system.tar.gz".
+static const char *kind_type(BackupKind kind)
+{
+    switch (kind) {
+    case BACKUP_RAW:    return "img";
+    case BACKUP_BLOCKS: return "simg";
+    default:            return "tar";
+    }
+}
+
+/*
+ * Parallel gzip writer.
+ *
+ * Input is cut into GZ_CHUNK_SIZE pieces, each compressed on a worker
+ * thread into a complete gzip member of its own.  Members are written
+ * out in order by the producing thread; a file of concatenated members
+ * is a valid gzip file that gunzip and zcat read as one stream.
+ *
+ * With a chunk store, pieces are instead cut at content-defined
+ * boundaries (so an insertion only changes the chunks around it) and
+ * named by their SHA-1.  Workers compress each one into the store
+ * unless it's already there, and the output file becomes a manifest
+ * listing the chunks in order.  Backups that share most of their data
+ * then share most of their chunks.
+ */
+#define GZ_CHUNK_SIZE (256 * 1024)
+#define GZ_MAX_WORKERS 4
+#define GZ_MAX_JOBS (GZ_MAX_WORKERS * 2)
+#define GZ_LEVEL Z_BEST_SPEED
+
+// Content-defined chunk sizes for the chunk store.
+#define CDC_MIN_SIZE (64 * 1024)
+#define CDC_MAX_SIZE (1024 * 1024)
+#define CDC_MASK ((1 << 18) - 1)      // ~256KB average past the minimum
+
+#define MANIFEST_MAGIC "nandroid-manifest 1\n"
+
+// Digest of each item's uncompressed data, written as the backup's
+// last file but for INFO_FILE: "<sha1> <length> <file>" lines.
+#define DIGESTS_FILE "nandroid.sha1"
+
+// The backup's summary for the menus: "<INFO_MAGIC>", "created <time_t>",
+// then DIGESTS_FILE's lines.
+#define INFO_FILE "nandroid.info"
+#define INFO_MAGIC "nandroid-info 1"
+
+static int write_info(const char *dir, time_t created);
+static int inflate_file(const char *path, NandroidSink sink, void *cookie,
+        MzSha1Ctx *sha, long long *pLen);
+
+enum { JOB_FREE, JOB_FILLING, JOB_QUEUED, JOB_BUSY, JOB_DONE, JOB_FAILED };
+
+typedef struct {
+    unsigned char *in;
+    size_t inLen;
+    unsigned char *out;
+    size_t outLen;
+    int state;
+    uint8_t digest[MZ_SHA1_DIGEST_SIZE];  // chunk store only
+    int stored;                         // chunk was new to the store
+} GzJob;
+
+typedef struct {
+    int fd;
+    const char *store;      // chunk store directory, or NULL
+    GzJob jobs[GZ_MAX_JOBS];
+    int head;               // oldest job still to be written
+    int count;              // jobs in use, starting at head
+    int stop;
+    int failed;
+    size_t chunkMax;
+    size_t outBound;
+    uint32_t cut;           // rolling hash for chunk boundaries
+    long long written;      // compressed bytes
+    int chunks, newChunks;
+    MzSha1Ctx sha;          // of the uncompressed data, in order
+
+    pthread_t workers[GZ_MAX_WORKERS];
+    int numWorkers;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} GzWriter;
+
+/* Random values for the boundary hash.  These must never change, or
+ * new backups would stop sharing chunks with old ones.
+ */
+static uint32_t g_gear[256];
+static pthread_once_t g_gear_once = PTHREAD_ONCE_INIT;
+
+static void init_gear(void)
+{
+    uint32_t x = 0x9e3779b9;
+    int i;
+    for (i = 0; i < 256; ++i) {
+        x = x * 1664525 + 1013904223;
+        g_gear[i] = x;
+    }
+}
+
+static void digest_hex(const uint8_t *digest, char *hex)
+{
+    int i;
+    for (i = 0; i < MZ_SHA1_DIGEST_SIZE; ++i) {
+        sprintf(hex + i * 2, "%02x", digest[i]);
+    }
+}
+
+static void chunk_path(const char *store, const uint8_t *digest,
+        char *path, size_t pathLen)
+{
+    char hex[MZ_SHA1_DIGEST_SIZE * 2 + 1];
+    digest_hex(digest, hex);
+    snprintf(path, pathLen, "%s/%.2s/%s.gz", store, hex, hex);
+}
+
+/* A backup ends up on the sdcard, whichever device it came from.
+ * Jobs for different devices run at once, but their writes take turns
+ * here so that they don't fight over the card.  A restore writes each
+ * item to its own partition, so those writes don't take the lock.
+ */
+static pthread_mutex_t g_sink_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t g_roots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int write_fully(int fd, const void *data, size_t len)
+{
+    const char *p = (const char *) data;
+    int result = 0;
+    while (len > 0) {
+        ssize_t r = write(fd, p, len);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            result = -1;
+            break;
+        }
+        p += r;
+        len -= r;
+    }
+    return result;
+}
+
+// write_fully() to a file on the sdcard, taking turns with other backups.
+static int write_to_card(int fd, const void *data, size_t len)
+{
+    pthread_mutex_lock(&g_sink_lock);
+    int result = write_fully(fd, data, len);
+    pthread_mutex_unlock(&g_sink_lock);
+    return result;
+}
+
+static int gz_compress(GzJob *job, size_t outBound)
+{
+    z_stream zstream;
+    memset(&zstream, 0, sizeof(zstream));
+    // 16 + MAX_WBITS asks for a gzip header and trailer.
+    if (deflateInit2(&zstream, GZ_LEVEL, Z_DEFLATED, 16 + MAX_WBITS,
+            8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    zstream.next_in = job->in;
+    zstream.avail_in = job->inLen;
+    zstream.next_out = job->out;
+    zstream.avail_out = outBound;
+    int zerr = deflate(&zstream, Z_FINISH);
+    job->outLen = outBound - zstream.avail_out;
+    deflateEnd(&zstream);
+    return zerr == Z_STREAM_END ? 0 : -1;
+}
+
+static int discard_sink(const void *data, size_t len, void *cookie)
+{
+    return 0;
+}
+
+// True if the chunk at path holds exactly len bytes with this digest.
+// Anything a crash (or a bad card) left short or garbled fails.
+static int chunk_is_intact(const char *path, const uint8_t *digest,
+        size_t len)
+{
+    MzSha1Ctx sha;
+    long long got;
+    mzSha1Init(&sha);
+    if (inflate_file(path, discard_sink, NULL, &sha, &got)) return 0;
+    return got == (long long) len &&
+            memcmp(mzSha1Final(&sha), digest, MZ_SHA1_DIGEST_SIZE) == 0;
+}
+
+// Flushes the directory holding path, so a rename into it sticks.
+static int sync_parent(const char *path)
+{
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL) return 0;
+    *slash = '\0';
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0) return -1;
+    int result = fsync(fd);
+    close(fd);
+    return result;
+}
+
+// Adds a chunk to the store unless it's already there.
+static int store_chunk(const char *store, GzJob *job, size_t outBound)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+
+    job->stored = 0;
+    mzSha1(job->in, job->inLen, job->digest);
+    chunk_path(store, job->digest, path, sizeof(path));
+    if (access(path, F_OK) == 0) {
+        if (chunk_is_intact(path, job->digest, job->inLen)) return 0;
+        LOGW("Replacing damaged chunk %s\n", path);
+    }
+
+    if (gz_compress(job, outBound)) return -1;
+    if (dirCreateHierarchy(path, 0755, NULL, true)) return -1;
+
+    // Write it under a temporary name, and only rename it into place
+    // once it's on the card, so a chunk that exists is always complete.
+    snprintf(tmp, sizeof(tmp), "%s.%lx.tmp", path,
+            (unsigned long) pthread_self());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    int bad = write_to_card(fd, job->out, job->outLen) || fsync(fd);
+    if (close(fd) || bad || rename(tmp, path)) {
+        unlink(tmp);
+        return -1;
+    }
+    if (sync_parent(path)) return -1;
+    job->stored = 1;
+    return 0;
+}
+
+static void *gz_worker(void *cookie)
+{
+    GzWriter *w = (GzWriter *) cookie;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        GzJob *job = NULL;
+        int i;
+        for (i = 0; i < w->count; ++i) {
+            GzJob *j = &w->jobs[(w->head + i) % GZ_MAX_JOBS];
+            if (j->state == JOB_QUEUED) {
+                job = j;
+                break;
+            }
+        }
+        if (job == NULL) {
+            if (w->stop) break;
+            pthread_cond_wait(&w->cond, &w->lock);
+            continue;
+        }
+        job->state = JOB_BUSY;
+        pthread_mutex_unlock(&w->lock);
+
+        int r;
+        if (w->store == NULL) {
+            r = gz_compress(job, w->outBound);
+        } else {
+            r = job->inLen > 0 ? store_chunk(w->store, job, w->outBound) : 0;
+        }
+
+        pthread_mutex_lock(&w->lock);
+        job->state = r == 0 ? JOB_DONE : JOB_FAILED;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// Writes out the oldest job, waiting for it to be compressed if "wait"
+// is set.  Returns 1 if a job was retired.  Called with the lock held.
+static int gz_retire_locked(GzWriter *w, int wait)
+{
+    if (w->count == 0) return 0;
+    GzJob *job = &w->jobs[w->head];
+    while (wait && (job->state == JOB_QUEUED || job->state == JOB_BUSY)) {
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+    if (job->state != JOB_DONE && job->state != JOB_FAILED) return 0;
+
+    pthread_mutex_unlock(&w->lock);
+    int ok = job->state == JOB_DONE;
+    if (!ok) {
+        LOGE("Can't compress backup data\n");
+    } else if (w->store == NULL) {
+        ok = write_to_card(w->fd, job->out, job->outLen) == 0;
+    } else if (job->inLen > 0) {
+        char line[MZ_SHA1_DIGEST_SIZE * 2 + 32];
+        digest_hex(job->digest, line);
+        int n = MZ_SHA1_DIGEST_SIZE * 2;
+        n += sprintf(line + n, " %lu\n", (unsigned long) job->inLen);
+        ok = write_to_card(w->fd, line, n) == 0;
+    }
+    if (job->state == JOB_DONE && !ok) {
+        LOGE("Can't write backup (%s)\n", strerror(errno));
+    }
+    pthread_mutex_lock(&w->lock);
+
+    if (!ok) w->failed = 1;
+    if (w->store == NULL) {
+        w->written += job->outLen;
+    } else if (job->inLen > 0) {
+        w->chunks++;
+        if (job->stored) {
+            w->newChunks++;
+            w->written += job->outLen;
+        }
+    }
+    job->state = JOB_FREE;
+    job->inLen = 0;
+    w->head = (w->head + 1) % GZ_MAX_JOBS;
+    w->count--;
+    return 1;
+}
+
+static void gz_close_workers(GzWriter *w)
+{
+    int i;
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    for (i = 0; i < w->numWorkers; ++i) {
+        pthread_join(w->workers[i], NULL);
+    }
+    for (i = 0; i < GZ_MAX_JOBS; ++i) {
+        free(w->jobs[i].in);
+        free(w->jobs[i].out);
+    }
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+}
+
+// Output goes to fd: compressed data, or with a store, the manifest.
+static int gz_open(GzWriter *w, int fd, const char *store)
+{
+    int i;
+    memset(w, 0, sizeof(*w));
+    w->fd = fd;
+    w->store = store;
+    w->chunkMax = store != NULL ? CDC_MAX_SIZE : GZ_CHUNK_SIZE;
+    // Room for a stored (incompressible) chunk plus the gzip framing.
+    w->outBound = compressBound(w->chunkMax) + 32;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    pthread_once(&g_gear_once, init_gear);
+    mzSha1Init(&w->sha);
+
+    for (i = 0; i < GZ_MAX_JOBS; ++i) {
+        w->jobs[i].in = malloc(w->chunkMax);
+        w->jobs[i].out = malloc(w->outBound);
+        if (w->jobs[i].in == NULL || w->jobs[i].out == NULL) {
+            gz_close_workers(w);
+            return -1;
+        }
+    }
+
+    if (store != NULL && write_to_card(fd, MANIFEST_MAGIC,
+            sizeof(MANIFEST_MAGIC) - 1)) {
+        gz_close_workers(w);
+        return -1;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cpus < 1 ? 1 : cpus > GZ_MAX_WORKERS ? GZ_MAX_WORKERS : cpus;
+    for (i = 0; i < workers; ++i) {
+        if (pthread_create(&w->workers[i], NULL, gz_worker, w) != 0) break;
+        w->numWorkers++;
+    }
+    if (w->numWorkers == 0) {
+        gz_close_workers(w);
+        return -1;
+    }
+    return 0;
+}
+
+// The job the producer is filling, starting a new one if need be.
+static GzJob *gz_filling_job(GzWriter *w)
+{
+    GzJob *job = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (w->count > 0) {
+        GzJob *last = &w->jobs[(w->head + w->count - 1) % GZ_MAX_JOBS];
+        if (last->state == JOB_FILLING) job = last;
+    }
+    if (job == NULL) {
+        // Write out whatever is finished, and make room if we must.
+        while (gz_retire_locked(w, w->count == GZ_MAX_JOBS)) {
+        }
+        job = &w->jobs[(w->head + w->count) % GZ_MAX_JOBS];
+        job->state = JOB_FILLING;
+        job->inLen = 0;
+        w->count++;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return job;
+}
+
+static void gz_submit(GzWriter *w, GzJob *job)
+{
+    pthread_mutex_lock(&w->lock);
+    job->state = JOB_QUEUED;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// How much of data (at most len bytes) belongs in a chunk that already
+// holds "have" bytes; sets *cut if the chunk ends there.
+static size_t gz_find_cut(GzWriter *w, size_t have, const unsigned char *data,
+        size_t len, int *cut)
+{
+    size_t i = 0;
+    uint32_t h = w->cut;
+    // Boundaries are never looked for inside the minimum size.
+    if (have < CDC_MIN_SIZE) {
+        i = CDC_MIN_SIZE - have < len ? CDC_MIN_SIZE - have : len;
+    }
+    for (; i < len; ++i) {
+        h = (h << 1) + g_gear[data[i]];
+        if ((h & CDC_MASK) == 0) {
+            *cut = 1;
+            w->cut = 0;
+            return i + 1;
+        }
+    }
+    w->cut = h;
+    return len;
+}
+
+static int gz_write(GzWriter *w, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    // Hashed here, on the way in, so that checking the backup later
+    // doesn't need a second read of the partition.
+    mzSha1Update(&w->sha, data, len);
+    while (len > 0) {
+        GzJob *job = gz_filling_job(w);
+        size_t copy = w->chunkMax - job->inLen;
+        int cut = 0;
+        if (copy > len) copy = len;
+        if (w->store != NULL) copy = gz_find_cut(w, job->inLen, p, copy, &cut);
+        memcpy(job->in + job->inLen, p, copy);
+        job->inLen += copy;
+        p += copy;
+        len -= copy;
+        if (cut || job->inLen == w->chunkMax) {
+            w->cut = 0;
+            gz_submit(w, job);
+        }
+    }
+    return w->failed ? -1 : 0;
+}
+
+// Flushes everything, stops the workers and returns 0 if all of the
+// output was written.  Does not close the file.
+static int gz_close(GzWriter *w)
+{
+    GzJob *job = gz_filling_job(w);
+    gz_submit(w, job);  // may be empty; still a valid (empty) member
+
+    pthread_mutex_lock(&w->lock);
+    while (gz_retire_locked(w, 1)) {
+    }
+    int failed = w->failed;
+    pthread_mutex_unlock(&w->lock);
+
+    gz_close_workers(w);
+    return failed ? -1 : 0;
+}
+
+/*
+ * Progress across the whole backup.
+ */
+typedef struct {
+    long long done;
+    long long total;
+    pthread_mutex_t lock;   // items may be running on several threads
+} Progress;
+
+static void progress_add(Progress *progress, long long bytes)
+{
+    pthread_mutex_lock(&progress->lock);
+    progress->done += bytes;
+    mzPhaseAdd(bytes);
+    if (progress->total > 0) {
+        ui_set_progress((float) progress->done / progress->total);
+    }
+    pthread_mutex_unlock(&progress->lock);
+}
+
+/*
+ * Running items concurrently, one thread per device.  Items on the same
+ * device still run one after another, in table order, since they'd
+ * only compete for the same flash.
+ */
+typedef int (*ItemFunc)(const BackupItem *item, void *cookie);
+
+typedef struct {
+    const BackupItem *items[NUM_BACKUP_ITEMS];
+    int count;
+    ItemFunc fn;
+    void *cookie;
+    volatile int *failed;   // shared by all groups
+    pthread_t thread;
+} DeviceGroup;
+
+static void *run_device_group(void *arg)
+{
+    DeviceGroup *group = (DeviceGroup *) arg;
+    int i;
+    for (i = 0; i < group->count && !*group->failed; ++i) {
+        if (group->fn(group->items[i], group->cookie)) *group->failed = 1;
+    }
+    return NULL;
+}
+
+static int run_items_by_device(ItemFunc fn, void *cookie)
+{
+    DeviceGroup groups[NUM_BACKUP_ITEMS];
+    volatile int failed = 0;
+    int numGroups = 0;
+    size_t i;
+    int g;
+
+    for (i = 0; i < NUM_BACKUP_ITEMS; ++i) {
+        const BackupItem *item = &g_backup_items[i];
+        for (g = 0; g < numGroups; ++g) {
+            if (strcmp(groups[g].items[0]->device, item->device) == 0) break;
+        }
+        if (g == numGroups) {
+            memset(&groups[g], 0, sizeof(groups[g]));
+            groups[g].fn = fn;
+            groups[g].cookie = cookie;
+            groups[g].failed = &failed;
+            numGroups++;
+        }
+        groups[g].items[groups[g].count++] = item;
+    }
+
+    // The first group runs here; the others get threads of their own,
+    // or run here too if one can't be started.
+    for (g = 1; g < numGroups; ++g) {
+        if (pthread_create(&groups[g].thread, NULL,
+                run_device_group, &groups[g]) != 0) {
+            run_device_group(&groups[g]);
+            groups[g].count = -1;   // nothing to join
+        }
+    }
+    run_device_group(&groups[0]);
+    for (g = 1; g < numGroups; ++g) {
+        if (groups[g].count >= 0) pthread_join(groups[g].thread, NULL);
+    }
+    return failed ? -1 : 0;
+}
+
+static long long estimate_size(const BackupItem *item)
+{
+    if (item->kind == BACKUP_RAW) {
+        const MtdPartition *partition = get_root_mtd_partition(item->root);
+        size_t total_size;
+        if (partition == NULL ||
+            mtd_partition_info(partition, &total_size, NULL, NULL)) {
+            return 0;
+        }
+        return total_size;
+    }
+
+    char path[PATH_MAX];
+    struct statfs st;
+    if (ensure_root_path_mounted(item->root) ||
+        translate_root_path(item->root, path, sizeof(path)) == NULL ||
+        statfs(path, &st)) {
+        return 0;
+    }
+    return (long long) (st.f_blocks - st.f_bfree) * st.f_bsize;
+}
+
+/*
+ * Raw partitions.
+ */
+static int backup_raw(const BackupItem *item, GzWriter *gz,
+        Progress *progress)
+{
+    const MtdPartition *partition = get_root_mtd_partition(item->root);
+    if (partition == NULL) {
+        LOGE("Can't find partition for %s\n", item->root);
+        return -1;
+    }
+    size_t erase_size;
+    if (mtd_partition_info(partition, NULL, &erase_size, NULL)) {
+        LOGE("Can't get size of %s\n", item->root);
+        return -1;
+    }
+    MtdReadContext *in = mtd_read_partition(partition);
+    if (in == NULL) {
+        LOGE("Can't open %s (%s)\n", item->root, strerror(errno));
+        return -1;
+    }
+
+    char *buffer = malloc(erase_size);
+    int result = buffer != NULL ? 0 : -1;
+    while (result == 0) {
+        // One block per call; mtd_read_data() batches the reads itself,
+        // and skips bad blocks, so the image simply ends early.
+        ssize_t r = mtd_read_data(in, buffer, erase_size);
+        if (r < 0) {
+            if (errno != ENOSPC) {
+                LOGE("Can't read %s (%s)\n", item->root, strerror(errno));
+                result = -1;
+            }
+            break;
+        }
+        if (gz_write(gz, buffer, r)) result = -1;
+        progress_add(progress, r);
+    }
+
+    free(buffer);
+    mtd_read_close(in);
+    return result;
+}
+
+/*
+ * Mountable partitions, as tar archives (ustar, with GNU long names).
+ */
+#define TAR_BLOCK 512
+
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} TarHeader;
+
+static void tar_octal(char *field, size_t width, unsigned long long value)
+{
+    snprintf(field, width, "%0*llo", (int) width - 1, value);
+}
+
+static int tar_pad(GzWriter *gz, unsigned long long size)
+{
+    static const char zeros[TAR_BLOCK];
+    size_t rem = size % TAR_BLOCK;
+    return rem ? gz_write(gz, zeros, TAR_BLOCK - rem) : 0;
+}
+
+static int tar_header(GzWriter *gz, const char *name, char type,
+        const struct stat *st, unsigned long long size, const char *link);
+
+// Names that don't fit a header go in a GNU long name record before it.
+static int tar_long_name(GzWriter *gz, char type, const char *name)
+{
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    size_t len = strlen(name) + 1;
+    if (tar_header(gz, "././@LongLink", type, &st, len, NULL) ||
+        gz_write(gz, name, len) ||
+        tar_pad(gz, len)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int tar_header(GzWriter *gz, const char *name, char type,
+        const struct stat *st, unsigned long long size, const char *link)
+{
+    TarHeader h;
+    if (strlen(name) >= sizeof(h.name) && tar_long_name(gz, 'L', name)) {
+        return -1;
+    }
+    if (link != NULL && strlen(link) >= sizeof(h.linkname) &&
+        tar_long_name(gz, 'K', link)) {
+        return -1;
+    }
+
+    memset(&h, 0, sizeof(h));
+    strncpy(h.name, name, sizeof(h.name) - 1);
+    tar_octal(h.mode, sizeof(h.mode), st->st_mode & 07777);
+    tar_octal(h.uid, sizeof(h.uid), st->st_uid);
+    tar_octal(h.gid, sizeof(h.gid), st->st_gid);
+    tar_octal(h.size, sizeof(h.size), size);
+    tar_octal(h.mtime, sizeof(h.mtime), st->st_mtime);
+    h.typeflag = type;
+    if (link != NULL) strncpy(h.linkname, link, sizeof(h.linkname) - 1);
+    memcpy(h.magic, "ustar", 6);
+    memcpy(h.version, "00", 2);
+
+    // The checksum is computed with the field itself full of spaces.
+    memset(h.chksum, ' ', sizeof(h.chksum));
+    const unsigned char *p = (const unsigned char *) &h;
+    unsigned int sum = 0;
+    size_t i;
+    for (i = 0; i < sizeof(h); ++i) sum += p[i];
+    snprintf(h.chksum, sizeof(h.chksum), "%06o", sum);
+
+    return gz_write(gz, &h, sizeof(h));
+}
+
+static int tar_file(GzWriter *gz, const char *path, const char *name,
+        const struct stat *st, Progress *progress)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Can't open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    if (tar_header(gz, name, '0', st, st->st_size, NULL)) {
+        close(fd);
+        return -1;
+    }
+
+    // The header promised st_size bytes; pad or truncate to that even
+    // if the file changes under us.
+    char buffer[64 * 1024];
+    unsigned long long left = st->st_size;
+    int result = 0;
+    while (left > 0 && result == 0) {
+        size_t want = left < sizeof(buffer) ? left : sizeof(buffer);
+        ssize_t r = read(fd, buffer, want);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            LOGW("%s shrank while being backed up\n", path);
+            memset(buffer, 0, want);
+            r = want;
+        }
+        if (gz_write(gz, buffer, r)) result = -1;
+        left -= r;
+        progress_add(progress, r);
+    }
+    close(fd);
+    return result ? -1 : tar_pad(gz, st->st_size);
+}
+
+static int tar_tree(GzWriter *gz, char *path, size_t pathLen,
+        char *name, size_t nameLen, Progress *progress)
+{
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        LOGE("Can't open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    int result = 0;
+    struct dirent *de;
+    while (result == 0 && (de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        size_t len = strlen(de->d_name);
+        if (pathLen + 1 + len >= PATH_MAX || nameLen + 2 + len >= PATH_MAX) {
+            LOGE("Path too long under %s\n", path);
+            result = -1;
+            break;
+        }
+        path[pathLen] = '/';
+        strcpy(path + pathLen + 1, de->d_name);
+        name[nameLen] = '/';
+        strcpy(name + nameLen + 1, de->d_name);
+
+        struct stat st;
+        if (lstat(path, &st)) {
+            LOGE("Can't stat %s (%s)\n", path, strerror(errno));
+            result = -1;
+        } else if (S_ISDIR(st.st_mode)) {
+            // Directory names end in a slash in tar archives.
+            name[nameLen + 1 + len] = '/';
+            name[nameLen + 2 + len] = '\0';
+            result = tar_header(gz, name, '5', &st, 0, NULL);
+            name[nameLen + 1 + len] = '\0';
+            if (result == 0) {
+                result = tar_tree(gz, path, pathLen + 1 + len,
+                        name, nameLen + 1 + len, progress);
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            result = tar_file(gz, path, name, &st, progress);
+        } else if (S_ISLNK(st.st_mode)) {
+            char link[PATH_MAX];
+            ssize_t r = readlink(path, link, sizeof(link) - 1);
+            if (r < 0) {
+                LOGE("Can't read link %s (%s)\n", path, strerror(errno));
+                result = -1;
+            } else {
+                link[r] = '\0';
+                result = tar_header(gz, name, '2', &st, 0, link);
+            }
+        } else {
+            LOGW("Skipping special file %s\n", path);
+        }
+        path[pathLen] = '\0';
+        name[nameLen] = '\0';
+    }
+    closedir(dir);
+    return result;
+}
+
+static int backup_tree(const BackupItem *item, GzWriter *gz,
+        Progress *progress)
+{
+    char path[PATH_MAX], name[PATH_MAX];
+    // roots.c keeps a single table of mounted volumes; don't let two
+    // device threads rescan it at once.
+    pthread_mutex_lock(&g_roots_lock);
+    int mounted = ensure_root_path_mounted(item->root) == 0;
+    const char *translated = mounted ?
+            translate_root_path(item->root, path, sizeof(path)) : NULL;
+    pthread_mutex_unlock(&g_roots_lock);
+    if (!mounted) {
+        LOGE("Can't mount %s\n", item->root);
+        return -1;
+    }
+    if (translated == NULL) {
+        LOGE("Bad root %s\n", item->root);
+        return -1;
+    }
+    size_t pathLen = strlen(path);
+    while (pathLen > 1 && path[pathLen - 1] == '/') path[--pathLen] = '\0';
+
+    // Entries are named relative to "/", e.g. "system/app/Foo.apk", as
+    // "tar -C / -c system" would name them.
+    const char *top = strrchr(path, '/');
+    top = top != NULL ? top + 1 : path;
+    strcpy(name, top);
+    size_t nameLen = strlen(name);
+
+    struct stat st;
+    if (stat(path, &st)) {
+        LOGE("Can't stat %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    name[nameLen] = '/';
+    name[nameLen + 1] = '\0';
+    if (tar_header(gz, name, '5', &st, 0, NULL)) return -1;
+    name[nameLen] = '\0';
+
+    if (tar_tree(gz, path, pathLen, name, nameLen, progress)) return -1;
+
+    // Two empty blocks mark the end of the archive.
+    static const char zeros[2 * TAR_BLOCK];
+    return gz_write(gz, zeros, sizeof(zeros));
+}
+
+/*
+ * ext4 volumes, block by block.  Only the blocks that the allocation
+ * bitmaps mark as in use are read, and they're saved as an Android
+ * sparse image (the format of ext4_utils' simg2img), with the free
+ * stretches in between left out.  No file is ever opened, so a volume
+ * full of small ones costs no more than one holding a few big ones.
+ * The volume is unmounted throughout, so the copy is consistent.
+ */
+#define EXT4_SUPER_OFFSET 1024
+#define EXT4_SUPER_MAGIC 0xef53
+#define EXT4_INCOMPAT_META_BG 0x0010
+#define EXT4_INCOMPAT_64BIT 0x0080
+#define EXT4_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT4_RO_COMPAT_GDT_CSUM 0x0010
+#define EXT4_RO_COMPAT_BIGALLOC 0x0200
+#define EXT4_RO_COMPAT_METADATA_CSUM 0x0400
+#define EXT4_BG_BLOCK_UNINIT 0x0002
+
+#define SPARSE_HEADER_MAGIC 0xed26ff3a
+#define SPARSE_HEADER_SIZE 28
+#define SPARSE_CHUNK_HEADER_SIZE 12
+#define CHUNK_TYPE_RAW 0xcac1
+#define CHUNK_TYPE_FILL 0xcac2
+#define CHUNK_TYPE_DONT_CARE 0xcac3
+#define CHUNK_TYPE_CRC32 0xcac4
+
+// Blocks are read and written this many bytes at a time, from and to
+// page-aligned buffers.
+#define BLOCK_IO_SIZE (1024 * 1024)
+
+typedef struct {
+    int fd;
+    uint32_t blockSize;
+    uint32_t blocks;            // in the filesystem
+    uint32_t usedBlocks;
+    unsigned char *used;        // one bit per block
+} Ext4Volume;
+
+static uint32_t get_le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void put_le16(unsigned char *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+static void put_le32(unsigned char *p, uint32_t value)
+{
+    put_le16(p, value);
+    put_le16(p + 2, value >> 16);
+}
+
+static int pread_fully(int fd, void *data, size_t len, off64_t offset)
+{
+    char *p = (char *) data;
+    while (len > 0) {
+        ssize_t r = pread64(fd, p, len, offset);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r;
+        len -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+static int block_used(const Ext4Volume *vol, uint32_t block)
+{
+    return vol->used[block >> 3] & (1 << (block & 7));
+}
+
+static void mark_blocks(Ext4Volume *vol, uint64_t start, uint64_t count)
+{
+    for (; count > 0 && start < vol->blocks; ++start, --count) {
+        vol->used[start >> 3] |= 1 << (start & 7);
+    }
+}
+
+// Whether a group holds a backup of the superblock and descriptors.
+static int group_has_super(uint32_t group, int sparse)
+{
+    static const uint32_t bases[] = { 3, 5, 7 };
+    size_t i;
+    if (group <= 1 || !sparse) return 1;
+    for (i = 0; i < sizeof(bases) / sizeof(bases[0]); ++i) {
+        uint32_t n = group;
+        while (n % bases[i] == 0) n /= bases[i];
+        if (n == 1) return 1;
+    }
+    return 0;
+}
+
+static void ext4_close(Ext4Volume *vol)
+{
+    if (vol->fd >= 0) close(vol->fd);
+    free(vol->used);
+    vol->fd = -1;
+    vol->used = NULL;
+}
+
+/* Reads device's superblock, group descriptors and block bitmaps into
+ * vol.  Fails, saying why, for anything but an ext2/3/4 layout it fully
+ * understands; the caller can fall back to saving files then.
+ */
+static int ext4_open(const char *device, Ext4Volume *vol)
+{
+    unsigned char sb[1024];
+    unsigned char *gdt = NULL, *bitmap = NULL;
+    memset(vol, 0, sizeof(*vol));
+    vol->fd = open(device, O_RDONLY);
+    if (vol->fd < 0) {
+        LOGW("Can't open %s (%s)\n", device, strerror(errno));
+        return -1;
+    }
+    if (pread_fully(vol->fd, sb, sizeof(sb), EXT4_SUPER_OFFSET) ||
+        get_le16(sb + 0x38) != EXT4_SUPER_MAGIC) {
+        LOGW("No ext2/3/4 filesystem on %s\n", device);
+        goto fail;
+    }
+
+    uint32_t incompat = get_le32(sb + 0x60);
+    uint32_t roCompat = get_le32(sb + 0x64);
+    uint32_t logBlockSize = get_le32(sb + 0x18);
+    uint32_t firstBlock = get_le32(sb + 0x14);
+    uint32_t perGroup = get_le32(sb + 0x20);
+    uint32_t inodesPerGroup = get_le32(sb + 0x28);
+    uint32_t inodeSize = get_le32(sb + 0x4c) != 0 ? get_le16(sb + 0x58) : 128;
+    uint32_t reservedGdt = get_le16(sb + 0xce);
+    size_t descSize = 32;
+    uint64_t blocks = get_le32(sb + 0x04);
+    if (incompat & EXT4_INCOMPAT_64BIT) {
+        blocks |= (uint64_t) get_le32(sb + 0x150) << 32;
+        descSize = get_le16(sb + 0xfe);
+    }
+    if ((incompat & EXT4_INCOMPAT_META_BG) ||
+        (roCompat & EXT4_RO_COMPAT_BIGALLOC) || logBlockSize > 6 ||
+        descSize < 32 || perGroup == 0 ||
+        perGroup > (1024u << logBlockSize) * 8 ||
+        blocks <= firstBlock || blocks > UINT32_MAX) {
+        LOGW("Unsupported ext4 layout on %s\n", device);
+        goto fail;
+    }
+    vol->blockSize = 1024 << logBlockSize;
+    vol->blocks = blocks;
+
+    uint32_t bs = vol->blockSize;
+    uint32_t groups = (vol->blocks - firstBlock + perGroup - 1) / perGroup;
+    size_t gdtLen = (size_t) groups * descSize;
+    uint32_t gdtBlocks = (gdtLen + bs - 1) / bs;
+    uint32_t itableBlocks =
+            ((uint64_t) inodesPerGroup * inodeSize + bs - 1) / bs;
+    int uninit = (roCompat &
+            (EXT4_RO_COMPAT_GDT_CSUM | EXT4_RO_COMPAT_METADATA_CSUM)) != 0;
+    int sparse = (roCompat & EXT4_RO_COMPAT_SPARSE_SUPER) != 0;
+
+    vol->used = calloc((vol->blocks + 7) / 8, 1);
+    gdt = malloc(gdtLen);
+    bitmap = malloc(bs);
+    if (vol->used == NULL || gdt == NULL || bitmap == NULL) {
+        LOGE("Out of memory for %s's bitmaps\n", device);
+        goto fail;
+    }
+    if (pread_fully(vol->fd, gdt, gdtLen, (off64_t) (firstBlock + 1) * bs)) {
+        LOGW("Can't read %s's group descriptors (%s)\n", device,
+                strerror(errno));
+        goto fail;
+    }
+
+    // The boot block, with 1K blocks; the superblock itself is in a
+    // group's bitmap.
+    mark_blocks(vol, 0, firstBlock);
+    uint32_t g, i;
+    for (g = 0; g < groups; ++g) {
+        const unsigned char *desc = gdt + (size_t) g * descSize;
+        uint64_t blockBitmap = get_le32(desc);
+        uint64_t inodeBitmap = get_le32(desc + 0x04);
+        uint64_t inodeTable = get_le32(desc + 0x08);
+        if (descSize >= 64) {
+            blockBitmap |= (uint64_t) get_le32(desc + 0x20) << 32;
+            inodeBitmap |= (uint64_t) get_le32(desc + 0x24) << 32;
+            inodeTable |= (uint64_t) get_le32(desc + 0x28) << 32;
+        }
+        // With flex_bg these can live in another group, one whose own
+        // bitmap may not be written yet.
+        mark_blocks(vol, blockBitmap, 1);
+        mark_blocks(vol, inodeBitmap, 1);
+        mark_blocks(vol, inodeTable, itableBlocks);
+
+        uint32_t start = firstBlock + g * perGroup;
+        if (uninit && (get_le16(desc + 0x12) & EXT4_BG_BLOCK_UNINIT)) {
+            // The bitmap was never written; nothing in the group is in
+            // use but its copy of the superblock and descriptors.
+            if (group_has_super(g, sparse)) {
+                mark_blocks(vol, start, 1 + gdtBlocks + reservedGdt);
+            }
+            continue;
+        }
+        if (blockBitmap >= vol->blocks ||
+            pread_fully(vol->fd, bitmap, bs, (off64_t) blockBitmap * bs)) {
+            LOGW("Can't read block bitmap %u of %s\n", g, device);
+            goto fail;
+        }
+        for (i = 0; i < perGroup && start + i < vol->blocks; ++i) {
+            if (bitmap[i >> 3] & (1 << (i & 7))) mark_blocks(vol, start + i, 1);
+        }
+    }
+    for (i = 0; i < vol->blocks; ++i) {
+        if (block_used(vol, i)) vol->usedBlocks++;
+    }
+    free(gdt);
+    free(bitmap);
+    return 0;
+
+fail:
+    free(gdt);
+    free(bitmap);
+    ext4_close(vol);
+    return -1;
+}
+
+// The run of used or free blocks starting at start, as one chunk.
+static uint32_t block_run(const Ext4Volume *vol, uint32_t start, int *used)
+{
+    uint32_t max = (UINT32_MAX - SPARSE_CHUNK_HEADER_SIZE) / vol->blockSize;
+    uint32_t end = start + 1;
+    *used = block_used(vol, start) != 0;
+    while (end < vol->blocks && end - start < max &&
+           (block_used(vol, end) != 0) == *used) {
+        ++end;
+    }
+    return end - start;
+}
+
+static int sparse_chunk_header(GzWriter *gz, uint32_t type, uint32_t blocks,
+        uint32_t totalSize)
+{
+    unsigned char header[SPARSE_CHUNK_HEADER_SIZE];
+    put_le16(header, type);
+    put_le16(header + 2, 0);
+    put_le32(header + 4, blocks);
+    put_le32(header + 8, totalSize);
+    return gz_write(gz, header, sizeof(header));
+}
+
+static int backup_blocks(const BackupItem *item, Ext4Volume *vol,
+        GzWriter *gz, Progress *progress)
+{
+    uint32_t bs = vol->blockSize;
+    uint32_t block, count, chunks = 0;
+    int used;
+    for (block = 0; block < vol->blocks; block += count) {
+        count = block_run(vol, block, &used);
+        ++chunks;
+    }
+    LOGI("%s: %u of %u blocks of %u bytes in use, in %u chunks\n",
+            item->root, vol->usedBlocks, vol->blocks, bs, chunks);
+
+    unsigned char header[SPARSE_HEADER_SIZE];
+    put_le32(header, SPARSE_HEADER_MAGIC);
+    put_le16(header + 4, 1);        // major version
+    put_le16(header + 6, 0);
+    put_le16(header + 8, SPARSE_HEADER_SIZE);
+    put_le16(header + 10, SPARSE_CHUNK_HEADER_SIZE);
+    put_le32(header + 12, bs);
+    put_le32(header + 16, vol->blocks);
+    put_le32(header + 20, chunks);
+    put_le32(header + 24, 0);       // no image checksum
+    if (gz_write(gz, header, sizeof(header))) return -1;
+
+    char *buffer = memalign(getpagesize(), BLOCK_IO_SIZE);
+    if (buffer == NULL) {
+        LOGE("Out of memory for %s\n", item->root);
+        return -1;
+    }
+    int result = 0;
+    for (block = 0; block < vol->blocks && result == 0; block += count) {
+        count = block_run(vol, block, &used);
+        if (!used) {
+            result = sparse_chunk_header(gz, CHUNK_TYPE_DONT_CARE, count,
+                    SPARSE_CHUNK_HEADER_SIZE);
+            continue;
+        }
+        uint64_t len = (uint64_t) count * bs;
+        off64_t offset = (off64_t) block * bs;
+        result = sparse_chunk_header(gz, CHUNK_TYPE_RAW, count,
+                SPARSE_CHUNK_HEADER_SIZE + len);
+        while (len > 0 && result == 0) {
+            size_t n = len < BLOCK_IO_SIZE ? len : BLOCK_IO_SIZE;
+            if (pread_fully(vol->fd, buffer, n, offset)) {
+                LOGE("Can't read %s (%s)\n", item->root, strerror(errno));
+                result = -1;
+                break;
+            }
+            if (gz_write(gz, buffer, n)) result = -1;
+            progress_add(progress, n);
+            offset += n;
+            len -= n;
+        }
+    }
+    free(buffer);
+    return result;
+}
+
+typedef struct {
+    const char *dir;
+    const char *store;      // NULL without NANDROID_DEDUP
+    Progress progress;
+    int chunks, newChunks;
+    long long written;
+    pthread_mutex_t lock;   // for the counts
+
+    // Per item, indexed like g_backup_items.
+    uint8_t digests[NUM_BACKUP_ITEMS][MZ_SHA1_DIGEST_SIZE];
+    long long lengths[NUM_BACKUP_ITEMS];
+    int saved[NUM_BACKUP_ITEMS];
+    BackupKind kinds[NUM_BACKUP_ITEMS];     // as saved
+} BackupJob;
+
+// Unmounts an ext4 item and reads its bitmaps.
+static int open_block_item(const BackupItem *item, Ext4Volume *vol)
+{
+    pthread_mutex_lock(&g_roots_lock);
+    const char *device = get_root_block_device(item->root);
+    int unmounted = device != NULL &&
+            ensure_root_path_unmounted(item->root) == 0;
+    pthread_mutex_unlock(&g_roots_lock);
+    if (!unmounted) {
+        LOGW("Can't unmount %s\n", item->root);
+        return -1;
+    }
+    return ext4_open(device, vol);
+}
+
+static int backup_item(const BackupItem *item, void *cookie)
+{
+    BackupJob *job = (BackupJob *) cookie;
+    const char *dir = job->dir;
+    const char *store = job->store;
+    Progress *progress = &job->progress;
+
+    ui_print("\nBacking up %s", item->root);
+    BackupKind kind = item->kind;
+    Ext4Volume vol;
+    vol.fd = -1;
+    vol.used = NULL;
+    if (kind == BACKUP_BLOCKS && open_block_item(item, &vol)) {
+        LOGW("Saving the files on %s instead\n", item->root);
+        kind = BACKUP_TREE;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s.%s.%s", dir, item->name,
+            kind_type(kind), store != NULL ? "manifest" : "gz");
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOGE("Can't create %s (%s)\n", path, strerror(errno));
+        ext4_close(&vol);
+        return -1;
+    }
+    GzWriter gz;
+    if (gz_open(&gz, fd, store)) {
+        LOGE("Can't start compressor for %s\n", path);
+        close(fd);
+        ext4_close(&vol);
+        return -1;
+    }
+
+    int result;
+    if (kind == BACKUP_RAW) {
+        result = backup_raw(item, &gz, progress);
+    } else if (kind == BACKUP_BLOCKS) {
+        result = backup_blocks(item, &vol, &gz, progress);
+    } else {
+        result = backup_tree(item, &gz, progress);
+    }
+    ext4_close(&vol);
+    if (gz_close(&gz)) result = -1;
+    if (fsync(fd) || close(fd)) {
+        LOGE("Can't write %s (%s)\n", path, strerror(errno));
+        result = -1;
+    }
+    size_t index = item - g_backup_items;
+    pthread_mutex_lock(&job->lock);
+    if (result == 0) {
+        job->lengths[index] = gz.sha.count;
+        memcpy(job->digests[index], mzSha1Final(&gz.sha),
+                MZ_SHA1_DIGEST_SIZE);
+        job->saved[index] = 1;
+        job->kinds[index] = kind;
+    }
+    job->chunks += gz.chunks;
+    job->newChunks += gz.newChunks;
+    job->written += gz.written;
+    pthread_mutex_unlock(&job->lock);
+    return result;
+}
+
+static int write_digests(const BackupJob *job)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", job->dir, DIGESTS_FILE);
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        LOGE("Can't create %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    size_t i;
+    for (i = 0; i < NUM_BACKUP_ITEMS; ++i) {
+        if (!job->saved[i]) continue;
+        const BackupItem *item = &g_backup_items[i];
+        char hex[MZ_SHA1_DIGEST_SIZE * 2 + 1];
+        digest_hex(job->digests[i], hex);
+        fprintf(f, "%s %lld %s.%s.%s\n", hex, job->lengths[i], item->name,
+                kind_type(job->kinds[i]),
+                job->store != NULL ? "manifest" : "gz");
+    }
+    int bad = ferror(f) || fflush(f) || fsync(fileno(f));
+    if (fclose(f) || bad) {
+        LOGE("Can't write %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// The chunk store shared by every slot: a "chunks" directory next to
+// the slot directories.
+static void get_store_dir(const char *slot_dir, char *store, size_t len)
+{
+    snprintf(store, len, "%s", slot_dir);
+    size_t n = strlen(store);
+    while (n > 1 && store[n - 1] == '/') store[--n] = '\0';
+    char *slash = strrchr(store, '/');
+    if (slash != NULL) {
+        slash[1] = '\0';
+    } else {
+        store[0] = '\0';
+    }
+    strncat(store, "chunks", len - strlen(store) - 1);
+}
+
+int nandroid_backup(const char *slot_dir, int flags)
+{
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    char dir[PATH_MAX];
+    char stamp[32];
+    time_t now = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+    snprintf(dir, sizeof(dir), "%s/%s", slot_dir, stamp);
+    if (dirCreateHierarchy(dir, 0755, NULL, false)) {
+        LOGE("Can't create %s (%s)\n", dir, strerror(errno));
+        return -1;
+    }
+
+    char store[PATH_MAX];
+    get_store_dir(slot_dir, store, sizeof(store));
+    if ((flags & NANDROID_DEDUP) &&
+        dirCreateHierarchy(store, 0755, NULL, false)) {
+        LOGE("Can't create %s (%s)\n", store, strerror(errno));
+        dirUnlinkHierarchy(dir);
+        return -1;
+    }
+
+    BackupJob job;
+    memset(&job, 0, sizeof(job));
+    job.dir = dir;
+    job.store = (flags & NANDROID_DEDUP) ? store : NULL;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_mutex_init(&job.progress.lock, NULL);
+    size_t i;
+    for (i = 0; i < NUM_BACKUP_ITEMS; ++i) {
+        job.progress.total += estimate_size(&g_backup_items[i]);
+    }
+    ui_show_progress(1.0, 0);
+
+    mzPhaseBegin("backup", job.progress.total);
+    int result = run_items_by_device(backup_item, &job);
+    if (result == 0) result = write_digests(&job);
+    if (result == 0) result = write_info(dir, now);
+    mzPhaseEnd();
+    sync();
+    ui_reset_progress();
+    pthread_mutex_destroy(&job.progress.lock);
+    pthread_mutex_destroy(&job.lock);
+
+    if (result != 0) {
+        dirUnlinkHierarchy(dir);
+        // Chunks written so far are complete and harmless; the next
+        // backup can use them, and nandroid_collect_chunks() can drop
+        // them.
+        return -1;
+    }
+
+    gettimeofday(&end, NULL);
+    long ms = (end.tv_sec - start.tv_sec) * 1000 +
+            (end.tv_usec - start.tv_usec) / 1000;
+    ui_print("\nSaved %lld MB to %s in %ld s", job.progress.done >> 20,
+            dir, ms / 1000);
+    if (flags & NANDROID_DEDUP) {
+        ui_print("\n%d of %d chunks were new (%lld MB written)",
+                job.newChunks, job.chunks, job.written >> 20);
+    }
+    LOGI("backup: %lld bytes in %ld ms, wrote %lld\n", job.progress.done, ms,
+            job.written);
+    return 0;
+}
+
+/*
+ * Reading backups back.
+ */
+
+// Inflates a file of one or more gzip members into sink.  Also hashes
+// the output if sha is non-NULL.
+static int inflate_file(const char *path, NandroidSink sink, void *cookie,
+        MzSha1Ctx *sha, long long *pLen)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Can't open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    unsigned char in[64 * 1024], out[64 * 1024];
+    z_stream zstream;
+    memset(&zstream, 0, sizeof(zstream));
+    if (inflateInit2(&zstream, 16 + MAX_WBITS) != Z_OK) {
+        close(fd);
+        return -1;
+    }
+
+    int result = 0, zerr = Z_OK;
+    long long total = 0;
+    ssize_t r;
+    while (result == 0 && (r = read(fd, in, sizeof(in))) != 0) {
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            result = -1;
+            break;
+        }
+        zstream.next_in = in;
+        zstream.avail_in = r;
+        while (result == 0 && zstream.avail_in > 0) {
+            if (zerr == Z_STREAM_END) {
+                // Another member follows.
+                inflateReset(&zstream);
+            }
+            zstream.next_out = out;
+            zstream.avail_out = sizeof(out);
+            zerr = inflate(&zstream, Z_NO_FLUSH);
+            if (zerr != Z_OK && zerr != Z_STREAM_END) {
+                LOGE("Corrupt data in %s\n", path);
+                result = -1;
+                break;
+            }
+            size_t have = sizeof(out) - zstream.avail_out;
+            if (have > 0) {
+                if (sha != NULL) mzSha1Update(sha, out, have);
+                if (sink(out, have, cookie)) result = -1;
+                total += have;
+            }
+        }
+    }
+    if (result == 0 && zerr != Z_STREAM_END) {
+        LOGE("%s is truncated\n", path);
+        result = -1;
+    }
+    inflateEnd(&zstream);
+    close(fd);
+    if (pLen != NULL) *pLen = total;
+    return result;
+}
+
+static int parse_digest(const char *hex, uint8_t *digest)
+{
+    int i;
+    for (i = 0; i < MZ_SHA1_DIGEST_SIZE; ++i) {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1) return -1;
+        digest[i] = byte;
+    }
+    return 0;
+}
+
+// Calls fn for every chunk a manifest lists.  Stops early if fn fails.
+static int read_manifest(const char *path,
+        int (*fn)(const uint8_t *digest, unsigned long len, void *cookie),
+        void *cookie)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        LOGE("Can't open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    char line[128];
+    int result = 0;
+    if (fgets(line, sizeof(line), f) == NULL ||
+        strcmp(line, MANIFEST_MAGIC) != 0) {
+        LOGE("%s is not a backup manifest\n", path);
+        result = -1;
+    }
+    while (result == 0 && fgets(line, sizeof(line), f) != NULL) {
+        uint8_t digest[MZ_SHA1_DIGEST_SIZE];
+        char hex[MZ_SHA1_DIGEST_SIZE * 2 + 1];
+        unsigned long len;
+        if (sscanf(line, "%40s %lu", hex, &len) != 2 ||
+            strlen(hex) != MZ_SHA1_DIGEST_SIZE * 2 ||
+            parse_digest(hex, digest)) {
+            LOGE("Bad line in %s\n", path);
+            result = -1;
+        } else {
+            result = fn(digest, len, cookie);
+        }
+    }
+    fclose(f);
+    return result;
+}
+
+typedef struct {
+    char store[PATH_MAX];
+    NandroidSink sink;
+    void *cookie;
+} ReassembleArgs;
+
+static int reassemble_chunk(const uint8_t *digest, unsigned long len,
+        void *cookie)
+{
+    ReassembleArgs *args = (ReassembleArgs *) cookie;
+    char path[PATH_MAX];
+    MzSha1Ctx sha;
+    long long got;
+
+    chunk_path(args->store, digest, path, sizeof(path));
+    mzSha1Init(&sha);
+    if (inflate_file(path, args->sink, args->cookie, &sha, &got)) return -1;
+    if (got != (long long) len ||
+        memcmp(mzSha1Final(&sha), digest, MZ_SHA1_DIGEST_SIZE) != 0) {
+        LOGE("Chunk %s is damaged\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int nandroid_read_item(const char *path, NandroidSink sink, void *cookie)
+{
+    size_t len = strlen(path);
+    static const char suffix[] = ".manifest";
+    if (len < sizeof(suffix) ||
+        strcmp(path + len - (sizeof(suffix) - 1), suffix) != 0) {
+        return inflate_file(path, sink, cookie, NULL, NULL);
+    }
+
+    // <nandroid>/<slot>/<backup>/<item>.manifest -> <nandroid>/chunks
+    ReassembleArgs args;
+    char slot[PATH_MAX];
+    snprintf(slot, sizeof(slot), "%s", path);
+    char *slash = strrchr(slot, '/');
+    if (slash != NULL) *slash = '\0';
+    slash = strrchr(slot, '/');
+    if (slash != NULL) *slash = '\0';
+    get_store_dir(slot, args.store, sizeof(args.store));
+    args.sink = sink;
+    args.cookie = cookie;
+    return read_manifest(path, reassemble_chunk, &args);
+}
+
+/*
+ * Restoring.  Data is streamed from the decompressor straight into the
+ * flash or the filesystem; nothing is staged in /tmp or on the sdcard.
+ */
+
+// Finds the file holding item's data in backup dir, if there is one,
+// and how it was saved.  An ext4 volume may have been saved as files,
+// by an older backup or when its blocks couldn't be read.
+static int find_item_file(const BackupItem *item, const char *dir,
+        char *path, size_t len, BackupKind *kind)
+{
+    BackupKind kinds[2];
+    int numKinds = 0, i;
+    kinds[numKinds++] = item->kind;
+    if (item->kind == BACKUP_BLOCKS) kinds[numKinds++] = BACKUP_TREE;
+    for (i = 0; i < numKinds; ++i) {
+        const char *type = kind_type(kinds[i]);
+        *kind = kinds[i];
+        snprintf(path, len, "%s/%s.%s.manifest", dir, item->name, type);
+        if (access(path, R_OK) == 0) return 0;
+        snprintf(path, len, "%s/%s.%s.gz", dir, item->name, type);
+        if (access(path, R_OK) == 0) return 0;
+    }
+    return -1;
+}
+
+// Uncompressed size of an item, for the progress bar: exact for a
+// manifest, a guess for a .gz.
+typedef struct {
+    long long total;
+} SizeArgs;
+
+static int add_chunk_size(const uint8_t *digest, unsigned long len,
+        void *cookie)
+{
+    ((SizeArgs *) cookie)->total += len;
+    return 0;
+}
+
+static long long restore_size(const char *path)
+{
+    size_t len = strlen(path);
+    if (len > 9 && strcmp(path + len - 9, ".manifest") == 0) {
+        SizeArgs args;
+        args.total = 0;
+        return read_manifest(path, add_chunk_size, &args) ? 0 : args.total;
+    }
+    struct stat st;
+    return stat(path, &st) ? 0 : (long long) st.st_size * 2;
+}
+
+typedef struct {
+    MtdWriteContext *out;
+    Progress *progress;
+} RawSink;
+
+static int write_raw(const void *data, size_t len, void *cookie)
+{
+    RawSink *sink = (RawSink *) cookie;
+    if (mtd_write_data(sink->out, data, len) != (ssize_t) len) {
+        LOGE("Can't write to flash (%s)\n", strerror(errno));
+        return -1;
+    }
+    progress_add(sink->progress, len);
+    return 0;
+}
+
+static int restore_raw(const BackupItem *item, const char *path,
+        Progress *progress)
+{
+    const MtdPartition *partition = get_root_mtd_partition(item->root);
+    if (partition == NULL) {
+        LOGE("Can't find partition for %s\n", item->root);
+        return -1;
+    }
+    RawSink sink;
+    sink.progress = progress;
+    sink.out = mtd_write_partition(partition);
+    if (sink.out == NULL) {
+        LOGE("Can't write %s (%s)\n", item->root, strerror(errno));
+        return -1;
+    }
+    // Blocks that didn't change since the backup are left alone.
+    mtd_write_skip_unchanged(sink.out);
+
+    int result = nandroid_read_item(path, write_raw, &sink);
+    if (result == 0 && mtd_erase_blocks(sink.out, -1) == (off_t) -1) {
+        LOGE("Can't erase the rest of %s\n", item->root);
+        result = -1;
+    }
+    if (mtd_write_close(sink.out)) result = -1;
+    return result;
+}
+
+/* A tar extractor that's fed the archive a piece at a time, so that no
+ * more than one header and one output buffer are ever held.
+ */
+enum { TAR_HEADER, TAR_DATA, TAR_LONG_NAME, TAR_LONG_LINK, TAR_SKIP };
+
+typedef struct {
+    const char *target;     // directory the top-level entry maps to
+    Progress *progress;
+
+    unsigned char header[TAR_BLOCK];
+    size_t have;            // bytes of header collected
+    int state;
+    unsigned long long left;    // data bytes left in this entry
+    size_t pad;                 // padding after them
+
+    char longName[PATH_MAX];
+    char longLink[PATH_MAX];
+    size_t longLen;
+    int haveLongName, haveLongLink;
+
+    int fd;                 // file being written, in TAR_DATA
+    char path[PATH_MAX];
+    struct stat st;         // its mode, owner and times
+    int failed;
+} TarReader;
+
+static unsigned long long tar_field(const char *field, size_t width)
+{
+    unsigned long long value = 0;
+    size_t i = 0;
+    while (i < width && field[i] == ' ') ++i;
+    for (; i < width && field[i] >= '0' && field[i] <= '7'; ++i) {
+        value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+// True if any directory between the target and path's last component
+// is a symlink, such as one an earlier entry of the archive made.
+static int tar_through_symlink(TarReader *t, const char *path)
+{
+    size_t start = strlen(t->target);
+    if (path[start] == '\0') return 0;
+    const char *slash = path + start;
+    while ((slash = strchr(slash + 1, '/')) != NULL) {
+        char dir[PATH_MAX];
+        size_t n = slash - path;
+        memcpy(dir, path, n);
+        dir[n] = '\0';
+        struct stat st;
+        if (lstat(dir, &st) == 0 && S_ISLNK(st.st_mode)) return 1;
+    }
+    return 0;
+}
+
+// Maps an archive name such as "system/app/Foo.apk" to a path under
+// the target directory.  Refuses names that would escape it, whether
+// with ".." or by going through a symlink.
+static int tar_target_path(TarReader *t, const char *name,
+        char *path, size_t len)
+{
+    const char *rest = strchr(name, '/');
+    rest = rest != NULL ? rest + 1 : "";
+    if (strncmp(rest, "../", 3) == 0 || strstr(rest, "/../") != NULL ||
+        strcmp(rest, "..") == 0 ||
+        (strlen(rest) >= 3 && strcmp(rest + strlen(rest) - 3, "/..") == 0)) {
+        LOGE("Refusing to restore %s\n", name);
+        return -1;
+    }
+    snprintf(path, len, "%s/%s", t->target, rest);
+    size_t n = strlen(path);
+    while (n > 1 && path[n - 1] == '/') path[--n] = '\0';
+    if (tar_through_symlink(t, path)) {
+        LOGE("Refusing to restore %s through a symlink\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+static void tar_set_owner(const char *path, const struct stat *st, int link)
+{
+    if (link) {
+        lchown(path, st->st_uid, st->st_gid);
+        return;
+    }
+    chown(path, st->st_uid, st->st_gid);
+    chmod(path, st->st_mode & 07777);
+}
+
+static int tar_begin_entry(TarReader *t)
+{
+    const TarHeader *h = (const TarHeader *) t->header;
+    int i;
+
+    // All-zero blocks end the archive; just keep skipping them.
+    for (i = 0; i < TAR_BLOCK && t->header[i] == 0; ++i) {
+    }
+    if (i == TAR_BLOCK) return 0;
+
+    unsigned int sum = 0;
+    for (i = 0; i < TAR_BLOCK; ++i) {
+        sum += (i >= 148 && i < 156) ? ' ' : t->header[i];
+    }
+    if (sum != tar_field(h->chksum, sizeof(h->chksum))) {
+        LOGE("Corrupt tar header\n");
+        return -1;
+    }
+
+    unsigned long long size = tar_field(h->size, sizeof(h->size));
+    t->left = size;
+    t->pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+
+    if (h->typeflag == 'L' || h->typeflag == 'K') {
+        t->state = h->typeflag == 'L' ? TAR_LONG_NAME : TAR_LONG_LINK;
+        t->longLen = 0;
+        return 0;
+    }
+
+    char name[PATH_MAX], linkName[PATH_MAX];
+    if (t->haveLongName) {
+        strcpy(name, t->longName);
+    } else if (h->prefix[0] != '\0') {
+        snprintf(name, sizeof(name), "%.155s/%.100s", h->prefix, h->name);
+    } else {
+        snprintf(name, sizeof(name), "%.100s", h->name);
+    }
+    if (t->haveLongLink) {
+        strcpy(linkName, t->longLink);
+    } else {
+        snprintf(linkName, sizeof(linkName), "%.100s", h->linkname);
+    }
+    t->haveLongName = t->haveLongLink = 0;
+
+    memset(&t->st, 0, sizeof(t->st));
+    t->st.st_mode = tar_field(h->mode, sizeof(h->mode));
+    t->st.st_uid = tar_field(h->uid, sizeof(h->uid));
+    t->st.st_gid = tar_field(h->gid, sizeof(h->gid));
+    t->st.st_mtime = tar_field(h->mtime, sizeof(h->mtime));
+    if (tar_target_path(t, name, t->path, sizeof(t->path))) return -1;
+
+    t->state = TAR_SKIP;
+    switch (h->typeflag) {
+    case '0':
+    case '\0':
+        unlink(t->path);
+        t->fd = open(t->path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW,
+                0600);
+        if (t->fd < 0) {
+            LOGE("Can't create %s (%s)\n", t->path, strerror(errno));
+            return -1;
+        }
+        t->state = TAR_DATA;
+        break;
+    case '5': {
+        // chown() and chmod() below would follow a link left here.
+        struct stat st;
+        if (lstat(t->path, &st) == 0 && S_ISLNK(st.st_mode)) unlink(t->path);
+        if (mkdir(t->path, 0700) && errno != EEXIST) {
+            LOGE("Can't create %s (%s)\n", t->path, strerror(errno));
+            return -1;
+        }
+        tar_set_owner(t->path, &t->st, 0);
+        break;
+    }
+    case '2':
+        unlink(t->path);
+        if (symlink(linkName, t->path)) {
+            LOGE("Can't link %s (%s)\n", t->path, strerror(errno));
+            return -1;
+        }
+        tar_set_owner(t->path, &t->st, 1);
+        break;
+    case '1': {
+        char target[PATH_MAX];
+        if (tar_target_path(t, linkName, target, sizeof(target))) return -1;
+        unlink(t->path);
+        if (link(target, t->path)) {
+            LOGE("Can't link %s (%s)\n", t->path, strerror(errno));
+            return -1;
+        }
+        break;
+    }
+    default:
+        LOGW("Skipping special file %s\n", t->path);
+        break;
+    }
+    return 0;
+}
+
+static int tar_end_file(TarReader *t)
+{
+    int result = 0;
+    if (fchown(t->fd, t->st.st_uid, t->st.st_gid) ||
+        fchmod(t->fd, t->st.st_mode & 07777)) {
+        LOGW("Can't set owner of %s (%s)\n", t->path, strerror(errno));
+    }
+    if (close(t->fd)) {
+        LOGE("Can't write %s (%s)\n", t->path, strerror(errno));
+        result = -1;
+    }
+    t->fd = -1;
+    struct timeval times[2];
+    times[0].tv_sec = times[1].tv_sec = t->st.st_mtime;
+    times[0].tv_usec = times[1].tv_usec = 0;
+    utimes(t->path, times);
+    return result;
+}
+
+static int tar_extract(const void *data, size_t len, void *cookie)
+{
+    TarReader *t = (TarReader *) cookie;
+    const unsigned char *p = (const unsigned char *) data;
+    progress_add(t->progress, len);
+
+    while (len > 0 && !t->failed) {
+        size_t n;
+        if (t->state == TAR_HEADER) {
+            n = TAR_BLOCK - t->have;
+            if (n > len) n = len;
+            memcpy(t->header + t->have, p, n);
+            t->have += n;
+            if (t->have == TAR_BLOCK) {
+                t->have = 0;
+                if (tar_begin_entry(t)) t->failed = 1;
+            }
+        } else if (t->left > 0) {
+            n = t->left < len ? t->left : len;
+            if (t->state == TAR_DATA) {
+                if (write_fully(t->fd, p, n)) {
+                    LOGE("Can't write %s (%s)\n", t->path, strerror(errno));
+                    t->failed = 1;
+                }
+            } else if (t->state == TAR_LONG_NAME || t->state == TAR_LONG_LINK) {
+                char *dest = t->state == TAR_LONG_NAME ?
+                        t->longName : t->longLink;
+                size_t room = PATH_MAX - 1 - t->longLen;
+                memcpy(dest + t->longLen, p, n < room ? n : room);
+                t->longLen += n < room ? n : room;
+                dest[t->longLen] = '\0';
+            }
+            t->left -= n;
+        } else if (t->pad > 0) {
+            n = t->pad < len ? t->pad : len;
+            t->pad -= n;
+        } else {
+            // Entry done (data and padding); wrap it up.
+            n = 0;
+            if (t->state == TAR_DATA && tar_end_file(t)) t->failed = 1;
+            if (t->state == TAR_LONG_NAME) t->haveLongName = 1;
+            if (t->state == TAR_LONG_LINK) t->haveLongLink = 1;
+            t->state = TAR_HEADER;
+        }
+        p += n;
+        len -= n;
+    }
+    // An empty file's entry is complete as soon as its header is in.
+    if (!t->failed && t->state == TAR_DATA && t->left == 0 && t->pad == 0) {
+        if (tar_end_file(t)) t->failed = 1;
+        t->state = TAR_HEADER;
+    }
+    return t->failed ? -1 : 0;
+}
+
+static int restore_tree(const BackupItem *item, const char *path,
+        Progress *progress)
+{
+    char target[PATH_MAX];
+    pthread_mutex_lock(&g_roots_lock);
+    int ok = format_root_device(item->root) == 0 &&
+            ensure_root_path_mounted(item->root) == 0 &&
+            translate_root_path(item->root, target, sizeof(target)) != NULL;
+    pthread_mutex_unlock(&g_roots_lock);
+    if (!ok) {
+        LOGE("Can't format and mount %s\n", item->root);
+        return -1;
+    }
+    size_t n = strlen(target);
+    while (n > 1 && target[n - 1] == '/') target[--n] = '\0';
+
+    TarReader t;
+    memset(&t, 0, sizeof(t));
+    t.target = target;
+    t.progress = progress;
+    t.fd = -1;
+    int result = nandroid_read_item(path, tar_extract, &t);
+    // Catch a file cut short by the end of the stream.
+    if (t.fd >= 0) {
+        close(t.fd);
+        if (result == 0) {
+            LOGE("%s ends in the middle of %s\n", path, t.path);
+            result = -1;
+        }
+    }
+    return result;
+}
+
+/* A sparse image writer that's fed the image a piece at a time.  Data
+ * is gathered into BLOCK_IO_SIZE writes at block-aligned offsets; the
+ * free blocks between chunks are skipped, not written, since nothing in
+ * the restored filesystem refers to them.
+ */
+enum { SPARSE_HEADER, SPARSE_CHUNK, SPARSE_RAW, SPARSE_FILL, SPARSE_SKIP };
+
+typedef struct {
+    const char *root;
+    int fd;
+    off64_t deviceSize;
+    Progress *progress;
+
+    unsigned char header[SPARSE_HEADER_SIZE];
+    size_t have;            // bytes of header collected
+    int state;
+    uint32_t blockSize;
+    uint32_t totalBlocks, totalChunks, chunks;
+    uint32_t block;             // where the current chunk goes
+    uint32_t chunkBlocks;
+    unsigned long long left;    // bytes of chunk data left
+    off64_t offset;             // where the next RAW byte goes
+    unsigned char fill[4096];   // a FILL chunk's pattern, repeated
+
+    unsigned char *buffer;  // BLOCK_IO_SIZE, page-aligned
+    off64_t bufferStart;
+    size_t bufferLen;
+    int failed;
+} SparseReader;
+
+static int sparse_flush(SparseReader *s)
+{
+    const unsigned char *p = s->buffer;
+    size_t len = s->bufferLen;
+    off64_t offset = s->bufferStart;
+    int result = 0;
+    while (len > 0) {
+        ssize_t r = pwrite64(s->fd, p, len, offset);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            LOGE("Can't write %s (%s)\n", s->root, strerror(errno));
+            result = -1;
+            break;
+        }
+        p += r;
+        len -= r;
+        offset += r;
+    }
+    s->bufferStart += s->bufferLen;
+    s->bufferLen = 0;
+    return result;
+}
+
+// Adds len bytes at offset to the pending write, flushing as needed.
+static int sparse_put(SparseReader *s, const unsigned char *data, size_t len,
+        off64_t offset)
+{
+    if (s->bufferLen > 0 && s->bufferStart + s->bufferLen != offset &&
+        sparse_flush(s)) {
+        return -1;
+    }
+    if (s->bufferLen == 0) s->bufferStart = offset;
+    while (len > 0) {
+        size_t n = BLOCK_IO_SIZE - s->bufferLen;
+        if (n > len) n = len;
+        memcpy(s->buffer + s->bufferLen, data, n);
+        s->bufferLen += n;
+        data += n;
+        len -= n;
+        if (s->bufferLen == BLOCK_IO_SIZE && sparse_flush(s)) return -1;
+    }
+    return 0;
+}
+
+static int sparse_begin(SparseReader *s)
+{
+    const unsigned char *h = s->header;
+    if (get_le32(h) != SPARSE_HEADER_MAGIC || get_le16(h + 4) != 1 ||
+        get_le16(h + 8) != SPARSE_HEADER_SIZE ||
+        get_le16(h + 10) != SPARSE_CHUNK_HEADER_SIZE) {
+        LOGE("Not a sparse image this can restore\n");
+        return -1;
+    }
+    s->blockSize = get_le32(h + 12);
+    s->totalBlocks = get_le32(h + 16);
+    s->totalChunks = get_le32(h + 20);
+    if (s->blockSize == 0 || s->blockSize % 4 != 0 ||
+        BLOCK_IO_SIZE % s->blockSize != 0) {
+        LOGE("Bad block size %u in sparse image\n", s->blockSize);
+        return -1;
+    }
+    if ((off64_t) s->totalBlocks * s->blockSize > s->deviceSize) {
+        LOGE("%s is too small for this backup (%lld < %lld bytes)\n",
+                s->root, (long long) s->deviceSize,
+                (long long) s->totalBlocks * s->blockSize);
+        return -1;
+    }
+    return 0;
+}
+
+static int sparse_begin_chunk(SparseReader *s)
+{
+    const unsigned char *h = s->header;
+    uint32_t type = get_le16(h);
+    uint32_t blocks = get_le32(h + 4);
+    unsigned long long data = get_le32(h + 8);
+    if (data < SPARSE_CHUNK_HEADER_SIZE) goto bad;
+    data -= SPARSE_CHUNK_HEADER_SIZE;
+    if (++s->chunks > s->totalChunks ||
+        (uint64_t) s->block + blocks > s->totalBlocks) {
+        LOGE("Sparse image runs past its end\n");
+        return -1;
+    }
+
+    s->chunkBlocks = blocks;
+    s->offset = (off64_t) s->block * s->blockSize;
+    s->left = data;
+    switch (type) {
+    case CHUNK_TYPE_RAW:
+        if (data != (unsigned long long) blocks * s->blockSize) goto bad;
+        s->state = SPARSE_RAW;
+        break;
+    case CHUNK_TYPE_FILL:
+        if (data != 4) goto bad;
+        s->state = SPARSE_FILL;
+        break;
+    case CHUNK_TYPE_DONT_CARE:
+    case CHUNK_TYPE_CRC32:
+        if (data != (type == CHUNK_TYPE_CRC32 ? 4 : 0)) goto bad;
+        if (type == CHUNK_TYPE_CRC32) s->chunkBlocks = 0;
+        s->state = SPARSE_SKIP;
+        break;
+    default:
+        goto bad;
+    }
+    return 0;
+
+bad:
+    LOGE("Bad chunk %u in sparse image\n", s->chunks);
+    return -1;
+}
+
+// Repeats the 4-byte pattern at the start of s->fill over this FILL
+// chunk's blocks.
+static int sparse_fill(SparseReader *s)
+{
+    size_t i;
+    for (i = 4; i < sizeof(s->fill); i += 4) memcpy(s->fill + i, s->fill, 4);
+    unsigned long long len =
+            (unsigned long long) s->chunkBlocks * s->blockSize;
+    while (len > 0) {
+        size_t n = len < sizeof(s->fill) ? len : sizeof(s->fill);
+        if (sparse_put(s, s->fill, n, s->offset)) return -1;
+        s->offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int sparse_extract(const void *data, size_t len, void *cookie)
+{
+    SparseReader *s = (SparseReader *) cookie;
+    const unsigned char *p = (const unsigned char *) data;
+    progress_add(s->progress, len);
+
+    while (len > 0 && !s->failed) {
+        size_t n;
+        if (s->state == SPARSE_HEADER || s->state == SPARSE_CHUNK) {
+            size_t size = s->state == SPARSE_HEADER ?
+                    SPARSE_HEADER_SIZE : SPARSE_CHUNK_HEADER_SIZE;
+            n = size - s->have;
+            if (n > len) n = len;
+            memcpy(s->header + s->have, p, n);
+            s->have += n;
+            if (s->have == size) {
+                s->have = 0;
+                int r = s->state == SPARSE_HEADER ?
+                        sparse_begin(s) : sparse_begin_chunk(s);
+                if (r) s->failed = 1;
+                if (s->state == SPARSE_HEADER) s->state = SPARSE_CHUNK;
+            }
+        } else if (s->state == SPARSE_RAW) {
+            n = s->left < len ? s->left : len;
+            if (sparse_put(s, p, n, s->offset)) s->failed = 1;
+            s->offset += n;
+            s->left -= n;
+        } else if (s->state == SPARSE_FILL) {
+            n = s->left < len ? s->left : len;
+            memcpy(s->fill + 4 - s->left, p, n);
+            s->left -= n;
+        } else {
+            n = s->left < len ? s->left : len;
+            s->left -= n;
+        }
+        p += n;
+        len -= n;
+
+        // A chunk's data is all in; move on to the next header.
+        if (!s->failed && s->left == 0 && s->state >= SPARSE_RAW) {
+            if (s->state == SPARSE_FILL && sparse_fill(s)) s->failed = 1;
+            s->block += s->chunkBlocks;
+            s->state = SPARSE_CHUNK;
+        }
+    }
+    return s->failed ? -1 : 0;
+}
+
+static int restore_blocks(const BackupItem *item, const char *path,
+        Progress *progress)
+{
+    pthread_mutex_lock(&g_roots_lock);
+    const char *device = get_root_block_device(item->root);
+    int ok = device != NULL && ensure_root_path_unmounted(item->root) == 0;
+    pthread_mutex_unlock(&g_roots_lock);
+    if (!ok) {
+        LOGE("Can't unmount %s\n", item->root);
+        return -1;
+    }
+
+    SparseReader s;
+    memset(&s, 0, sizeof(s));
+    s.root = item->root;
+    s.progress = progress;
+    s.fd = open(device, O_WRONLY);
+    if (s.fd < 0) {
+        LOGE("Can't open %s (%s)\n", device, strerror(errno));
+        return -1;
+    }
+    s.deviceSize = lseek64(s.fd, 0, SEEK_END);
+    s.buffer = memalign(getpagesize(), BLOCK_IO_SIZE);
+    int result = -1;
+    if (s.deviceSize < 0 || s.buffer == NULL) {
+        LOGE("Can't set up writing %s\n", device);
+    } else {
+        result = nandroid_read_item(path, sparse_extract, &s);
+    }
+    if (result == 0 && (s.state != SPARSE_CHUNK || s.have != 0 ||
+            s.chunks != s.totalChunks || s.block != s.totalBlocks)) {
+        LOGE("%s ends in the middle of the image\n", path);
+        result = -1;
+    }
+    if (s.bufferLen > 0 && sparse_flush(&s)) result = -1;
+    if (fsync(s.fd)) result = -1;
+    close(s.fd);
+    free(s.buffer);
+    return result;
+}
+
+typedef struct {
+    const char *dir;
+    Progress progress;
+} RestoreJob;
+
+static int restore_item(const BackupItem *item, void *cookie)
+{
+    RestoreJob *job = (RestoreJob *) cookie;
+    char path[PATH_MAX];
+    BackupKind kind;
+    if (find_item_file(item, job->dir, path, sizeof(path), &kind)) {
+        return 0;  // not in this backup
+    }
+    ui_print("\nRestoring %s", item->root);
+    switch (kind) {
+    case BACKUP_RAW:
+        return restore_raw(item, path, &job->progress);
+    case BACKUP_BLOCKS:
+        return restore_blocks(item, path, &job->progress);
+    default:
+        return restore_tree(item, path, &job->progress);
+    }
+}
+
+int nandroid_is_native_backup(const char *backup_dir)
+{
+    size_t i;
+    char path[PATH_MAX];
+    BackupKind kind;
+    for (i = 0; i < NUM_BACKUP_ITEMS; ++i) {
+        if (find_item_file(&g_backup_items[i], backup_dir,
+                path, sizeof(path), &kind) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int nandroid_restore(const char *backup_dir)
+{
+    RestoreJob job;
+    memset(&job, 0, sizeof(job));
+    job.dir = backup_dir;
+    pthread_mutex_init(&job.progress.lock, NULL);
+
+    size_t i;
+    char path[PATH_MAX];
+    BackupKind kind;
+    for (i = 0; i < NUM_BACKUP_ITEMS; ++i) {
+        if (find_item_file(&g_backup_items[i], backup_dir,
+                path, sizeof(path), &kind) == 0) {
+            job.progress.total += restore_size(path);
+        }
+    }
+    ui_show_progress(1.0, 0);
+    // The restored partitions aren't what an interrupted install left.
+    forget_install_checkpoint();
+
+    mzPhaseBegin("restore", job.progress.total);
+    int result = run_items_by_device(restore_item, &job);
+    mzPhaseEnd();
+    sync();
+    ui_reset_progress();
+    pthread_mutex_destroy(&job.progress.lock);
+    return result;
+}
+
+/*
+ * Verifying, against the digests taken while the backup was made.
+ */
+typedef struct {
+    MzSha1Ctx sha;
+    Progress *progress;
+} VerifySink;
+
+static int hash_data(const void *data, size_t len, void *cookie)
+{
+    VerifySink *v = (VerifySink *) cookie;
+    mzSha1Update(&v->sha, data, len);
+    progress_add(v->progress, len);
+    return 0;
+}
+
+int nandroid_verify(const char *backup_dir)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", backup_dir, DIGESTS_FILE);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        ui_print("\nNo digests in this backup; can't verify it");
+        return -1;
+    }
+
+    Progress progress;
+    memset(&progress, 0, sizeof(progress));
+    pthread_mutex_init(&progress.lock, NULL);
+    char line[PATH_MAX + 64];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char hex[MZ_SHA1_DIGEST_SIZE * 2 + 1];
+        long long len;
+        if (sscanf(line, "%40s %lld", hex, &len) == 2) progress.total += len;
+    }
+    rewind(f);
+    ui_show_progress(1.0, 0);
+    mzPhaseBegin("verify", progress.total);
+
+    int result = 0, items = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char hex[MZ_SHA1_DIGEST_SIZE * 2 + 1], name[PATH_MAX];
+        uint8_t digest[MZ_SHA1_DIGEST_SIZE];
+        long long len;
+        if (sscanf(line, "%40s %lld %s", hex, &len, name) != 3 ||
+            strlen(hex) != MZ_SHA1_DIGEST_SIZE * 2 ||
+            parse_digest(hex, digest) || strchr(name, '/') != NULL) {
+            LOGE("Bad line in %s\n", DIGESTS_FILE);
+            result = -1;
+            continue;
+        }
+        ui_print("\nVerifying %s...", name);
+        snprintf(path, sizeof(path), "%s/%s", backup_dir, name);
+
+        VerifySink v;
+        mzSha1Init(&v.sha);
+        v.progress = &progress;
+        // Keep going after a bad item, so every damaged one is reported.
+        if (nandroid_read_item(path, hash_data, &v) != 0 ||
+            (long long) v.sha.count != len ||
+            memcmp(mzSha1Final(&v.sha), digest, MZ_SHA1_DIGEST_SIZE) != 0) {
+            ui_print(" BAD");
+            result = -1;
+        } else {
+            ui_print(" ok");
+        }
+        ++items;
+    }
+    fclose(f);
+    mzPhaseEnd();
+    ui_reset_progress();
+    pthread_mutex_destroy(&progress.lock);
+    return items > 0 ? result : -1;
+}
+
+/*
+ * Chunk store garbage collection.
+ */
+typedef struct {
+    uint8_t (*digests)[MZ_SHA1_DIGEST_SIZE];
+    size_t count, alloc;
+} DigestSet;
+
+static int add_digest(const uint8_t *digest, unsigned long len, void *cookie)
+{
+    DigestSet *set = (DigestSet *) cookie;
+    if (set->count == set->alloc) {
+        size_t alloc = set->alloc ? set->alloc * 2 : 1024;
+        void *d = realloc(set->digests, alloc * MZ_SHA1_DIGEST_SIZE);
+        if (d == NULL) return -1;
+        set->digests = d;
+        set->alloc = alloc;
+    }
+    memcpy(set->digests[set->count++], digest, MZ_SHA1_DIGEST_SIZE);
+    return 0;
+}
+
+static int compare_digests(const void *a, const void *b)
+{
+    return memcmp(a, b, MZ_SHA1_DIGEST_SIZE);
+}
+
+// Collects the chunks listed by every manifest two levels below dir
+// (<slot>/<backup>/*.manifest).
+static int collect_manifests(const char *dir, int depth, DigestSet *set)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL) return depth == 0 ? -1 : 0;
+    int result = 0;
+    struct dirent *de;
+    while (result == 0 && (de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        if (depth == 0 && strcmp(de->d_name, "chunks") == 0) continue;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        size_t len = strlen(de->d_name);
+        if (depth < 2) {
+            result = collect_manifests(path, depth + 1, set);
+        } else if (len > 9 && strcmp(de->d_name + len - 9, ".manifest") == 0) {
+            result = read_manifest(path, add_digest, set);
+        }
+    }
+    closedir(d);
+    return result;
+}
+
+int nandroid_collect_chunks(const char *nandroid_dir)
+{
+    DigestSet set;
+    memset(&set, 0, sizeof(set));
+    // Don't delete anything unless every manifest could be read.
+    if (collect_manifests(nandroid_dir, 0, &set)) {
+        free(set.digests);
+        return -1;
+    }
+    qsort(set.digests, set.count, MZ_SHA1_DIGEST_SIZE, compare_digests);
+
+    char store[PATH_MAX];
+    snprintf(store, sizeof(store), "%s/chunks", nandroid_dir);
+    int removed = 0;
+    DIR *top = opendir(store);
+    struct dirent *de;
+    while (top != NULL && (de = readdir(top)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        char sub[PATH_MAX];
+        snprintf(sub, sizeof(sub), "%s/%s", store, de->d_name);
+        DIR *d = opendir(sub);
+        struct dirent *ce;
+        while (d != NULL && (ce = readdir(d)) != NULL) {
+            if (ce->d_name[0] == '.') continue;
+            uint8_t digest[MZ_SHA1_DIGEST_SIZE];
+            int keep = strlen(ce->d_name) == MZ_SHA1_DIGEST_SIZE * 2 + 3 &&
+                    strcmp(ce->d_name + MZ_SHA1_DIGEST_SIZE * 2, ".gz") == 0 &&
+                    parse_digest(ce->d_name, digest) == 0 &&
+                    bsearch(digest, set.digests, set.count,
+                            MZ_SHA1_DIGEST_SIZE, compare_digests) != NULL;
+            if (!keep) {
+                char path[PATH_MAX];
+                snprintf(path, sizeof(path), "%s/%s", sub, ce->d_name);
+                if (unlink(path) == 0) removed++;
+            }
+        }
+        if (d != NULL) closedir(d);
+        rmdir(sub);  // only succeeds once it's empty
+    }
+    if (top != NULL) closedir(top);
+    free(set.digests);
+    return removed;
+}
+
+/*
+ * Summaries of the backups, for the menus.
+ *
+ * A native backup's summary is kept in INFO_FILE beside its digests, so
+ * it only takes one small read.  A background thread goes through the
+ * slots and summarises every backup it hasn't already (or whose
+ * directory has changed since), so the menus can show the summaries
+ * without touching the card themselves.
+ */
+
+// Adds one of a backup's files to its summary.
+static void info_add(NandroidInfo *info, const char *file, long long len)
+{
+    size_t n = strcspn(file, ".");
+    size_t used = strlen(info->names);
+    if (used + n + 2 <= sizeof(info->names)) {
+        if (used > 0) info->names[used++] = ',';
+        memcpy(info->names + used, file, n);
+        info->names[used + n] = '\0';
+    }
+    info->partitions++;
+    info->bytes += len;
+}
+
+static int write_info(const char *dir, time_t created)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, DIGESTS_FILE);
+    FILE *in = fopen(path, "r");
+    if (in == NULL) return -1;
+    snprintf(path, sizeof(path), "%s/%s", dir, INFO_FILE);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) {
+        fclose(in);
+        return -1;
+    }
+    fprintf(out, "%s\ncreated %ld\n", INFO_MAGIC, (long) created);
+    char line[PATH_MAX + 64];
+    while (fgets(line, sizeof(line), in) != NULL) fputs(line, out);
+    int bad = ferror(in) || ferror(out) || fflush(out) || fsync(fileno(out));
+    fclose(in);
+    if (fclose(out) || bad || rename(tmp, path)) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static int read_info(const char *dir, NandroidInfo *info)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, INFO_FILE);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+
+    char line[PATH_MAX + 64];
+    long created;
+    memset(info, 0, sizeof(*info));
+    int result = -1;
+    if (fgets(line, sizeof(line), f) != NULL &&
+        strncmp(line, INFO_MAGIC "\n", sizeof(INFO_MAGIC)) == 0 &&
+        fgets(line, sizeof(line), f) != NULL &&
+        sscanf(line, "created %ld", &created) == 1) {
+        info->created = created;
+        result = 0;
+        while (fgets(line, sizeof(line), f) != NULL) {
+            char hex[MZ_SHA1_DIGEST_SIZE * 2 + 1], name[PATH_MAX];
+            long long len;
+            if (sscanf(line, "%40s %lld %s", hex, &len, name) != 3) {
+                result = -1;
+                break;
+            }
+            info_add(info, name, len);
+        }
+    }
+    fclose(f);
+    return result;
+}
+
+// When the backup in dir was made: from its name if nandroid_backup()
+// stamped it, or else its directory's mtime.
+static time_t backup_time(const char *dir, const struct stat *st)
+{
+    const char *name = strrchr(dir, '/');
+    name = name != NULL ? name + 1 : dir;
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(name, "%4d%2d%2d-%2d%2d%2d", &tm.tm_year, &tm.tm_mon,
+            &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) == 6) {
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        tm.tm_isdst = -1;
+        time_t t = mktime(&tm);
+        if (t != (time_t) -1) return t;
+    }
+    return st->st_mtime;
+}
+
+// Summarises the backup in dir, writing its INFO_FILE if it's a
+// complete native one without.  Anything else (nandroid-mobile.sh's
+// backups, say) is summarised from its files' names and sizes.
+static int summarize_backup(const char *dir, const struct stat *st,
+        NandroidInfo *info)
+{
+    if (read_info(dir, info) == 0) return 0;
+    time_t created = backup_time(dir, st);
+    if (write_info(dir, created) == 0 && read_info(dir, info) == 0) {
+        return 0;
+    }
+
+    DIR *d = opendir(dir);
+    if (d == NULL) return -1;
+    memset(info, 0, sizeof(*info));
+    info->created = created;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        char path[PATH_MAX];
+        struct stat fst;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (stat(path, &fst) == 0 && S_ISREG(fst.st_mode) &&
+            (strstr(de->d_name, ".img") != NULL ||
+             strstr(de->d_name, ".tar") != NULL)) {
+            info_add(info, de->d_name, fst.st_size);
+        }
+    }
+    closedir(d);
+    return 0;
+}
+
+typedef struct {
+    char *dir;              // the backup directory
+    time_t mtime;           // of dir, when it was summarised
+    int seen;               // by the current pass
+    NandroidInfo info;
+} IndexEntry;
+
+// Guards everything below; the thread fills it in while the menus look.
+static pthread_mutex_t g_index_lock = PTHREAD_MUTEX_INITIALIZER;
+static IndexEntry *g_index = NULL;
+static int g_index_count = 0, g_index_alloc = 0;
+static char **g_index_slots = NULL;     // slots the current pass has done
+static int g_index_slot_count = 0;
+static int g_index_complete = 0;        // the current pass is done
+static char g_index_root[PATH_MAX];
+
+static pthread_t g_index_thread;
+static int g_index_running = 0;
+static volatile int g_index_cancel = 0;
+
+// Calls to the observer don't overlap with nandroid_index_watch().
+static pthread_mutex_t g_index_watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static NandroidIndexObserver g_index_observer = NULL;
+static void *g_index_cookie = NULL;
+
+static void index_changed(void)
+{
+    pthread_mutex_lock(&g_index_watch_lock);
+    if (g_index_observer != NULL) g_index_observer(g_index_cookie);
+    pthread_mutex_unlock(&g_index_watch_lock);
+}
+
+// Returns the entry for dir (given without a trailing slash), or NULL.
+static IndexEntry *index_find_locked(const char *dir, size_t len)
+{
+    int i;
+    for (i = 0; i < g_index_count; ++i) {
+        if (strncmp(g_index[i].dir, dir, len) == 0 &&
+            g_index[i].dir[len] == '\0') {
+            return &g_index[i];
+        }
+    }
+    return NULL;
+}
+
+static void index_backup(const char *dir)
+{
+    struct stat st;
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) return;
+
+    pthread_mutex_lock(&g_index_lock);
+    IndexEntry *e = index_find_locked(dir, strlen(dir));
+    int current = e != NULL && e->mtime == st.st_mtime;
+    if (current) e->seen = 1;
+    pthread_mutex_unlock(&g_index_lock);
+    if (current) return;
+
+    NandroidInfo info;
+    if (summarize_backup(dir, &st, &info) != 0) return;
+    // Writing INFO_FILE moved the directory's mtime.
+    if (stat(dir, &st) != 0) return;
+
+    pthread_mutex_lock(&g_index_lock);
+    e = index_find_locked(dir, strlen(dir));
+    if (e == NULL && g_index_count == g_index_alloc) {
+        int n = g_index_alloc ? g_index_alloc * 2 : 16;
+        IndexEntry *p = realloc(g_index, n * sizeof(IndexEntry));
+        if (p != NULL) {
+            g_index = p;
+            g_index_alloc = n;
+        }
+    }
+    if (e == NULL && g_index_count < g_index_alloc) {
+        e = &g_index[g_index_count++];
+        e->dir = strdup(dir);
+    }
+    if (e != NULL && e->dir != NULL) {
+        e->mtime = st.st_mtime;
+        e->seen = 1;
+        e->info = info;
+    }
+    pthread_mutex_unlock(&g_index_lock);
+    index_changed();
+}
+
+static void *index_thread(void *cookie)
+{
+    DIR *top = opendir(g_index_root);
+    struct dirent *de;
+    while (top != NULL && !g_index_cancel && (de = readdir(top)) != NULL) {
+        if (de->d_name[0] == '.' || strcmp(de->d_name, "chunks") == 0) {
+            continue;
+        }
+        char slot[PATH_MAX];
+        snprintf(slot, sizeof(slot), "%s/%s", g_index_root, de->d_name);
+        DIR *d = opendir(slot);
+        struct dirent *be;
+        while (d != NULL && !g_index_cancel && (be = readdir(d)) != NULL) {
+            if (be->d_name[0] == '.') continue;
+            char dir[PATH_MAX];
+            snprintf(dir, sizeof(dir), "%s/%s", slot, be->d_name);
+            index_backup(dir);
+        }
+        if (d != NULL) closedir(d);
+        if (g_index_cancel) break;
+
+        pthread_mutex_lock(&g_index_lock);
+        char **p = realloc(g_index_slots,
+                (g_index_slot_count + 1) * sizeof(char *));
+        if (p != NULL) {
+            g_index_slots = p;
+            g_index_slots[g_index_slot_count] = strdup(slot);
+            if (g_index_slots[g_index_slot_count] != NULL) {
+                g_index_slot_count++;
+            }
+        }
+        pthread_mutex_unlock(&g_index_lock);
+        index_changed();
+    }
+    if (top != NULL) closedir(top);
+
+    // Forget backups that have gone, once a whole pass has been made.
+    if (top != NULL && !g_index_cancel) {
+        pthread_mutex_lock(&g_index_lock);
+        int i, kept = 0;
+        for (i = 0; i < g_index_count; ++i) {
+            if (g_index[i].seen) {
+                g_index[kept++] = g_index[i];
+            } else {
+                free(g_index[i].dir);
+            }
+        }
+        g_index_count = kept;
+        g_index_complete = 1;
+        pthread_mutex_unlock(&g_index_lock);
+        index_changed();
+    }
+    return NULL;
+}
+
+void nandroid_index_stop(void)
+{
+    if (!g_index_running) return;
+    g_index_cancel = 1;
+    pthread_join(g_index_thread, NULL);
+    g_index_running = 0;
+}
+
+void nandroid_index_start(const char *nandroid_dir)
+{
+    nandroid_index_stop();
+
+    pthread_mutex_lock(&g_index_lock);
+    snprintf(g_index_root, sizeof(g_index_root), "%s", nandroid_dir);
+    size_t n = strlen(g_index_root);
+    while (n > 1 && g_index_root[n - 1] == '/') g_index_root[--n] = '\0';
+    int i;
+    for (i = 0; i < g_index_count; ++i) g_index[i].seen = 0;
+    for (i = 0; i < g_index_slot_count; ++i) free(g_index_slots[i]);
+    g_index_slot_count = 0;
+    g_index_complete = 0;
+    pthread_mutex_unlock(&g_index_lock);
+
+    g_index_cancel = 0;
+    g_index_running = pthread_create(&g_index_thread, NULL,
+            index_thread, NULL) == 0;
+}
+
+void nandroid_index_watch(NandroidIndexObserver observer, void *cookie)
+{
+    pthread_mutex_lock(&g_index_watch_lock);
+    g_index_observer = observer;
+    g_index_cookie = cookie;
+    pthread_mutex_unlock(&g_index_watch_lock);
+}
+
+// The length of path without trailing slashes.
+static size_t trimmed_len(const char *path)
+{
+    size_t n = strlen(path);
+    while (n > 1 && path[n - 1] == '/') --n;
+    return n;
+}
+
+int nandroid_index_lookup(const char *backup_dir, NandroidInfo *info)
+{
+    pthread_mutex_lock(&g_index_lock);
+    IndexEntry *e = index_find_locked(backup_dir, trimmed_len(backup_dir));
+    if (e != NULL) *info = e->info;
+    pthread_mutex_unlock(&g_index_lock);
+    return e != NULL ? 0 : -1;
+}
+
+int nandroid_index_slot(const char *slot_dir, int *backups,
+        long long *bytes, time_t *newest)
+{
+    size_t len = trimmed_len(slot_dir);
+    int i, done;
+    *backups = 0;
+    *bytes = 0;
+    *newest = 0;
+
+    pthread_mutex_lock(&g_index_lock);
+    // A slot the whole pass didn't find is simply empty.
+    done = g_index_complete;
+    for (i = 0; i < g_index_slot_count && !done; ++i) {
+        done = strncmp(g_index_slots[i], slot_dir, len) == 0 &&
+                g_index_slots[i][len] == '\0';
+    }
+    for (i = 0; done && i < g_index_count; ++i) {
+        const IndexEntry *e = &g_index[i];
+        if (!e->seen || strncmp(e->dir, slot_dir, len) != 0 ||
+            e->dir[len] != '/' ||
+            strchr(e->dir + len + 1, '/') != NULL) {
+            continue;
+        }
+        (*backups)++;
+        *bytes += e->info.bytes;
+        if (e->info.created > *newest) *newest = e->info.created;
+    }
+    pthread_mutex_unlock(&g_index_lock);
+    return done ? 0 : -1;
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RECOVERY_NANDROID_H_
+#define RECOVERY_NANDROID_H_
+
+#include <stddef.h>
+#include <time.h>
+
+/* Back up the device into a new, timestamped directory under slot_dir
+ * (e.g. "/sdcard/nandroid/SLOT1").  Raw partitions are saved as
+ * <name>.img.gz, the ext4 internal storage as <name>.simg.gz (a sparse
+ * image of just its used blocks, in ext4_utils' format), and the other
+ * mountable ones as <name>.tar.gz, compressed on several threads.
+ * Progress is shown on the progress bar.  Returns 0 on success; on
+ * failure the partial backup is removed.
+ *
+ * With NANDROID_DEDUP, the data goes into a chunk store shared by all
+ * slots (a "chunks" directory beside them) instead, and each partition
+ * gets a <name>.img.manifest (or .simg or .tar) listing its chunks.
+ * Chunks already in the store from earlier backups aren't written again.
+ *
+ * Either way, each partition's SHA-1 is taken as it is read and saved in
+ * nandroid.sha1 in the backup directory, for nandroid_verify().
+ */
+#define NANDROID_DEDUP 1
+
+int nandroid_backup(const char *slot_dir, int flags);
+
+/* Feed the original contents of one backed-up partition, given the path
+ * of its .gz or .manifest file, to sink in order.  Chunks are checked
+ * against their hashes as they're read.  Stops and returns -1 if sink
+ * returns nonzero or the data can't be read.
+ */
+typedef int (*NandroidSink)(const void *data, size_t len, void *cookie);
+
+int nandroid_read_item(const char *path, NandroidSink sink, void *cookie);
+
+/* Restore the partitions saved in backup_dir (one timestamped directory
+ * made by nandroid_backup()), streaming each straight into the flash or
+ * the freshly formatted filesystem.  Partitions that aren't in the
+ * backup are left alone.  Returns 0 on success.
+ */
+int nandroid_restore(const char *backup_dir);
+
+/* Returns nonzero if backup_dir holds a backup made by nandroid_backup()
+ * rather than by nandroid-mobile.sh.
+ */
+int nandroid_is_native_backup(const char *backup_dir);
+
+/* Check every partition in backup_dir against the digest taken of it
+ * while the backup was being made, without touching the device.  Each
+ * result is shown on screen.  Returns 0 if all of them match.
+ */
+int nandroid_verify(const char *backup_dir);
+
+/* Delete chunks under nandroid_dir/chunks that no manifest in any slot
+ * refers to any more.  Returns the number removed, or -1 (having removed
+ * nothing) if a manifest couldn't be read.
+ */
+int nandroid_collect_chunks(const char *nandroid_dir);
+
+/* A background index of the backups in every slot, for the menus.  Each
+ * native backup's summary is kept in a small nandroid.info file beside
+ * its digests (written by nandroid_backup(), or by the indexer for older
+ * backups), so building the index costs one short read per backup, and
+ * backups already indexed are only looked at again if their directory
+ * has changed.
+ */
+typedef struct {
+    time_t created;
+    long long bytes;        // as backed up, before compression
+    int partitions;
+    char names[64];         // "boot,system,data", say
+} NandroidInfo;
+
+/* Start (or restart) indexing the slots under nandroid_dir, which must
+ * stay mounted until nandroid_index_stop().  Summaries from an earlier
+ * pass are kept and only brought up to date.
+ */
+void nandroid_index_start(const char *nandroid_dir);
+
+/* Stop the indexer and wait for it, before anything that changes the
+ * backups or unmounts the card.
+ */
+void nandroid_index_stop(void);
+
+/* Have observer called, from the indexer's thread, each time the index
+ * changes; NULL stops it.  Once this returns, the previous observer is
+ * no longer being called.
+ */
+typedef void (*NandroidIndexObserver)(void *cookie);
+
+void nandroid_index_watch(NandroidIndexObserver observer, void *cookie);
+
+/* Look up one backup directory (with or without a trailing slash).
+ * Returns 0 and fills in info if it has been indexed.
+ */
+int nandroid_index_lookup(const char *backup_dir, NandroidInfo *info);
+
+/* Totals for the backups in slot_dir: how many, their size, and the
+ * time of the newest.  Returns -1 if the slot hasn't been indexed yet.
+ */
+int nandroid_index_slot(const char *slot_dir, int *backups,
+        long long *bytes, time_t *newest);
+
+#endif  // RECOVERY_NANDROID_H_
@@ -21,11 +21,14 @@
 #include <getopt.h>
 #include <limits.h>
 #include <linux/input.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <dirent.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/reboot.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
@@ -41,7 +44,9 @@
 #include "install.h"
 #include "minui/minui.h"
 #include "minzip/DirUtil.h"
+#include "nandroid.h"
 #include "roots.h"
+#include "recovery_log.h"
 #include "recovery_ui.h"
 #include "extendedcommand.h"
 
@@ -71,6 +76,8 @@ static const char *SDCARD_PACKAGE_FILE = "SDCARD:update.zip";
 static const char *SDCARD_PATH = "SDCARD:";
 static const char *THEMES_PATH = "THEMES:";
 #define SDCARD_PATH_LENGTH 20
+// How many packages one install may be given.
+#define MAX_QUEUED_PACKAGES 8
 #define THEMES_PATH_LENGTH 20
 static const char *TEMPORARY_LOG_FILE = "/sdcard/recovery.log";
 
@@ -83,6 +90,9 @@ static const char *TEMPORARY_LOG_FILE = "/sdcard/recovery.log";
  * The arguments which may be supplied in the recovery.command file:
  *   --send_intent=anystring - write the text out to recovery.intent
  *   --update_package=root:path - verify install an OTA package file
+ *       (path may also be a pipe or socket, e.g. TMP:usb.fifo, in which
+ *       case the package is received into RAM instead of staged on disk);
+ *       give it more than once to install several in one session
  *   --wipe_data - erase user data (and cache), then reboot
  *   --wipe_cache - wipe cache (but not user data), then reboot
  *
@@ -110,6 +120,9 @@ static const char *TEMPORARY_LOG_FILE = "/sdcard/recovery.log";
  *    -- after this, rebooting will attempt to reinstall the update --
  * 5. install_package() attempts to install the update
  *    NOTE: the package install must itself be restartable from any point
+ *    (the updater checkpoints finished steps in
+ *    /cache/recovery/updater_checkpoint, and a restart skips those whose
+ *    output still checks out)
  * 6. finish_recovery() erases BCB
  *    -- after this, rebooting will (try to) restart the main system --
  * 7. ** if install failed **
@@ -136,6 +149,33 @@ static const int MAX_ARGS = 100;
 
 static int do_reboot = 1;
 
+// Startup time, for log_boot_phase().
+static struct timeval boot_start;
+
+// Note in the log how long it has taken to get this far, and how long the
+// kernel had been up, so slow startup steps show up.
+static void
+log_boot_phase(const char *phase) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    long ms = (now.tv_sec - boot_start.tv_sec) * 1000 +
+            (now.tv_usec - boot_start.tv_usec) / 1000;
+
+    double uptime = -1;
+    FILE *f = fopen("/proc/uptime", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%lf", &uptime) != 1) uptime = -1;
+        fclose(f);
+    }
+    fprintf(stderr, "I:boot: %s at %ld ms (uptime %.2f s)\n", phase, ms, uptime);
+}
+
+// PhaseObserver for everything run in this process.
+static void
+show_phase(const PhaseStatus *status, void *cookie) {
+    ui_show_phase(status);
+}
+
 
 // drakaz : binary location
 #define STARTUP_BIN "/tmp/RECTOOLS/startup.sh"
@@ -279,26 +319,19 @@ finish_recovery(const char *send_intent)
         }
     }
 
-    // Copy logs to cache so the system can find out what happened.
-    /*
+    // Copy logs to cache so the system can find out what happened.  Only
+    // the part since the last copy that's still in memory, up to
+    // RECOVERY_LOG_RING_SIZE; the whole of it is on the sdcard.
     FILE *log = fopen_root_path(LOG_FILE, "a");
     if (log == NULL) {
         LOGE("Can't open %s\n", LOG_FILE);
     } else {
-        FILE *tmplog = fopen(TEMPORARY_LOG_FILE, "r");
-        if (tmplog == NULL) {
-            LOGE("Can't open %s\n", TEMPORARY_LOG_FILE);
-        } else {
-            static long tmplog_offset = 0;
-            fseek(tmplog, tmplog_offset, SEEK_SET);  // Since last write
-            char buf[4096];
-            while (fgets(buf, sizeof(buf), tmplog)) fputs(buf, log);
-            tmplog_offset = ftell(tmplog);
-            check_and_fclose(tmplog, TEMPORARY_LOG_FILE);
+        if (recovery_log_save_tail(log) != 0) {
+            LOGE("Can't copy the log to %s\n", LOG_FILE);
         }
         check_and_fclose(log, LOG_FILE);
     }
-    */
+
     // Reset the bootloader message to revert to a normal main system boot.
     struct bootloader_message boot;
     memset(&boot, 0, sizeof(boot));
@@ -338,9 +371,99 @@ erase_root(const char *root)
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     ui_show_indeterminate_progress();
     ui_print("Formatting %s...\n", root);
+    forget_install_checkpoint();
     return format_root_device(root);
 }
 
+/* Formatting several roots at once: everything on the NAND goes through
+ * one thread, since its erases can't overlap anyway, and every other
+ * device gets its own.
+ */
+#define MAX_ERASE_ROOTS 8
+
+typedef struct {
+    const char *root;
+    int result;
+    long ms;
+} EraseResult;
+
+typedef struct {
+    EraseResult *results[MAX_ERASE_ROOTS];
+    int count;
+    pthread_t thread;
+    int started;
+} EraseGroup;
+
+static void *
+erase_group(void *cookie)
+{
+    EraseGroup *group = (EraseGroup *) cookie;
+    int i;
+    for (i = 0; i < group->count; ++i) {
+        EraseResult *r = group->results[i];
+        struct timeval start, end;
+        gettimeofday(&start, NULL);
+        r->result = format_root_device(r->root);
+        gettimeofday(&end, NULL);
+        r->ms = (end.tv_sec - start.tv_sec) * 1000 +
+                (end.tv_usec - start.tv_usec) / 1000;
+    }
+    return NULL;
+}
+
+static int
+erase_roots(const char **roots, int count)
+{
+    EraseResult results[MAX_ERASE_ROOTS];
+    EraseGroup groups[MAX_ERASE_ROOTS];
+    int i, num_groups = 0, mtd_group = -1;
+
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_show_indeterminate_progress();
+    forget_install_checkpoint();
+    if (count > MAX_ERASE_ROOTS) count = MAX_ERASE_ROOTS;
+    memset(groups, 0, sizeof(groups));
+    for (i = 0; i < count; ++i) {
+        ui_print("Formatting %s...\n", roots[i]);
+        results[i].root = roots[i];
+        results[i].result = -1;
+        results[i].ms = 0;
+        int g;
+        if (get_root_mtd_partition(roots[i]) != NULL) {
+            if (mtd_group < 0) mtd_group = num_groups++;
+            g = mtd_group;
+        } else {
+            g = num_groups++;
+        }
+        groups[g].results[groups[g].count++] = &results[i];
+    }
+
+    // The first group runs here; a group whose thread can't be started
+    // runs here too, after it.
+    for (i = 1; i < num_groups; ++i) {
+        groups[i].started =
+                pthread_create(&groups[i].thread, NULL, erase_group, &groups[i]) == 0;
+    }
+    if (num_groups > 0) erase_group(&groups[0]);
+    for (i = 1; i < num_groups; ++i) {
+        if (groups[i].started) {
+            pthread_join(groups[i].thread, NULL);
+        } else {
+            erase_group(&groups[i]);
+        }
+    }
+
+    int result = 0;
+    for (i = 0; i < count; ++i) {
+        ui_print("\n%s %s in %ld.%01ld s", results[i].root,
+                results[i].result == 0 ? "formatted" : "FAILED",
+                results[i].ms / 1000, (results[i].ms % 1000) / 100);
+        if (results[i].result != 0) result = -1;
+    }
+    ui_print("\n");
+    return result;
+}
+
 static void
 run_script(char *str1,char *str2,char *str3,char *str4,char *str5,char *str6,char *str7, bool promptUser)
 {
@@ -356,6 +479,8 @@ run_script(char *str1,char *str2,char *str3,char *str4,char *str5,char *str6,cha
     }
     if (confirm) {
         ui_print(str2);
+        // The scripts restore, wipe and format partitions.
+        forget_install_checkpoint();
         pid_t pid = fork();
         if (pid == 0) {
             char *args[] = { "/sbin/sh", "-c", str3, "1>&2", NULL };
@@ -390,10 +515,13 @@ run_startup_script() {
         fprintf(stderr, "\nUnable to execute startup script!\n(%s)", strerror(errno));
         _exit(-1);
     }
+    // Poll often so a quick script doesn't hold up the menu for a second,
+    // but only print a dot about once a second.
     int status;
+    int polls = 0;
     while (waitpid(pid, &status, WNOHANG) == 0) {
-        ui_print(".");
-        sleep(1);
+        if (++polls % 20 == 0) ui_print(".");
+        usleep(50000);
     }
     if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
         ui_print("\nError while executing startup script!\n");
@@ -442,6 +570,12 @@ int device_handle_key(int key_code, int visible) {
 
 int
 get_menu_selection(char** headers, char** items, int menu_only) {
+    return get_menu_selection_highlight(headers, items, menu_only, NULL, NULL);
+}
+
+int
+get_menu_selection_highlight(char** headers, char** items, int menu_only,
+                             menu_highlight_fn highlight, void* cookie) {
     // throw away keys pressed previously, so user doesn't
     // accidentally trigger menu items.
     ui_clear_key_queue();
@@ -455,6 +589,8 @@ get_menu_selection(char** headers, char** items, int menu_only) {
     // We can't rely on /cache or /sdcard since they may not be available.
     int wrap_count = 0;
 
+    if (highlight != NULL && item_count > 0) highlight(selected, cookie);
+
     while (chosen_item < 0 && chosen_item != GO_BACK) {
         int key = ui_wait_key();
         int visible = ui_text_visible();
@@ -491,6 +627,10 @@ get_menu_selection(char** headers, char** items, int menu_only) {
             chosen_item = action;
         }
 
+        if (highlight != NULL && selected != old_selected) {
+            highlight(selected, cookie);
+        }
+
         if (abs(selected - old_selected) > 1) {
             wrap_count++;
             if (wrap_count == 3) {
@@ -581,6 +721,83 @@ static void show_payload_menu()
 }
 #endif
 
+#define NANDROID_SLOTS 4
+#define NANDROID_LABEL_LEN 80
+
+// A menu of slots or backups, whose items are filled in with what the
+// nandroid indexer finds as it finds it.
+typedef struct {
+    int count;
+    int slots;          // items are slots rather than backups
+    char** names;
+    char** dirs;
+    char** items;       // as shown
+    int watching;
+} NandroidMenu;
+
+static void describe_nandroid_item(const NandroidMenu* m, int i, char* label)
+{
+    if (m->slots) {
+        int backups;
+        long long bytes;
+        time_t newest;
+        if (nandroid_index_slot(m->dirs[i], &backups, &bytes, &newest) != 0) {
+            snprintf(label, NANDROID_LABEL_LEN, "%s", m->names[i]);
+        } else if (backups == 0) {
+            snprintf(label, NANDROID_LABEL_LEN, "%s  (empty)", m->names[i]);
+        } else {
+            char when[32];
+            strftime(when, sizeof(when), "%m/%d %H:%M", localtime(&newest));
+            snprintf(label, NANDROID_LABEL_LEN, "%s  %d backup%s, %lldMB, newest %s",
+                     m->names[i], backups, backups == 1 ? "" : "s", bytes >> 20, when);
+        }
+    } else {
+        NandroidInfo info;
+        if (nandroid_index_lookup(m->dirs[i], &info) != 0 || info.partitions == 0) {
+            snprintf(label, NANDROID_LABEL_LEN, "%s", m->names[i]);
+        } else {
+            snprintf(label, NANDROID_LABEL_LEN, "%s  %lldMB %s",
+                     m->names[i], info.bytes >> 20, info.names);
+        }
+    }
+}
+
+// Called by the indexer; the menu is up until it's unwatched.
+static void nandroid_menu_changed(void* cookie)
+{
+    NandroidMenu* m = (NandroidMenu*) cookie;
+    char label[NANDROID_LABEL_LEN];
+    int i;
+    for (i = 0; i < m->count; ++i) {
+        describe_nandroid_item(m, i, label);
+        ui_set_menu_item(i, label);
+    }
+}
+
+static void nandroid_menu_highlighted(int item, void* cookie)
+{
+    NandroidMenu* m = (NandroidMenu*) cookie;
+    if (m->watching)
+        return;
+    // The menu is on screen now, so the indexer can update it; catch up
+    // with anything it found while the menu was being put up.
+    m->watching = 1;
+    nandroid_index_watch(nandroid_menu_changed, m);
+    nandroid_menu_changed(m);
+}
+
+static int run_nandroid_menu(char** headers, NandroidMenu* m)
+{
+    int i;
+    for (i = 0; i < m->count; ++i)
+        describe_nandroid_item(m, i, m->items[i]);
+    m->watching = 0;
+    int chosen_item = get_menu_selection_highlight(headers, m->items, 0,
+            nandroid_menu_highlighted, m);
+    nandroid_index_watch(NULL, NULL);
+    return chosen_item;
+}
+
 // Nandroid slot support from bukington
 static int choose_nandroid_slot()
 {
@@ -588,9 +805,69 @@ static int choose_nandroid_slot()
                                "",
                                MENU_HINT,
                                NULL };
-    static char* slots[] = { "Slot 1", "Slot 2", "Slot 3", "Slot 4", NULL };
 
-    return get_menu_selection(headers, slots, 0) + 1;
+    // (Re)index in the background; each slot's totals appear as they're
+    // known.
+    if (ensure_root_path_mounted("SDCARD:") == 0)
+        nandroid_index_start(NANDROID_BACKUP);
+
+    char name_buf[NANDROID_SLOTS][8];
+    char dir_buf[NANDROID_SLOTS][PATH_MAX];
+    char label_buf[NANDROID_SLOTS][NANDROID_LABEL_LEN];
+    char* names[NANDROID_SLOTS];
+    char* dirs[NANDROID_SLOTS];
+    char* items[NANDROID_SLOTS + 1];
+    int i;
+    for (i = 0; i < NANDROID_SLOTS; ++i) {
+        snprintf(name_buf[i], sizeof(name_buf[i]), "Slot %d", i + 1);
+        snprintf(dir_buf[i], sizeof(dir_buf[i]), "%sSLOT%d", NANDROID_BACKUP, i + 1);
+        names[i] = name_buf[i];
+        dirs[i] = dir_buf[i];
+        items[i] = label_buf[i];
+    }
+    items[NANDROID_SLOTS] = NULL;
+
+    NandroidMenu m = { NANDROID_SLOTS, 1, names, dirs, items, 0 };
+    return run_nandroid_menu(headers, &m) + 1;
+}
+
+// Like choose_file_menu(slot_dir, NULL, headers), with each backup's
+// size and partitions beside its name once the indexer has them.
+static char* choose_nandroid_backup(const char* slot_dir, const char** headers)
+{
+    int count = 0;
+    char** dirs = gather_files(slot_dir, NULL, &count);
+    if (count == 0) {
+        ui_print("No files found.\n");
+        return NULL;
+    }
+
+    int dir_len = strlen(slot_dir);
+    char** names = (char**) malloc(count * sizeof(char*));
+    char** items = (char**) malloc((count + 1) * sizeof(char*));
+    int i;
+    for (i = 0; i < count; ++i) {
+        names[i] = strdup(dirs[i] + dir_len);
+        names[i][strlen(names[i]) - 1] = '\0';     // the trailing slash
+        items[i] = (char*) malloc(NANDROID_LABEL_LEN);
+    }
+    items[count] = NULL;
+
+    NandroidMenu m = { count, 0, names, dirs, items, 0 };
+    int chosen_item = run_nandroid_menu((char**) headers, &m);
+
+    static char ret[PATH_MAX];
+    char* return_value = NULL;
+    if (chosen_item >= 0 && chosen_item < count) {
+        snprintf(ret, sizeof(ret), "%s", dirs[chosen_item]);
+        return_value = ret;
+    }
+    for (i = 0; i < count; ++i)
+        free(names[i]);
+    free(names);
+    free_string_array(items);
+    free_string_array(dirs);
+    return return_value;
 }
 
 static void show_nandroid_menu()
@@ -599,6 +876,7 @@ static void show_nandroid_menu()
 #define ITEM_NANDROID_BACKUP  0
 #define ITEM_NANDROID_RESTORE 1
 #define ITEM_NANDROID_DELETE  2
+#define ITEM_NANDROID_VERIFY  3
 
     static char* headers[] = {  "Nandroid",
                                 "",
@@ -609,6 +887,7 @@ static void show_nandroid_menu()
     static char* list[] = { "Backup",
                             "Restore",
                             "Delete",
+                            "Verify",
                             /*"Advanced Restore",*/
                             NULL
     };
@@ -630,17 +909,14 @@ static void show_nandroid_menu()
                             strcpy(sdcard_backup_dir, NANDROID_BACKUP);
                             strcat(sdcard_backup_dir, strSlot);
 
-                            snprintf(command_label, MAX_COMMAND_ARG, "\nPerforming backup in %s", strSlot);
-                            snprintf(command, MAX_COMMAND_ARG, "%s -b -p %s", NANDROID_BIN, sdcard_backup_dir);
-                            snprintf(command_err, MAX_COMMAND_ARG, "\nE:Can't run %s\n(%s)", NANDROID_BIN); 
-                            run_script("",
-                                       command_label,
-                                       command,
-                                       command_err,
-                                       "\nError running nandroid backup. Backup not performed.",
-                                       "\nBackup complete!",
-                                       "\nBackup aborted by user!",
-                                       false);
+                            nandroid_index_stop();
+                            ui_end_menu();
+                            ui_print("\nPerforming backup in %s", strSlot);
+                            if (nandroid_backup(sdcard_backup_dir, NANDROID_DEDUP) != 0) {
+                                ui_print("\nError running nandroid backup. Backup not performed.");
+                            } else {
+                                ui_print("\nBackup complete!");
+                            }
                         }
                     }
                 }
@@ -666,11 +942,27 @@ static void show_nandroid_menu()
                         strcat(sdcard_backup_dir, strSlot);
                         strcat(sdcard_backup_dir, "/");
 
-                        char* file = choose_file_menu(sdcard_backup_dir, NULL, headers);
+                        char* file = choose_nandroid_backup(sdcard_backup_dir, headers);
                         if (file != NULL) {
                             char* backup = basename(file);
 
                             snprintf(command_prompt, MAX_COMMAND_ARG, "Restore backup %s from %s", backup, strSlot);
+                            nandroid_index_stop();
+                            if (nandroid_is_native_backup(file)) {
+                                ui_end_menu();
+                                ui_clear_key_queue();
+                                ui_print("\n-- %s", command_prompt);
+                                ui_print("\n-- Press HOME to confirm, or");
+                                ui_print("\n-- any other key to abort.");
+                                if (ui_wait_key() != KEY_HOME) {
+                                    ui_print("\nRestore aborted by user!");
+                                } else if (nandroid_restore(file) != 0) {
+                                    ui_print("\nError running nandroid restore! Partitions may be left incomplete.");
+                                } else {
+                                    ui_print("\nRestore complete!");
+                                }
+                                continue;
+                            }
                             snprintf(command_label, MAX_COMMAND_ARG, "\nRestoring backup %s from %s", backup, strSlot);
                             snprintf(command, MAX_COMMAND_ARG, "%s --restore --defaultinput -p %s -s %s", NANDROID_BIN, sdcard_backup_dir, backup);
                             snprintf(command_err, MAX_COMMAND_ARG, "\nE:Can't run %s\n(\%s)", NANDROID_BIN); 
@@ -712,13 +1004,14 @@ static void show_nandroid_menu()
                         
                         // Keep menu while files are deleted
                         for (;;) {
-                            file = choose_file_menu(sdcard_backup_dir, NULL, headers);
+                            file = choose_nandroid_backup(sdcard_backup_dir, headers);
                             if (file == NULL)
                                 break;
 
                             char* backup = basename(file);
 
                             snprintf(command_prompt, MAX_COMMAND_ARG, "Delete backup %s from %s", backup, strSlot);
+                            nandroid_index_stop();
                             snprintf(command_label, MAX_COMMAND_ARG, "\nDeleting backup %s from %s", backup, strSlot);
                             snprintf(command, MAX_COMMAND_ARG, "%s -d --defaultinput -p %s -s %s", NANDROID_BIN, sdcard_backup_dir, backup);
                             snprintf(command_err, MAX_COMMAND_ARG, "\nE:Can't run %s\n(\%s)", NANDROID_BIN); 
@@ -730,11 +1023,49 @@ static void show_nandroid_menu()
                                        "\nDelete complete!",
                                        "\nDelete aborted by user!",
                                        true);
+                            // Drop chunks only the deleted backup used.
+                            nandroid_collect_chunks(NANDROID_BACKUP);
+                        }
+                    }
+                }
+                break;
+            case ITEM_NANDROID_VERIFY:
+                {
+                    int slota;
+                    for (;;) {
+                        slota = choose_nandroid_slot();
+                        if (slota < 1)
+                            break;
+                        char strSlot[5];
+                        sprintf(strSlot, "SLOT%d", slota);
+
+                        static const char* headers[] = {  "Choose a backup to verify",
+                                                          "",
+                                                          MENU_HINT,
+                                                          NULL
+                        };
+
+                        char sdcard_backup_dir[1024];
+                        strcpy(sdcard_backup_dir, NANDROID_BACKUP);
+                        strcat(sdcard_backup_dir, strSlot);
+                        strcat(sdcard_backup_dir, "/");
+
+                        char* file = choose_nandroid_backup(sdcard_backup_dir, headers);
+                        if (file != NULL) {
+                            nandroid_index_stop();
+                            ui_end_menu();
+                            ui_print("\nVerifying backup %s from %s", basename(file), strSlot);
+                            if (nandroid_verify(file) != 0) {
+                                ui_print("\nBackup is damaged or can't be verified!");
+                            } else {
+                                ui_print("\nBackup verified!");
+                            }
                         }
                     }
                 }
                 break;
             case GO_BACK:
+                nandroid_index_stop();
                 return;
                 break;
         }
@@ -755,22 +1086,39 @@ choose_update_file() {
                               NULL
   };
 
-  char* file = choose_file_menu("/sdcard/", ".zip", headers);
-  if (file == NULL)
-    return;
-
-  char sdcard_package_file[1024];
-  strcpy(sdcard_package_file, "SDCARD:");
-  strcat(sdcard_package_file,  file + strlen("/sdcard/"));
+  // Zips can be queued up with MENU and installed one after another.
+  char queue[MAX_QUEUED_PACKAGES][1024];
+  const char* queued[MAX_QUEUED_PACKAGES];
+  int count = 0;
+  int confirm_apply;
+  do {
+      // Whatever zip is highlighted gets verified in the background.
+      char* file = choose_file_menu_highlight("/sdcard/", ".zip", headers,
+                                              speculate_package_verification);
+      if (file == NULL) {
+          speculate_package_verification(NULL);
+          if (count > 0) ui_print("\nInstallation aborted\n");
+          return;
+      }
+      speculate_package_verification(file);
+
+      snprintf(queue[count], sizeof(queue[count]), "SDCARD:%s",
+               file + strlen("/sdcard/"));
+      queued[count] = queue[count];
+      ++count;
+
+      ui_end_menu();
+      if (count > 1) ui_print("\n-- Queued %d packages", count);
+      ui_print("\n-- Installing new image!");
+      ui_print("\n-- Press HOME to confirm,");
+      if (count < MAX_QUEUED_PACKAGES) ui_print("\n-- MENU to queue another zip,");
+      ui_print("\n-- or any other key to abort\n\n");
+      confirm_apply = ui_wait_key();
+  } while (confirm_apply == KEY_DREAM_MENU && count < MAX_QUEUED_PACKAGES);
 
-  ui_end_menu();
-  ui_print("\n-- Installing new image!");
-  ui_print("\n-- Press HOME to confirm, or");
-  ui_print("\n-- any other key to abort\n\n");
-  int confirm_apply = ui_wait_key();
   if (confirm_apply == KEY_DREAM_HOME) {
       ui_print("\nInstalling from sdcard...\n");
-      int status = install_package(sdcard_package_file);
+      int status = install_packages(queued, count);
       if (status != INSTALL_SUCCESS) {
           ui_set_background(BACKGROUND_ICON_ERROR);
           ui_print("Installation failed\n");
@@ -785,6 +1133,7 @@ choose_update_file() {
           }
       }
   } else {
+      speculate_package_verification(NULL);
       ui_print("\nInstallation failed");
   }
 }
@@ -1028,10 +1377,12 @@ prompt_and_wait()
                              NULL };
 #if PSFREEDOM == 0
     run_startup_script();
+    log_boot_phase("startup script done");
 #endif
 
     finish_recovery(NULL);
     ui_reset_progress();
+    log_boot_phase("menu shown");
     for (;;) {
         int chosen_item = get_menu_selection(headers, items, 0);
 
@@ -1508,23 +1859,10 @@ prompt_and_wait()
                     int confirm_wipe = ui_wait_key();
                     if (confirm_wipe == KEY_DREAM_HOME) {
                         ui_print("\n-- Wiping data...\n");
-                        erase_root("CACHE:");
-			erase_root("DBDATA:");
 // drakaz : first wipe galaxy internal data with erase_root
-// umount /data partition
- 		    pid_t pidf = fork();
-                    if (pidf == 0) {
-			char *args[] = { "umount", "/data", NULL };
-			execv("/sbin/busybox", args);
-                        fprintf(stderr, "Unable to umount /data.\n(%s)\n", strerror(errno));
-                        _exit(-1);
-                    }
-                    int fsck_status;
-                    while (waitpid(pidf, &fsck_status, WNOHANG) == 0) {
-                        ui_print(".");
-                        sleep(1);
-                    }
-			erase_root("INTERNAL:");
+// (format_root_device unmounts /data itself)
+			static const char *wipe_roots[] = { "CACHE:", "DBDATA:", "INTERNAL:" };
+			erase_roots(wipe_roots, 3);
 			ui_print("\nWiping internal data...\n");
 
 // drakaz : second, delete with simple rm to be sure of the correct deletion
@@ -2200,17 +2538,12 @@ static int exec_nandroid() {
         strcat(sdcard_backup_dir, "SLOT4");
         strcat(sdcard_backup_dir, "/");
 
-	snprintf(command_label, MAX_COMMAND_ARG, "\n-  Performing backup in %s  -", "SLOT4");
-	snprintf(command, MAX_COMMAND_ARG, "%s -b -p %s", NANDROID_BIN, sdcard_backup_dir);
-	snprintf(command_err, MAX_COMMAND_ARG, "\nE:Can't run %s\n(%s)", NANDROID_BIN); 
-        run_script("",
-        	command_label,
-         	command,
-                command_err,
-                "\nError running nandroid backup. Backup not performed.\nAll flash process stopped.",
-		"\n-       Backup complete!       -",
-                "\n-   Backup aborted by user!    -",
-                 false);
+	ui_print("\n-  Performing backup in %s  -", "SLOT4");
+	if (nandroid_backup(sdcard_backup_dir, NANDROID_DEDUP) != 0) {
+		ui_print("\nError running nandroid backup. Backup not performed.\nAll flash process stopped.");
+	} else {
+		ui_print("\n-       Backup complete!       -");
+	}
         }
 	ui_print("\n-                              -");
 	ui_print("\n-                              -");
@@ -2222,9 +2555,8 @@ static int exec_wipe() {
                     ui_print("\n-           WIPE DATA          -");
                     ui_print("\n-                              -");
                     ui_print("\n-                              -");
-                    erase_root("CACHE:");
-		    erase_root("DBDATA:");
-		    erase_root("INTERNAL:");
+                    static const char *wipe_roots[] = { "CACHE:", "DBDATA:", "INTERNAL:" };
+                    erase_roots(wipe_roots, 3);
 
  		    pid_t pidf1 = fork();
                     if (pidf1 == 0) {
@@ -2238,32 +2570,7 @@ static int exec_wipe() {
                         ui_print(".");
                         sleep(1);
                     }
-
- 		    pid_t pidf2 = fork();
-                    if (pidf2 == 0) {
-			char *args2[] = {"/system/bin/rm", "-rf", "/data/*", NULL};
-			execv("/system/bin/rm", args2);
-                        fprintf(stderr, "Unable to format /data\n(%s)\n", strerror(errno));
-                        _exit(-1);
-                    }
-                    int fsck_status2;
-                    while (waitpid(pidf2, &fsck_status2, WNOHANG) == 0) {
-                        ui_print(".");
-                        sleep(1);
-                    }
-		    sync();
-		    pid_t pidf3 = fork();
-                    if (pidf3 == 0) {
-			char *args3[] = {"/system/bin/sync", NULL};
-			execv("/system/bin/sync", args3);
-                        fprintf(stderr, "Unable to sync /data\n(%s)\n", strerror(errno));
-                        _exit(-1);
-                    }
-                    int fsck_status3;
-                    while (waitpid(pidf3, &fsck_status3, WNOHANG) == 0) {
-                        ui_print(".");
-                        sleep(1);
-                    }
+		    // /data was just formatted; nothing is left to delete.
 		    sync();
 		    return 0;
 	return 0;
@@ -2300,11 +2607,15 @@ int
 main(int argc, char **argv)
 {
     time_t start = time(NULL);
+    gettimeofday(&boot_start, NULL);
 
     // If these fail, there's not really anywhere to complain...
-    freopen(TEMPORARY_LOG_FILE, "a", stdout); setbuf(stdout, NULL);
-    freopen(TEMPORARY_LOG_FILE, "a", stderr); setbuf(stderr, NULL);
+    if (recovery_log_start(TEMPORARY_LOG_FILE) != 0) {
+        freopen(TEMPORARY_LOG_FILE, "a", stdout); setbuf(stdout, NULL);
+        freopen(TEMPORARY_LOG_FILE, "a", stderr); setbuf(stderr, NULL);
+    }
     fprintf(stderr, "Starting recovery on %s", ctime(&start));
+    log_boot_phase("log open");
 
     tcflow(STDIN_FILENO, TCOOFF);
     
@@ -2341,22 +2652,14 @@ main(int argc, char **argv)
 #endif
    
 // Create themes dir
-
-    pid_t pidtheme = fork();
-    if (pidtheme == 0) {
-	char *argstheme[] = { "mkdir", "/sdcard/themes", NULL };
-	execv("/sbin/busybox", argstheme);
+    if (mkdir("/sdcard/themes", 0755) != 0 && errno != EEXIST) {
         fprintf(stderr, "Can't mkdir /sdcard/themes\n(%s)\n", strerror(errno));
-        _exit(-1);
     }
-    int statustheme;
-    while (waitpid(pidtheme, &statustheme, WNOHANG) == 0) {
-    	ui_print(".");
-    	sleep(1);
-    }
-
+    log_boot_phase("themes dir");
 
     ui_init();
+    log_boot_phase("ui up");
+    mzSetPhaseObserver(show_phase, NULL);
     ui_print("Build: ");
     ui_print(prop_value);
     ui_print("\nBy drakaz & bukington\n");
@@ -2364,7 +2667,8 @@ main(int argc, char **argv)
 
     int previous_runs = 0;
     const char *send_intent = NULL;
-    const char *update_package = NULL;
+    const char *update_packages[MAX_QUEUED_PACKAGES];
+    int num_update_packages = 0;
     const char *update_gapps = NULL;
     int wipe_data = 0, wipe_cache = 0, wipe_full = 0, nandroid = 0, nreboot = 0, hello = 0, migrate = 0;
 
@@ -2373,7 +2677,13 @@ main(int argc, char **argv)
         switch (arg) {
         case 'p': previous_runs = atoi(optarg); break;
         case 's': send_intent = optarg; break;
-        case 'u': update_package = optarg; break;
+        case 'u':
+            if (num_update_packages < MAX_QUEUED_PACKAGES) {
+                update_packages[num_update_packages++] = optarg;
+            } else {
+                LOGE("Too many packages; ignoring %s\n", optarg);
+            }
+            break;
         case 'g': update_gapps = optarg; break;
         case 'w': wipe_data = wipe_cache = 1; break;
         case 'a': wipe_full = 1; break;
@@ -2405,6 +2715,7 @@ main(int argc, char **argv)
     if (register_update_commands(&ctx)) {
         LOGE("Can't install update commands\n");
     }
+    log_boot_phase("commands registered");
 
     int status = INSTALL_SUCCESS;
 
@@ -2426,12 +2737,14 @@ main(int argc, char **argv)
 	if (wipe_full && exec_wipe()) status = INSTALL_ERROR;
         if (status != INSTALL_SUCCESS) ui_print("Data wipe failed.\n");
     }
-    if (update_package != NULL && (status == INSTALL_SUCCESS)) {
-        status = install_package(update_package);
-        if (status != INSTALL_SUCCESS) ui_print("Installation aborted.\n");
+    // gapps goes in the same session, after the packages.
+    if (update_gapps != NULL && num_update_packages < MAX_QUEUED_PACKAGES) {
+        update_packages[num_update_packages++] = update_gapps;
+    } else if (update_gapps != NULL) {
+        LOGE("Too many packages; ignoring %s\n", update_gapps);
     }
-    if (update_gapps != NULL && (status == INSTALL_SUCCESS)) {
-        status = install_package(update_gapps);
+    if (num_update_packages > 0 && (status == INSTALL_SUCCESS)) {
+        status = install_packages(update_packages, num_update_packages);
         if (status != INSTALL_SUCCESS) ui_print("Installation aborted.\n");
     }
     if ((nreboot || wipe_data) && (status == INSTALL_SUCCESS)) {
@@ -2457,6 +2770,7 @@ main(int argc, char **argv)
     if (do_reboot)
     {
     	ui_print("Rebooting...\n");
+    	recovery_log_flush();
     	reboot(RB_AUTOBOOT);
 	}
 	
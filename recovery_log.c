@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "recovery_log.h"
+
+#define RING_SIZE RECOVERY_LOG_RING_SIZE
+
+// The flusher writes once this much is waiting, or after FLUSH_INTERVAL_MS
+// with anything waiting at all.
+#define FLUSH_BATCH (16 * 1024)
+#define FLUSH_INTERVAL_MS 1000
+
+/* Positions are counts of bytes since the start, so they never wrap; a
+ * byte's place in the ring is its position modulo RING_SIZE.  The ring
+ * holds [received - RING_SIZE, received); the reader never overwrites
+ * bytes the flusher hasn't written yet.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    char ring[RING_SIZE];
+    unsigned long long received;
+    unsigned long long written;
+    unsigned long long saved;       // by recovery_log_save_tail()
+    int flush_waiters;
+    int pipe_fd;
+    int file_fd;
+    int running;
+} g_log = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .changed = PTHREAD_COND_INITIALIZER,
+};
+
+static void deadline_in(int ms, struct timespec *deadline)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    long long ns = (now.tv_usec + ms * 1000LL) * 1000;
+    deadline->tv_sec = now.tv_sec + ns / 1000000000;
+    deadline->tv_nsec = ns % 1000000000;
+}
+
+static void *reader_thread(void *cookie)
+{
+    char buf[4096];
+    for (;;) {
+        ssize_t n = read(g_log.pipe_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        pthread_mutex_lock(&g_log.lock);
+        ssize_t done = 0;
+        while (done < n) {
+            unsigned long long space =
+                    RING_SIZE - (g_log.received - g_log.written);
+            if (space == 0) {
+                pthread_cond_wait(&g_log.changed, &g_log.lock);
+                continue;
+            }
+            size_t pos = g_log.received % RING_SIZE;
+            size_t len = n - done;
+            if (len > space) len = space;
+            if (len > RING_SIZE - pos) len = RING_SIZE - pos;
+            memcpy(g_log.ring + pos, buf + done, len);
+            g_log.received += len;
+            done += len;
+        }
+        pthread_cond_broadcast(&g_log.changed);
+        pthread_mutex_unlock(&g_log.lock);
+    }
+    return NULL;
+}
+
+static void *flusher_thread(void *cookie)
+{
+    struct timespec deadline;
+    int waiting = 0;
+
+    pthread_mutex_lock(&g_log.lock);
+    for (;;) {
+        unsigned long long pending = g_log.received - g_log.written;
+        if (pending == 0) {
+            pthread_cond_wait(&g_log.changed, &g_log.lock);
+            continue;
+        }
+        if (pending < FLUSH_BATCH && g_log.flush_waiters == 0) {
+            // Give it a while to grow into a decent write.
+            if (!waiting) {
+                deadline_in(FLUSH_INTERVAL_MS, &deadline);
+                waiting = 1;
+            }
+            if (pthread_cond_timedwait(&g_log.changed, &g_log.lock,
+                    &deadline) != ETIMEDOUT) {
+                continue;
+            }
+        }
+        waiting = 0;
+
+        // The bytes from written to received stay put while we're
+        // unlocked, since the reader waits for space.
+        size_t pos = g_log.written % RING_SIZE;
+        size_t len = g_log.received - g_log.written;
+        if (len > RING_SIZE - pos) len = RING_SIZE - pos;
+        pthread_mutex_unlock(&g_log.lock);
+
+        size_t done = 0;
+        while (done < len) {
+            ssize_t w = write(g_log.file_fd, g_log.ring + pos + done,
+                    len - done);
+            if (w < 0 && errno == EINTR) continue;
+            // If the card has gone away, drop the data rather than
+            // stopping everything that logs.
+            if (w <= 0) break;
+            done += w;
+        }
+
+        pthread_mutex_lock(&g_log.lock);
+        g_log.written += len;
+        pthread_cond_broadcast(&g_log.changed);
+    }
+    return NULL;
+}
+
+int recovery_log_start(const char *path)
+{
+    int fds[2];
+    int file_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (file_fd < 0) return -1;
+    if (pipe(fds) != 0) {
+        close(file_fd);
+        return -1;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(file_fd, F_SETFD, FD_CLOEXEC);
+    g_log.pipe_fd = fds[0];
+    g_log.file_fd = file_fd;
+
+    pthread_t reader, flusher;
+    if (pthread_create(&reader, NULL, reader_thread, NULL) != 0) {
+        close(fds[0]);
+        goto fail;
+    }
+    if (pthread_create(&flusher, NULL, flusher_thread, NULL) != 0) {
+        // Closing the write end sends the reader off with end of file.
+        goto fail;
+    }
+    pthread_detach(reader);
+    pthread_detach(flusher);
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(fds[1], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+    close(fds[1]);
+    setbuf(stdout, NULL);
+    setbuf(stderr, NULL);
+    g_log.running = 1;
+    return 0;
+
+fail:
+    close(fds[1]);
+    close(file_fd);
+    return -1;
+}
+
+void recovery_log_flush(void)
+{
+    if (!g_log.running) return;
+    pthread_mutex_lock(&g_log.lock);
+    g_log.flush_waiters++;
+    pthread_cond_broadcast(&g_log.changed);
+
+    // First let the reader take whatever is still in the pipe.
+    int unread;
+    while (ioctl(g_log.pipe_fd, FIONREAD, &unread) == 0 && unread > 0) {
+        struct timespec deadline;
+        deadline_in(10, &deadline);
+        pthread_cond_timedwait(&g_log.changed, &g_log.lock, &deadline);
+    }
+    unsigned long long target = g_log.received;
+    while (g_log.written < target) {
+        pthread_cond_wait(&g_log.changed, &g_log.lock);
+    }
+    g_log.flush_waiters--;
+    pthread_mutex_unlock(&g_log.lock);
+}
+
+int recovery_log_save_tail(FILE *out)
+{
+    if (!g_log.running) return -1;
+    recovery_log_flush();
+
+    // Copy it out under the lock, so the reader can't reuse that part of
+    // the ring meanwhile, then write it with nothing held.
+    pthread_mutex_lock(&g_log.lock);
+    unsigned long long from = g_log.saved;
+    int truncated = 0;
+    if (g_log.received > RING_SIZE && from < g_log.received - RING_SIZE) {
+        from = g_log.received - RING_SIZE;
+        truncated = 1;
+    }
+    size_t len = g_log.received - from;
+    char *copy = malloc(len ? len : 1);
+    if (copy == NULL) {
+        pthread_mutex_unlock(&g_log.lock);
+        return -1;
+    }
+    size_t pos = from % RING_SIZE;
+    size_t first = len < RING_SIZE - pos ? len : RING_SIZE - pos;
+    memcpy(copy, g_log.ring + pos, first);
+    memcpy(copy + first, g_log.ring, len - first);
+    g_log.saved = g_log.received;
+    pthread_mutex_unlock(&g_log.lock);
+
+    // If the start was lost, begin at a whole line.
+    size_t skip = 0;
+    if (truncated) {
+        char *nl = memchr(copy, '\n', len);
+        if (nl != NULL) skip = nl + 1 - copy;
+    }
+    int result = fwrite(copy + skip, 1, len - skip, out) == len - skip ? 0 : -1;
+    free(copy);
+    return result;
+}
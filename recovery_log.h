@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RECOVERY_LOG_H_
+#define RECOVERY_LOG_H_
+
+#include <stdio.h>
+
+/* Point stdout and stderr (and so the output of every child process) at
+ * a pipe drained into an in-memory ring by a background thread.  A
+ * second thread appends what's in the ring to path in large batches, so
+ * logging never waits for a slow card.  Returns 0 on success; on failure
+ * nothing has been changed.
+ */
+int recovery_log_start(const char *path);
+
+/* Wait until everything logged so far is in the file. */
+void recovery_log_flush(void);
+
+/* Write to out what was logged since the last call, or the whole lines
+ * in the last RECOVERY_LOG_RING_SIZE bytes of it if there's more.
+ * Returns 0 on success.
+ */
+#define RECOVERY_LOG_RING_SIZE (256 * 1024)
+
+int recovery_log_save_tail(FILE *out);
+
+#endif  // RECOVERY_LOG_H_
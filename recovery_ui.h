@@ -27,6 +27,13 @@
 int
 get_menu_selection(char** headers, char** items, int menu_only);
 
+// Like get_menu_selection(), also calling "highlight" with the index of
+// each item as it's highlighted, starting with the first.
+typedef void (*menu_highlight_fn)(int item, void* cookie);
+int
+get_menu_selection_highlight(char** headers, char** items, int menu_only,
+                             menu_highlight_fn highlight, void* cookie);
+
 void
 set_sdcard_update_bootloader_message();
 
@@ -15,6 +15,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
@@ -103,6 +104,14 @@ get_root_info_for_path(const char *root_path)
     return NULL;
 }
 
+/* scan_mounted_volumes() rebuilds a single global table; roots may be
+ * mounted and formatted from several threads (e.g. a parallel wipe).
+ */
+static pthread_mutex_t g_volumes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bumped under g_volumes_lock whenever we mount or unmount something. */
+static unsigned int g_mount_generation = 0;
+
 static const ZipArchive *g_package = NULL;
 static char *g_package_path = NULL;
 
@@ -224,11 +233,14 @@ is_root_path_mounted(const char *root_path)
     if (info == NULL) {
         return -1;
     }
-    return internal_root_mounted(info) >= 0;
+    pthread_mutex_lock(&g_volumes_lock);
+    int ret = internal_root_mounted(info) >= 0;
+    pthread_mutex_unlock(&g_volumes_lock);
+    return ret;
 }
 
-int
-ensure_root_path_mounted(const char *root_path)
+static int
+ensure_root_path_mounted_locked(const char *root_path)
 {
     const RootInfo *info = get_root_info_for_path(root_path);
     if (info == NULL) {
@@ -255,8 +267,12 @@ ensure_root_path_mounted(const char *root_path)
         if (partition == NULL) {
             return -1;
         }
-        return mtd_mount_partition(partition, info->mount_point,
+        ret = mtd_mount_partition(partition, info->mount_point,
                 info->filesystem, 0);
+        if (ret == 0) {
+            g_mount_generation++;
+        }
+        return ret;
     }
 
     if (info->device == NULL || info->mount_point == NULL ||
@@ -281,13 +297,23 @@ ensure_root_path_mounted(const char *root_path)
 		    return -1;
 		}
 	    }
+	    g_mount_generation++;
 	    return 0;
     }
     return 0;
 }
 
 int
-ensure_root_path_unmounted(const char *root_path)
+ensure_root_path_mounted(const char *root_path)
+{
+    pthread_mutex_lock(&g_volumes_lock);
+    int ret = ensure_root_path_mounted_locked(root_path);
+    pthread_mutex_unlock(&g_volumes_lock);
+    return ret;
+}
+
+static int
+ensure_root_path_unmounted_locked(const char *root_path)
 {
     const RootInfo *info = get_root_info_for_path(root_path);
     if (info == NULL) {
@@ -314,7 +340,29 @@ ensure_root_path_unmounted(const char *root_path)
         return 0;
     }
 
-    return unmount_mounted_volume(volume);
+    ret = unmount_mounted_volume(volume);
+    if (ret == 0) {
+        g_mount_generation++;
+    }
+    return ret;
+}
+
+int
+ensure_root_path_unmounted(const char *root_path)
+{
+    pthread_mutex_lock(&g_volumes_lock);
+    int ret = ensure_root_path_unmounted_locked(root_path);
+    pthread_mutex_unlock(&g_volumes_lock);
+    return ret;
+}
+
+unsigned int
+get_mount_generation()
+{
+    pthread_mutex_lock(&g_volumes_lock);
+    unsigned int generation = g_mount_generation;
+    pthread_mutex_unlock(&g_volumes_lock);
+    return generation;
 }
 
 const MtdPartition *
@@ -330,6 +378,99 @@ get_root_mtd_partition(const char *root_path)
     return mtd_find_partition_by_name(info->partition_name);
 }
 
+const char *
+get_root_block_device(const char *root_path)
+{
+    const RootInfo *info = get_root_info_for_path(root_path);
+    if (info == NULL || info->device == NULL ||
+            info->device == g_mtd_device || info->device[0] != '/')
+    {
+        return NULL;
+    }
+    return info->device;
+}
+
+/* Features that only ext4 mounts: extents, flex_bg, uninit_bg. */
+#define EXT_SUPER_OFFSET 1024
+#define EXT_SUPER_MAGIC 0xef53
+#define EXT4_INCOMPAT_MASK (0x0040 | 0x0200)
+#define EXT4_RO_COMPAT_MASK 0x0010
+
+static int
+device_has_ext4(const char *device)
+{
+    unsigned char sb[0x68];
+    int fd = open(device, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t r = pread(fd, sb, sizeof(sb), EXT_SUPER_OFFSET);
+    close(fd);
+    if (r != (ssize_t) sizeof(sb) ||
+            (sb[0x38] | (sb[0x39] << 8)) != EXT_SUPER_MAGIC) {
+        return 0;
+    }
+    uint32_t incompat = sb[0x60] | (sb[0x61] << 8) | (sb[0x62] << 16) |
+            ((uint32_t) sb[0x63] << 24);
+    uint32_t ro_compat = sb[0x64] | (sb[0x65] << 8) | (sb[0x66] << 16) |
+            ((uint32_t) sb[0x67] << 24);
+    return (incompat & EXT4_INCOMPAT_MASK) || (ro_compat & EXT4_RO_COMPAT_MASK);
+}
+
+static int
+run_mke2fs(char **args)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv(MKE2FS_BIN, args);
+        fprintf(stderr, "format_root_device: can't run %s\n(%s)\n",
+                MKE2FS_BIN, strerror(errno));
+        _exit(-1);
+    }
+    if (pid < 0) {
+        return -1;
+    }
+    int status;
+    while (waitpid(pid, &status, WNOHANG) == 0) {
+        ui_print(".");
+        sleep(1);
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/* Formats the internal data partition, keeping whichever of ext3 and
+ * ext4 it had.  Inode tables are left for the kernel to initialize
+ * lazily and the old blocks are discarded rather than overwritten, the
+ * slow parts of a stock mke2fs; an older mke2fs that refuses those
+ * options gets a plain format.
+ */
+static int
+format_ext_device(const char *device)
+{
+    static char *extended[] = {
+        "lazy_itable_init=1,discard",
+        "lazy_itable_init=1",
+    };
+    int ext4 = device_has_ext4(device);
+    size_t i;
+    for (i = 0; i < sizeof(extended) / sizeof(extended[0]); ++i) {
+        char *args[] = { MKE2FS_BIN, "-L", "data", "-t", ext4 ? "ext4" : "ext3",
+                "-E", extended[i], (char *) device, NULL };
+        if (run_mke2fs(args) == 0) {
+            return 0;
+        }
+        LOGW("format_root_device: mke2fs -E %s failed on %s\n",
+                extended[i], device);
+    }
+    // EXT3 Journalisation
+    char *args_format[] = { MKE2FS_BIN, "-L", "data", "-j", (char *) device, NULL };
+    if (run_mke2fs(args_format) != 0) {
+        LOGE("format_root_device: can't format %s\n", device);
+        return -1;
+    }
+    return 0;
+}
+
 int
 format_root_device(const char *root)
 {
@@ -394,22 +535,7 @@ format_root_device(const char *root)
 // drakaz : ajout du support du formattage de la partition ext3 data propre au galaxy
 LOGW("Data partition info : FS : \"%s\", Name : \"%s\"\n", info->filesystem, info->partition_name );
 	if ( !strcmp(info->partition_name,"intdata")) {
-   		pid_t pid_format = fork();
-		if (pid_format == 0) {
-			// EXT3 Journalisation
-			char *journal_opts;
-			journal_opts = "-j";
-			char *args_format[] = { MKE2FS_BIN, "-L", "data", journal_opts, "/dev/block/mmcblk0p1", NULL };
-			execv(MKE2FS_BIN, args_format);
-                        fprintf(stderr, "format_root_device: can't format data partition  \"%s\"\n", strerror(errno));
-                        _exit(-1);
-                    }
-		int format_status;
-                while (waitpid(pid_format, &format_status, WNOHANG) == 0) {
-                        ui_print(".");
-                        sleep(1);
-                    }
-		return 0;
+		return format_ext_device(info->device);
 	}
 
 //TODO: handle other device types (sdcard, etc.)
@@ -53,8 +53,18 @@ int ensure_root_path_mounted(const char *root_path);
 
 int ensure_root_path_unmounted(const char *root_path);
 
+/* Changes every time one of the roots is mounted or unmounted, so
+ * anything cached about their contents can tell when it's stale.
+ */
+unsigned int get_mount_generation(void);
+
 const MtdPartition *get_root_mtd_partition(const char *root_path);
 
+/* Returns the block device (e.g. "/dev/block/mmcblk0p1") behind a root
+ * that's on one, or NULL for MTD partitions and the rest.
+ */
+const char *get_root_block_device(const char *root_path);
+
 /* "root" must be the exact name of the root; no relative path is permitted.
  * If the named root is mounted, this will attempt to unmount it first.
  */
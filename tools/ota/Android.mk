@@ -20,6 +20,13 @@ LOCAL_MODULE_TAGS := optional
 LOCAL_SRC_FILES := make-update-script.c
 include $(BUILD_HOST_EXECUTABLE)
 
+include $(CLEAR_VARS)
+LOCAL_MODULE := optimize-update-package
+LOCAL_MODULE_TAGS := optional
+LOCAL_SRC_FILES := optimize-update-package.c
+LOCAL_STATIC_LIBRARIES := libz
+include $(BUILD_HOST_EXECUTABLE)
+
 ifneq ($(TARGET_SIMULATOR),true)
 
 include $(CLEAR_VARS)
@@ -18,14 +18,17 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/klog.h>
 #include <sys/reboot.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "private/android_filesystem_config.h"
 
@@ -39,9 +42,169 @@ static const char *kOutputFile = "/data/tombstones/check-lost+found-log";
 // Partitions to check
 static const char *kPartitions[] = { "/system", "/data", "/cache", NULL };
 
+// This runs on the boot path, so a badly corrupted partition mustn't hold
+// boot up for long: at most this much of lost+found is deleted per boot,
+// and whatever's left is counted again (and deleted) on the next one.
+static const int kMaxDeleteFiles = 1000;
+static const long long kMaxDeleteBytes = 32 * 1024 * 1024;
+
+// Threads to scan and delete with; the time goes on waiting for flash.
+#define NUM_WORKERS 4
+
+// One entry in a lost+found directory.
+typedef struct {
+    int partition;              // index into kPartitions
+    char *path;
+} Item;
+
+typedef struct {
+    int entries;                // in lost+found itself
+    int files;                  // in all, counting what's in directories
+    long long bytes;
+    int uncounted;              // entries left unmeasured, or only in part
+    int deleted_files;
+    long long deleted_bytes;
+} PartitionStats;
+
+static Item *items = NULL;
+static int num_items = 0, max_items = 0, next_item = 0;
+static PartitionStats stats[sizeof(kPartitions) / sizeof(kPartitions[0])];
+static int budget_files = 0;
+static long long budget_bytes = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Count the files and bytes at path (a tree, if it's a directory).
+// Gives up and returns -1 as soon as the count goes over max_files or
+// max_bytes, since the entry can't be deleted this boot anyway.
+static int measure(const char *path, int *files, long long *bytes,
+                   int max_files, long long max_bytes) {
+    struct stat st;
+    if (lstat(path, &st) != 0) return 0;
+    *files += 1;
+    if (!S_ISDIR(st.st_mode)) *bytes += st.st_size;
+    if (*files > max_files || *bytes > max_bytes) return -1;
+    if (!S_ISDIR(st.st_mode)) return 0;
+
+    int result = 0;
+    DIR *dir = opendir(path);
+    if (dir == NULL) return 0;
+    struct dirent *ent;
+    while (result == 0 && (ent = readdir(dir))) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+        char fn[PATH_MAX];
+        snprintf(fn, sizeof(fn), "%s/%s", path, ent->d_name);
+        result = measure(fn, files, bytes, max_files, max_bytes);
+    }
+    closedir(dir);
+    return result;
+}
+
+// Delete path and everything under it.  Returns 0 if it all went.
+static int remove_tree(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) != 0) return -1;
+    if (!S_ISDIR(st.st_mode)) return unlink(path);
+
+    int result = 0;
+    DIR *dir = opendir(path);
+    if (dir == NULL) return -1;
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+        char fn[PATH_MAX];
+        snprintf(fn, sizeof(fn), "%s/%s", path, ent->d_name);
+        if (remove_tree(fn) != 0) result = -1;
+    }
+    closedir(dir);
+    if (rmdir(path) != 0) result = -1;
+    return result;
+}
+
+static void *worker(void *cookie) {
+    for (;;) {
+        // Once the budget is spent, nothing more can be deleted this
+        // boot, so the rest isn't even measured.
+        pthread_mutex_lock(&lock);
+        if (budget_files <= 0 || budget_bytes <= 0) next_item = num_items;
+        int i = next_item < num_items ? next_item++ : -1;
+        int max_files = budget_files;
+        long long max_bytes = budget_bytes;
+        pthread_mutex_unlock(&lock);
+        if (i < 0) return NULL;
+
+        Item *item = &items[i];
+        int files = 0;
+        long long bytes = 0;
+        int whole = measure(item->path, &files, &bytes,
+                            max_files, max_bytes) == 0;
+
+        // Only take on the whole entry if it fits in what's left.
+        pthread_mutex_lock(&lock);
+        PartitionStats *ps = &stats[item->partition];
+        ps->files += files;
+        ps->bytes += bytes;
+        if (!whole) ps->uncounted += 1;
+        int take = whole && files <= budget_files && bytes <= budget_bytes;
+        if (take) {
+            budget_files -= files;
+            budget_bytes -= bytes;
+        }
+        pthread_mutex_unlock(&lock);
+
+        if (take && remove_tree(item->path) == 0) {
+            pthread_mutex_lock(&lock);
+            ps->deleted_files += files;
+            ps->deleted_bytes += bytes;
+            pthread_mutex_unlock(&lock);
+        }
+    }
+}
+
+// Queue up the entries of each partition's lost+found for the workers.
+static void list_lost_found(FILE *out) {
+    int i;
+    for (i = 0; kPartitions[i] != NULL; ++i) {
+        char fn[PATH_MAX];
+        snprintf(fn, sizeof(fn), "%s/%s", kPartitions[i], "lost+found");
+        DIR *dir = opendir(fn);
+        if (dir == NULL) {
+            fprintf(out, "Can't open %s: %s\n", fn, strerror(errno));
+            continue;
+        }
+        struct dirent *ent;
+        while ((ent = readdir(dir))) {
+            if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+                continue;
+            }
+            ++stats[i].entries;
+            if (num_items == max_items) {
+                int count = max_items ? max_items * 2 : 64;
+                Item *more = realloc(items, count * sizeof(Item));
+                if (more == NULL) {
+                    fprintf(out, "Out of memory listing %s\n", fn);
+                    break;
+                }
+                items = more;
+                max_items = count;
+            }
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", fn, ent->d_name);
+            items[num_items].partition = i;
+            items[num_items].path = strdup(path);
+            if (items[num_items].path == NULL) {
+                fprintf(out, "Out of memory listing %s\n", fn);
+                break;
+            }
+            ++num_items;
+        }
+        closedir(dir);
+    }
+}
+
 /*
  * 1. If /data/misc/forced-reboot is missing, touch it & force "unclean" boot.
- * 2. Write a log entry with the number of files in lost+found directories.
+ * 2. Write a log entry with the number of files in lost+found directories,
+ *    and clear them out, up to kMaxDeleteFiles / kMaxDeleteBytes per boot.
  */
 
 int main(int argc, char **argv) {
@@ -93,28 +256,51 @@ int main(int argc, char **argv) {
         fprintf(out, "Found %s\n", kMarkerFile);
     }
 
-    int i;
+    struct timeval scan_start, scan_end;
+    gettimeofday(&scan_start, NULL);
+    budget_files = kMaxDeleteFiles;
+    budget_bytes = kMaxDeleteBytes;
+    list_lost_found(out);
+
+    pthread_t threads[NUM_WORKERS];
+    int i, num_threads = 0;
+    for (i = 0; i < NUM_WORKERS && i < num_items; ++i) {
+        if (pthread_create(&threads[num_threads], NULL, worker, NULL) == 0) {
+            ++num_threads;
+        }
+    }
+    if (num_threads == 0) worker(NULL);
+    for (i = 0; i < num_threads; ++i) pthread_join(threads[i], NULL);
+    gettimeofday(&scan_end, NULL);
+
+    // Whatever the workers never got to went uncounted too.
+    int measured[sizeof(kPartitions) / sizeof(kPartitions[0])];
+    memset(measured, 0, sizeof(measured));
+    for (i = 0; i < next_item; ++i) measured[items[i].partition] += 1;
     for (i = 0; kPartitions[i] != NULL; ++i) {
-        char fn[PATH_MAX];
-        snprintf(fn, sizeof(fn), "%s/%s", kPartitions[i], "lost+found");
-        DIR *dir = opendir(fn);
-        if (dir == NULL) {
-            fprintf(out, "Can't open %s: %s\n", fn, strerror(errno));
+        stats[i].uncounted += stats[i].entries - measured[i];
+    }
+
+    int deleted_files = 0;
+    long long deleted_bytes = 0;
+    for (i = 0; kPartitions[i] != NULL; ++i) {
+        const PartitionStats *ps = &stats[i];
+        if (ps->entries > 0) {
+            fprintf(out, "OMGZ FOUND %d FILES IN %s/lost+found "
+                    "(%d%s in all, %lld bytes; deleted %d)\n",
+                    ps->entries, kPartitions[i], ps->files,
+                    ps->uncounted > 0 ? "+" : "", ps->bytes,
+                    ps->deleted_files);
         } else {
-            int count = 0;
-            struct dirent *ent;
-            while ((ent = readdir(dir))) {
-                if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, ".."))
-                    ++count;
-            }
-            closedir(dir);
-            if (count > 0) {
-                fprintf(out, "OMGZ FOUND %d FILES IN %s\n", count, fn);
-            } else {
-                fprintf(out, "%s is clean\n", fn);
-            }
+            fprintf(out, "%s/lost+found is clean\n", kPartitions[i]);
         }
+        deleted_files += ps->deleted_files;
+        deleted_bytes += ps->deleted_bytes;
     }
+    long ms = (scan_end.tv_sec - scan_start.tv_sec) * 1000 +
+            (scan_end.tv_usec - scan_start.tv_usec) / 1000;
+    fprintf(out, "Checked in %ld ms, deleted %d files (%lld bytes)\n",
+            ms, deleted_files, deleted_bytes);
 
     char dmesg[131073];
     int len = klogctl(KLOG_READ_ALL, dmesg, sizeof(dmesg) - 1);
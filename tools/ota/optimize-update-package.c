@@ -0,0 +1,501 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Rewrite an update package so recovery reads it front to back:
+ *
+ *   - the signature files, update binary and script come first, then the
+ *     entries in the order the script uses them, then everything else;
+ *   - each entry is stored or deflated, whichever the device should get
+ *     through faster, given how fast it reads the card and inflates;
+ *   - stored entries start on a page boundary, so minzip can map them
+ *     straight from the file without copying.
+ *
+ * Entry digests are over the uncompressed data, so a jar signature still
+ * holds afterwards.  A whole-file signature can't, so the zip comment that
+ * holds it is dropped, and recovery falls back to the jar signature.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#define LOCSIG 0x04034b50
+#define LOCHDR 30
+#define CENSIG 0x02014b50
+#define CENHDR 46
+#define ENDSIG 0x06054b50
+#define ENDHDR 22
+
+#define STORED 0
+#define DEFLATED 8
+
+typedef struct {
+    char *name;
+    unsigned name_len;
+    unsigned version_made_by;
+    unsigned version_needed;
+    unsigned flags;
+    unsigned method;
+    unsigned mod_time, mod_date;
+    unsigned long crc;
+    unsigned long comp_len, uncomp_len;
+    unsigned internal_attrs;
+    unsigned long external_attrs;
+    const unsigned char *data;      // comp_len bytes, in the input
+    unsigned char *new_data;        // recompressed, if it was
+    int order;                      // position in the output
+    unsigned long new_offset;       // of the local header, in the output
+} Entry;
+
+static long read_mbps = 8;          // card read rate on the device
+static long inflate_mbps = 16;      // inflate output rate on the device
+static unsigned long alignment = 4096;
+static int keep_methods = 0;
+static int verbose = 0;
+
+static unsigned get2(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned long get4(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long) p[3] << 24);
+}
+
+static void put2(FILE *f, unsigned v) {
+    fputc(v & 0xff, f);
+    fputc((v >> 8) & 0xff, f);
+}
+
+static void put4(FILE *f, unsigned long v) {
+    put2(f, v & 0xffff);
+    put2(f, (v >> 16) & 0xffff);
+}
+
+static void die(const char *what, const char *name) {
+    fprintf(stderr, "optimize-update-package: %s%s%s\n",
+            what, name ? ": " : "", name ? name : "");
+    exit(1);
+}
+
+static unsigned char *read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL || fseek(f, 0, SEEK_END) != 0) {
+        perror(path);
+        exit(1);
+    }
+    *len = ftell(f);
+    rewind(f);
+    unsigned char *buf = malloc(*len + 1);
+    if (buf == NULL || fread(buf, 1, *len, f) != *len) {
+        perror(path);
+        exit(1);
+    }
+    buf[*len] = '\0';
+    fclose(f);
+    return buf;
+}
+
+/*
+ * Parse the central directory of the zip in buf.  Data descriptors,
+ * encryption and zip64 aren't supported; update packages don't use them.
+ */
+static Entry *read_entries(const unsigned char *buf, size_t len, int *count) {
+    if (len < ENDHDR) die("not a zip file", NULL);
+    const unsigned char *eocd = buf + len - ENDHDR;
+    while (eocd > buf && get4(eocd) != ENDSIG) eocd--;
+    if (get4(eocd) != ENDSIG) die("no end of central directory", NULL);
+
+    *count = get2(eocd + 10);
+    unsigned long cd_offset = get4(eocd + 16);
+    if (cd_offset > len) die("bad central directory offset", NULL);
+
+    Entry *entries = calloc(*count, sizeof(Entry));
+    const unsigned char *p = buf + cd_offset;
+    int i;
+    for (i = 0; i < *count; ++i) {
+        Entry *e = &entries[i];
+        if (p + CENHDR > buf + len || get4(p) != CENSIG) {
+            die("bad central directory entry", NULL);
+        }
+        e->version_made_by = get2(p + 4);
+        e->version_needed = get2(p + 6);
+        e->flags = get2(p + 8);
+        e->method = get2(p + 10);
+        e->mod_time = get2(p + 12);
+        e->mod_date = get2(p + 14);
+        e->crc = get4(p + 16);
+        e->comp_len = get4(p + 20);
+        e->uncomp_len = get4(p + 24);
+        e->name_len = get2(p + 28);
+        unsigned extra_len = get2(p + 30);
+        unsigned comment_len = get2(p + 32);
+        e->internal_attrs = get2(p + 36);
+        e->external_attrs = get4(p + 38);
+        unsigned long local = get4(p + 42);
+
+        e->name = malloc(e->name_len + 1);
+        memcpy(e->name, p + CENHDR, e->name_len);
+        e->name[e->name_len] = '\0';
+
+        if (e->flags & 1) die("encrypted entry", e->name);
+        if (e->method != STORED && e->method != DEFLATED) {
+            die("unsupported compression method", e->name);
+        }
+        if (local + LOCHDR > len || get4(buf + local) != LOCSIG) {
+            die("bad local header", e->name);
+        }
+        unsigned long data = local + LOCHDR + get2(buf + local + 26) +
+                get2(buf + local + 28);
+        if (data + e->comp_len > len) die("data runs off the end", e->name);
+        e->data = buf + data;
+        e->order = -1;
+
+        p += CENHDR + e->name_len + extra_len + comment_len;
+    }
+    return entries;
+}
+
+static int next_order = 0;
+
+static void schedule(Entry *e) {
+    if (e->order < 0) e->order = next_order++;
+}
+
+/*
+ * Schedule the entry called name, or if there's none, everything under
+ * the directory called name.
+ */
+static void schedule_path(Entry *entries, int count, const char *name) {
+    if (strncmp(name, "PACKAGE:", 8) == 0) name += 8;
+    size_t len = strlen(name);
+    while (len > 0 && name[len-1] == '/') len--;
+    if (len == 0) return;
+
+    int i, found = 0;
+    for (i = 0; i < count; ++i) {
+        if (entries[i].name_len == len &&
+            memcmp(entries[i].name, name, len) == 0) {
+            schedule(&entries[i]);
+            found = 1;
+        }
+    }
+    if (found) return;
+    for (i = 0; i < count; ++i) {
+        if (entries[i].name_len > len &&
+            memcmp(entries[i].name, name, len) == 0 &&
+            entries[i].name[len] == '/') {
+            schedule(&entries[i]);
+        }
+    }
+}
+
+/*
+ * Return a malloc()ed, NUL-terminated copy of e's uncompressed data.
+ */
+static char *entry_text(const Entry *e) {
+    char *text = malloc(e->uncomp_len + 1);
+    if (text == NULL) die("out of memory", e->name);
+    if (e->method == STORED) {
+        memcpy(text, e->data, e->uncomp_len);
+    } else {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        zs.next_in = (unsigned char *) e->data;
+        zs.avail_in = e->comp_len;
+        zs.next_out = (unsigned char *) text;
+        zs.avail_out = e->uncomp_len;
+        if (inflateInit2(&zs, -MAX_WBITS) != Z_OK ||
+            inflate(&zs, Z_FINISH) != Z_STREAM_END) {
+            die("can't inflate", e->name);
+        }
+        inflateEnd(&zs);
+    }
+    text[e->uncomp_len] = '\0';
+    return text;
+}
+
+/*
+ * Schedule what the script reads from the package, in the order it reads
+ * it.  For edify that's the first argument of the functions below; for
+ * amend, and for edify's write_firmware_image(), it's PACKAGE: paths.
+ */
+static void schedule_script(Entry *entries, int count, const Entry *script) {
+    static const char *functions[] = {
+        "package_extract_dir", "package_extract_file", "set_perm_table",
+        "write_raw_image", NULL
+    };
+
+    char *text = entry_text(script);
+    char *p = text;
+    while (*p != '\0') {
+        if (strncmp(p, "PACKAGE:", 8) == 0) {
+            char *end = p + strcspn(p, " \t\r\n\"");
+            char saved = *end;
+            *end = '\0';
+            schedule_path(entries, count, p);
+            *end = saved;
+            p = end;
+            continue;
+        }
+
+        int i;
+        for (i = 0; functions[i] != NULL; ++i) {
+            size_t n = strlen(functions[i]);
+            if (strncmp(p, functions[i], n) != 0) continue;
+            char *q = p + n;
+            while (*q == ' ' || *q == '\t') q++;
+            if (*q != '(') continue;
+            q += 1 + strspn(q + 1, " \t\r\n");
+            if (*q != '"') continue;
+            char *end = strchr(q + 1, '"');
+            if (end == NULL) continue;
+            *end = '\0';
+            schedule_path(entries, count, q + 1);
+            *end = '"';
+            break;
+        }
+        p++;
+    }
+    free(text);
+}
+
+static int compare_order(const void *a, const void *b) {
+    return ((const Entry *) a)->order - ((const Entry *) b)->order;
+}
+
+/*
+ * Decide how to compress e.  Reading n bytes takes n / read_mbps and
+ * inflating to n bytes takes n / inflate_mbps, so deflating only pays
+ * when it saves more reading than the inflating costs.
+ */
+static void choose_method(Entry *e) {
+    if (keep_methods || e->uncomp_len == 0) return;
+
+    unsigned long deflated_len = e->comp_len;
+    unsigned char *deflated = NULL;
+    if (e->method == STORED) {
+        // Find out how well it would deflate.
+        uLong bound = compressBound(e->uncomp_len);
+        deflated = malloc(bound);
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+                         8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            die("deflateInit2 failed", e->name);
+        }
+        zs.next_in = (unsigned char *) e->data;
+        zs.avail_in = e->uncomp_len;
+        zs.next_out = deflated;
+        zs.avail_out = bound;
+        if (deflate(&zs, Z_FINISH) != Z_STREAM_END) die("can't deflate", e->name);
+        deflated_len = zs.total_out;
+        deflateEnd(&zs);
+    }
+
+    double stored_cost = (double) e->uncomp_len / read_mbps;
+    double deflated_cost = (double) deflated_len / read_mbps +
+            (double) e->uncomp_len / inflate_mbps;
+    int store = stored_cost <= deflated_cost;
+
+    if (e->method == STORED && !store) {
+        e->new_data = deflated;
+        e->comp_len = deflated_len;
+        e->method = DEFLATED;
+        e->version_needed = 20;
+        if (verbose) printf("deflate %s\n", e->name);
+    } else if (e->method == DEFLATED && store) {
+        unsigned char *stored = malloc(e->uncomp_len);
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        zs.next_in = (unsigned char *) e->data;
+        zs.avail_in = e->comp_len;
+        zs.next_out = stored;
+        zs.avail_out = e->uncomp_len;
+        if (inflateInit2(&zs, -MAX_WBITS) != Z_OK ||
+            inflate(&zs, Z_FINISH) != Z_STREAM_END ||
+            zs.total_out != e->uncomp_len) {
+            die("can't inflate", e->name);
+        }
+        inflateEnd(&zs);
+        if (crc32(crc32(0, NULL, 0), stored, e->uncomp_len) != e->crc) {
+            die("CRC mismatch", e->name);
+        }
+        e->new_data = stored;
+        e->comp_len = e->uncomp_len;
+        e->method = STORED;
+        if (verbose) printf("store %s\n", e->name);
+        free(deflated);
+    } else {
+        free(deflated);
+    }
+}
+
+static void write_entries(FILE *f, Entry *entries, int count) {
+    unsigned long offset = 0;
+    int i;
+    for (i = 0; i < count; ++i) {
+        Entry *e = &entries[i];
+        const unsigned char *data = e->new_data ? e->new_data : e->data;
+
+        // Pad the extra field so stored data starts on a page boundary.
+        // Entries smaller than a page only get word alignment; a page of
+        // padding would cost more than mapping them saves.
+        unsigned long data_offset = offset + LOCHDR + e->name_len;
+        unsigned long align = e->comp_len >= alignment ? alignment : 4;
+        unsigned pad = 0;
+        if (e->method == STORED && e->comp_len > 0) {
+            pad = (align - data_offset % align) % align;
+        }
+
+        e->new_offset = offset;
+        e->flags &= ~8;         // sizes are in the header; no descriptor
+        put4(f, LOCSIG);
+        put2(f, e->version_needed);
+        put2(f, e->flags);
+        put2(f, e->method);
+        put2(f, e->mod_time);
+        put2(f, e->mod_date);
+        put4(f, e->crc);
+        put4(f, e->comp_len);
+        put4(f, e->uncomp_len);
+        put2(f, e->name_len);
+        put2(f, pad);
+        fwrite(e->name, 1, e->name_len, f);
+        unsigned j;
+        for (j = 0; j < pad; ++j) fputc(0, f);
+        fwrite(data, 1, e->comp_len, f);
+        offset = data_offset + pad + e->comp_len;
+    }
+
+    unsigned long cd_offset = offset;
+    for (i = 0; i < count; ++i) {
+        Entry *e = &entries[i];
+        put4(f, CENSIG);
+        put2(f, e->version_made_by);
+        put2(f, e->version_needed);
+        put2(f, e->flags);
+        put2(f, e->method);
+        put2(f, e->mod_time);
+        put2(f, e->mod_date);
+        put4(f, e->crc);
+        put4(f, e->comp_len);
+        put4(f, e->uncomp_len);
+        put2(f, e->name_len);
+        put2(f, 0);             // extra
+        put2(f, 0);             // comment
+        put2(f, 0);             // disk
+        put2(f, e->internal_attrs);
+        put4(f, e->external_attrs);
+        put4(f, e->new_offset);
+        fwrite(e->name, 1, e->name_len, f);
+        offset += CENHDR + e->name_len;
+    }
+
+    put4(f, ENDSIG);
+    put2(f, 0);
+    put2(f, 0);
+    put2(f, count);
+    put2(f, count);
+    put4(f, offset - cd_offset);
+    put4(f, cd_offset);
+    put2(f, 0);                 // no comment, so no whole-file signature
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "usage: %s [options] input.zip output.zip\n"
+            "  -r MB/s   how fast the device reads the card (default %ld)\n"
+            "  -i MB/s   how fast the device inflates (default %ld)\n"
+            "  -a bytes  alignment of stored entries (default %lu)\n"
+            "  -k        keep each entry's compression method\n"
+            "  -v        say which entries change method\n"
+            "The rates are the ones to use for the devices the package is\n"
+            "for; the \"phase\" lines in the recovery log give a rough idea.\n",
+            argv0, read_mbps, inflate_mbps, alignment);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "r:i:a:kv")) != -1) {
+        switch (c) {
+            case 'r': read_mbps = atol(optarg); break;
+            case 'i': inflate_mbps = atol(optarg); break;
+            case 'a': alignment = strtoul(optarg, NULL, 0); break;
+            case 'k': keep_methods = 1; break;
+            case 'v': verbose = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || read_mbps <= 0 || inflate_mbps <= 0) {
+        usage(argv[0]);
+    }
+
+    size_t len;
+    unsigned char *buf = read_file(argv[optind], &len);
+    int count;
+    Entry *entries = read_entries(buf, len, &count);
+
+    // Verification reads the signature first; then the binary and script.
+    static const char *first[] = {
+        "META-INF/MANIFEST.MF",
+        "META-INF/com/google/android/update-binary",
+        "META-INF/com/google/android/updater-script",
+        "META-INF/com/google/android/update-script",
+        NULL
+    };
+    int i;
+    for (i = 0; i < count; ++i) {
+        const char *name = entries[i].name;
+        if (strncmp(name, "META-INF/", 9) == 0 && strchr(name + 9, '/') == NULL &&
+            strcmp(name, first[0]) != 0) {
+            schedule(&entries[i]);
+        }
+    }
+    for (i = 0; first[i] != NULL; ++i) {
+        schedule_path(entries, count, first[i]);
+    }
+    for (i = 0; i < count; ++i) {
+        if (strcmp(entries[i].name, first[2]) == 0 ||
+            strcmp(entries[i].name, first[3]) == 0) {
+            schedule_script(entries, count, &entries[i]);
+        }
+    }
+    for (i = 0; i < count; ++i) schedule(&entries[i]);
+    qsort(entries, count, sizeof(Entry), compare_order);
+
+    for (i = 0; i < count; ++i) choose_method(&entries[i]);
+
+    FILE *f = fopen(argv[optind + 1], "wb");
+    if (f == NULL) {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+    write_entries(f, entries, count);
+    int failed = ferror(f);
+    if (fclose(f) != 0 || failed) {
+        fprintf(stderr, "optimize-update-package: error writing %s: %s\n",
+                argv[optind + 1], strerror(errno));
+        remove(argv[optind + 1]);
+        return 1;
+    }
+    return 0;
+}
@@ -41,6 +41,7 @@
 
 #define PROGRESSBAR_INDETERMINATE_STATES 6
 #define PROGRESSBAR_INDETERMINATE_FPS 15
+#define UI_MAX_FPS 30
 
 enum { LEFT_SIDE, CENTER_TILE, RIGHT_SIDE, NUM_SIDES };
 
@@ -73,6 +74,8 @@ static const struct { gr_surface* surface; const char *name; } BITMAPS[] = {
     { NULL,                             NULL },
 };
 
+static int gBitmapsLoaded = 0;
+
 static gr_surface gCurrentIcon = NULL;
 
 static enum ProgressBarType {
@@ -88,12 +91,24 @@ static time_t gProgressScopeTime, gProgressScopeDuration;
 // Set to 1 when both graphics pages are the same (except for the progress bar)
 static int gPagesIdentical = 0;
 
+// Repaints the render thread owes; see update_screen_locked().
+static pthread_cond_t gRedrawCond = PTHREAD_COND_INITIALIZER;
+static int gRedrawScreen = 0;
+static int gRedrawProgress = 0;
+
+// Wakes progress_thread when the progress bar or text overlay changes.
+static pthread_cond_t gProgressCond = PTHREAD_COND_INITIALIZER;
+
 // Log text overlay, displayed when a magic key is pressed
 static char text[MAX_ROWS][MAX_COLS];
 static int text_cols = 0, text_rows = 0;
 static int text_col = 0, text_row = 0, text_top = 0;
 static int show_text = 1;
 
+// Status line for the running phase of work (see ui_show_phase)
+static char gPhaseLine[MAX_COLS];
+static int gShowPhase = 1;
+
 static char menu[MENU_MAX_ROWS][MENU_MAX_COLS];
 static int show_menu = 0;
 static int menu_top = 0, menu_items = 0, menu_sel = 0;
@@ -103,8 +118,39 @@ static int menu_show_start = 0;             // this is line which menu display i
 static pthread_mutex_t key_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t key_queue_cond = PTHREAD_COND_INITIALIZER;
 static int key_queue[256], key_queue_len = 0;
+static struct timeval key_queue_time[256];  // when each key was pressed
+
+// Input-to-screen latency: the time from a key press to the first frame
+// shown after something took that key off the queue.  Logged every
+// LATENCY_REPORT_KEYS keys, so menu lag shows up in the recovery log.
+#define LATENCY_REPORT_KEYS 32
+#define LATENCY_MAX_MS 2000     // longer means the key changed nothing
+static struct timeval gKeyTaken;            // guarded by gUpdateMutex
+static int gKeyTakenPending = 0;
+static long gLatencyTotalMs = 0, gLatencyMaxMs = 0;
+static int gLatencyCount = 0;
 static volatile char key_pressed[KEY_MAX + 1];
 
+// The menu is all text, so the bitmaps (backgrounds for the install
+// screens and the progress bar) aren't decoded until something needs
+// them, keeping PNG loading out of the time it takes to reach the menu.
+// Should only be called with gUpdateMutex locked.
+static void load_bitmaps_locked()
+{
+    if (gBitmapsLoaded) return;
+    gBitmapsLoaded = 1;
+
+    int i;
+    for (i = 0; BITMAPS[i].name != NULL; ++i) {
+        int result = res_create_surface(BITMAPS[i].name, BITMAPS[i].surface);
+        if (result < 0) {
+            // LOGE would print, which needs gUpdateMutex.
+            LOGW("Missing bitmap %s\n(Code %d)\n", BITMAPS[i].name, result);
+            *BITMAPS[i].surface = NULL;
+        }
+    }
+}
+
 // Clear the screen and draw the currently selected background icon (if any).
 // Should only be called with gUpdateMutex locked.
 static void draw_background_locked(gr_surface icon)
@@ -127,6 +173,7 @@ static void draw_background_locked(gr_surface icon)
 static void draw_progress_locked()
 {
     if (gProgressBarType == PROGRESSBAR_TYPE_NONE) return;
+    load_bitmaps_locked();
 
     int iconHeight = gr_get_height(gBackgroundIcon[BACKGROUND_ICON_INSTALLING]);
     int width = gr_get_width(gProgressBarIndeterminate[0]);
@@ -222,40 +269,126 @@ static void draw_screen_locked(void)
             row++;
         }
 
+        // Keep the newest log line above the phase status line.
+        int hud = gShowPhase && gPhaseLine[0] != '\0';
         gr_color(NORMAL_TEXT_COLOR);
-        for (; row < text_rows; ++row) {
-            draw_text_line(row, text[(row+text_top) % text_rows]);
+        for (; row < text_rows - hud; ++row) {
+            draw_text_line(row, text[(row+hud+text_top) % text_rows]);
         }
     }
+
+    if (gShowPhase && gPhaseLine[0] != '\0' && text_rows > 0) {
+        int row = text_rows - 1;
+        gr_color(0, 0, 0, 200);
+        gr_fill(0, row*CHAR_HEIGHT, gr_fb_width(), (row+1)*CHAR_HEIGHT);
+        gr_color(NORMAL_TEXT_COLOR);
+        draw_text_line(row, gPhaseLine);
+    }
 }
 
-// Redraw everything on the screen and flip the screen (make it visible).
+// Ask for everything on the screen to be redrawn and flipped.  The
+// render thread does it, at most UI_MAX_FPS times a second, however often
+// this is called.
 // Should only be called with gUpdateMutex locked.
 static void update_screen_locked(void)
 {
     if (!ui_has_initialized) return;
-    draw_screen_locked();
-    gr_flip();
+    gRedrawScreen = 1;
+    pthread_cond_signal(&gRedrawCond);
+    pthread_cond_signal(&gProgressCond);
 }
 
-// Updates only the progress bar, if possible, otherwise redraws the screen.
+// Ask for just the progress bar to be redrawn, if possible, otherwise the
+// whole screen.
 // Should only be called with gUpdateMutex locked.
 static void update_progress_locked(void)
 {
     if (!ui_has_initialized) return;
-    if (show_text || !gPagesIdentical) {
-        draw_screen_locked();    // Must redraw the whole screen
-        gPagesIdentical = 1;
-    } else {
-        draw_progress_locked();  // Draw only the progress bar
+    gRedrawProgress = 1;
+    pthread_cond_signal(&gRedrawCond);
+    pthread_cond_signal(&gProgressCond);
+}
+
+// Does the repaints asked for, so a burst of prints or progress updates
+// costs one frame rather than one each.
+static void *render_thread(void *cookie)
+{
+    const long frame_us = 1000000 / UI_MAX_FPS;
+    struct timeval last = { 0, 0 };
+
+    pthread_mutex_lock(&gUpdateMutex);
+    for (;;) {
+        while (!gRedrawScreen && !gRedrawProgress) {
+            pthread_cond_wait(&gRedrawCond, &gUpdateMutex);
+        }
+
+        // Let changes collect until a frame has passed since the last one.
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        long since = (now.tv_sec - last.tv_sec) * 1000000L +
+                (now.tv_usec - last.tv_usec);
+        if (since >= 0 && since < frame_us) {
+            pthread_mutex_unlock(&gUpdateMutex);
+            usleep(frame_us - since);
+            pthread_mutex_lock(&gUpdateMutex);
+        }
+
+        if (gRedrawScreen) {
+            draw_screen_locked();
+        } else if (show_text || !gPagesIdentical) {
+            draw_screen_locked();    // Must redraw the whole screen
+            gPagesIdentical = 1;
+        } else {
+            draw_progress_locked();  // Draw only the progress bar
+        }
+        gRedrawScreen = gRedrawProgress = 0;
+        gr_flip();
+        gettimeofday(&last, NULL);
+
+        if (gKeyTakenPending) {
+            gKeyTakenPending = 0;
+            long ms = (last.tv_sec - gKeyTaken.tv_sec) * 1000 +
+                    (last.tv_usec - gKeyTaken.tv_usec) / 1000;
+            if (ms >= 0 && ms < LATENCY_MAX_MS) {
+                gLatencyTotalMs += ms;
+                if (ms > gLatencyMaxMs) gLatencyMaxMs = ms;
+                if (++gLatencyCount == LATENCY_REPORT_KEYS) {
+                    LOGI("input latency over %d keys: avg %ld ms, max %ld ms\n",
+                         gLatencyCount, gLatencyTotalMs / gLatencyCount,
+                         gLatencyMaxMs);
+                    gLatencyCount = 0;
+                    gLatencyTotalMs = gLatencyMaxMs = 0;
+                }
+            }
+        }
     }
-    gr_flip();
+    return NULL;
+}
+
+// Whether progress_thread has anything to animate.
+// Should only be called with gUpdateMutex locked.
+static int progress_timer_active_locked(void)
+{
+    // skip the animation if we have a text overlay (too expensive to update)
+    if (gProgressBarType == PROGRESSBAR_TYPE_INDETERMINATE) return !show_text;
+    return gProgressBarType == PROGRESSBAR_TYPE_NORMAL &&
+            gProgressScopeDuration > 0 && gProgress < 1.0;
 }
 
 // Keeps the progress bar updated, even when the process is otherwise busy.
 static void *progress_thread(void *cookie)
 {
+    pthread_mutex_lock(&gUpdateMutex);
     for (;;) {
+        // Sleep until there's an animation or timed scope to run; every
+        // change to them goes through update_screen_locked() or
+        // update_progress_locked(), which wake us.
+        if (!progress_timer_active_locked()) {
+            pthread_cond_wait(&gProgressCond, &gUpdateMutex);
+            continue;
+        }
+
+        pthread_mutex_unlock(&gUpdateMutex);
         usleep(1000000 / PROGRESSBAR_INDETERMINATE_FPS);
         pthread_mutex_lock(&gUpdateMutex);
 
@@ -276,8 +409,6 @@ static void *progress_thread(void *cookie)
                 update_progress_locked();
             }
         }
-
-        pthread_mutex_unlock(&gUpdateMutex);
     }
     return NULL;
 }
@@ -331,6 +462,7 @@ static void *input_thread(void *cookie)
         fake_key = 0;
         const int queue_max = sizeof(key_queue) / sizeof(key_queue[0]);
         if (ev.value > 0 && key_queue_len < queue_max) {
+            key_queue_time[key_queue_len] = ev.time;
             key_queue[key_queue_len++] = ev.code;
             pthread_cond_signal(&key_queue_cond);
         }
@@ -346,6 +478,14 @@ static void *input_thread(void *cookie)
             pthread_mutex_unlock(&gUpdateMutex);
         }
 
+        // Alt+T: toggle the phase status line
+        if (alt && ev.code == KEY_T && ev.value > 0) {
+            pthread_mutex_lock(&gUpdateMutex);
+            gShowPhase = !gShowPhase;
+            update_screen_locked();
+            pthread_mutex_unlock(&gUpdateMutex);
+        }
+
         // Green+Menu+Red: reboot immediately
         if (ev.code == KEY_DREAM_RED &&
             key_pressed[KEY_DREAM_MENU] &&
@@ -370,22 +510,15 @@ void ui_init(void)
     text_cols = gr_fb_width() / CHAR_WIDTH;
     if (text_cols > MAX_COLS - 1) text_cols = MAX_COLS - 1;
 
-    int i;
-    for (i = 0; BITMAPS[i].name != NULL; ++i) {
-        int result = res_create_surface(BITMAPS[i].name, BITMAPS[i].surface);
-        if (result < 0) {
-            LOGE("Missing bitmap %s\n(Code %d)\n", BITMAPS[i].name, result);
-            *BITMAPS[i].surface = NULL;
-        }
-    }
-
     pthread_t t;
+    pthread_create(&t, NULL, render_thread, NULL);
     pthread_create(&t, NULL, progress_thread, NULL);
     pthread_create(&t, NULL, input_thread, NULL);
 }
 
 char *ui_copy_image(int icon, int *width, int *height, int *bpp) {
     pthread_mutex_lock(&gUpdateMutex);
+    load_bitmaps_locked();
     draw_background_locked(gBackgroundIcon[icon]);
     *width = gr_fb_width();
     *height = gr_fb_height();
@@ -404,6 +537,7 @@ char *ui_copy_image(int icon, int *width, int *height, int *bpp) {
 void ui_set_background(int icon)
 {
     pthread_mutex_lock(&gUpdateMutex);
+    load_bitmaps_locked();
     gCurrentIcon = gBackgroundIcon[icon];
     update_screen_locked();
     pthread_mutex_unlock(&gUpdateMutex);
@@ -439,6 +573,7 @@ void ui_set_progress(float fraction)
     if (fraction > 1.0) fraction = 1.0;
     if (gProgressBarType == PROGRESSBAR_TYPE_NORMAL && fraction > gProgress) {
         // Skip updates that aren't visibly different.
+        load_bitmaps_locked();
         int width = gr_get_width(gProgressBarIndeterminate[0]);
         float scale = width * gProgressScopeSize;
         if ((int) (gProgress * scale) != (int) (fraction * scale)) {
@@ -460,6 +595,24 @@ void ui_reset_progress()
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
+void ui_show_phase(const PhaseStatus* status)
+{
+    char line[MAX_COLS];
+    if (status->ended) {
+        line[0] = '\0';
+    } else {
+        mzFormatPhaseStatus(status, line, sizeof(line));
+    }
+
+    pthread_mutex_lock(&gUpdateMutex);
+    if (text_cols > 0 && text_cols < (int) sizeof(line)) line[text_cols] = '\0';
+    if (strcmp(line, gPhaseLine) != 0) {
+        strcpy(gPhaseLine, line);
+        if (gShowPhase) update_screen_locked();
+    }
+    pthread_mutex_unlock(&gUpdateMutex);
+}
+
 void ui_print(const char *fmt, ...)
 {
     char buf[256];
@@ -540,6 +693,19 @@ int ui_menu_select(int sel) {
     return sel;
 }
 
+void ui_set_menu_item(int item, const char* text) {
+    pthread_mutex_lock(&gUpdateMutex);
+    if (show_menu > 0 && item >= 0 && item < menu_items) {
+        char* row = menu[menu_top + item];
+        if (strncmp(row, text, text_cols-1) != 0) {
+            strncpy(row, text, text_cols-1);
+            row[text_cols-1] = '\0';
+            update_screen_locked();
+        }
+    }
+    pthread_mutex_unlock(&gUpdateMutex);
+}
+
 void ui_end_menu() {
     int i;
     pthread_mutex_lock(&gUpdateMutex);
@@ -558,6 +724,28 @@ int ui_text_visible()
     return visible;
 }
 
+// Should only be called with key_queue_mutex locked and a key queued.
+static int dequeue_key_locked(struct timeval *pressed)
+{
+    int key = key_queue[0];
+    *pressed = key_queue_time[0];
+    --key_queue_len;
+    memmove(&key_queue[0], &key_queue[1], sizeof(int) * key_queue_len);
+    memmove(&key_queue_time[0], &key_queue_time[1],
+            sizeof(struct timeval) * key_queue_len);
+    return key;
+}
+
+// Start timing until the screen next changes, from when the key was
+// pressed.
+static void note_key_taken(const struct timeval *pressed)
+{
+    pthread_mutex_lock(&gUpdateMutex);
+    gKeyTaken = *pressed;
+    gKeyTakenPending = 1;
+    pthread_mutex_unlock(&gUpdateMutex);
+}
+
 int ui_wait_key()
 {
     pthread_mutex_lock(&key_queue_mutex);
@@ -565,9 +753,10 @@ int ui_wait_key()
         pthread_cond_wait(&key_queue_cond, &key_queue_mutex);
     }
 
-    int key = key_queue[0];
-    memcpy(&key_queue[0], &key_queue[1], sizeof(int) * --key_queue_len);
+    struct timeval pressed;
+    int key = dequeue_key_locked(&pressed);
     pthread_mutex_unlock(&key_queue_mutex);
+    note_key_taken(&pressed);
     return key;
 }
 
@@ -589,9 +778,10 @@ int ui_wait_key_to(int ms)
         }
     }
 
-    int key = key_queue[0];
-    memcpy(&key_queue[0], &key_queue[1], sizeof(int) * --key_queue_len);
+    struct timeval pressed;
+    int key = dequeue_key_locked(&pressed);
     pthread_mutex_unlock(&key_queue_mutex);
+    note_key_taken(&pressed);
     return key;
 }
 
@@ -3,6 +3,8 @@
 LOCAL_PATH := $(call my-dir)
 
 updater_src_files := \
+	checkpoint.c \
+	estimate.c \
 	install.c \
 	updater.c
 
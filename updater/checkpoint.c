@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "minzip/Sha1.h"
+
+// First line of CHECKPOINT_FILE, followed by the digest of the package
+// it's for.  Each checkpoint after that is a line of its own:
+// "<step> <name> <sha1, or -> <size>".
+#define CHECKPOINT_MAGIC "updater-checkpoint 1"
+#define CHECKPOINT_NAME_LEN 32
+
+typedef struct {
+    int step;
+    char name[CHECKPOINT_NAME_LEN];
+    bool has_digest;
+    uint8_t digest[MZ_SHA1_DIGEST_SIZE];
+    long long size;
+} Checkpoint;
+
+// Guards everything below; parallel() branches look up and record
+// steps at the same time.
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+static Checkpoint* checkpoints = NULL;
+static int num_checkpoints = 0;
+static int alloc_checkpoints = 0;
+static int checkpoint_fd = -1;
+static bool resuming = false;
+
+static void ToHex(const uint8_t* digest, char* hex) {
+    static const char digits[] = "0123456789abcdef";
+    int i;
+    for (i = 0; i < MZ_SHA1_DIGEST_SIZE; ++i) {
+        hex[i*2] = digits[digest[i] >> 4];
+        hex[i*2+1] = digits[digest[i] & 0xf];
+    }
+    hex[MZ_SHA1_DIGEST_SIZE*2] = '\0';
+}
+
+static bool FromHex(const char* hex, uint8_t* digest) {
+    int i;
+    if (strlen(hex) != MZ_SHA1_DIGEST_SIZE*2) return false;
+    for (i = 0; i < MZ_SHA1_DIGEST_SIZE*2; ++i) {
+        char c = hex[i];
+        int v = (c >= '0' && c <= '9') ? c - '0' :
+                (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+        if (v < 0) return false;
+        if (i % 2 == 0) {
+            digest[i/2] = v << 4;
+        } else {
+            digest[i/2] |= v;
+        }
+    }
+    return true;
+}
+
+// Identifies the package: its size and time, and the script it runs.
+static void PackageKey(const char* package_path, const char* script,
+                       char* hex) {
+    MzSha1Ctx sha;
+    mzSha1Init(&sha);
+    struct stat st;
+    if (stat(package_path, &st) == 0) {
+        long long id[2] = { st.st_size, st.st_mtime };
+        mzSha1Update(&sha, id, sizeof(id));
+    }
+    mzSha1Update(&sha, script, strlen(script));
+    ToHex(mzSha1Final(&sha), hex);
+}
+
+static const Checkpoint* FindLocked(const char* name, int step) {
+    int i;
+    for (i = 0; i < num_checkpoints; ++i) {
+        if (checkpoints[i].step == step &&
+            strncmp(checkpoints[i].name, name, CHECKPOINT_NAME_LEN-1) == 0) {
+            return &checkpoints[i];
+        }
+    }
+    return NULL;
+}
+
+// A step redone in a later run has a second line; that one counts.
+static void AddCheckpoint(const Checkpoint* c) {
+    Checkpoint* old = (Checkpoint*) FindLocked(c->name, c->step);
+    if (old != NULL) {
+        *old = *c;
+        return;
+    }
+    if (num_checkpoints == alloc_checkpoints) {
+        int n = alloc_checkpoints ? alloc_checkpoints * 2 : 32;
+        Checkpoint* p = realloc(checkpoints, n * sizeof(Checkpoint));
+        if (p == NULL) return;
+        checkpoints = p;
+        alloc_checkpoints = n;
+    }
+    checkpoints[num_checkpoints++] = *c;
+}
+
+// Reads the checkpoints in CHECKPOINT_FILE if they're for key.
+static void LoadCheckpoints(const char* key) {
+    FILE* f = fopen(CHECKPOINT_FILE, "r");
+    if (f == NULL) return;
+    char line[256];
+    char magic[sizeof(line)];
+    if (fgets(line, sizeof(line), f) == NULL ||
+        snprintf(magic, sizeof(magic), "%s %s\n", CHECKPOINT_MAGIC, key) <= 0 ||
+        strcmp(line, magic) != 0) {
+        fprintf(stderr, "checkpoints in %s are for another package\n",
+                CHECKPOINT_FILE);
+        fclose(f);
+        return;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        // A line cut off by the power going is simply dropped.
+        size_t len = strlen(line);
+        if (len == 0 || line[len-1] != '\n') break;
+
+        Checkpoint c;
+        char hex[64];
+        memset(&c, 0, sizeof(c));
+        if (sscanf(line, "%d %31s %63s %lld", &c.step, c.name, hex,
+                   &c.size) != 4) {
+            break;
+        }
+        c.has_digest = strcmp(hex, "-") != 0;
+        if (c.has_digest && !FromHex(hex, c.digest)) break;
+        AddCheckpoint(&c);
+    }
+    fclose(f);
+}
+
+static int FormatCheckpoint(const Checkpoint* c, char* line, size_t len) {
+    char hex[MZ_SHA1_DIGEST_SIZE*2 + 1];
+    if (c->has_digest) {
+        ToHex(c->digest, hex);
+    } else {
+        strcpy(hex, "-");
+    }
+    return snprintf(line, len, "%d %s %s %lld\n",
+                    c->step, c->name, hex, c->size);
+}
+
+// Writes the header and the checkpoints kept so far to a new file,
+// which replaces CHECKPOINT_FILE (so a line left half written by the
+// earlier run doesn't get appended to), and leaves it open.
+static int StartCheckpointFile(const char* key) {
+    char tmp[sizeof(CHECKPOINT_FILE) + 4];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", CHECKPOINT_FILE);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if (fd < 0) return -1;
+
+    char line[256];
+    int n = snprintf(line, sizeof(line), "%s %s\n", CHECKPOINT_MAGIC, key);
+    bool ok = write(fd, line, n) == n;
+    int i;
+    for (i = 0; ok && i < num_checkpoints; ++i) {
+        n = FormatCheckpoint(&checkpoints[i], line, sizeof(line));
+        ok = write(fd, line, n) == n;
+    }
+    if (!ok || fsync(fd) != 0 || rename(tmp, CHECKPOINT_FILE) != 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    return fd;
+}
+
+void CheckpointBegin(const char* package_path, const char* script) {
+    char key[MZ_SHA1_DIGEST_SIZE*2 + 1];
+    PackageKey(package_path, script, key);
+
+    pthread_mutex_lock(&checkpoint_lock);
+    LoadCheckpoints(key);
+    resuming = num_checkpoints > 0;
+    if (resuming) {
+        fprintf(stderr, "resuming: %d steps finished before\n",
+                num_checkpoints);
+    }
+    checkpoint_fd = StartCheckpointFile(key);
+    if (checkpoint_fd < 0) {
+        // The install goes ahead; it just can't be resumed.
+        fprintf(stderr, "can't write %s: %s\n",
+                CHECKPOINT_FILE, strerror(errno));
+    }
+    pthread_mutex_unlock(&checkpoint_lock);
+}
+
+void CheckpointFinish() {
+    pthread_mutex_lock(&checkpoint_lock);
+    if (checkpoint_fd >= 0) close(checkpoint_fd);
+    checkpoint_fd = -1;
+    unlink(CHECKPOINT_FILE);
+    free(checkpoints);
+    checkpoints = NULL;
+    num_checkpoints = alloc_checkpoints = 0;
+    resuming = false;
+    pthread_mutex_unlock(&checkpoint_lock);
+}
+
+bool CheckpointFind(const char* name, int step, uint8_t* digest,
+                    long long* size) {
+    pthread_mutex_lock(&checkpoint_lock);
+    const Checkpoint* c = FindLocked(name, step);
+    bool found = c != NULL && (c->has_digest || digest == NULL);
+    if (found) {
+        if (digest != NULL) memcpy(digest, c->digest, MZ_SHA1_DIGEST_SIZE);
+        if (size != NULL) *size = c->size;
+    } else {
+        // The earlier run never got this far.
+        resuming = false;
+    }
+    pthread_mutex_unlock(&checkpoint_lock);
+    return found;
+}
+
+void CheckpointRedo() {
+    pthread_mutex_lock(&checkpoint_lock);
+    resuming = false;
+    pthread_mutex_unlock(&checkpoint_lock);
+}
+
+bool CheckpointSkipUnchecked(const char* name, int step) {
+    pthread_mutex_lock(&checkpoint_lock);
+    bool skip = resuming && FindLocked(name, step) != NULL;
+    if (!skip) resuming = false;
+    pthread_mutex_unlock(&checkpoint_lock);
+    return skip;
+}
+
+void CheckpointRecord(const char* name, int step, const uint8_t* digest,
+                      long long size) {
+    Checkpoint c;
+    memset(&c, 0, sizeof(c));
+    c.step = step;
+    strncpy(c.name, name, CHECKPOINT_NAME_LEN-1);
+    c.has_digest = digest != NULL;
+    if (digest != NULL) memcpy(c.digest, digest, MZ_SHA1_DIGEST_SIZE);
+    c.size = size;
+    char line[256];
+    int n = FormatCheckpoint(&c, line, sizeof(line));
+
+    pthread_mutex_lock(&checkpoint_lock);
+    if (checkpoint_fd >= 0 &&
+        (write(checkpoint_fd, line, n) != n || fsync(checkpoint_fd) != 0)) {
+        fprintf(stderr, "can't write %s: %s\n",
+                CHECKPOINT_FILE, strerror(errno));
+        close(checkpoint_fd);
+        checkpoint_fd = -1;
+    }
+    pthread_mutex_unlock(&checkpoint_lock);
+}
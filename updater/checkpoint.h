@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_CHECKPOINT_H_
+#define _UPDATER_CHECKPOINT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// An install that's cut short (by a power loss, say) is run again from
+// the top of the script on the next boot.  So that the rerun doesn't
+// redo all the work, the big steps -- extracting files, writing images,
+// formatting -- each append a checkpoint to CHECKPOINT_FILE as they
+// finish: which step it was (the position of its first argument in the
+// script, so branches of a parallel() block don't get mixed up), and a
+// digest of what it wrote.  When the same package runs again, a step
+// whose checkpoint is there and whose output still matches the digest
+// is skipped, the way apply_patch() skips a file that's already
+// patched.
+//
+// Steps whose output can't be checked (format, delete) are skipped
+// only while the rerun is still retracing the earlier run: once any
+// step has to be done again, everything after it is too.
+//
+// Since those steps are trusted blindly, the file is only good for the
+// power-loss case: recovery removes it when an install fails, and before
+// anything else that changes the partitions (a restore, wipe, format or
+// sideload).  See forget_install_checkpoint() in install.h.
+#define CHECKPOINT_FILE "/cache/recovery/updater_checkpoint"
+
+// Load the checkpoints left by an earlier run of this package (the same
+// file and script), or start a fresh set.
+void CheckpointBegin(const char* package_path, const char* script);
+
+// The install succeeded; forget the checkpoints.
+void CheckpointFinish();
+
+// If the step named name at position step finished in the earlier run,
+// returns true with the digest and size it recorded (either may be
+// NULL).  The caller still has to check its output, and call
+// CheckpointRedo() if that doesn't match.
+bool CheckpointFind(const char* name, int step, uint8_t* digest,
+                    long long* size);
+
+// The step being looked at has to be done (again).
+void CheckpointRedo();
+
+// For steps with no output to check: returns true if the step finished
+// in the earlier run and no step before it has been redone.
+bool CheckpointSkipUnchecked(const char* name, int step);
+
+// Note that a step finished, durably, before going on.  digest may be
+// NULL for steps with nothing to check.
+void CheckpointRecord(const char* name, int step, const uint8_t* digest,
+                      long long size);
+
+#endif
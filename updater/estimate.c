@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "estimate.h"
+
+// Kinds of work an install does, each with its own throughput.
+enum {
+    WORK_EXTRACT,       // unpacking package entries to a filesystem
+    WORK_PATCH,         // writing patched files
+    WORK_HASH,          // reading and hashing files to check them
+    WORK_FLASH,         // writing raw images to mtd
+    WORK_KINDS
+};
+
+static const char* kWorkName[WORK_KINDS] = {
+    "extract", "patch", "hash", "flash"
+};
+
+// Rates used when no profile is given, in MB/s -- roughly what a
+// G1-class device with a slow sdcard manages.
+static const double kDefaultRate[WORK_KINDS] = { 4.0, 1.5, 12.0, 2.5 };
+static const double kDefaultFormatSeconds = 3.0;
+
+typedef struct {
+    char name[64];
+    double rate[WORK_KINDS];    // MB/s
+    double format_seconds;      // per format() call
+} ThroughputProfile;
+
+// A file the script puts somewhere with package_extract_file(), so a
+// later write_raw_image() of it can be sized.
+typedef struct Staged {
+    char* path;
+    long size;
+    struct Staged* next;
+} Staged;
+
+typedef struct {
+    ZipArchive* za;
+    long long bytes[WORK_KINDS];
+    int items[WORK_KINDS];
+    int formats;
+    int unsized;        // calls whose data size couldn't be worked out
+    int computed;       // calls whose arguments aren't known until run time
+    int missing;        // package entries the script names that aren't there
+    Staged* staged;
+} Estimate;
+
+// The value of argument i of e, if there is one and it doesn't depend
+// on anything the device would work out at install time.
+static const char* LiteralArg(const Expr* e, int i) {
+    if (i >= e->argc || e->argv[i]->fn != Literal) return NULL;
+    return e->argv[i]->name;
+}
+
+static void Add(Estimate* est, int kind, long long bytes) {
+    est->bytes[kind] += bytes;
+    ++est->items[kind];
+}
+
+// Size of the package entry named, or -1 if it isn't there.
+static long EntrySize(Estimate* est, const char* name) {
+    const ZipEntry* entry = mzFindZipEntry(est->za, name);
+    if (entry == NULL) {
+        fprintf(stderr, "estimate: no %s in package\n", name);
+        ++est->missing;
+        return -1;
+    }
+    return mzGetZipEntryUncompLen(entry);
+}
+
+static void ExtractDir(Estimate* est, const char* zip_path) {
+    int len = strlen(zip_path);
+    char* prefix = malloc(len + 2);
+    strcpy(prefix, zip_path);
+    if (len > 0 && prefix[len-1] != '/') strcat(prefix, "/");
+
+    unsigned int first;
+    unsigned int count = mzFindZipEntriesWithPrefix(est->za, prefix, &first);
+    unsigned int i;
+    for (i = 0; i < count; ++i) {
+        const ZipEntry* entry = mzGetZipEntryAt(est->za, first + i);
+        UnterminatedString name = mzGetZipEntryFileName(entry);
+        if (name.len > 0 && name.str[name.len-1] == '/') continue;
+        Add(est, WORK_EXTRACT, mzGetZipEntryUncompLen(entry));
+    }
+    free(prefix);
+}
+
+static void ExtractFile(Estimate* est, const char* zip_path,
+                        const char* dest_path) {
+    long size = EntrySize(est, zip_path);
+    if (size < 0) return;
+    Add(est, WORK_EXTRACT, size);
+    if (dest_path != NULL) {
+        Staged* s = malloc(sizeof(Staged));
+        s->path = strdup(dest_path);
+        s->size = size;
+        s->next = est->staged;
+        est->staged = s;
+    }
+}
+
+// write_raw_image() takes a package entry or a file, which is usually
+// one the script extracted earlier.
+static void Flash(Estimate* est, const char* filename) {
+    long size = -1;
+    if (filename[0] == '/') {
+        Staged* s;
+        for (s = est->staged; s != NULL; s = s->next) {
+            if (strcmp(s->path, filename) == 0) {
+                size = s->size;
+                break;
+            }
+        }
+        if (size < 0) ++est->unsized;
+    } else {
+        size = EntrySize(est, filename);
+    }
+    Add(est, WORK_FLASH, size < 0 ? 0 : size);
+}
+
+// Files given as "MTD:<partition>:<size>:<sha1>:..." carry their sizes;
+// count the largest.  Anything else is on the device and can't be sized.
+static void Check(Estimate* est, const char* filename) {
+    long size = -1;
+    if (strncmp(filename, "MTD:", 4) == 0) {
+        char* copy = strdup(filename);
+        char* save;
+        char* tok = strtok_r(copy + 4, ":", &save);      // partition
+        int i;
+        for (i = 0; (tok = strtok_r(NULL, ":", &save)) != NULL; ++i) {
+            if (i % 2 == 0) {
+                long s = strtol(tok, NULL, 10);
+                if (s > size) size = s;
+            }
+        }
+        free(copy);
+    }
+    if (size < 0) ++est->unsized;
+    Add(est, WORK_HASH, size < 0 ? 0 : size);
+}
+
+static void Visit(Estimate* est, const Expr* e) {
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        Visit(est, e->argv[i]);
+    }
+    if (e->fn == Literal) return;
+
+    const char* name = e->name;
+    const char* arg0 = LiteralArg(e, 0);
+    if (strcmp(name, "package_extract_dir") == 0) {
+        if (arg0 == NULL) { ++est->computed; return; }
+        ExtractDir(est, arg0);
+    } else if (strcmp(name, "package_extract_file") == 0) {
+        if (arg0 == NULL) { ++est->computed; return; }
+        ExtractFile(est, arg0, LiteralArg(e, 1));
+    } else if (strcmp(name, "write_raw_image") == 0 ||
+               strcmp(name, "write_firmware_image") == 0) {
+        if (arg0 == NULL) { ++est->computed; return; }
+        Flash(est, arg0);
+    } else if (strcmp(name, "apply_patch") == 0) {
+        // apply_patch(src, tgt, tgt_sha1, tgt_size, sha1:patch, ...)
+        // reads and hashes the source, then writes the target; the
+        // source is taken to be about the size of the target.
+        const char* size = LiteralArg(e, 3);
+        if (size == NULL) { ++est->computed; return; }
+        long long bytes = strtoll(size, NULL, 10);
+        Add(est, WORK_HASH, bytes);
+        Add(est, WORK_PATCH, bytes);
+    } else if (strcmp(name, "apply_patch_check") == 0) {
+        if (arg0 == NULL) { ++est->computed; return; }
+        Check(est, arg0);
+    } else if (strcmp(name, "apply_patch_check_batch") == 0) {
+        for (i = 0; i < e->argc; i += 2) {
+            const char* file = LiteralArg(e, i);
+            if (file == NULL) {
+                ++est->computed;
+            } else {
+                Check(est, file);
+            }
+        }
+    } else if (strcmp(name, "format") == 0) {
+        ++est->formats;
+    }
+}
+
+static void DefaultProfile(ThroughputProfile* p) {
+    strcpy(p->name, "default");
+    memcpy(p->rate, kDefaultRate, sizeof(p->rate));
+    p->format_seconds = kDefaultFormatSeconds;
+}
+
+// A profile is a text file of "<kind> <value>" lines: a rate in MB/s for
+// each of extract, patch, hash and flash, "format" with the seconds one
+// format() takes, and "name" with the device class it describes.  Kinds
+// it leaves out keep the built-in values.  '#' starts a comment.
+static int LoadProfile(const char* filename, ThroughputProfile* p) {
+    FILE* f = fopen(filename, "r");
+    if (f == NULL) {
+        fprintf(stderr, "can't open profile %s: %s\n",
+                filename, strerror(errno));
+        return -1;
+    }
+    DefaultProfile(p);
+    const char* base = strrchr(filename, '/');
+    snprintf(p->name, sizeof(p->name), "%s", base ? base+1 : filename);
+
+    char line[256];
+    int lineno = 0;
+    int result = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        ++lineno;
+        char* hash = strchr(line, '#');
+        if (hash != NULL) *hash = '\0';
+
+        char key[32];
+        char value[64];
+        int n = sscanf(line, "%31s %63s", key, value);
+        if (n <= 0) continue;
+        if (n == 1) {
+            fprintf(stderr, "%s:%d: no value for %s\n", filename, lineno, key);
+            result = -1;
+            continue;
+        }
+        if (strcmp(key, "name") == 0) {
+            snprintf(p->name, sizeof(p->name), "%s", value);
+            continue;
+        }
+
+        char* end;
+        double v = strtod(value, &end);
+        if (*end != '\0' || v <= 0) {
+            fprintf(stderr, "%s:%d: bad value \"%s\"\n",
+                    filename, lineno, value);
+            result = -1;
+            continue;
+        }
+        if (strcmp(key, "format") == 0) {
+            p->format_seconds = v;
+            continue;
+        }
+        int kind;
+        for (kind = 0; kind < WORK_KINDS; ++kind) {
+            if (strcmp(key, kWorkName[kind]) == 0) break;
+        }
+        if (kind == WORK_KINDS) {
+            fprintf(stderr, "%s:%d: unknown kind \"%s\"\n",
+                    filename, lineno, key);
+            result = -1;
+            continue;
+        }
+        p->rate[kind] = v;
+    }
+    fclose(f);
+    return result;
+}
+
+static void PrintEstimate(const Estimate* est, const ThroughputProfile* p) {
+    double seconds = est->formats * p->format_seconds;
+    int kind;
+    for (kind = 0; kind < WORK_KINDS; ++kind) {
+        seconds += est->bytes[kind] / 1048576.0 / p->rate[kind];
+    }
+    int s = (int)(seconds + 0.5);
+    printf("%-20s about %dm %02ds\n", p->name, s / 60, s % 60);
+}
+
+int EstimateInstall(Expr* root, ZipArchive* za,
+                    int num_profiles, char** profiles) {
+    Estimate est;
+    memset(&est, 0, sizeof(est));
+    est.za = za;
+    Visit(&est, root);
+
+    int kind;
+    for (kind = 0; kind < WORK_KINDS; ++kind) {
+        printf("%-8s %10.1f MB in %d %s\n", kWorkName[kind],
+               est.bytes[kind] / 1048576.0, est.items[kind],
+               kind == WORK_HASH ? "checks" : "files");
+    }
+    printf("%-8s %10d partitions\n", "format", est.formats);
+    if (est.unsized > 0) {
+        printf("%d files on the device couldn't be sized\n", est.unsized);
+    }
+    if (est.computed > 0) {
+        printf("%d calls have arguments only known at install time\n",
+               est.computed);
+    }
+    if (est.missing > 0) {
+        printf("%d entries named by the script are missing\n", est.missing);
+    }
+    printf("\n");
+
+    int result = est.missing > 0 ? 1 : 0;
+    ThroughputProfile p;
+    if (num_profiles == 0) {
+        DefaultProfile(&p);
+        PrintEstimate(&est, &p);
+    }
+    int i;
+    for (i = 0; i < num_profiles; ++i) {
+        if (LoadProfile(profiles[i], &p) < 0) {
+            result = 1;
+            continue;
+        }
+        PrintEstimate(&est, &p);
+    }
+
+    while (est.staged != NULL) {
+        Staged* next = est.staged->next;
+        free(est.staged->path);
+        free(est.staged);
+        est.staged = next;
+    }
+    return result;
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_ESTIMATE_H_
+#define _UPDATER_ESTIMATE_H_
+
+#include "edify/expr.h"
+#include "minzip/Zip.h"
+
+// Add up the work the parsed script in root would do -- bytes extracted
+// from za, patched, hashed and flashed, and partitions formatted --
+// without running any of it, and print that with an estimate of the
+// install time for each of the throughput profiles named (or for
+// built-in rates if there are none).  Both sides of every ifelse() are
+// counted, so the totals are an upper bound.  Returns 0 on success.
+int EstimateInstall(Expr* root, ZipArchive* za,
+                    int num_profiles, char** profiles);
+
+#endif
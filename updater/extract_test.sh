@@ -0,0 +1,75 @@
+#!/bin/bash
+#
+# A script for testing that package_extract_file() leaves nothing behind
+# when an entry fails its deferred digest check.  It builds (on the host)
+# a package whose payload doesn't match the digest recovery would have
+# passed down, runs the updater on it on the device, and checks that
+# neither the destination nor a temporary file is left.  Build updater
+# first (it's an eng module).
+
+# where on the device to do all the work.
+WORK_DIR=/data/local/tmp/extract_test
+
+ADB="adb -d "
+
+# ------------------------
+
+echo "waiting to connect to device"
+$ADB wait-for-device
+
+# run a command on the device; exit with the exit status of the device
+# command.
+run_command() {
+  $ADB shell "$@" \; echo \$? | awk '{if (b) {print a}; a=$0; b=1} END {exit a}'
+}
+
+tmpdir=$(mktemp -d)
+
+script=META-INF/com/google/android/updater-script
+mkdir -p $tmpdir/pkg/$(dirname $script)
+cat > $tmpdir/pkg/$script <<EOF
+package_extract_file("payload", "$WORK_DIR/out") || abort("extract failed");
+EOF
+head -c 65536 /dev/urandom > $tmpdir/pkg/payload
+(cd $tmpdir/pkg && zip -qr $tmpdir/package.zip .)
+
+# The script's digest is right; the payload's is that of other data, as
+# if the entry had been changed after the manifest was checked.
+echo "$(sha1sum < $tmpdir/pkg/$script | cut -d' ' -f1) $script" \
+    > $tmpdir/digests
+echo "$(echo tampered | sha1sum | cut -d' ' -f1) payload" >> $tmpdir/digests
+
+run_command rm -r $WORK_DIR
+run_command mkdir -p $WORK_DIR
+$ADB push $ANDROID_PRODUCT_OUT/system/bin/updater $WORK_DIR/updater
+$ADB push $tmpdir/package.zip $WORK_DIR/package.zip
+$ADB push $tmpdir/digests $WORK_DIR/digests
+
+fail=0
+if run_command UPDATE_PACKAGE_DIGESTS=$WORK_DIR/digests \
+    $WORK_DIR/updater 3 1 $WORK_DIR/package.zip; then
+  echo "updater succeeded on a tampered entry"
+  fail=1
+fi
+if run_command ls $WORK_DIR/out; then
+  echo "tampered entry left at $WORK_DIR/out"
+  fail=1
+fi
+if run_command ls $WORK_DIR/out.extract; then
+  echo "temporary file left at $WORK_DIR/out.extract"
+  fail=1
+fi
+
+run_command rm -r $WORK_DIR
+rm -rf $tmpdir
+
+if [ $fail == 0 ]; then
+  echo
+  echo PASS
+  echo
+else
+  echo
+  echo FAIL
+  echo
+  exit 1
+fi
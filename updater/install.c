@@ -16,6 +16,10 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,15 +29,25 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "checkpoint.h"
 #include "cutils/misc.h"
 #include "cutils/properties.h"
 #include "edify/expr.h"
 #include "minzip/DirUtil.h"
+#include "minzip/Sha1.h"
+#include "minzip/Throughput.h"
 #include "mtdutils/mounts.h"
 #include "mtdutils/mtdutils.h"
+#include "mtdutils/yaffs2.h"
 #include "updater.h"
+#include "zlib.h"
 
 
+// scan_mounted_volumes() rebuilds a single global table, freeing the
+// strings find_mounted_volume_by_*() handed out; parallel() branches
+// hold this from the scan until they're done with the volume.
+static pthread_mutex_t mounts_lock = PTHREAD_MUTEX_INITIALIZER;
+
 // mount(type, location, mount_point)
 //
 //   what:  type="MTD"   location="<partition>"            to mount a yaffs2 filesystem
@@ -114,6 +128,7 @@ char* IsMountedFn(const char* name, State* state, int argc, Expr* argv[]) {
         goto done;
     }
 
+    pthread_mutex_lock(&mounts_lock);
     scan_mounted_volumes();
     const MountedVolume* vol = find_mounted_volume_by_mount_point(mount_point);
     if (vol == NULL) {
@@ -121,6 +136,7 @@ char* IsMountedFn(const char* name, State* state, int argc, Expr* argv[]) {
     } else {
         result = mount_point;
     }
+    pthread_mutex_unlock(&mounts_lock);
 
 done:
     if (result != mount_point) free(mount_point);
@@ -142,6 +158,9 @@ char* UnmountFn(const char* name, State* state, int argc, Expr* argv[]) {
         goto done;
     }
 
+    // A tree delete_recursive() is still removing would keep it busy.
+    dirUnlinkWaitAway();
+    pthread_mutex_lock(&mounts_lock);
     scan_mounted_volumes();
     const MountedVolume* vol = find_mounted_volume_by_mount_point(mount_point);
     if (vol == NULL) {
@@ -151,6 +170,7 @@ char* UnmountFn(const char* name, State* state, int argc, Expr* argv[]) {
         unmount_mounted_volume(vol);
         result = mount_point;
     }
+    pthread_mutex_unlock(&mounts_lock);
 
 done:
     if (result != mount_point) free(mount_point);
@@ -181,7 +201,15 @@ char* FormatFn(const char* name, State* state, int argc, Expr* argv[]) {
         goto done;
     }
 
+    int step = argv[0]->start;
+    if (CheckpointSkipUnchecked(name, step)) {
+        fprintf(stderr, "%s: \"%s\" was formatted before\n", name, location);
+        result = location;
+        goto done;
+    }
+
     if (strcmp(type, "MTD") == 0) {
+        dirUnlinkWaitAway();
         mtd_scan_partitions();
         const MtdPartition* mtd = mtd_find_partition_by_name(location);
         if (mtd == NULL) {
@@ -207,6 +235,7 @@ char* FormatFn(const char* name, State* state, int argc, Expr* argv[]) {
             result = strdup("");
             goto done;
         }
+        CheckpointRecord(name, step, NULL, 0);
         result = location;
     } else {
         fprintf(stderr, "%s: unsupported type \"%s\"", name, type);
@@ -219,6 +248,12 @@ done:
 }
 
 
+// delete(path, ...), delete_recursive(path, ...)
+// delete_recursive_background(path, ...)
+//
+// The last renames each tree out of the way and removes it while the
+// script carries on; the filesystem must have room for the old tree
+// and whatever is written next, until it's unmounted or formatted.
 char* DeleteFn(const char* name, State* state, int argc, Expr* argv[]) {
     char** paths = malloc(argc * sizeof(char*));
     int i;
@@ -234,15 +269,42 @@ char* DeleteFn(const char* name, State* state, int argc, Expr* argv[]) {
         }
     }
 
-    bool recursive = (strcmp(name, "delete_recursive") == 0);
+    bool recursive = (strcmp(name, "delete") != 0);
+    // Only on request: until the background removal is done the old
+    // tree's blocks are still allocated, which a nearly full partition
+    // can't spare while its replacement is being extracted.
+    int unlink_flags = (strcmp(name, "delete_recursive_background") == 0) ?
+            DIR_UNLINK_RENAME_AWAY : 0;
 
+    // A rerun mustn't delete what later steps have put back; the
+    // checkpoint keeps the count this returned the first time.
     int success = 0;
+    long long earlier;
+    int step = argc > 0 ? argv[0]->start : -1;
+    if (argc > 0 && CheckpointSkipUnchecked(name, step) &&
+        CheckpointFind(name, step, NULL, &earlier)) {
+        for (i = 0; i < argc; ++i) free(paths[i]);
+        argc = 0;
+        success = earlier;
+    }
     for (i = 0; i < argc; ++i) {
-        if ((recursive ? dirUnlinkHierarchy(paths[i]) : unlink(paths[i])) == 0)
+        if (recursive) {
+            DirUnlinkStats stats;
+            if (dirUnlinkHierarchyEx(paths[i], unlink_flags, &stats) == 0) {
+                ++success;
+                fprintf(stderr, "removed %lu entries under %s in %ld ms\n",
+                        stats.removed, paths[i], stats.elapsedMs);
+            }
+        } else if (unlink(paths[i]) == 0) {
             ++success;
+        }
         free(paths[i]);
     }
     free(paths);
+    if (argc > 0) {
+        sync();
+        CheckpointRecord(name, step, NULL, success);
+    }
 
     char buffer[10];
     sprintf(buffer, "%d", success);
@@ -264,7 +326,10 @@ char* ShowProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
     int sec = strtol(sec_str, NULL, 10);
 
     UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
-    fprintf(ui->cmd_pipe, "progress %f %d\n", frac, sec);
+    pthread_mutex_lock(&ui->output_lock);
+    ui->progress = 0.0;
+    SendProgress(ui, frac, sec);
+    pthread_mutex_unlock(&ui->output_lock);
 
     free(sec_str);
     return frac_str;
@@ -281,12 +346,143 @@ char* SetProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     double frac = strtod(frac_str, NULL);
 
+    // Branches of a parallel() block each report their own progress;
+    // only let the bar move forward so it doesn't jump back and forth.
     UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
-    fprintf(ui->cmd_pipe, "set_progress %f\n", frac);
+    pthread_mutex_lock(&ui->output_lock);
+    if (ui->parallel == 0 || frac > ui->progress) {
+        ui->progress = frac;
+        SendSetProgress(ui, frac);
+    }
+    pthread_mutex_unlock(&ui->output_lock);
 
     return frac_str;
 }
 
+// Bytes package_extract_dir() will write for zip_path.
+static long long ExtractDirSize(ZipArchive* za, const char* zip_path) {
+    int len = strlen(zip_path);
+    char* prefix = malloc(len + 2);
+    strcpy(prefix, zip_path);
+    if (len > 0 && prefix[len-1] != '/') strcat(prefix, "/");
+
+    unsigned int first;
+    unsigned int count = mzFindZipEntriesWithPrefix(za, prefix, &first);
+    long long total = 0;
+    unsigned int i;
+    for (i = 0; i < count; ++i) {
+        total += mzGetZipEntryUncompLen(mzGetZipEntryAt(za, first + i));
+    }
+    free(prefix);
+    return total;
+}
+
+// Adds an extracted file to the digest a checkpoint keeps for it: its
+// path, size and CRC-32.  With read_back the size and CRC are read from
+// the file as it is now rather than taken from the package, which is
+// how a rerun checks that the file came through intact.
+static bool AddExtractedDigest(MzSha1Ctx* sha, const ZipEntry* entry,
+                               const char* path, bool read_back,
+                               unsigned char* buffer, size_t buffer_size) {
+    uint32_t crc = entry->crc32;
+    long long size = mzGetZipEntryUncompLen(entry);
+    if (read_back) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return false;
+        crc = crc32(0L, Z_NULL, 0);
+        size = 0;
+        ssize_t r;
+        while ((r = read(fd, buffer, buffer_size)) > 0) {
+            crc = crc32(crc, buffer, r);
+            size += r;
+            mzPhaseAdd(r);
+        }
+        close(fd);
+        if (r < 0) return false;
+    }
+    unsigned char fields[12];
+    int i;
+    for (i = 0; i < 4; ++i) fields[i] = crc >> (i * 8);
+    for (i = 0; i < 8; ++i) fields[4 + i] = size >> (i * 8);
+    mzSha1Update(sha, path, strlen(path) + 1);
+    mzSha1Update(sha, fields, sizeof(fields));
+    return true;
+}
+
+#define EXTRACT_CHECK_BUFFER (64 * 1024)
+
+// The checkpoint digest of what package_extract_dir(zip_path, dest_path)
+// writes; see AddExtractedDigest().
+static bool ExtractDirDigest(ZipArchive* za, const char* zip_path,
+                             const char* dest_path, bool read_back,
+                             uint8_t* digest) {
+    int len = strlen(zip_path);
+    char* prefix = malloc(len + 2);
+    strcpy(prefix, zip_path);
+    if (len > 0 && prefix[len-1] != '/') strcat(prefix, "/");
+    size_t prefix_len = strlen(prefix);
+    const char* slash =
+        dest_path[0] != '\0' && dest_path[strlen(dest_path)-1] == '/' ?
+        "" : "/";
+
+    unsigned char* buffer = read_back ? malloc(EXTRACT_CHECK_BUFFER) : NULL;
+    bool ok = !read_back || buffer != NULL;
+    MzSha1Ctx sha;
+    mzSha1Init(&sha);
+    unsigned int first;
+    unsigned int count = mzFindZipEntriesWithPrefix(za, prefix, &first);
+    unsigned int i;
+    for (i = 0; ok && i < count; ++i) {
+        const ZipEntry* entry = mzGetZipEntryAt(za, first + i);
+        UnterminatedString fn = mzGetZipEntryFileName(entry);
+        if (fn.len == 0 || fn.str[fn.len-1] == '/') continue;  // directory
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%s%.*s", dest_path, slash,
+                 (int)(fn.len - prefix_len), fn.str + prefix_len);
+        ok = AddExtractedDigest(&sha, entry, path, read_back,
+                                buffer, EXTRACT_CHECK_BUFFER);
+    }
+    if (ok) memcpy(digest, mzSha1Final(&sha), MZ_SHA1_DIGEST_SIZE);
+    free(buffer);
+    free(prefix);
+    return ok;
+}
+
+// If the checkpoint for this extract step is there, checks the files
+// it wrote against it.  Returns true if the step needn't be done again.
+static bool AlreadyExtracted(const char* name, int step,
+                             ZipArchive* za, const char* zip_path,
+                             const ZipEntry* entry, const char* dest_path) {
+    uint8_t recorded[MZ_SHA1_DIGEST_SIZE], actual[MZ_SHA1_DIGEST_SIZE];
+    long long size;
+    if (!CheckpointFind(name, step, recorded, &size)) return false;
+
+    bool ok;
+    mzPhaseBegin("check", size);
+    if (entry != NULL) {
+        unsigned char* buffer = malloc(EXTRACT_CHECK_BUFFER);
+        MzSha1Ctx sha;
+        mzSha1Init(&sha);
+        ok = buffer != NULL &&
+             AddExtractedDigest(&sha, entry, dest_path, true,
+                                buffer, EXTRACT_CHECK_BUFFER);
+        if (ok) memcpy(actual, mzSha1Final(&sha), MZ_SHA1_DIGEST_SIZE);
+        free(buffer);
+    } else {
+        ok = ExtractDirDigest(za, zip_path, dest_path, true, actual);
+    }
+    mzPhaseEnd();
+    if (ok && memcmp(actual, recorded, MZ_SHA1_DIGEST_SIZE) == 0) {
+        fprintf(stderr, "%s: %s was extracted to %s before\n",
+                name, zip_path, dest_path);
+        return true;
+    }
+    fprintf(stderr, "%s: %s has changed since it was extracted; "
+            "extracting it again\n", name, dest_path);
+    CheckpointRedo();
+    return false;
+}
+
 // package_extract_dir(package_path, destination_path)
 char* PackageExtractDirFn(const char* name, State* state,
                           int argc, Expr* argv[]) {
@@ -298,13 +494,29 @@ char* PackageExtractDirFn(const char* name, State* state,
     if (ReadArgs(state, argv, 2, &zip_path, &dest_path) < 0) return NULL;
 
     ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+    int step = argv[0]->start;
+    if (AlreadyExtracted(name, step, za, zip_path, NULL, dest_path)) {
+        free(zip_path);
+        free(dest_path);
+        return strdup("t");
+    }
 
     // To create a consistent system image, never use the clock for timestamps.
     struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
 
+    long long size = ExtractDirSize(za, zip_path);
+    mzPhaseBegin("extract", size);
     bool success = mzExtractRecursive(za, zip_path, dest_path,
-                                      MZ_EXTRACT_FILES_ONLY, &timestamp,
+                                      MZ_EXTRACT_FILES_ONLY |
+                                      MZ_EXTRACT_PARALLEL |
+                                      MZ_EXTRACT_DEFER_METADATA |
+                                      MZ_EXTRACT_DEDUP, &timestamp,
                                       NULL, NULL);
+    mzPhaseEnd();
+    uint8_t digest[MZ_SHA1_DIGEST_SIZE];
+    if (success && ExtractDirDigest(za, zip_path, dest_path, false, digest)) {
+        CheckpointRecord(name, step, digest, size);
+    }
     free(zip_path);
     free(dest_path);
     return strdup(success ? "t" : "");
@@ -329,15 +541,47 @@ char* PackageExtractFileFn(const char* name, State* state,
         fprintf(stderr, "%s: no %s in package\n", name, zip_path);
         goto done;
     }
+    int step = argv[0]->start;
+    if (AlreadyExtracted(name, step, za, zip_path, entry, dest_path)) {
+        success = true;
+        goto done;
+    }
 
-    FILE* f = fopen(dest_path, "wb");
+    // With deferred digests the entry is only checked once all of it
+    // has been written, so it goes under a temporary name and replaces
+    // dest_path only if it matched.
+    char* tmp_path = malloc(strlen(dest_path) + 10);
+    if (tmp_path == NULL) {
+        fprintf(stderr, "%s: out of memory\n", name);
+        goto done;
+    }
+    sprintf(tmp_path, "%s.extract", dest_path);
+    FILE* f = fopen(tmp_path, "wb");
     if (f == NULL) {
         fprintf(stderr, "%s: can't open %s for write: %s\n",
-                name, dest_path, strerror(errno));
+                name, tmp_path, strerror(errno));
+        free(tmp_path);
         goto done;
     }
+    mzPhaseBegin("extract", mzGetZipEntryUncompLen(entry));
     success = mzExtractZipEntryToFile(za, entry, fileno(f));
-    fclose(f);
+    mzPhaseEnd();
+    if (fclose(f) != 0) success = false;
+    if (success && rename(tmp_path, dest_path) != 0) {
+        fprintf(stderr, "%s: can't rename %s to %s: %s\n",
+                name, tmp_path, dest_path, strerror(errno));
+        success = false;
+    }
+    if (!success) unlink(tmp_path);
+    free(tmp_path);
+    if (success) {
+        ProfileAddBytes(mzGetZipEntryUncompLen(entry));
+        MzSha1Ctx sha;
+        mzSha1Init(&sha);
+        AddExtractedDigest(&sha, entry, dest_path, false, NULL, 0);
+        CheckpointRecord(name, step, mzSha1Final(&sha),
+                         mzGetZipEntryUncompLen(entry));
+    }
 
   done:
     free(zip_path);
@@ -422,10 +666,16 @@ char* SetPermFn(const char* name, State* state, int argc, Expr* argv[]) {
             goto done;
         }
 
-        for (i = 3; i < argc; ++i) {
-            chown(args[i], uid, gid);
-            chmod(args[i], mode);
+        int count = argc - 3;
+        DirPermsEntry* entries = malloc(count * sizeof(DirPermsEntry));
+        for (i = 0; i < count; ++i) {
+            entries[i].path = args[i+3];
+            entries[i].uid = uid;
+            entries[i].gid = gid;
+            entries[i].mode = mode;
         }
+        dirSetPermissionsBatch(entries, count);
+        free(entries);
     }
     result = strdup("");
 
@@ -439,6 +689,125 @@ done:
 }
 
 
+// Reads a permission table (see set_perm_table()) from the package.
+// The entries' paths point into *buffer; the caller frees both it and
+// *entries, even on failure.  Returns the number of entries, or -1
+// after an ErrorAbort().
+static int ReadPermTable(State* state, const char* name, const char* zip_path,
+                         char** buffer, DirPermsEntry** entries) {
+    *buffer = NULL;
+    *entries = NULL;
+
+    ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+    const ZipEntry* entry = mzFindZipEntry(za, zip_path);
+    if (entry == NULL) {
+        ErrorAbort(state, "%s: no %s in package", name, zip_path);
+        return -1;
+    }
+    long len = mzGetZipEntryUncompLen(entry);
+    *buffer = malloc(len + 1);
+    if (*buffer == NULL) {
+        ErrorAbort(state, "%s: failed to alloc %ld bytes", name, len + 1);
+        return -1;
+    }
+    if (!mzReadZipEntry(za, entry, *buffer, len)) {
+        ErrorAbort(state, "%s: failed to read %s", name, zip_path);
+        return -1;
+    }
+    (*buffer)[len] = '\0';
+
+    int count = 0;
+    int size = 0;
+    int line_no = 0;
+    char* line;
+    char* next;
+    for (line = *buffer; line != NULL; line = next) {
+        next = strchr(line, '\n');
+        if (next != NULL) *next++ = '\0';
+        ++line_no;
+        while (*line && isspace(*line)) ++line;
+        if (*line == '\0' || *line == '#') continue;
+
+        // uid, gid and mode, each followed by whitespace, then the path
+        int fields[3];
+        int f;
+        char* end;
+        for (f = 0; f < 3; ++f) {
+            fields[f] = strtoul(line, &end, 0);
+            if (end == line || !isspace(*end)) break;
+            line = end;
+        }
+        while (isspace(*line)) ++line;
+        if (f < 3 || *line == '\0') {
+            ErrorAbort(state, "%s: %s:%d: expected \"<uid> <gid> <mode> <path>\"",
+                       name, zip_path, line_no);
+            return -1;
+        }
+
+        // trim trailing whitespace (eg, a '\r') off the path
+        char* path_end = line + strlen(line) - 1;
+        while (path_end > line && isspace(*path_end)) --path_end;
+        path_end[1] = '\0';
+
+        if (count >= size) {
+            size = size * 2 + 256;
+            DirPermsEntry* grown = realloc(*entries,
+                                           size * sizeof(DirPermsEntry));
+            if (grown == NULL) {
+                ErrorAbort(state, "%s: failed to alloc %d entries",
+                           name, size);
+                return -1;
+            }
+            *entries = grown;
+        }
+        (*entries)[count].path = line;
+        (*entries)[count].uid = fields[0];
+        (*entries)[count].gid = fields[1];
+        (*entries)[count].mode = fields[2];
+        ++count;
+    }
+    return count;
+}
+
+// set_perm_table(package_path)
+//
+// Applies a table of permissions stored in the package, one entry per
+// line:
+//
+//     <uid> <gid> <mode> <path>
+//
+// with blank lines and lines starting with '#' ignored.  This does the
+// same as one set_perm() per line, without an edify call (and a lookup
+// of the full path) for each.
+char* SetPermTableFn(const char* name, State* state, int argc, Expr* argv[]) {
+    if (argc != 1) {
+        return ErrorAbort(state, "%s() expects 1 arg, got %d", name, argc);
+    }
+    char* zip_path;
+    if (ReadArgs(state, argv, 1, &zip_path) < 0) return NULL;
+
+    char* result = NULL;
+    char* buffer;
+    DirPermsEntry* entries;
+    int count = ReadPermTable(state, name, zip_path, &buffer, &entries);
+    if (count < 0) goto done;
+
+    int failed = dirSetPermissionsBatch(entries, count);
+    if (failed) {
+        fprintf(stderr, "%s: couldn't set %d of %d entries (last error: %s)\n",
+                name, failed, count, strerror(errno));
+    }
+    printf("%s: applied %d entries from %s\n", name, count - failed, zip_path);
+    result = strdup("");
+
+  done:
+    free(entries);
+    free(buffer);
+    free(zip_path);
+    return result;
+}
+
+
 char* GetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc != 1) {
         return ErrorAbort(state, "%s() expects 1 arg, got %d", name, argc);
@@ -507,7 +876,8 @@ char* FileGetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     fclose(f);
 
-    char* line = strtok(buffer, "\n");
+    char* save;
+    char* line = strtok_r(buffer, "\n", &save);
     do {
         // skip whitespace at start of line
         while (*line && isspace(*line)) ++line;
@@ -542,7 +912,7 @@ char* FileGetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
         result = strdup(val_start);
         break;
 
-    } while ((line = strtok(NULL, "\n")));
+    } while ((line = strtok_r(NULL, "\n", &save)));
 
     if (result == NULL) result = strdup("");
 
@@ -554,15 +924,101 @@ char* FileGetPropFn(const char* name, State* state, int argc, Expr* argv[]) {
 }
 
 
+// Where write_raw_image() sends an image: the partition, and the digest
+// its checkpoint keeps.
+typedef struct {
+    MtdWriteContext* ctx;
+    MzSha1Ctx sha;
+    long long len;
+} RawImageSink;
+
 static bool write_raw_image_cb(const unsigned char* data,
-                               int data_len, void* ctx) {
-    int r = mtd_write_data((MtdWriteContext*)ctx, (const char *)data, data_len);
-    if (r == data_len) return true;
+                               int data_len, void* cookie) {
+    RawImageSink* sink = (RawImageSink*)cookie;
+    int r = mtd_write_data(sink->ctx, (const char *)data, data_len);
+    if (r == data_len) {
+        mzSha1Update(&sink->sha, data, data_len);
+        sink->len += data_len;
+        ProfileAddBytes(data_len);
+        mzPhaseAdd(data_len);
+        return true;
+    }
     fprintf(stderr, "%s\n", strerror(errno));
     return false;
 }
 
+// Images are read from files this many erase blocks at a time, so
+// mtd_write_data() can write every block straight out of the buffer.
+#define RAW_IMAGE_READ_BLOCKS 16
+
+// Copy the image open on fd to the sink.  Returns true on success.
+static bool write_raw_image_fd(const char* name, const char* filename,
+                               int fd, const MtdPartition* mtd,
+                               RawImageSink* sink) {
+    size_t erase_size;
+    if (mtd_partition_info(mtd, NULL, &erase_size, NULL) != 0) {
+        erase_size = 128 * 1024;
+    }
+
+    bool success = true;
+    size_t size = erase_size * RAW_IMAGE_READ_BLOCKS;
+    char* buffer = memalign(getpagesize(), size);
+    while (success) {
+        // Fill the whole buffer (short reads only at end of file), so
+        // every write but the last is a whole number of blocks.
+        size_t got = 0;
+        while (got < size) {
+            ssize_t r = read(fd, buffer + got, size - got);
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) {
+                fprintf(stderr, "%s: error reading %s: %s\n",
+                        name, filename, strerror(errno));
+                success = false;
+            }
+            if (r <= 0) break;
+            got += r;
+        }
+        if (got == 0) break;
+        if (mtd_write_data(sink->ctx, buffer, got) != (ssize_t)got) {
+            fprintf(stderr, "mtd_write_data failed: %s\n", strerror(errno));
+            success = false;
+        }
+        mzSha1Update(&sink->sha, buffer, got);
+        sink->len += got;
+        ProfileAddBytes(got);
+        mzPhaseAdd(got);
+        if (got < size) break;
+    }
+    free(buffer);
+    return success;
+}
+
+extern int applypatch_check_output(const char* filename,
+                                   const uint8_t* sha1);
+
+// With deferred digests (UPDATE_PACKAGE_DIGESTS) an entry is only known
+// to match once all of it has been read, and by then a streamed write
+// has already put it on the partition, which can't be rolled back.  So
+// when there's a verifier, entries are read through it once before
+// anything is written; the whole-package signature alone already
+// covers the bytes and needs no extra pass.
+static bool VerifyEntryBeforeFlashing(const char* name, ZipArchive* za,
+                                      const ZipEntry* entry) {
+    if (za->pVerifier == NULL) return true;
+    if (!mzIsZipEntryIntact(za, entry)) {
+        UnterminatedString fn = mzGetZipEntryFileName(entry);
+        fprintf(stderr, "%s: %.*s failed verification; not flashing\n",
+                name, fn.len, fn.str);
+        return false;
+    }
+    return true;
+}
+
 // write_raw_image(file, partition)
+//
+// file is either an absolute path, or the path of an entry in the
+// package, which is streamed to the partition as it is inflated
+// without being staged anywhere first.
 char* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
     char* result = NULL;
 
@@ -589,37 +1045,89 @@ char* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
         goto done;
     }
 
+    // An image written before this install was interrupted is still
+    // there if the start of the partition hashes the way it did then.
+    int step = argv[0]->start;
+    uint8_t digest[MZ_SHA1_DIGEST_SIZE];
+    long long len;
+    if (CheckpointFind(name, step, digest, &len)) {
+        char check[128];
+        snprintf(check, sizeof(check), "MTD:%s:%lld:", partition, len);
+        int i;
+        for (i = 0; i < MZ_SHA1_DIGEST_SIZE; ++i) {
+            sprintf(check + strlen(check), "%02x", digest[i]);
+        }
+        if (applypatch_check_output(check, digest) == 0) {
+            printf("%s partition was written from %s before\n",
+                   partition, filename);
+            result = partition;
+            goto done;
+        }
+        CheckpointRedo();
+    }
+
+    // Find the source before opening the partition, so a missing image
+    // doesn't leave it half erased.
+    ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+    const ZipEntry* entry = NULL;
+    int fd = -1;
+    if (filename[0] == '/') {
+        fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "%s: can't open %s: %s\n",
+                    name, filename, strerror(errno));
+            result = strdup("");
+            goto done;
+        }
+    } else {
+        entry = mzFindZipEntry(za, filename);
+        if (entry == NULL) {
+            fprintf(stderr, "%s: no %s in package\n", name, filename);
+            result = strdup("");
+            goto done;
+        }
+        if (!VerifyEntryBeforeFlashing(name, za, entry)) {
+            result = strdup("");
+            goto done;
+        }
+    }
+
     MtdWriteContext* ctx = mtd_write_partition(mtd);
     if (ctx == NULL) {
         fprintf(stderr, "%s: can't write mtd partition \"%s\"\n",
                 name, partition);
+        if (fd >= 0) close(fd);
         result = strdup("");
         goto done;
     }
+    // Re-flashing a similar image only needs the blocks that differ.
+    mtd_write_skip_unchanged(ctx);
 
+    RawImageSink sink;
+    sink.ctx = ctx;
+    mzSha1Init(&sink.sha);
+    sink.len = 0;
     bool success;
-
-    FILE* f = fopen(filename, "rb");
-    if (f == NULL) {
-        fprintf(stderr, "%s: can't open %s: %s\n",
-                name, filename, strerror(errno));
-        result = strdup("");
-        goto done;
-    }
-
-    success = true;
-    char* buffer = malloc(BUFSIZ);
-    int read;
-    while (success && (read = fread(buffer, 1, BUFSIZ, f)) > 0) {
-        int wrote = mtd_write_data(ctx, buffer, read);
-        success = success && (wrote == read);
-        if (!success) {
-            fprintf(stderr, "mtd_write_data to %s failed: %s\n",
-                    partition, strerror(errno));
+    if (fd >= 0) {
+        struct stat st;
+        mzPhaseBegin("flash", fstat(fd, &st) == 0 ? st.st_size : 0);
+        success = write_raw_image_fd(name, filename, fd, mtd, &sink);
+        close(fd);
+    } else {
+        mzPhaseBegin("flash", mzGetZipEntryUncompLen(entry));
+        // A stored entry is handed over from the package mapping in
+        // runs of whole erase blocks, which mtd_write_data() writes in
+        // place; only a short tail gets copied.  Inflated output comes
+        // in 32K chunks, and those are coalesced into its block buffer.
+        size_t erase_size;
+        if (mtd_partition_info(mtd, NULL, &erase_size, NULL) != 0) {
+            erase_size = 128 * 1024;
         }
+        success = mzProcessZipEntryContentsInSlices(
+            za, entry, erase_size * RAW_IMAGE_READ_BLOCKS,
+            write_raw_image_cb, &sink);
     }
-    free(buffer);
-    fclose(f);
+    mzPhaseEnd();
 
     if (mtd_erase_blocks(ctx, -1) == -1) {
         fprintf(stderr, "%s: error erasing blocks of %s\n", name, partition);
@@ -630,6 +1138,9 @@ char* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     printf("%s %s partition from %s\n",
            success ? "wrote" : "failed to write", partition, filename);
+    if (success) {
+        CheckpointRecord(name, step, mzSha1Final(&sink.sha), sink.len);
+    }
 
     result = success ? partition : strdup("");
 
@@ -639,6 +1150,282 @@ done:
     return result;
 }
 
+typedef struct {
+    Yaffs2Writer* writer;
+    const DirPermsEntry* perms;
+    int perm_count;
+    char path[PATH_MAX];    // of the object being written, for the table
+    int path_prefix;        // length of the mount point in path
+} Yaffs2Image;
+
+// The attributes the table gives the object at image->path, or the
+// defaults that package_extract_dir() would leave behind.  As with
+// set_perm_table(), a later line wins.
+static void Yaffs2ImageAttrs(const Yaffs2Image* image, unsigned int type,
+                             Yaffs2Attrs* attrs) {
+    attrs->mode = type | (type == S_IFDIR ? 0755 :
+                          type == S_IFLNK ? 0777 : 0644);
+    attrs->uid = attrs->gid = 0;
+    attrs->mtime = 1217592000;  // 8/1/2008, as package_extract_dir()
+    int i;
+    for (i = image->perm_count - 1; i >= 0; --i) {
+        if (strcmp(image->perms[i].path, image->path) == 0) {
+            attrs->mode = type | (image->perms[i].mode & 07777);
+            attrs->uid = image->perms[i].uid;
+            attrs->gid = image->perms[i].gid;
+            break;
+        }
+    }
+}
+
+static bool write_yaffs2_file_cb(const unsigned char* data,
+                                 int data_len, void* cookie) {
+    if (yaffs2_write_file((Yaffs2Writer*)cookie, data, data_len) != 0) {
+        return false;
+    }
+    mzPhaseAdd(data_len);
+    return true;
+}
+
+// Every file and symlink under prefix goes through
+// VerifyEntryBeforeFlashing(), so a bad entry is found before the first
+// page of the image is written rather than halfway through it.
+static bool VerifyYaffs2Entries(const char* name, ZipArchive* za,
+                                const char* prefix) {
+    unsigned int first;
+    unsigned int count = mzFindZipEntriesWithPrefix(za, prefix, &first);
+    unsigned int i;
+    for (i = 0; i < count; ++i) {
+        const ZipEntry* entry = mzGetZipEntryAt(za, first + i);
+        UnterminatedString fn = mzGetZipEntryFileName(entry);
+        if (fn.len > 0 && fn.str[fn.len-1] == '/') continue;
+        if (!VerifyEntryBeforeFlashing(name, za, entry)) return false;
+    }
+    return true;
+}
+
+// Adds the entries under prefix (which ends in '/') to the image.  Zip
+// entries are sorted by name, so everything in a directory comes in one
+// run; the stack holds the directories that run is inside.
+static bool WriteYaffs2Entries(const char* name, Yaffs2Image* image,
+                               ZipArchive* za, const char* prefix) {
+    enum { MAX_DEPTH = 32 };
+    int dir_ids[MAX_DEPTH + 1];
+    int dir_lens[MAX_DEPTH + 1];    // of each one's path, after prefix
+    char open_dir[PATH_MAX];        // the innermost one's path
+    int depth = 0;
+    dir_ids[0] = YAFFS2_ROOT_ID;
+    dir_lens[0] = 0;
+
+    int prefix_len = strlen(prefix);
+    unsigned int first;
+    unsigned int count = mzFindZipEntriesWithPrefix(za, prefix, &first);
+    unsigned int i;
+    for (i = 0; i < count; ++i) {
+        const ZipEntry* entry = mzGetZipEntryAt(za, first + i);
+        UnterminatedString fn = mzGetZipEntryFileName(entry);
+        int len = fn.len - prefix_len;
+        const char* rel = fn.str + prefix_len;
+        if (image->path_prefix + 1 + len >= (int)sizeof(image->path)) {
+            fprintf(stderr, "%s: path too long: %.*s\n", name, fn.len, fn.str);
+            return false;
+        }
+        // image->path is the mount point, '/', and the path in the image.
+        char* path = image->path + image->path_prefix + 1;
+        memcpy(path, rel, len);
+        path[len] = '\0';
+
+        // Leave the directories this entry isn't in.
+        while (depth > 0 && (dir_lens[depth] >= len ||
+                             strncmp(open_dir, rel, dir_lens[depth]) != 0 ||
+                             rel[dir_lens[depth]] != '/')) {
+            --depth;
+        }
+
+        // Enter (creating) the ones it is in that aren't open yet.
+        int start = depth > 0 ? dir_lens[depth] + 1 : 0;
+        int j;
+        for (j = start; j < len; ++j) {
+            if (rel[j] != '/') continue;
+            if (depth >= MAX_DEPTH) {
+                fprintf(stderr, "%s: too deep: %.*s\n", name, fn.len, fn.str);
+                return false;
+            }
+            Yaffs2Attrs attrs;
+            path[j] = '\0';
+            Yaffs2ImageAttrs(image, S_IFDIR, &attrs);
+            int id = yaffs2_add_directory(image->writer, dir_ids[depth],
+                                          path + start, &attrs);
+            path[j] = '/';
+            if (id < 0) return false;
+            memcpy(open_dir, rel, j);
+            ++depth;
+            dir_ids[depth] = id;
+            dir_lens[depth] = j;
+            start = j + 1;
+        }
+        if (start >= len) continue;     // just a directory entry
+
+        const char* leaf = path + start;
+        int parent = dir_ids[depth];
+        Yaffs2Attrs attrs;
+        if (mzIsZipEntrySymlink(entry)) {
+            long target_len = mzGetZipEntryUncompLen(entry);
+            char target[PATH_MAX];
+            if (target_len >= (long)sizeof(target) ||
+                !mzReadZipEntry(za, entry, target, target_len)) {
+                fprintf(stderr, "%s: bad symlink %.*s\n", name, fn.len, fn.str);
+                return false;
+            }
+            target[target_len] = '\0';
+            Yaffs2ImageAttrs(image, S_IFLNK, &attrs);
+            if (yaffs2_add_symlink(image->writer, parent, leaf, target,
+                                   &attrs) < 0) {
+                return false;
+            }
+            continue;
+        }
+
+        long size = mzGetZipEntryUncompLen(entry);
+        Yaffs2ImageAttrs(image, S_IFREG, &attrs);
+        if (yaffs2_begin_file(image->writer, parent, leaf, size, &attrs) != 0 ||
+            !mzProcessZipEntryContentsVerified(za, entry, write_yaffs2_file_cb,
+                                               image->writer) ||
+            yaffs2_end_file(image->writer) != 0) {
+            fprintf(stderr, "%s: failed writing %.*s\n",
+                    name, fn.len, fn.str);
+            return false;
+        }
+        ProfileAddBytes(size);
+    }
+    return true;
+}
+
+// write_yaffs2_image(package_path, partition, mount_point[, perm_table])
+//
+// Replaces the contents of the (unmounted) yaffs2 partition with the
+// package directory package_path, as package_extract_dir() after a
+// format() would, by building the filesystem's pages and tags here and
+// writing them block after block; the kernel's filesystem is never
+// involved.  Symlinks stored in the package are kept.  perm_table is a
+// set_perm_table() table whose paths are under mount_point; anything it
+// doesn't mention is owned by root, with mode 0755 for directories and
+// 0644 for files.
+char* WriteYaffs2ImageFn(const char* name, State* state,
+                         int argc, Expr* argv[]) {
+    if (argc != 3 && argc != 4) {
+        return ErrorAbort(state, "%s() expects 3 or 4 args, got %d",
+                          name, argc);
+    }
+    char** args = ReadVarArgs(state, argc, argv);
+    if (args == NULL) return NULL;
+    const char* zip_path = args[0];
+    const char* partition = args[1];
+    const char* mount_point = args[2];
+
+    char* result = NULL;
+    char* prefix = NULL;
+    char* buffer = NULL;
+    DirPermsEntry* entries = NULL;
+    Yaffs2Image image;
+    memset(&image, 0, sizeof(image));
+
+    int count = 0;
+    if (argc == 4) {
+        count = ReadPermTable(state, name, args[3], &buffer, &entries);
+        if (count < 0) goto done;
+    }
+    image.perms = entries;
+    image.perm_count = count;
+
+    image.path_prefix = strlen(mount_point);
+    while (image.path_prefix > 0 && mount_point[image.path_prefix-1] == '/') {
+        --image.path_prefix;
+    }
+    if (image.path_prefix >= (int)sizeof(image.path) - 1) {
+        ErrorAbort(state, "%s: mount point too long", name);
+        goto done;
+    }
+    memcpy(image.path, mount_point, image.path_prefix);
+    image.path[image.path_prefix] = '/';
+
+    mtd_scan_partitions();
+    const MtdPartition* mtd = mtd_find_partition_by_name(partition);
+    if (mtd == NULL) {
+        fprintf(stderr, "%s: no mtd partition named \"%s\"\n", name, partition);
+        result = strdup("");
+        goto done;
+    }
+    pthread_mutex_lock(&mounts_lock);
+    scan_mounted_volumes();
+    int mounted = find_mounted_volume_by_mount_point(mount_point) != NULL;
+    pthread_mutex_unlock(&mounts_lock);
+    if (mounted) {
+        ErrorAbort(state, "%s: %s must be unmounted first", name, mount_point);
+        goto done;
+    }
+
+    // Nothing short of reading the whole filesystem back would show the
+    // image is intact, so it's trusted only while resuming.
+    int step = argv[0]->start;
+    if (CheckpointSkipUnchecked(name, step)) {
+        printf("%s partition was written from %s before\n",
+               partition, zip_path);
+        result = strdup("t");
+        goto done;
+    }
+
+    int len = strlen(zip_path);
+    prefix = malloc(len + 2);
+    strcpy(prefix, zip_path);
+    if (len > 0 && prefix[len-1] != '/') strcat(prefix, "/");
+
+    ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+    if (za->pVerifier != NULL && !VerifyYaffs2Entries(name, za, prefix)) {
+        result = strdup("");
+        goto done;
+    }
+
+    MtdWriteContext* ctx = mtd_write_partition(mtd);
+    if (ctx == NULL) {
+        fprintf(stderr, "%s: can't write mtd partition \"%s\"\n",
+                name, partition);
+        result = strdup("");
+        goto done;
+    }
+    bool success = false;
+    image.writer = yaffs2_writer_open(mtd, ctx);
+    if (image.writer != NULL) {
+        mzPhaseBegin("flash", ExtractDirSize(za, zip_path));
+        success = WriteYaffs2Entries(name, &image, za, prefix);
+        mzPhaseEnd();
+        if (yaffs2_writer_close(image.writer) != 0) success = false;
+    }
+
+    // Whatever isn't part of the image is left erased, ie. free space.
+    if (mtd_erase_blocks(ctx, -1) == -1) {
+        fprintf(stderr, "%s: error erasing blocks of %s\n", name, partition);
+        success = false;
+    }
+    if (mtd_write_close(ctx) != 0) {
+        fprintf(stderr, "%s: error closing write of %s\n", name, partition);
+        success = false;
+    }
+    printf("%s %s partition from %s\n",
+           success ? "wrote" : "failed to write", partition, zip_path);
+    if (success) CheckpointRecord(name, step, NULL, 0);
+    result = strdup(success ? "t" : "");
+
+done:
+    free(prefix);
+    free(entries);
+    free(buffer);
+    int i;
+    for (i = 0; i < argc; ++i) free(args[i]);
+    free(args);
+    return result;
+}
+
 // write_firmware_image(file, partition)
 //
 //    partition is "radio" or "hboot"
@@ -664,8 +1451,7 @@ char* WriteFirmwareImageFn(const char* name, State* state,
         goto done;
     }
 
-    FILE* cmd = ((UpdaterInfo*)(state->cookie))->cmd_pipe;
-    fprintf(cmd, "firmware %s %s\n", partition, filename);
+    SendFirmware((UpdaterInfo*)(state->cookie), partition, filename);
 
     printf("will write %s firmware from %s\n", partition, filename);
     result = partition;
@@ -727,6 +1513,51 @@ char* ApplyPatchFn(const char* name, State* state, int argc, Expr* argv[]) {
     }
 }
 
+extern int applypatch_check_batch(int count, char** const filenames,
+                                  char** const sha1_lists, int* results);
+
+// apply_patch_check_batch(file, "sha1[,sha1...]", file, "sha1[,...]", ...)
+//
+// Checks all the files at once, hashing them in parallel, and reports
+// every one that fails rather than stopping at the first.  Returns "t"
+// only if they all pass.
+char* ApplyPatchCheckBatchFn(const char* name, State* state,
+                             int argc, Expr* argv[]) {
+    if (argc < 2 || argc % 2 != 0) {
+        return ErrorAbort(state, "%s() expects file/sha1 pairs, got %d args",
+                          name, argc);
+    }
+    char** args = ReadVarArgs(state, argc, argv);
+    if (args == NULL) return NULL;
+
+    int count = argc / 2;
+    char** filenames = malloc(count * sizeof(char*));
+    char** sha1_lists = malloc(count * sizeof(char*));
+    int* results = malloc(count * sizeof(int));
+    int i;
+    for (i = 0; i < count; ++i) {
+        filenames[i] = args[i*2];
+        sha1_lists[i] = args[i*2+1];
+    }
+
+    int failed = applypatch_check_batch(count, filenames, sha1_lists, results);
+    for (i = 0; i < count; ++i) {
+        if (results[i] != 0) {
+            fprintf(stderr, "%s: %s doesn't match\n", name, filenames[i]);
+        }
+    }
+    printf("%s: %d of %d files failed\n", name, failed, count);
+
+    for (i = 0; i < argc; ++i) {
+        free(args[i]);
+    }
+    free(args);
+    free(filenames);
+    free(sha1_lists);
+    free(results);
+    return strdup(failed == 0 ? "t" : "");
+}
+
 char* UIPrintFn(const char* name, State* state, int argc, Expr* argv[]) {
     char** args = ReadVarArgs(state, argc, argv);
     if (args == NULL) {
@@ -748,13 +1579,12 @@ char* UIPrintFn(const char* name, State* state, int argc, Expr* argv[]) {
     free(args);
     buffer[size] = '\0';
 
-    char* line = strtok(buffer, "\n");
-    while (line) {
-        fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe,
-                "ui_print %s\n", line);
-        line = strtok(NULL, "\n");
-    }
-    fprintf(((UpdaterInfo*)(state->cookie))->cmd_pipe, "ui_print\n");
+    // Hold the output lock so lines printed by parallel() branches don't
+    // interleave with this message.
+    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+    pthread_mutex_lock(&ui->output_lock);
+    SendUIPrint(ui, buffer);
+    pthread_mutex_unlock(&ui->output_lock);
 
     return buffer;
 }
@@ -769,20 +1599,24 @@ void RegisterInstallFunctions() {
     RegisterFunction("set_progress", SetProgressFn);
     RegisterFunction("delete", DeleteFn);
     RegisterFunction("delete_recursive", DeleteFn);
+    RegisterFunction("delete_recursive_background", DeleteFn);
     RegisterFunction("package_extract_dir", PackageExtractDirFn);
     RegisterFunction("package_extract_file", PackageExtractFileFn);
     RegisterFunction("symlink", SymlinkFn);
     RegisterFunction("set_perm", SetPermFn);
     RegisterFunction("set_perm_recursive", SetPermFn);
+    RegisterFunction("set_perm_table", SetPermTableFn);
 
     RegisterFunction("getprop", GetPropFn);
     RegisterFunction("file_getprop", FileGetPropFn);
     RegisterFunction("write_raw_image", WriteRawImageFn);
+    RegisterFunction("write_yaffs2_image", WriteYaffs2ImageFn);
     RegisterFunction("write_firmware_image", WriteFirmwareImageFn);
 
     RegisterFunction("apply_patch", ApplyPatchFn);
     RegisterFunction("apply_patch_check", ApplyPatchFn);
     RegisterFunction("apply_patch_space", ApplyPatchFn);
+    RegisterFunction("apply_patch_check_batch", ApplyPatchCheckBatchFn);
 
     RegisterFunction("ui_print", UIPrintFn);
 }
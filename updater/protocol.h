@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_PROTOCOL_H_
+#define _UPDATER_PROTOCOL_H_
+
+#include <stdint.h>
+
+// The commands an update binary sends back to recovery over its pipe.
+// Up to API version 2 they are text lines ("set_progress 0.5\n"); from
+// version 3 on, each is a binary frame: an UpdaterFrameHeader followed
+// by 'length' bytes of payload.  Both sides are on the same device, so
+// everything is in native byte order.
+#define UPDATER_FRAMED_API_VERSION 3
+
+// The newest version an update binary built from this tree supports.
+#define UPDATER_MAX_API_VERSION 3
+
+enum {
+    UPDATER_CMD_PROGRESS = 1,       // UpdaterProgress
+    UPDATER_CMD_SET_PROGRESS = 2,   // float fraction
+    UPDATER_CMD_FIRMWARE = 3,       // "<type>\0<filename>\0"
+    UPDATER_CMD_UI_PRINT = 4,       // text to print as-is, newlines included
+    UPDATER_CMD_PHASE = 5,          // UpdaterPhase, then "<name>\0"
+};
+
+typedef struct {
+    uint16_t type;
+    uint16_t length;
+} UpdaterFrameHeader;
+
+#define UPDATER_MAX_PAYLOAD 0xffff
+
+typedef struct {
+    float fraction;
+    int32_t seconds;
+} UpdaterProgress;
+
+// How a phase of the install (see minzip/Throughput.h) is going.
+typedef struct {
+    int64_t done;
+    int64_t total;
+    int64_t elapsed_ms;
+    int32_t ended;
+} UpdaterPhase;
+
+#endif
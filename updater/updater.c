@@ -14,42 +14,298 @@
  * limitations under the License.
  */
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 
+#include "checkpoint.h"
 #include "edify/expr.h"
+#include "estimate.h"
 #include "updater.h"
 #include "install.h"
+#include "minzip/Digests.h"
+#include "minzip/DirUtil.h"
+#include "minzip/Throughput.h"
+#include "minzip/Trace.h"
 #include "minzip/Zip.h"
+#include "mtdutils/mtdutils.h"
+#include "protocol.h"
 
 // Where in the package we expect to find the edify script to execute.
 // (Note it's "updateR-script", not the older "update-script".)
 #define SCRIPT_NAME "META-INF/com/google/android/updater-script"
 
+// Profiling of the script is turned on by setting UPDATER_PROFILE in the
+// environment or by creating PROFILE_TRIGGER.  The busiest lines go to
+// stderr (and so into the recovery log); the whole report goes to
+// PROFILE_FILE.
+#define PROFILE_TRIGGER "/cache/recovery/profile_updater"
+#define PROFILE_FILE "/cache/recovery/updater_profile"
+#define PROFILE_LOG_LINES 15
+
+static void WriteProfile(const char* script) {
+    WriteProfileReport(stderr, script, PROFILE_LOG_LINES);
+    FILE* f = fopen(PROFILE_FILE, "w");
+    if (f == NULL) {
+        fprintf(stderr, "can't write %s: %s\n", PROFILE_FILE, strerror(errno));
+        return;
+    }
+    WriteProfileReport(f, script, 0);
+    fclose(f);
+}
+
+static void SendFrame(UpdaterInfo* ui, int type,
+                      const void* data, size_t length) {
+    UpdaterFrameHeader header;
+    header.type = type;
+    header.length = length;
+    flockfile(ui->cmd_pipe);
+    fwrite(&header, sizeof(header), 1, ui->cmd_pipe);
+    fwrite(data, 1, length, ui->cmd_pipe);
+    funlockfile(ui->cmd_pipe);
+    fflush(ui->cmd_pipe);
+}
+
+static int Framed(const UpdaterInfo* ui) {
+    return ui->api_version >= UPDATER_FRAMED_API_VERSION;
+}
+
+void SendProgress(UpdaterInfo* ui, double frac, int seconds) {
+    if (Framed(ui)) {
+        UpdaterProgress p;
+        p.fraction = frac;
+        p.seconds = seconds;
+        SendFrame(ui, UPDATER_CMD_PROGRESS, &p, sizeof(p));
+    } else {
+        fprintf(ui->cmd_pipe, "progress %f %d\n", frac, seconds);
+    }
+}
+
+void SendSetProgress(UpdaterInfo* ui, double frac) {
+    if (Framed(ui)) {
+        float f = frac;
+        SendFrame(ui, UPDATER_CMD_SET_PROGRESS, &f, sizeof(f));
+    } else {
+        fprintf(ui->cmd_pipe, "set_progress %f\n", frac);
+    }
+}
+
+void SendFirmware(UpdaterInfo* ui, const char* type, const char* filename) {
+    if (Framed(ui)) {
+        size_t type_len = strlen(type) + 1;
+        size_t filename_len = strlen(filename) + 1;
+        if (type_len + filename_len > UPDATER_MAX_PAYLOAD) return;
+        char* payload = malloc(type_len + filename_len);
+        memcpy(payload, type, type_len);
+        memcpy(payload + type_len, filename, filename_len);
+        SendFrame(ui, UPDATER_CMD_FIRMWARE, payload, type_len + filename_len);
+        free(payload);
+    } else {
+        fprintf(ui->cmd_pipe, "firmware %s %s\n", type, filename);
+    }
+}
+
+void SendUIPrint(UpdaterInfo* ui, const char* text) {
+    if (Framed(ui)) {
+        // The whole message goes in one frame (or a few, if it's huge)
+        // with its own newline, instead of a command per line.
+        size_t len = strlen(text) + 1;
+        char* payload = malloc(len);
+        memcpy(payload, text, len - 1);
+        payload[len - 1] = '\n';
+        size_t sent;
+        for (sent = 0; sent < len; sent += UPDATER_MAX_PAYLOAD) {
+            size_t n = len - sent;
+            if (n > UPDATER_MAX_PAYLOAD) n = UPDATER_MAX_PAYLOAD;
+            SendFrame(ui, UPDATER_CMD_UI_PRINT, payload + sent, n);
+        }
+        free(payload);
+        return;
+    }
+
+    // In text form each line is its own command, and a bare "ui_print"
+    // ends the message.
+    const char* line = text;
+    while (*line) {
+        const char* end = strchr(line, '\n');
+        int len = end ? end - line : (int)strlen(line);
+        if (len > 0) {
+            fprintf(ui->cmd_pipe, "ui_print %.*s\n", len, line);
+        }
+        line += len + (end ? 1 : 0);
+    }
+    fprintf(ui->cmd_pipe, "ui_print\n");
+}
+
+// Pass on how each phase is going, for recovery to show.
+static void SendPhase(const PhaseStatus* status, void* cookie) {
+    UpdaterInfo* ui = (UpdaterInfo*)cookie;
+    size_t name_len = strlen(status->name) + 1;
+    char payload[sizeof(UpdaterPhase) + 64];
+    if (name_len > sizeof(payload) - sizeof(UpdaterPhase)) return;
+
+    UpdaterPhase p;
+    p.done = status->done;
+    p.total = status->total;
+    p.elapsed_ms = status->elapsedMs;
+    p.ended = status->ended;
+    memcpy(payload, &p, sizeof(p));
+    memcpy(payload + sizeof(p), status->name, name_len);
+    SendFrame(ui, UPDATER_CMD_PHASE, payload, sizeof(p) + name_len);
+}
+
+// Threads evaluating the branches of one parallel() block, counting
+// the caller.  Most of the work is flash and filesystem I/O, so more
+// than this just makes the branches fight over the same devices.
+#define PARALLEL_MAX_WORKERS 4
+
+typedef struct {
+    State* state;
+    int argc;
+    Expr** argv;
+    Value** results;
+    char** errors;
+    int next;
+    pthread_mutex_t lock;
+} ParallelBlock;
+
+static void* ParallelWorker(void* cookie) {
+    ParallelBlock* pb = (ParallelBlock*)cookie;
+    for (;;) {
+        pthread_mutex_lock(&pb->lock);
+        int i = pb->next++;
+        pthread_mutex_unlock(&pb->lock);
+        if (i >= pb->argc) break;
+
+        // Each branch gets its own copy of the state so errors don't
+        // trample each other.
+        State state = *pb->state;
+        state.errmsg = NULL;
+        pb->results[i] = EvaluateValue(&state, pb->argv[i]);
+        pb->errors[i] = state.errmsg;
+    }
+    return NULL;
+}
+
+// parallel(expr, expr, ...)
+//
+// Evaluates its arguments concurrently and waits for all of them to
+// finish.  If they all succeed, returns the value of the last one (as
+// a sequence would); otherwise aborts with the errors of every branch
+// that failed, in argument order.  The branches must not depend on
+// each other's side effects.
+Value* ParallelFn(const char* name, State* state, int argc, Expr* argv[]) {
+    if (argc == 0) {
+        return StringValue(strdup(""));
+    }
+
+    // The MTD partition table is filled in on first use; do that now so
+    // the branches only ever read it.
+    mtd_scan_partitions();
+
+    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+    pthread_mutex_lock(&ui->output_lock);
+    ++ui->parallel;
+    pthread_mutex_unlock(&ui->output_lock);
+
+    ParallelBlock pb;
+    pb.state = state;
+    pb.argc = argc;
+    pb.argv = argv;
+    pb.results = calloc(argc, sizeof(Value*));
+    pb.errors = calloc(argc, sizeof(char*));
+    pb.next = 0;
+    pthread_mutex_init(&pb.lock, NULL);
+
+    int workers = argc < PARALLEL_MAX_WORKERS ? argc : PARALLEL_MAX_WORKERS;
+    pthread_t threads[PARALLEL_MAX_WORKERS];
+    int started = 0;
+    while (started < workers-1 &&
+           pthread_create(&threads[started], NULL, ParallelWorker, &pb) == 0) {
+        ++started;
+    }
+    ParallelWorker(&pb);
+    int i;
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pb.lock);
+
+    pthread_mutex_lock(&ui->output_lock);
+    --ui->parallel;
+    pthread_mutex_unlock(&ui->output_lock);
+
+    int failed = 0;
+    size_t len = 0;
+    for (i = 0; i < argc; ++i) {
+        if (pb.results[i] == NULL) {
+            ++failed;
+            len += (pb.errors[i] ? strlen(pb.errors[i]) : 20) + 32;
+        }
+    }
+
+    Value* result = NULL;
+    if (failed == 0) {
+        result = pb.results[argc-1];
+        pb.results[argc-1] = NULL;
+    } else {
+        char* msg = malloc(len + 64);
+        char* p = msg + sprintf(msg, "%s: %d of %d branches failed",
+                                name, failed, argc);
+        for (i = 0; i < argc; ++i) {
+            if (pb.results[i] == NULL) {
+                p += sprintf(p, "\n  branch %d: %s", i+1,
+                             pb.errors[i] ? pb.errors[i] : "(no message)");
+            }
+        }
+        ErrorAbort(state, "%s", msg);
+        free(msg);
+    }
+
+    for (i = 0; i < argc; ++i) {
+        FreeValue(pb.results[i]);
+        free(pb.errors[i]);
+    }
+    free(pb.results);
+    free(pb.errors);
+    return result;
+}
+
 int main(int argc, char** argv) {
-    if (argc != 4) {
+    // "updater --estimate <package> [<profile> ...]" works out what
+    // installing the package would take instead of installing it.
+    int estimate = argc >= 3 && strcmp(argv[1], "--estimate") == 0;
+    if (!estimate && argc != 4) {
         fprintf(stderr, "unexpected number of arguments (%d)\n", argc);
         return 1;
     }
 
-    char* version = argv[1];
-    if ((version[0] != '1' && version[0] != '2') || version[1] != '\0') {
-        // We support version "1" or "2".
-        fprintf(stderr, "wrong updater binary API; expected 1 or 2, got %s\n",
-                argv[1]);
+    char* version = estimate ? "1" : argv[1];
+    if (version[0] < '1' || version[0] > '0' + UPDATER_MAX_API_VERSION ||
+        version[1] != '\0') {
+        // We support versions "1" through UPDATER_MAX_API_VERSION.
+        // Recovery depends on this exiting with status 2 to know to
+        // try again with an older version.
+        fprintf(stderr, "wrong updater binary API; expected 1 to %d, got %s\n",
+                UPDATER_MAX_API_VERSION, argv[1]);
         return 2;
     }
 
     // Set up the pipe for sending commands back to the parent process.
 
-    int fd = atoi(argv[2]);
-    FILE* cmd_pipe = fdopen(fd, "wb");
-    setlinebuf(cmd_pipe);
+    FILE* cmd_pipe = NULL;
+    if (!estimate) {
+        int fd = atoi(argv[2]);
+        cmd_pipe = fdopen(fd, "wb");
+        setlinebuf(cmd_pipe);
+    }
 
     // Extract the script from the package.
 
-    char* package_data = argv[3];
+    char* package_data = estimate ? argv[2] : argv[3];
     ZipArchive za;
     int err;
     err = mzOpenZipArchive(package_data, &za);
@@ -59,6 +315,19 @@ int main(int argc, char** argv) {
         return 3;
     }
 
+    // If recovery deferred checking the entry digests to us, every entry
+    // we read (the script included) has to match them.
+    const char* digests_file = getenv("UPDATE_PACKAGE_DIGESTS");
+    MzDigestTable* digests = NULL;
+    if (digests_file != NULL) {
+        digests = mzLoadDigestTable(&za, digests_file);
+        if (digests == NULL) {
+            fprintf(stderr, "failed to load digests from %s\n", digests_file);
+            return 3;
+        }
+        mzSetEntryVerifier(&za, mzGetDigestTableVerifier(digests));
+    }
+
     const ZipEntry* script_entry = mzFindZipEntry(&za, SCRIPT_NAME);
     if (script_entry == NULL) {
         fprintf(stderr, "failed to find %s in %s\n", SCRIPT_NAME, package_data);
@@ -76,6 +345,7 @@ int main(int argc, char** argv) {
 
     RegisterBuiltins();
     RegisterInstallFunctions();
+    RegisterFunction("parallel", ParallelFn);
     FinishRegistration();
 
     // Parse the script.
@@ -88,40 +358,67 @@ int main(int argc, char** argv) {
         fprintf(stderr, "%d parse errors\n", error_count);
         return 6;
     }
+    OptimizeExpr(root);
+
+    if (estimate) {
+        int result = EstimateInstall(root, &za, argc - 3, argv + 3);
+        FreeExprArena();
+        mzCloseZipArchive(&za);
+        free(script);
+        return result;
+    }
 
     // Evaluate the parsed script.
 
     UpdaterInfo updater_info;
     updater_info.cmd_pipe = cmd_pipe;
+    updater_info.api_version = version[0] - '0';
     updater_info.package_zip = &za;
+    pthread_mutex_init(&updater_info.output_lock, NULL);
+    updater_info.parallel = 0;
+    updater_info.progress = 0.0;
+    if (Framed(&updater_info)) mzSetPhaseObserver(SendPhase, &updater_info);
+    if (!estimate) mzTraceAttach(getenv(MZ_TRACE_ENV), "updater");
 
     State state;
     state.cookie = &updater_info;
     state.script = script;
     state.errmsg = NULL;
 
+    int profile = getenv("UPDATER_PROFILE") != NULL ||
+                  access(PROFILE_TRIGGER, F_OK) == 0;
+    if (profile) EnableProfiling();
+
+    // If this package was cut off partway through installing, pick up
+    // after the steps that finished.
+    CheckpointBegin(package_data, script);
+
+    mzTraceBegin("script");
     char* result = Evaluate(&state, root);
+    // Trees delete_recursive() renamed away must be gone before the
+    // filesystems are unmounted.
+    dirUnlinkWaitAway();
+    mzTraceEnd("script");
+    if (profile) WriteProfile(script);
     if (result == NULL) {
         if (state.errmsg == NULL) {
             fprintf(stderr, "script aborted (no error message)\n");
-            fprintf(cmd_pipe, "ui_print script aborted (no error message)\n");
+            SendUIPrint(&updater_info, "script aborted (no error message)");
         } else {
             fprintf(stderr, "script aborted: %s\n", state.errmsg);
-            char* line = strtok(state.errmsg, "\n");
-            while (line) {
-                fprintf(cmd_pipe, "ui_print %s\n", line);
-                line = strtok(NULL, "\n");
-            }
-            fprintf(cmd_pipe, "ui_print\n");
+            SendUIPrint(&updater_info, state.errmsg);
         }
         free(state.errmsg);
         return 7;
     } else {
         fprintf(stderr, "script result was [%s]\n", result);
         free(result);
+        CheckpointFinish();
     }
 
+    FreeExprArena();
     mzCloseZipArchive(&za);
+    mzFreeDigestTable(digests);
     free(script);
 
     return 0;
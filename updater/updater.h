@@ -17,12 +17,32 @@
 #ifndef _UPDATER_UPDATER_H_
 #define _UPDATER_UPDATER_H_
 
+#include <pthread.h>
 #include <stdio.h>
 #include "minzip/Zip.h"
 
 typedef struct {
     FILE* cmd_pipe;
+    int api_version;            // as passed by recovery
     ZipArchive* package_zip;
+
+    // Held while writing a multi-line command to cmd_pipe, so output
+    // from parallel() branches doesn't interleave.  It also guards the
+    // number of parallel() blocks running and the last fraction sent
+    // by set_progress.
+    pthread_mutex_t output_lock;
+    int parallel;
+    double progress;
 } UpdaterInfo;
 
+// Send a command to recovery in whichever form (see protocol.h) its
+// API version calls for.  Callers that may run inside parallel() hold
+// output_lock.
+void SendProgress(UpdaterInfo* ui, double frac, int seconds);
+void SendSetProgress(UpdaterInfo* ui, double frac);
+void SendFirmware(UpdaterInfo* ui, const char* type, const char* filename);
+
+// Print text, which may hold several lines, on the recovery screen.
+void SendUIPrint(UpdaterInfo* ui, const char* text);
+
 #endif
@@ -17,15 +17,41 @@
 #include "common.h"
 #include "verifier.h"
 
+#include "minzip/Budget.h"
+#include "minzip/Sha1.h"
+#include "minzip/Throughput.h"
 #include "minzip/Zip.h"
 #include "mincrypt/rsa.h"
 #include "mincrypt/sha.h"
 
+#include <errno.h>
 #include <netinet/in.h>  /* required for resolv.h */
+#include <pthread.h>
 #include <resolv.h>      /* for base64 codec */
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
-/* Return an allocated buffer with the contents of a zip file entry. */
+/* Set by verify_set_background() while a background verification runs. */
+static const volatile int *gCancel = NULL;
+
+/* In the background nothing goes on screen: errors are only logged. */
+#undef LOGE
+#define LOGE(...) do { \
+        if (gCancel != NULL) fprintf(stderr, "E:" __VA_ARGS__); \
+        else ui_print("E:" __VA_ARGS__); \
+    } while (0)
+
+static bool cancelled(void) {
+    return gCancel != NULL && *gCancel != 0;
+}
+
+void verify_set_background(const volatile int *cancel) {
+    gCancel = cancel;
+}
+
+/* Return a buffer with the contents of a zip file entry, from the memory
+ * budget; free it with mzBudgetFree(). */
 static char *slurpEntry(const ZipArchive *pArchive, const ZipEntry *pEntry) {
     if (!mzIsZipEntryIntact(pArchive, pEntry)) {
         UnterminatedString fn = mzGetZipEntryFileName(pEntry);
@@ -34,7 +60,7 @@ static char *slurpEntry(const ZipArchive *pArchive, const ZipEntry *pEntry) {
     }
 
     int len = mzGetZipEntryUncompLen(pEntry);
-    char *buf = malloc(len + 1);
+    char *buf = mzBudgetAlloc(len + 1, 0);
     if (buf == NULL) {
         UnterminatedString fn = mzGetZipEntryFileName(pEntry);
         LOGE("Can't allocate %d bytes for %.*s\n", len, fn.len, fn.str);
@@ -44,7 +70,7 @@ static char *slurpEntry(const ZipArchive *pArchive, const ZipEntry *pEntry) {
     if (!mzReadZipEntry(pArchive, pEntry, buf, len)) {
         UnterminatedString fn = mzGetZipEntryFileName(pEntry);
         LOGE("Can't read %.*s\n", fn.len, fn.str);
-        free(buf);
+        mzBudgetFree(buf);
         return NULL;
     }
 
@@ -54,20 +80,26 @@ static char *slurpEntry(const ZipArchive *pArchive, const ZipEntry *pEntry) {
 
 
 struct DigestContext {
-    SHA_CTX digest;
+    MzSha1Ctx digest;
     unsigned *doneBytes;
     unsigned totalBytes;
+    pthread_mutex_t *doneLock;  /* guards *doneBytes; may be NULL */
 };
 
 
 /* mzProcessZipEntryContents callback to update an SHA-1 hash context. */
 static bool updateHash(const unsigned char *data, int dataLen, void *cookie) {
     struct DigestContext *context = (struct DigestContext *) cookie;
-    SHA_update(&context->digest, data, dataLen);
-    if (context->doneBytes != NULL) {
+    if (cancelled()) return false;
+    mzSha1Update(&context->digest, data, dataLen);
+    if (context->doneBytes != NULL && gCancel == NULL) {
+        mzPhaseAdd(dataLen);
+        if (context->doneLock != NULL) pthread_mutex_lock(context->doneLock);
         *context->doneBytes += dataLen;
+        unsigned done = *context->doneBytes;
+        if (context->doneLock != NULL) pthread_mutex_unlock(context->doneLock);
         if (context->totalBytes > 0) {
-            ui_set_progress(*context->doneBytes * 1.0 / context->totalBytes);
+            ui_set_progress(done * 1.0 / context->totalBytes);
         }
     }
     return true;
@@ -76,19 +108,22 @@ static bool updateHash(const unsigned char *data, int dataLen, void *cookie) {
 
 /* Get the SHA-1 digest of a zip file entry. */
 static bool digestEntry(const ZipArchive *pArchive, const ZipEntry *pEntry,
-        unsigned *doneBytes, unsigned totalBytes,
+        unsigned *doneBytes, unsigned totalBytes, pthread_mutex_t *doneLock,
         uint8_t digest[SHA_DIGEST_SIZE]) {
     struct DigestContext context;
-    SHA_init(&context.digest);
+    mzSha1Init(&context.digest);
     context.doneBytes = doneBytes;
     context.totalBytes = totalBytes;
-    if (!mzProcessZipEntryContents(pArchive, pEntry, updateHash, &context)) {
+    context.doneLock = doneLock;
+    /* The CRC is checked in the same pass as the hash. */
+    if (!mzProcessZipEntryContentsVerified(pArchive, pEntry, updateHash,
+            &context)) {
         UnterminatedString fn = mzGetZipEntryFileName(pEntry);
         LOGE("Can't digest %.*s\n", fn.len, fn.str);
         return false;
     }
 
-    memcpy(digest, SHA_final(&context.digest), SHA_DIGEST_SIZE);
+    memcpy(digest, mzSha1Final(&context.digest), SHA_DIGEST_SIZE);
 
 #ifdef LOG_VERBOSE
     UnterminatedString fn = mzGetZipEntryFileName(pEntry);
@@ -136,7 +171,7 @@ static const ZipEntry *verifySignature(const ZipArchive *pArchive,
             free(sfName);
 
             uint8_t sfDigest[SHA_DIGEST_SIZE];
-            if (!digestEntry(pArchive, sfEntry, NULL, 0, sfDigest)) continue;
+            if (!digestEntry(pArchive, sfEntry, NULL, 0, NULL, sfDigest)) continue;
 
             char *rsaBuf = slurpEntry(pArchive, rsaEntry);
             if (rsaBuf == NULL) continue;
@@ -145,13 +180,13 @@ static const ZipEntry *verifySignature(const ZipArchive *pArchive,
             uint8_t *sig = (uint8_t *) rsaBuf + rsaLen - RSANUMBYTES;
             for (j = 0; j < numKeys; ++j) {
                 if (RSA_verify(&pKeys[j], sig, RSANUMBYTES, sfDigest)) {
-                    free(rsaBuf);
+                    mzBudgetFree(rsaBuf);
                     LOGI("Verified %.*s\n", rsaName.len, rsaName.str);
                     return sfEntry;
                 }
             }
 
-            free(rsaBuf);
+            mzBudgetFree(rsaBuf);
             LOGW("Can't verify %.*s\n", rsaName.len, rsaName.str);
         }
     }
@@ -186,7 +221,7 @@ static const ZipEntry *verifyManifest(const ZipArchive *pArchive,
         }
     }
 
-    free(sfBuf);
+    mzBudgetFree(sfBuf);
 
     if (line == NULL) {
         LOGE("No digest manifest in signature file\n");
@@ -200,7 +235,7 @@ static const ZipEntry *verifyManifest(const ZipArchive *pArchive,
         return NULL;
     }
 
-    if (!digestEntry(pArchive, mfEntry, NULL, 0, actual)) return NULL;
+    if (!digestEntry(pArchive, mfEntry, NULL, 0, NULL, actual)) return NULL;
     if (memcmp(expected, actual, SHA_DIGEST_SIZE)) {
         UnterminatedString fn = mzGetZipEntryFileName(sfEntry);
         LOGE("Wrong digest for %s in %.*s\n", mfName, fn.len, fn.str);
@@ -212,8 +247,127 @@ static const ZipEntry *verifyManifest(const ZipArchive *pArchive,
 }
 
 
-/* Verify all the files in a Zip archive against the manifest. */
-static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
+/* One manifest entry waiting to be hashed. */
+struct DigestJob {
+    const ZipEntry *entry;
+    char *name;
+    uint8_t expected[SHA_DIGEST_SIZE];
+    bool ok;
+};
+
+#define MAX_DIGEST_THREADS 4
+
+/* State shared by the threads hashing manifest entries. */
+struct DigestPool {
+    const ZipArchive *pArchive;
+    struct DigestJob *jobs;
+    int numJobs;
+    int nextJob;
+    bool failed;
+    unsigned doneBytes;
+    unsigned totalBytes;
+    pthread_mutex_t lock;
+};
+
+static void *digestWorker(void *cookie) {
+    struct DigestPool *pool = (struct DigestPool *) cookie;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        int i = pool->failed ? pool->numJobs : pool->nextJob++;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->numJobs) break;
+
+        struct DigestJob *job = &pool->jobs[i];
+        uint8_t actual[SHA_DIGEST_SIZE];
+        job->ok = digestEntry(pool->pArchive, job->entry,
+                &pool->doneBytes, pool->totalBytes, &pool->lock, actual) &&
+                memcmp(job->expected, actual, SHA_DIGEST_SIZE) == 0;
+        if (!job->ok) {
+            /* No point hashing the rest. */
+            pthread_mutex_lock(&pool->lock);
+            pool->failed = true;
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    return NULL;
+}
+
+/* Hash every job, spread over the available cores (entries are read
+ * with pread, so threads can share the archive).  Returns true if all
+ * of them matched; progress is reported as bytes are hashed.
+ */
+static bool runDigestJobs(const ZipArchive *pArchive,
+        struct DigestJob *jobs, int numJobs, unsigned totalBytes) {
+    struct DigestPool pool;
+    pthread_t threads[MAX_DIGEST_THREADS];
+    int i, started = 0;
+
+    pool.pArchive = pArchive;
+    pool.jobs = jobs;
+    pool.numJobs = numJobs;
+    pool.nextJob = 0;
+    pool.failed = false;
+    pool.doneBytes = 0;
+    pool.totalBytes = totalBytes;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numThreads < 1) numThreads = 1;
+    if (numThreads > MAX_DIGEST_THREADS) numThreads = MAX_DIGEST_THREADS;
+    if (numThreads > numJobs) numThreads = numJobs;
+
+    /* The calling thread is one of the workers. */
+    for (i = 1; i < numThreads; ++i) {
+        if (pthread_create(&threads[started], NULL, digestWorker, &pool)) break;
+        ++started;
+    }
+    digestWorker(&pool);
+    for (i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&pool.lock);
+
+    /* Report in manifest order, whichever thread got there first. */
+    for (i = 0; i < numJobs; ++i) {
+        if (!jobs[i].ok) {
+            LOGE("Wrong digest:\n  %s\n", jobs[i].name);
+            return false;
+        }
+        LOGI("Verified %s\n", jobs[i].name);
+    }
+    return true;
+}
+
+
+/* Write the expected digests for minzip's digest table, instead of
+ * checking them now.  Returns false if the file can't be written.
+ */
+static bool writeDeferredDigests(const char *path,
+        const struct DigestJob *jobs, int numJobs) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        LOGE("Can't create %s (%s)\n", path, strerror(errno));
+        return false;
+    }
+    int i, j;
+    for (i = 0; i < numJobs; ++i) {
+        for (j = 0; j < SHA_DIGEST_SIZE; ++j) {
+            fprintf(f, "%02x", jobs[i].expected[j]);
+        }
+        fprintf(f, " %s\n", jobs[i].name);
+    }
+    if (fclose(f) != 0) {
+        LOGE("Can't write %s (%s)\n", path, strerror(errno));
+        unlink(path);
+        return false;
+    }
+    LOGI("Deferred %d digests to %s\n", numJobs, path);
+    return true;
+}
+
+
+/* Verify all the files in a Zip archive against the manifest.
+ * See verify_jar_signature_deferred() for deferredDigests. */
+static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry,
+        const char *deferredDigests, bool *pDeferred) {
     static const char namePrefix[] = "Name: ";
     static const char contPrefix[] = " ";  // Continuation of the filename
     static const char digestPrefix[] = "SHA1-Digest: ";
@@ -226,7 +380,7 @@ static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
     bool *unverified = (bool *) calloc(mzZipEntryCount(pArchive), sizeof(bool));
     if (unverified == NULL) {
         LOGE("Can't allocate valid flags\n");
-        free(mfBuf);
+        mzBudgetFree(mfBuf);
         return false;
     }
 
@@ -257,7 +411,10 @@ static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
         }
     }
 
-    unsigned doneBytes = 0;
+    /* Collect the digests first, then hash the entries in parallel. */
+    struct DigestJob *jobs = NULL;
+    int numJobs = 0, maxJobs = 0;
+
     char *line, *save, *name = NULL;
     for (line = strtok_r(mfBuf, eol, &save); line != NULL;
          line = strtok_r(NULL, eol, &save)) {
@@ -300,37 +457,61 @@ static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
                 LOGE("Missing file:\n  %s\n", name);
                 break;
             }
-            if (!mzIsZipEntryIntact(pArchive, entry)) {
-                LOGE("Corrupt file:\n  %s\n", name);
-                break;
-            }
             if (!unverified[mzGetZipEntryIndex(pArchive, entry)]) {
                 LOGE("Unexpected file:\n  %s\n", name);
                 break;
             }
 
-            uint8_t expected[SHA_DIGEST_SIZE + 3], actual[SHA_DIGEST_SIZE];
+            uint8_t expected[SHA_DIGEST_SIZE + 3];
             int n = b64_pton(base64, expected, sizeof(expected));
             if (n != SHA_DIGEST_SIZE) {
                 LOGE("Invalid base64:\n  %s\n  %s\n", name, base64);
                 break;
             }
 
-            if (!digestEntry(pArchive, entry, &doneBytes, totalBytes, actual) ||
-                memcmp(expected, actual, SHA_DIGEST_SIZE) != 0) {
-                LOGE("Wrong digest:\n  %s\n", name);
-                break;
+            if (numJobs == maxJobs) {
+                int newMax = maxJobs ? maxJobs * 2 : 64;
+                struct DigestJob *newJobs = (struct DigestJob *)
+                        realloc(jobs, newMax * sizeof(struct DigestJob));
+                if (newJobs == NULL) {
+                    LOGE("Can't allocate digest list\n");
+                    break;
+                }
+                jobs = newJobs;
+                maxJobs = newMax;
             }
+            jobs[numJobs].entry = entry;
+            jobs[numJobs].name = name;
+            memcpy(jobs[numJobs].expected, expected, SHA_DIGEST_SIZE);
+            jobs[numJobs].ok = false;
+            ++numJobs;
 
-            LOGI("Verified %s\n", name);
             unverified[mzGetZipEntryIndex(pArchive, entry)] = false;
-            free(name);
             name = NULL;
         }
     }
 
     if (name != NULL) free(name);
-    free(mfBuf);
+    mzBudgetFree(mfBuf);
+
+    /* Every entry, the marker included, has been matched to a signed
+     * manifest stanza by now (or we fail below), so its presence can be
+     * trusted.
+     */
+    bool digestsOk = false;
+    if (line == NULL) {
+        if (deferredDigests != NULL &&
+                mzFindZipEntry(pArchive, VERIFY_ON_EXTRACT_MARKER) != NULL) {
+            digestsOk = writeDeferredDigests(deferredDigests, jobs, numJobs);
+            *pDeferred = digestsOk;
+        } else {
+            if (gCancel == NULL) mzPhaseBegin("verify", totalBytes);
+            digestsOk = runDigestJobs(pArchive, jobs, numJobs, totalBytes);
+            if (gCancel == NULL) mzPhaseEnd();
+        }
+    }
+    for (i = 0; i < (unsigned) numJobs; ++i) free(jobs[i].name);
+    free(jobs);
 
     for (i = 0; i < mzZipEntryCount(pArchive) && !unverified[i]; ++i) ;
     free(unverified);
@@ -338,6 +519,8 @@ static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
     // This means we didn't get to the end of the manifest successfully.
     if (line != NULL) return false;
 
+    if (!digestsOk) return false;
+
     if (i < mzZipEntryCount(pArchive)) {
         const ZipEntry *entry = mzGetZipEntryAt(pArchive, i);
         UnterminatedString fn = mzGetZipEntryFileName(entry);
@@ -351,11 +534,152 @@ static bool verifyArchive(const ZipArchive *pArchive, const ZipEntry *mfEntry) {
 
 bool verify_jar_signature(const ZipArchive *pArchive,
         const RSAPublicKey *pKeys, int numKeys) {
+    return verify_jar_signature_deferred(pArchive, pKeys, numKeys, NULL, NULL);
+}
+
+
+bool verify_jar_signature_deferred(const ZipArchive *pArchive,
+        const RSAPublicKey *pKeys, int numKeys,
+        const char *deferredDigests, bool *pDeferred) {
+    bool deferred = false;
+    bool ok = false;
+
     const ZipEntry *sfEntry = verifySignature(pArchive, pKeys, numKeys);
-    if (sfEntry == NULL) return false;
+    if (sfEntry != NULL) {
+        const ZipEntry *mfEntry = verifyManifest(pArchive, sfEntry);
+        if (mfEntry != NULL) {
+            ok = verifyArchive(pArchive, mfEntry, deferredDigests, &deferred);
+        }
+    }
+    if (!ok && deferred) unlink(deferredDigests);
+    if (pDeferred != NULL) *pDeferred = ok && deferred;
+    return ok;
+}
+
+
+/* The whole-file signature lives in the zip comment.  The last six bytes
+ * of the file are a footer:
+ *
+ *     2 bytes  offset of the PKCS#7 signature block from the end of
+ *              the file; the RSA signature is its last RSANUMBYTES
+ *     2 bytes  0xff 0xff
+ *     2 bytes  length of the comment (the footer is its tail)
+ *
+ * The signed data is everything up to, but not including, the comment
+ * length field of the end-of-central-directory record.
+ */
+#define FOOTER_SIZE 6
+#define EOCD_HEADER_SIZE 22
 
-    const ZipEntry *mfEntry = verifyManifest(pArchive, sfEntry);
-    if (mfEntry == NULL) return false;
+int verify_whole_file_signature(const char *path,
+        const RSAPublicKey *pKeys, int numKeys) {
+    int ret = VERIFY_FAILURE;
+    unsigned char *eocd = NULL;
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        LOGE("Can't open %s (%s)\n", path, strerror(errno));
+        return VERIFY_FAILURE;
+    }
+
+    unsigned char footer[FOOTER_SIZE];
+    if (fseek(f, -FOOTER_SIZE, SEEK_END) != 0 ||
+        fread(footer, 1, FOOTER_SIZE, f) != FOOTER_SIZE) {
+        LOGE("Can't read footer of %s\n", path);
+        goto done;
+    }
+    if (footer[2] != 0xff || footer[3] != 0xff) {
+        ret = VERIFY_NO_SIGNATURE;
+        goto done;
+    }
+
+    size_t commentSize = footer[4] | (footer[5] << 8);
+    size_t signatureStart = footer[0] | (footer[1] << 8);
+    if (signatureStart > commentSize ||
+        signatureStart < RSANUMBYTES + FOOTER_SIZE) {
+        LOGE("Bad whole-file signature footer in %s\n", path);
+        goto done;
+    }
+
+    size_t eocdSize = commentSize + EOCD_HEADER_SIZE;
+    eocd = (unsigned char *) malloc(eocdSize);
+    if (eocd == NULL) {
+        LOGE("Can't allocate %d bytes for signature\n", (int) eocdSize);
+        goto done;
+    }
+    if (fseek(f, -(long) eocdSize, SEEK_END) != 0 ||
+        fread(eocd, 1, eocdSize, f) != eocdSize) {
+        LOGE("Can't read signature of %s\n", path);
+        goto done;
+    }
+    long length = ftell(f);
+
+    /* The comment must be the one the zip's EOCD record points at, and
+     * must not contain another EOCD signature that a zip reader could
+     * latch onto instead of the signed one.
+     */
+    if (eocd[0] != 0x50 || eocd[1] != 0x4b ||
+        eocd[2] != 0x05 || eocd[3] != 0x06 ||
+        (size_t) (eocd[20] | (eocd[21] << 8)) != commentSize) {
+        LOGE("Signature length doesn't match EOCD in %s\n", path);
+        goto done;
+    }
+    size_t i;
+    for (i = 4; i + 3 < eocdSize; ++i) {
+        if (eocd[i] == 0x50 && eocd[i+1] == 0x4b &&
+            eocd[i+2] == 0x05 && eocd[i+3] == 0x06) {
+            LOGE("EOCD marker occurs after start of EOCD in %s\n", path);
+            goto done;
+        }
+    }
+
+    /* Hash the signed region in large sequential reads. */
+    long signedLen = length - eocdSize + EOCD_HEADER_SIZE - 2;
+    long doneLen = 0;
+    MzSha1Ctx ctx;
+    mzSha1Init(&ctx);
+    rewind(f);
+    bool quiet = gCancel != NULL;
+    if (!quiet) mzPhaseBegin("verify", signedLen);
+    while (doneLen < signedLen) {
+        unsigned char buf[64 * 1024];
+        if (cancelled()) {
+            LOGI("Verification of %s cancelled\n", path);
+            goto done;
+        }
+        size_t want = sizeof(buf);
+        if ((long) want > signedLen - doneLen) want = signedLen - doneLen;
+        size_t got = fread(buf, 1, want, f);
+        if (got != want) {
+            LOGE("Can't read %s (%s)\n", path, strerror(errno));
+            if (!quiet) mzPhaseEnd();
+            goto done;
+        }
+        mzSha1Update(&ctx, buf, got);
+        doneLen += got;
+        if (!quiet) {
+            mzPhaseAdd(got);
+            ui_set_progress(doneLen * 1.0 / signedLen);
+        }
+    }
+    if (!quiet) mzPhaseEnd();
+    const uint8_t *sha1 = mzSha1Final(&ctx);
+
+    /* signatureStart is where signapk's PKCS#7 block begins; the RSA
+     * signature itself is the block's last RSANUMBYTES, just before the
+     * footer. */
+    const uint8_t *sig = eocd + eocdSize - FOOTER_SIZE - RSANUMBYTES;
+    int j;
+    for (j = 0; j < numKeys; ++j) {
+        if (RSA_verify(&pKeys[j], sig, RSANUMBYTES, sha1)) {
+            LOGI("Whole-file signature verified by key %d\n", j);
+            ret = VERIFY_SUCCESS;
+            goto done;
+        }
+    }
+    LOGE("Whole-file signature didn't verify against any key\n");
 
-    return verifyArchive(pArchive, mfEntry);
+done:
+    free(eocd);
+    fclose(f);
+    return ret;
 }
@@ -27,4 +27,36 @@
 bool verify_jar_signature(const ZipArchive *pArchive,
         const RSAPublicKey *pKeys, int numKeys);
 
+/*
+ * Like verify_jar_signature(), but for packages that opt in by carrying
+ * (and signing) a VERIFY_ON_EXTRACT_MARKER entry, the signature and
+ * manifest are checked now while the per-entry digests are written to
+ * "deferredDigests" for minzip's digest table (minzip/Digests.h).
+ * Each entry is then hashed as it's extracted rather than inflated
+ * once more up front.  *pDeferred says which happened.
+ */
+#define VERIFY_ON_EXTRACT_MARKER "META-INF/com/android/verify-on-extract"
+bool verify_jar_signature_deferred(const ZipArchive *pArchive,
+        const RSAPublicKey *pKeys, int numKeys,
+        const char *deferredDigests, bool *pDeferred);
+
+/*
+ * Check a signature over the raw bytes of the whole package (as applied
+ * by "signapk -w"), stored in the zip comment.  The file is read once,
+ * sequentially, and nothing is inflated.  Returns VERIFY_NO_SIGNATURE
+ * if the package doesn't carry one, so the caller can fall back to
+ * verify_jar_signature().
+ */
+enum { VERIFY_SUCCESS, VERIFY_FAILURE, VERIFY_NO_SIGNATURE };
+int verify_whole_file_signature(const char *path,
+        const RSAPublicKey *pKeys, int numKeys);
+
+/*
+ * While "cancel" is non-NULL, verification runs in the background: it
+ * puts nothing on screen (errors go to the log), and fails as soon as
+ * *cancel becomes nonzero.  Pass NULL to go back to the foreground.
+ * Only one verification may be running at a time.
+ */
+void verify_set_background(const volatile int *cancel);
+
 #endif  /* _RECOVERY_VERIFIER_H */
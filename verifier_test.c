@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Checks verify_whole_file_signature() against the packages in testdata/,
+ * which were signed the way "signapk -w" signs them, with the key below:
+ *
+ *     verifier_test success testdata/otasigned.zip
+ *     verifier_test failure testdata/otasigned-bad.zip
+ *     verifier_test none testdata/unsigned.zip
+ *
+ * Exits with 0 if the package gets the expected result.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "verifier.h"
+
+// The public half of the key testdata/otasigned*.zip are signed with,
+// as dumpkey writes it.
+static const RSAPublicKey test_key =
+    { 64, 0xa9b4bdc5,
+    {
+      0x8c1c46f3, 0xa0b42442, 0x808f4ac9, 0x3bcd6951,
+      0x63cc4d87, 0xf813d0d7, 0x4325f111, 0x15742413,
+      0x6264ad4e, 0xde3421b8, 0x82053602, 0x5ab2c6fe,
+      0x9d8e7ad0, 0x517bd9be, 0x50709de8, 0xd4119f2c,
+      0x5c7bafc0, 0x758dd881, 0x3730a264, 0x16593e38,
+      0x638475b9, 0xda1f520c, 0x0dcd8dcd, 0x4c095438,
+      0x1ae56c59, 0x28635add, 0xed92fb1f, 0xe62d1c9e,
+      0xe11d5707, 0xdee259fc, 0x48fe3c8f, 0xaadac8ec,
+      0x90c151e5, 0x60bb6adb, 0x5f6956dc, 0xaef802b3,
+      0xe725fc38, 0xaacd3148, 0x20101359, 0x524875bc,
+      0x8590935d, 0x76f1b346, 0x2829183f, 0x8cbc2cf3,
+      0xfad3fd73, 0xe4d5d6b2, 0x4e08a7c0, 0xcf754d66,
+      0x2f47ff37, 0x0188be38, 0xd619b1f8, 0x7a8c912d,
+      0xa91aa59a, 0xaf48c918, 0x4de80b97, 0xc2360575,
+      0x794b9ecf, 0x11db11c3, 0xac0b0d6a, 0xfc2086f3,
+      0xe4770e94, 0x398dd18c, 0xb8aa05ac, 0xc2763853
+    },
+    {
+      0x3e998a33, 0xf4b7a8a4, 0xf26cce2f, 0x6cbb9c80,
+      0x66e3d5d5, 0xa3bad0d1, 0xef0a1592, 0x9499db92,
+      0x7a041bcd, 0x0ea15912, 0xc81ea6bb, 0xe2192af0,
+      0xac89b874, 0x011b5a34, 0x55c9ddd2, 0xefad622d,
+      0xd8224657, 0x3e2cb30b, 0x7aaf1d94, 0xd46b2472,
+      0x218e9f83, 0xd88ef3fd, 0x1a59e155, 0xc34338c0,
+      0xfbd2373c, 0x0d0f0783, 0xc856fba4, 0x5baec231,
+      0x2d62ad1e, 0xb44e28e6, 0x51d857ce, 0x253e04ee,
+      0x4276cf28, 0x3014c569, 0xd6a8a752, 0x12680fd8,
+      0xcff10c8c, 0x7eed9747, 0xb1d1970b, 0x7e85fd8e,
+      0x9964555e, 0xe743efde, 0xf88ee4aa, 0x296d2bbb,
+      0x083488f1, 0xd5067ab0, 0xa06f0d4b, 0xe81a8d30,
+      0xf97ddd21, 0x44be1e56, 0x2efdb871, 0xf0afca99,
+      0x320bd08e, 0x4e509ad3, 0x6a5e41ca, 0xafee4f37,
+      0x3c221039, 0xc48bf30a, 0x18986ade, 0x29611dbb,
+      0xc8cda2f9, 0x7bae621d, 0x49efa7b0, 0x28adf60c
+    } }
+;
+
+void ui_print(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+void ui_set_progress(float fraction) {
+}
+
+int main(int argc, char **argv) {
+    static const char* results[] = { "success", "failure", "none" };
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s success|failure|none <package>\n", argv[0]);
+        return 2;
+    }
+
+    int result = verify_whole_file_signature(argv[2], &test_key, 1);
+    printf("%s: %s\n", argv[2], results[result]);
+    return strcmp(results[result], argv[1]) == 0 ? 0 : 1;
+}
@@ -0,0 +1,47 @@
+#!/bin/bash
+#
+# A script for testing the whole-file signature check.  It runs
+# verifier_test on the device against the signed, tampered and unsigned
+# packages in testdata/.  Build verifier_test first.
+
+# where on the device to put the test packages.
+WORK_DIR=/data/local/tmp
+
+ADB="adb -d "
+
+# ------------------------
+
+echo "waiting to connect to device"
+$ADB wait-for-device
+
+# run a command on the device; exit with the exit status of the device
+# command.
+run_command() {
+  $ADB shell "$@" \; echo \$? | awk '{if (b) {print a}; a=$0; b=1} END {exit a}'
+}
+
+testdata=$(dirname $0)/testdata
+
+$ADB push $ANDROID_PRODUCT_OUT/system/bin/verifier_test $WORK_DIR/verifier_test
+for f in otasigned.zip otasigned-bad.zip unsigned.zip; do
+  $ADB push $testdata/$f $WORK_DIR/$f
+done
+
+fail=0
+run_command $WORK_DIR/verifier_test success $WORK_DIR/otasigned.zip || fail=1
+run_command $WORK_DIR/verifier_test failure $WORK_DIR/otasigned-bad.zip || fail=1
+run_command $WORK_DIR/verifier_test none $WORK_DIR/unsigned.zip || fail=1
+
+run_command rm $WORK_DIR/verifier_test $WORK_DIR/otasigned.zip \
+    $WORK_DIR/otasigned-bad.zip $WORK_DIR/unsigned.zip
+
+if [ $fail == 0 ]; then
+  echo
+  echo PASS
+  echo
+else
+  echo
+  echo FAIL
+  echo
+  exit 1
+fi